@@ -0,0 +1,504 @@
+/*
+ * File:     bench.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Throughput and latency benchmark for the sensor emulators.
+ *           Every emulator is started against the slave side of an openpty()
+ *           pair and driven from the master side, exactly as a data logger
+ *           would drive it over a serial cable:
+ *            - poll:       command to first byte and command to end of frame
+ *                          latency percentiles for the emulator's polled command.
+ *            - continuous: frames per second and inter-frame jitter against the
+ *                          configured message interval.
+ *           Both report the emulator's CPU use from /proc/<pid>/stat.
+ *
+ *           One JSON object per line is written to stdout, so results can be
+ *           kept and compared between builds; a readable summary goes to stderr.
+ *
+ * Usage:    bench [--bin=DIR] [--polls=N] [--seconds=S] [emulator ...]
+ *           DIR defaults to bin, N to 200 polls, S to 5 seconds of continuous
+ *           output. With no emulator names every scenario is run.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DEFAULT_POLLS 200
+#define DEFAULT_SECONDS 5.0
+#define STARTUP_MS 400        // Time given to an emulator to open its port and start its threads.
+#define REPLY_TIMEOUT_MS 1000 // A poll without a complete reply in this time counts as a timeout.
+#define MAX_FRAME 65536       // Largest frame collected, a SkyVUE8 profile message is ~10 KB.
+#define MAX_ARGS 12
+
+typedef struct {
+    const char *name;          // Emulator folder, the binary is <bin>/<name>/<name>.
+    const char *data_file;     // Data file replayed.
+    const char *baud;
+    const char *mode;          // RS422 or RS232, a pty has no RS-485 driver.
+    const char *extra_args[3]; // Extra command line arguments, NULL terminated.
+    const char *poll_setup;    // Sent before polling, e.g. to stop continuous output. NULL if none.
+    const char *poll_cmd;      // The polled command, NULL if the emulator is not polled.
+    const char *stream_setup;  // Starts continuous output, NULL if it runs from startup.
+    double interval_s;         // Expected interval between continuous frames, 0 for no continuous test.
+    const char *terminator;    // The bytes every line of a frame ends with.
+    int lines;                 // Terminators per frame, the DSP8100 answers for all three transducers.
+} BenchScenario;
+
+static const BenchScenario scenarios[] = {
+    { "wind", "data_files/wind/wind_data_M.txt", "115200", "RS422", { NULL },
+      "!\r\n", "Q\r\n", "?\r\n", 0.25, "\r\n", 1 },
+    { "ptb330", "data_files/barometric/ptb330_data_24h.txt", "115200", "RS422", { NULL },
+      "SMODE STOP\r", "SEND\r", "INTV 1 s\rR\r", 1.0, "\r\n\r\n", 1 },
+    { "dsp8100", "data_files/barometric/barometric_data.txt", "115200", "RS422", { NULL },
+      "A,0\r\n", "R\r\n", "A,0.1\r\n", 0.1, "\r\n", 3 },
+    { "ceilometer", "data_files/ceilometer/skyvue8_test_data.txt", "115200", "RS232", { NULL },
+      NULL, "POLL 0 1\r\n", NULL, 0.0, "\x04\r\n", 1 },
+    { "btd300", "data_files/flash/24hr_lightning_sensor_data.txt", "115200", "RS422", { "--speed", "10", NULL },
+      NULL, NULL, NULL, 0.2, "\r\n", 1 }, // 2 s message interval at --speed 10.
+};
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+typedef struct {
+    pid_t pid;
+    int master;   // Our side of the pty.
+    int slave;    // Held open so the master never sees a hangup between emulator runs.
+    char slave_name[64];
+} Emulator;
+
+/*
+ * Name:         now_ns
+ * Purpose:      Reads CLOCK_MONOTONIC in nanoseconds.
+ *
+ * Returns:      The time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Name:         cpu_ticks
+ * Purpose:      Reads the user plus system time of a process.
+ * Arguments:    pid: the process.
+ *
+ * Returns:      Clock ticks used so far, 0 if /proc could not be read.
+ * Notes:        The comm field may contain spaces, so parsing starts after the
+ *               last ')' as proc(5) advises.
+ */
+static unsigned long long cpu_ticks(pid_t pid) {
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    char *p = strrchr(buf, ')');
+    unsigned long long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) return 0;
+    return utime + stime;
+}
+
+/*
+ * Name:         start_emulator
+ * Purpose:      Creates a pty pair and starts an emulator on its slave side.
+ * Arguments:    sc: the scenario to run.
+ * 				 bin_dir: directory holding <name>/<name>.
+ * 				 emu: receives the process and the pty.
+ *
+ * Output:       Error message to stderr on failure.
+ * Modifies:     emu.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  The current directory is the repository root, for the data files.
+ *
+ * Bugs:         None known.
+ * Notes:        The slave is put in raw mode before the emulator starts so nothing
+ *               is echoed back before open_serial_port() configures it. The
+ *               emulator's console output is discarded.
+ */
+static int start_emulator(const BenchScenario *sc, const char *bin_dir, Emulator *emu) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", bin_dir, sc->name, sc->name);
+    if (access(path, X_OK) != 0) {
+        fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct termios raw;
+    if (openpty(&emu->master, &emu->slave, emu->slave_name, NULL, NULL) != 0) {
+        fprintf(stderr, "bench: openpty: %s\n", strerror(errno));
+        return -1;
+    }
+    tcgetattr(emu->slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(emu->slave, TCSANOW, &raw);
+    fcntl(emu->master, F_SETFL, fcntl(emu->master, F_GETFL) | O_NONBLOCK);
+
+    const char *argv[MAX_ARGS];
+    int argc = 0;
+    argv[argc++] = path;
+    argv[argc++] = sc->data_file;
+    argv[argc++] = emu->slave_name;
+    argv[argc++] = sc->baud;
+    argv[argc++] = sc->mode;
+    for (int i = 0; sc->extra_args[i] && argc < MAX_ARGS - 1; i++) argv[argc++] = sc->extra_args[i];
+    argv[argc] = NULL;
+
+    emu->pid = fork();
+    if (emu->pid < 0) {
+        fprintf(stderr, "bench: fork: %s\n", strerror(errno));
+        return -1;
+    }
+    if (emu->pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+        }
+        close(emu->master);
+        close(emu->slave);
+        execv(path, (char *const *)argv);
+        _exit(127);
+    }
+
+    usleep(STARTUP_MS * 1000);
+    int status;
+    if (waitpid(emu->pid, &status, WNOHANG) == emu->pid) {
+        fprintf(stderr, "bench: %s exited during startup (status %d)\n", sc->name, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        emu->pid = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         stop_emulator
+ * Purpose:      Stops an emulator with SIGTERM and releases its pty.
+ * Arguments:    emu: the emulator.
+ *
+ * Returns:      None.
+ * Notes:        SIGKILL follows if the emulator has not exited within a second.
+ */
+static void stop_emulator(Emulator *emu) {
+    if (emu->pid > 0) {
+        kill(emu->pid, SIGTERM);
+        for (int i = 0; i < 100; i++) {
+            if (waitpid(emu->pid, NULL, WNOHANG) == emu->pid) {
+                emu->pid = -1;
+                break;
+            }
+            usleep(10000);
+        }
+        if (emu->pid > 0) {
+            kill(emu->pid, SIGKILL);
+            waitpid(emu->pid, NULL, 0);
+        }
+    }
+    close(emu->master);
+    close(emu->slave);
+}
+
+/*
+ * Name:         drain
+ * Purpose:      Discards input until the line has been quiet for quiet_ms.
+ * Arguments:    fd: the pty master.
+ * 				 quiet_ms: how long the line must be idle.
+ *
+ * Returns:      None.
+ */
+static void drain(int fd, int quiet_ms) {
+    char buf[4096];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (poll(&pfd, 1, quiet_ms) > 0) {
+        if (read(fd, buf, sizeof(buf)) <= 0) break;
+    }
+}
+
+static void send_cmd(int fd, const char *cmd) {
+    size_t len = strlen(cmd);
+    while (len > 0) {
+        ssize_t n = write(fd, cmd, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return;
+        }
+        cmd += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * Name:         read_frame
+ * Purpose:      Reads until one frame, lines terminators, has been received.
+ * Arguments:    fd: the pty master.
+ * 				 sc: the scenario, gives the terminator and lines per frame.
+ * 				 deadline: CLOCK_MONOTONIC time to give up at.
+ * 				 first_ns: receives the arrival time of the first byte, 0 if none.
+ * 				 end_ns: receives the arrival time of the terminator, 0 if none.
+ *
+ * Output:       None.
+ * Modifies:     first_ns, end_ns.
+ * Returns:      true if a complete frame arrived before the deadline.
+ * Assumptions:  No other output is in flight, see drain().
+ *
+ * Bugs:         None known.
+ * Notes:        Bytes are read one poll() wake-up at a time so the first byte
+ *               time is as close to its arrival as the scheduler allows.
+ */
+static bool read_frame(int fd, const BenchScenario *sc, uint64_t deadline, uint64_t *first_ns, uint64_t *end_ns) {
+    static char buf[MAX_FRAME];
+    size_t len = 0;
+    size_t scanned = 0; // Bytes already searched for a terminator.
+    int seen = 0;
+    size_t term_len = strlen(sc->terminator);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    *first_ns = *end_ns = 0;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= deadline) return false;
+        int ms = (int)((deadline - now) / 1000000ULL) + 1;
+        if (poll(&pfd, 1, ms) <= 0) continue;
+
+        ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+        if (n <= 0) continue;
+        uint64_t t = now_ns();
+        if (len == 0) *first_ns = t;
+        len += (size_t)n;
+
+        while (scanned + term_len <= len) {
+            if (memcmp(buf + scanned, sc->terminator, term_len) == 0) {
+                scanned += term_len;
+                if (++seen == sc->lines) {
+                    *end_ns = t;
+                    return true;
+                }
+            } else {
+                scanned++;
+            }
+        }
+        if (len == sizeof(buf)) len = scanned = 0; // Runaway output, keep looking for the terminator.
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Name:         percentile_us
+ * Purpose:      Nearest-rank percentile of a sorted array, in microseconds.
+ * Arguments:    v: values in nanoseconds, sorted ascending.
+ * 				 n: number of values.
+ * 				 q: the percentile, 0.0-1.0.
+ *
+ * Returns:      The percentile in microseconds, 0 for an empty array.
+ */
+static double percentile_us(const uint64_t *v, size_t n, double q) {
+    if (n == 0) return 0.0;
+    size_t idx = (size_t)(q * (double)(n - 1) + 0.5);
+    return (double)v[idx] / 1000.0;
+}
+
+static double cpu_percent(unsigned long long ticks, uint64_t wall_ns) {
+    if (wall_ns == 0) return 0.0;
+    return 100.0 * ((double)ticks / (double)sysconf(_SC_CLK_TCK)) / ((double)wall_ns / 1e9);
+}
+
+/*
+ * Name:         bench_poll
+ * Purpose:      Measures polled command latency.
+ * Arguments:    sc: the scenario.
+ * 				 emu: the running emulator.
+ * 				 polls: number of commands to send.
+ *
+ * Output:       One JSON line on stdout, a summary on stderr.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  The emulator has been started.
+ *
+ * Bugs:         None known.
+ * Notes:        Each command waits for the previous reply, so this is latency
+ *               under no load rather than throughput.
+ */
+static void bench_poll(const BenchScenario *sc, Emulator *emu, int polls) {
+    uint64_t *first = calloc((size_t)polls, sizeof(uint64_t));
+    uint64_t *whole = calloc((size_t)polls, sizeof(uint64_t));
+    if (!first || !whole) {
+        free(first);
+        free(whole);
+        return;
+    }
+
+    if (sc->poll_setup) send_cmd(emu->master, sc->poll_setup);
+    drain(emu->master, 100);
+
+    size_t ok = 0;
+    int timeouts = 0;
+    unsigned long long cpu0 = cpu_ticks(emu->pid);
+    uint64_t t_start = now_ns();
+
+    for (int i = 0; i < polls; i++) {
+        uint64_t t0 = now_ns();
+        send_cmd(emu->master, sc->poll_cmd);
+        uint64_t f, e;
+        if (read_frame(emu->master, sc, t0 + REPLY_TIMEOUT_MS * 1000000ULL, &f, &e)) {
+            first[ok] = f - t0;
+            whole[ok] = e - t0;
+            ok++;
+        } else {
+            timeouts++;
+            drain(emu->master, 50);
+        }
+    }
+
+    uint64_t wall = now_ns() - t_start;
+    double cpu = cpu_percent(cpu_ticks(emu->pid) - cpu0, wall);
+    qsort(first, ok, sizeof(uint64_t), cmp_u64);
+    qsort(whole, ok, sizeof(uint64_t), cmp_u64);
+
+    printf("{\"emulator\":\"%s\",\"test\":\"poll\",\"samples\":%zu,\"timeouts\":%d,"
+           "\"first_byte_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+           "\"frame_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},\"cpu_pct\":%.2f}\n",
+           sc->name, ok, timeouts,
+           percentile_us(first, ok, 0.50), percentile_us(first, ok, 0.90), percentile_us(first, ok, 0.99), percentile_us(first, ok, 1.0),
+           percentile_us(whole, ok, 0.50), percentile_us(whole, ok, 0.90), percentile_us(whole, ok, 0.99), percentile_us(whole, ok, 1.0),
+           cpu);
+    fprintf(stderr, "%-10s poll        %4zu ok %3d timeouts  first byte p50 %8.1f us p99 %8.1f us  frame p99 %8.1f us  cpu %5.2f%%\n",
+            sc->name, ok, timeouts, percentile_us(first, ok, 0.50), percentile_us(first, ok, 0.99),
+            percentile_us(whole, ok, 0.99), cpu);
+    fflush(stdout);
+    free(first);
+    free(whole);
+}
+
+/*
+ * Name:         bench_continuous
+ * Purpose:      Measures continuous output rate and interval jitter.
+ * Arguments:    sc: the scenario.
+ * 				 emu: the running emulator.
+ * 				 seconds: how long to collect frames for.
+ *
+ * Output:       One JSON line on stdout, a summary on stderr.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  The emulator has been started.
+ *
+ * Bugs:         None known.
+ * Notes:        Jitter is |actual interval - configured interval| between the
+ *               first bytes of consecutive frames.
+ */
+static void bench_continuous(const BenchScenario *sc, Emulator *emu, double seconds) {
+    size_t cap = (size_t)(seconds / sc->interval_s * 2.0) + 16;
+    uint64_t *arrivals = calloc(cap, sizeof(uint64_t));
+    uint64_t *jitter = calloc(cap, sizeof(uint64_t));
+    if (!arrivals || !jitter) {
+        free(arrivals);
+        free(jitter);
+        return;
+    }
+
+    if (sc->stream_setup) send_cmd(emu->master, sc->stream_setup);
+    // Skip replies to the setup and the first, partially timed, frame.
+    uint64_t f, e;
+    drain(emu->master, 20);
+    read_frame(emu->master, sc, now_ns() + (uint64_t)(sc->interval_s * 3e9) + REPLY_TIMEOUT_MS * 1000000ULL, &f, &e);
+
+    size_t frames = 0;
+    unsigned long long cpu0 = cpu_ticks(emu->pid);
+    uint64_t t_start = now_ns();
+    uint64_t t_end = t_start + (uint64_t)(seconds * 1e9);
+    while (frames < cap && read_frame(emu->master, sc, t_end, &f, &e)) arrivals[frames++] = f;
+    uint64_t wall = now_ns() - t_start;
+    double cpu = cpu_percent(cpu_ticks(emu->pid) - cpu0, wall);
+
+    uint64_t expected = (uint64_t)(sc->interval_s * 1e9);
+    uint64_t sum = 0;
+    size_t n = frames > 1 ? frames - 1 : 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t d = arrivals[i + 1] - arrivals[i];
+        sum += d;
+        jitter[i] = d > expected ? d - expected : expected - d;
+    }
+    qsort(jitter, n, sizeof(uint64_t), cmp_u64);
+    double mean_us = n ? (double)sum / (double)n / 1000.0 : 0.0;
+    double fps = wall ? (double)frames / ((double)wall / 1e9) : 0.0;
+
+    printf("{\"emulator\":\"%s\",\"test\":\"continuous\",\"seconds\":%.2f,\"frames\":%zu,\"fps\":%.3f,"
+           "\"interval_us\":{\"expected\":%.1f,\"mean\":%.1f},"
+           "\"jitter_us\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f},\"cpu_pct\":%.2f}\n",
+           sc->name, (double)wall / 1e9, frames, fps, (double)expected / 1000.0, mean_us,
+           percentile_us(jitter, n, 0.50), percentile_us(jitter, n, 0.99), percentile_us(jitter, n, 1.0), cpu);
+    fprintf(stderr, "%-10s continuous  %4zu frames %7.2f fps  interval %9.1f us (expect %9.1f)  jitter p99 %8.1f us  cpu %5.2f%%\n",
+            sc->name, frames, fps, mean_us, (double)expected / 1000.0, percentile_us(jitter, n, 0.99), cpu);
+    fflush(stdout);
+    free(arrivals);
+    free(jitter);
+}
+
+static bool selected(const char *name, int argc, char **argv) {
+    bool any = false;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) continue;
+        any = true;
+        if (strcmp(argv[i], name) == 0) return true;
+    }
+    return !any;
+}
+
+int main(int argc, char *argv[]) {
+    const char *bin_dir = "bin";
+    int polls = DEFAULT_POLLS;
+    double seconds = DEFAULT_SECONDS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--bin=", 6) == 0) bin_dir = argv[i] + 6;
+        else if (strncmp(argv[i], "--polls=", 8) == 0) polls = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--seconds=", 10) == 0) seconds = atof(argv[i] + 10);
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Usage: %s [--bin=DIR] [--polls=N] [--seconds=S] [emulator ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (polls < 1) polls = 1;
+    if (seconds <= 0.0) seconds = DEFAULT_SECONDS;
+
+    signal(SIGPIPE, SIG_IGN);
+    int failures = 0;
+    for (size_t i = 0; i < SCENARIO_COUNT; i++) {
+        const BenchScenario *sc = &scenarios[i];
+        if (!selected(sc->name, argc, argv)) continue;
+
+        Emulator emu = { .pid = -1, .master = -1, .slave = -1 };
+        if (start_emulator(sc, bin_dir, &emu) != 0) {
+            printf("{\"emulator\":\"%s\",\"test\":\"start\",\"error\":true}\n", sc->name);
+            if (emu.master >= 0) stop_emulator(&emu);
+            failures++;
+            continue;
+        }
+        if (sc->interval_s > 0.0) bench_continuous(sc, &emu, seconds);
+        if (sc->poll_cmd) bench_poll(sc, &emu, polls);
+        stop_emulator(&emu);
+    }
+    return failures ? 1 : 0;
+}
@@ -44,6 +44,7 @@
  * Usage:    use case ' flash <file_path> <serial_port_location> <baud_rate> <RS422|RS485> The serial port currently must match /dev/tty(S|USB)[0-9]+
  * 	         use case ' flash <file_path> // The serial port, baud rate, and mode will be set to  defaults /dev/ttyUSB0, and B9600
  *			 use case ' flash <(socat - TCP:lightningdata.com:8080,forever,intervall=10) <serial_port_location> <baud_rate> <RS422|RS485> // in the event we use external data
+ *			 use case ' flash - <serial_port_location> <baud_rate> <RS422|RS485> --storm SEED [--storm-rate N] [--storm-cells N] // generated storm, no data file
  *           Serial port must match pattern: /dev/tty(S|USB)[0-9]+
  *
  * Sensor:   Biral BTD-300 Thunderstorm Detector
@@ -64,7 +65,25 @@
  *           - Default baud rate: 9600
  *           - Optional relay outputs (3x) for warning/alert/severe alert
  *
- * Mods:
+ * Mods:     14/10/2026 The sender works from a seqlock snapshot of sensor_one and no
+ *                      longer shares sensor_mutex with command handling.
+ *           14/10/2026 The sender runs on a SendSchedule, deadlines follow the
+ *                      last deadline rather than the end of the last send.
+ *           14/10/2026 --storm generates the flashes with the storm engine instead
+ *                      of reading a data file.
+ *           14/10/2026 Commands are matched by command_lookup().
+ *           14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ *                      wait metrics on a UNIX socket.
+ *           14/10/2026 --live reads a pipe, FIFO or udp:// source ahead of the
+ *                      sender, parsed records come out of a lock-free ring.
+ *           14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 A data file of wxstate://NAME reports the flashes of the
+ *                      shared weather state's storm, see wxstate/.
  *
  */
 
@@ -84,15 +103,22 @@
 #include <poll.h>
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "btd300_utils.h"
-
+#include "seqlock_utils.h"
+#include "schedule_utils.h"
+#include "storm_utils.h"
+#include "command_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+
+#define DATA_PERIOD_MS 2000 // BTD-300 data files are recorded every 2 seconds, each line carries its own time.
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B9600	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 #define MAX_CMD_LENGTH 256
 #define MAX_MSG_LENGTH 512
-#define CPU_WAIT_USEC 10000
 
 #define DEBUG_MODE // Comment this line out to disable all debug prints
 
@@ -103,7 +129,7 @@
 #endif
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -116,10 +142,23 @@ const char *program_name = "unknown";
 // This needs to be freed upon exit.
 BTD300_sensor *sensor_one = NULL; // Global pointer to struct for skyvue8 sensor .
 
+/*
+ * sensor_one belongs to the receiver thread. After each command it is published to
+ * sensor_shared, and the sender takes snapshots of that copy through sensor_lock.
+ * sensor_mutex only guards terminate; the sender sleeps on sender_sched.
+ */
+static BTD300_sensor sensor_shared;
+static SeqLock sensor_lock = SEQLOCK_INITIALIZER;
+
+// --storm: the engine and its output belong to the sender thread.
+static StormConfig storm_cfg;
+static StormEngine storm;
+static StormFlash storm_flashes[STORM_MAX_STEP_FLASHES];
+static uint64_t state_flashes_seen = WXSTATE_FLASHES_NEW; // wxstate:// cursor, sender thread only.
+
 // Synchronization primitives
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // RUN mode deadlines, woken by publish_sensor().
 
 // Global pointers to receiver and sender threads.
 pthread_t recv_thread, send_thread, sig_thread;
@@ -128,7 +167,6 @@ bool recv_thread_created = false;
 bool sig_thread_created = false;
 bool send_thread_created = false;
 
-bool sensor_cond_init = false;
 /**
  * Name:         cleanup_and_exit
  * Purpose:      helper function to cleanup sensors, and arrays.
@@ -145,8 +183,8 @@ bool sensor_cond_init = false;
 void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex);
     terminate = 1;
-	if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
     pthread_mutex_unlock(&sensor_mutex);
+	schedule_wake(&sender_sched);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -156,6 +194,12 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
+		if (storm_cfg.enabled) {
+			safe_console_print("%s: storm seed %llu, %llu flashes in %.0f s, %llu past the step limit\n", program_name,
+							   (unsigned long long)storm_cfg.seed, (unsigned long long)storm.flashes, storm.time_s,
+							   (unsigned long long)storm.dropped);
+		}
     }
 
     if (sig_thread_created) {
@@ -165,13 +209,14 @@ void cleanup_and_exit(int exit_code) {
     }
 
 	pthread_mutex_destroy(&sensor_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
+    schedule_destroy(&sender_sched);
 
     if (sensor_one) free(sensor_one);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -200,99 +245,106 @@ void cleanup_and_exit(int exit_code) {
  *               Ensures string fields (METAR, BLM) are safely null-terminated.
  */
 void parse_message(char *msg, ParsedMessage *p_message) {
-	memset(p_message, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
-	char *saveptr; // Our place keeper in the msg string.
-	char *token; // Where we temporarily store each token.
-	char temp_date_holder[DATE_STRING];
-	char temp_time_holder[TIME_STRING];
-	// These are pulled from a text file in this format:
-	// DATA:,01,131125,142809,0,0,00,OOOOO,000000,000000,000,00000,000,000000,000000,000,00000,000,000000,000000,000,00000,000,000000,000000,000,00000,000
-	if ((token = strtok_r(msg, ",", &saveptr))) {
-        strncpy(p_message->data_header, token, MAX_HEADER_STR - 1); // Capture the message header 'DATA:' ** We could discard this.
-        p_message->data_header[MAX_HEADER_STR - 1] = '\0';
-    }
-   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
-   	if ((token = NEXT_T)) p_message->site_id = (uint8_t)atoi(token); // Set site ID.
-   	if ((token = NEXT_T)) {
-		strncpy(temp_date_holder, token, DATE_STRING - 1);
-		temp_date_holder[DATE_STRING - 1] = '\0';
+	BTD300_parse_message(msg, p_message);
+}
+
+/*
+ * Name:         live_parse
+ * Purpose:      Parses a --live line into a record, as wxb_convert does.
+ * Arguments:    line: the line, modified by the parse.
+ * 				 record: the ParsedMessage to fill.
+ *
+ * Output:       None.
+ * Modifies:     record, line.
+ * Returns:      None.
+ * Assumptions:  Called on the live feed's ingestion thread.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void live_parse(char *line, void *record) {
+	BTD300_parse_message(line, record);
+}
+
+/*
+ * Name:         next_message
+ * Purpose:      Fetches the next record to send from the data file, the storm engine or the shared state.
+ * Arguments:    p_message: pointer to the struct where the record will be stored.
+ * 				 cfg: the sender's snapshot of sensor_one.
+ *
+ * Output:       None.
+ * Modifies:     p_message, advances the replay cursor or the storm.
+ * Returns:      true if a record was stored, false if the data file has no line available.
+ * Assumptions:  replay_src has been opened and checked with replay_check_records(),
+ *               or --storm was given. Called from the sender thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        A .wxb cache made by wxb_convert is copied out record by record,
+ *               as is a --live record, a text file is read a line at a time and parsed. A storm is
+ *               advanced by one message interval (DATA_PERIOD_MS when polled or
+ *               back to back), so a seed gives the same messages at any --speed.
+ *               A wxstate:// source reports the flashes its producer published
+ *               since the last message, the same way as a storm step.
+ */
+bool next_message(ParsedMessage *p_message, const BTD300_sensor *cfg) {
+	if (storm_cfg.enabled) {
+		double step_s = cfg->message_interval ? (double)cfg->message_interval : DATA_PERIOD_MS / 1000.0;
+		size_t n = storm_step(&storm, step_s, storm_flashes, STORM_MAX_STEP_FLASHES);
+		BTD300_storm_message(cfg, storm_flashes, n, storm.time_s, p_message);
+		return true;
+	}
+	const WxStateView *state = replay_state(replay_src);
+	if (state) {
+		WxState snapshot;
+		if (!wxstate_read(state, &snapshot)) return false;
+		size_t n = wxstate_flashes(&snapshot, &state_flashes_seen, storm_flashes, STORM_MAX_STEP_FLASHES);
+		BTD300_storm_message(cfg, storm_flashes, n, snapshot.storm_time_s, p_message);
+		return true;
 	}
-	if ((token = NEXT_T)) {
-		strncpy(temp_time_holder, token, TIME_STRING - 1);
-		temp_time_holder[TIME_STRING - 1] = '\0';
-   	}
-	// HANDLE EPOCH CONVERSION
-	p_message->original_epoch = parse_to_epoch(temp_date_holder, temp_time_holder);
-	if ((token = NEXT_T)) p_message->number_of_flashes = (uint8_t)atoi(token); // Number of Flashes in the message string.
-   	if ((token = NEXT_T)) p_message->warning_indicator = (uint8_t)atoi(token); // Warning Indicator.
-   	if ((token = NEXT_T)) p_message->warning_flags = (uint8_t)atoi(token); // Warning Indicator.
-	if ((token = NEXT_T)) {
-		strncpy(p_message->self_test_flags, token, MAX_SELF_TEST_FLAG - 1); // Set the Self Test Flags.
-		p_message->self_test_flags[MAX_SELF_TEST_FLAG - 1] = '\0';
+	const void *record = replay_next_record(replay_src);
+	if (record) {
+		memcpy(p_message, record, sizeof(ParsedMessage));
+		return true;
 	}
+	char line[REPLAY_LINE_MAX];
+	if (replay_next_line(replay_src, line, sizeof(line)) == 0) return false;
+	parse_message(line, p_message);
+	return true;
+}
 
-	if (p_message->number_of_flashes != 0) { // The rest of the string is all zeros, if the number of flashes is zero.
-		// FLASH ONE
-	   	if ((token = NEXT_T)) {
-			strncpy(temp_date_holder, token, DATE_STRING - 1);
-			temp_date_holder[DATE_STRING - 1] = '\0';
-		}
-		if ((token = NEXT_T)) {
-			strncpy(temp_time_holder, token, TIME_STRING - 1);
-			temp_time_holder[TIME_STRING - 1] = '\0';
-	   	}
-		p_message->flash_epoch_array[0] = parse_to_epoch(temp_date_holder, temp_time_holder);
-		if ((token = NEXT_T)) p_message->time_since_flash_one = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash one.
-	   	if ((token = NEXT_T)) p_message->distance_of_flash_one = (uint16_t)atoi(token); // Distance of Flash one.
-	   	if ((token = NEXT_T)) p_message->direction_of_flash_one = (uint16_t)atoi(token); // Direction of Flash one.
-
-		if (p_message->number_of_flashes < 2) goto end_flashes; // Jump to the end if the rest of the string is zeros.
-		// FLASH TWO
-	   	if ((token = NEXT_T)) {
-			strncpy(temp_date_holder, token, DATE_STRING - 1);
-			temp_date_holder[DATE_STRING - 1] = '\0';
-		}
-		if ((token = NEXT_T)) {
-			strncpy(temp_time_holder, token, TIME_STRING - 1);
-			temp_time_holder[TIME_STRING - 1] = '\0';
-		}
-		p_message->flash_epoch_array[1] = parse_to_epoch(temp_date_holder, temp_time_holder);
-	   	if ((token = NEXT_T)) p_message->time_since_flash_two = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash two.
-	   	if ((token = NEXT_T)) p_message->distance_of_flash_two = (uint16_t)atoi(token); // Distance of Flash two.
-	   	if ((token = NEXT_T)) p_message->direction_of_flash_two = (uint16_t)atoi(token); // Direction of Flash two.
-
-		if (p_message->number_of_flashes < 3) goto end_flashes; // Jump to the end if the rest of the string is zeros.
-		// FLASH THREE
-   		if ((token = NEXT_T)) {
-			strncpy(temp_date_holder, token, DATE_STRING - 1);
-			temp_date_holder[DATE_STRING - 1] = '\0';
-		}
-		if ((token = NEXT_T)) {
-			strncpy(temp_time_holder, token, TIME_STRING - 1);
-			temp_time_holder[TIME_STRING - 1] = '\0';
-		}
-		p_message->flash_epoch_array[2] = parse_to_epoch(temp_date_holder, temp_time_holder);
-   		if ((token = NEXT_T)) p_message->time_since_flash_three = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash three.
-   		if ((token = NEXT_T)) p_message->distance_of_flash_three = (uint16_t)atoi(token); // Distance of Flash three.
-   		if ((token = NEXT_T)) p_message->direction_of_flash_three = (uint16_t)atoi(token); // Direction of Flash three.
-
-		if (p_message->number_of_flashes < 4) goto end_flashes; // Jump to the end if the rest of the string is zeros.
-		// FLASH FOUR
-	   	if ((token = NEXT_T)) {
-			strncpy(temp_date_holder, token, DATE_STRING - 1);
-			temp_date_holder[DATE_STRING - 1] = '\0';
-		}
-		if ((token = NEXT_T)) {
-			strncpy(temp_time_holder, token, TIME_STRING - 1);
-			temp_time_holder[TIME_STRING - 1] = '\0';
-		}
-		p_message->flash_epoch_array[3] = parse_to_epoch(temp_date_holder, temp_time_holder);
-		if ((token = NEXT_T)) p_message->time_since_flash_four = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash four.
-	   	if ((token = NEXT_T)) p_message->distance_of_flash_four = (uint16_t)atoi(token); // Distance of Flash four.
-	   	if ((token = NEXT_T)) p_message->direction_of_flash_four = (uint16_t)atoi(token); // Direction of Flash four.
+/*
+ * Name:         record_time
+ * Purpose:      Reads the recorded time of a data file entry for the --start/--end index.
+ * Arguments:    item: a text line, or a ParsedMessage record of a .wxb cache.
+ * 				 len: the length of item.
+ * 				 is_record: true if item is a record.
+ * 				 time_ms: receives the UTC time in milliseconds since the epoch.
+ *
+ * Output:       None.
+ * Modifies:     time_ms.
+ * Returns:      true if the entry carries a time.
+ * Assumptions:  Lines follow DATA:,<site>,<DDMMYY>,<HHMMSS>,...
+ *
+ * Bugs:         None known.
+ * Notes:        Only the header time is read, flashes are not parsed.
+ */
+bool record_time(const void *item, size_t len, bool is_record, int64_t *time_ms) {
+	if (is_record) {
+		*time_ms = (int64_t)((const ParsedMessage *)item)->original_epoch * 1000;
+		return true;
 	}
-	end_flashes:
-	#undef NEXT_T
+	char head[64];
+	if (len > sizeof(head) - 1) len = sizeof(head) - 1;
+	memcpy(head, item, len);
+	head[len] = '\0';
+
+	char date[DATE_STRING];
+	char clock[TIME_STRING];
+	if (sscanf(head, "%*[^,],%*[^,],%6[0-9],%6[0-9]", date, clock) != 2 || strlen(date) != 6 || strlen(clock) != 6) return false;
+	time_t t = parse_to_epoch(date, clock);
+	if (t == (time_t)-1) return false;
+	*time_ms = (int64_t)t * 1000;
+	return true;
 }
 
 /*
@@ -362,6 +414,9 @@ void process_and_send(ParsedMessage *msg) {
 									msg->direction_of_flash_four);	// Direction in degrees of Flash 4
 }
 
+// Built into a trie from cmd_table[] on the first command.
+static CommandDispatch dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_ALNUM | CMD_TERM_QUERY);
+
 /*
  * Name:         parse_command
  * Purpose:      Translates a received string to command enum.
@@ -374,40 +429,22 @@ void process_and_send(ParsedMessage *msg) {
  * Assumptions:  The string recieved is a string and should be able to translate to one of the commands.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The keyword is matched by command_lookup() on dispatch.
  */
 CommandType parse_command(const char *buf, ParsedCommand *cmd) {
     if (buf == NULL || cmd == NULL) return CMD_UNKNOWN;
 
 	memset(cmd, 0, sizeof(ParsedCommand)); // zero out the contents of our ParsedCommand
-    const char *ptr = buf;
-
-	while (*ptr && isspace((unsigned char)*ptr)) ptr++; // Skip any leading whitespace.
-
-    for (size_t i = 0; i < CMD_TABLE_SIZE; i++) {
-
-        if (strncasecmp(ptr, cmd_table[i].name, cmd_table[i].len) == 0) {
-            // Ensure exact match (don't match "R" if the command is "RESET")
-            char next = ptr[cmd_table[i].len];
-            if (next == '\0' || isalnum((unsigned char)next) || next == '?') { // If the command is terminated, or has additional text. !! Excludes \t \n \r
-				cmd->type = cmd_table[i].type;
-                ptr += cmd_table[i].len; // Jump past command
-                // Skip any spaces to point at arguments
-                while (*ptr && isspace((unsigned char)*ptr)) ptr++;
-
-				size_t param_len = strcspn(ptr, "\n\r"); // Get the size of the string, up to the \n \r
-				if (param_len > sizeof(cmd->raw_params) - 1) { // Truncate if the remaining string is larger than our raw_params char*.
-    				param_len = sizeof(cmd->raw_params) - 1;
-				}
-
-				strncpy(cmd->raw_params, ptr, param_len);
-				cmd->raw_params[param_len] = '\0'; // Always null-terminate
-                return cmd->type;
-            }
-        }
+
+    const char *args;
+    const CommandMap *m = command_lookup(&dispatch, buf, &args);
+    if (m == NULL) {
+        cmd->type = CMD_UNKNOWN;
+        return CMD_UNKNOWN;
     }
-    cmd->type = CMD_UNKNOWN;
-    return CMD_UNKNOWN;
+    cmd->type = (CommandType)m->type;
+    command_copy_params(args, cmd->raw_params, sizeof(cmd->raw_params)); // Up to the \n \r, truncated to fit.
+    return cmd->type;
 }
 
 
@@ -433,7 +470,6 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 				safe_serial_write(serial_fd, "%s\r\n", "COMMAND NOT ALLOWED");
 			} else {
 				sensor_one->mode = SMODE_RUN;
-				pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
 			}
 			break;
 		case CMD_STOP:
@@ -442,7 +478,6 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 				safe_serial_write(serial_fd, "%s\r\n", "COMMAND NOT ALLOWED");
 			} else {
 				sensor_one->mode = SMODE_STOP;
-				pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
 			}
 			break;
 		case CMD_SITE:
@@ -526,18 +561,64 @@ void* signal_thread(void* arg) {
     terminate = 1;
     kill_flag = 1;
 
-    // Now safely wake any threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    // Now safely wake the sender
+    schedule_wake(&sender_sched);
 
     return NULL;
 }
 
+/*
+ * Name:         publish_sensor
+ * Purpose:      Publishes sensor_one to the sender thread, and wakes it if anything changed.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     sensor_shared, sensor_lock.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Queries such as SITE and SN change nothing and are not published.
+ * 				 The wake is remembered by sender_sched until the sender next
+ * 				 waits, so a change is never missed.
+ */
+static void publish_sensor(void) {
+	if (memcmp(&sensor_shared, sensor_one, sizeof(sensor_shared)) == 0) return;
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared));
+	schedule_wake(&sender_sched); // Wake our sender thread, to check if our mode has changed.
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command(), then publishes the result.
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+
+    handle_command(cmd_type, &local_cmd); // handle received command here, sensor_one is ours.
+
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    publish_sensor();
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -547,47 +628,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    	if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0'; // Terminate with NULL for safety.
-
-                    ParsedCommand local_cmd;
-                    CommandType cmd_type = parse_command(line, &local_cmd);
-
-					pthread_mutex_lock(&sensor_mutex);   // <--- LOCK HERE
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    pthread_mutex_unlock(&sensor_mutex); // <--- UNLOCK HERE
-                    len = 0;
-                } else { // empty line ignore
-                }
-            } else {
-              	  if (len < sizeof(line)-1) {
-				      line[len++] = c;
-                  } else {
-                    	len = 0;
-                  }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(CPU_WAIT_USEC);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -596,60 +646,39 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Sends on sender_sched deadlines, each one the previous deadline
+ * 				 plus the interval, so the time taken to send never adds up as drift.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec ts;
-	bool should_send = false;
-	int interval = 0;
+	BTD300_sensor cfg; // Snapshot of sensor_one, private to this thread.
+	seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
 
     while (!terminate) {
-        pthread_mutex_lock(&sensor_mutex);
-
-		// Determine if we should wait for a specific time or indefinitely
-        if (sensor_one != NULL && sensor_one->mode == SMODE_RUN) {
-			interval = sensor_one->message_interval; // If we are in polled mode, message_interval is zero.
-            // Calculate absolute time: Last Send Time + Interval
-            // Use current REALTIME + (Interval - Time Since Last Send)
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            // Add the continuous interval (in seconds) to the current time
-            ts.tv_sec += interval;
-            // Wait until that specific second arrives OR a signal interrupts us
-            pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-        } else {
-            // If in Polling/Stop Mode, wait indefinitely for a signal from the receiver
-            pthread_cond_wait(&sensor_cond, &sensor_mutex);
-        }
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
-            break;
-        }
-
-        // is_ready_to_send() handles the interval and timing logic internally, and checks if the sensor is Pollling or Continuous.
-        should_send = (sensor_one != NULL && BTD300_is_ready_to_send(sensor_one));
+		if (cfg.mode == SMODE_RUN) {
+			// Keeps its phase while the interval is unchanged, an interval of 0 sends back to back.
+			schedule_start(&sender_sched, (uint64_t)cfg.message_interval * SCHED_NS_PER_SEC);
+		} else {
+			// If in Polling/Stop Mode, wait indefinitely for the receiver to publish a change.
+			schedule_stop(&sender_sched);
+		}
 
-		pthread_mutex_unlock(&sensor_mutex);  // <-- UNLOCK BEFORE I/O
+		ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+		if (event == SCHEDULE_ERROR) {
+			safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
+			break;
+		}
+		if (event == SCHEDULE_WOKEN) {
+			seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg)); // The receiver has published since.
+			continue;
+		}
 
         // Do I/O operations WITHOUT holding the mutex
-        if (should_send) {
-            char *line = get_next_line_copy(file_ptr, &file_mutex);
-            if (line) {
-                ParsedMessage local_msg;  // LOCAL, not global
-                parse_message(line, &local_msg);
-                process_and_send(&local_msg);
-                fflush(NULL);  // Flush all output streams
-                free(line);
-                line = NULL;
-            }
-
-            // Update timestamp with lock
-            pthread_mutex_lock(&sensor_mutex);
-            if (sensor_one != NULL) {
-                clock_gettime(CLOCK_MONOTONIC, &sensor_one->last_send_time);
-            }
-            pthread_mutex_unlock(&sensor_mutex);
+        ParsedMessage local_msg;  // LOCAL, not global
+        if (next_message(&local_msg, &cfg)) {
+            process_and_send(&local_msg);
+            fflush(NULL);  // Flush all output streams
         }
     }
     return NULL;
@@ -680,18 +709,39 @@ void* sender_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    ReplayOptions replay_opts;
+    if (replay_parse_options(&argc, argv, &replay_opts) != 0) cleanup_and_exit(1); // Strips --start/--end/--speed/--live.
+    if (storm_parse_options(&argc, argv, &storm_cfg) != 0) cleanup_and_exit(1); // Strips --storm*.
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path|-> <serial_device> <baud_rate> <RS422|RS485> [--start T] [--end T] [--speed N|max] [--live[=latest|block|repeat]] [--live-depth N] [--storm SEED] [--metrics PATH] [--capture PATH]\n", argv[0]);
         return 1;
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
-        safe_console_error("Failed to open file: %s\n", strerror(errno));
-		cleanup_and_exit(1);
-    }
+    if (storm_cfg.enabled) { // The data file argument is not read.
+		if (replay_opts.start.kind != REPLAY_TIME_NONE || replay_opts.end.kind != REPLAY_TIME_NONE) {
+			safe_console_error("%s: --start and --end select data file entries, they do not apply to --storm\n", program_name);
+			cleanup_and_exit(1);
+		}
+		storm_init(&storm, &storm_cfg);
+	} else {
+		if (replay_open(&replay_src, file_path) != 0) {
+			safe_console_error("Failed to open file: %s\n", strerror(errno));
+			cleanup_and_exit(1);
+		}
+		if (replay_check_records(replay_src, "btd300", sizeof(ParsedMessage)) != 0) {
+			safe_console_error("%s: %s was not converted for this sensor or this build, rerun wxb_convert\n", program_name, file_path);
+			cleanup_and_exit(1);
+		}
+	}
+    if (replay_apply_options(replay_src, &replay_opts, record_time, DATA_PERIOD_MS) != 0) cleanup_and_exit(1); // Sets --speed, no src needed without a window.
+    if (replay_src && replay_start_live(replay_src, &replay_opts, sizeof(ParsedMessage), live_parse) != 0) cleanup_and_exit(1);
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -706,10 +756,15 @@ int main(int argc, char *argv[]) {
         cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
 	if (init_BTD300_sensor(&sensor_one) != 0) {
         safe_console_error("Failed to initialize sensor_one\n");
 	  	cleanup_and_exit(1);
     }
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared)); // The sender's first snapshot.
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -718,17 +773,20 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
-	// Initialize the send condition to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&sensor_cond, &attr); // Initialize the global variable here
-	sensor_cond_init = true;
-    pthread_condattr_destroy(&attr);
+	// RUN mode deadlines for the sender, on CLOCK_MONOTONIC.
+	if (schedule_init(&sender_sched, SCHEDULE_SKIP) != 0) {
+        safe_console_error("Failed to create sender schedule: %s\n", strerror(errno));
+		cleanup_and_exit(1);
+	}
 
 	// create the signal thread
 
+	if (metrics_start(&metrics_opts, program_name) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, program_name) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
+
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
 		safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
         terminate = 1;          // <- symmetrical, but not required
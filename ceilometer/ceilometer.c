@@ -274,7 +274,23 @@
  *             0x0002: Laser shutdown by TOP board
  *             0x0001: Laser is off
  *
- * Mods:
+ * Mods:     14/10/2026 The sender works from a seqlock snapshot of sensor_one and no
+ *                      longer takes sensor_mutex to read the address and version.
+ *           14/10/2026 The sender runs on a SendSchedule, deadlines follow the
+ *                      last deadline rather than the end of the last send.
+ *           14/10/2026 Commands are matched by command_lookup().
+ *           14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ *                      wait metrics on a UNIX socket.
+ *           14/10/2026 --live reads a pipe, FIFO or udp:// source ahead of the
+ *                      sender, parsed records come out of a lock-free ring.
+ *           14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 A data file of wxstate://NAME reports the cloud bases of the
+ *                      shared weather state, see wxstate/.
  *
  */
 
@@ -295,16 +311,23 @@
 #include "crc_utils.h"
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "skyvue8_utils.h"
-
+#include "seqlock_utils.h"
+#include "schedule_utils.h"
+#include "command_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+
+#define DATA_PERIOD_MS 2000 // SkyVUE8 data files carry no time, taken as recorded at the 2 second minimum interval.
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B115200	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 #define MAX_CMD_LENGTH 256
 #define MAX_MSG_LENGTH 512
-#define CPU_WAIT_USEC 10000
 #define CNTL_AND_SPACE 32
+#define PROFILE_CHUNK_BINS 64 // Bins encoded per chunk, 320 characters stay in L1.
 
 #define DEBUG_MODE // Comment this line out to disable all debug prints
 
@@ -315,7 +338,7 @@
 #endif
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -328,10 +351,17 @@ const char *program_name = "unknown";
 // This needs to be freed upon exit.
 skyvue8_sensor *sensor_one = NULL; // Global pointer to struct for skyvue8 sensor .
 
+/*
+ * sensor_one belongs to the receiver thread. After each command it is published to
+ * sensor_shared, and the sender takes snapshots of that copy through sensor_lock.
+ * sensor_mutex only guards terminate; the sender sleeps on sender_sched.
+ */
+static skyvue8_sensor sensor_shared;
+static SeqLock sensor_lock = SEQLOCK_INITIALIZER;
+
 /* Synchronization primitives */
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // RUN mode deadlines, woken by publish_sensor().
 
 // Global pointers to receiver and sender threads.
 pthread_t recv_thread, send_thread, sig_thread;
@@ -340,7 +370,6 @@ bool sig_thread_created = false;
 bool recv_thread_created = false;
 bool send_thread_created = false;
 
-bool sensor_cond_init = false;
 /*
  * Name:         cleanup_and_exit
  * Purpose:      helper function to cleanup sensors, and arrays.
@@ -357,8 +386,8 @@ bool sensor_cond_init = false;
 void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex);
     terminate = 1;
-    if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
     pthread_mutex_unlock(&sensor_mutex);
+	schedule_wake(&sender_sched);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -367,6 +396,7 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
     }
     if (sig_thread_created) {
         pthread_cancel(sig_thread);
@@ -375,13 +405,14 @@ void cleanup_and_exit(int exit_code) {
     }
 
 	pthread_mutex_destroy(&sensor_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
+    schedule_destroy(&sender_sched);
 
     if (sensor_one) free(sensor_one);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -410,148 +441,191 @@ void cleanup_and_exit(int exit_code) {
  *               Ensures string fields (METAR, BLM) are safely null-terminated.
  */
 void parse_message(char *msg, ParsedMessage *p_message) {
-	memset(p_message, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
-	char *saveptr; // Our place keeper in the msg string.
-	char *token; // Where we temporarily store each token.
-
-	if ((token = strtok_r(msg, ",", &saveptr))) p_message->detection_status = (char)token[0];  // Set detection status.
-   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
-	// These are pulled from a text file in this format:
-	// 1,0,085,010000,/////,/////,/////,8000,0000,0000
-	// Detection Status, Alarm Status, Window Trans %, 1st Height, 2nd Height, 3rd Height, 4th Height, Most Significant Alarm Word, Middle Alarm Word, Least Significant Alarm Word
-   	if ((token = NEXT_T)) p_message->alarm_status = (char)token[0]; // Set Alarm Status.
-   	if ((token = NEXT_T)) p_message->win_trans_per = atoi(token); // Set Window Transmission Percentage.
-	if ((token = NEXT_T)) {
-		strncpy(p_message->first_height, token, MAX_HEIGHT_STR - 1); // Set the First Cloud Height.
-		p_message->first_height[MAX_HEIGHT_STR - 1] = '\0';
+	skyvue8_parse_message(msg, p_message);
+}
+
+/*
+ * Name:         live_parse
+ * Purpose:      Parses a --live line into a record, as wxb_convert does.
+ * Arguments:    line: the line, modified by the parse.
+ * 				 record: the ParsedMessage to fill.
+ *
+ * Output:       None.
+ * Modifies:     record, line.
+ * Returns:      None.
+ * Assumptions:  Called on the live feed's ingestion thread.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void live_parse(char *line, void *record) {
+	skyvue8_parse_message(line, record);
+}
+
+/*
+ * Name:         next_message
+ * Purpose:      Fetches the next record to send from the data file.
+ * Arguments:    p_message: pointer to the struct where the record will be stored.
+ *
+ * Output:       None.
+ * Modifies:     p_message, advances the replay cursor.
+ * Returns:      true if a record was stored, false if the data file has no line available.
+ * Assumptions:  replay_src has been opened and checked with replay_check_records().
+ *
+ * Bugs:         None known.
+ * Notes:        A .wxb cache made by wxb_convert is copied out record by record,
+ *               as is a --live record, a text file is read a line at a time and parsed.
+ */
+bool next_message(ParsedMessage *p_message) {
+	const void *record = replay_next_record(replay_src);
+	if (record) {
+		memcpy(p_message, record, sizeof(ParsedMessage));
+		return true;
 	}
-	if ((token = NEXT_T)) {
-		strncpy(p_message->second_height, token, MAX_HEIGHT_STR - 1); // Set the Second Cloud Height.
-		p_message->second_height[MAX_HEIGHT_STR - 1] = '\0';
+	char line[REPLAY_LINE_MAX];
+	if (replay_next_line(replay_src, line, sizeof(line)) == 0) return false;
+	parse_message(line, p_message);
+	return true;
+}
+
+/*
+ * Name:         format_header
+ * Purpose:      Formats every line of a message that precedes the backscatter profile.
+ * Arguments:    msg: the data record.
+ * 				 layout: the message layout.
+ * 				 gen: the profile generator, gives the sum of backscatter.
+ * 				 address: the sensor ID.
+ * 				 version: the operating system version.
+ * 				 buf: receives the lines, from "CS"/"CL" to the last CR/LF.
+ * 				 buf_len: the size of buf.
+ *
+ * Output:       None.
+ * Modifies:     buf.
+ * Returns:      The length of the header, or -1 if it does not fit.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        See wxsensors.xlsx for the CS message breakdown. CL31 messages report
+ *               three cloud heights and carry the window transmission in the profile
+ *               header instead.
+ */
+static int format_header(const ParsedMessage *msg, const Skyvue8Layout *layout, const Skyvue8ProfileGen *gen,
+						 char address, const char *version, char *buf, size_t buf_len) {
+	int len;
+	if (layout->cl31) {
+		len = snprintf(buf, buf_len, "CL%c%s%d%d\x02\r\n%c%c %s %s %s %04X%04X%04X\r\n",
+					   address, version, 1, msg->message_id - 100,
+					   (char)msg->detection_status, (char)msg->alarm_status,
+					   msg->first_height, msg->second_height, msg->third_height,
+					   (unsigned int)msg->most_sig_alarm, (unsigned int)msg->middle_sig_alarm, (unsigned int)msg->least_sig_alarm);
+	} else {
+		len = snprintf(buf, buf_len, "CS%c%s%03d\x02\r\n%c%c %03d %s %s %s %s %04X%04X%04X\r\n",
+					   address, version, msg->message_id,
+					   (char)msg->detection_status, (char)msg->alarm_status, (uint8_t)msg->win_trans_per,
+					   msg->first_height, msg->second_height, msg->third_height, msg->fourth_height,
+					   (unsigned int)msg->most_sig_alarm, (unsigned int)msg->middle_sig_alarm, (unsigned int)msg->least_sig_alarm);
 	}
-	if ((token = NEXT_T)) {
-		strncpy(p_message->third_height, token, MAX_HEIGHT_STR - 1); // Set the Third Cloud Height.
-		p_message->third_height[MAX_HEIGHT_STR - 1] = '\0';
+	if (len < 0 || (size_t)len >= buf_len) return -1;
+
+	if (layout->sky_condition) {
+		int n = skyvue8_format_sky_condition(msg, buf + len, buf_len - (size_t)len - 2);
+		if (n < 0) return -1;
+		len += n;
+		buf[len++] = '\r';
+		buf[len++] = '\n';
 	}
-	if ((token = NEXT_T)) {
-		strncpy(p_message->fourth_height, token, MAX_HEIGHT_STR - 1); // Set the Fourth Cloud Height.
-		p_message->fourth_height[MAX_HEIGHT_STR - 1] = '\0';
+
+	if (layout->bins > 0) {
+		// Scale %, resolution m, bins, pulse energy %, laser temperature, [window %,] tilt, background light, pulses, sample rate, sum.
+		int n;
+		if (layout->cl31) {
+			n = snprintf(buf + len, buf_len - (size_t)len, "%05d %02d %04d %03d %+03d %03d %02d %03d %s %03u\r\n",
+						 100, layout->resolution_m, layout->bins, 100, 40, (uint8_t)msg->win_trans_per, 2, 74,
+						 "LF1HN15", skyvue8_profile_sum(gen));
+		} else {
+			n = snprintf(buf + len, buf_len - (size_t)len, "%05d %02d %04d %03d %+03d %02d %04d %04d %02d %03u\r\n",
+						 100, layout->resolution_m, layout->bins, 100, 40, 2, 74, 70, 30, skyvue8_profile_sum(gen));
+		}
+		if (n < 0 || (size_t)n >= buf_len - (size_t)len) return -1;
+		len += n;
 	}
-	if ((token = NEXT_T)) p_message->most_sig_alarm = (uint16_t)strtol(token, NULL, 16);  // Set Most Significant Alarm Word "8000" -> 0x8000.
-	if ((token = NEXT_T)) p_message->middle_sig_alarm = (uint16_t)strtol(token, NULL, 16);  // Set Middle Significant Alarm Word "0000" -> 0x0000.
-	if ((token = NEXT_T)) p_message->least_sig_alarm = (uint16_t)strtol(token, NULL, 16);  // Set Least Significant Alarm Word "0000" -> 0x0000.
-	// TODO: If we implement other message formats 002, or 004, we will need to injest the raw bin data ~10,000 chars.
-	#undef NEXT_T
+	return len;
 }
 
 /*
  * Name:         process_and_send
- * Purpose:      Parse a data line, format the message string, and send with CRC.
+ * Purpose:      Formats a data record as the requested message and sends it with CRC.
  * Arguments:    msg: Pointer to the ParsedMessage struct containing the data stripped from the file/buffer.
+ * 				 sensor: the configuration to report, sensor_one or a sender snapshot.
  *
- * Output:       Prints the formatted sensor message with STX/ETX and CRC to serial.
+ * Output:       <SOH>message<ETX><CRC><EOT><CR><LF> on the serial port.
  * Modifies:     None.
  * Returns:      None.
  * Assumptions:  sensor is initialized, and the msg has data fields filled.
  *
  * Bugs:         None known.
- * Notes:        Ensures the 32-field format matches the hardware specification.
+ * Notes:        The backscatter profile is never built as a whole. The header lines are
+ *               formatted once, then the profile is encoded PROFILE_CHUNK_BINS bins at
+ *               a time and each chunk is added to the CRC and copied into the transmit
+ *               ring. The frame is reserved in the ring first, so it is committed whole
+ *               and poll replies queued meanwhile are not held up.
  */
-void process_and_send(ParsedMessage *msg) {
+void process_and_send(ParsedMessage *msg, const skyvue8_sensor *sensor) {
 
 	if (msg == NULL) return;
 
-	char msg_buffer[MAX_MSG_LENGTH]; // 512
 	char local_software_version[MAX_SV_LEN]; // 4
 
-	pthread_mutex_lock(&sensor_mutex);
-	char local_address = (char)sensor_one->address;
-	strncpy(local_software_version, sensor_one->software_version, MAX_SV_LEN - 1);
+	char local_address = (char)sensor->address;
+	strncpy(local_software_version, sensor->software_version, MAX_SV_LEN - 1);
 	local_software_version[MAX_SV_LEN - 1] = '\0';
-	pthread_mutex_unlock(&sensor_mutex);
-
-		switch(msg->message_id) {
-			case MSG_001: {
-				// See wxsensors.xlsx for message breakdown.
-				int length = snprintf(msg_buffer, sizeof(msg_buffer), "%s%c%s%03d\x02\r\n%c%c %03d %s %s %s %s %04X%04X%04X\r\n\x03",
-    				"CS",											// 1.  char* - "CS" Always CS
-					local_address,									// 2.  char - Sensor ID
-    				local_software_version,				   			// 3.  char* - Operating System
-    				msg->message_id,								// 4.  uint8_t - Message ID
-					(char)msg->detection_status,	       			// 5.  char - Detection Status
-    				(char)msg->alarm_status,		  				// 6.  char - Alarm Status
-    				(uint8_t)msg->win_trans_per,       				// 7.  uint8_t - Window Transmission Percent
-    				msg->first_height,								// 8.  char* - First Height
-		    		msg->second_height,      						// 9.  char* - Second Height
-    				msg->third_height,           					// 10.  char* - Third Height
-		    		msg->fourth_height,						  		// 11.  char* - Fourth Height
-    				(unsigned int)msg->most_sig_alarm,				// 12. uint16_t - Most Significant Alarm
-		    		(unsigned int)msg->middle_sig_alarm,			// 13. uint16_t - Middle Significant Alarm
-    				(unsigned int)msg->least_sig_alarm	  			// 14. uint16_t - Least Significant Alarm
-					);
-
-				if (length > 0 && length < (int)sizeof(msg_buffer)) {
-					uint16_t calculated_crc = crc16(msg_buffer, length);
-					safe_serial_write(serial_fd, "\x01%s%04X\x04\r\n", msg_buffer, calculated_crc);
-				}
-				break;
-			}
-			case MSG_002:
-				// TODO
-				break;
-			case MSG_003:
-				// TODO
-				break;
-			case MSG_004:
-				// TODO
-				break;
-			case MSG_101:
-				// TODO
-				break;
-			case MSG_102:
-				// TODO
-				break;
-			case MSG_103:
-				// TODO
-				break;
-			case MSG_104:
-				// TODO
-				break;
-			case MSG_105:
-				// TODO
-				break;
-			case MSG_106:
-				// TODO
-				break;
-			case MSG_107:
-				// TODO
-				break;
-			case MSG_108:
-				// TODO
-				break;
-			case MSG_109:
-				// TODO
-				break;
-			case MSG_110:
-				// TODO
-				break;
-			case MSG_111:
-				// TODO
-				break;
-			case MSG_112:
-				// TODO
-				break;
-			case MSG_113:
-				// TODO
-				break;
-			case MSG_114:
-				// TODO
-				break;
-			default:
-				break;
+
+	const Skyvue8Layout *layout = skyvue8_layout(msg->message_id);
+	if (layout == NULL) {
+		safe_console_error("%s: Message %03d is not supported\n", program_name, msg->message_id);
+		return;
 	}
+
+	Skyvue8ProfileGen gen;
+	skyvue8_profile_begin(&gen, msg, layout);
+
+	char header[MAX_MSG_LENGTH]; // 512
+	int length = format_header(msg, layout, &gen, local_address, local_software_version, header, sizeof(header));
+	if (length < 0) return;
+
+	size_t profile_len = layout->bins ? (size_t)layout->bins * SKYVUE8_BIN_CHARS + 2 : 0;
+	SerialTxFrame frame;
+	// <SOH> + header + profile + <ETX> + CRC + <EOT><CR><LF>
+	if (serial_tx_frame_begin(&frame, serial_fd, 1 + (size_t)length + profile_len + 1 + 4 + 3) != 0) return;
+
+	Crc16Context crc; // From "CS"/"CL" to <ETX> inclusive.
+	crc16_init(&crc, CRC16_GENIBUS);
+
+	serial_tx_frame_append(&frame, "\x01", 1);
+	crc16_update(&crc, header, (size_t)length);
+	serial_tx_frame_append(&frame, header, (size_t)length);
+
+	if (layout->bins > 0) {
+		char chunk[PROFILE_CHUNK_BINS * SKYVUE8_BIN_CHARS];
+		size_t n;
+		while ((n = skyvue8_profile_encode(&gen, chunk, PROFILE_CHUNK_BINS)) > 0) {
+			crc16_update(&crc, chunk, n);
+			serial_tx_frame_append(&frame, chunk, n);
+		}
+		crc16_update(&crc, "\r\n", 2);
+		serial_tx_frame_append(&frame, "\r\n", 2);
+	}
+	crc16_update(&crc, "\x03", 1);
+
+	char trailer[12];
+	snprintf(trailer, sizeof(trailer), "\x03%04X\x04\r\n", crc16_final(&crc));
+	serial_tx_frame_append(&frame, trailer, 8);
+	serial_tx_frame_commit(&frame);
 }
 
+// Built into a trie from cmd_table[] on the first command.
+static CommandDispatch dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_SPACE | CMD_SKIP_CONTROL);
+
 /*
  * Name:         parse_command
  * Purpose:      Translates a received string to command enum.
@@ -564,44 +638,22 @@ void process_and_send(ParsedMessage *msg) {
  * Assumptions:  The string recieved is a string and should be able to translate to one of the commands.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The keyword is matched by command_lookup() on dispatch.
  */
 CommandType parse_command(const char *buf, ParsedCommand *cmd) {
     if (buf == NULL || cmd == NULL) return CMD_UNKNOWN;
 
 	memset(cmd, 0, sizeof(ParsedCommand)); // zero out the contents of our ParsedCommand
-    const char *ptr = buf;
-
-	while (*ptr && ((unsigned char)*ptr <= CNTL_AND_SPACE)) ptr++; // Skip all leading control chars and space. <STX> <ETX>
-    // while (*ptr && isspace((unsigned char)*ptr)) ptr++; // Skip any leading whitespace.
-
-    for (size_t i = 0; i < CMD_TABLE_SIZE; i++) {
-
-        if (strncasecmp(ptr, cmd_table[i].name, cmd_table[i].len) == 0) {
-            // Ensure exact match (don't match "R" if the command is "RESET")
-            char next = ptr[cmd_table[i].len];
-            if (next == '\0' || isspace((unsigned char)next)) {
-                cmd->type = cmd_table[i].type;
-                ptr += cmd_table[i].len; // Jump past command
-
-                // Skip spaces to point at arguments
-                while (*ptr && isspace((unsigned char)*ptr)) ptr++;
 
-				size_t param_len = strcspn(ptr, "\n\r"); // Get the size of the string, up to the \n \r
-
-				if (param_len > sizeof(cmd->raw_params) - 1) { // Truncate if the remaining string is larger than our raw_params char*.
-    				param_len = sizeof(cmd->raw_params) - 1;
-				}
-
-				strncpy(cmd->raw_params, ptr, param_len);
-				cmd->raw_params[param_len] = '\0'; // Always null-terminate
-
-                return cmd->type;
-            }
-        }
+    const char *args;
+    const CommandMap *m = command_lookup(&dispatch, buf, &args);
+    if (m == NULL) {
+        cmd->type = CMD_UNKNOWN;
+        return CMD_UNKNOWN;
     }
-    cmd->type = CMD_UNKNOWN;
-    return CMD_UNKNOWN;
+    cmd->type = (CommandType)m->type;
+    command_copy_params(args, cmd->raw_params, sizeof(cmd->raw_params)); // Up to the \n \r, truncated to fit.
+    return cmd->type;
 }
 
 
@@ -631,17 +683,15 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			if ((token = strtok_r(p_cmd->raw_params, " \r\n", &saveptr))) sensor_id = (uint8_t)token[0];  // Set sensor ID.
 			if ((token = strtok_r(NULL, " \r\n", &saveptr)))  message_id = atoi(token);  // Set message ID.
 
-        	char *line = get_next_line_copy(file_ptr, &file_mutex);
-
-        	if (line) {
-		        ParsedMessage local_msg;  // LOCAL
-				parse_message(line, &local_msg);
+        	ParsedMessage local_msg;  // LOCAL
+        	if (next_message(&local_msg)) {
 				local_msg.sensor_id = sensor_id; // Add the sensor_id before sending. TODO: Validate address against sensor.
+				if (message_id == 0) { // POLL without a message number sends the configured message.
+					message_id = sensor_one->message_id;
+				}
 				local_msg.message_id = message_id; // Add the message_id before sending.
-				process_and_send(&local_msg);
+				process_and_send(&local_msg, sensor_one);
 				fflush(NULL);
-            	free(line); // caller of get_next_line_copy() must free resource.
-				line = NULL;
         	}
 			break;
 		}
@@ -696,18 +746,62 @@ void* signal_thread(void* arg) {
     terminate = 1;
     kill_flag = 1;
 
-    // safely wake threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    // Now safely wake the sender
+    schedule_wake(&sender_sched);
 
     return NULL;
 }
 
+/*
+ * Name:         publish_sensor
+ * Purpose:      Publishes sensor_one to the sender thread, and wakes it if anything changed.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     sensor_shared, sensor_lock.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        A POLL changes nothing and is not published. The wake is
+ * 				 remembered by sender_sched until the sender next waits, so a
+ * 				 change is never missed.
+ */
+static void publish_sensor(void) {
+	if (memcmp(&sensor_shared, sensor_one, sizeof(sensor_shared)) == 0) return;
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared));
+	schedule_wake(&sender_sched); // Wake our sender thread, to check if our mode has changed.
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command(), then publishes the result.
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    handle_command(cmd_type, &local_cmd); // handle received command here, sensor_one is ours.
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    publish_sensor();
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -717,47 +811,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    	if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0'; // Terminate with NULL for safety.
-
-                    ParsedCommand local_cmd;
-                    CommandType cmd_type = parse_command(line, &local_cmd);
-
-					// pthread_mutex_lock(&sensor_mutex);   // <--- LOCK HERE
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    // pthread_mutex_unlock(&sensor_mutex); // <--- UNLOCK HERE
-                    len = 0;
-                } else { // empty line ignore
-                }
-            } else {
-              	  if (len < sizeof(line)-1) {
-				      line[len++] = c;
-                  } else {
-                    	len = 0;
-                  }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(CPU_WAIT_USEC);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -766,61 +829,40 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Sends on sender_sched deadlines, each one the previous deadline
+ * 				 plus the interval, so the time taken to send never adds up as drift.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec ts;
-	bool should_send = false;
-	int interval = 0;
+	skyvue8_sensor cfg; // Snapshot of sensor_one, private to this thread.
+	seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
 
     while (!terminate) {
-        pthread_mutex_lock(&sensor_mutex);
-
-		// Determine if we should wait for a specific time or indefinitely
-        if (sensor_one != NULL && sensor_one->mode == SMODE_RUN) {
-			interval = sensor_one->message_interval; // If we are in polled mode, message_interval is zero.
-            // Calculate absolute time: Last Send Time + Interval
-            // Use current REALTIME + (Interval - Time Since Last Send)
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            // Add the continuous interval (in seconds) to the current time
-            ts.tv_sec += interval;
-            // Wait until that specific second arrives OR a signal interrupts us
-            pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-        } else {
-            // If in Polling/Stop Mode, wait indefinitely for a signal from the receiver
-            pthread_cond_wait(&sensor_cond, &sensor_mutex);
-        }
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
-            break;
-        }
-
-        // is_ready_to_send() handles the interval and timing logic internally, and checks if the sensor is Pollling or Continuous.
-        should_send = (sensor_one != NULL && skyvue8_is_ready_to_send(sensor_one));
+		if (cfg.mode == SMODE_RUN) {
+			// Keeps its phase while the interval is unchanged, an interval of 0 sends back to back.
+			schedule_start(&sender_sched, (uint64_t)cfg.message_interval * SCHED_NS_PER_SEC);
+		} else {
+			// If in Polling/Stop Mode, wait indefinitely for the receiver to publish a change.
+			schedule_stop(&sender_sched);
+		}
 
-		pthread_mutex_unlock(&sensor_mutex);  // <-- UNLOCK BEFORE I/O
+		ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+		if (event == SCHEDULE_ERROR) {
+			safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
+			break;
+		}
+		if (event == SCHEDULE_WOKEN) {
+			seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg)); // The receiver has published since.
+			continue;
+		}
 
         // Do I/O operations WITHOUT holding the mutex
-        if (should_send) {
-            char *line = get_next_line_copy(file_ptr, &file_mutex);
-
-            if (line) {
-                ParsedMessage local_msg;  // LOCAL, not global
-                parse_message(line, &local_msg);
-                process_and_send(&local_msg);
-                fflush(NULL);  // Flush all output streams
-                free(line);
-                line = NULL;
-            }
-
-            // Update timestamp with lock
-            pthread_mutex_lock(&sensor_mutex);
-            if (sensor_one != NULL) {
-                clock_gettime(CLOCK_MONOTONIC, &sensor_one->last_send_time);
-            }
-            pthread_mutex_unlock(&sensor_mutex);
+        ParsedMessage local_msg;  // LOCAL, not global
+        if (next_message(&local_msg)) {
+            local_msg.message_id = cfg.message_id;
+            process_and_send(&local_msg, &cfg);
+            fflush(NULL);  // Flush all output streams
         }
     }
     return NULL;
@@ -851,18 +893,30 @@ void* sender_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    ReplayOptions replay_opts;
+    if (replay_parse_options(&argc, argv, &replay_opts) != 0) cleanup_and_exit(1); // Strips --start/--end/--speed/--live.
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--start T] [--end T] [--speed N|max] [--live[=latest|block|repeat]] [--live-depth N] [--metrics PATH] [--capture PATH]\n", argv[0]);
         return 1;
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
+    if (replay_check_records(replay_src, "ceilometer", sizeof(ParsedMessage)) != 0) {
+        safe_console_error("%s: %s was not converted for this sensor or this build, rerun wxb_convert\n", program_name, file_path);
+        cleanup_and_exit(1);
+    }
+    if (replay_apply_options(replay_src, &replay_opts, NULL, DATA_PERIOD_MS) != 0) cleanup_and_exit(1);
+    if (replay_start_live(replay_src, &replay_opts, sizeof(ParsedMessage), live_parse) != 0) cleanup_and_exit(1);
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -877,10 +931,15 @@ int main(int argc, char *argv[]) {
         cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
 	if (init_skyvue8_sensor(&sensor_one) != 0) {
         safe_console_error("Failed to initialize sensor_one\n");
 	  	cleanup_and_exit(1);
     }
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared)); // The sender's first snapshot.
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -889,15 +948,18 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
 
-	// Initialize the send condition to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&sensor_cond, &attr); // Initialize the global variable here
-	sensor_cond_init = true;
-    pthread_condattr_destroy(&attr);
+	// RUN mode deadlines for the sender, on CLOCK_MONOTONIC.
+	if (schedule_init(&sender_sched, SCHEDULE_SKIP) != 0) {
+        safe_console_error("Failed to create sender schedule: %s\n", strerror(errno));
+		cleanup_and_exit(1);
+	}
+
+	if (metrics_start(&metrics_opts, program_name) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, program_name) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
 
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
 	    safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
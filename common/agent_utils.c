@@ -0,0 +1,396 @@
+/*
+ * File:     agent_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Line buffers, field escaping and state names of the wxagent
+ *           control protocol, see agent_utils.h. Shared by wxagent and
+ *           sensor_control, so it uses nothing but libc.
+ *
+ *           A buffer is read into and written from in place: fill appends at
+ *           len, a parsed line or a flushed write advances head, and the bytes
+ *           still held are moved to the front only when the free space at the
+ *           end runs out.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "agent_utils.h"
+
+#define AGENT_BUFFER_MIN 4096          // First allocation of a buffer.
+#define AGENT_READ_CHUNK 16384         // Free space fill asks read() to use.
+
+static const char *state_names[AGENT_STATES] = {
+    [AGENT_STOPPED]    = "stopped",
+    [AGENT_RUNNING]    = "running",
+    [AGENT_RESTARTING] = "restarting",
+    [AGENT_FAILED]     = "failed",
+};
+
+/*
+ * Name:         reserve
+ * Purpose:      Makes room for n more bytes at the end of a buffer.
+ * Arguments:    b: the buffer.
+ * 				 n: bytes about to be added.
+ *
+ * Output:       None.
+ * Modifies:     b, its data may move.
+ * Returns:      0 on success, -1 with errno ENOMEM.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Compacts first, and grows by doubling only when the bytes
+ * 				 already held and the new ones do not fit.
+ */
+static int reserve(AgentBuffer *b, size_t n) {
+    if (b->cap - b->len >= n) return 0;
+    if (b->head > 0) {
+        memmove(b->data, b->data + b->head, b->len - b->head);
+        b->len -= b->head;
+        b->head = 0;
+        if (b->cap - b->len >= n) return 0;
+    }
+    size_t cap = b->cap ? b->cap : AGENT_BUFFER_MIN;
+    while (cap - b->len < n) {
+        if (cap > SIZE_MAX / 2) {
+            errno = ENOMEM;
+            return -1;
+        }
+        cap *= 2;
+    }
+    char *data = realloc(b->data, cap);
+    if (!data) return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+/*
+ * Name:         agent_buffer_append
+ * Purpose:      Adds bytes to the end of a buffer.
+ * Arguments:    b: the buffer.
+ * 				 data: the bytes, may be NULL when len is 0.
+ * 				 len: number of bytes.
+ *
+ * Output:       None.
+ * Modifies:     b.
+ * Returns:      0 on success, -1 with errno ENOMEM.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+int agent_buffer_append(AgentBuffer *b, const void *data, size_t len) {
+    if (len == 0) return 0;
+    if (reserve(b, len) != 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/*
+ * Name:         agent_buffer_printf
+ * Purpose:      Adds formatted text to the end of a buffer.
+ * Arguments:    b: the buffer.
+ * 				 fmt: printf format.
+ *
+ * Output:       None.
+ * Modifies:     b.
+ * Returns:      0 on success, -1 on a format or allocation failure.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The text is not escaped, a field that may hold a space or a
+ * 				 control character goes through agent_buffer_field().
+ */
+int agent_buffer_printf(AgentBuffer *b, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (n < 0 || reserve(b, (size_t)n + 1) != 0) return -1;
+
+    va_start(args, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, args);
+    va_end(args);
+    b->len += (size_t)n;
+    return 0;
+}
+
+/*
+ * Name:         agent_buffer_field
+ * Purpose:      Adds one escaped field to the end of a buffer, after a space
+ * 				 unless it starts a line.
+ * Arguments:    b: the buffer.
+ * 				 field: the field, any bytes but NUL.
+ *
+ * Output:       None.
+ * Modifies:     b.
+ * Returns:      0 on success, -1 with errno ENOMEM.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        '%', space and the control characters become %XX, other bytes,
+ * 				 UTF-8 included, are copied. An empty field is written as "%".
+ */
+int agent_buffer_field(AgentBuffer *b, const char *field) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = strlen(field);
+    if (reserve(b, 2 + len * 3) != 0) return -1;
+
+    char *out = b->data + b->len;
+    if (b->len > b->head && out[-1] != '\n') *out++ = ' ';
+    if (len == 0) *out++ = '%';
+    for (const unsigned char *p = (const unsigned char *)field; *p; p++) {
+        if (*p <= ' ' || *p == '%' || *p == 0x7F) {
+            *out++ = '%';
+            *out++ = hex[*p >> 4];
+            *out++ = hex[*p & 0x0F];
+        } else {
+            *out++ = (char)*p;
+        }
+    }
+    b->len = (size_t)(out - b->data);
+    return 0;
+}
+
+/*
+ * Name:         agent_buffer_fields
+ * Purpose:      Adds a whole line of escaped fields to the end of a buffer.
+ * Arguments:    b: the buffer.
+ * 				 fields: the fields, the tag or "*" first.
+ * 				 count: number of fields.
+ *
+ * Output:       None.
+ * Modifies:     b.
+ * Returns:      0 on success, -1 with errno ENOMEM, when the line is left out.
+ * Assumptions:  b holds whole lines only.
+ *
+ * Bugs:         None known.
+ * Notes:        A failure leaves no half line behind, the next line would be
+ * 				 parsed into it.
+ */
+int agent_buffer_fields(AgentBuffer *b, const char *const *fields, size_t count) {
+    size_t keep = agent_buffer_pending(b); // Not len, a compaction may move the bytes held.
+    int rc = 0;
+    for (size_t i = 0; i < count && rc == 0; i++) rc = agent_buffer_field(b, fields[i]);
+    if (rc == 0) rc = agent_buffer_append(b, "\n", 1);
+    if (rc != 0) b->len = b->head + keep;
+    return rc;
+}
+
+/*
+ * Name:         agent_buffer_fill
+ * Purpose:      Reads whatever a non-blocking fd has ready onto the end of a buffer.
+ * Arguments:    b: the buffer.
+ * 				 fd: the socket or pipe.
+ *
+ * Output:       None.
+ * Modifies:     b.
+ * Returns:      Bytes read, 0 at end of file, -1 with errno set, EAGAIN when
+ * 				 nothing was ready.
+ * Assumptions:  fd is non-blocking.
+ *
+ * Bugs:         None known.
+ * Notes:        Reads until the fd runs dry, so one call empties the socket
+ * 				 and a burst of pipelined requests is parsed together.
+ */
+ssize_t agent_buffer_fill(AgentBuffer *b, int fd) {
+    size_t total = 0;
+    for (;;) {
+        if (reserve(b, AGENT_READ_CHUNK) != 0) return total ? (ssize_t)total : -1;
+        ssize_t n = read(fd, b->data + b->len, b->cap - b->len);
+        if (n > 0) {
+            b->len += (size_t)n;
+            total += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (total > 0) return (ssize_t)total; // Report the end or the error on the next call.
+        return n;
+    }
+}
+
+/*
+ * Name:         agent_buffer_flush
+ * Purpose:      Writes as much of a buffer as a non-blocking fd takes.
+ * Arguments:    b: the buffer.
+ * 				 fd: the socket.
+ *
+ * Output:       None.
+ * Modifies:     b, the written bytes are consumed.
+ * Returns:      0 when the buffer is empty, 1 when the fd is full and bytes
+ * 				 remain, -1 with errno set on an error.
+ * Assumptions:  fd is a non-blocking socket.
+ *
+ * Bugs:         None known.
+ * Notes:        MSG_NOSIGNAL, a peer that has gone is an EPIPE, not a SIGPIPE.
+ */
+int agent_buffer_flush(AgentBuffer *b, int fd) {
+    while (b->head < b->len) {
+        ssize_t n = send(fd, b->data + b->head, b->len - b->head, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (n <= 0) return -1;
+        b->head += (size_t)n;
+    }
+    b->head = b->len = 0;
+    return 0;
+}
+
+/*
+ * Name:         agent_buffer_line
+ * Purpose:      Takes the next whole line off the front of a buffer.
+ * Arguments:    b: the buffer.
+ *
+ * Output:       None.
+ * Modifies:     b, the line and its newline are consumed.
+ * Returns:      The line, NUL terminated without its newline or a trailing
+ * 				 '\r', or NULL when no whole line is held.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The line stays in the buffer's memory and is valid until the
+ * 				 buffer is next added to. A caller finding NULL with more than
+ * 				 AGENT_LINE_MAX bytes pending should drop the peer.
+ */
+char *agent_buffer_line(AgentBuffer *b) {
+    if (b->head >= b->len) return NULL;
+    char *start = b->data + b->head;
+    char *nl = memchr(start, '\n', b->len - b->head);
+    if (!nl) return NULL;
+
+    *nl = '\0';
+    if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+    b->head = (size_t)(nl + 1 - b->data);
+    if (b->head == b->len) b->head = b->len = 0; // The line is still there, only the counts are reset.
+    return start;
+}
+
+/*
+ * Name:         agent_buffer_consume
+ * Purpose:      Drops bytes from the front of a buffer.
+ * Arguments:    b: the buffer.
+ * 				 n: bytes to drop, at most agent_buffer_pending().
+ *
+ * Returns:      None.
+ */
+void agent_buffer_consume(AgentBuffer *b, size_t n) {
+    b->head += n;
+    if (b->head >= b->len) b->head = b->len = 0;
+}
+
+/*
+ * Name:         agent_buffer_free
+ * Purpose:      Frees a buffer's memory and empties it.
+ * Arguments:    b: the buffer, or NULL.
+ *
+ * Returns:      None.
+ */
+void agent_buffer_free(AgentBuffer *b) {
+    if (!b) return;
+    free(b->data);
+    b->data = NULL;
+    b->head = b->len = b->cap = 0;
+}
+
+/*
+ * Name:         hex_value
+ * Purpose:      Converts one hex digit.
+ * Returns:      0-15, or -1 for any other character.
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Name:         agent_split
+ * Purpose:      Splits a line into its fields and unescapes each in place.
+ * Arguments:    line: the line, from agent_buffer_line().
+ * 				 fields: filled with a pointer to each field.
+ * 				 max: entries in fields.
+ *
+ * Output:       None.
+ * Modifies:     line, fields.
+ * Returns:      The number of fields, or -1 with errno EINVAL for a bad
+ * 				 escape or a NUL inside a field, E2BIG for more than max fields.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Runs of spaces separate fields, so an empty field is only ever
+ * 				 the lone "%" that agent_buffer_field() writes.
+ */
+int agent_split(char *line, char **fields, int max) {
+    int count = 0;
+    char *p = line;
+    for (;;) {
+        while (*p == ' ') p++;
+        if (*p == '\0') return count;
+        if (count == max) {
+            errno = E2BIG;
+            return -1;
+        }
+
+        char *field = p;
+        char *out = p;
+        if (p[0] == '%' && (p[1] == ' ' || p[1] == '\0')) {
+            p++; // The empty field.
+        } else {
+            while (*p && *p != ' ') {
+                if (*p != '%') {
+                    *out++ = *p++;
+                    continue;
+                }
+                int hi = hex_value(p[1]);
+                int lo = hi < 0 ? -1 : hex_value(p[2]);
+                if (lo < 0 || (hi == 0 && lo == 0)) {
+                    errno = EINVAL;
+                    return -1;
+                }
+                *out++ = (char)(hi << 4 | lo);
+                p += 3;
+            }
+        }
+        bool last = *p == '\0';
+        *out = '\0';
+        fields[count++] = field;
+        if (last) return count;
+        p++;
+    }
+}
+
+/*
+ * Name:         agent_state_name
+ * Purpose:      The protocol name of a sensor state.
+ * Arguments:    state: the state.
+ *
+ * Returns:      The name, "unknown" for a value out of range.
+ */
+const char *agent_state_name(AgentState state) {
+    return (unsigned)state < AGENT_STATES ? state_names[state] : "unknown";
+}
+
+/*
+ * Name:         agent_state_parse
+ * Purpose:      Looks up a sensor state by its protocol name.
+ * Arguments:    name: the name from a sensor event.
+ *
+ * Returns:      The AgentState, or -1 for a name this build does not know.
+ */
+int agent_state_parse(const char *name) {
+    for (int s = 0; s < AGENT_STATES; s++) {
+        if (strcmp(name, state_names[s]) == 0) return s;
+    }
+    return -1;
+}
@@ -0,0 +1,184 @@
+/*
+ * File:     arena_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Bump allocator over one anonymous mapping, see arena_utils.h.
+ *
+ *           The mapping is reserved with MAP_NORESERVE, so an arena sized for
+ *           the worst case only costs the pages that are actually touched.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "arena_utils.h"
+
+static __thread Arena scratch = ARENA_INITIALIZER;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Name:         arena_init
+ * Purpose:      Reserves size bytes of zeroed memory for the arena.
+ * Arguments:    a: the arena.
+ * 				 size: bytes to reserve.
+ *
+ * Output:       None.
+ * Modifies:     a.
+ * Returns:      0 on success, -1 with errno set if the mapping fails.
+ * Assumptions:  a is not already initialized.
+ *
+ * Bugs:         None known.
+ * Notes:        Fresh memory reads as zero; memory handed out again after
+ * 				 arena_reset() does not.
+ */
+int arena_init(Arena *a, size_t size) {
+    a->base = NULL;
+    a->size = 0;
+    a->used = 0;
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    a->base = p;
+    a->size = size;
+    return 0;
+}
+
+/*
+ * Name:         arena_alloc
+ * Purpose:      Hands out size bytes from the arena.
+ * Arguments:    a: the arena.
+ * 				 size: bytes wanted.
+ * 				 align: required alignment, a power of two.
+ *
+ * Output:       None.
+ * Modifies:     a->used.
+ * Returns:      The memory, or NULL with errno set to ENOMEM if the arena is full.
+ * Assumptions:  Called from one thread at a time.
+ *
+ * Bugs:         None known.
+ * Notes:        There is no free; the memory lives until arena_reset() or
+ * 				 arena_destroy().
+ */
+void *arena_alloc(Arena *a, size_t size, size_t align) {
+    if (!a->base || align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uintptr_t start = ((uintptr_t)a->base + a->used + align - 1) & ~(uintptr_t)(align - 1);
+    size_t offset = (size_t)(start - (uintptr_t)a->base);
+    if (offset > a->size || size > a->size - offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    a->used = offset + size;
+    return a->base + offset;
+}
+
+/*
+ * Name:         arena_strndup
+ * Purpose:      Copies len bytes of a string into the arena, NULL terminated.
+ * Arguments:    a: the arena.
+ * 				 s: the bytes to copy.
+ * 				 len: how many.
+ *
+ * Output:       None.
+ * Modifies:     a->used.
+ * Returns:      The copy, or NULL with errno set if the arena is full.
+ * Assumptions:  s holds at least len bytes.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+char *arena_strndup(Arena *a, const char *s, size_t len) {
+    char *copy = arena_alloc(a, len + 1, 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*
+ * Name:         arena_reset
+ * Purpose:      Makes the whole arena available again.
+ * Arguments:    a: the arena.
+ *
+ * Output:       None.
+ * Modifies:     a->used.
+ * Returns:      None.
+ * Assumptions:  Nothing allocated from a is still in use.
+ *
+ * Bugs:         None known.
+ * Notes:        The contents are kept, callers clear what they reuse.
+ */
+void arena_reset(Arena *a) {
+    a->used = 0;
+}
+
+/*
+ * Name:         arena_destroy
+ * Purpose:      Unmaps the arena.
+ * Arguments:    a: the arena.
+ *
+ * Output:       None.
+ * Modifies:     a, reset to ARENA_INITIALIZER.
+ * Returns:      None.
+ * Assumptions:  Nothing allocated from a is still in use.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe on an arena that was never initialized.
+ */
+void arena_destroy(Arena *a) {
+    if (a->base) munmap(a->base, a->size);
+    a->base = NULL;
+    a->size = 0;
+    a->used = 0;
+}
+
+/*
+ * Name:         release_scratch
+ * Purpose:      Thread exit destructor, unmaps the thread's scratch arena.
+ *
+ * Returns:      None.
+ */
+static void release_scratch(void *a) {
+    arena_destroy((Arena *)a);
+}
+
+static void make_scratch_key(void) {
+    pthread_key_create(&scratch_key, release_scratch);
+}
+
+/*
+ * Name:         arena_scratch
+ * Purpose:      Gives the calling thread its scratch arena, mapping it on first use.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     The calling thread's scratch arena.
+ * Returns:      The arena, or NULL with errno set if it cannot be mapped.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        ARENA_SCRATCH_SIZE is reserved once per thread and unmapped
+ * 				 when the thread exits. Nothing resets it but the callers'
+ * 				 arena_rewind(), so a builder that forgets to rewind uses it up
+ * 				 and its later allocations fail rather than reach the heap.
+ */
+Arena *arena_scratch(void) {
+    if (!scratch.base) {
+        pthread_once(&scratch_key_once, make_scratch_key);
+        if (arena_init(&scratch, ARENA_SCRATCH_SIZE) != 0) return NULL;
+        pthread_setspecific(scratch_key, &scratch);
+    }
+    return &scratch;
+}
@@ -3,6 +3,8 @@
  * Author:   Bruce Dearing
  * Date:     16/01/2026
  * Purpose:  Implementation of BTD-300-specific logic.
+ * Mods:     14/10/2026 Added BTD300_storm_message().
+ *           14/10/2026 epoch_to_date() and epoch_to_time() read a cached Calendar.
  */
 
 #include <stdio.h>
@@ -11,6 +13,8 @@
 #include <math.h>
 #include <ctype.h>
 #include "crc_utils.h"
+#include "replay_utils.h"
+#include "calendar_utils.h"
 #include "btd300_utils.h"
 
 
@@ -47,7 +51,7 @@ int init_BTD300_sensor(BTD300_sensor **ptr) {
     s->vicinity = 1852; // sets the overhead lightning limit to 10 NM or 1852 decametres
     s->near_distant = 3704; // sets the overhead lightning limit to 20 NM or 3704 decametres
     s->far_distant = 5556; // sets the overhead lightning limit to 30 NM or 5556 decametres
-	clock_gettime(CLOCK_MONOTONIC, &s->last_send_time);
+	replay_clock_now(&s->last_send_time);
 	s->initialized = true;
     return 0;
 }
@@ -67,13 +71,14 @@ int init_BTD300_sensor(BTD300_sensor **ptr) {
  *
  * Bugs:         None known.
  * Notes:        Uses CLOCK_MONOTONIC to ensure timing remains consistent even
- * 				 if the system real-time clock is adjusted.
+ * 				 if the system real-time clock is adjusted, read through
+ * 				 replay_clock_now() so --speed shortens the interval.
  */
 bool BTD300_is_ready_to_send(BTD300_sensor *sensor) {
     if (!sensor || sensor->mode != SMODE_RUN) return false;
 
     struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    replay_clock_now(&now);
 
     long seconds = now.tv_sec - sensor->last_send_time.tv_sec;
     if (seconds >= (long)sensor->message_interval) return true;
@@ -196,14 +201,16 @@ time_t parse_to_epoch(const char *date_token, const char *time_token)
  * Assumptions:  The provided buf is a valid address of a char * pointer, of size 7 bytes, and time_t epoch is not null.
  *
  * Bugs:         None known.
- * Notes:        Uses UTC time.
+ * Notes:        Uses UTC time, through the calling thread's Calendar, so only a
+ *               new day reaches gmtime_r(). A message asks for the date and
+ *               time of the same few seconds over and over.
  *
  */
+static __thread Calendar utc_cache = CALENDAR_INITIALIZER(CALENDAR_UTC);
+
 void epoch_to_date(time_t epoch, char *buf)
 {
-    struct tm t;
-	gmtime_r(&epoch, &t);
-	strftime(buf, sizeof(buf), "%d%m%y", &t);
+	memcpy(buf, calendar_set(&utc_cache, epoch)->ddmmyy, DATE_STRING);
 }
 
 /*
@@ -217,12 +224,187 @@ void epoch_to_date(time_t epoch, char *buf)
  * Assumptions:  The provided buf is a valid address of a char * pointer, of size 7 bytes, and time_t epoch is not null.
  *
  * Bugs:         None known.
- * Notes:        Uses UTC time.
+ * Notes:        Uses UTC time, see epoch_to_date().
  *
  */
 void epoch_to_time(time_t epoch, char *buf)
 {
-    struct tm t;
-	gmtime_r(&epoch, &t);
-	strftime(buf, sizeof(buf), "%H%M%S", &t);
+	memcpy(buf, calendar_set(&utc_cache, epoch)->hhmmss, TIME_STRING);
+}
+
+/*
+ * Name:         BTD300_parse_message
+ * Purpose:      Tokenizes a space-delimited sensor string and populates a ParsedMessage struct.
+ * Arguments:    msg: the raw input string to be parsed (modified by strtok_r).
+ * 				 p_message: pointer to the struct where parsed data will be stored.
+ *
+ * Output:       None (internal debug prints to console only).
+ * Modifies:     p_message: overwrites with new data.
+ * 				 msg: the input string is modified (nulls inserted by strtok_r).
+ * Returns:      None
+ * Assumptions:  msg is a valid space-delimited string matching the sensor protocol.
+ *               p_message has been allocated by the caller.
+ *
+ * Bugs:         None known.
+ * Notes:        Uses a local macro NEXT_T to sequence through 32 expected fields.
+ *               Shared by the emulator and wxb_convert.
+ *               Ensures string fields (METAR, BLM) are safely null-terminated.
+ */
+void BTD300_parse_message(char *msg, ParsedMessage *p_message) {
+	memset(p_message, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
+	char *saveptr; // Our place keeper in the msg string.
+	char *token; // Where we temporarily store each token.
+	char temp_date_holder[DATE_STRING];
+	char temp_time_holder[TIME_STRING];
+	// These are pulled from a text file in this format:
+	// DATA:,01,131125,142809,0,0,00,OOOOO,000000,000000,000,00000,000,000000,000000,000,00000,000,000000,000000,000,00000,000,000000,000000,000,00000,000
+	if ((token = strtok_r(msg, ",", &saveptr))) {
+        strncpy(p_message->data_header, token, MAX_HEADER_STR - 1); // Capture the message header 'DATA:' ** We could discard this.
+        p_message->data_header[MAX_HEADER_STR - 1] = '\0';
+    }
+   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
+   	if ((token = NEXT_T)) p_message->site_id = (uint8_t)atoi(token); // Set site ID.
+   	if ((token = NEXT_T)) {
+		strncpy(temp_date_holder, token, DATE_STRING - 1);
+		temp_date_holder[DATE_STRING - 1] = '\0';
+	}
+	if ((token = NEXT_T)) {
+		strncpy(temp_time_holder, token, TIME_STRING - 1);
+		temp_time_holder[TIME_STRING - 1] = '\0';
+   	}
+	// HANDLE EPOCH CONVERSION
+	p_message->original_epoch = parse_to_epoch(temp_date_holder, temp_time_holder);
+	if ((token = NEXT_T)) p_message->number_of_flashes = (uint8_t)atoi(token); // Number of Flashes in the message string.
+   	if ((token = NEXT_T)) p_message->warning_indicator = (uint8_t)atoi(token); // Warning Indicator.
+   	if ((token = NEXT_T)) p_message->warning_flags = (uint8_t)atoi(token); // Warning Indicator.
+	if ((token = NEXT_T)) {
+		strncpy(p_message->self_test_flags, token, MAX_SELF_TEST_FLAG - 1); // Set the Self Test Flags.
+		p_message->self_test_flags[MAX_SELF_TEST_FLAG - 1] = '\0';
+	}
+
+	if (p_message->number_of_flashes != 0) { // The rest of the string is all zeros, if the number of flashes is zero.
+		// FLASH ONE
+	   	if ((token = NEXT_T)) {
+			strncpy(temp_date_holder, token, DATE_STRING - 1);
+			temp_date_holder[DATE_STRING - 1] = '\0';
+		}
+		if ((token = NEXT_T)) {
+			strncpy(temp_time_holder, token, TIME_STRING - 1);
+			temp_time_holder[TIME_STRING - 1] = '\0';
+	   	}
+		p_message->flash_epoch_array[0] = parse_to_epoch(temp_date_holder, temp_time_holder);
+		if ((token = NEXT_T)) p_message->time_since_flash_one = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash one.
+	   	if ((token = NEXT_T)) p_message->distance_of_flash_one = (uint16_t)atoi(token); // Distance of Flash one.
+	   	if ((token = NEXT_T)) p_message->direction_of_flash_one = (uint16_t)atoi(token); // Direction of Flash one.
+
+		if (p_message->number_of_flashes < 2) goto end_flashes; // Jump to the end if the rest of the string is zeros.
+		// FLASH TWO
+	   	if ((token = NEXT_T)) {
+			strncpy(temp_date_holder, token, DATE_STRING - 1);
+			temp_date_holder[DATE_STRING - 1] = '\0';
+		}
+		if ((token = NEXT_T)) {
+			strncpy(temp_time_holder, token, TIME_STRING - 1);
+			temp_time_holder[TIME_STRING - 1] = '\0';
+		}
+		p_message->flash_epoch_array[1] = parse_to_epoch(temp_date_holder, temp_time_holder);
+	   	if ((token = NEXT_T)) p_message->time_since_flash_two = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash two.
+	   	if ((token = NEXT_T)) p_message->distance_of_flash_two = (uint16_t)atoi(token); // Distance of Flash two.
+	   	if ((token = NEXT_T)) p_message->direction_of_flash_two = (uint16_t)atoi(token); // Direction of Flash two.
+
+		if (p_message->number_of_flashes < 3) goto end_flashes; // Jump to the end if the rest of the string is zeros.
+		// FLASH THREE
+   		if ((token = NEXT_T)) {
+			strncpy(temp_date_holder, token, DATE_STRING - 1);
+			temp_date_holder[DATE_STRING - 1] = '\0';
+		}
+		if ((token = NEXT_T)) {
+			strncpy(temp_time_holder, token, TIME_STRING - 1);
+			temp_time_holder[TIME_STRING - 1] = '\0';
+		}
+		p_message->flash_epoch_array[2] = parse_to_epoch(temp_date_holder, temp_time_holder);
+   		if ((token = NEXT_T)) p_message->time_since_flash_three = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash three.
+   		if ((token = NEXT_T)) p_message->distance_of_flash_three = (uint16_t)atoi(token); // Distance of Flash three.
+   		if ((token = NEXT_T)) p_message->direction_of_flash_three = (uint16_t)atoi(token); // Direction of Flash three.
+
+		if (p_message->number_of_flashes < 4) goto end_flashes; // Jump to the end if the rest of the string is zeros.
+		// FLASH FOUR
+	   	if ((token = NEXT_T)) {
+			strncpy(temp_date_holder, token, DATE_STRING - 1);
+			temp_date_holder[DATE_STRING - 1] = '\0';
+		}
+		if ((token = NEXT_T)) {
+			strncpy(temp_time_holder, token, TIME_STRING - 1);
+			temp_time_holder[TIME_STRING - 1] = '\0';
+		}
+		p_message->flash_epoch_array[3] = parse_to_epoch(temp_date_holder, temp_time_holder);
+		if ((token = NEXT_T)) p_message->time_since_flash_four = (uint8_t)atoi(token); // # of 10 millisecond intervals since Flash four.
+	   	if ((token = NEXT_T)) p_message->distance_of_flash_four = (uint16_t)atoi(token); // Distance of Flash four.
+	   	if ((token = NEXT_T)) p_message->direction_of_flash_four = (uint16_t)atoi(token); // Direction of Flash four.
+	}
+	end_flashes:
+	#undef NEXT_T
+}
+
+/*
+ * Name:         BTD300_storm_message
+ * Purpose:      Builds a DATA message from the flashes of one storm_step().
+ * Arguments:    sensor: the sensor settings, for the site ID and distance limits.
+ * 				 flashes: the step's flashes, in time order.
+ * 				 count: number of flashes.
+ * 				 step_end_s: storm time at the end of the step, StormEngine.time_s.
+ * 				 p_message: receives the message.
+ *
+ * Output:       None.
+ * Modifies:     p_message: overwritten.
+ * Returns:      None
+ * Assumptions:  flashes came from storm_step(), whose times are storm seconds.
+ *
+ * Bugs:         None known.
+ * Notes:        The message carries the last MAX_FLASHES flashes within
+ * 				 BTD300_RANGE_KM, as the sensor reports at most four a period.
+ * 				 The warning indicator follows the nearest flash of the step:
+ * 				 3 within the overhead limit, 2 within vicinity, 1 within far
+ * 				 distant. Times are storm seconds; process_and_send() only uses
+ * 				 them relative to original_epoch.
+ */
+void BTD300_storm_message(const BTD300_sensor *sensor, const StormFlash *flashes, size_t count,
+                          double step_end_s, ParsedMessage *p_message) {
+	memset(p_message, 0, sizeof(ParsedMessage));
+	snprintf(p_message->data_header, MAX_HEADER_STR, "%s", "DATA:");
+	snprintf(p_message->self_test_flags, MAX_SELF_TEST_FLAG, "%s", "OOOOO");
+	p_message->site_id = sensor->address;
+	p_message->original_epoch = (time_t)floor(step_end_s);
+
+	const StormFlash *chosen[MAX_FLASHES];
+	uint8_t n = 0;
+	double nearest_dam = -1.0;
+	for (size_t i = count; i-- > 0;) { // Newest first.
+		if (flashes[i].distance_km > BTD300_RANGE_KM) continue;
+		double dam = flashes[i].distance_km * 100.0;
+		if (nearest_dam < 0.0 || dam < nearest_dam) nearest_dam = dam;
+		if (n < MAX_FLASHES) chosen[n++] = &flashes[i];
+	}
+
+	if (nearest_dam >= 0.0) {
+		if (nearest_dam <= sensor->overhead) p_message->warning_indicator = 3;
+		else if (nearest_dam <= sensor->vicinity) p_message->warning_indicator = 2;
+		else if (nearest_dam <= sensor->far_distant) p_message->warning_indicator = 1;
+	}
+
+	p_message->number_of_flashes = n;
+	uint8_t *since[MAX_FLASHES] = { &p_message->time_since_flash_one, &p_message->time_since_flash_two,
+	                                &p_message->time_since_flash_three, &p_message->time_since_flash_four };
+	uint16_t *distance[MAX_FLASHES] = { &p_message->distance_of_flash_one, &p_message->distance_of_flash_two,
+	                                    &p_message->distance_of_flash_three, &p_message->distance_of_flash_four };
+	uint16_t *direction[MAX_FLASHES] = { &p_message->direction_of_flash_one, &p_message->direction_of_flash_two,
+	                                     &p_message->direction_of_flash_three, &p_message->direction_of_flash_four };
+	for (uint8_t i = 0; i < n; i++) {
+		const StormFlash *f = chosen[n - 1 - i]; // Oldest first, as recorded.
+		double whole = floor(f->t_s);
+		p_message->flash_epoch_array[i] = (time_t)whole;
+		*since[i] = (uint8_t)((f->t_s - whole) * 100.0); // Centiseconds past the second.
+		*distance[i] = (uint16_t)lround(f->distance_km * 100.0);
+		*direction[i] = (uint16_t)lround(f->bearing_deg) % 360;
+	}
 }
@@ -0,0 +1,100 @@
+/*
+ * File:     calendar_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Calendar fields for a second, recomputed in full only when the
+ *           day or local hour changes, see calendar_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include "calendar_utils.h"
+
+/*
+ * Name:         put2
+ * Purpose:      Writes a value 0-99 as two digits.
+ *
+ * Returns:      None.
+ */
+static inline void put2(char *p, int v) {
+    p[0] = (char)('0' + v / 10);
+    p[1] = (char)('0' + v % 10);
+}
+
+/*
+ * Name:         load_window
+ * Purpose:      Reads the date of t from the C library and formats the date text.
+ *
+ * Returns:      None.
+ */
+static void load_window(Calendar *c, time_t t) {
+    if (c->zone == CALENDAR_LOCAL) localtime_r(&t, &c->tm);
+    else gmtime_r(&t, &c->tm);
+
+    long sod = (long)c->tm.tm_hour * 3600 + c->tm.tm_min * 60 + c->tm.tm_sec;
+    if (c->zone == CALENDAR_LOCAL) {
+        // To the next hour, where an offset change can happen.
+        long into_hour = c->tm.tm_min * 60 + c->tm.tm_sec;
+        c->window_start = t - into_hour;
+        c->window_sod = sod - into_hour;
+        c->window_end = c->window_start + 3600;
+    } else {
+        c->window_start = t - sod;
+        c->window_sod = 0;
+        c->window_end = c->window_start + 86400;
+    }
+
+    int year = c->tm.tm_year + 1900;
+    put2(c->ddmmyy, c->tm.tm_mday);
+    put2(c->ddmmyy + 2, c->tm.tm_mon + 1);
+    put2(c->ddmmyy + 4, year % 100);
+    c->ddmmyy[6] = '\0';
+    put2(c->ymd, (year / 100) % 100);
+    put2(c->ymd + 2, year % 100);
+    c->ymd[4] = '-';
+    put2(c->ymd + 5, c->tm.tm_mon + 1);
+    c->ymd[7] = '-';
+    put2(c->ymd + 8, c->tm.tm_mday);
+    c->ymd[10] = '\0';
+}
+
+/*
+ * Name:         calendar_set
+ * Purpose:      Brings a Calendar's fields to the second t.
+ * Arguments:    c: the calendar, CALENDAR_INITIALIZER before first use.
+ *               t: the second wanted, from time() or a data file.
+ *
+ * Output:       None.
+ * Modifies:     c.
+ * Returns:      c, so the fields can be read off the call.
+ * Assumptions:  c is only used by the calling thread.
+ *
+ * Bugs:         None known.
+ * Notes:        The same second again costs one compare, another second in
+ *               the same window sets only the time of day. A t before the
+ *               window, a clock stepped back or an older flash time, reloads
+ *               the window as a new day does.
+ */
+const Calendar *calendar_set(Calendar *c, time_t t) {
+    if (t == c->second) return c;
+    if (c->second == (time_t)-1 || t < c->window_start || t >= c->window_end) load_window(c, t);
+
+    long sod = c->window_sod + (long)(t - c->window_start);
+    c->tm.tm_hour = (int)(sod / 3600);
+    c->tm.tm_min = (int)(sod / 60 % 60);
+    c->tm.tm_sec = (int)(sod % 60);
+    put2(c->hhmmss, c->tm.tm_hour);
+    put2(c->hhmmss + 2, c->tm.tm_min);
+    put2(c->hhmmss + 4, c->tm.tm_sec);
+    c->hhmmss[6] = '\0';
+    put2(c->hms, c->tm.tm_hour);
+    c->hms[2] = ':';
+    put2(c->hms + 3, c->tm.tm_min);
+    c->hms[5] = ':';
+    put2(c->hms + 6, c->tm.tm_sec);
+    c->hms[8] = '\0';
+    c->second = t;
+    return c;
+}
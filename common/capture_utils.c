@@ -0,0 +1,514 @@
+/*
+ * File:     capture_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Per-thread capture rings and the drainer that writes them to a
+ *           capture file, see capture_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "capture_utils.h"
+#include "metrics_utils.h"
+
+#define CAPTURE_MASK (CAPTURE_RING_SIZE - 1)
+
+_Static_assert((CAPTURE_RING_SIZE & CAPTURE_MASK) == 0, "CAPTURE_RING_SIZE must be a power of two");
+_Static_assert(CAPTURE_CHUNK + sizeof(CaptureRecord) < CAPTURE_RING_SIZE, "a record must fit a ring");
+
+// A thread's records, one producer (the thread) and one consumer (the drainer).
+typedef struct {
+    _Atomic size_t head;                // Free running, written by the owning thread.
+    _Atomic size_t tail;                // Free running, written by the drainer.
+    _Atomic uint64_t lost;              // Records turned away because the ring was full.
+    uint64_t lost_written;              // Of those, already reported in a gap record. Drainer only.
+    atomic_bool retired;                // The owning thread has exited.
+    unsigned char data[CAPTURE_RING_SIZE];
+} CaptureRing;
+
+// A port open_serial_port() opened, and the name it was opened by.
+typedef struct {
+    _Atomic int fd;
+    uint64_t t_ns;                      // When it was opened, relative to the capture start.
+    char name[CAPTURE_PORT_NAME_LEN];
+    bool written;                       // Its CAPTURE_PORT record is in the file. Drainer only.
+} CapturePort;
+
+atomic_bool capture_on = false;
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER; // Ring claims and port registration.
+static CaptureRing *rings[CAPTURE_MAX_THREADS];
+static _Atomic unsigned ring_count = 0;
+static CapturePort ports[CAPTURE_MAX_PORTS];
+static _Atomic unsigned port_count = 0;
+static __thread CaptureRing *thread_ring = NULL;
+static __thread bool thread_unrecorded = false; // Every ring was taken, this thread is not recorded.
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static FILE *capture_file = NULL;
+static char capture_path[4096];
+static int64_t capture_base_ns = 0;     // CLOCK_MONOTONIC at capture_start().
+static pthread_t drainer;
+static bool drainer_created = false;
+static atomic_bool drainer_stop = false;
+
+/*
+ * Name:         now_ns
+ * Purpose:      Reads CLOCK_MONOTONIC relative to the capture start.
+ *
+ * Returns:      Nanoseconds since capture_start(), 0 before it.
+ */
+static uint64_t now_ns(void) {
+    int64_t t = metrics_now_ns() - capture_base_ns;
+    return t > 0 ? (uint64_t)t : 0;
+}
+
+/*
+ * Name:         retire_ring
+ * Purpose:      Thread exit destructor, hands the thread's ring back for reuse.
+ * Arguments:    ring: the exiting thread's ring.
+ *
+ * Returns:      None.
+ */
+static void retire_ring(void *ring) {
+    atomic_store_explicit(&((CaptureRing *)ring)->retired, true, memory_order_release);
+}
+
+static void make_ring_key(void) {
+    pthread_key_create(&ring_key, retire_ring);
+}
+
+/*
+ * Name:         claim_ring
+ * Purpose:      Gives the calling thread a ring on its first record.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     rings, ring_count, thread_ring.
+ * Returns:      The ring, or NULL when all CAPTURE_MAX_THREADS are in use.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The only lock on the record path, taken once per thread. A ring
+ *               whose thread has exited is reused once the drainer has emptied it,
+ *               so a restarted sender does not use up the table.
+ */
+static CaptureRing *claim_ring(void) {
+    pthread_once(&ring_key_once, make_ring_key);
+    pthread_mutex_lock(&capture_mutex);
+    CaptureRing *ring = NULL;
+    unsigned count = atomic_load_explicit(&ring_count, memory_order_relaxed);
+    for (unsigned i = 0; i < count && !ring; i++) {
+        CaptureRing *r = rings[i];
+        if (atomic_load_explicit(&r->retired, memory_order_acquire) &&
+            atomic_load_explicit(&r->tail, memory_order_acquire) == atomic_load_explicit(&r->head, memory_order_relaxed)) {
+            atomic_store_explicit(&r->retired, false, memory_order_relaxed);
+            ring = r;
+        }
+    }
+    if (!ring && count < CAPTURE_MAX_THREADS && (ring = calloc(1, sizeof(CaptureRing)))) {
+        rings[count] = ring;
+        atomic_store_explicit(&ring_count, count + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+
+    if (ring) pthread_setspecific(ring_key, ring);
+    else thread_unrecorded = true;
+    thread_ring = ring;
+    return ring;
+}
+
+/*
+ * Name:         port_id
+ * Purpose:      Maps an fd to the id of the port it was opened as.
+ * Arguments:    fd: the port's file descriptor.
+ *
+ * Returns:      The port id, CAPTURE_NO_PORT if fd was not registered.
+ */
+static uint8_t port_id(int fd) {
+    unsigned count = atomic_load_explicit(&port_count, memory_order_acquire);
+    for (unsigned i = count; i-- > 0;) { // Newest first, an fd number can be reused.
+        if (atomic_load_explicit(&ports[i].fd, memory_order_relaxed) == fd) return (uint8_t)i;
+    }
+    return CAPTURE_NO_PORT;
+}
+
+/*
+ * Name:         ring_put
+ * Purpose:      Copies bytes into a ring at a free running index, wrapping at the end.
+ *
+ * Returns:      None.
+ */
+static void ring_put(CaptureRing *ring, size_t at, const void *src, size_t len) {
+    size_t start = at & CAPTURE_MASK;
+    size_t first = CAPTURE_RING_SIZE - start;
+    if (first > len) first = len;
+    memcpy(ring->data + start, src, first);
+    memcpy(ring->data, (const unsigned char *)src + first, len - first);
+}
+
+/*
+ * Name:         ring_get
+ * Purpose:      Copies bytes out of a ring at a free running index, wrapping at the end.
+ *
+ * Returns:      None.
+ */
+static void ring_get(const CaptureRing *ring, size_t at, void *dst, size_t len) {
+    size_t start = at & CAPTURE_MASK;
+    size_t first = CAPTURE_RING_SIZE - start;
+    if (first > len) first = len;
+    memcpy(dst, ring->data + start, first);
+    memcpy((unsigned char *)dst + first, ring->data, len - first);
+}
+
+/*
+ * Name:         capture_iov
+ * Purpose:      Records bytes written to or read from a port.
+ * Arguments:    fd: the port's file descriptor.
+ *               dir: CAPTURE_RX or CAPTURE_TX.
+ *               iov: the bytes, as handed to writev() or readv().
+ *               iovcnt: the number of pieces.
+ *               len: how many bytes of iov to record, what the call moved.
+ *
+ * Output:       None.
+ * Modifies:     The calling thread's ring.
+ * Returns:      None.
+ * Assumptions:  Called through capture_writev(), with capture on and len > 0.
+ *
+ * Bugs:         None known.
+ * Notes:        Writes longer than CAPTURE_CHUNK are split into records with the
+ *               same timestamp. A record that does not fit the ring is counted
+ *               as lost rather than waited for.
+ */
+void capture_iov(int fd, CaptureDirection dir, const struct iovec *iov, int iovcnt, size_t len) {
+    CaptureRing *ring = thread_ring;
+    if (!ring) {
+        if (thread_unrecorded || !(ring = claim_ring())) return;
+    }
+
+    CaptureRecord rec = { .t_ns = now_ns(), .port = port_id(fd), .dir = (uint8_t)dir };
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int piece = 0;
+    size_t offset = 0; // Into iov[piece].
+
+    while (len > 0) {
+        size_t chunk = len < CAPTURE_CHUNK ? len : CAPTURE_CHUNK;
+        size_t used = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (CAPTURE_RING_SIZE - used < sizeof(rec) + chunk) {
+            atomic_store_explicit(&ring->lost, atomic_load_explicit(&ring->lost, memory_order_relaxed) + 1, memory_order_relaxed);
+            metrics_count(METRIC_CAPTURE_LOST, 1);
+            break;
+        }
+
+        rec.len = (uint16_t)chunk;
+        ring_put(ring, head, &rec, sizeof(rec));
+        size_t at = head + sizeof(rec);
+        for (size_t left = chunk; left > 0 && piece < iovcnt;) {
+            size_t n = iov[piece].iov_len - offset;
+            if (n > left) n = left;
+            ring_put(ring, at, (const unsigned char *)iov[piece].iov_base + offset, n);
+            at += n;
+            left -= n;
+            offset += n;
+            if (offset == iov[piece].iov_len) {
+                piece++;
+                offset = 0;
+            }
+        }
+        head = at;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        metrics_count(METRIC_CAPTURE_RECORDS, 1);
+        len -= chunk;
+    }
+}
+
+/*
+ * Name:         capture_port
+ * Purpose:      Names a port, so its records can be told apart in the capture.
+ * Arguments:    fd: the port's file descriptor.
+ *               name: the device or transport name it was opened by.
+ *
+ * Output:       None.
+ * Modifies:     The port table.
+ * Returns:      None.
+ * Assumptions:  Called by open_serial_port() on success.
+ *
+ * Bugs:         None known.
+ * Notes:        Ports are registered whether or not a capture is running, so
+ *               capture_start() may come after the ports are open. The table
+ *               holds CAPTURE_MAX_PORTS names, later ports record as CAPTURE_NO_PORT.
+ */
+void capture_port(int fd, const char *name) {
+    pthread_mutex_lock(&capture_mutex);
+    unsigned count = atomic_load_explicit(&port_count, memory_order_relaxed);
+    if (count < CAPTURE_MAX_PORTS) {
+        CapturePort *p = &ports[count];
+        snprintf(p->name, sizeof(p->name), "%s", name);
+        p->t_ns = now_ns();
+        atomic_store_explicit(&p->fd, fd, memory_order_relaxed);
+        atomic_store_explicit(&port_count, count + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+/*
+ * Name:         write_record
+ * Purpose:      Appends one record and its payload to the capture file.
+ *
+ * Returns:      None.
+ */
+static void write_record(const CaptureRecord *rec, const void *payload) {
+    fwrite(rec, sizeof(*rec), 1, capture_file);
+    if (rec->len) fwrite(payload, rec->len, 1, capture_file);
+}
+
+/*
+ * Name:         drain_rings
+ * Purpose:      Moves every complete record out of the rings into the file, oldest first.
+ * Arguments:    None.
+ *
+ * Output:       The records, to the capture file.
+ * Modifies:     The rings' tails, the port table's written flags.
+ * Returns:      None.
+ * Assumptions:  Called by the drainer thread, or by capture_stop() once it has exited.
+ *
+ * Bugs:         None known.
+ * Notes:        The heads are read once, then the rings are merged by timestamp
+ *               up to those heads. A record published after the snapshot can be
+ *               a few microseconds older than the last one written; readers of
+ *               a capture order records per port, where this cannot happen.
+ */
+static void drain_rings(void) {
+    unsigned nports = atomic_load_explicit(&port_count, memory_order_acquire);
+    for (unsigned i = 0; i < nports; i++) {
+        if (ports[i].written) continue;
+        CaptureRecord rec = { .t_ns = ports[i].t_ns, .len = (uint16_t)strlen(ports[i].name), .port = (uint8_t)i, .dir = CAPTURE_PORT };
+        write_record(&rec, ports[i].name);
+        ports[i].written = true;
+    }
+
+    unsigned count = atomic_load_explicit(&ring_count, memory_order_acquire);
+    size_t at[CAPTURE_MAX_THREADS], end[CAPTURE_MAX_THREADS];
+    for (unsigned i = 0; i < count; i++) {
+        CaptureRing *r = rings[i];
+        at[i] = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        end[i] = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        uint64_t lost = atomic_load_explicit(&r->lost, memory_order_relaxed);
+        if (lost != r->lost_written) {
+            uint64_t gap = lost - r->lost_written;
+            CaptureRecord rec = { .t_ns = now_ns(), .len = sizeof(gap), .port = CAPTURE_NO_PORT, .dir = CAPTURE_GAP };
+            write_record(&rec, &gap);
+            r->lost_written = lost;
+        }
+    }
+
+    static unsigned char payload[CAPTURE_CHUNK];
+    for (;;) {
+        int oldest = -1;
+        CaptureRecord best, rec;
+        for (unsigned i = 0; i < count; i++) {
+            if (at[i] == end[i]) continue;
+            ring_get(rings[i], at[i], &rec, sizeof(rec));
+            if (oldest < 0 || rec.t_ns < best.t_ns) {
+                oldest = (int)i;
+                best = rec;
+            }
+        }
+        if (oldest < 0) break;
+
+        ring_get(rings[oldest], at[oldest] + sizeof(best), payload, best.len);
+        write_record(&best, payload);
+        at[oldest] += sizeof(best) + best.len;
+    }
+
+    for (unsigned i = 0; i < count; i++) atomic_store_explicit(&rings[i]->tail, at[i], memory_order_release);
+    fflush(capture_file);
+}
+
+/*
+ * Name:         drain_thread
+ * Purpose:      Empties the rings into the capture file every CAPTURE_FLUSH_MS.
+ * Arguments:    arg: unused.
+ *
+ * Returns:      NULL.
+ */
+static void *drain_thread(void *arg) {
+    (void)arg;
+    while (!atomic_load(&drainer_stop)) {
+        struct timespec pause = { 0, CAPTURE_FLUSH_MS * 1000000L };
+        nanosleep(&pause, NULL);
+        drain_rings();
+    }
+    return NULL;
+}
+
+/*
+ * Name:         capture_parse_options
+ * Purpose:      Takes --capture PATH off the command line.
+ * Arguments:    argc: pointer to the argument count, updated.
+ * 				 argv: the argument vector, compacted in place.
+ * 				 opts: filled with the option, or NULL path when absent.
+ *
+ * Output:       An error message on stderr for a malformed value.
+ * Modifies:     argc, argv, opts.
+ * Returns:      0 on success, -1 on a malformed value.
+ * Assumptions:  argv[*argc] may be written (it is NULL by the C standard).
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors metrics_parse_options().
+ */
+int capture_parse_options(int *argc, char **argv, CaptureOptions *opts) {
+    opts->path = NULL;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *name = "--capture";
+        size_t n = strlen(name);
+        const char *value = NULL;
+
+        if (strncmp(argv[i], name, n) == 0) {
+            if (argv[i][n] == '=') {
+                value = argv[i] + n + 1;
+            } else if (argv[i][n] == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+            }
+        }
+        if (!value) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        if (value[0] == '\0' || strlen(value) >= sizeof(capture_path)) {
+            fprintf(stderr, "Invalid --capture '%s': use a file path under %zu characters\n", value, sizeof(capture_path));
+            return -1;
+        }
+        opts->path = value;
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+ * Name:         capture_start
+ * Purpose:      Creates the capture file and starts recording.
+ * Arguments:    opts: from capture_parse_options(), nothing is done without a path.
+ *               name: the program name, written to the file header.
+ *
+ * Output:       An error message on stderr on failure.
+ * Modifies:     capture_on, starts the drainer thread.
+ * Returns:      0 on success or with no path, -1 on failure.
+ * Assumptions:  Called from main() before the sender and receiver threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        The drainer is created with every signal blocked, like the
+ *               transmit queue writer, so it never takes the signal_thread's signals.
+ */
+int capture_start(const CaptureOptions *opts, const char *name) {
+    if (!opts->path) return 0;
+
+    snprintf(capture_path, sizeof(capture_path), "%s", opts->path);
+    capture_file = fopen(capture_path, "wb");
+    if (!capture_file) {
+        fprintf(stderr, "Unable to capture to %s: %s\n", capture_path, strerror(errno));
+        return -1;
+    }
+
+    const char *base = strrchr(name, '/');
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    CaptureFileHeader hdr = {
+        .version = CAPTURE_VERSION,
+        .header_size = sizeof(CaptureFileHeader),
+        .byte_order = CAPTURE_BYTE_ORDER,
+        .record_size = sizeof(CaptureRecord),
+        .start_unix_ns = (int64_t)wall.tv_sec * 1000000000LL + wall.tv_nsec,
+    };
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    strncpy(hdr.program, base ? base + 1 : name, sizeof(hdr.program) - 1);
+    capture_base_ns = metrics_now_ns();
+    if (fwrite(&hdr, sizeof(hdr), 1, capture_file) != 1) {
+        fprintf(stderr, "Unable to capture to %s: %s\n", capture_path, strerror(errno));
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+
+    // Ports opened before the capture started are dated from its start.
+    unsigned nports = atomic_load_explicit(&port_count, memory_order_acquire);
+    for (unsigned i = 0; i < nports; i++) ports[i].t_ns = 0;
+
+    atomic_store(&drainer_stop, false);
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int err = pthread_create(&drainer, NULL, drain_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Unable to start capture thread: %s\n", strerror(err));
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+    drainer_created = true;
+    atomic_store(&capture_on, true);
+    fprintf(stderr, "Capturing port traffic to %s\n", capture_path);
+    return 0;
+}
+
+/*
+ * Name:         capture_stop
+ * Purpose:      Stops recording, writes out what the rings still hold and closes the file.
+ * Arguments:    None.
+ *
+ * Output:       A summary line on stderr.
+ * Modifies:     capture_on, joins the drainer, frees the rings.
+ * Returns:      None.
+ * Assumptions:  Every thread that writes or reads a port has been joined, i.e.
+ *               called after close_serial_port(). Safe without capture_start().
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+void capture_stop(void) {
+    atomic_store(&capture_on, false);
+    if (drainer_created) {
+        atomic_store(&drainer_stop, true);
+        pthread_join(drainer, NULL);
+        drainer_created = false;
+    }
+    if (capture_file) {
+        drain_rings();
+        long size = ftell(capture_file);
+        uint64_t lost = 0;
+        unsigned count = atomic_load(&ring_count);
+        for (unsigned i = 0; i < count; i++) lost += atomic_load(&rings[i]->lost);
+        fclose(capture_file);
+        capture_file = NULL;
+        fprintf(stderr, "Captured %ld bytes to %s", size, capture_path);
+        if (lost) fprintf(stderr, ", %llu records lost to full rings", (unsigned long long)lost);
+        fprintf(stderr, "\n");
+    }
+
+    pthread_mutex_lock(&capture_mutex);
+    unsigned count = atomic_load(&ring_count);
+    for (unsigned i = 0; i < count; i++) {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+    atomic_store(&ring_count, 0);
+    pthread_mutex_unlock(&capture_mutex);
+    if (thread_ring) pthread_setspecific(ring_key, NULL); // The caller's ring is gone with the rest.
+    thread_ring = NULL;
+}
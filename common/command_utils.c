@@ -0,0 +1,325 @@
+/*
+ * File:     command_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Shared keyword dispatch for the emulators' terminal commands, see
+ *           command_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include "command_utils.h"
+#include "metrics_utils.h"
+
+/*
+ * Name:         term_ok
+ * Purpose:      Checks the character after a keyword against the sensor's terminators.
+ * Arguments:    c: the character after the keyword.
+ * 				 flags: the dispatch's CMD_TERM_* flags.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      true if the keyword ends here.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Keeps "R" from matching a "RESET" line on sensors without
+ * 				 CMD_TERM_ALNUM.
+ */
+static bool term_ok(char c, unsigned flags) {
+    unsigned char u = (unsigned char)c;
+    return u == '\0' ||
+           ((flags & CMD_TERM_ALNUM) && isalnum(u)) ||
+           ((flags & CMD_TERM_SPACE) && isspace(u)) ||
+           ((flags & CMD_TERM_QUERY) && u == '?') ||
+           ((flags & CMD_TERM_EQUALS) && u == '=');
+}
+
+/*
+ * Name:         find_child
+ * Purpose:      Finds the node for one more keyword character under a parent.
+ * Arguments:    d: the dispatch.
+ * 				 first: the parent's first child, or COMMAND_NONE.
+ * 				 ch: the upper cased character.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The node, or COMMAND_NONE.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static uint16_t find_child(const CommandDispatch *d, uint16_t first, char ch) {
+    for (uint16_t n = first; n != COMMAND_NONE; n = d->nodes[n].sibling) {
+        if (d->nodes[n].ch == ch) return n;
+    }
+    return COMMAND_NONE;
+}
+
+/*
+ * Name:         new_node
+ * Purpose:      Takes the next free trie node.
+ * Arguments:    d: the dispatch.
+ * 				 ch: the upper cased character it stands for.
+ * 				 sibling: the node it goes in front of.
+ *
+ * Output:       None.
+ * Modifies:     d->nodes, d->node_count.
+ * Returns:      The node, or COMMAND_NONE when the trie is full.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static uint16_t new_node(CommandDispatch *d, char ch, uint16_t sibling) {
+    if (d->node_count >= COMMAND_MAX_NODES) return COMMAND_NONE;
+    uint16_t n = d->node_count++;
+    d->nodes[n] = (CommandNode){ .ch = ch, .child = COMMAND_NONE, .sibling = sibling, .entry = COMMAND_NONE };
+    return n;
+}
+
+/*
+ * Name:         build
+ * Purpose:      Turns the dispatch's table into the trie.
+ * Arguments:    d: the dispatch.
+ *
+ * Output:       None.
+ * Modifies:     d.
+ * Returns:      None.
+ * Assumptions:  d->lock is held.
+ *
+ * Bugs:         None known.
+ * Notes:        Entries are added in table order and a node keeps the first
+ * 				 entry to reach it, so duplicates behave as they did in the
+ * 				 linear scan. A table with a non-ASCII keyword, or too many
+ * 				 prefixes, falls back to that scan.
+ */
+static void build(CommandDispatch *d) {
+    d->empty = COMMAND_NONE;
+    d->node_count = 0;
+    for (size_t c = 0; c < COMMAND_ROOT_SIZE; c++) d->root[c] = COMMAND_NONE;
+    if (d->count >= COMMAND_NONE) {
+        d->linear = true;
+        return;
+    }
+
+    for (size_t i = 0; i < d->count; i++) {
+        const CommandMap *m = &d->table[i];
+        if (m->len == 0) {
+            if (d->empty == COMMAND_NONE) d->empty = (uint16_t)i;
+            continue;
+        }
+        for (size_t k = 0; k < m->len; k++) {
+            if ((unsigned char)m->name[k] >= COMMAND_ROOT_SIZE) {
+                d->linear = true;
+                return;
+            }
+        }
+
+        char ch = (char)toupper((unsigned char)m->name[0]);
+        uint16_t n = d->root[(unsigned char)ch];
+        if (n == COMMAND_NONE) n = d->root[(unsigned char)ch] = new_node(d, ch, COMMAND_NONE);
+        for (size_t k = 1; k < m->len && n != COMMAND_NONE; k++) {
+            ch = (char)toupper((unsigned char)m->name[k]);
+            uint16_t next = find_child(d, d->nodes[n].child, ch);
+            if (next == COMMAND_NONE) next = d->nodes[n].child = new_node(d, ch, d->nodes[n].child);
+            n = next;
+        }
+        if (n == COMMAND_NONE) {
+            d->linear = true;
+            return;
+        }
+        if (d->nodes[n].entry == COMMAND_NONE) d->nodes[n].entry = (uint16_t)i;
+    }
+}
+
+/*
+ * Name:         lookup_linear
+ * Purpose:      The table scan the emulators used before the trie.
+ * Arguments:    d: the dispatch.
+ * 				 p: the line, past any leading white space.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The first matching entry, or NULL.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Only used for a table build() could not take.
+ */
+static const CommandMap *lookup_linear(const CommandDispatch *d, const char *p) {
+    for (size_t i = 0; i < d->count; i++) {
+        const CommandMap *m = &d->table[i];
+        if (strncasecmp(p, m->name, m->len) == 0 && term_ok(p[m->len], d->flags)) return m;
+    }
+    return NULL;
+}
+
+/*
+ * Name:         command_lookup
+ * Purpose:      Finds the command a received line starts with.
+ * Arguments:    d: the sensor's dispatch.
+ * 				 buf: the received line.
+ * 				 args: set to the text after the keyword and any white space, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     d, built on first use. *args on a match.
+ * Returns:      The matching table entry, or NULL.
+ * Assumptions:  buf is NUL terminated.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe from several threads at once, the first caller builds the
+ * 				 trie under d->lock. The walk follows the line one character at a
+ * 				 time and, of the keywords it passes whose terminator matches,
+ * 				 keeps the one earliest in the table.
+ */
+const CommandMap *command_lookup(CommandDispatch *d, const char *buf, const char **args) {
+    if (d == NULL || buf == NULL) return NULL;
+
+    if (!atomic_load_explicit(&d->built, memory_order_acquire)) {
+        pthread_mutex_lock(&d->lock);
+        if (!atomic_load_explicit(&d->built, memory_order_relaxed)) {
+            build(d);
+            atomic_store_explicit(&d->built, true, memory_order_release);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    const char *p = buf;
+    if (d->flags & CMD_SKIP_CONTROL) {
+        while (*p && (unsigned char)*p <= ' ') p++; // <STX> and friends.
+    } else {
+        while (*p && isspace((unsigned char)*p)) p++;
+    }
+
+    const CommandMap *m;
+    if (d->linear) {
+        m = lookup_linear(d, p);
+    } else {
+        uint16_t best = COMMAND_NONE;
+        if (d->empty != COMMAND_NONE && term_ok(p[0], d->flags)) best = d->empty;
+
+        unsigned char c = (unsigned char)p[0];
+        uint16_t n = (c != '\0' && c < COMMAND_ROOT_SIZE) ? d->root[toupper(c)] : COMMAND_NONE;
+        for (size_t k = 1; n != COMMAND_NONE; k++) {
+            uint16_t e = d->nodes[n].entry;
+            if (e < best && term_ok(p[k], d->flags)) best = e; // COMMAND_NONE never wins.
+            c = (unsigned char)p[k];
+            if (c == '\0' || c >= COMMAND_ROOT_SIZE) break;
+            n = find_child(d, d->nodes[n].child, (char)toupper(c));
+        }
+        m = best == COMMAND_NONE ? NULL : &d->table[best];
+    }
+
+    metrics_count(METRIC_COMMANDS, 1);
+    if (!m) metrics_count(METRIC_BAD_COMMANDS, 1);
+    if (m && args) {
+        p += m->len;
+        while (*p && isspace((unsigned char)*p)) p++; // Point at the arguments.
+        *args = p;
+    }
+    return m;
+}
+
+/*
+ * Name:         command_copy_params
+ * Purpose:      Copies a command's arguments into a ParsedCommand's raw_params.
+ * Arguments:    args: the arguments from command_lookup().
+ * 				 dst: the buffer to fill.
+ * 				 size: size of dst, at least 1.
+ *
+ * Output:       None.
+ * Modifies:     dst.
+ * Returns:      Characters copied.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Stops at CR or LF and truncates to fit, dst is always terminated.
+ */
+size_t command_copy_params(const char *args, char *dst, size_t size) {
+    size_t len = strcspn(args, "\n\r");
+    if (len > size - 1) len = size - 1;
+    memcpy(dst, args, len);
+    dst[len] = '\0';
+    return len;
+}
+
+/*
+ * Name:         command_arg_long
+ * Purpose:      Parses a whole decimal integer argument within limits.
+ * Arguments:    s: the argument text, leading and trailing white space allowed.
+ * 				 min, max: the accepted range.
+ * 				 out: set to the value on success.
+ *
+ * Output:       None.
+ * Modifies:     *out on success.
+ * Returns:      0 on success, -1 with errno set to EINVAL or ERANGE otherwise.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Unlike atoi(), "" and "2X" are rejected rather than read as 0 and 2.
+ */
+int command_arg_long(const char *s, long min, long max, long *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    if (errno == ERANGE || v < min || v > max) {
+        errno = ERANGE;
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/*
+ * Name:         command_arg_double
+ * Purpose:      Parses a whole decimal number argument within limits.
+ * Arguments:    s: the argument text, leading and trailing white space allowed.
+ * 				 min, max: the accepted range.
+ * 				 out: set to the value on success.
+ *
+ * Output:       None.
+ * Modifies:     *out on success.
+ * Returns:      0 on success, -1 with errno set to EINVAL or ERANGE otherwise.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        NaN is rejected by the range check.
+ */
+int command_arg_double(const char *s, double min, double max, double *out) {
+    char *end;
+    errno = 0;
+    double v = strtod(s, &end);
+    if (end == s) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    if (errno == ERANGE || !(v >= min && v <= max)) {
+        errno = ERANGE;
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
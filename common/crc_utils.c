@@ -2,11 +2,11 @@
  * File:     crc_utils.c
  * Author:   Bruce Dearing
  * Date:     26/11/2025
- * Version:  1.0
+ * Version:  1.1
  * Purpose:  Program to declare cyclic redundancy check (CRC) helper functions for sensor emulation.
  *
- * Mods:
- *
+ * Mods:     14/10/2026 Table driven, slice-by-8 CRC-16 engine with an incremental
+ *                      init/update/final API. crc16() no longer limited to 256 bytes.
  *
  */
 
@@ -19,6 +19,158 @@
 
 #define MAX_PACKET_LENGTH 256
 
+/*
+ * CRC-16 lookup tables, generated by the compiler.
+ *
+ * Every sensor CRC in this tree is the CCITT polynomial 0x1021, MSB first, so
+ * one set of tables serves them all. crc16_table[k][i] is the CRC register
+ * contribution of byte i followed by k zero bytes, which is what slice-by-8
+ * needs to fold eight input bytes per step.
+ *
+ * A CRC is linear over XOR, so each entry is the XOR of the basis values for
+ * the bits set in i. The 64 basis values (8 bits x 8 tables) are enum
+ * constants: table 0 is eight shift/xor steps of the bit itself, table k is
+ * table k-1 advanced over one more zero byte. Nothing is computed at run time
+ * and the tables live in .rodata.
+ */
+#define CRC16_POLY 0x1021
+
+#define CRC_STEP(c) ((uint16_t)(((c) << 1) ^ (((c) & 0x8000) ? CRC16_POLY : 0)))
+#define CRC_BYTE(c) CRC_STEP(CRC_STEP(CRC_STEP(CRC_STEP(CRC_STEP(CRC_STEP(CRC_STEP(CRC_STEP(c))))))))
+
+#define CRC_BASIS_ROW(k, p) \
+    CRC16_B##k##_0 = CRC_BYTE(CRC16_B##p##_0), CRC16_B##k##_1 = CRC_BYTE(CRC16_B##p##_1), \
+    CRC16_B##k##_2 = CRC_BYTE(CRC16_B##p##_2), CRC16_B##k##_3 = CRC_BYTE(CRC16_B##p##_3), \
+    CRC16_B##k##_4 = CRC_BYTE(CRC16_B##p##_4), CRC16_B##k##_5 = CRC_BYTE(CRC16_B##p##_5), \
+    CRC16_B##k##_6 = CRC_BYTE(CRC16_B##p##_6), CRC16_B##k##_7 = CRC_BYTE(CRC16_B##p##_7)
+
+enum {
+    CRC16_B0_0 = CRC_BYTE(0x0100), CRC16_B0_1 = CRC_BYTE(0x0200),
+    CRC16_B0_2 = CRC_BYTE(0x0400), CRC16_B0_3 = CRC_BYTE(0x0800),
+    CRC16_B0_4 = CRC_BYTE(0x1000), CRC16_B0_5 = CRC_BYTE(0x2000),
+    CRC16_B0_6 = CRC_BYTE(0x4000), CRC16_B0_7 = CRC_BYTE(0x8000),
+    CRC_BASIS_ROW(1, 0), CRC_BASIS_ROW(2, 1), CRC_BASIS_ROW(3, 2), CRC_BASIS_ROW(4, 3),
+    CRC_BASIS_ROW(5, 4), CRC_BASIS_ROW(6, 5), CRC_BASIS_ROW(7, 6)
+};
+
+#define CRC_ENTRY(k, i) (uint16_t)( \
+    (((i) & 0x01) ? CRC16_B##k##_0 : 0) ^ (((i) & 0x02) ? CRC16_B##k##_1 : 0) ^ \
+    (((i) & 0x04) ? CRC16_B##k##_2 : 0) ^ (((i) & 0x08) ? CRC16_B##k##_3 : 0) ^ \
+    (((i) & 0x10) ? CRC16_B##k##_4 : 0) ^ (((i) & 0x20) ? CRC16_B##k##_5 : 0) ^ \
+    (((i) & 0x40) ? CRC16_B##k##_6 : 0) ^ (((i) & 0x80) ? CRC16_B##k##_7 : 0))
+
+#define CRC_R4(k, i)   CRC_ENTRY(k, i), CRC_ENTRY(k, (i) + 1), CRC_ENTRY(k, (i) + 2), CRC_ENTRY(k, (i) + 3)
+#define CRC_R16(k, i)  CRC_R4(k, i), CRC_R4(k, (i) + 4), CRC_R4(k, (i) + 8), CRC_R4(k, (i) + 12)
+#define CRC_R64(k, i)  CRC_R16(k, i), CRC_R16(k, (i) + 16), CRC_R16(k, (i) + 32), CRC_R16(k, (i) + 48)
+#define CRC_R256(k)    CRC_R64(k, 0), CRC_R64(k, 64), CRC_R64(k, 128), CRC_R64(k, 192)
+
+static const uint16_t crc16_table[8][256] = {
+    { CRC_R256(0) }, { CRC_R256(1) }, { CRC_R256(2) }, { CRC_R256(3) },
+    { CRC_R256(4) }, { CRC_R256(5) }, { CRC_R256(6) }, { CRC_R256(7) }
+};
+
+_Static_assert(CRC_ENTRY(0, 1) == 0x1021, "CRC-16 table generation is broken");
+
+/*
+ * Name:         crc16_raw_update
+ * Purpose:      Advances a CRC-16/CCITT register over a buffer.
+ * Arguments:    crc - the current register value.
+ *               data - the bytes to add.
+ *               length - the number of bytes.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The new register value.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Slice-by-8: eight independent table lookups per eight bytes, then a
+ *               byte-at-a-time tail. The two register bytes fold into the first two
+ *               input bytes of each block. ARMv8 CRC32 instructions only implement
+ *               the CRC-32 and CRC-32C polynomials, so there is no hardware path for
+ *               0x1021; slice-by-8 is the fast path on the Pi as well.
+ */
+static uint16_t crc16_raw_update(uint16_t crc, const uint8_t *data, size_t length) {
+    while (length >= 8) {
+        crc = crc16_table[7][data[0] ^ (crc >> 8)] ^
+              crc16_table[6][data[1] ^ (crc & 0xFF)] ^
+              crc16_table[5][data[2]] ^
+              crc16_table[4][data[3]] ^
+              crc16_table[3][data[4]] ^
+              crc16_table[2][data[5]] ^
+              crc16_table[1][data[6]] ^
+              crc16_table[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (uint16_t)((crc << 8) ^ crc16_table[0][(crc >> 8) ^ *data++]);
+    }
+    return crc;
+}
+
+/*
+ * Name:         crc16_init
+ * Purpose:      Starts an incremental CRC-16 calculation.
+ * Arguments:    ctx - the context to initialize.
+ *               variant - which sensor CRC to compute.
+ *
+ * Output:       None.
+ * Modifies:     ctx.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+void crc16_init(Crc16Context *ctx, Crc16Variant variant) {
+    if (variant == CRC16_GENIBUS) {
+        ctx->value = 0xFFFF;
+        ctx->xor_out = 0xFFFF;
+    } else {
+        ctx->value = 0x0000;
+        ctx->xor_out = 0x0000;
+    }
+}
+
+/*
+ * Name:         crc16_update
+ * Purpose:      Adds bytes to an incremental CRC-16 calculation.
+ * Arguments:    ctx - a context started with crc16_init().
+ *               data - the bytes to add.
+ *               length - the number of bytes, may be 0.
+ *
+ * Output:       None.
+ * Modifies:     ctx.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        May be called any number of times, so a frame can be checksummed
+ *               piece by piece while it is being built.
+ */
+void crc16_update(Crc16Context *ctx, const void *data, size_t length) {
+    if (data == NULL || length == 0) return;
+    ctx->value = crc16_raw_update(ctx->value, data, length);
+}
+
+/*
+ * Name:         crc16_final
+ * Purpose:      Returns the result of an incremental CRC-16 calculation.
+ * Arguments:    ctx - the context.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The CRC value.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Does not modify ctx, so a running CRC can be read and then extended.
+ */
+uint16_t crc16_final(const Crc16Context *ctx) {
+    return (uint16_t)(ctx->value ^ ctx->xor_out);
+}
+
 /*
  * Name:         crc16
  * Purpose:      Returns the CRC value of the buffer string provided.
@@ -26,30 +178,21 @@
  *               length - the length of the buffer string.
  *
  * Output:       None.
- * Modifies:     unsigned short crc.
- * Returns:      the calculated CRC value of the string provided or -1 on failure.
+ * Modifies:     None.
+ * Returns:      the calculated CRC value of the string provided or 0 on failure.
  * Assumptions:
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        CRC-16/GENIBUS (poly 0x1021, init 0xFFFF, xorout 0xFFFF) as used by
+ *               the SkyVUE8. Any length is accepted, profile messages are ~10 KB.
  */
 unsigned short crc16(char *buffer, int length) {
-	if (buffer == NULL || length <= 0 || length > MAX_PACKET_LENGTH) return 0;
-
-    unsigned short crc = 0xFFFF;
-    unsigned short m;
-    int i, j;
-
-    for (i=0; i < length; ++i) {
-        crc ^= (unsigned char)buffer[i] << 8;
-        for (j=0; j < 8; ++j) {
-            m = (crc & 0x8000) ? 0x1021 : 0;
-            crc <<= 1;
-            crc ^= m;
-        }
-    }
-    crc ^= 0xFFFF;
-    return crc;
+	if (buffer == NULL || length <= 0) return 0;
+
+    Crc16Context ctx;
+    crc16_init(&ctx, CRC16_GENIBUS);
+    crc16_update(&ctx, buffer, (size_t)length);
+    return crc16_final(&ctx);
 }
 
 /*
@@ -58,28 +201,19 @@ unsigned short crc16(char *buffer, int length) {
  * Arguments:    line_of_date - the string to calculate the CRC from.
  *
  * Output:       None.
- * Modifies:     unsigned int crc.
+ * Modifies:     None.
  * Returns:      the calculated crc value of the string provided.
  * Assumptions:
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        CRC-16/XMODEM of a NULL terminated string. The previous bitwise code
+ *               kept its register in an unsigned int and left unmasked carries above
+ *               bit 15 in the result and sign extended bytes >= 0x80, only the low
+ *               16 bits of ASCII input were ever the CRC.
  */
 unsigned int crc_ccitt(char *line_of_data) {
 	if (line_of_data == NULL) return 0;
-    unsigned int crc; // Returned CRC value
-    unsigned int i; // counter
-    crc = 0x0000;
-    size_t len = strlen(line_of_data);
-	for (i=0; i < len; i++) {
-        unsigned crc_new = (unsigned char)(crc >> 8) | (crc << 8);
-        crc_new ^= line_of_data[i];
-        crc_new ^= (unsigned char)(crc_new & 0xff) >> 4;
-        crc_new ^= crc_new << 12;
-        crc_new ^= (crc_new & 0xff) << 5;
-        crc = crc_new;
-    }
-    return (crc);
+    return crc16_raw_update(0x0000, (const uint8_t *)line_of_data, strlen(line_of_data));
 }
 
 
@@ -90,31 +224,44 @@ unsigned int crc_ccitt(char *line_of_data) {
  *				 length - the length of the string.
  *
  * Output:       None.
- * Modifies:     uint16_t crc.
+ * Modifies:     None.
  * Returns:      the calculated crc value of the string provided.
  * Assumptions:
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        CRC-16/XMODEM (poly 0x1021, init 0x0000) as used by the AtmosVue30.
  */
 uint16_t crc16_ccitt(const uint8_t *data, size_t length) {
-    uint16_t crc = 0x0000; // Initial value
+    if (data == NULL) return 0;
+    return crc16_raw_update(0x0000, data, length);
+}
 
+/*
+ * Name:         crc16_arc
+ * Purpose:      Returns the CRC-16/ARC of a buffer.
+ * Arguments:    data - the bytes to calculate the CRC from.
+ *				 length - the number of bytes.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      the calculated crc value of the buffer provided.
+ * Assumptions:
+ *
+ * Bugs:         None known.
+ * Notes:        Reflected polynomial 0xA001, init 0x0000, the CRC of SDI-12 (section 4.4.12).
+ *               Bitwise rather than from the CCITT tables above, an SDI-12 reply is
+ *               at most 80 bytes at 1200 baud.
+ */
+uint16_t crc16_arc(const uint8_t *data, size_t length) {
+    if (data == NULL) return 0;
+    uint16_t crc = 0x0000;
     for (size_t i = 0; i < length; i++) {
-        crc ^= (uint16_t)data[i] << 8;
-
-        for (int j = 0; j < 8; j++) {
-            if (crc & 0x8000) {
-                crc = (crc << 1) ^ 0x1021;
-            } else {
-                crc <<= 1;
-            }
-        }
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ 0xA001) : (uint16_t)(crc >> 1);
     }
     return crc;
 }
 
-
 /*
  * Name:         checksum_m256
  * Purpose:      Takes a  string, and returns a checksum of the characters XOR.
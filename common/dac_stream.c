@@ -0,0 +1,322 @@
+/*
+ * File:     dac_stream.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  MCP4728 waveform streaming engine, see dac_stream.h.
+ *
+ *           MCP4728 multi-write, per channel:
+ *             0 1 0 0 0 DAC1 DAC0 UDAC | VREF PD1 PD0 Gx D11..D8 | D7..D0
+ *           With UDAC set the input registers load but the outputs hold until
+ *           a general call software update (address 0x00, byte 0x08), which
+ *           moves every channel of every MCP4728 on the bus at once.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "dac_stream.h"
+#include "console_utils.h"
+#include "metrics_utils.h"
+
+#define MCP4728_MULTI_WRITE 0x40
+#define MCP4728_UDAC        0x01
+#define MCP4728_VREF_INT    0x80 // VREF=1 internal 2.048 V, PD=00 normal, Gx=0 gain 1, as update_dac_channel().
+#define I2C_GENERAL_CALL    0x00
+#define GC_SOFTWARE_UPDATE  0x08
+
+static const uint8_t software_update = GC_SOFTWARE_UPDATE;
+
+/*
+ * Name:         encode_segment
+ * Purpose:      Pre-encodes every tick of the ramp from samples[s->sample] to the next sample.
+ * Arguments:    s: the stream.
+ *
+ * Output:       None.
+ * Modifies:     s->frames, s->tick reset to 0, s->stats.segments.
+ * Returns:      None.
+ * Assumptions:  s->frames holds ticks_per_sample frames.
+ *
+ * Bugs:         None known.
+ * Notes:        Tick j of n is a + (b - a) * j / n rounded, so the first tick
+ * 				 is exactly sample a and the ramp reaches b on the first tick of
+ * 				 the next segment. The last sample ramps back to the first, as
+ * 				 the data file wraps.
+ */
+static void encode_segment(DacStream *s) {
+    const DacSample *a = &s->samples[s->sample];
+    const DacSample *b = &s->samples[(s->sample + 1) % s->sample_count];
+    int64_t n = s->ticks_per_sample;
+    uint8_t udac = s->latch ? MCP4728_UDAC : 0;
+
+    for (int64_t j = 0; j < n; j++) {
+        uint8_t *f = s->frames + (size_t)j * s->frame_size;
+        for (unsigned ch = 0; ch < s->channels; ch++) {
+            int64_t from = a->code[ch], to = b->code[ch];
+            int64_t v = from + ((to - from) * j * 2 + (to >= from ? n : -n)) / (2 * n);
+            f[0] = (uint8_t)(MCP4728_MULTI_WRITE | (ch << 1) | udac);
+            f[1] = (uint8_t)(MCP4728_VREF_INT | ((v >> 8) & 0x0F));
+            f[2] = (uint8_t)(v & 0xFF);
+            f += DAC_STREAM_BYTES_PER_CHANNEL;
+        }
+    }
+    s->tick = 0;
+    s->stats.segments++;
+}
+
+/*
+ * Name:         write_tick
+ * Purpose:      Sends one pre-encoded tick, and the latch, in a single I2C_RDWR.
+ * Arguments:    s: the stream.
+ * 				 frame: the tick's multi-write.
+ *
+ * Output:       None.
+ * Modifies:     The DAC, s->stats.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The two messages go out with a repeated start, so no other
+ * 				 master can slip in between the write and the update.
+ */
+static void write_tick(DacStream *s, const uint8_t *frame) {
+    struct i2c_msg msgs[2] = {
+        { .addr = s->addr, .flags = 0, .len = (uint16_t)s->frame_size, .buf = (uint8_t *)frame },
+        { .addr = I2C_GENERAL_CALL, .flags = 0, .len = 1, .buf = (uint8_t *)&software_update },
+    };
+    struct i2c_rdwr_ioctl_data xfer = { .msgs = msgs, .nmsgs = s->latch ? 2 : 1 };
+    if (ioctl(s->fd, I2C_RDWR, &xfer) < 0) {
+        if (s->stats.errors++ == 0) safe_console_error("DAC write failed: %s\n", strerror(errno)); // Once, not every tick.
+    } else {
+        s->stats.updates++;
+        metrics_count(METRIC_FRAMES_SENT, 1);
+        metrics_count(METRIC_BYTES_WRITTEN, s->frame_size + (s->latch ? 1 : 0));
+    }
+}
+
+/*
+ * Name:         dac_stream_init
+ * Purpose:      Prepares a stream over a set of samples and encodes its first segment.
+ * Arguments:    s: the stream.
+ * 				 fd: open i2c-dev adapter, not closed by the stream.
+ * 				 addr: 7-bit DAC address.
+ * 				 channels: channels written each tick, 1-4, from A.
+ * 				 samples: one entry per data file line, copied.
+ * 				 sample_count: entries in samples, at least 1.
+ * 				 sample_period_s: time from one sample to the next.
+ * 				 rate_hz: DAC updates per second, 1-DAC_STREAM_MAX_RATE_HZ.
+ * 				 latch: update the channels together with a general call.
+ *
+ * Output:       None.
+ * Modifies:     s.
+ * Returns:      0 on success, -1 with errno set on failure.
+ * Assumptions:  No thread is using s.
+ *
+ * Bugs:         None known.
+ * Notes:        Codes above DAC_STREAM_CODE_MAX are clamped. A sample period
+ * 				 shorter than the update interval still gives one tick per sample.
+ */
+int dac_stream_init(DacStream *s, int fd, uint16_t addr, unsigned channels, const DacSample *samples,
+                    size_t sample_count, double sample_period_s, unsigned rate_hz, bool latch) {
+    memset(s, 0, sizeof(*s));
+    s->schedule = (SendSchedule)SCHEDULE_INITIALIZER;
+    s->fd = fd;
+    s->addr = addr;
+    s->channels = channels;
+    s->latch = latch;
+
+    if (fd < 0 || channels == 0 || channels > DAC_STREAM_CHANNELS || sample_count == 0 ||
+        !(sample_period_s > 0.0) || rate_hz == 0 || rate_hz > DAC_STREAM_MAX_RATE_HZ) {
+        errno = EINVAL;
+        return -1;
+    }
+    double ticks = sample_period_s * rate_hz + 0.5;
+    if (ticks > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    s->ticks_per_sample = ticks < 1.0 ? 1 : (uint32_t)ticks;
+    s->interval_ns = (uint64_t)(SCHED_NS_PER_SEC / rate_hz);
+    s->frame_size = (size_t)channels * DAC_STREAM_BYTES_PER_CHANNEL;
+    s->sample_count = sample_count;
+    s->samples = malloc(sample_count * sizeof(DacSample));
+    s->frames = malloc((size_t)s->ticks_per_sample * s->frame_size);
+    if (!s->samples || !s->frames || schedule_init(&s->schedule, SCHEDULE_SKIP) != 0) {
+        int saved = errno;
+        dac_stream_destroy(s);
+        errno = saved;
+        return -1;
+    }
+    for (size_t i = 0; i < sample_count; i++) {
+        for (unsigned ch = 0; ch < DAC_STREAM_CHANNELS; ch++) {
+            uint16_t c = samples[i].code[ch];
+            s->samples[i].code[ch] = c > DAC_STREAM_CODE_MAX ? DAC_STREAM_CODE_MAX : c;
+        }
+    }
+    encode_segment(s);
+    return 0;
+}
+
+/*
+ * Name:         dac_stream_set_feed
+ * Purpose:      Makes a stream take its samples from a live source.
+ * Arguments:    s: a stream from dac_stream_init(), given two samples.
+ * 				 feed: called for the next sample each time a segment ends.
+ * 				 ctx: passed to feed.
+ *
+ * Output:       None.
+ * Modifies:     s.
+ * Returns:      0 on success, -1 with errno EINVAL if s holds fewer than two samples.
+ * Assumptions:  Called before dac_stream_run().
+ *
+ * Bugs:         None known.
+ * Notes:        The stream ramps from samples[0] to samples[1]. At the end of
+ * 				 each segment samples[1] becomes samples[0] and feed supplies the
+ * 				 new samples[1], so the output follows the source one sample
+ * 				 period behind. feed runs on the DAC thread between two ticks and
+ * 				 must not block.
+ */
+int dac_stream_set_feed(DacStream *s, DacFeedFn feed, void *ctx) {
+    if (s->sample_count < 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    s->feed = feed;
+    s->feed_ctx = ctx;
+    s->sample = 0;
+    return 0;
+}
+
+/*
+ * Name:         feed_next
+ * Purpose:      Moves a fed stream on by one sample.
+ * Arguments:    s: a stream with a feed.
+ *
+ * Returns:      None.
+ */
+static void feed_next(DacStream *s) {
+    DacSample next;
+    s->samples[0] = s->samples[1];
+    if (!s->feed(&next, s->feed_ctx)) return; // Held, the next segment is flat.
+    for (unsigned ch = 0; ch < DAC_STREAM_CHANNELS; ch++) {
+        s->samples[1].code[ch] = next.code[ch] > DAC_STREAM_CODE_MAX ? DAC_STREAM_CODE_MAX : next.code[ch];
+    }
+}
+
+/*
+ * Name:         dac_stream_run
+ * Purpose:      Streams the waveform until stop is set, the body of the DAC thread.
+ * Arguments:    s: the stream.
+ * 				 stop: the program's terminate flag.
+ *
+ * Output:       DAC updates.
+ * Modifies:     The DAC, s.
+ * Returns:      When stop is set and dac_stream_wake() has been called.
+ * Assumptions:  dac_stream_init() succeeded. Called from one thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Missed ticks are skipped, not sent late, and the ramp moves on
+ * 				 by the same number of ticks, so the waveform stays on time. The
+ * 				 next segment is encoded right after the last tick of the
+ * 				 current one, well inside the following interval.
+ */
+void dac_stream_run(DacStream *s, volatile sig_atomic_t *stop) {
+    schedule_start(&s->schedule, s->interval_ns);
+    uint64_t skipped = s->schedule.stats.skipped;
+
+    while (!*stop) {
+        ScheduleEvent ev = schedule_wait(&s->schedule);
+        if (ev == SCHEDULE_ERROR) {
+            safe_console_error("DAC schedule failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ev != SCHEDULE_TICK) continue;
+
+        write_tick(s, s->frames + (size_t)s->tick * s->frame_size);
+
+        uint64_t advance = 1 + (s->schedule.stats.skipped - skipped);
+        skipped = s->schedule.stats.skipped;
+        uint64_t pos = s->tick + advance;
+        if (pos < s->ticks_per_sample) {
+            s->tick = (uint32_t)pos;
+            continue;
+        }
+        if (s->feed) {
+            feed_next(s); // Once however many segments were missed, the source has only its latest.
+        } else {
+            s->sample = (size_t)((s->sample + pos / s->ticks_per_sample) % s->sample_count);
+        }
+        encode_segment(s);
+        s->tick = (uint32_t)(pos % s->ticks_per_sample);
+    }
+    schedule_stop(&s->schedule);
+}
+
+/*
+ * Name:         dac_stream_wake
+ * Purpose:      Interrupts the DAC thread's wait, so it sees stop.
+ * Arguments:    s: the stream.
+ *
+ * Output:       None.
+ * Modifies:     The schedule's eventfd.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe from any thread, and before dac_stream_init().
+ */
+void dac_stream_wake(DacStream *s) {
+    schedule_wake(&s->schedule);
+}
+
+/*
+ * Name:         dac_stream_report
+ * Purpose:      Prints the update counts and the schedule's lateness to the console.
+ * Arguments:    s: the stream.
+ * 				 name: prefix for the lines, usually program_name.
+ *
+ * Output:       Two lines on stdout, nothing if no tick was sent.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  The DAC thread has stopped.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void dac_stream_report(const DacStream *s, const char *name) {
+    if (s->stats.updates + s->stats.errors == 0) return;
+    safe_console_print("%s: %llu DAC updates, %llu failed, %llu segments, %u channels %s\n",
+                       name, (unsigned long long)s->stats.updates, (unsigned long long)s->stats.errors,
+                       (unsigned long long)s->stats.segments, s->channels, s->latch ? "latched together" : "unlatched");
+    schedule_report(&s->schedule, name);
+}
+
+/*
+ * Name:         dac_stream_destroy
+ * Purpose:      Frees the stream's buffers and closes its schedule.
+ * Arguments:    s: the stream.
+ *
+ * Output:       None.
+ * Modifies:     s.
+ * Returns:      None.
+ * Assumptions:  The DAC thread has stopped.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe on a stream whose dac_stream_init() failed. The adapter
+ * 				 descriptor belongs to the caller and stays open.
+ */
+void dac_stream_destroy(DacStream *s) {
+    free(s->samples);
+    free(s->frames);
+    s->samples = NULL;
+    s->frames = NULL;
+    schedule_destroy(&s->schedule);
+}
@@ -5,7 +5,12 @@
  * Version:  1.0
  * Purpose:  Program to declare helper functions for sensor initialization for barometric sensor emulation.
  *
- * Mods:
+ * Mods:     14/10/2026 Added advance_send_time() so interval sends no longer drift.
+ *           14/10/2026 Pressure compensation engine over the coefficient table,
+ *           SSE2/NEON Horner evaluation batched over the bus, and its inverse
+ *           for the simulated diaphragm frequency.
+ *           14/10/2026 WX_FIXED_POINT builds compensate in q1_31 through the
+ *           block Horner kernels.
  *
  *
  */
@@ -18,14 +23,36 @@
 #include <regex.h>
 #include <time.h>
 #include <ctype.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "dsp8100_utils.h"
+#ifdef WX_FIXED_POINT
+#include "q1_31_utils.h"
+#endif
 
 
 
 #define MAX_TOKENS 32
 #define DT_STRING 7
 char units_of_measure[25][50]; // Global array to hold the units of measurement available.
-double coefficients[58]; // Global array to hold K coefficients of float values.
+double coefficients[DSP8100_COEFFICIENTS]; // Global array to hold K coefficients of float values.
+
+#define COEF_F0 0   // Reference diaphragm frequency, Hz.
+#define COEF_V0 1   // Reference diode voltage, V.
+#define COEF_K 2    // First of the K(i,j) surface, row i by row.
+#define NEWTON_MAX_STEPS 8
+#define NEWTON_TOLERANCE 1.0E-9 // mbar
+
+#ifdef WX_FIXED_POINT
+#define FIXED_X_RANGE (1.0 / 16.0) // x is kept as x / FIXED_X_RANGE, f0 +-6.25%.
+#define FIXED_Y_RANGE 0.25         // y as y / FIXED_Y_RANGE, V0 +-0.25 V.
+#define FIXED_P_RANGE 2048.0       // Pressure as P / FIXED_P_RANGE, 1E-6 mbar a step.
+static q1_31 coefficients_q[DSP8100_F_TERMS * DSP8100_V_TERMS]; // The K surface in those units.
+#endif
 
 
 /*
@@ -39,29 +66,211 @@ double coefficients[58]; // Global array to hold K coefficients of float values.
  * Assumptions:  coefficients has been allocated.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The layout is f0, V0, then K(i,j) for i = 0-7 and j = 0-6, see
+ *               dsp8100_compensate(). The surface spans 600-1100 mbar over
+ *               f0 +-4%, and rises with frequency everywhere from -40 to +85 C.
  */
 void init_coefficients() {
-    coefficients[0] = 9.173625E+02; coefficients[1] = -8.654275E-02; coefficients[2] = 3.705644E-05;
-    coefficients[3] = 9.173625E+02; coefficients[4] = 9.173625E+02; coefficients[5] = 9.173625E+02;
-    coefficients[6] = 9.173625E+02; coefficients[7] = 9.173625E+02; coefficients[8] = 9.173625E+02;
-    coefficients[9] = 9.173625E+02; coefficients[10] = 9.173625E+02; coefficients[11] = 9.173625E+02;
-    coefficients[12] = 9.173625E+02; coefficients[13] = 9.173625E+02; coefficients[14] = 9.173625E+02;
-    coefficients[15] = 9.173625E+02; coefficients[16] = 9.173625E+02; coefficients[17] = 9.173625E+02;
-    coefficients[18] = 9.173625E+02; coefficients[19] = 9.173625E+02; coefficients[20] = 9.173625E+02;
-    coefficients[21] = 9.173625E+02; coefficients[22] = 9.173625E+02; coefficients[23] = 9.173625E+02;
-    coefficients[24] = 9.173625E+02; coefficients[25] = 9.173625E+02; coefficients[26] = 9.173625E+02;
-    coefficients[27] = 9.173625E+02; coefficients[28] = 9.173625E+02; coefficients[29] = 9.173625E+02;
-    coefficients[30] = 9.173625E+02; coefficients[31] = 9.173625E+02; coefficients[32] = 9.173625E+02;
-    coefficients[33] = 9.173625E+02; coefficients[34] = 9.173625E+02; coefficients[35] = 9.173625E+02;
-    coefficients[36] = 9.173625E+02; coefficients[37] = 9.173625E+02; coefficients[38] = 9.173625E+02;
-    coefficients[39] = 9.173625E+02; coefficients[40] = 9.173625E+02; coefficients[41] = 9.173625E+02;
-    coefficients[42] = 9.173625E+02; coefficients[43] = 9.173625E+02; coefficients[44] = 9.173625E+02;
-    coefficients[45] = 9.173625E+02; coefficients[46] = 9.173625E+02; coefficients[47] = 9.173625E+02;
-    coefficients[48] = 9.173625E+02; coefficients[49] = 9.173625E+02; coefficients[50] = 9.173625E+02;
-    coefficients[51] = 9.173625E+02; coefficients[52] = 9.173625E+02; coefficients[53] = 9.173625E+02;
-    coefficients[54] = 9.173625E+02; coefficients[55] = 9.173625E+02; coefficients[56] = 9.173625E+02;
-    coefficients[57] = 9.173625E+02;
+    coefficients[0] = 2.950000E+04; coefficients[1] = 6.000000E-01; coefficients[2] = 8.500000E+02;
+    coefficients[3] = 4.200000E+00; coefficients[4] = -1.150000E+01; coefficients[5] = 1.800000E+01;
+    coefficients[6] = -2.500000E+01; coefficients[7] = 3.000000E+01; coefficients[8] = -3.500000E+01;
+    coefficients[9] = 6.250000E+03; coefficients[10] = -1.443750E+01; coefficients[11] = 6.187500E+00;
+    coefficients[12] = -2.750000E+00; coefficients[13] = 1.237500E+00; coefficients[14] = -5.500000E-01;
+    coefficients[15] = 2.062500E-01; coefficients[16] = 2.100000E+04; coefficients[17] = -5.292000E+01;
+    coefficients[18] = 2.268000E+01; coefficients[19] = -1.008000E+01; coefficients[20] = 4.536000E+00;
+    coefficients[21] = -2.016000E+00; coefficients[22] = 7.560000E-01; coefficients[23] = -3.500000E+04;
+    coefficients[24] = 9.555000E+01; coefficients[25] = -4.095000E+01; coefficients[26] = 1.820000E+01;
+    coefficients[27] = -8.190000E+00; coefficients[28] = 3.640000E+00; coefficients[29] = -1.365000E+00;
+    coefficients[30] = 1.200000E+05; coefficients[31] = -3.528000E+02; coefficients[32] = 1.512000E+02;
+    coefficients[33] = -6.720000E+01; coefficients[34] = 3.024000E+01; coefficients[35] = -1.344000E+01;
+    coefficients[36] = 5.040000E+00; coefficients[37] = -4.000000E+05; coefficients[38] = 1.260000E+03;
+    coefficients[39] = -5.400000E+02; coefficients[40] = 2.400000E+02; coefficients[41] = -1.080000E+02;
+    coefficients[42] = 4.800000E+01; coefficients[43] = -1.800000E+01; coefficients[44] = 1.100000E+06;
+    coefficients[45] = -3.696000E+03; coefficients[46] = 1.584000E+03; coefficients[47] = -7.040000E+02;
+    coefficients[48] = 3.168000E+02; coefficients[49] = -1.408000E+02; coefficients[50] = 5.280000E+01;
+    coefficients[51] = -3.000000E+06; coefficients[52] = 1.071000E+04; coefficients[53] = -4.590000E+03;
+    coefficients[54] = 2.040000E+03; coefficients[55] = -9.180000E+02; coefficients[56] = 4.080000E+02;
+    coefficients[57] = -1.530000E+02;
+
+#ifdef WX_FIXED_POINT
+    // K(i,j) * FIXED_X_RANGE^i * FIXED_Y_RANGE^j / FIXED_P_RANGE, so every partial sum stays inside +-1.
+    for (int i = 0; i < DSP8100_F_TERMS; i++) {
+        for (int j = 0; j < DSP8100_V_TERMS; j++) {
+            double k = coefficients[COEF_K + i * DSP8100_V_TERMS + j];
+            coefficients_q[i * DSP8100_V_TERMS + j] = q1_sat_from_double(k * pow(FIXED_X_RANGE, i) * pow(FIXED_Y_RANGE, j) / FIXED_P_RANGE);
+        }
+    }
+#endif
+}
+
+/*
+ * Name:         surface_point
+ * Purpose:      Evaluates the K(i,j) surface and its slope in x at one point, by Horner's rule.
+ * Arguments:    k - The surface, DSP8100_F_TERMS rows of DSP8100_V_TERMS.
+ *               x - Normalised frequency, f / f0 - 1.
+ *               y - Diode voltage offset, V - V0.
+ *               slope - Receives dP/dx, may be NULL.
+ * Output:       NIL.
+ * Returns:      The pressure.
+ * Modifies:     slope.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Each row is a polynomial in y, and the rows are the coefficients
+ *               of a polynomial in x.
+ */
+static double surface_point(const double *k, double x, double y, double *slope) {
+    double p = 0.0, dp = 0.0;
+    for (int i = DSP8100_F_TERMS - 1; i >= 0; i--) {
+        const double *row = k + i * DSP8100_V_TERMS;
+        double r = row[DSP8100_V_TERMS - 1];
+        for (int j = DSP8100_V_TERMS - 2; j >= 0; j--) r = r * y + row[j];
+        dp = dp * x + p;
+        p = p * x + r;
+    }
+    if (slope) *slope = dp;
+    return p;
+}
+
+#ifdef WX_FIXED_POINT
+/*
+ * Name:         compensate_fixed
+ * Purpose:      dsp8100_compensate() in q1_31, Q1_BLOCK readings a pass.
+ * Arguments:    As dsp8100_compensate().
+ * Returns:      NIL.
+ * Notes:        Each row of the surface is a q1_block_horner() in y, and the rows
+ *               are folded into the pressure by q1_block_mac_sat() in x. Agrees
+ *               with the double engine to a few 1E-6 mbar.
+ */
+static void compensate_fixed(const double *coef, const double *freq, const double *volt, double *pressure, size_t n) {
+    const double x_scale = 1.0 / (coef[COEF_F0] * FIXED_X_RANGE);
+    q1_31 x[Q1_BLOCK], y[Q1_BLOCK], row[Q1_BLOCK], p[Q1_BLOCK];
+
+    for (size_t done = 0; done < n; done += Q1_BLOCK) {
+        size_t count = n - done < Q1_BLOCK ? n - done : Q1_BLOCK;
+        for (size_t i = 0; i < count; i++) {
+            x[i] = q1_sat_from_double((freq[done + i] - coef[COEF_F0]) * x_scale);
+            y[i] = q1_sat_from_double((volt[done + i] - coef[COEF_V0]) / FIXED_Y_RANGE);
+        }
+        q1_block_horner(coefficients_q + (DSP8100_F_TERMS - 1) * DSP8100_V_TERMS, DSP8100_V_TERMS, y, p, count);
+        for (int a = DSP8100_F_TERMS - 2; a >= 0; a--) {
+            q1_block_horner(coefficients_q + a * DSP8100_V_TERMS, DSP8100_V_TERMS, y, row, count);
+            q1_block_mac_sat(p, x, row, count);
+        }
+        for (size_t i = 0; i < count; i++) pressure[done + i] = q1_to_double(p[i]) * FIXED_P_RANGE;
+    }
+}
+#endif
+
+/*
+ * Name:         dsp8100_compensate
+ * Purpose:      Converts a block of raw readings to pressure through the coefficient surface.
+ * Arguments:    coef - The DSP8100_COEFFICIENTS table, as init_coefficients() fills it.
+ *               freq - Diaphragm frequencies, Hz.
+ *               volt - Diode voltages, V.
+ *               pressure - Receives the pressures, mbar, may not overlap the inputs.
+ *               n - Number of readings.
+ * Output:       NIL.
+ * Returns:      NIL.
+ * Modifies:     pressure[0..n).
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        P = sum K(i,j) x^i y^j with x = f / f0 - 1 and y = V - V0, 56 multiply
+ *               and adds a reading. SSE2 or NEON takes two readings per step, with
+ *               each coefficient broadcast once for both, and a scalar pass does an
+ *               odd one out. The sums are done in the same order on every path.
+ *               Built with WX_FIXED_POINT it is compensate_fixed() instead, on
+ *               the surface init_coefficients() scaled, coef giving f0 and V0.
+ */
+void dsp8100_compensate(const double *coef, const double *freq, const double *volt, double *pressure, size_t n) {
+#ifdef WX_FIXED_POINT
+    compensate_fixed(coef, freq, volt, pressure, n);
+#else
+    const double *k = coef + COEF_K;
+    const double inv_f0 = 1.0 / coef[COEF_F0];
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128d f0 = _mm_set1_pd(coef[COEF_F0]), v0 = _mm_set1_pd(coef[COEF_V0]), scale = _mm_set1_pd(inv_f0);
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(freq + i), f0), scale);
+        __m128d y = _mm_sub_pd(_mm_loadu_pd(volt + i), v0);
+        __m128d p = _mm_setzero_pd();
+        for (int a = DSP8100_F_TERMS - 1; a >= 0; a--) {
+            const double *row = k + a * DSP8100_V_TERMS;
+            __m128d r = _mm_set1_pd(row[DSP8100_V_TERMS - 1]);
+            for (int b = DSP8100_V_TERMS - 2; b >= 0; b--) r = _mm_add_pd(_mm_mul_pd(r, y), _mm_set1_pd(row[b]));
+            p = _mm_add_pd(_mm_mul_pd(p, x), r);
+        }
+        _mm_storeu_pd(pressure + i, p);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t f0 = vdupq_n_f64(coef[COEF_F0]), v0 = vdupq_n_f64(coef[COEF_V0]), scale = vdupq_n_f64(inv_f0);
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t x = vmulq_f64(vsubq_f64(vld1q_f64(freq + i), f0), scale);
+        float64x2_t y = vsubq_f64(vld1q_f64(volt + i), v0);
+        float64x2_t p = vdupq_n_f64(0.0);
+        for (int a = DSP8100_F_TERMS - 1; a >= 0; a--) {
+            const double *row = k + a * DSP8100_V_TERMS;
+            float64x2_t r = vdupq_n_f64(row[DSP8100_V_TERMS - 1]);
+            for (int b = DSP8100_V_TERMS - 2; b >= 0; b--) r = vaddq_f64(vmulq_f64(r, y), vdupq_n_f64(row[b]));
+            p = vaddq_f64(vmulq_f64(p, x), r);
+        }
+        vst1q_f64(pressure + i, p);
+    }
+#endif
+    for (; i < n; i++) {
+        pressure[i] = surface_point(k, (freq[i] - coef[COEF_F0]) * inv_f0, volt[i] - coef[COEF_V0], NULL);
+    }
+#endif
+}
+
+/*
+ * Name:         dsp8100_raw_frequency
+ * Purpose:      Finds the diaphragm frequency that reads as a pressure at a diode voltage.
+ * Arguments:    coef - The DSP8100_COEFFICIENTS table.
+ *               pressure - The pressure wanted, mbar.
+ *               volt - The diode voltage, V.
+ * Output:       NIL.
+ * Returns:      The frequency, Hz.
+ * Modifies:     NIL.
+ * Assumptions:  The surface rises with frequency, as init_coefficients() sets it.
+ *
+ * Bugs:         None known.
+ * Notes:        Newton's method from the linear term; three or four steps reach
+ *               NEWTON_TOLERANCE inside the range. dsp8100_compensate() of the
+ *               result gives pressure back, so a host that compensates the raw
+ *               output itself sees the same reading as R.
+ */
+double dsp8100_raw_frequency(const double *coef, double pressure, double volt) {
+    const double *k = coef + COEF_K;
+    const double y = volt - coef[COEF_V0];
+    double x = (pressure - k[0]) / k[DSP8100_V_TERMS];
+
+    for (int step = 0; step < NEWTON_MAX_STEPS; step++) {
+        double slope;
+        double error = surface_point(k, x, y, &slope) - pressure;
+        if (fabs(error) < NEWTON_TOLERANCE || slope <= 0.0) break;
+        x -= error / slope;
+    }
+    return coef[COEF_F0] * (1.0 + x);
+}
+
+/*
+ * Name:         dsp8100_diode_voltage
+ * Purpose:      The simulated temperature diode's voltage.
+ * Arguments:    temperature - Transducer temperature, degrees C.
+ * Output:       NIL.
+ * Returns:      The voltage, V.
+ * Modifies:     NIL.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A silicon diode, linear at DSP8100_DIODE_V_PER_C.
+ */
+double dsp8100_diode_voltage(double temperature) {
+    return DSP8100_DIODE_V25 + DSP8100_DIODE_V_PER_C * (temperature - 25.0);
 }
 
 
@@ -108,6 +317,10 @@ int init_sensor(bp_sensor **ptr) {
     (*ptr)->set_point = 0.0f; //
     (*ptr)->pin = 0; //
     (*ptr)->pin_set = false; //
+    (*ptr)->current_pressure = 0.0f;
+    (*ptr)->current_temperature = 20.0f; // Transducer temperature, sets the simulated diode voltage.
+    (*ptr)->diode_voltage = dsp8100_diode_voltage((*ptr)->current_temperature);
+    (*ptr)->raw_frequency = 0.0;
 
 
     // Initialize the timer
@@ -209,3 +422,32 @@ bool is_ready_to_send(bp_sensor *s) {
 
     return (elapsed >= (double)s->transmission_interval);
 }
+
+/*
+ * Name:         advance_send_time
+ * Purpose:      Moves a sensor's send window on by one interval after it sends.
+ * Arguments:    s: the sensor which has just sent.
+ *
+ * Output:       None.
+ * Modifies:     s->last_send_time.
+ * Returns:      None.
+ * Assumptions:  is_ready_to_send(s) returned true.
+ *
+ * Bugs:         None known.
+ * Notes:        The window follows the previous window rather than the time of
+ * 				 the send, so the 10ms polling of the sender does not add up as
+ * 				 drift. A sensor more than an interval behind (a new interval, or
+ * 				 a stalled sender) restarts from now instead of sending a burst.
+ */
+void advance_send_time(bp_sensor *s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t step = (int64_t)((double)s->transmission_interval * 1.0e9);
+    int64_t next = (int64_t)s->last_send_time.tv_sec * 1000000000LL + s->last_send_time.tv_nsec + step;
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (now_ns - next >= step) next = now_ns;
+
+    s->last_send_time.tv_sec = (time_t)(next / 1000000000LL);
+    s->last_send_time.tv_nsec = (long)(next % 1000000000LL);
+}
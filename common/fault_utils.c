@@ -0,0 +1,486 @@
+/*
+ * File:     fault_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  The WX_FAULTS list, the faults themselves and the SIGUSR2 watcher,
+ *           see fault_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "fault_utils.h"
+#include "storm_utils.h"
+#include "metrics_utils.h"
+
+#define FAULT_FILE_MAX 4096             // Longest @FILE read.
+#define ETX 0x03
+#define EOT 0x04
+
+// The last clean message sent on a port, repeated while the port is stuck.
+typedef struct {
+    int fd;
+    size_t len;
+    unsigned stuck_left;                // Messages still to be replaced by last.
+    char last[FAULT_MAX_MESSAGE];
+} FaultPort;
+
+static const char *const fault_names[FAULT_KINDS] = {
+    [FAULT_DROP]     = "drop",
+    [FAULT_TRUNCATE] = "truncate",
+    [FAULT_ETX]      = "etx",
+    [FAULT_CHECKSUM] = "checksum",
+    [FAULT_FLIP]     = "flip",
+    [FAULT_DELAY]    = "delay",
+    [FAULT_STUCK]    = "stuck",
+};
+
+atomic_bool fault_on = false;
+
+static pthread_mutex_t fault_mutex = PTHREAD_MUTEX_INITIALIZER; // The config, the RNG and the ports.
+static FaultConfig config;
+static StormRng rng;
+static FaultPort *ports[FAULT_MAX_PORTS];
+
+static bool fault_started = false;
+static const char *fault_file = NULL;  // @FILE, re-read on SIGUSR2, NULL for an inline list.
+static FaultConfig inline_config;      // The inline list, SIGUSR2 turns it off and on.
+static int usr2_fd = -1;               // signalfd for SIGUSR2.
+static int wake_fd = -1;               // eventfd, stops the watcher.
+static pthread_t watcher;
+static bool watcher_started = false;
+
+/*
+ * Name:         fault_parse
+ * Purpose:      Reads a WX_FAULTS list.
+ * Arguments:    spec: the list, e.g. "checksum=0.01,delay=0.05,delay_ms=800,seed=7".
+ *               config: filled in.
+ *
+ * Output:       An error message to stderr for a bad entry.
+ * Modifies:     config.
+ * Returns:      0 on success, -1 if any entry is bad, config is then all off.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Entries are separated by commas or white space, and '#' starts a
+ *               comment that runs to the end of its line. An empty list is valid
+ *               and sets no fault. Without a seed= one is taken from the clock.
+ */
+int fault_parse(const char *spec, FaultConfig *config) {
+    char buf[FAULT_FILE_MAX];
+    char *save = NULL;
+    bool seeded = false;
+
+    memset(config, 0, sizeof(FaultConfig));
+    config->delay_ms = FAULT_DELAY_MS;
+    config->stuck_frames = FAULT_STUCK_FRAMES;
+
+    if (strlen(spec) >= sizeof(buf)) {
+        fprintf(stderr, "%s: longer than %d bytes\n", FAULT_ENV, FAULT_FILE_MAX - 1);
+        return -1;
+    }
+    strcpy(buf, spec);
+    for (char *hash = strchr(buf, '#'); hash; hash = strchr(hash, '#')) {
+        while (*hash && *hash != '\n') *hash++ = ' ';
+    }
+
+    for (char *entry = strtok_r(buf, ", \t\r\n", &save); entry; entry = strtok_r(NULL, ", \t\r\n", &save)) {
+        char *value = strchr(entry, '=');
+        char *end = NULL;
+        if (!value || value[1] == '\0') {
+            value = NULL; // Shown as written.
+            goto bad;
+        }
+        *value++ = '\0';
+        errno = 0;
+
+        if (strcasecmp(entry, "seed") == 0) {
+            config->seed = strtoull(value, &end, 0);
+            seeded = true;
+        } else if (strcasecmp(entry, "delay_ms") == 0 || strcasecmp(entry, "stuck_frames") == 0) {
+            unsigned long n = strtoul(value, &end, 10);
+            if (n == 0 || n > 3600000UL) goto bad;
+            *(strcasecmp(entry, "delay_ms") == 0 ? &config->delay_ms : &config->stuck_frames) = (unsigned)n;
+        } else {
+            int kind = 0;
+            while (kind < FAULT_KINDS && strcasecmp(entry, fault_names[kind]) != 0) kind++;
+            if (kind == FAULT_KINDS) goto bad;
+            double rate = strtod(value, &end);
+            if (!(rate >= 0.0 && rate <= 1.0)) goto bad;
+            config->rate[kind] = rate;
+        }
+        if (errno != 0 || *end != '\0') goto bad;
+        continue;
+
+    bad:
+        fprintf(stderr, "%s: bad entry \"%s%s%s\", expected NAME=PROBABILITY with NAME one of "
+                "drop, truncate, etx, checksum, flip, delay, stuck, or delay_ms=MS, stuck_frames=N, seed=N\n",
+                FAULT_ENV, entry, value ? "=" : "", value ? value : "");
+        memset(config->rate, 0, sizeof(config->rate));
+        return -1;
+    }
+    if (!seeded) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        config->seed = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    }
+    return 0;
+}
+
+/*
+ * Name:         fault_configure
+ * Purpose:      Makes a list the one in force.
+ * Arguments:    faults: the faults to inject, NULL for none.
+ *
+ * Output:       The faults now in force to stderr.
+ * Modifies:     The config, the RNG, the stuck state of every port.
+ * Returns:      None.
+ * Assumptions:  None, safe while other threads are sending.
+ *
+ * Bugs:         None known.
+ * Notes:        The RNG is seeded again every time, so turning the same list
+ *               back on repeats its faults from the start.
+ */
+void fault_configure(const FaultConfig *faults) {
+    FaultConfig next = { 0 };
+    char line[256];
+    int at = 0;
+    bool any = false;
+
+    if (faults) next = *faults;
+    for (int kind = 0; kind < FAULT_KINDS; kind++) {
+        if (next.rate[kind] <= 0.0) continue;
+        any = true;
+        at += snprintf(line + at, sizeof(line) - (size_t)at, " %s=%g", fault_names[kind], next.rate[kind]);
+        if (at >= (int)sizeof(line)) at = (int)sizeof(line) - 1;
+    }
+
+    pthread_mutex_lock(&fault_mutex);
+    config = next;
+    storm_rng_seed(&rng, next.seed);
+    for (int i = 0; i < FAULT_MAX_PORTS; i++) {
+        if (ports[i]) ports[i]->stuck_left = 0;
+    }
+    atomic_store_explicit(&fault_on, any, memory_order_relaxed);
+    pthread_mutex_unlock(&fault_mutex);
+
+    if (any) {
+        fprintf(stderr, "[%ld] Faults on:%s delay_ms=%u stuck_frames=%u seed=%llu\n", time(NULL), line,
+                next.delay_ms, next.stuck_frames, (unsigned long long)next.seed);
+    } else {
+        fprintf(stderr, "[%ld] Faults off\n", time(NULL));
+    }
+}
+
+/*
+ * Name:         load_file
+ * Purpose:      Reads fault_file and puts its list in force.
+ *
+ * Returns:      None, a file that cannot be read or parsed turns faults off.
+ */
+static void load_file(void) {
+    char buf[FAULT_FILE_MAX];
+    FaultConfig file_config;
+    FILE *f = fopen(fault_file, "re");
+
+    if (!f) {
+        fprintf(stderr, "%s: %s: %s\n", FAULT_ENV, fault_file, strerror(errno));
+        fault_configure(NULL);
+        return;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    bool whole = feof(f);
+    fclose(f);
+    buf[n] = '\0';
+    if (!whole) {
+        fprintf(stderr, "%s: %s: longer than %d bytes\n", FAULT_ENV, fault_file, FAULT_FILE_MAX - 1);
+        fault_configure(NULL);
+        return;
+    }
+    fault_configure(fault_parse(buf, &file_config) == 0 ? &file_config : NULL);
+}
+
+/*
+ * Name:         watch_thread
+ * Purpose:      Waits for SIGUSR2 and re-reads the fault file, or toggles the inline list.
+ *
+ * Returns:      NULL, once woken through wake_fd.
+ */
+static void *watch_thread(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { .fd = usr2_fd, .events = POLLIN },
+            { .fd = wake_fd, .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Faults: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents & POLLIN) break;
+        if (!(pfd[0].revents & POLLIN)) continue;
+
+        struct signalfd_siginfo info;
+        while (read(usr2_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {}
+        if (fault_file) load_file();
+        else fault_configure(fault_active() ? NULL : &inline_config);
+    }
+    return NULL;
+}
+
+/*
+ * Name:         fault_init
+ * Purpose:      Reads WX_FAULTS and, when it is set, starts the SIGUSR2 watcher.
+ * Arguments:    None.
+ *
+ * Output:       The faults in force, or what is wrong with the list, to stderr.
+ * Modifies:     The calling thread's signal mask, the fault state.
+ * Returns:      None, a bad list leaves faults off.
+ * Assumptions:  Called from main() before other threads start, open_serial_port()
+ *               calls it for every emulator.
+ *
+ * Bugs:         None known.
+ * Notes:        Only the first call does anything. SIGUSR2 is blocked and read
+ *               through usr2_fd only while WX_FAULTS is set, so an emulator run
+ *               without it keeps the default action.
+ */
+void fault_init(void) {
+    if (fault_started) return;
+    fault_started = true;
+
+    const char *spec = getenv(FAULT_ENV);
+    if (!spec || spec[0] == '\0') return;
+
+    if (spec[0] == '@') {
+        fault_file = spec + 1;
+        load_file();
+    } else if (fault_parse(spec, &inline_config) == 0) {
+        fault_configure(&inline_config);
+    } else {
+        return; // Nothing to toggle.
+    }
+
+    sigset_t usr2;
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+
+    usr2_fd = signalfd(-1, &usr2, SFD_CLOEXEC | SFD_NONBLOCK);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int ret = (usr2_fd < 0 || wake_fd < 0) ? errno : 0;
+    if (ret == 0) {
+        sigset_t all, previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &previous);
+        ret = pthread_create(&watcher, NULL, watch_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Faults: SIGUSR2 will not change them: %s\n", strerror(ret));
+        if (usr2_fd >= 0) close(usr2_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        usr2_fd = wake_fd = -1;
+        return;
+    }
+    watcher_started = true;
+}
+
+/*
+ * Name:         draw
+ * Purpose:      Decides whether a fault hits this message.
+ *
+ * Returns:      true with the fault's probability. Takes no number from the RNG
+ *               for a fault that is off, so enabling one more fault does not
+ *               move the others.
+ */
+static bool draw(FaultKind kind) {
+    return config.rate[kind] > 0.0 && storm_rng_uniform(&rng) < config.rate[kind];
+}
+
+/*
+ * Name:         find_port
+ * Purpose:      Finds a port's stuck state, making it on the port's first message.
+ *
+ * Returns:      The port, or NULL when FAULT_MAX_PORTS are kept already.
+ */
+static FaultPort *find_port(int fd) {
+    int free_slot = -1;
+    for (int i = 0; i < FAULT_MAX_PORTS; i++) {
+        if (ports[i] && ports[i]->fd == fd) return ports[i];
+        if (!ports[i] && free_slot < 0) free_slot = i;
+    }
+    if (free_slot < 0 || !(ports[free_slot] = calloc(1, sizeof(FaultPort)))) return NULL;
+    ports[free_slot]->fd = fd;
+    return ports[free_slot];
+}
+
+static bool is_terminator(char c) {
+    return c == '\r' || c == '\n' || c == ETX || c == EOT;
+}
+
+/*
+ * Name:         drop_terminator
+ * Purpose:      Removes a message's last ETX, or its trailing CR/LF when it has none.
+ *
+ * Returns:      The new length, len if there was nothing to remove.
+ */
+static size_t drop_terminator(char *buf, size_t len) {
+    for (size_t i = len; i-- > 0;) {
+        if (buf[i] == ETX) {
+            memmove(buf + i, buf + i + 1, len - i - 1);
+            return len - 1;
+        }
+    }
+    while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n')) len--;
+    return len;
+}
+
+/*
+ * Name:         corrupt_checksum
+ * Purpose:      Changes the last byte before a message's trailing terminators.
+ *
+ * Returns:      true if a byte was changed. A hex digit becomes another hex
+ *               digit of the same case, so the frame still parses and only
+ *               the checksum test fails.
+ */
+static bool corrupt_checksum(char *buf, size_t len) {
+    static const char upper[] = "0123456789ABCDEF";
+    static const char lower[] = "0123456789abcdef";
+
+    while (len > 0 && is_terminator(buf[len - 1])) len--;
+    if (len == 0) return false;
+
+    char *c = &buf[len - 1];
+    if (isxdigit((unsigned char)*c)) {
+        const char *digits = islower((unsigned char)*c) ? lower : upper;
+        int value = isdigit((unsigned char)*c) ? *c - '0' : tolower((unsigned char)*c) - 'a' + 10;
+        *c = digits[(value + 1 + (int)(storm_rng_next(&rng) % 15)) % 16];
+    } else {
+        *c ^= 0x01;
+    }
+    return true;
+}
+
+/*
+ * Name:         fault_apply
+ * Purpose:      Injects the faults in force into one message.
+ * Arguments:    fd: the port the message is for.
+ *               iov: the pieces of the message.
+ *               iovcnt: the number of pieces.
+ *               total: the message length, the sum of the pieces.
+ *               out: FAULT_MAX_MESSAGE bytes, receives the faulted message.
+ *               delay_ms: set to how long to hold the message back, 0 for not
+ *                         at all. NULL for a caller that cannot wait, which then
+ *                         gets no delay faults.
+ *
+ * Output:       None.
+ * Modifies:     out, *delay_ms, the RNG, the port's stuck state.
+ * Returns:      -1 to send the message as it is, otherwise the length of the
+ *               message in out to send instead, 0 to send nothing.
+ * Assumptions:  Only called while fault_active(), from any thread.
+ *
+ * Bugs:         None known.
+ * Notes:        Faults stack, a stuck message may also be truncated. A message
+ *               longer than FAULT_MAX_MESSAGE is sent untouched and not kept
+ *               for stuck faults.
+ */
+ssize_t fault_apply(int fd, const struct iovec *iov, int iovcnt, size_t total, char *out, unsigned *delay_ms) {
+    uint64_t injected = 0;
+    size_t len = 0;
+
+    if (delay_ms) *delay_ms = 0;
+    if (total == 0 || total > FAULT_MAX_MESSAGE) return -1;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&fault_mutex);
+    FaultPort *port = config.rate[FAULT_STUCK] > 0.0 ? find_port(fd) : NULL;
+    if (port && port->len > 0 && (port->stuck_left > 0 || draw(FAULT_STUCK))) {
+        if (port->stuck_left == 0) port->stuck_left = config.stuck_frames + 1;
+        port->stuck_left--;
+        memcpy(out, port->last, port->len);
+        len = port->len;
+        injected++;
+    } else if (port) {
+        memcpy(port->last, out, len);
+        port->len = len;
+    }
+
+    if (draw(FAULT_DROP)) {
+        len = 0;
+        injected++;
+    } else {
+        if (draw(FAULT_TRUNCATE) && len > 1) {
+            len = 1 + (size_t)(storm_rng_next(&rng) % (len - 1));
+            injected++;
+        }
+        if (draw(FAULT_ETX)) {
+            size_t shorter = drop_terminator(out, len);
+            if (shorter != len) injected++;
+            len = shorter;
+        }
+        if (draw(FAULT_CHECKSUM) && corrupt_checksum(out, len)) injected++;
+        if (draw(FAULT_FLIP) && len > 0) {
+            uint64_t r = storm_rng_next(&rng);
+            out[r % len] ^= (char)(1u << ((r >> 32) & 7));
+            injected++;
+        }
+        if (delay_ms && draw(FAULT_DELAY)) {
+            *delay_ms = 1 + (unsigned)(storm_rng_next(&rng) % config.delay_ms);
+            metrics_count(METRIC_FAULTS_INJECTED, 1); // Sent as it is, later.
+        }
+    }
+    pthread_mutex_unlock(&fault_mutex);
+
+    if (injected == 0) return -1;
+    metrics_count(METRIC_FAULTS_INJECTED, injected);
+    return (ssize_t)len;
+}
+
+/*
+ * Name:         fault_stop
+ * Purpose:      Stops the SIGUSR2 watcher and frees the stuck state.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     The fault state.
+ * Returns:      None.
+ * Assumptions:  No thread is sending, serial_utils_cleanup() calls it last.
+ *
+ * Bugs:         None known.
+ * Notes:        SIGUSR2 stays blocked.
+ */
+void fault_stop(void) {
+    atomic_store(&fault_on, false);
+    if (watcher_started) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {} // Full only if already woken.
+        pthread_join(watcher, NULL);
+        close(usr2_fd);
+        close(wake_fd);
+        usr2_fd = wake_fd = -1;
+        watcher_started = false;
+    }
+    for (int i = 0; i < FAULT_MAX_PORTS; i++) {
+        free(ports[i]);
+        ports[i] = NULL;
+    }
+}
@@ -0,0 +1,180 @@
+/*
+ * File:     frame_ring.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Single producer, single consumer ring of pre-rendered output frames,
+ *           see frame_ring.h.
+ *
+ *           head and tail only ever increase; the slot is the count modulo
+ *           FRAME_RING_SLOTS. The producer owns head and the slot at head, the
+ *           consumer owns tail and the slot at tail. A release store of a count
+ *           hands the slot over, so a slot's bytes need no atomics.
+ *
+ * Mods:
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "frame_ring.h"
+
+#define SLOT(r, n) (&(r)->slots[(n) & (FRAME_RING_SLOTS - 1)])
+
+/*
+ * Name:         frame_ring_init
+ * Purpose:      Initializes an empty ring.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     r.
+ * Returns:      0 on success, -1 with errno set if the semaphore cannot be created.
+ * Assumptions:  No thread is using r.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+int frame_ring_init(FrameRing *r) {
+    memset(r->slots, 0, sizeof(r->slots));
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return sem_init(&r->space, 0, FRAME_RING_SLOTS);
+}
+
+/*
+ * Name:         frame_ring_claim
+ * Purpose:      Waits for a free slot and returns it for the producer to fill.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     Takes a token from r->space.
+ * Returns:      The slot to fill and then frame_ring_publish(), or NULL if woken
+ * 				 by frame_ring_wake() with the ring still full.
+ * Assumptions:  Called from the producer thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        The caller checks its terminate flag when NULL is returned and
+ * 				 claims again. A wake token spent while a slot is free leaves the
+ * 				 semaphore one ahead, which a later NULL return evens out.
+ */
+RingFrame *frame_ring_claim(FrameRing *r) {
+    while (sem_wait(&r->space) != 0 && errno == EINTR);
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire); // The consumer is done with the slot.
+    if (head - tail >= FRAME_RING_SLOTS) return NULL;
+    return SLOT(r, head);
+}
+
+/*
+ * Name:         frame_ring_publish
+ * Purpose:      Hands the slot returned by frame_ring_claim() to the consumer.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     r->head.
+ * Returns:      None.
+ * Assumptions:  Called from the producer thread, after a claim that returned a slot.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void frame_ring_publish(FrameRing *r) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Name:         frame_ring_peek
+ * Purpose:      Returns the oldest published frame without removing it.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The frame, or NULL if the ring is empty.
+ * Assumptions:  Called from the consumer thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        The frame stays valid until frame_ring_release().
+ */
+const RingFrame *frame_ring_peek(FrameRing *r) {
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire); // The producer is done with the slot.
+    if (head == tail) return NULL;
+    return SLOT(r, tail);
+}
+
+/*
+ * Name:         frame_ring_release
+ * Purpose:      Gives the frame returned by frame_ring_peek() back to the producer.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     r->tail, posts r->space.
+ * Returns:      None.
+ * Assumptions:  Called from the consumer thread, after a peek that returned a frame.
+ *
+ * Bugs:         None known.
+ * Notes:        sem_post() is a single atomic add unless the producer is asleep.
+ */
+void frame_ring_release(FrameRing *r) {
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    sem_post(&r->space);
+}
+
+/*
+ * Name:         frame_ring_drain
+ * Purpose:      Discards every published frame.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     r->tail, posts r->space once per frame.
+ * Returns:      The number of frames discarded.
+ * Assumptions:  Called from the consumer thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Used when the frames were rendered too long ago to still be sent.
+ */
+size_t frame_ring_drain(FrameRing *r) {
+    size_t n = 0;
+    while (frame_ring_peek(r)) {
+        frame_ring_release(r);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Name:         frame_ring_wake
+ * Purpose:      Wakes a producer waiting in frame_ring_claim(), so it can see terminate.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     Posts r->space.
+ * Returns:      None.
+ * Assumptions:  frame_ring_init() succeeded.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe from any thread.
+ */
+void frame_ring_wake(FrameRing *r) {
+    sem_post(&r->space);
+}
+
+/*
+ * Name:         frame_ring_destroy
+ * Purpose:      Releases the ring's semaphore.
+ * Arguments:    r: the ring.
+ *
+ * Output:       None.
+ * Modifies:     r->space.
+ * Returns:      None.
+ * Assumptions:  Neither the producer nor the consumer is running.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void frame_ring_destroy(FrameRing *r) {
+    sem_destroy(&r->space);
+}
@@ -0,0 +1,417 @@
+/*
+ * File:     live_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Ingestion thread and record ring of a live feed, see live_utils.h.
+ *
+ *           Each slot is a SeqLock and one record, so a copy taken while the
+ *           ingester is rewriting the slot is never torn. Which record a copy
+ *           holds is then settled by the ring counters: the consumer claims
+ *           slot tail with a compare and swap, and the ingester waits for or
+ *           drops on a full ring by comparing head with tail.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "live_utils.h"
+#include "seqlock_utils.h"
+#include "metrics_utils.h"
+
+#define LIVE_LINE_MAX 1024 // Longest line kept, matches REPLAY_LINE_MAX.
+#define LIVE_SLOT_ALIGN 64 // Slots start on their own cache line.
+
+struct LiveFeed {
+    int fd;                        // The stream, owned by the caller.
+    bool datagram;                 // Every read() ends a line, for UDP.
+    LivePolicy policy;
+    size_t record_size;            // Bytes per record, a NUL terminated line when parse is NULL.
+    size_t stride;                 // Bytes per slot, the SeqLock and the record.
+    size_t depth;                  // Slots, a power of two.
+    LiveParseFn parse;             // NULL to keep lines as they are.
+    unsigned char *slots;
+    unsigned char *staging;        // The record being parsed, ingester only.
+    char *read_buf;                // LIVE_READ_SIZE bytes, ingester only.
+    sem_t space;                   // Free slots, LIVE_BLOCK only.
+    pthread_t thread;
+    atomic_bool stop;
+    _Alignas(64) _Atomic uint64_t head; // Records published by the ingester.
+    _Alignas(64) _Atomic uint64_t tail; // Records taken by the sender, LIVE_BLOCK and LIVE_REPEAT.
+    _Atomic uint64_t taken;        // head at the last LIVE_LATEST take.
+};
+
+/*
+ * Name:         slot_lock
+ * Purpose:      Returns the SeqLock of the slot a ring position maps to.
+ */
+static SeqLock *slot_lock(const LiveFeed *f, uint64_t n) {
+    return (SeqLock *)(f->slots + (size_t)(n & (f->depth - 1)) * f->stride);
+}
+
+/*
+ * Name:         slot_record
+ * Purpose:      Returns the record of the slot a ring position maps to.
+ */
+static unsigned char *slot_record(const LiveFeed *f, uint64_t n) {
+    return f->slots + (size_t)(n & (f->depth - 1)) * f->stride + sizeof(uint64_t);
+}
+
+/*
+ * Name:         live_policy
+ * Purpose:      Looks up a policy by the name given to --live.
+ * Arguments:    name: "latest", "block" or "repeat", any case.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The policy, or LIVE_OFF for an unknown name.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+LivePolicy live_policy(const char *name) {
+    if (strcasecmp(name, "latest") == 0) return LIVE_LATEST;
+    if (strcasecmp(name, "block") == 0) return LIVE_BLOCK;
+    if (strcasecmp(name, "repeat") == 0) return LIVE_REPEAT;
+    return LIVE_OFF;
+}
+
+/*
+ * Name:         live_policy_name
+ * Purpose:      Returns the --live name of a policy, for log messages.
+ */
+const char *live_policy_name(LivePolicy policy) {
+    switch (policy) {
+        case LIVE_LATEST: return "latest";
+        case LIVE_BLOCK: return "block";
+        case LIVE_REPEAT: return "repeat";
+        default: return "off";
+    }
+}
+
+/*
+ * Name:         wait_for_space
+ * Purpose:      Holds the ingester until a LIVE_BLOCK ring has a free slot.
+ * Arguments:    f: the feed.
+ *
+ * Output:       None.
+ * Modifies:     Takes a token from f->space.
+ * Returns:      true with a slot free, false if live_stop() was called first.
+ * Assumptions:  Called from the ingestion thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Wakes every LIVE_POLL_MS to check the stop flag, the sender
+ * 				 posts a token for every record it takes.
+ */
+static bool wait_for_space(LiveFeed *f) {
+    while (!atomic_load_explicit(&f->stop, memory_order_relaxed)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LIVE_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(&f->space, &deadline) == 0) return true;
+    }
+    return false;
+}
+
+/*
+ * Name:         publish
+ * Purpose:      Parses one line into the next slot and hands it to the sender.
+ * Arguments:    f: the feed.
+ * 				 line: the line, NUL terminated without CR/LF.
+ *
+ * Output:       None.
+ * Modifies:     The next slot, f->head, the live metrics.
+ * Returns:      None.
+ * Assumptions:  Called from the ingestion thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        LIVE_LATEST writes over the oldest slot, the sender only ever
+ * 				 reads the newest. LIVE_REPEAT drops the new line when the sender
+ * 				 is a whole ring behind, LIVE_BLOCK waits for it. The record is
+ * 				 parsed into a private buffer first, so the slot is only held for
+ * 				 the copy.
+ */
+static void publish(LiveFeed *f, char *line) {
+    uint64_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+
+    if (f->policy == LIVE_BLOCK) {
+        if (!wait_for_space(f)) return;
+    } else if (f->policy == LIVE_REPEAT &&
+               head - atomic_load_explicit(&f->tail, memory_order_acquire) >= f->depth) {
+        metrics_count(METRIC_LIVE_DROPPED, 1);
+        return;
+    }
+
+    if (f->parse) {
+        memset(f->staging, 0, f->record_size);
+        f->parse(line, f->staging);
+    } else {
+        size_t len = strnlen(line, f->record_size - 1);
+        memcpy(f->staging, line, len);
+        f->staging[len] = '\0';
+    }
+    seqlock_write(slot_lock(f, head), slot_record(f, head), f->staging, f->record_size);
+    atomic_store_explicit(&f->head, head + 1, memory_order_release);
+    metrics_count(METRIC_LIVE_RECORDS, 1);
+}
+
+/*
+ * Name:         ingest_thread
+ * Purpose:      Reads the stream in bulk, splits it into lines and publishes them.
+ * Arguments:    arg: the feed.
+ *
+ * Output:       A message to stderr when the upstream closes or fails.
+ * Modifies:     The ring.
+ * Returns:      NULL.
+ * Assumptions:  Started by live_start() with every signal blocked.
+ *
+ * Bugs:         None known.
+ * Notes:        Blank lines are skipped and lines over LIVE_LINE_MAX truncated,
+ * 				 as replay_next_line() does. A datagram is a line on its own even
+ * 				 without a newline. When the last writer of a FIFO goes away
+ * 				 read() returns 0 until another one opens it, so the thread keeps
+ * 				 trying every LIVE_POLL_MS instead of giving up, and the sender
+ * 				 goes on with whatever the policy gives it meanwhile.
+ */
+static void *ingest_thread(void *arg) {
+    LiveFeed *f = arg;
+    char line[LIVE_LINE_MAX];
+    size_t len = 0;
+    bool closed = false;
+
+    while (!atomic_load_explicit(&f->stop, memory_order_relaxed)) {
+        struct pollfd pfd = { .fd = f->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, LIVE_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Live feed: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ready <= 0) continue;
+
+        ssize_t n = read(f->fd, f->read_buf, LIVE_READ_SIZE);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            fprintf(stderr, "Live feed: read failed: %s\n", strerror(errno));
+            break;
+        }
+        if (n == 0) {
+            if (len > 0) { // The writer left without a final newline.
+                line[len] = '\0';
+                publish(f, line);
+                len = 0;
+            }
+            if (!closed) fprintf(stderr, "[%ld] Live feed: upstream closed, waiting for a writer\n", time(NULL));
+            closed = true;
+            struct timespec pause = { 0, LIVE_POLL_MS * 1000000L };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (closed) fprintf(stderr, "[%ld] Live feed: upstream back\n", time(NULL));
+        closed = false;
+
+        const char *p = f->read_buf;
+        const char *end = f->read_buf + n;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            const char *stop = nl ? nl : end;
+            size_t take = (size_t)(stop - p);
+            if (take > sizeof(line) - 1 - len) take = sizeof(line) - 1 - len;
+            memcpy(line + len, p, take);
+            len += take;
+            if (!nl && !f->datagram) break; // The rest of the line is in a later read.
+
+            while (len > 0 && line[len - 1] == '\r') len--;
+            if (len > 0) {
+                line[len] = '\0';
+                publish(f, line);
+            }
+            len = 0;
+            p = nl ? nl + 1 : end;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Name:         free_feed
+ * Purpose:      Releases a feed whose thread is not running.
+ */
+static void free_feed(LiveFeed *f) {
+    free(f->slots);
+    free(f->staging);
+    free(f->read_buf);
+    free(f);
+}
+
+/*
+ * Name:         live_start
+ * Purpose:      Sets up a feed's ring and starts its ingestion thread.
+ * Arguments:    fd: the stream to read, left open by live_stop().
+ * 				 datagram: true if every read() returns one whole message, as on UDP.
+ * 				 policy: LIVE_LATEST, LIVE_BLOCK or LIVE_REPEAT.
+ * 				 depth: ring slots, rounded up to a power of two, 0 for LIVE_DEPTH_DEFAULT.
+ * 				 record_size: bytes per record.
+ * 				 parse: turns a line into a record, NULL to store the line itself.
+ *
+ * Output:       An error message to stderr on failure.
+ * Modifies:     Allocates the feed.
+ * Returns:      The feed, or NULL with errno set.
+ * Assumptions:  The caller stops reading fd itself.
+ *
+ * Bugs:         None known.
+ * Notes:        The thread is created with every signal blocked, so SIGINT and
+ * 				 friends still reach the emulator's signal thread. Until the first
+ * 				 line arrives live_next() has nothing to give.
+ */
+LiveFeed *live_start(int fd, bool datagram, LivePolicy policy, size_t depth, size_t record_size, LiveParseFn parse) {
+    if (policy == LIVE_OFF || record_size == 0 || depth > LIVE_DEPTH_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (depth == 0) depth = LIVE_DEPTH_DEFAULT;
+    size_t slots = 2;
+    while (slots < depth) slots <<= 1;
+
+    LiveFeed *f = calloc(1, sizeof(LiveFeed));
+    if (!f) return NULL;
+    f->fd = fd;
+    f->datagram = datagram;
+    f->policy = policy;
+    f->record_size = record_size;
+    f->stride = (sizeof(uint64_t) + record_size + LIVE_SLOT_ALIGN - 1) & ~(size_t)(LIVE_SLOT_ALIGN - 1);
+    f->depth = slots;
+    f->parse = parse;
+    atomic_init(&f->head, 0);
+    atomic_init(&f->tail, 0);
+    atomic_init(&f->taken, 0);
+    atomic_init(&f->stop, false);
+
+    f->slots = aligned_alloc(LIVE_SLOT_ALIGN, f->stride * f->depth);
+    f->staging = malloc(record_size);
+    f->read_buf = malloc(LIVE_READ_SIZE);
+    if (!f->slots || !f->staging || !f->read_buf) {
+        free_feed(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(f->slots, 0, f->stride * f->depth); // Every SeqLock starts even.
+
+    if (sem_init(&f->space, 0, (unsigned)f->depth) != 0) {
+        int saved = errno;
+        free_feed(f);
+        errno = saved;
+        return NULL;
+    }
+
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int ret = pthread_create(&f->thread, NULL, ingest_thread, f);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "Live feed: pthread_create failed: %s\n", strerror(ret));
+        sem_destroy(&f->space);
+        free_feed(f);
+        errno = ret;
+        return NULL;
+    }
+    return f;
+}
+
+/*
+ * Name:         live_next
+ * Purpose:      Copies out the record the feed's policy picks for this send.
+ * Arguments:    feed: the feed.
+ * 				 out: receives record_size bytes.
+ *
+ * Output:       None.
+ * Modifies:     out, feed->tail or feed->taken, the live metrics.
+ * Returns:      true if a record was copied, false if there is none to send:
+ * 				 nothing has arrived yet, or a LIVE_BLOCK ring is empty.
+ * Assumptions:  None, safe from the sender and receiver threads at once.
+ *
+ * Bugs:         None known.
+ * Notes:        Never blocks or calls into the kernel, the only wait is the
+ * 				 SeqLock retry while the ingester is copying into the same slot.
+ *
+ * 				 LIVE_LATEST reads the newest slot. If the ingester laps it during
+ * 				 the copy the SeqLock still hands back a whole record, only a newer
+ * 				 one, which is just as good. Records published since the last take
+ * 				 and never sent are counted as dropped.
+ *
+ * 				 LIVE_BLOCK and LIVE_REPEAT copy slot tail and keep the copy only
+ * 				 if tail has not moved meanwhile. The ingester does not reuse that
+ * 				 slot until tail has passed it, so a kept copy is the right record.
+ * 				 An empty LIVE_REPEAT ring resends the slot before tail, which the
+ * 				 ingester only overwrites once it is a whole ring ahead again.
+ */
+bool live_next(LiveFeed *feed, void *out) {
+    if (feed->policy == LIVE_LATEST) {
+        uint64_t head = atomic_load_explicit(&feed->head, memory_order_acquire);
+        if (head == 0) return false;
+        seqlock_read(slot_lock(feed, head - 1), out, slot_record(feed, head - 1), feed->record_size);
+        uint64_t last = atomic_exchange_explicit(&feed->taken, head, memory_order_relaxed);
+        if (head == last) metrics_count(METRIC_LIVE_REPEATS, 1);
+        else if (head > last + 1) metrics_count(METRIC_LIVE_DROPPED, head - last - 1);
+        return true;
+    }
+
+    for (;;) {
+        uint64_t tail = atomic_load_explicit(&feed->tail, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&feed->head, memory_order_acquire);
+        if (tail == head) {
+            if (feed->policy == LIVE_BLOCK || tail == 0) return false;
+            seqlock_read(slot_lock(feed, tail - 1), out, slot_record(feed, tail - 1), feed->record_size);
+            if (atomic_load_explicit(&feed->head, memory_order_acquire) - (tail - 1) >= feed->depth) continue; // Overwritten, so there is news.
+            metrics_count(METRIC_LIVE_REPEATS, 1);
+            return true;
+        }
+
+        seqlock_read(slot_lock(feed, tail), out, slot_record(feed, tail), feed->record_size);
+        if (atomic_compare_exchange_strong_explicit(&feed->tail, &tail, tail + 1,
+                                                    memory_order_acq_rel, memory_order_relaxed)) {
+            if (feed->policy == LIVE_BLOCK) sem_post(&feed->space);
+            return true;
+        }
+    }
+}
+
+/*
+ * Name:         live_stop
+ * Purpose:      Stops a feed's ingestion thread and frees the feed.
+ * Arguments:    feed: the feed, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     Frees feed.
+ * Returns:      None.
+ * Assumptions:  No thread is still in live_next() on feed.
+ *
+ * Bugs:         None known.
+ * Notes:        Takes up to LIVE_POLL_MS while the thread notices. The stream
+ * 				 itself is left open for the caller to close.
+ */
+void live_stop(LiveFeed *feed) {
+    if (!feed) return;
+    atomic_store_explicit(&feed->stop, true, memory_order_relaxed);
+    pthread_join(feed->thread, NULL);
+    sem_destroy(&feed->space);
+    free_feed(feed);
+}
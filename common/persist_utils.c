@@ -0,0 +1,364 @@
+/*
+ * File:     persist_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Memory-mapped --state files with two checksummed slots, see
+ *           persist_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "persist_utils.h"
+#include "crc_utils.h"
+
+_Static_assert(sizeof(PersistHeader) <= PERSIST_PAGE, "PersistHeader must fit its page");
+
+/*
+ * Name:         slot_at
+ * Purpose:      Returns slot 0 or 1 of a state file.
+ *
+ * Returns:      The slot, its payload follows it.
+ */
+static PersistSlot *slot_at(const PersistFile *p, int index) {
+    return (PersistSlot *)(p->map + PERSIST_PAGE + (size_t)index * p->slot_size);
+}
+
+/*
+ * Name:         slot_complete
+ * Purpose:      Checks that a slot holds a whole commit of the right size.
+ *
+ * Returns:      The commit's sequence number, 0 for an empty or torn slot.
+ */
+static uint64_t slot_complete(const PersistFile *p, const PersistSlot *slot) {
+    uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence == 0 || slot->size != p->payload_size) return 0;
+
+    Crc16Context crc;
+    crc16_init(&crc, CRC16_XMODEM);
+    crc16_update(&crc, slot + 1, p->payload_size);
+    return crc16_final(&crc) == slot->checksum ? sequence : 0;
+}
+
+/*
+ * Name:         header_matches
+ * Purpose:      Checks that a state file was written for this sensor, layout and build.
+ *
+ * Returns:      true if its slots can be loaded.
+ */
+static bool header_matches(const PersistFile *p, const char *sensor, uint32_t layout) {
+    const PersistHeader *h = p->header;
+    return memcmp(h->magic, PERSIST_MAGIC, 4) == 0 && h->version == PERSIST_VERSION &&
+           h->header_size == PERSIST_PAGE && h->byte_order == PERSIST_BYTE_ORDER &&
+           h->layout == layout && h->payload_size == p->payload_size && h->slot_size == p->slot_size &&
+           strncmp(h->sensor, sensor, PERSIST_SENSOR_LEN) == 0;
+}
+
+/*
+ * Name:         persist_parse_options
+ * Purpose:      Takes --state PATH off the command line.
+ * Arguments:    argc: pointer to the argument count, updated.
+ * 				 argv: the argument vector, compacted in place.
+ * 				 opts: filled with the option, or NULL path when absent.
+ *
+ * Output:       An error message on stderr for a malformed or missing value.
+ * Modifies:     argc, argv, opts.
+ * Returns:      0 on success, -1 on a malformed or missing value.
+ * Assumptions:  argv[*argc] may be written (it is NULL by the C standard).
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors capture_parse_options().
+ */
+int persist_parse_options(int *argc, char **argv, PersistOptions *opts) {
+    opts->path = NULL;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *name = "--state";
+        size_t n = strlen(name);
+        const char *value = NULL;
+
+        if (strncmp(argv[i], name, n) == 0) {
+            if (argv[i][n] == '=') {
+                value = argv[i] + n + 1;
+            } else if (argv[i][n] == '\0') {
+                value = i + 1 < *argc ? argv[++i] : ""; // A bare --state last is an empty value.
+            }
+        }
+        if (!value) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        if (value[0] == '\0') {
+            fprintf(stderr, "Invalid --state '': use a file path\n");
+            return -1;
+        }
+        opts->path = value;
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+ * Name:         persist_open
+ * Purpose:      Maps the --state file, creating it or starting it again when it
+ *               does not match, and finds the newest complete commit.
+ * Arguments:    ptr: receives the state file, NULL without --state.
+ *               opts: from persist_parse_options().
+ *               sensor: sensor name for the header.
+ *               layout: the emulator's payload layout number.
+ *               payload_size: bytes of the emulator's payload.
+ *
+ * Output:       An error message on stderr on failure, a note when the file is
+ *               started again.
+ * Modifies:     Creates, resizes or rewrites the file.
+ * Returns:      0 on success or with no path, -1 on failure.
+ * Assumptions:  Called from main() before the threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        The file is flock()ed, two emulators given the same --state
+ *               would otherwise take turns overwriting each other's settings.
+ */
+int persist_open(PersistFile **ptr, const PersistOptions *opts, const char *sensor, uint32_t layout, size_t payload_size) {
+    *ptr = NULL;
+    if (!opts->path) return 0;
+
+    PersistFile *p = calloc(1, sizeof(*p));
+    if (!p) {
+        fprintf(stderr, "Unable to open --state %s: %s\n", opts->path, strerror(errno));
+        return -1;
+    }
+    p->fd = -1;
+    p->map = MAP_FAILED;
+    p->payload_size = payload_size;
+    p->slot_size = (sizeof(PersistSlot) + payload_size + PERSIST_PAGE - 1) / PERSIST_PAGE * PERSIST_PAGE;
+    p->map_size = PERSIST_PAGE + 2 * p->slot_size;
+    p->newest = -1;
+    pthread_mutex_init(&p->mutex, NULL);
+
+    struct stat st;
+    p->fd = open(opts->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (p->fd < 0 || fstat(p->fd, &st) != 0) goto fail;
+    if (flock(p->fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "--state %s is in use by another emulator\n", opts->path);
+            persist_close(p);
+            return -1;
+        }
+        goto fail;
+    }
+    if ((size_t)st.st_size != p->map_size && ftruncate(p->fd, (off_t)p->map_size) != 0) goto fail;
+    p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+    if (p->map == MAP_FAILED) goto fail;
+    p->header = (PersistHeader *)p->map;
+
+    if (!header_matches(p, sensor, layout)) {
+        if (st.st_size != 0) fprintf(stderr, "--state %s was written for another sensor or build, starting from defaults\n", opts->path);
+        memset(p->map, 0, p->map_size);
+        memcpy(p->header->magic, PERSIST_MAGIC, 4);
+        p->header->version = PERSIST_VERSION;
+        p->header->header_size = PERSIST_PAGE;
+        p->header->byte_order = PERSIST_BYTE_ORDER;
+        p->header->layout = layout;
+        p->header->payload_size = payload_size;
+        p->header->slot_size = p->slot_size;
+        strncpy(p->header->sensor, sensor, PERSIST_SENSOR_LEN - 1);
+        if (msync(p->map, p->map_size, MS_SYNC) != 0) goto fail;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        uint64_t sequence = slot_complete(p, slot_at(p, i));
+        if (sequence > p->sequence) {
+            p->sequence = sequence;
+            p->newest = i;
+        }
+    }
+    *ptr = p;
+    return 0;
+
+fail:
+    fprintf(stderr, "Unable to open --state %s: %s\n", opts->path, strerror(errno));
+    persist_close(p);
+    return -1;
+}
+
+/*
+ * Name:         persist_load
+ * Purpose:      Returns the payload of the newest complete commit.
+ * Arguments:    p: the state file, may be NULL.
+ *               saved_unix_ns: receives the wall clock of the commit, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     saved_unix_ns.
+ * Returns:      Pointer into the mapping, or NULL for no file or no commit.
+ * Assumptions:  The caller copies the payload out before its next commit.
+ *
+ * Bugs:         None known.
+ * Notes:        The slots were checked by persist_open().
+ */
+const void *persist_load(const PersistFile *p, int64_t *saved_unix_ns) {
+    if (!p || p->newest < 0) return NULL;
+    const PersistSlot *slot = slot_at(p, p->newest);
+    if (saved_unix_ns) *saved_unix_ns = slot->saved_unix_ns;
+    return slot + 1;
+}
+
+/*
+ * Name:         persist_commitv
+ * Purpose:      Writes a payload gathered from iov to the state file.
+ * Arguments:    p: the state file, may be NULL.
+ *               iov: the pieces of the payload, in order.
+ *               iovcnt: number of pieces.
+ *
+ * Output:       None.
+ * Modifies:     The older slot, then p->newest and p->sequence.
+ * Returns:      None.
+ * Assumptions:  The pieces add up to the payload_size given to persist_open(),
+ *               a payload of another size is not written.
+ *
+ * Bugs:         None known.
+ * Notes:        The slot's sequence is cleared first and stored last, after the
+ *               payload and its checksum, so the slot is only ever loaded
+ *               whole. A crash between the two leaves the other slot, the
+ *               commit before, as the newest. msync(MS_ASYNC) starts the
+ *               write back without waiting for it.
+ */
+void persist_commitv(PersistFile *p, const struct iovec *iov, int iovcnt) {
+    if (!p) return;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (total != p->payload_size) return;
+
+    pthread_mutex_lock(&p->mutex);
+    int target = p->newest == 0 ? 1 : 0;
+    PersistSlot *slot = slot_at(p, target);
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    unsigned char *out = (unsigned char *)(slot + 1);
+    Crc16Context crc;
+    crc16_init(&crc, CRC16_XMODEM);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        crc16_update(&crc, out, iov[i].iov_len);
+        out += iov[i].iov_len;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->saved_unix_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    slot->size = total;
+    slot->checksum = crc16_final(&crc);
+    atomic_store_explicit(&slot->sequence, p->sequence + 1, memory_order_release);
+
+    p->sequence++;
+    p->newest = target;
+    msync(slot, p->slot_size, MS_ASYNC);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+ * Name:         persist_commit
+ * Purpose:      Writes a payload held in one piece, see persist_commitv().
+ * Arguments:    p: the state file, may be NULL.
+ *               payload: payload_size bytes.
+ *
+ * Returns:      None.
+ */
+void persist_commit(PersistFile *p, const void *payload) {
+    if (!p) return;
+    struct iovec iov = { .iov_base = (void *)payload, .iov_len = p->payload_size };
+    persist_commitv(p, &iov, 1);
+}
+
+/*
+ * Name:         persist_note_replay
+ * Purpose:      Stores the replay cursor of src in the header.
+ * Arguments:    p: the state file, may be NULL.
+ *               src: the replay source, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     p->header->replay_taken, p->header->replay_entries.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Two stores to the mapping, no system call; each word is written
+ *               whole, so the cursor is never torn. A stream has no cursor.
+ */
+void persist_note_replay(PersistFile *p, const ReplaySource *src) {
+    if (!p || !src) return;
+    size_t position, entries;
+    uint64_t taken;
+    if (!replay_progress(src, &position, &entries, &taken)) return;
+    atomic_store_explicit(&p->header->replay_entries, entries, memory_order_relaxed);
+    atomic_store_explicit(&p->header->replay_taken, taken, memory_order_relaxed);
+}
+
+/*
+ * Name:         persist_resume_replay
+ * Purpose:      Moves the replay cursor of src to where the state file left it.
+ * Arguments:    p: the state file, may be NULL.
+ *               src: the replay source, may be NULL.
+ *
+ * Output:       A note on stderr of where replay resumes, or why it does not.
+ * Modifies:     src->cursor.
+ * Returns:      true if the cursor was moved.
+ * Assumptions:  Called after replay_apply_options(), before the threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        A window of another size means another data file or another
+ *               --start/--end, the old count would land on an unrelated entry,
+ *               so replay starts from the beginning of the window instead.
+ */
+bool persist_resume_replay(const PersistFile *p, ReplaySource *src) {
+    if (!p || !src) return false;
+    uint64_t entries = atomic_load_explicit(&p->header->replay_entries, memory_order_relaxed);
+    uint64_t taken = atomic_load_explicit(&p->header->replay_taken, memory_order_relaxed);
+    size_t position, now_entries;
+    uint64_t now_taken;
+    if (entries == 0 || !replay_progress(src, &position, &now_entries, &now_taken)) return false;
+    if ((uint64_t)now_entries != entries) {
+        fprintf(stderr, "Data file has changed since the state was saved, replay starts from the beginning\n");
+        return false;
+    }
+    if (!replay_seek(src, taken)) return false;
+    fprintf(stderr, "Resuming replay at entry %llu of %llu\n", (unsigned long long)(taken % entries + 1), (unsigned long long)entries);
+    return true;
+}
+
+/*
+ * Name:         persist_close
+ * Purpose:      Syncs and unmaps a state file.
+ * Arguments:    p: the state file, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     Frees p.
+ * Returns:      None.
+ * Assumptions:  No other thread commits to p.
+ *
+ * Bugs:         None known.
+ * Notes:        MS_SYNC, so a clean exit has everything on disk.
+ */
+void persist_close(PersistFile *p) {
+    if (!p) return;
+    if (p->map != MAP_FAILED) {
+        msync(p->map, p->map_size, MS_SYNC);
+        munmap(p->map, p->map_size);
+    }
+    if (p->fd >= 0) close(p->fd);
+    pthread_mutex_destroy(&p->mutex);
+    free(p);
+}
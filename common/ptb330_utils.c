@@ -11,15 +11,83 @@
 #include <math.h>
 #include <ctype.h>
 #include "crc_utils.h"
+#include "replay_utils.h"
+#include "seqlock_utils.h"
+#include "calendar_utils.h"
 #include "ptb330_utils.h"
+#ifdef WX_FIXED_POINT
+#include "q1_31_utils.h"
+#endif
 
 #define OUTPUT_STRING "\" \"  P1 \" \" P2 \" \" P3 \" \" ERR \" \" P \" \" P3H \\R \\N"
 
-FormItem compiled_form[MAX_FORM_ITEMS];
-int form_item_count = 0;
+// What --upsample interpolates, with the noise of each at --noise 1. The rest hold.
+const UpsampleField ptb330_upsample_fields[PTB330_UPSAMPLE_FIELDS] = {
+	UPSAMPLE_FIELD(ParsedMessage, p1_pressure,    UPSAMPLE_DOUBLE, 0.01, 0.0, 0.0), // hPa, the PTB330's resolution.
+	UPSAMPLE_FIELD(ParsedMessage, p2_pressure,    UPSAMPLE_DOUBLE, 0.01, 0.0, 0.0),
+	UPSAMPLE_FIELD(ParsedMessage, p3_pressure,    UPSAMPLE_DOUBLE, 0.01, 0.0, 0.0),
+	UPSAMPLE_FIELD(ParsedMessage, p1_temperature, UPSAMPLE_DOUBLE, 0.05, 0.0, 0.0), // Degrees C.
+	UPSAMPLE_FIELD(ParsedMessage, p2_temperature, UPSAMPLE_DOUBLE, 0.05, 0.0, 0.0),
+	UPSAMPLE_FIELD(ParsedMessage, p3_temperature, UPSAMPLE_DOUBLE, 0.05, 0.0, 0.0),
+	UPSAMPLE_FIELD(ParsedMessage, p_average,      UPSAMPLE_DOUBLE, 0.01, 0.0, 0.0),
+	UPSAMPLE_FIELD(ParsedMessage, trend,          UPSAMPLE_DOUBLE, 0.0,  0.0, 0.0), // A 3 hour figure, no sample noise.
+	UPSAMPLE_FIELD(ParsedMessage, tendency,       UPSAMPLE_DOUBLE, 0.0,  0.0, 0.0)
+};
 
-int active_width = 0;
-int active_precision = 0;
+/*
+ * The FORM as a flat instruction list, rebuilt by parse_form_string(). Literals are
+ * merged and stored in FormProgram.text, numeric fields carry their resolved format.
+ */
+typedef enum {
+	OP_LITERAL,		// Copy length bytes of text from offset.
+	OP_NUMBER,		// Fixed point number, source is the FormItemType of the value.
+	OP_UNIT, OP_ERR, OP_DATE, OP_TIME, OP_CS2, OP_CS4, OP_CSX, OP_PSTAB, OP_SN, OP_ADDR
+} FormOpcode;
+
+typedef struct {
+	uint8_t opcode;		// FormOpcode.
+	uint8_t source;		// FormItemType of an OP_NUMBER value.
+	uint8_t width;		// Resolved field width, 0 for natural width.
+	uint8_t precision;	// Resolved digits after the decimal point.
+	bool scaled;		// A pressure, multiplied by the UNIT scale.
+	bool plus;			// Always print the sign.
+	uint16_t offset;	// OP_LITERAL position in text.
+	uint16_t length;
+} FormOp;
+
+#define FIXED_MAX_PRECISION 9		// format_fixed() handles up to 9 decimals itself.
+#define FIXED_MAX_SCALED 9007199254740992.0 // 2^53, larger scaled values go to snprintf().
+#define FIXED_TIE_GUARD 1e-6		// Closer than this to a rounding tie goes to snprintf().
+
+typedef struct {
+	FormOp ops[MAX_FORM_ITEMS];
+	int op_count;
+	bool uses_clock;
+	char text[MAX_FORM_ITEMS * MAX_LITERAL_SIZE];
+} FormProgram;
+
+/*
+ * One unit's FORM. parse_form_string() runs on the thread taking commands and
+ * build_dynamic_output() on the sender, so the program is built in build,
+ * published to shared through lock, and each thread formats from its own copy,
+ * refreshed only when the unit or the sequence number differs from its last
+ * message.
+ */
+struct PTB330Form {
+	FormItem items[MAX_FORM_ITEMS];
+	int item_count;
+	int active_width;		// The last n.n rule, carried on into the next FORM as before.
+	int active_precision;
+	FormProgram build;
+	FormProgram shared;
+	SeqLock lock;
+};
+
+static __thread FormProgram form_local;
+static __thread const PTB330Form *form_local_owner = NULL;
+static __thread uint32_t form_local_seq = 0;
+
+static void compile_form_program(PTB330Form *f);
 
 /*
  * Name:         init_ptb330_sensor
@@ -43,6 +111,12 @@ int init_ptb330_sensor(ptb330_sensor **ptr) {
     if (!*ptr) return -1;
 
     ptb330_sensor *s = *ptr;
+	s->form = calloc(1, sizeof(PTB330Form));
+	if (!s->form) {
+		free(s);
+		*ptr = NULL;
+		return -1;
+	}
 	// Identity
 	strncpy(s->serial_number, "G1234567", MAX_SN_LEN);
     strncpy(s->software_version, "1.12", 5);
@@ -57,7 +131,7 @@ int init_ptb330_sensor(ptb330_sensor **ptr) {
 	s->intv_data.multiplier = 1; // stored in seconds.
     strncpy(s->format_string, OUTPUT_STRING, MAX_FORM_STR - 1); // Our default format P11A11.
 	s->format_string[MAX_FORM_STR - 1] = '\0'; // Manually terminate string.
-	parse_form_string(s->format_string);
+	parse_form_string(s->form, s->format_string);
     s->pressure = 1013.25;
     s->offset = 0.0;
     s->echo_enabled = false;
@@ -77,12 +151,31 @@ int init_ptb330_sensor(ptb330_sensor **ptr) {
 	strncpy(s->module_two.batch_num, "550", MAX_BATCH_NUM);
 	strncpy(s->module_three.batch_num, "550", MAX_BATCH_NUM);
 	s->initialized = true;
-	clock_gettime(CLOCK_MONOTONIC, &s->last_send_time);
+	replay_clock_now(&s->last_send_time);
 	time_t now = time(NULL);
 	strftime(s->date_string, sizeof(s->date_string), "%Y-%m-%d", gmtime(&now));
     return 0;
 }
 
+/*
+ * Name:         free_ptb330_sensor
+ * Purpose:      Frees a sensor from init_ptb330_sensor() and its FORM.
+ * Arguments:    sensor - The sensor, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     Frees sensor and sensor->form.
+ * Returns:      None.
+ * Assumptions:  No thread is formatting a message for the sensor.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void free_ptb330_sensor(ptb330_sensor *sensor) {
+	if (!sensor) return;
+	free(sensor->form);
+	free(sensor);
+}
+
 /*
  * Name:         ptb330_is_ready_to_send
  * Purpose:      Determines if the required time interval has elapsed since the
@@ -98,13 +191,14 @@ int init_ptb330_sensor(ptb330_sensor **ptr) {
  *
  * Bugs:         None known.
  * Notes:        Uses CLOCK_MONOTONIC to ensure timing remains consistent even
- * 				 if the system real-time clock is adjusted.
+ * 				 if the system real-time clock is adjusted, read through
+ * 				 replay_clock_now() so --speed shortens the interval.
  */
 bool ptb330_is_ready_to_send(ptb330_sensor *sensor) {
     if (!sensor || sensor->mode != SMODE_RUN) return false;
 
     struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    replay_clock_now(&now);
 
     long seconds = now.tv_sec - sensor->last_send_time.tv_sec;
     if (seconds >= (long)(sensor->intv_data.interval * sensor->intv_data.multiplier)) return true;
@@ -160,11 +254,12 @@ double get_scaled_pressure(float hpa_val, PTB330_Unit unit) {
  * Name:         parse_form_string
  * Purpose:      Parses a PTB330 format string into a compiled array of items,
  * 				 identifying literals, escape sequences, and sensor variables.
- * Arguments:    input - The raw format string to be parsed (e.g., "P1 .3 P2 \R \N").
+ * Arguments:    f     - The unit's FORM, from its ptb330_sensor.
+ * 				 input - The raw format string to be parsed (e.g., "P1 .3 P2 \R \N").
  *
- * Output:       Populates the global compiled_form array and form_item_count.
- * Modifies:     Updates form_item_count, active_width, active_precision,
- * 				 and the compiled_form array.
+ * Output:       Populates f->items and f->item_count.
+ * Modifies:     Updates f->items, f->item_count, f->active_width,
+ * 				 f->active_precision and the formatter program.
  * Returns:      None.
  * Assumptions:  The input string follows Vaisala PTB330 format syntax.
  *
@@ -173,18 +268,18 @@ double get_scaled_pressure(float hpa_val, PTB330_Unit unit) {
  * 				 escapes (\R, \N, \T, or decimal codes). Limits items to
  * 				 MAX_FORM_ITEMS - 1 (49) to ensure array bounds 0-49.
  */
-void parse_form_string(const char *input) {
-    form_item_count = 0;
+void parse_form_string(PTB330Form *f, const char *input) {
+    f->item_count = 0;
     const char *p = input;
 
-    while (*p && form_item_count < (MAX_FORM_ITEMS)) { // This array is size 50, only add entries at 0-49.
+    while (*p && f->item_count < (MAX_FORM_ITEMS)) { // This array is size 50, only add entries at 0-49.
 		if (isdigit((unsigned char)p[0])) {
         	// Update the "active" format state
-        	active_width = atoi(p); // Pulls out the first integer, up to . without moving pointer.
+        	f->active_width = atoi(p); // Pulls out the first integer, up to . without moving pointer.
         	while (isdigit((unsigned char)*p)) p++; // Move the pointer up to the decimal.
         	if (*p == '.') {
             	p++;
-            	active_precision = atoi(p); // Set the precision.
+            	f->active_precision = atoi(p); // Set the precision.
             	while (isdigit((unsigned char)*p)) p++; // Move the pointer to the next non-digit.
         	}
         	// We don't create a FormItem here; we just updated the 'rule'
@@ -194,64 +289,64 @@ void parse_form_string(const char *input) {
             p++; // Skip leading quote
             int i = 0;
             while (*p && *p != '"' && i < (MAX_LITERAL_SIZE - 1)) { // char array 'literal' in struct is size 32.
-                compiled_form[form_item_count].literal[i++] = toupper((unsigned char)*p++);
+                f->items[f->item_count].literal[i++] = toupper((unsigned char)*p++);
             }
             if (*p == '"') {
 				p++; // Skip trailing quote, if there was no trailing quote the string is likely truncated and full of junk.
-            	compiled_form[form_item_count].literal[i] = '\0'; // here is why we need the (MAX_LITERAL_SIZE - 1) above.
-            	compiled_form[form_item_count].type = FORM_LITERAL;
+            	f->items[f->item_count].literal[i] = '\0'; // here is why we need the (MAX_LITERAL_SIZE - 1) above.
+            	f->items[f->item_count].type = FORM_LITERAL;
 			} else { // There was no trailing quote, null out the string and shout.
 				fprintf(stderr, "Error: Unclosed string literal in format\n");
-            	compiled_form[form_item_count].literal[0] = '\0'; // NULL terminate the string, this dumps all the consumed string.
-            	compiled_form[form_item_count].type = FORM_LITERAL;
+            	f->items[f->item_count].literal[0] = '\0'; // NULL terminate the string, this dumps all the consumed string.
+            	f->items[f->item_count].type = FORM_LITERAL;
 			}
-            form_item_count++;
+            f->item_count++;
         } else if (*p == '\\' || *p == '#') {
 			char next = toupper((unsigned char)*(p + 1));
 			if (next == 'T' || next == 'R' || next == 'N') {
-            	compiled_form[form_item_count].type = FORM_LITERAL;
+            	f->items[f->item_count].type = FORM_LITERAL;
 
 				if (next == 'T') {
-					compiled_form[form_item_count].literal[0] = '\t';
-		            compiled_form[form_item_count].literal[1] = '\0';
+					f->items[f->item_count].literal[0] = '\t';
+		            f->items[f->item_count].literal[1] = '\0';
 					p += 2;
             	}
 				else if (next == 'N') {
-					compiled_form[form_item_count].literal[0] = '\n';
-		            compiled_form[form_item_count].literal[1] = '\0';
+					f->items[f->item_count].literal[0] = '\n';
+		            f->items[f->item_count].literal[1] = '\0';
 					p += 2;
             	}
 				else if (next == 'R') {
-					compiled_form[form_item_count].literal[0] = '\r';
-		            compiled_form[form_item_count].literal[1] = '\0';
+					f->items[f->item_count].literal[0] = '\r';
+		            f->items[f->item_count].literal[1] = '\0';
 					next = toupper((unsigned char)*(p + 2)); // Check for RN
 					if (next == 'N') {
-						compiled_form[form_item_count].literal[1] = '\n';
-			            compiled_form[form_item_count].literal[2] = '\0';
+						f->items[f->item_count].literal[1] = '\n';
+			            f->items[f->item_count].literal[2] = '\0';
 						p += 3;
 					} else p += 2;
 				}
-            	form_item_count++; // Keep an eye on this, in the event \* is received.
+            	f->item_count++; // Keep an eye on this, in the event \* is received.
         	} else if (isdigit((unsigned char)p[1])) {
 				p++; // move pointer past '\\' or '#'
 				int dec_val = atoi(p);
 				while(*p && isdigit(*p)) p++; // Move pointer past the decimal code byte numbers.
-				compiled_form[form_item_count].literal[0] = (unsigned char)dec_val;
-	            compiled_form[form_item_count].literal[1] = '\0';
-				form_item_count++;
+				f->items[f->item_count].literal[0] = (unsigned char)dec_val;
+	            f->items[f->item_count].literal[1] = '\0';
+				f->item_count++;
 			} else {
 				p++; // Catch the bug if someone enters \\ or \* into the string.
 			}
 		} else if (*p == 'U' || *p == 'u') {
-			compiled_form[form_item_count].type = FORM_VAR_UNIT;
+			f->items[f->item_count].type = FORM_VAR_UNIT;
 			if (isdigit((unsigned char)p[1])) {
-        		compiled_form[form_item_count].width = p[1] - '0'; // Convert '3' to 3
+        		f->items[f->item_count].width = p[1] - '0'; // Convert '3' to 3
         		p += 2; // Jump past 'U' and the digit
     		} else {
-        		compiled_form[form_item_count].width = 0; // Default: no fixed width
+        		f->items[f->item_count].width = 0; // Default: no fixed width
         		p += 1; // Jump past 'U'
     		}
-			form_item_count++;
+			f->item_count++;
 		}
 		else if (isgraph(*p)) {
             // Handle Variables (P, P1, ERR, etc.)
@@ -263,355 +358,402 @@ void parse_form_string(const char *input) {
             }
             var_name[i] = '\0';
 			// make sure that it cascades into selection, i.e. check for PSTAB before P.
-            if (strncmp(var_name, "P1", 2) == 0) compiled_form[form_item_count].type = FORM_VAR_P1;
-            else if (strncmp(var_name, "P2", 2) == 0) compiled_form[form_item_count].type = FORM_VAR_P2;
-            else if (strncmp(var_name, "P3H", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_P3H;
-            else if (strncmp(var_name, "P3", 2) == 0) compiled_form[form_item_count].type = FORM_VAR_P3;
-            else if (strncmp(var_name, "ERR", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_ERR;
-            else if (strncmp(var_name, "DP12", 4) == 0) compiled_form[form_item_count].type = FORM_VAR_DP12;
-            else if (strncmp(var_name, "DP13", 4) == 0) compiled_form[form_item_count].type = FORM_VAR_DP13;
-            else if (strncmp(var_name, "DP23", 4) == 0) compiled_form[form_item_count].type = FORM_VAR_DP23;
-            else if (strncmp(var_name, "HCP", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_HCP;
-            else if (strncmp(var_name, "QFE", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_QFE;
-            else if (strncmp(var_name, "QNH", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_QNH;
-            else if (strncmp(var_name, "TP1", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_TP1;
-            else if (strncmp(var_name, "TP2", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_TP2;
-            else if (strncmp(var_name, "TP3", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_TP3;
-            else if (strncmp(var_name, "A3H", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_A3H;
-            else if (strncmp(var_name, "CS2", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_CS2;
-            else if (strncmp(var_name, "CS4", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_CS4;
-            else if (strncmp(var_name, "CSX", 3) == 0) compiled_form[form_item_count].type = FORM_VAR_CSX;
-            else if (strncmp(var_name, "SN", 2) == 0) compiled_form[form_item_count].type = FORM_VAR_SN;
-            else if (strncmp(var_name, "PSTAB", 5) == 0) compiled_form[form_item_count].type = FORM_VAR_PSTAB;
-            else if (strncmp(var_name, "ADDR", 4) == 0) compiled_form[form_item_count].type = FORM_VAR_ADDR;
-            else if (strncmp(var_name, "DATE", 4) == 0) compiled_form[form_item_count].type = FORM_VAR_DATE;
-            else if (strncmp(var_name, "TIME", 4) == 0) compiled_form[form_item_count].type = FORM_VAR_TIME;
-            else if (strncmp(var_name, "P", 1) == 0) compiled_form[form_item_count].type = FORM_VAR_P;
+            if (strncmp(var_name, "P1", 2) == 0) f->items[f->item_count].type = FORM_VAR_P1;
+            else if (strncmp(var_name, "P2", 2) == 0) f->items[f->item_count].type = FORM_VAR_P2;
+            else if (strncmp(var_name, "P3H", 3) == 0) f->items[f->item_count].type = FORM_VAR_P3H;
+            else if (strncmp(var_name, "P3", 2) == 0) f->items[f->item_count].type = FORM_VAR_P3;
+            else if (strncmp(var_name, "ERR", 3) == 0) f->items[f->item_count].type = FORM_VAR_ERR;
+            else if (strncmp(var_name, "DP12", 4) == 0) f->items[f->item_count].type = FORM_VAR_DP12;
+            else if (strncmp(var_name, "DP13", 4) == 0) f->items[f->item_count].type = FORM_VAR_DP13;
+            else if (strncmp(var_name, "DP23", 4) == 0) f->items[f->item_count].type = FORM_VAR_DP23;
+            else if (strncmp(var_name, "HCP", 3) == 0) f->items[f->item_count].type = FORM_VAR_HCP;
+            else if (strncmp(var_name, "QFE", 3) == 0) f->items[f->item_count].type = FORM_VAR_QFE;
+            else if (strncmp(var_name, "QNH", 3) == 0) f->items[f->item_count].type = FORM_VAR_QNH;
+            else if (strncmp(var_name, "TP1", 3) == 0) f->items[f->item_count].type = FORM_VAR_TP1;
+            else if (strncmp(var_name, "TP2", 3) == 0) f->items[f->item_count].type = FORM_VAR_TP2;
+            else if (strncmp(var_name, "TP3", 3) == 0) f->items[f->item_count].type = FORM_VAR_TP3;
+            else if (strncmp(var_name, "A3H", 3) == 0) f->items[f->item_count].type = FORM_VAR_A3H;
+            else if (strncmp(var_name, "CS2", 3) == 0) f->items[f->item_count].type = FORM_VAR_CS2;
+            else if (strncmp(var_name, "CS4", 3) == 0) f->items[f->item_count].type = FORM_VAR_CS4;
+            else if (strncmp(var_name, "CSX", 3) == 0) f->items[f->item_count].type = FORM_VAR_CSX;
+            else if (strncmp(var_name, "SN", 2) == 0) f->items[f->item_count].type = FORM_VAR_SN;
+            else if (strncmp(var_name, "PSTAB", 5) == 0) f->items[f->item_count].type = FORM_VAR_PSTAB;
+            else if (strncmp(var_name, "ADDR", 4) == 0) f->items[f->item_count].type = FORM_VAR_ADDR;
+            else if (strncmp(var_name, "DATE", 4) == 0) f->items[f->item_count].type = FORM_VAR_DATE;
+            else if (strncmp(var_name, "TIME", 4) == 0) f->items[f->item_count].type = FORM_VAR_TIME;
+            else if (strncmp(var_name, "P", 1) == 0) f->items[f->item_count].type = FORM_VAR_P;
 			// ... and so on
             else bad_cmd = true;
 
 			if (!bad_cmd) {
-				compiled_form[form_item_count].width = active_width;
-        		compiled_form[form_item_count].precision = active_precision;
-        		form_item_count++;
+				f->items[f->item_count].width = f->active_width;
+        		f->items[f->item_count].precision = f->active_precision;
+        		f->item_count++;
 			}
         }
         else {
             p++; // Skip spaces between tokens
         }
     }
+    compile_form_program(f);
 }
 
 
 
-// This function is called every time a measurement is requested (e.g., every 1 second)
+/*
+ * Name:         format_fixed
+ * Purpose:      Writes a double as printf("%*.*f") would, without the printf machinery.
+ * Arguments:    out   - destination.
+ * 				 room  - bytes available at out, including the terminator.
+ * 				 value - the number to print.
+ * 				 width - minimum field width, padded with leading spaces.
+ * 				 precision - digits after the decimal point.
+ * 				 plus  - always print a sign, as the '+' flag.
+ *
+ * Output:       None.
+ * Modifies:     out, NULL terminated.
+ * Returns:      The number of characters written, or -1 if they do not fit in room.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The value is scaled to an integer number of units in the last place
+ * 				 and printed with integer arithmetic. printf rounds the exact binary
+ * 				 value half to even, which the scaled product can only misjudge
+ * 				 within rounding error of a tie, so anything that close to .5, very
+ * 				 large, non finite or over FIXED_MAX_PRECISION goes to snprintf().
+ */
+static int format_fixed(char *out, size_t room, double value, int width, int precision, bool plus) {
+	static const double pow10[FIXED_MAX_PRECISION + 1] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+	bool neg = signbit(value);
+	double scaled = precision <= FIXED_MAX_PRECISION ? fabs(value) * pow10[precision] : 0.0;
+	double whole = floor(scaled);
+	double frac = scaled - whole;
+
+	if (precision > FIXED_MAX_PRECISION || !isfinite(value) || scaled >= FIXED_MAX_SCALED || fabs(frac - 0.5) < FIXED_TIE_GUARD) {
+		int n = snprintf(out, room, plus ? "%+*.*f" : "%*.*f", width, precision, value);
+		return (n < 0 || (size_t)n >= room) ? -1 : n;
+	}
+
+	uint64_t units = (uint64_t)whole + (frac > 0.5);
+	char digits[24]; // Reversed: fraction digits, then the integer part.
+	int n = 0;
+	for (int i = 0; i < precision; i++) {
+		digits[n++] = (char)('0' + units % 10);
+		units /= 10;
+	}
+	do {
+		digits[n++] = (char)('0' + units % 10);
+		units /= 10;
+	} while (units);
+
+	bool sign = neg || plus;
+	int len = n + (precision > 0) + sign;
+	int pad = width > len ? width - len : 0;
+	if ((size_t)(len + pad) >= room) return -1;
+
+	char *p = out;
+	while (pad--) *p++ = ' ';
+	if (sign) *p++ = neg ? '-' : '+';
+	for (int i = n - 1; i >= 0; i--) {
+		if (i == precision - 1) *p++ = '.';
+		*p++ = digits[i];
+	}
+	*p = '\0';
+	return (int)(p - out);
+}
+
+/*
+ * Name:         format_hex
+ * Purpose:      Writes value as printf("%0*X") would.
+ * Arguments:    out - destination, room - bytes available, value - the number,
+ * 				 min_digits - zero padded minimum width.
+ *
+ * Returns:      The number of characters written, or -1 if they do not fit in room.
+ */
+static int format_hex(char *out, size_t room, unsigned int value, int min_digits) {
+	static const char hex[] = "0123456789ABCDEF";
+	char digits[8];
+	int n = 0;
+	do {
+		digits[n++] = hex[value & 0xF];
+		value >>= 4;
+	} while (value || n < min_digits);
+	if ((size_t)n >= room) return -1;
+	for (int i = 0; i < n; i++) out[i] = digits[n - 1 - i];
+	out[n] = '\0';
+	return n;
+}
+
+/*
+ * Name:         emit_number
+ * Purpose:      Returns the number an OP_NUMBER instruction prints, in the output unit.
+ * Arguments:    op    - the instruction.
+ * 				 p_msg - the current measurement.
+ * 				 scale - hPa to output unit multiplier, resolved once per message.
+ *
+ * Returns:      The value to print.
+ */
+static double emit_number(const FormOp *op, const ParsedMessage *p_msg, double scale) {
+	double v = 0.0;
+	switch (op->source) {
+		case FORM_VAR_P1:   v = p_msg->p1_pressure; break;
+		case FORM_VAR_P2:   v = p_msg->p2_pressure; break;
+		case FORM_VAR_P3:   v = p_msg->p3_pressure; break;
+		case FORM_VAR_QFE:  // Fall into P as the value is the same.
+		case FORM_VAR_P:    v = p_msg->p_average; break;
+		case FORM_VAR_DP12: v = p_msg->p1_pressure - p_msg->p2_pressure; break;
+		case FORM_VAR_DP13: v = p_msg->p1_pressure - p_msg->p3_pressure; break;
+		case FORM_VAR_DP23: v = p_msg->p2_pressure - p_msg->p3_pressure; break;
+		case FORM_VAR_QNH:  // Fall into HCP as the code is the same.
+		case FORM_VAR_HCP:  v = get_hcp_pressure(p_msg->p_average, p_msg->altitude); break;
+		case FORM_VAR_TP1:  v = p_msg->p1_temperature; break;
+		case FORM_VAR_TP2:  v = p_msg->p2_temperature; break;
+		case FORM_VAR_TP3:  v = p_msg->p3_temperature; break;
+		case FORM_VAR_P3H:  v = p_msg->trend; break;
+		case FORM_VAR_A3H:  v = p_msg->tendency; break;
+		default: break;
+	}
+	// get_scaled_pressure() takes a float, keep its rounding so the output is unchanged.
+	return op->scaled ? (double)(float)v * scale : v;
+}
+
+/*
+ * Name:         compile_form_program
+ * Purpose:      Lowers f->items into the instruction list build_dynamic_output() runs.
+ * Arguments:    f - The unit's FORM.
+ *
+ * Output:       None.
+ * Modifies:     f->build, publishes it to f->shared.
+ * Returns:      None.
+ * Assumptions:  f->items and f->item_count are current. Called from one thread per unit only.
+ *
+ * Bugs:         None known.
+ * Notes:        Adjacent literals are merged into one copy, and each variable's
+ * 				 default width/precision, sign flag and whether it is a pressure
+ * 				 that takes the UNIT scale are decided here, once per FORM command,
+ * 				 instead of once per field per message.
+ */
+static void compile_form_program(PTB330Form *f) {
+	size_t text_len = 0;
+	FormProgram *prog = &f->build;
+	prog->op_count = 0;
+	prog->uses_clock = false;
+
+	for (int i = 0; i < f->item_count; i++) {
+		const FormItem *item = &f->items[i];
+		FormOp op = { .opcode = OP_NUMBER, .source = (uint8_t)item->type, .width = item->width, .precision = item->precision };
+
+		switch (item->type) {
+			case FORM_LITERAL: {
+				size_t len = strlen(item->literal);
+				if (len == 0) continue; // \0 or an unclosed quote, nothing to print.
+				if (prog->op_count > 0 && prog->ops[prog->op_count - 1].opcode == OP_LITERAL) {
+					memcpy(prog->text + text_len, item->literal, len);
+					prog->ops[prog->op_count - 1].length += (uint16_t)len;
+					text_len += len;
+					continue;
+				}
+				op.opcode = OP_LITERAL;
+				op.offset = (uint16_t)text_len;
+				op.length = (uint16_t)len;
+				memcpy(prog->text + text_len, item->literal, len);
+				text_len += len;
+				break;
+			}
+			case FORM_VAR_P: case FORM_VAR_P1: case FORM_VAR_P2: case FORM_VAR_P3:
+			case FORM_VAR_DP12: case FORM_VAR_DP13: case FORM_VAR_DP23:
+			case FORM_VAR_HCP: case FORM_VAR_QFE: case FORM_VAR_QNH:
+				op.scaled = true;
+				if (op.width == 0) { op.width = 8; op.precision = 2; }
+				break;
+			case FORM_VAR_TP1: case FORM_VAR_TP2: case FORM_VAR_TP3:
+				if (op.width == 0) { op.width = 3; op.precision = 2; }
+				break;
+			case FORM_VAR_P3H: // Always "%+.2f", the trend ignores the width rule.
+				op.width = 0;
+				op.precision = 2;
+				op.plus = true;
+				break;
+			case FORM_VAR_A3H:
+				if (op.width == 0) { op.precision = 2; op.plus = true; }
+				break;
+			case FORM_VAR_UNIT:  op.opcode = OP_UNIT; break;
+			case FORM_VAR_ERR:   op.opcode = OP_ERR; break;
+			case FORM_VAR_DATE:  op.opcode = OP_DATE; prog->uses_clock = true; break;
+			case FORM_VAR_TIME:  op.opcode = OP_TIME; prog->uses_clock = true; break;
+			case FORM_VAR_CS2:   op.opcode = OP_CS2; break;
+			case FORM_VAR_CS4:   op.opcode = OP_CS4; break;
+			case FORM_VAR_CSX:   op.opcode = OP_CSX; break;
+			case FORM_VAR_PSTAB: op.opcode = OP_PSTAB; break;
+			case FORM_VAR_SN:    op.opcode = OP_SN; break;
+			case FORM_VAR_ADDR:  op.opcode = OP_ADDR; break;
+		}
+		prog->ops[prog->op_count++] = op;
+	}
+	seqlock_write(&f->lock, &f->shared, prog, sizeof(*prog));
+}
+
+/*
+ * Name:         clock_cache
+ * Purpose:      The calling thread's DATE and TIME field text, in local time.
+ * Notes:        Thread local, so no lock is needed. localtime_r() runs once an
+ * 				 hour, see calendar_set().
+ */
+static __thread Calendar clock_cache = CALENDAR_INITIALIZER(CALENDAR_LOCAL);
 
 /*
  * Name:         build_dynamic_output
  * Purpose:      Constructs a formatted output string based on the compiled
  * 				 representation of the PTB330 format string and the current sensor data.
- * Arguments:    p_msg      - Pointer to the ParsedMessage containing current measurements.
+ * Arguments:    form       - The unit's FORM, from its ptb330_sensor.
+ * 				 p_msg      - Pointer to the ParsedMessage containing current measurements.
  * 				 output_buf - Destination buffer for the constructed string.
  * 				 buf_len    - Maximum size of the destination buffer.
  *
  * Output:       The final formatted string stored in output_buf.
- * Modifies:     Updates output_buf and moves internal pointer/remaining count
- * 				 tracking to ensure safe snprintf calls.
+ * Modifies:     Updates output_buf.
  * Returns:      None.
- * Assumptions:  form_item_count and compiled_form are populated; output_buf
- * 				 is large enough to hold the generated data.
+ * Assumptions:  parse_form_string() has been called; output_buf is large enough
+ * 				 to hold the generated data.
  *
  * Bugs:         None known.
- * Notes:        Handles variables (P1, P2, etc.), unit conversions, checksums
- * 				 (CS2/CS4/CSX), and timestamp formatting. Uses *.*f for
- * 				 dynamic width and precision control.
+ * Notes:        Runs the instruction list built by compile_form_program(). The unit
+ * 				 scale is looked up once per message, numbers go through
+ * 				 format_fixed(), and DATE/TIME come from the per-second cache.
+ * 				 Output stops at the last field that fits, as before. Checksums
+ * 				 (CS2/CS4/CSX) cover everything written before them. Each thread
+ * 				 runs its own copy of the program, so a FORM compiled by the
+ * 				 receiver never changes under a message being built. A thread
+ * 				 formatting for several units copies the program in again when
+ * 				 the unit changes.
  */
-void build_dynamic_output(ParsedMessage *p_msg, char *output_buf, size_t buf_len) {
-    char *ptr = output_buf;
-    size_t remaining = buf_len;
-    output_buf[0] = '\0';    // Terminate the string at the first char.
-
-	time_t t = time(NULL);
-	struct tm *tm_info = localtime(&t);
-
-
-    for (int i = 0; i < form_item_count; i++) {
-        int written = 0;
-
-        switch (compiled_form[i].type) {
-            case FORM_LITERAL:
-                // Copy the static text the user wanted (e.g., "Pressure: " or any \t \r \n chars)
-                written = snprintf(ptr, remaining, "%s", compiled_form[i].literal);
-                break;
-
-            case FORM_VAR_P1:
-                // Fetch the CURRENT value of P1
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure(p_msg->p1_pressure, p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure(p_msg->p1_pressure, p_msg->units));
-				}
-                break;
-            case FORM_VAR_P2:
-                // Fetch the CURRENT value of P2
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure(p_msg->p2_pressure, p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure(p_msg->p2_pressure, p_msg->units));
-				}
-                break;
-            case FORM_VAR_P3:
-                // Fetch the CURRENT value of P3
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure(p_msg->p3_pressure, p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure(p_msg->p3_pressure, p_msg->units));
-				}
-                break;
-
-            case FORM_VAR_P:
-                // Fetch the CURRENT value of P3
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure(p_msg->p_average, p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure(p_msg->p_average, p_msg->units));
-				}
+void build_dynamic_output(const PTB330Form *form, ParsedMessage *p_msg, char *output_buf, size_t buf_len) {
+	if (buf_len == 0) return;
+	char *ptr = output_buf;
+	size_t remaining = buf_len;
+	output_buf[0] = '\0';    // Terminate the string at the first char.
+
+	if (form != form_local_owner || seqlock_sequence(&form->lock) != form_local_seq) { // Another unit, or a FORM compiled since.
+		form_local_seq = seqlock_read(&form->lock, &form_local, &form->shared, sizeof(form_local));
+		form_local_owner = form;
+	}
+	const FormProgram *prog = &form_local;
+
+	double scale = get_scaled_pressure(1.0f, p_msg->units);
+	if (prog->uses_clock) calendar_set(&clock_cache, time(NULL));
+
+	for (int i = 0; i < prog->op_count; i++) {
+		const FormOp *op = &prog->ops[i];
+		const char *text = NULL;
+		size_t text_len = 0;
+		int written = -1;
+
+		switch (op->opcode) {
+			case OP_LITERAL:
+				text = prog->text + op->offset;
+				text_len = op->length;
 				break;
-            case FORM_VAR_ERR: {
-				written = snprintf(ptr, remaining, "%X%X%X",
-                       p_msg->p1_sensor_error,
-                       p_msg->p2_sensor_error,
-                       p_msg->p3_sensor_error);
-			    break;
-			}
-            case FORM_VAR_P3H:
-                // Fetch the CURRENT 3-hour pressure trend
-                written = snprintf(ptr, remaining, "%+.2f", p_msg->trend);
-                break;
-			case FORM_VAR_UNIT:
-				const char *unit_str = get_unit_str(p_msg->units); // e.g., "hPa"
-    			int w = compiled_form[i].width;
-
-    			if (w > 0) {
-        			// Use a temporary buffer to handle the truncation/padding safely
-        			char temp_unit[MAX_UNIT_STR];
-        			// Format: Left-justified, fixed width 'w', max characters 'w'
-					if (w > (int)sizeof(temp_unit) - 1) w = (int)sizeof(temp_unit) - 1;
-        			snprintf(temp_unit, sizeof(temp_unit), "%-*.*s", w, w, unit_str);
-        			written = snprintf(ptr, remaining, "%s", temp_unit);
-    			} else {
-        			// Just print the natural string
-        			written = snprintf(ptr, remaining, "%s", unit_str);
-    			}
+			case OP_NUMBER:
+				written = format_fixed(ptr, remaining, emit_number(op, p_msg, scale), op->width, op->precision, op->plus);
 				break;
-			case FORM_VAR_DATE: {
-    			// Format: 2026-02-09
-    			written = snprintf(ptr, remaining, "%04d-%02d-%02d",
-                       tm_info->tm_year + 1900,
-                       tm_info->tm_mon + 1,
-                       tm_info->tm_mday);
-    			break;
-			}
-			case FORM_VAR_TIME: {
-			    // Format: 13:56:55
-			    written = snprintf(ptr, remaining, "%02d:%02d:%02d",
-                       tm_info->tm_hour,
-                       tm_info->tm_min,
-                       tm_info->tm_sec);
-			    break;
-			}
-			case FORM_VAR_DP12: { // Delta p1 - p2
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure((p_msg->p1_pressure - p_msg->p2_pressure), p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure((p_msg->p1_pressure - p_msg->p2_pressure), p_msg->units));
+			case OP_UNIT: {
+				text = get_unit_str(p_msg->units); // e.g., "hPa"
+				text_len = strlen(text);
+				if (op->width > 0) { // Left-justified, fixed width, truncated to the width.
+					size_t w = op->width < MAX_UNIT_STR - 1 ? op->width : MAX_UNIT_STR - 1;
+					if (w >= remaining) break;
+					if (text_len > w) text_len = w;
+					memcpy(ptr, text, text_len);
+					memset(ptr + text_len, ' ', w - text_len);
+					ptr[w] = '\0';
+					written = (int)w;
+					text = NULL;
 				}
 				break;
 			}
-			case FORM_VAR_DP13: { // Delta p1 - p3
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure((p_msg->p1_pressure - p_msg->p3_pressure),p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure((p_msg->p1_pressure - p_msg->p3_pressure), p_msg->units));
+			case OP_ERR:
+				if (remaining > 3) {
+					ptr[0] = (char)('0' + p_msg->p1_sensor_error);
+					ptr[1] = (char)('0' + p_msg->p2_sensor_error);
+					ptr[2] = (char)('0' + p_msg->p3_sensor_error);
+					ptr[3] = '\0';
+					written = 3;
 				}
 				break;
-			}
-			case FORM_VAR_DP23: { // Delta p2 - p3
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2f", get_scaled_pressure((p_msg->p2_pressure - p_msg->p3_pressure), p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*f",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure((p_msg->p2_pressure - p_msg->p3_pressure), p_msg->units));
-				}
+			case OP_DATE:
+				text = clock_cache.ymd; // Format: 2026-02-09
+				text_len = sizeof(clock_cache.ymd) - 1;
 				break;
-			}
-			case FORM_VAR_QNH: // Fall into HCP as the code is the same.
-			case FORM_VAR_HCP: {
-				double cor_altitude = get_scaled_pressure(get_hcp_pressure(p_msg->p_average, p_msg->altitude), p_msg->units);
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2lf", cor_altitude);
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*lf",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		cor_altitude);
-				}
+			case OP_TIME:
+				text = clock_cache.hms; // Format: 13:56:55
+				text_len = sizeof(clock_cache.hms) - 1;
 				break;
-			}
-			case FORM_VAR_QFE: {
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%8.2lf", get_scaled_pressure(p_msg->p_average, p_msg->units));
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*lf",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		get_scaled_pressure(p_msg->p_average, p_msg->units));
-				}
+			case OP_CS2:
+				written = format_hex(ptr, remaining, calculate_cs2(output_buf, (size_t)(ptr - output_buf)), 2);
 				break;
-			}
-			case FORM_VAR_TP1: {
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%3.2lf", p_msg->p1_temperature);
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*lf",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		p_msg->p1_temperature);
-				}
+			case OP_CS4:
+				written = format_hex(ptr, remaining, calculate_cs4(output_buf, (size_t)(ptr - output_buf)), 2);
 				break;
-			}
-			case FORM_VAR_TP2: {
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%3.2lf", p_msg->p2_temperature);
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*lf",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		p_msg->p2_temperature);
-				}
+			case OP_CSX:
+				written = format_hex(ptr, remaining, calculate_csx(output_buf, (size_t)(ptr - output_buf)), 2);
 				break;
-			}
-			case FORM_VAR_TP3: {
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-    				written = snprintf(ptr, remaining, "%3.2lf", p_msg->p3_temperature);
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*lf",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		p_msg->p3_temperature);
-				}
+			case OP_PSTAB:
+				text = "OK";
+				text_len = 2;
 				break;
-			}
-			case FORM_VAR_A3H: {
-				if (compiled_form[i].width == 0) {
-				    // 0.0 case: Revert to default sensor precision
-	                written = snprintf(ptr, remaining, "%+.2f", p_msg->tendency);
-				} else {
-    				// Custom case: Use the x.y provided by the user
-    				written = snprintf(ptr, remaining, "%*.*lf",
-                    	   	compiled_form[i].width,
-                       		compiled_form[i].precision,
-                       		p_msg->tendency);
+			case OP_SN:
+				text = p_msg->serial_num;
+				text_len = strnlen(p_msg->serial_num, MAX_SN_LEN);
+				break;
+			case OP_ADDR: {
+				char digits[4];
+				int n = 0;
+				unsigned int addr = p_msg->address;
+				do { digits[n++] = (char)('0' + addr % 10); addr /= 10; } while (addr);
+				if ((size_t)n < remaining) {
+					for (int d = 0; d < n; d++) ptr[d] = digits[n - 1 - d];
+					ptr[n] = '\0';
+					written = n;
 				}
 				break;
 			}
-			case FORM_VAR_CS2: {
-				// Calculate length of string built up to this exact moment
-    			size_t current_len = (size_t)(ptr - output_buf);
-
-			    // Run the sum on the existing content
-			    unsigned char cs2_val = calculate_cs2(output_buf, current_len);
-
-			    // Print the hex result into the buffer
-			    written = snprintf(ptr, remaining, "%02X", cs2_val);
-			    break;
-			}
-			case FORM_VAR_CS4: {
-				// Calculate length of string built up to this exact moment
-    			size_t current_len = (size_t)(ptr - output_buf);
-
-			    // Run the sum on the existing content
-			    uint16_t cs4_val = calculate_cs4(output_buf, current_len);
+		}
 
-			    // Print the hex result into the buffer
-			    written = snprintf(ptr, remaining, "%02X", cs4_val);
-				break;
-			}
-			case FORM_VAR_CSX: {
-				// Calculate length of string built up to this exact moment
-    			size_t current_len = (size_t)(ptr - output_buf);
+		if (text) {
+			if (text_len >= remaining) break; // Buffer is full, break out of our loop here.
+			memcpy(ptr, text, text_len);
+			ptr[text_len] = '\0';
+			written = (int)text_len;
+		}
+		// Move the pointer forward so the next item appends to the end
+		if (written < 0) break; // Buffer is full, break out of our loop here.
+		ptr += written;
+		remaining -= (size_t)written;
+	}
+}
 
-			    // Run the sum on the existing content
-			    unsigned char csx_val = calculate_csx(output_buf, current_len);
+#ifdef WX_FIXED_POINT
+#define BARO_MANTISSA_BITS 29 // Pressure mantissa kept through the correction, room for a ratio up to 4.
 
-			    // Print the hex result into the buffer
-			    written = snprintf(ptr, remaining, "%02X", csx_val);
-				break;
-			}
-			case FORM_VAR_PSTAB: {
-			    written = snprintf(ptr, remaining, "OK");
-				break;
-			}
-			case FORM_VAR_SN: {
-			    written = snprintf(ptr, remaining, "%s", p_msg->serial_num);
-				break;
-			}
-			case FORM_VAR_ADDR: {
-			    written = snprintf(ptr, remaining, "%d", p_msg->address);
-				break;
-			}
-        }
-        // Move the pointer forward so the next item appends to the end
-        if (written > 0 && (size_t)written < remaining) {
-            ptr += written;
-            remaining -= written;
-        } else break; // Buffer is full, break out of our loop here.
-    }
+/*
+ * Name:         barometric_correction
+ * Purpose:      station_p / (1 + offset)^exponent in fixed point, with no pow().
+ * Arguments:    station_p - The station pressure, any unit.
+ * 				 offset    - The hypsometric base less one, -L * h / T.
+ * 				 exponent  - g / (R * L).
+ *
+ * Returns:      The corrected pressure, in the unit of station_p.
+ * Notes:        The division is a scale by 2^(-exponent * log2(1 + offset)) of
+ * 				 station_p's mantissa, and agrees with pow() to about 1E-7 relative.
+ */
+static double barometric_correction(double station_p, double offset, double exponent) {
+	int octave;
+	double mantissa = frexp(station_p, &octave);
+	q5_26 y = q5_sat_mul(q5_from_double(-exponent), q1_log2_1p(q1_sat_from_double(offset)));
+	int32_t p = q1_scale_exp2((int32_t)lrint(ldexp(mantissa, BARO_MANTISSA_BITS)), y);
+	return ldexp((double)p, octave - BARO_MANTISSA_BITS);
 }
+#endif
 
 /*
  * Name:         calculate_sea_level_pressure
@@ -629,6 +771,7 @@ void build_dynamic_output(ParsedMessage *p_msg, char *output_buf, size_t buf_len
  * Bugs:         None known.
  * Notes:        Uses a standard lapse rate of 0.0065 K/m and the barometric
  * 				 formula: $P_0 = P_s / (1 - \frac{L \cdot h}{T_s + L \cdot h})^{(g / (R \cdot L))}$
+ * 				 Built with WX_FIXED_POINT the power is the q1_31 table kernel.
  */
 double calculate_sea_level_pressure(double station_p, double elevation_m, double temp_c) {
     double temp_k = temp_c + 273.15;
@@ -639,10 +782,14 @@ double calculate_sea_level_pressure(double station_p, double elevation_m, double
     // The exponent part of the equation: (g / (R * L))
     double exponent = g / (r * lapse_rate);
 
+#ifdef WX_FIXED_POINT
+    return barometric_correction(station_p, -(lapse_rate * elevation_m) / (temp_k + lapse_rate * elevation_m), exponent);
+#else
     // The base part of the equation
     double base = 1 - (lapse_rate * elevation_m) / (temp_k + lapse_rate * elevation_m);
 
     return station_p / pow(base, exponent);
+#endif
 }
 
 
@@ -661,6 +808,7 @@ double calculate_sea_level_pressure(double station_p, double elevation_m, double
  * Bugs:         None known.
  * Notes:        Uses the formula: $$P_0 = \frac{P_s}{(1 - \frac{L \cdot h}{T_0})^{\frac{g}{R \cdot L}}}$$
  * 				 If altitude_m is 0.0, the function returns station_p directly.
+ * 				 Built with WX_FIXED_POINT the power is the q1_31 table kernel.
  */
 double get_hcp_pressure(double station_p, double altitude_m) {
     // Standard atmosphere constants
@@ -675,7 +823,87 @@ double get_hcp_pressure(double station_p, double altitude_m) {
     // ISA Formula: P = Ps * (1 - (L*H)/To)^(-g/RL)
     // Note: To is usually the sea-level standard temperature (288.15K)
     double exponent = g / (r * lapse_rate);
+#ifdef WX_FIXED_POINT
+    return barometric_correction(station_p, -(lapse_rate * altitude_m) / sea_level_temp_k, exponent);
+#else
     double base = 1.0 - (lapse_rate * altitude_m) / sea_level_temp_k;
 
     return station_p / pow(base, exponent);
+#endif
+}
+
+/*
+ * Name:         ptb330_parse_message
+ * Purpose:      Tokenizes a comma-delimited data file record and populates a ParsedMessage struct.
+ * Arguments:    msg: the raw input string to be parsed (modified by strtok_r).
+ * 				 p_message: pointer to the struct where parsed data will be stored.
+ * 				 sensor: the sensor whose altitude, serial number, address and units are copied in.
+ *
+ * Output:       None.
+ * Modifies:     p_message: overwrites with new data.
+ * 				 msg: the input string is modified (nulls inserted by strtok_r).
+ * Returns:      None
+ * Assumptions:  msg matches the data file format, p_message has been allocated by the caller.
+ *
+ * Bugs:         None known.
+ * Notes:        Shared by the standalone emulator and the wxsensord personality.
+ */
+void ptb330_parse_message(char *msg, ParsedMessage *p_message, const ptb330_sensor *sensor) {
+	memset(p_message, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
+	char *saveptr; // Our place keeper in the msg string.
+	char *token; // Where we temporarily store each token.
+
+	if ((token = strtok_r(msg, ",", &saveptr))) p_message->p1_pressure = atof(token);  // Set P1 pressure.
+   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
+	// These are pulled from a text file in this format:
+	// 1013.25,1013.24,1013.26,23.4,23.5,23.2,0,0,0,1013.25,0.00
+	// P1 Pressure,P2 Pressure,P3 Pressure,P1 Temp,P2 Temp,P3 Temp,P1 Error,P2 Error, P3, Error,Pressure Average,Pressure Trend
+   	if ((token = NEXT_T)) p_message->p2_pressure = atof(token); // Set P2 pressure.
+   	if ((token = NEXT_T)) p_message->p3_pressure = atof(token); // Set P3 pressure.
+	if ((token = NEXT_T)) p_message->p1_temperature = atof(token); // Set P1 temperature.
+	if ((token = NEXT_T)) p_message->p2_temperature = atof(token); // Set P2 temperature.
+	if ((token = NEXT_T)) p_message->p3_temperature = atof(token); // Set P3 temperature.
+   	if ((token = NEXT_T)) { // Set P1 error.
+		if (atoi(token) == 1) {
+			p_message->p1_sensor_error = IS_ERROR;
+		} else p_message->p1_sensor_error = NO_ERROR;
+	}
+   	if ((token = NEXT_T)) { // Set P2 error.
+		if (atoi(token) == 1) {
+			p_message->p2_sensor_error = IS_ERROR;
+		} else p_message->p2_sensor_error = NO_ERROR;
+	}
+   	if ((token = NEXT_T)) { // Set P3 error.
+		if (atoi(token) == 1) {
+			p_message->p3_sensor_error = IS_ERROR;
+		} else p_message->p3_sensor_error = NO_ERROR;
+	}
+	if ((token = NEXT_T)) p_message->p_average = atof(token); // Set Pressure Average.
+	if ((token = NEXT_T)) p_message->trend = atof(token); // Set Pressure Trend.
+	if ((token = NEXT_T)) p_message->tendency = atof(token); // Set Pressure Tendency.
+	#undef NEXT_T
+	ptb330_apply_sensor(p_message, sensor);
+}
+
+/*
+ * Name:         ptb330_apply_sensor
+ * Purpose:      Copies the sensor settings a message is formatted with into a parsed record.
+ * Arguments:    p_message: the record, freshly parsed or copied from a .wxb cache.
+ * 				 sensor: the sensor whose altitude, serial number, address and units are copied in.
+ *
+ * Output:       None.
+ * Modifies:     p_message altitude, serial_num, address and units.
+ * Returns:      None
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Kept apart from the parse so cached records, which are converted
+ *               with a default sensor, follow the live configuration.
+ */
+void ptb330_apply_sensor(ParsedMessage *p_message, const ptb330_sensor *sensor) {
+	p_message->altitude = sensor->hcp_altitude; // Update the sensor hcp_altitude.
+	strncpy(p_message->serial_num, sensor->serial_number, MAX_SN_LEN - 1); // Copy the serial numbers over.
+	p_message->serial_num[MAX_SN_LEN - 1] = '\0';
+	p_message->address = sensor->address;
+	p_message->units = sensor->units;
 }
@@ -0,0 +1,580 @@
+/*
+ * File:     pulse_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Precision pulse train engine shared by cs700h and fan_sim, see
+ *           pulse_utils.h.
+ *
+ *           Deadlines are absolute on CLOCK_MONOTONIC and each one is the
+ *           previous deadline plus the interval, so the pulse count over a
+ *           weather block is exact whatever the wake-up jitter. The pulse width
+ *           is timed from the achieved rising edge, so a late edge shifts the
+ *           pulse but never shortens it.
+ *
+ * Mods:
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include "pulse_utils.h"
+#include "console_utils.h"
+
+#define PWM_EXPORT_WAIT_MS 1000 // udev takes a moment to give a newly exported channel its permissions.
+#define STACK_PREFAULT 65536    // Stack touched before the first pulse so mlockall() has it resident.
+
+static int64_t ts_to_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * PULSE_NS_PER_SEC + ts->tv_nsec;
+}
+
+static struct timespec ns_to_ts(int64_t ns) {
+    struct timespec ts = { .tv_sec = (time_t)(ns / PULSE_NS_PER_SEC), .tv_nsec = (long)(ns % PULSE_NS_PER_SEC) };
+    return ts;
+}
+
+static int64_t mono_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_to_ns(&ts);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Name:         pulse_parse_options
+ * Purpose:      Takes --pwm CHIP:CHANNEL and --rt-priority N off the command line.
+ * Arguments:    argc: pointer to the argument count, updated.
+ * 				 argv: the argument vector, compacted in place.
+ * 				 opts: filled with the options found, or the defaults.
+ *
+ * Output:       An error message on stderr for a malformed value.
+ * Modifies:     argc, argv, opts.
+ * Returns:      0 on success, -1 on a malformed value.
+ * Assumptions:  argv[*argc] may be written (it is NULL by the C standard).
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors replay_parse_options(); both forms "--opt V" and
+ * 				 "--opt=V" are accepted and the other arguments keep their order.
+ */
+int pulse_parse_options(int *argc, char **argv, PulseOptions *opts) {
+    opts->rt_priority = PULSE_RT_PRIORITY;
+    opts->pwm_chip = -1;
+    opts->pwm_channel = -1;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *names[] = { "--pwm", "--rt-priority" };
+        const char *value = NULL;
+        int which = -1;
+
+        for (int k = 0; k < 2 && which < 0; k++) {
+            size_t n = strlen(names[k]);
+            if (strncmp(argv[i], names[k], n) != 0) continue;
+            if (argv[i][n] == '=') {
+                value = argv[i] + n + 1;
+                which = k;
+            } else if (argv[i][n] == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+                which = k;
+            }
+        }
+        if (which < 0) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        char *end = NULL;
+        if (which == 0) {
+            long chip = strtol(value, &end, 10);
+            long channel = -1;
+            if (end != value && *end == ':') {
+                const char *c = end + 1;
+                channel = strtol(c, &end, 10);
+                if (end == c) channel = -1;
+            }
+            if (chip < 0 || chip > 255 || channel < 0 || channel > 255 || *end != '\0') {
+                fprintf(stderr, "Invalid --pwm '%s': use CHIP:CHANNEL, as in %s/pwmchipCHIP/pwmCHANNEL\n", value, PULSE_PWM_SYSFS);
+                return -1;
+            }
+            opts->pwm_chip = (int)chip;
+            opts->pwm_channel = (int)channel;
+        } else {
+            long prio = strtol(value, &end, 10);
+            int max = sched_get_priority_max(SCHED_FIFO);
+            if (end == value || *end != '\0' || prio < 0 || prio > max) {
+                fprintf(stderr, "Invalid --rt-priority '%s': use 1-%d, or 0 for the normal scheduler\n", value, max);
+                return -1;
+            }
+            opts->rt_priority = (int)prio;
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+ * Name:         pwm_write
+ * Purpose:      Writes a decimal value to an open sysfs PWM attribute.
+ * Arguments:    fd: the attribute.
+ * 				 value: the value.
+ *
+ * Output:       None.
+ * Modifies:     The PWM channel.
+ * Returns:      0 on success, -1 with errno set on failure.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        sysfs takes the whole value in one write at offset 0.
+ */
+static int pwm_write(int fd, int64_t value) {
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), "%lld", (long long)value);
+    return pwrite(fd, buf, (size_t)n, 0) == n ? 0 : -1;
+}
+
+/*
+ * Name:         pwm_open
+ * Purpose:      Exports a PWM channel if needed and opens its attributes.
+ * Arguments:    p: the channel, chip and channel already set.
+ *
+ * Output:       None.
+ * Modifies:     p's descriptors, the channel is left disabled with a zero duty cycle.
+ * Returns:      0 on success, -1 with errno set on failure.
+ * Assumptions:  The pin has been switched to its PWM function, on a Pi 5 by a
+ * 				 dtoverlay such as pwm-2chan.
+ *
+ * Bugs:         None known.
+ * Notes:        A channel that is already exported is used as it is.
+ */
+static int pwm_open(PulsePwm *p) {
+    char path[96];
+    snprintf(path, sizeof(path), PULSE_PWM_SYSFS "/pwmchip%d/pwm%d/period", p->chip, p->channel);
+    if (access(path, F_OK) != 0) {
+        char export_path[64];
+        snprintf(export_path, sizeof(export_path), PULSE_PWM_SYSFS "/pwmchip%d/export", p->chip);
+        int fd = open(export_path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        int ret = pwm_write(fd, p->channel);
+        int saved = errno;
+        close(fd);
+        if (ret != 0 && saved != EBUSY) {
+            errno = saved;
+            return -1;
+        }
+    }
+
+    const char *names[] = { "period", "duty_cycle", "enable" };
+    int *fds[] = { &p->period_fd, &p->duty_fd, &p->enable_fd };
+    for (int k = 0; k < 3; k++) {
+        snprintf(path, sizeof(path), PULSE_PWM_SYSFS "/pwmchip%d/pwm%d/%s", p->chip, p->channel, names[k]);
+        for (int waited = 0; (*fds[k] = open(path, O_WRONLY | O_CLOEXEC)) < 0; waited += 10) {
+            if ((errno != ENOENT && errno != EACCES) || waited >= PWM_EXPORT_WAIT_MS) return -1;
+            struct timespec ts = { .tv_nsec = 10 * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+    }
+    pwm_write(p->enable_fd, 0);
+    if (pwm_write(p->duty_fd, 0) != 0) return -1; // Zero fits under any period, so the first period write cannot fail on the old duty.
+    p->period_ns = 0;
+    return 0;
+}
+
+/*
+ * Name:         pwm_apply
+ * Purpose:      Sets the PWM channel to a new interval.
+ * Arguments:    t: the pulse train.
+ * 				 interval_ns: pulse period, 0 stops the output.
+ * 				 now_ns: CLOCK_MONOTONIC now.
+ *
+ * Output:       An error message if the channel refuses the period.
+ * Modifies:     The channel, t->pwm, t->stats.pwm_pulses.
+ * Returns:      None.
+ * Assumptions:  width_ns < interval_ns.
+ *
+ * Bugs:         None known.
+ * Notes:        The duty cycle is written once, when the channel is enabled;
+ * 				 later changes only write the period, which the hardware takes
+ * 				 at the end of the running period, so no pulse is cut short.
+ */
+static void pwm_apply(PulseTrain *t, int64_t interval_ns, int64_t now_ns) {
+    PulsePwm *p = &t->pwm;
+    if (p->period_ns > 0) t->stats.pwm_pulses += (double)(now_ns - p->since_ns) / (double)p->period_ns;
+    p->since_ns = now_ns;
+
+    if (interval_ns <= 0) {
+        if (p->period_ns > 0) pwm_write(p->enable_fd, 0);
+        p->period_ns = 0;
+        return;
+    }
+    bool was_enabled = p->period_ns > 0;
+    if (pwm_write(p->period_fd, interval_ns) != 0 ||
+        (!was_enabled && (pwm_write(p->duty_fd, t->width_ns) != 0 || pwm_write(p->enable_fd, 1) != 0))) {
+        safe_console_error("pwmchip%d/pwm%d refused a period of %.6f s: %s\n", p->chip, p->channel,
+                           (double)interval_ns / 1e9, strerror(errno));
+        pwm_write(p->enable_fd, 0);
+        p->period_ns = 0;
+        return;
+    }
+    p->period_ns = interval_ns;
+}
+
+/*
+ * Name:         enter_realtime
+ * Purpose:      Moves the calling thread to SCHED_FIFO and locks the process in memory.
+ * Arguments:    t: the pulse train.
+ *
+ * Output:       A warning for each step that is not permitted.
+ * Modifies:     The thread's scheduling, t->realtime.
+ * Returns:      None.
+ * Assumptions:  Called from the pulse thread.
+ *
+ * Bugs:         None known.
+ * Notes:        Needs CAP_SYS_NICE and CAP_IPC_LOCK (or root, or rtprio and
+ * 				 memlock limits); without them the pulses still run, with the
+ * 				 normal scheduler's jitter. Timer slack is cut to 1 ns either
+ * 				 way, the 50 us default would swallow most of the spin window.
+ */
+static void enter_realtime(PulseTrain *t) {
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+    if (t->rt_priority <= 0) return;
+
+    struct sched_param sp = { .sched_priority = t->rt_priority };
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (err != 0) {
+        safe_console_error("SCHED_FIFO priority %d not permitted (%s), pulses use the normal scheduler\n",
+                           t->rt_priority, strerror(err));
+        return;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        safe_console_error("mlockall failed (%s), a page fault can delay a pulse\n", strerror(errno));
+        return;
+    }
+    volatile unsigned char stack[STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+    t->realtime = true;
+}
+
+/*
+ * Name:         drain_wake
+ * Purpose:      Clears the wake eventfd.
+ * Arguments:    t: the pulse train.
+ *
+ * Output:       None.
+ * Modifies:     The eventfd counter.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void drain_wake(PulseTrain *t) {
+    uint64_t v;
+    while (read(t->wake_fd, &v, sizeof(v)) < 0 && errno == EINTR);
+}
+
+/*
+ * Name:         wait_until
+ * Purpose:      Waits for an absolute CLOCK_MONOTONIC deadline.
+ * Arguments:    t: the pulse train.
+ * 				 deadline_ns: when to return.
+ * 				 interruptible: whether pulse_train_wake() ends the wait early.
+ *
+ * Output:       None.
+ * Modifies:     Drains the wake eventfd when woken.
+ * Returns:      true if woken before the deadline, false at the deadline.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Sleeps until PULSE_SPIN_NS before the deadline and spins the
+ * 				 rest. A wake that arrives during the spin is left for the
+ * 				 next wait.
+ */
+static bool wait_until(PulseTrain *t, int64_t deadline_ns, bool interruptible) {
+    for (;;) {
+        int64_t remain = deadline_ns - mono_now_ns();
+        if (remain <= PULSE_SPIN_NS) break;
+        if (interruptible) {
+            struct timespec to = ns_to_ts(remain - PULSE_SPIN_NS);
+            struct pollfd pfd = { .fd = t->wake_fd, .events = POLLIN };
+            if (ppoll(&pfd, 1, &to, NULL) > 0) {
+                drain_wake(t);
+                return true;
+            }
+        } else {
+            struct timespec at = ns_to_ts(deadline_ns - PULSE_SPIN_NS);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+        }
+    }
+    while (mono_now_ns() < deadline_ns) cpu_relax();
+    return false;
+}
+
+/*
+ * Name:         wait_wake
+ * Purpose:      Waits, without a deadline, for pulse_train_wake().
+ * Arguments:    t: the pulse train.
+ *
+ * Output:       None.
+ * Modifies:     Drains the wake eventfd.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void wait_wake(PulseTrain *t) {
+    struct pollfd pfd = { .fd = t->wake_fd, .events = POLLIN };
+    if (poll(&pfd, 1, -1) > 0) drain_wake(t);
+}
+
+/*
+ * Name:         record_pulse
+ * Purpose:      Adds one software pulse to the timing statistics.
+ * Arguments:    st: the statistics.
+ * 				 late_ns: rising edge minus its deadline.
+ * 				 width_ns: falling edge minus rising edge.
+ *
+ * Output:       None.
+ * Modifies:     st.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void record_pulse(PulseStats *st, int64_t late_ns, int64_t width_ns) {
+    st->pulses++;
+    if (late_ns > PULSE_SPIN_NS) st->late++;
+    if (late_ns < st->late_min_ns) st->late_min_ns = late_ns;
+    if (late_ns > st->late_max_ns) st->late_max_ns = late_ns;
+    st->late_sum_ns += (double)late_ns;
+    st->late_sumsq_ns += (double)late_ns * (double)late_ns;
+    if (width_ns < st->width_min_ns) st->width_min_ns = width_ns;
+    if (width_ns > st->width_max_ns) st->width_max_ns = width_ns;
+    st->width_sum_ns += (double)width_ns;
+}
+
+/*
+ * Name:         pulse_train_init
+ * Purpose:      Prepares a pulse train with no pulses scheduled.
+ * Arguments:    t: the pulse train.
+ * 				 opts: from pulse_parse_options().
+ * 				 width_ns: active time of each pulse.
+ * 				 set: drives the line, unused when opts selects a PWM channel.
+ * 				 ctx: passed to set.
+ *
+ * Output:       None.
+ * Modifies:     t, exports and opens the PWM channel if one is selected.
+ * Returns:      0 on success, -1 with errno set on failure.
+ * Assumptions:  No thread is using t.
+ *
+ * Bugs:         None known.
+ * Notes:        A PWM channel that cannot be opened is an error rather than a
+ * 				 fall back to software, since a pin muxed to PWM ignores GPIO writes.
+ */
+int pulse_train_init(PulseTrain *t, const PulseOptions *opts, int64_t width_ns, PulseSetFn set, void *ctx) {
+    memset(t, 0, sizeof(*t));
+    t->wake_fd = -1;
+    t->pwm.period_fd = t->pwm.duty_fd = t->pwm.enable_fd = -1;
+    t->pwm.chip = opts->pwm_chip;
+    t->pwm.channel = opts->pwm_channel;
+    t->set = set;
+    t->ctx = ctx;
+    t->width_ns = width_ns;
+    t->rt_priority = opts->rt_priority;
+    t->use_pwm = opts->pwm_chip >= 0;
+    t->stats.late_min_ns = INT64_MAX;
+    t->stats.late_max_ns = INT64_MIN;
+    t->stats.width_min_ns = INT64_MAX;
+    t->stats.width_max_ns = INT64_MIN;
+    atomic_init(&t->interval_ns, 0);
+
+    if (width_ns <= 0 || (!t->use_pwm && !set)) {
+        errno = EINVAL;
+        return -1;
+    }
+    t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->wake_fd < 0 || (t->use_pwm && pwm_open(&t->pwm) != 0)) {
+        int saved = errno;
+        pulse_train_destroy(t);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         pulse_train_set_interval
+ * Purpose:      Changes the time between pulses.
+ * Arguments:    t: the pulse train.
+ * 				 interval_ns: rising edge to rising edge, 0 stops the pulses.
+ *
+ * Output:       None.
+ * Modifies:     t->interval_ns, wakes the pulse thread.
+ * Returns:      None.
+ * Assumptions:  interval_ns is 0 or more than twice the pulse width.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe from any thread. The next pulse follows the last one by
+ * 				 the new interval, or comes at once if that time has passed, so
+ * 				 a rate change neither adds nor loses a pulse.
+ */
+void pulse_train_set_interval(PulseTrain *t, int64_t interval_ns) {
+    atomic_store_explicit(&t->interval_ns, interval_ns > 0 ? interval_ns : 0, memory_order_relaxed);
+    pulse_train_wake(t);
+}
+
+/*
+ * Name:         pulse_train_run
+ * Purpose:      Emits the pulse train until stop is set, the body of the pulse thread.
+ * Arguments:    t: the pulse train.
+ * 				 stop: the program's terminate flag.
+ *
+ * Output:       Pulses on the line or the PWM channel.
+ * Modifies:     The calling thread's scheduling, t->stats.
+ * Returns:      When stop is set and pulse_train_wake() has been called.
+ * Assumptions:  pulse_train_init() succeeded. Called from one thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        The line is left inactive and the PWM channel disabled.
+ * 				 A stop during a pulse waits for the pulse to finish.
+ */
+void pulse_train_run(PulseTrain *t, volatile sig_atomic_t *stop) {
+    enter_realtime(t);
+
+    int64_t interval = 0;
+    int64_t deadline = 0;      // Next rising edge.
+    int64_t last_deadline = 0; // Deadline of the last pulse, 0 before the first.
+    int64_t last_fall = 0;
+
+    while (!*stop) {
+        int64_t want = atomic_load_explicit(&t->interval_ns, memory_order_relaxed);
+        if (want != interval) {
+            int64_t now = mono_now_ns();
+            if (t->use_pwm) pwm_apply(t, want, now);
+            deadline = last_deadline + want;
+            if (interval == 0 || last_deadline == 0 || deadline < now) deadline = now; // No burst of stale pulses after a dry spell.
+            interval = want;
+        }
+        if (interval == 0 || t->use_pwm) {
+            wait_wake(t);
+            continue;
+        }
+
+        if (deadline < last_fall + t->width_ns) deadline = last_fall + t->width_ns; // Catching up still leaves the line off for a pulse width.
+        if (wait_until(t, deadline, true)) continue;
+
+        t->set(t->ctx, true);
+        int64_t rise = mono_now_ns();
+        wait_until(t, rise + t->width_ns, false);
+        t->set(t->ctx, false);
+        int64_t fall = mono_now_ns();
+
+        record_pulse(&t->stats, rise - deadline, fall - rise);
+        last_deadline = deadline;
+        last_fall = fall;
+        deadline += interval;
+    }
+
+    if (t->use_pwm) pwm_apply(t, 0, mono_now_ns());
+    else t->set(t->ctx, false);
+}
+
+/*
+ * Name:         pulse_train_wake
+ * Purpose:      Interrupts the pulse thread's wait, so it re-reads the interval or sees stop.
+ * Arguments:    t: the pulse train.
+ *
+ * Output:       None.
+ * Modifies:     The eventfd counter.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe from any thread, and before pulse_train_init().
+ */
+void pulse_train_wake(PulseTrain *t) {
+    if (t->wake_fd < 0) return;
+    uint64_t one = 1;
+    while (write(t->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/*
+ * Name:         pulse_train_report
+ * Purpose:      Prints the achieved pulse timing to the console.
+ * Arguments:    t: the pulse train.
+ * 				 name: prefix for the line, usually program_name.
+ *
+ * Output:       One line on stdout, nothing if no pulse was sent.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  The pulse thread has stopped.
+ *
+ * Bugs:         None known.
+ * Notes:        PWM pulses are not observed, their count is worked out from
+ * 				 the periods that were set.
+ */
+void pulse_train_report(const PulseTrain *t, const char *name) {
+    const PulseStats *st = &t->stats;
+    if (t->use_pwm) {
+        if (st->pwm_pulses > 0.0)
+            safe_console_print("%s: about %.0f pulses from pwmchip%d/pwm%d\n", name, st->pwm_pulses, t->pwm.chip, t->pwm.channel);
+        return;
+    }
+    if (st->pulses == 0) return;
+    double n = (double)st->pulses;
+    double mean = st->late_sum_ns / n;
+    double var = st->late_sumsq_ns / n - mean * mean;
+    safe_console_print("%s: %llu pulses, %llu late, edge lateness mean %.1f us, sd %.1f us, min %.1f us, max %.1f us, "
+                       "width mean %.1f us, min %.1f us, max %.1f us, %s\n",
+                       name, (unsigned long long)st->pulses, (unsigned long long)st->late,
+                       mean / 1e3, sqrt(var > 0.0 ? var : 0.0) / 1e3,
+                       (double)st->late_min_ns / 1e3, (double)st->late_max_ns / 1e3,
+                       st->width_sum_ns / n / 1e3, (double)st->width_min_ns / 1e3, (double)st->width_max_ns / 1e3,
+                       t->realtime ? "SCHED_FIFO" : "normal scheduler");
+}
+
+/*
+ * Name:         pulse_train_destroy
+ * Purpose:      Disables the PWM channel and closes the train's descriptors.
+ * Arguments:    t: the pulse train.
+ *
+ * Output:       None.
+ * Modifies:     t's descriptors set to -1.
+ * Returns:      None.
+ * Assumptions:  The pulse thread has stopped.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe on a train whose pulse_train_init() failed. The channel
+ * 				 stays exported.
+ */
+void pulse_train_destroy(PulseTrain *t) {
+    if (t->pwm.enable_fd >= 0) pwm_write(t->pwm.enable_fd, 0);
+    int *fds[] = { &t->pwm.period_fd, &t->pwm.duty_fd, &t->pwm.enable_fd, &t->wake_fd };
+    for (int k = 0; k < 4; k++) {
+        if (*fds[k] >= 0) close(*fds[k]);
+        *fds[k] = -1;
+    }
+}
@@ -0,0 +1,579 @@
+/*
+ * File:     q1_31_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Fixed-point kernels. Table driven log2, exp2 and pow in q1_31 and
+ *           q5_26, and block versions of the saturating ops for SSE2, NEON
+ *           and plain C, see q1_31_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "q1_31_utils.h"
+
+#define TABLE_N (1 << Q1_TABLE_BITS)
+#define TABLE_SIZE (TABLE_N + 3)        // Interpolation reads two past the last interval's start.
+#define Q2_SHIFT 30                      // Table entries are 2.30, room for 1.0.
+#define LOG_INDEX_SHIFT (Q1_SHIFT - Q1_TABLE_BITS)   // Mantissa bits below the table index.
+#define EXP_INDEX_SHIFT (Q5_SHIFT - Q1_TABLE_BITS)   // Fraction bits below the table index.
+
+static int32_t log2_table[TABLE_SIZE];   // log2(1 + i / TABLE_N).
+static int32_t exp2_table[TABLE_SIZE];   // 2^(-i / TABLE_N).
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Name:         build_tables
+ * Purpose:      Fills the log2 and exp2 tables, the only libm calls the kernels make.
+ * Returns:      None.
+ */
+static void build_tables(void) {
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        log2_table[i] = (int32_t)lrint(log2(1.0 + (double)i / TABLE_N) * (double)(1 << Q2_SHIFT));
+        exp2_table[i] = (int32_t)lrint(exp2(-(double)i / TABLE_N) * (double)(1 << Q2_SHIFT));
+    }
+}
+
+/*
+ * Name:         q1_tables_init
+ * Purpose:      Builds the log2 and exp2 tables, once per process.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     log2_table, exp2_table.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Every table kernel calls it, so an emulator only needs to call it
+ *               itself to keep the one-off libm work out of its first frame.
+ */
+void q1_tables_init(void) {
+    pthread_once(&tables_once, build_tables);
+}
+
+/*
+ * Name:         interpolate
+ * Purpose:      Quadratic interpolation between t[i], t[i + 1] and t[i + 2].
+ * Arguments:    t - A table, 2.30.
+ *               i - The interval.
+ *               u - Position in it, q1_31 in [0, 1).
+ * Returns:      The value, 2.30.
+ * Notes:        Newton's forward form t0 + u * (d1 + (u - 1) * d2 / 2), with the
+ *               rounded multiplies the NEON path uses so both agree exactly.
+ */
+static inline int32_t interpolate(const int32_t *t, uint32_t i, q1_31 u) {
+    int32_t t0 = t[i], t1 = t[i + 1], t2 = t[i + 2];
+    int32_t d1 = t1 - t0;
+    int32_t d2 = (t2 - t1) - d1;
+    q1_31 u_less_one = (q1_31)((uint32_t)u + 0x80000000u);
+    return t0 + q1_sat_mul(u, d1 + (q1_sat_mul(u_less_one, d2) >> 1));
+}
+
+/*
+ * Name:         log2_unsigned
+ * Purpose:      log2 of s / 2^31, for s in [1, 2^32).
+ * Returns:      The logarithm, q5_26.
+ */
+static q5_26 log2_unsigned(uint32_t s) {
+    int n = __builtin_clz(s);
+    uint32_t mantissa = (s << n) & 0x7FFFFFFFu;   // 1.m, the 1 dropped.
+    uint32_t i = mantissa >> LOG_INDEX_SHIFT;
+    q1_31 u = (q1_31)((mantissa & ((1u << LOG_INDEX_SHIFT) - 1)) << Q1_TABLE_BITS);
+    int32_t lg = interpolate(log2_table, i, u);
+    return ((lg + (1 << (Q2_SHIFT - Q5_SHIFT - 1))) >> (Q2_SHIFT - Q5_SHIFT)) - (n << Q5_SHIFT);
+}
+
+/*
+ * Name:         exp2_fraction
+ * Purpose:      2^-r for r in [0, 1].
+ * Arguments:    r - q5_26, 0 to Q5_ONE.
+ * Returns:      The power, 2.30, in [0.5, 1].
+ */
+static inline int32_t exp2_fraction(uint32_t r) {
+    uint32_t i = r >> EXP_INDEX_SHIFT;
+    q1_31 u = (q1_31)((r & ((1u << EXP_INDEX_SHIFT) - 1)) << (Q1_SHIFT - EXP_INDEX_SHIFT));
+    return interpolate(exp2_table, i, u);
+}
+
+/*
+ * Name:         q1_log2
+ * Purpose:      Base 2 logarithm of a q1_31.
+ * Arguments:    x - The value, greater than zero.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      log2(x), q5_26, in [-31, 0), or Q5_MIN for x <= 0.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        x is normalised to a mantissa in [1, 2) and its octave, and the
+ *               top Q1_TABLE_BITS of the mantissa pick the table interval.
+ */
+q5_26 q1_log2(q1_31 x) {
+    q1_tables_init();
+    if (x <= 0) return Q5_MIN;
+    return log2_unsigned((uint32_t)x);
+}
+
+/*
+ * Name:         q1_log2_1p
+ * Purpose:      log2(1 + x), for a ratio either side of one.
+ * Arguments:    x - The offset from one, q1_31.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      log2(1 + x), q5_26, in [-31, 1), or Q5_MIN for x = -1.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        1 + x is formed exactly in 32 bits unsigned, so a base just
+ *               above or below one keeps its full precision.
+ */
+q5_26 q1_log2_1p(q1_31 x) {
+    q1_tables_init();
+    uint32_t s = (uint32_t)x + 0x80000000u;
+    if (s == 0) return Q5_MIN;
+    return log2_unsigned(s);
+}
+
+/*
+ * Name:         q1_ln
+ * Purpose:      Natural logarithm of a q1_31.
+ * Arguments:    x - The value, greater than zero.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      ln(x), q5_26, or Q5_MIN for x <= 0.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        log2(x) * ln(2).
+ */
+q5_26 q1_ln(q1_31 x) {
+    q5_26 lg = q1_log2(x);
+    return lg == Q5_MIN ? Q5_MIN : q5_sat_mul(lg, Q5_LN2);
+}
+
+/*
+ * Name:         q1_exp2
+ * Purpose:      2^y as a q1_31.
+ * Arguments:    y - The exponent, q5_26.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      2^y, saturating at Q1_MAX for y >= 0.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        -y splits into whole octaves k and a fraction r, and 2^-r from
+ *               the table is shifted down k places with rounding.
+ */
+q1_31 q1_exp2(q5_26 y) {
+    q1_tables_init();
+    if (y >= 0) return Q1_MAX;
+    uint32_t ny = y == INT32_MIN ? (uint32_t)INT32_MAX : (uint32_t)-y;
+    int k = (int)(ny >> Q5_SHIFT);
+    int64_t v = (int64_t)exp2_fraction(ny & (Q5_ONE - 1)) << (Q1_SHIFT - Q2_SHIFT);
+    return q1_sat((v + ((1LL << k) >> 1)) >> k);
+}
+
+/*
+ * Name:         q1_exp
+ * Purpose:      e^y as a q1_31.
+ * Arguments:    y - The exponent, q5_26.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      e^y, saturating at Q1_MAX for y >= 0.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        2^(y * log2(e)).
+ */
+q1_31 q1_exp(q5_26 y) {
+    return q1_exp2(q5_sat_mul(y, Q5_LOG2E));
+}
+
+/*
+ * Name:         q1_pow
+ * Purpose:      base^exponent as a q1_31.
+ * Arguments:    base - The base, q1_31, greater than zero.
+ *               exponent - The power, q5_26, zero or more.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      base^exponent, 0 for a base of zero or less.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        exp2(exponent * log2(base)). The relative error is about 1E-8
+ *               times the exponent, the table error scaled by the power.
+ */
+q1_31 q1_pow(q1_31 base, q5_26 exponent) {
+    return q1_exp2(q5_sat_mul(exponent, q1_log2(base)));
+}
+
+/*
+ * Name:         q1_scale_exp2
+ * Purpose:      Scales an integer by 2^y, for results outside [-1, 1).
+ * Arguments:    value - The integer, in whatever units the caller keeps.
+ *               y - The exponent, q5_26, either sign.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      value * 2^y rounded, saturating at INT32_MIN and INT32_MAX.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        y = k + f with k whole, and 2^y = 2^(k + 1) * 2^-(1 - f), so the
+ *               table gives the fraction and k + 1 is a shift. This is how a
+ *               pressure is divided by a barometric ratio without a division.
+ *               A left shift, k of 30 or 31, is range checked first, so it
+ *               never leaves int64_t.
+ */
+int32_t q1_scale_exp2(int32_t value, q5_26 y) {
+    q1_tables_init();
+    int k = y >> Q5_SHIFT;
+    uint32_t r = Q5_ONE - ((uint32_t)y & (Q5_ONE - 1));
+    int64_t v = (int64_t)value * exp2_fraction(r);
+    int shift = Q2_SHIFT - (k + 1);
+
+    if (shift >= 63) return 0;
+    if (shift > 0) {
+        v = (v + (1LL << (shift - 1))) >> shift;
+    } else if (shift < 0) {
+        // At most 2 places, at k = 31. v can be near 2^62, so saturate before the shift, not after.
+        int64_t limit = 1LL << -shift;
+        if (v > INT32_MAX / limit) return INT32_MAX;
+        if (v < INT32_MIN / limit) return INT32_MIN;
+        v *= limit;
+    }
+    if (v > INT32_MAX) return INT32_MAX;
+    if (v < INT32_MIN) return INT32_MIN;
+    return (int32_t)v;
+}
+
+#if defined(__SSE2__)
+/*
+ * Name:         sse2_sat_add
+ * Purpose:      Four saturating q1_31 adds, SSE2 having no 32 bit saturation.
+ * Returns:      a + b, clamped.
+ */
+static inline __m128i sse2_sat_add(__m128i a, __m128i b) {
+    __m128i sum = _mm_add_epi32(a, b);
+    __m128i overflow = _mm_srai_epi32(_mm_andnot_si128(_mm_xor_si128(a, b), _mm_xor_si128(a, sum)), 31);
+    __m128i limit = _mm_xor_si128(_mm_srai_epi32(a, 31), _mm_set1_epi32(Q1_MAX));
+    return _mm_or_si128(_mm_andnot_si128(overflow, sum), _mm_and_si128(overflow, limit));
+}
+
+/*
+ * Name:         sse2_sat_mul
+ * Purpose:      Four rounded q1_31 products, as q1_sat_mul().
+ * Returns:      a * b.
+ * Notes:        The unsigned 64 bit products of _mm_mul_epu32 are made signed
+ *               by taking b off the high word where a is negative and a where
+ *               b is. Only -1 * -1 overflows, and is flipped to Q1_MAX.
+ */
+static inline __m128i sse2_sat_mul(__m128i a, __m128i b) {
+    const __m128i high = _mm_set_epi32(-1, 0, -1, 0);
+    const __m128i half = _mm_set_epi32(0, 1 << (Q1_SHIFT - 1), 0, 1 << (Q1_SHIFT - 1));
+    __m128i correction = _mm_add_epi32(_mm_and_si128(_mm_srai_epi32(a, 31), b), _mm_and_si128(_mm_srai_epi32(b, 31), a));
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    even = _mm_sub_epi64(even, _mm_slli_epi64(correction, 32));
+    odd = _mm_sub_epi64(odd, _mm_and_si128(correction, high));
+    even = _mm_srli_epi64(_mm_add_epi64(even, half), Q1_SHIFT);
+    odd = _mm_slli_epi64(_mm_srli_epi64(_mm_add_epi64(odd, half), Q1_SHIFT), 32);
+    __m128i product = _mm_or_si128(_mm_andnot_si128(high, even), odd);
+    const __m128i min = _mm_set1_epi32(Q1_MIN);
+    return _mm_xor_si128(product, _mm_and_si128(_mm_cmpeq_epi32(a, min), _mm_cmpeq_epi32(b, min)));
+}
+#elif defined(__ARM_NEON)
+/*
+ * Name:         neon_gather
+ * Purpose:      Loads t[i], t[i + 1] and t[i + 2] for each lane's interval i.
+ * Returns:      None.
+ */
+static inline void neon_gather(const int32_t *t, uint32x4_t index, int32x4_t *t0, int32x4_t *t1, int32x4_t *t2) {
+    uint32_t lane[4];
+    int32_t a[4], b[4], c[4];
+    vst1q_u32(lane, index);
+    for (int l = 0; l < 4; l++) {
+        a[l] = t[lane[l]];
+        b[l] = t[lane[l] + 1];
+        c[l] = t[lane[l] + 2];
+    }
+    *t0 = vld1q_s32(a);
+    *t1 = vld1q_s32(b);
+    *t2 = vld1q_s32(c);
+}
+
+/*
+ * Name:         neon_interpolate
+ * Purpose:      interpolate() on four lanes.
+ * Returns:      The values, 2.30.
+ */
+static inline int32x4_t neon_interpolate(const int32_t *t, uint32x4_t index, int32x4_t u) {
+    int32x4_t t0, t1, t2;
+    neon_gather(t, index, &t0, &t1, &t2);
+    int32x4_t d1 = vsubq_s32(t1, t0);
+    int32x4_t d2 = vsubq_s32(vsubq_s32(t2, t1), d1);
+    int32x4_t u_less_one = vreinterpretq_s32_u32(vaddq_u32(vreinterpretq_u32_s32(u), vdupq_n_u32(0x80000000u)));
+    int32x4_t inner = vaddq_s32(d1, vshrq_n_s32(vqrdmulhq_s32(u_less_one, d2), 1));
+    return vaddq_s32(t0, vqrdmulhq_s32(u, inner));
+}
+#endif
+
+/*
+ * Name:         q1_block_add_sat
+ * Purpose:      out = a + b, saturating, over a block.
+ * Arguments:    a, b - The operands.
+ *               out - Receives the sums, may be a or b.
+ *               n - Number of values.
+ *
+ * Output:       None.
+ * Modifies:     out[0..n).
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void q1_block_add_sat(const q1_31 *a, const q1_31 *b, q1_31 *out, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = sse2_sat_add(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(out + i), s);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) vst1q_s32(out + i, vqaddq_s32(vld1q_s32(a + i), vld1q_s32(b + i)));
+#endif
+    for (; i < n; i++) out[i] = q1_sat_add(a[i], b[i]);
+}
+
+/*
+ * Name:         q1_block_mul_sat
+ * Purpose:      out = a * b, rounded and saturating, over a block.
+ * Arguments:    a, b - The operands.
+ *               out - Receives the products, may be a or b.
+ *               n - Number of values.
+ *
+ * Output:       None.
+ * Modifies:     out[0..n).
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        NEON's vqrdmulh is q1_sat_mul() exactly.
+ */
+void q1_block_mul_sat(const q1_31 *a, const q1_31 *b, q1_31 *out, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = sse2_sat_mul(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(out + i), p);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) vst1q_s32(out + i, vqrdmulhq_s32(vld1q_s32(a + i), vld1q_s32(b + i)));
+#endif
+    for (; i < n; i++) out[i] = q1_sat_mul(a[i], b[i]);
+}
+
+/*
+ * Name:         q1_block_mac_sat
+ * Purpose:      acc = acc * x + add, saturating, over a block. One Horner step
+ *               whose coefficient differs lane to lane.
+ * Arguments:    acc - The accumulators.
+ *               x - The multipliers.
+ *               add - The addends, may be acc.
+ *               n - Number of values.
+ *
+ * Output:       None.
+ * Modifies:     acc[0..n).
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The product is rounded before the add, on every path.
+ */
+void q1_block_mac_sat(q1_31 *acc, const q1_31 *x, const q1_31 *add, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = sse2_sat_mul(_mm_loadu_si128((const __m128i *)(acc + i)), _mm_loadu_si128((const __m128i *)(x + i)));
+        _mm_storeu_si128((__m128i *)(acc + i), sse2_sat_add(p, _mm_loadu_si128((const __m128i *)(add + i))));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_s32(acc + i, vqaddq_s32(vqrdmulhq_s32(vld1q_s32(acc + i), vld1q_s32(x + i)), vld1q_s32(add + i)));
+    }
+#endif
+    for (; i < n; i++) acc[i] = q1_sat_add(q1_sat_mul(acc[i], x[i]), add[i]);
+}
+
+/*
+ * Name:         q1_block_horner
+ * Purpose:      Evaluates one polynomial at a block of points.
+ * Arguments:    coef - The coefficients, coef[j] for x^j.
+ *               terms - Number of coefficients, at least one.
+ *               x - The points.
+ *               out - Receives the values, may be x only if terms is one.
+ *               n - Number of points.
+ *
+ * Output:       None.
+ * Modifies:     out[0..n).
+ * Returns:      None.
+ * Assumptions:  The coefficients are scaled so no partial sum leaves [-1, 1),
+ *               or the result saturates.
+ *
+ * Bugs:         None known.
+ * Notes:        Each coefficient is broadcast once per four lanes.
+ */
+void q1_block_horner(const q1_31 *coef, int terms, const q1_31 *x, q1_31 *out, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i r = _mm_set1_epi32(coef[terms - 1]);
+        for (int j = terms - 2; j >= 0; j--) r = sse2_sat_add(sse2_sat_mul(r, v), _mm_set1_epi32(coef[j]));
+        _mm_storeu_si128((__m128i *)(out + i), r);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t v = vld1q_s32(x + i);
+        int32x4_t r = vdupq_n_s32(coef[terms - 1]);
+        for (int j = terms - 2; j >= 0; j--) r = vqaddq_s32(vqrdmulhq_s32(r, v), vdupq_n_s32(coef[j]));
+        vst1q_s32(out + i, r);
+    }
+#endif
+    for (; i < n; i++) {
+        q1_31 r = coef[terms - 1];
+        for (int j = terms - 2; j >= 0; j--) r = q1_sat_add(q1_sat_mul(r, x[i]), coef[j]);
+        out[i] = r;
+    }
+}
+
+/*
+ * Name:         q1_block_log2
+ * Purpose:      q1_log2() over a block.
+ * Arguments:    x - The values.
+ *               out - Receives the logarithms.
+ *               n - Number of values.
+ *
+ * Output:       None.
+ * Modifies:     out[0..n).
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        NEON normalises four lanes with vclz and a per-lane shift and
+ *               loads the table entries lane by lane.
+ */
+void q1_block_log2(const q1_31 *x, q5_26 *out, size_t n) {
+    size_t i = 0;
+    q1_tables_init();
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+    const uint32x4_t frac_mask = vdupq_n_u32(0x7FFFFFFFu);
+    const uint32x4_t low_mask = vdupq_n_u32((1u << LOG_INDEX_SHIFT) - 1);
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t v = vld1q_s32(x + i);
+        uint32x4_t s = vreinterpretq_u32_s32(v);
+        int32x4_t lz = vreinterpretq_s32_u32(vclzq_u32(s));
+        uint32x4_t mantissa = vandq_u32(vshlq_u32(s, lz), frac_mask);
+        uint32x4_t index = vshrq_n_u32(mantissa, LOG_INDEX_SHIFT);
+        int32x4_t u = vreinterpretq_s32_u32(vshlq_n_u32(vandq_u32(mantissa, low_mask), Q1_TABLE_BITS));
+        int32x4_t lg = vrshrq_n_s32(neon_interpolate(log2_table, index, u), Q2_SHIFT - Q5_SHIFT);
+        lg = vsubq_s32(lg, vshlq_n_s32(lz, Q5_SHIFT));
+        uint32x4_t positive = vcgtq_s32(v, vdupq_n_s32(0));
+        vst1q_s32(out + i, vbslq_s32(positive, lg, vdupq_n_s32(Q5_MIN)));
+    }
+#endif
+    for (; i < n; i++) out[i] = x[i] <= 0 ? Q5_MIN : log2_unsigned((uint32_t)x[i]);
+}
+
+/*
+ * Name:         q1_block_exp2
+ * Purpose:      q1_exp2() over a block.
+ * Arguments:    y - The exponents.
+ *               out - Receives the powers.
+ *               n - Number of values.
+ *
+ * Output:       None.
+ * Modifies:     out[0..n).
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        NEON shifts each lane down its own octave count with vrshl.
+ */
+void q1_block_exp2(const q5_26 *y, q1_31 *out, size_t n) {
+    size_t i = 0;
+    q1_tables_init();
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+    const uint32x4_t frac_mask = vdupq_n_u32(Q5_ONE - 1);
+    const uint32x4_t low_mask = vdupq_n_u32((1u << EXP_INDEX_SHIFT) - 1);
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t v = vld1q_s32(y + i);
+        uint32x4_t ny = vreinterpretq_u32_s32(vqnegq_s32(v));
+        int32x4_t k = vreinterpretq_s32_u32(vshrq_n_u32(ny, Q5_SHIFT));
+        uint32x4_t r = vandq_u32(ny, frac_mask);
+        uint32x4_t index = vshrq_n_u32(r, EXP_INDEX_SHIFT);
+        int32x4_t u = vreinterpretq_s32_u32(vshlq_n_u32(vandq_u32(r, low_mask), Q1_SHIFT - EXP_INDEX_SHIFT));
+        int32x4_t p = vqshlq_n_s32(neon_interpolate(exp2_table, index, u), Q1_SHIFT - Q2_SHIFT);
+        p = vrshlq_s32(p, vnegq_s32(k));
+        uint32x4_t negative = vcltq_s32(v, vdupq_n_s32(0));
+        vst1q_s32(out + i, vbslq_s32(negative, p, vdupq_n_s32(Q1_MAX)));
+    }
+#endif
+    for (; i < n; i++) out[i] = q1_exp2(y[i]);
+}
+
+/*
+ * Name:         q1_block_pow
+ * Purpose:      q1_pow() over a block of bases with one exponent.
+ * Arguments:    base - The bases.
+ *               exponent - The power, q5_26.
+ *               out - Receives the powers, may be base.
+ *               n - Number of values.
+ *
+ * Output:       None.
+ * Modifies:     out[0..n).
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Done Q1_BLOCK values at a time through a scratch array on the
+ *               stack, log2, the multiply, then exp2.
+ */
+void q1_block_pow(const q1_31 *base, q5_26 exponent, q1_31 *out, size_t n) {
+    q5_26 lg[Q1_BLOCK];
+
+    for (size_t done = 0; done < n; done += Q1_BLOCK) {
+        size_t count = n - done < Q1_BLOCK ? n - done : Q1_BLOCK;
+        size_t i = 0;
+        q1_block_log2(base + done, lg, count);
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+        const int32x2_t e = vdup_n_s32(exponent);
+        for (; i + 4 <= count; i += 4) {
+            int32x4_t v = vld1q_s32(lg + i);
+            int32x2_t lo = vqrshrn_n_s64(vmull_s32(vget_low_s32(v), e), Q5_SHIFT);
+            int32x2_t hi = vqrshrn_n_s64(vmull_s32(vget_high_s32(v), e), Q5_SHIFT);
+            vst1q_s32(lg + i, vcombine_s32(lo, hi));
+        }
+#endif
+        for (; i < count; i++) lg[i] = q5_sat_mul(exponent, lg[i]);
+        q1_block_exp2(lg, out + done, count);
+    }
+}
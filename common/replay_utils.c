@@ -0,0 +1,1770 @@
+/*
+ * File:     replay_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Memory-mapped replay source for sensor data files.
+ *           The data file is mapped once and a line-offset index is built at
+ *           startup. Sender and receiver threads then advance a shared atomic
+ *           cursor and receive views into the mapping, without taking a lock,
+ *           calling into stdio or touching the heap on the transmit path.
+ *
+ *           Files written by wxb_convert start with a WxbHeader and hold the
+ *           sensor's ParsedMessage records back to back. Those are validated
+ *           once at open and then handed out by pointer, so the emulator skips
+ *           strtok_r()/atof()/timegm() on every transmit.
+ *
+ *           A stream opened with --live is handed to live_utils.c instead, and
+ *           lines or records come out of its ring.
+ *
+ *           A .wxz cache is checked block by block at open, then decoded one
+ *           block at a time into a buffer of the generation as the cursor
+ *           reaches it, see wxz_utils.h.
+ *
+ *           A wxstate:// source holds no lines: each one is rendered from a
+ *           snapshot of the shared weather state as it is asked for, so every
+ *           emulator of the station reads the same instant.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "replay_utils.h"
+#include "crc_utils.h"
+#include "metrics_utils.h"
+#include "trace_utils.h"
+#include "wxz_utils.h"
+
+_Static_assert(sizeof(WxbHeader) == 64, "WxbHeader is an on-disk format, records start 8 byte aligned");
+
+#define REPLAY_UDP_PREFIX "udp://"
+#define REPLAY_STATE_PREFIX "wxstate://"
+#define REPLAY_MAX_WATCHED 64   // Sources replay_watch() can follow, one per wxsensord port.
+#define REPLAY_SETTLE_MS 200    // Quiet time after a change before reloading, a save is often several events.
+#define REPLAY_RECLAIM_NS 50000 // Poll interval while readers finish with an old generation.
+
+static void unwatch(ReplaySource *src);
+
+// A record copied out of the mapping or the live ring, handed back by replay_next_record().
+static __thread unsigned char record_copy[REPLAY_LINE_MAX] __attribute__((aligned(16)));
+
+/*
+ * Name:         build_line_index
+ * Purpose:      Walks the mapped file and records the offset and length of every
+ *               non-empty line.
+ * Arguments:    map - The generation with data and size already set.
+ *
+ * Output:       None.
+ * Modifies:     map->line_offsets, map->line_lengths, map->line_count.
+ * Returns:      0 on success, -1 if the index could not be allocated.
+ * Assumptions:  map->data points to a mapping of map->size bytes.
+ *
+ * Bugs:         None known.
+ * Notes:        Two passes over the mapping: one to count lines so the index can
+ *               be allocated exactly once, and one to fill it. Trailing CR/LF is
+ *               excluded from the length, blank lines are skipped so a parse
+ *               function never receives an empty record.
+ */
+static int build_line_index(ReplayMap *map) {
+    const char *p = map->data;
+    const char *end = map->data + map->size;
+    size_t count = 0;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        count++;
+        if (!nl) break;
+        p = nl + 1;
+    }
+
+    if (count == 0) return 0;
+
+    map->line_offsets = malloc(count * sizeof(uint32_t));
+    map->line_lengths = malloc(count * sizeof(uint32_t));
+    if (!map->line_offsets || !map->line_lengths) return -1;
+
+    p = map->data;
+    size_t n = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = nl ? nl : end;
+        size_t len = (size_t)(line_end - p);
+        while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == '\n')) len--; // Strip CR of a CR/LF pair.
+
+        if (len > 0) {
+            map->line_offsets[n] = (uint32_t)(p - map->data);
+            map->line_lengths[n] = (uint32_t)len;
+            n++;
+        }
+        if (!nl) break;
+        p = nl + 1;
+    }
+    map->line_count = n;
+    return 0;
+}
+
+/*
+ * Name:         load_record_header
+ * Purpose:      Validates the WxbHeader at the start of a mapping and switches the
+ *               generation into record mode.
+ * Arguments:    map - The generation with data and size already set.
+ *
+ * Output:       None.
+ * Modifies:     map->header, map->records, map->record_size, map->record_count.
+ * Returns:      0 if the mapping is a valid cache, -1 with errno set to EINVAL if it
+ *               carries the magic but is corrupt, truncated or from a foreign host.
+ * Assumptions:  The caller has checked map->size and the magic.
+ *
+ * Bugs:         None known.
+ * Notes:        The CRC is checked over the whole record area at open, a cache is
+ *               read far more often than it is written and a torn copy must not
+ *               replay garbage for a week. Records are copied out through a
+ *               REPLAY_LINE_MAX buffer, which bounds their size.
+ */
+static int load_record_header(ReplayMap *map) {
+    const WxbHeader *hdr = (const WxbHeader *)map->data;
+
+    if (hdr->version != WXB_VERSION || hdr->header_size != sizeof(WxbHeader) ||
+        hdr->byte_order != WXB_BYTE_ORDER || hdr->time_size != sizeof(time_t) ||
+        hdr->record_size == 0 || hdr->record_size > REPLAY_LINE_MAX || memchr(hdr->sensor, '\0', WXB_SENSOR_LEN) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (hdr->record_count > (map->size - sizeof(WxbHeader)) / hdr->record_size) { // Truncated file.
+        errno = EINVAL;
+        return -1;
+    }
+
+    map->records = (const unsigned char *)map->data + sizeof(WxbHeader);
+    map->record_size = hdr->record_size;
+    map->record_count = (size_t)hdr->record_count;
+
+    Crc16Context crc;
+    crc16_init(&crc, CRC16_XMODEM);
+    crc16_update(&crc, map->records, map->record_size * map->record_count);
+    if (crc16_final(&crc) != hdr->checksum) {
+        errno = EINVAL;
+        return -1;
+    }
+    map->header = hdr;
+    map->window_count = map->record_count;
+    return 0;
+}
+
+/*
+ * Name:         load_block_header
+ * Purpose:      Validates the WxzHeader and block index at the start of a mapping
+ *               and switches the generation into block mode.
+ * Arguments:    map - The generation with data and size already set.
+ *
+ * Output:       None.
+ * Modifies:     map->header, map->blocks, map->block, map->record_size,
+ *               map->record_count, map->block_records.
+ * Returns:      0 if the mapping is a valid cache, -1 with errno set to EINVAL if it
+ *               carries the magic but is corrupt, truncated or from a foreign host,
+ *               ENOMEM if the decode buffer cannot be allocated.
+ * Assumptions:  The caller has checked the magic.
+ *
+ * Bugs:         None known.
+ * Notes:        Every block is decoded once and checked against its CRC here,
+ *               for the same reason the whole of a .wxb is, through the one block
+ *               buffer replay keeps. A month of data costs the same memory to
+ *               verify as an hour. The index is used in place, the writer puts
+ *               it on an 8 byte boundary.
+ */
+static int load_block_header(ReplayMap *map) {
+    const WxzHeader *hdr = (const WxzHeader *)map->data;
+    const WxbHeader *base = &hdr->base;
+
+    if (map->size < sizeof(WxzHeader) || base->version != WXZ_VERSION || base->header_size != sizeof(WxzHeader) ||
+        base->byte_order != WXB_BYTE_ORDER || base->time_size != sizeof(time_t) ||
+        base->record_size == 0 || base->record_size > REPLAY_LINE_MAX || memchr(base->sensor, '\0', WXB_SENSOR_LEN) == NULL ||
+        hdr->block_records == 0 || hdr->block_records > WXZ_BLOCK_RECORDS_MAX ||
+        hdr->block_count != (base->record_count + hdr->block_records - 1) / hdr->block_records ||
+        base->record_count > (uint64_t)hdr->block_count * hdr->block_records ||
+        hdr->index_offset < sizeof(WxzHeader) || hdr->index_offset > map->size || hdr->index_offset % 8 != 0 ||
+        hdr->block_count > (map->size - hdr->index_offset) / sizeof(WxzBlock)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const WxzBlock *blocks = (const WxzBlock *)(map->data + hdr->index_offset);
+    Crc16Context crc;
+    crc16_init(&crc, CRC16_XMODEM);
+    crc16_update(&crc, blocks, hdr->block_count * sizeof(WxzBlock));
+    if (crc16_final(&crc) != base->checksum) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    map->block = malloc((size_t)hdr->block_records * base->record_size);
+    if (!map->block) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t b = 0; b < hdr->block_count; b++) {
+        size_t first = b * hdr->block_records;
+        size_t rows = base->record_count - first < hdr->block_records ? (size_t)(base->record_count - first) : hdr->block_records;
+        if (blocks[b].offset < sizeof(WxzHeader) || blocks[b].offset > hdr->index_offset ||
+            blocks[b].size > hdr->index_offset - blocks[b].offset ||
+            wxz_decode_block((const unsigned char *)map->data + blocks[b].offset, blocks[b].size, map->block,
+                             base->record_size, rows) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        crc16_init(&crc, CRC16_XMODEM);
+        crc16_update(&crc, map->block, rows * base->record_size);
+        if (crc16_final(&crc) != blocks[b].checksum) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&map->block_mutex, NULL);
+    map->header = base;
+    map->blocks = blocks;
+    map->block_records = hdr->block_records;
+    map->block_index = hdr->block_count ? hdr->block_count - 1 : SIZE_MAX; // Left in the buffer by the check.
+    map->record_size = base->record_size;
+    map->record_count = (size_t)base->record_count;
+    map->window_count = map->record_count;
+    return 0;
+}
+
+/*
+ * Name:         copy_record
+ * Purpose:      Copies one record of a .wxb or .wxz generation out.
+ * Arguments:    map - The generation, in record mode.
+ *               idx - The record, below map->record_count.
+ *               out - Receives map->record_size bytes.
+ *
+ * Output:       None.
+ * Modifies:     out, the decoded block of a .wxz.
+ * Returns:      None.
+ * Assumptions:  The caller holds map with map_enter(), or no reader can see it yet.
+ *
+ * Bugs:         None known.
+ * Notes:        A .wxz record comes out of the decoded block, which is replaced
+ *               when idx is in another. The lock is held for the copy, and the
+ *               decode of 4096 records on the first record of a block. Readers
+ *               of one source move through blocks together, so that is once per
+ *               block, not per reader.
+ */
+static void copy_record(ReplayMap *map, size_t idx, void *out) {
+    if (!map->blocks) {
+        memcpy(out, map->records + idx * map->record_size, map->record_size);
+        return;
+    }
+
+    size_t b = idx / map->block_records;
+    pthread_mutex_lock(&map->block_mutex);
+    if (map->block_index != b) {
+        size_t first = b * map->block_records;
+        size_t rows = map->record_count - first < map->block_records ? map->record_count - first : map->block_records;
+        // Checked at open, a failure here is a file changed in place under the mapping.
+        if (wxz_decode_block((const unsigned char *)map->data + map->blocks[b].offset, map->blocks[b].size,
+                             map->block, map->record_size, rows) == 0) {
+            map->block_index = b;
+        } else {
+            memset(map->block, 0, rows * map->record_size);
+            map->block_index = SIZE_MAX;
+        }
+    }
+    memcpy(out, map->block + (idx - b * map->block_records) * map->record_size, map->record_size);
+    pthread_mutex_unlock(&map->block_mutex);
+}
+
+/*
+ * Name:         open_udp
+ * Purpose:      Binds the UDP socket of a udp://[host]:port source.
+ * Arguments:    spec - The text after udp://, host may be empty, a name, an
+ *                      address or a bracketed IPv6 address.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The socket, or -1 with errno set.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        An empty host listens on every address. The receive buffer is
+ *               raised so a burst from the relay waits in the kernel for the
+ *               ingestion thread rather than being dropped.
+ */
+static int open_udp(const char *spec) {
+    char host[256];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon[1] == '\0' || (size_t)(colon - spec) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t host_len = (size_t)(colon - spec);
+    if (host_len >= 2 && spec[0] == '[' && spec[host_len - 1] == ']') {
+        memcpy(host, spec + 1, host_len - 2);
+        host[host_len - 2] = '\0';
+    } else {
+        memcpy(host, spec, host_len);
+        host[host_len] = '\0';
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    int err = getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res);
+    if (err != 0) {
+        errno = err == EAI_SYSTEM ? errno : EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int rcvbuf = 1 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        int saved = errno;
+        close(fd);
+        fd = -1;
+        errno = saved;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * Name:         free_map
+ * Purpose:      Unmaps a generation and frees its index.
+ * Arguments:    map - The generation, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     Frees map.
+ * Returns:      None.
+ * Assumptions:  No reader can still reach map.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void free_map(ReplayMap *map) {
+    if (!map) return;
+    if (map->data) munmap((void *)map->data, map->size);
+    if (map->blocks) pthread_mutex_destroy(&map->block_mutex);
+    free(map->block);
+    free(map->line_offsets);
+    free(map->line_lengths);
+    free(map);
+}
+
+/*
+ * Name:         map_file
+ * Purpose:      Maps a regular file read-only and indexes it as one generation.
+ * Arguments:    fd - The open file, closed before returning.
+ *               st - fstat() of fd.
+ *
+ * Output:       None.
+ * Modifies:     Allocates the generation and its index on the heap.
+ * Returns:      The generation, or NULL with errno set.
+ * Assumptions:  st describes a regular file.
+ *
+ * Bugs:         None known.
+ * Notes:        Files larger than 4 GiB are rejected with EFBIG, as the index
+ *               stores 32 bit offsets to halve its footprint on the Pi.
+ *               The mapping is advised MADV_SEQUENTIAL and then MADV_WILLNEED,
+ *               two calls as the advice values are not flags, so the kernel
+ *               reads ahead the way the old fgets() loop did.
+ *               A file starting with WXB_MAGIC or WXZ_MAGIC is opened in record
+ *               mode and no line index is built.
+ */
+static ReplayMap *map_file(int fd, const struct stat *st) {
+    ReplayMap *map = calloc(1, sizeof(ReplayMap));
+    if (!map || (uint64_t)st->st_size > UINT32_MAX) {
+        close(fd);
+        free(map);
+        errno = map ? EFBIG : ENOMEM;
+        return NULL;
+    }
+
+    map->size = (size_t)st->st_size;
+    if (map->size > 0) {
+        void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int saved = errno;
+            close(fd);
+            free(map);
+            errno = saved;
+            return NULL;
+        }
+        map->data = data;
+        madvise(data, map->size, MADV_SEQUENTIAL);
+        madvise(data, map->size, MADV_WILLNEED);
+    }
+    close(fd); // The mapping keeps its own reference to the file.
+
+    if (map->size >= sizeof(WxbHeader) && memcmp(map->data, WXB_MAGIC, 4) == 0) {
+        if (load_record_header(map) == 0) return map;
+    } else if (map->size >= 4 && memcmp(map->data, WXZ_MAGIC, 4) == 0) {
+        if (load_block_header(map) == 0) return map;
+    } else if (!map->data || build_line_index(map) == 0) {
+        map->window_count = map->line_count;
+        return map;
+    } else {
+        errno = ENOMEM;
+    }
+
+    int saved = errno;
+    free_map(map);
+    errno = saved;
+    return NULL;
+}
+
+/*
+ * Name:         map_enter
+ * Purpose:      Loads the current generation and keeps it from being reclaimed.
+ * Arguments:    src - The replay source.
+ *
+ * Output:       None.
+ * Modifies:     src->readers.
+ * Returns:      The generation, NULL in stream mode.
+ * Assumptions:  Every call is paired with map_exit() once the caller is done
+ *               with the generation.
+ *
+ * Bugs:         None known.
+ * Notes:        The reader count goes up before the pointer is loaded, both
+ *               sequentially consistent, and replay_reload() swaps the pointer
+ *               before it looks at the count. A reloader that then sees no
+ *               readers knows no thread can still be in the old generation.
+ *               The count is the only part of src a reader writes, so const
+ *               sources are accepted.
+ */
+static ReplayMap *map_enter(const ReplaySource *src) {
+    ReplaySource *s = (ReplaySource *)src;
+    atomic_fetch_add(&s->readers, 1);
+    return atomic_load(&s->map);
+}
+
+/*
+ * Name:         map_exit
+ * Purpose:      Ends a map_enter().
+ */
+static void map_exit(const ReplaySource *src) {
+    atomic_fetch_sub_explicit(&((ReplaySource *)src)->readers, 1, memory_order_release);
+}
+
+/*
+ * Name:         replay_open
+ * Purpose:      Opens a data file for replay. Regular files are mapped read-only and
+ *               indexed; anything that cannot be mapped is read as a stream.
+ * Arguments:    ptr - Address of a ReplaySource pointer to receive the new source.
+ *               path - Path to the data file.
+ *
+ * Output:       None.
+ * Modifies:     Allocates the source and its index on the heap.
+ * Returns:      0 on success, -1 on failure with errno set.
+ * Assumptions:  path points to a readable file, pipe or FIFO.
+ *
+ * Bugs:         None known.
+ * Notes:        The mapping and index are built by map_file(), the same way
+ *               replay_reload() builds a replacement. A udp:// path is a stream
+ *               of datagrams. A wxstate:// path is neither mapped nor streamed,
+ *               and fails with ENOENT until its producer has started.
+ */
+int replay_open(ReplaySource **ptr, const char *path) {
+    *ptr = calloc(1, sizeof(ReplaySource));
+    if (!*ptr) return -1;
+    ReplaySource *src = *ptr;
+    atomic_init(&src->map, NULL);
+    atomic_init(&src->readers, 0);
+    atomic_init(&src->generation, 0);
+    atomic_init(&src->cursor, 0);
+    pthread_mutex_init(&src->stream_mutex, NULL);
+    pthread_mutex_init(&src->reload_mutex, NULL);
+
+    if (strncmp(path, REPLAY_UDP_PREFIX, strlen(REPLAY_UDP_PREFIX)) == 0) {
+        int sock = open_udp(path + strlen(REPLAY_UDP_PREFIX));
+        if (sock < 0) goto fail;
+        src->stream = fdopen(sock, "r");
+        if (!src->stream) {
+            close(sock);
+            goto fail;
+        }
+        src->datagram = true;
+        return 0;
+    }
+
+    if (strncmp(path, REPLAY_STATE_PREFIX, strlen(REPLAY_STATE_PREFIX)) == 0) {
+        src->state = wxstate_attach(path + strlen(REPLAY_STATE_PREFIX));
+        if (!src->state) goto fail;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) goto fail;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        goto fail;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        // Pipes and FIFOs cannot be mapped or rewound, keep the buffered stream behaviour.
+        src->stream = fdopen(fd, "r");
+        if (!src->stream) {
+            close(fd);
+            goto fail;
+        }
+        return 0;
+    }
+
+    src->path = strdup(path);
+    if (!src->path) {
+        close(fd);
+        errno = ENOMEM;
+        goto fail;
+    }
+    ReplayMap *map = map_file(fd, &st);
+    if (!map) goto fail;
+    atomic_store(&src->map, map);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        replay_close(src);
+        *ptr = NULL;
+        errno = saved;
+    }
+    return -1;
+}
+
+/*
+ * Name:         next_view
+ * Purpose:      Advances the shared cursor and returns a view of the selected line.
+ * Arguments:    src - The replay source.
+ *               map - The generation from map_enter().
+ *               len - Receives the length of the line.
+ *
+ * Output:       None.
+ * Modifies:     src->cursor.
+ * Returns:      Pointer into the read-only mapping (not NUL terminated), or NULL
+ *               if the source is a stream or the file contains no lines.
+ * Assumptions:  The caller holds map with map_enter().
+ *
+ * Bugs:         None known.
+ * Notes:        The cursor is a monotonically increasing 64 bit counter, the line
+ *               is selected with a modulo so wrap-around needs no compare-and-swap
+ *               and concurrent callers always receive distinct consecutive lines.
+ *               The modulo runs over the --start/--end window, the whole file by default.
+ */
+static const char *next_view(ReplaySource *src, const ReplayMap *map, size_t *len) {
+    *len = 0;
+    if (!map || !map->data || map->window_count == 0 || map->header) return NULL;
+
+    uint_fast64_t n = atomic_fetch_add_explicit(&src->cursor, 1, memory_order_relaxed);
+    size_t idx = map->window_first + (size_t)(n % map->window_count);
+
+    *len = map->line_lengths[idx];
+    return map->data + map->line_offsets[idx];
+}
+
+/*
+ * Name:         replay_next_view
+ * Purpose:      Returns a view of the next line of the mapping.
+ * Arguments:    src - The replay source.
+ *               len - Receives the length of the line.
+ *
+ * Output:       None.
+ * Modifies:     src->cursor.
+ * Returns:      Pointer into the read-only mapping (not NUL terminated), or NULL
+ *               if the source is a stream or the file contains no lines.
+ * Assumptions:  src is not watched, see replay_watch().
+ *
+ * Bugs:         None known.
+ * Notes:        The view outlives the reader guard, a reload could unmap it
+ *               under the caller. replay_next_line() copies the line inside it.
+ */
+const char *replay_next_view(ReplaySource *src, size_t *len) {
+    const ReplayMap *map = map_enter(src);
+    const char *view = next_view(src, map, len);
+    map_exit(src);
+    WX_TRACE2(data_fetched, *len, 0);
+    return view;
+}
+
+/*
+ * Name:         replay_next_line
+ * Purpose:      Copies the next line into a caller-owned buffer, NUL terminated.
+ * Arguments:    src - The replay source.
+ *               buf - Destination buffer.
+ *               buf_len - Size of buf in bytes.
+ *
+ * Output:       Error message to stderr if a stream runs dry or fails.
+ * Modifies:     buf, src->cursor (mapped) or the stream position (stream).
+ * Returns:      Number of characters copied, 0 if no line is available.
+ * Assumptions:  buf_len is at least 1.
+ *
+ * Bugs:         None known.
+ * Notes:        Lines longer than buf_len - 1 are truncated. This keeps the
+ *               existing parse functions, which tokenize in place with strtok_r(),
+ *               working unchanged with a stack buffer instead of a strdup() copy.
+ *               The copy is taken inside map_enter(), so a reload cannot unmap
+ *               the line half way through.
+ *
+ *               In stream mode the behaviour matches get_next_line_copy(): on EOF
+ *               the error indicator is cleared and 0 is returned so the caller
+ *               retries on its next interval. A live feed of lines is read from
+ *               its ring instead, without touching the stream.
+ *
+ *               A wxstate:// source returns the state as a line of the sensor
+ *               named by replay_check_records() or replay_set_sensor(), and 0
+ *               before the first state is published.
+ */
+size_t replay_next_line(ReplaySource *src, char *buf, size_t buf_len) {
+    if (buf_len == 0) return 0;
+    buf[0] = '\0';
+
+    if (src->state) {
+        WxState state;
+        if (!wxstate_read(src->state, &state)) return 0;
+        size_t len = wxstate_render(&state, src->sensor, buf, buf_len);
+        WX_TRACE2(data_fetched, len, 0);
+        return len;
+    }
+
+    if (src->live) {
+        if (src->live_records || !live_next(src->live, record_copy)) return 0;
+        size_t len = strnlen((const char *)record_copy, buf_len - 1);
+        memcpy(buf, record_copy, len);
+        buf[len] = '\0';
+        WX_TRACE2(data_fetched, len, 0);
+        return len;
+    }
+
+    const ReplayMap *map = map_enter(src);
+    if (map) {
+        size_t len;
+        const char *view = next_view(src, map, &len);
+        if (len > buf_len - 1) len = buf_len - 1;
+        if (view) memcpy(buf, view, len);
+        buf[len] = '\0';
+        map_exit(src);
+        WX_TRACE2(data_fetched, len, 0);
+        return len;
+    }
+    map_exit(src);
+
+    if (!src->stream) return 0;
+
+    pthread_mutex_lock(&src->stream_mutex);
+    char *ok = fgets(buf, (int)buf_len, src->stream);
+    if (!ok) clearerr(src->stream);
+    pthread_mutex_unlock(&src->stream_mutex);
+
+    if (!ok) {
+        fprintf(stderr, "[%ld] Stream EOF reached. Waiting for more data...\n", time(NULL));
+        buf[0] = '\0';
+        return 0;
+    }
+
+    size_t len = strcspn(buf, "\r\n");
+    buf[len] = '\0';
+    WX_TRACE2(data_fetched, len, 0);
+    return len;
+}
+
+/*
+ * Name:         replay_next_record
+ * Purpose:      Advances the shared cursor and returns the selected cached record.
+ * Arguments:    src - The replay source.
+ *
+ * Output:       None.
+ * Modifies:     src->cursor, this thread's record copy.
+ * Returns:      Pointer to this thread's copy of the record, NULL if the source
+ *               holds no records.
+ * Assumptions:  The caller checked the cache with replay_check_records() at startup.
+ *
+ * Bugs:         None known.
+ * Notes:        The record is copied out of the mapping inside map_enter(), so
+ *               the caller's copy of it is safe from a reload. The copy lasts
+ *               until this thread's next call. Sensor fields are filled in by
+ *               the caller afterwards. A .wxz record is decoded with its block
+ *               by copy_record().
+ *               A live record parsed by replay_start_live()'s parse function is
+ *               copied out of the ring the same way.
+ */
+const void *replay_next_record(ReplaySource *src) {
+    if (src->live) {
+        if (!src->live_records || !live_next(src->live, record_copy)) return NULL;
+        WX_TRACE2(data_fetched, 0, 1);
+        return record_copy;
+    }
+
+    ReplayMap *map = map_enter(src);
+    const void *record = NULL;
+    if (map && map->header && map->window_count > 0) {
+        uint_fast64_t n = atomic_fetch_add_explicit(&src->cursor, 1, memory_order_relaxed);
+        copy_record(map, map->window_first + (size_t)(n % map->window_count), record_copy);
+        record = record_copy;
+        WX_TRACE2(data_fetched, map->record_size, 1);
+    }
+    map_exit(src);
+    return record;
+}
+
+/*
+ * Name:         replay_check_records
+ * Purpose:      Rejects a .wxb cache converted for another sensor or another build.
+ * Arguments:    src - The replay source.
+ *               sensor - Sensor name the caller expects.
+ *               record_size - sizeof(ParsedMessage) of the caller.
+ *
+ * Output:       None.
+ * Modifies:     errno on failure, the expectation replay_reload() checks against.
+ * Returns:      0 for text sources and matching caches, -1 otherwise.
+ * Assumptions:  Called from main() before the sender and receiver threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        A changed ParsedMessage layout that keeps its size is not caught,
+ *               regenerate caches whenever a sensor header changes.
+ *               The sensor is remembered for text sources too, so a text file
+ *               can be replaced by its cache on a reload.
+ */
+int replay_check_records(ReplaySource *src, const char *sensor, size_t record_size) {
+    snprintf(src->sensor, sizeof(src->sensor), "%s", sensor);
+    src->expect_record_size = record_size;
+
+    const ReplayMap *map = atomic_load(&src->map);
+    if (!map || !map->header) return 0;
+    if (map->record_size != record_size || strncmp(map->header->sensor, sensor, WXB_SENSOR_LEN) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         replay_set_sensor
+ * Purpose:      Names the sensor of a source that holds no records.
+ * Arguments:    src - The replay source.
+ *               sensor - The sensor.
+ *
+ * Output:       None.
+ * Modifies:     src->sensor.
+ * Returns:      None.
+ * Assumptions:  Called from main() before the sender and receiver threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        For emulators without a .wxb format. A wxstate:// source
+ *               renders the lines of this sensor.
+ */
+void replay_set_sensor(ReplaySource *src, const char *sensor) {
+    snprintf(src->sensor, sizeof(src->sensor), "%s", sensor);
+}
+
+/*
+ * Name:         replay_state
+ * Purpose:      Returns the shared weather state behind a wxstate:// source.
+ * Arguments:    src - The replay source, may be NULL.
+ *
+ * Returns:      The view, NULL for a file, a stream or a NULL source.
+ */
+const WxStateView *replay_state(const ReplaySource *src) {
+    return src ? src->state : NULL;
+}
+
+/*
+ * Name:         replay_start_live
+ * Purpose:      Hands a stream source to a live feed when --live asks for one.
+ * Arguments:    src - The replay source.
+ *               opts - Options from replay_parse_options().
+ *               record_size - sizeof(ParsedMessage) of the caller.
+ *               parse - Parses a line into a record, NULL for a feed of lines.
+ *
+ * Output:       The feed's policy, or an error, to stderr.
+ * Modifies:     src->live, src->live_records.
+ * Returns:      0 on success or when live mode is off, -1 on failure.
+ * Assumptions:  Called once from main(), after replay_apply_options() and
+ *               before the sender and receiver threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        A udp:// source is always live, latest unless --live says
+ *               otherwise, as nothing else would read the socket between sends.
+ *               A mapped file is already read without I/O and is refused.
+ *               The parse function should fill in sensor fields the way a
+ *               wxb_convert converter does, the caller's next_message() treats
+ *               a live record like a cached one.
+ */
+int replay_start_live(ReplaySource *src, const ReplayOptions *opts, size_t record_size, LiveParseFn parse) {
+    LivePolicy policy = opts->live;
+    if (policy == LIVE_OFF && src->datagram) policy = LIVE_LATEST;
+    if (policy == LIVE_OFF) return 0;
+
+    if (!src->stream) {
+        fprintf(stderr, "--live needs a pipe, FIFO or udp:// data source, a regular file is already read ahead\n");
+        return -1;
+    }
+    if (!parse) record_size = REPLAY_LINE_MAX;
+    if (record_size > sizeof(record_copy)) {
+        fprintf(stderr, "--live records of %zu bytes are over the %zu byte limit\n", record_size, sizeof(record_copy));
+        return -1;
+    }
+
+    src->live = live_start(fileno(src->stream), src->datagram, policy, opts->live_depth, record_size, parse);
+    if (!src->live) {
+        fprintf(stderr, "Unable to start the live feed: %s\n", strerror(errno));
+        return -1;
+    }
+    src->live_records = parse != NULL;
+    fprintf(stderr, "Live feed: %s policy, %zu records deep\n", live_policy_name(policy),
+            opts->live_depth ? opts->live_depth : (size_t)LIVE_DEPTH_DEFAULT);
+    return 0;
+}
+
+/*
+ * Name:         replay_write_records
+ * Purpose:      Writes a header and a block of records as a .wxb cache.
+ * Arguments:    path - File to create or replace.
+ *               sensor - Sensor name stored in the header.
+ *               records - The records.
+ *               record_size - Bytes per record.
+ *               count - Number of records.
+ *               source - stat() of the source text file, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     Creates path.
+ * Returns:      0 on success, -1 on failure with errno set.
+ * Assumptions:  records holds count * record_size bytes, the padding of every
+ *               record was zeroed by the parse function's memset().
+ *
+ * Bugs:         None known.
+ * Notes:        Written to path.tmp and renamed, so an emulator opening the cache
+ *               while it is being regenerated sees either the old or the new file.
+ */
+int replay_write_records(const char *path, const char *sensor, const void *records, size_t record_size,
+                         size_t count, const struct stat *source) {
+    if (record_size == 0 || record_size > UINT32_MAX || strlen(sensor) >= WXB_SENSOR_LEN ||
+        (count > 0 && !records)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    WxbHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WXB_MAGIC, 4);
+    hdr.version = WXB_VERSION;
+    hdr.header_size = sizeof(WxbHeader);
+    hdr.byte_order = WXB_BYTE_ORDER;
+    hdr.record_size = (uint32_t)record_size;
+    hdr.record_count = count;
+    strncpy(hdr.sensor, sensor, WXB_SENSOR_LEN - 1);
+    hdr.time_size = sizeof(time_t);
+    if (source) {
+        hdr.source_size = (uint64_t)source->st_size;
+        hdr.source_mtime = (int64_t)source->st_mtime;
+    }
+
+    Crc16Context crc;
+    crc16_init(&crc, CRC16_XMODEM);
+    crc16_update(&crc, records, record_size * count);
+    hdr.checksum = crc16_final(&crc);
+
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) return -1;
+
+    int ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+             (count == 0 || fwrite(records, record_size, count, out) == count);
+    if (fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         replay_is_binary
+ * Purpose:      Reports whether the source is a .wxb record cache.
+ * Arguments:    src - The replay source.
+ *
+ * Returns:      true for a validated cache, false for text, streams or NULL.
+ */
+bool replay_is_binary(const ReplaySource *src) {
+    if (!src) return false;
+    const ReplayMap *map = map_enter(src);
+    bool binary = map && map->header != NULL;
+    map_exit(src);
+    return binary;
+}
+
+/*
+ * Name:         replay_line_count
+ * Purpose:      Returns the number of indexed lines, or records of a .wxb cache.
+ * Arguments:    src - The replay source.
+ *
+ * Returns:      Line or record count, 0 for streams or a NULL source.
+ */
+size_t replay_line_count(const ReplaySource *src) {
+    if (!src) return 0;
+    const ReplayMap *map = map_enter(src);
+    size_t count = !map ? 0 : map->header ? map->record_count : map->line_count;
+    map_exit(src);
+    return count;
+}
+
+/*
+ * Name:         replay_is_mapped
+ * Purpose:      Reports whether the source is backed by a memory mapping.
+ * Arguments:    src - The replay source.
+ *
+ * Returns:      true for a mapped regular file, false for streams or NULL.
+ */
+bool replay_is_mapped(const ReplaySource *src) {
+    return src && atomic_load(&src->map) != NULL;
+}
+
+/*
+ * Name:         replay_is_live
+ * Purpose:      Reports whether the source is read through a live feed.
+ * Arguments:    src - The replay source.
+ *
+ * Returns:      true once replay_start_live() has started a feed, false otherwise or for NULL.
+ */
+bool replay_is_live(const ReplaySource *src) {
+    return src && src->live != NULL;
+}
+
+/*
+ * Name:         replay_progress
+ * Purpose:      Reads the cursor and window of a mapped source.
+ * Arguments:    src - The replay source.
+ *               position - Receives the entry the cursor is on.
+ *               entries - Receives the size of the replay window.
+ *               taken - Receives the entries taken so far.
+ *
+ * Output:       None.
+ * Modifies:     position, entries, taken.
+ * Returns:      false for a stream or an empty window.
+ * Assumptions:  None, safe from the metrics thread.
+ *
+ * Bugs:         None known.
+ * Notes:        taken restarts from 0 when the file is reloaded.
+ */
+bool replay_progress(const ReplaySource *src, size_t *position, size_t *entries, uint64_t *taken) {
+    const ReplayMap *map = map_enter(src);
+    bool ok = map && map->window_count > 0;
+    if (ok) {
+        uint_fast64_t n = atomic_load_explicit(&src->cursor, memory_order_relaxed);
+        *position = map->window_first + (size_t)(n % map->window_count);
+        *entries = map->window_count;
+        *taken = n;
+    }
+    map_exit(src);
+    return ok;
+}
+
+/*
+ * Name:         replay_seek
+ * Purpose:      Sets the replay cursor, so a restarted emulator carries on from
+ *               the entry it had reached.
+ * Arguments:    src - The replay source.
+ *               taken - Entries taken, as replay_progress() reports them.
+ *
+ * Output:       None.
+ * Modifies:     src->cursor.
+ * Returns:      true if the cursor was set, false for a stream or an empty window.
+ * Assumptions:  Called after replay_apply_options(), which starts the cursor again.
+ *
+ * Bugs:         None known.
+ * Notes:        The next entry is taken % window_count into the window, as it
+ *               would have been without the restart.
+ */
+bool replay_seek(ReplaySource *src, uint64_t taken) {
+    const ReplayMap *map = map_enter(src);
+    bool ok = map && map->window_count > 0;
+    if (ok) atomic_store_explicit(&src->cursor, taken, memory_order_relaxed);
+    map_exit(src);
+    return ok;
+}
+
+/*
+ * Name:         replay_close
+ * Purpose:      Releases every resource owned by a replay source.
+ * Arguments:    src - The replay source, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     Stops watching and any live feed, unmaps the file, closes the
+ *               stream, detaches the shared state, frees the index and src.
+ * Returns:      None.
+ * Assumptions:  No other thread is still reading from src.
+ *
+ * Bugs:         None known.
+ * Notes:        The live feed is stopped before the stream it reads is closed,
+ *               and the watch is dropped before the generation it reloads.
+ */
+void replay_close(ReplaySource *src) {
+    if (!src) return;
+    unwatch(src);
+    live_stop(src->live);
+    free_map(atomic_load(&src->map));
+    if (src->stream) fclose(src->stream);
+    wxstate_detach(src->state);
+    free(src->path);
+    pthread_mutex_destroy(&src->stream_mutex);
+    pthread_mutex_destroy(&src->reload_mutex);
+    free(src);
+}
+
+// ---------------- Replay window and clock ----------------
+
+// Set once by replay_apply_options() before the threads start, then only read.
+typedef struct {
+    double speed;                       // Replay seconds per CLOCK_MONOTONIC second.
+    struct timespec anchor;             // CLOCK_MONOTONIC time the speed was set, both clocks agree here.
+} ReplayClock;
+
+static const ReplayClock clock_default = { .speed = 1.0 };
+static ReplayClock clock_set;
+static _Atomic(const ReplayClock *) replay_clock = &clock_default; // Published with release, no lock on the read path.
+
+/*
+ * Name:         parse_replay_time
+ * Purpose:      Parses one --start/--end value.
+ * Arguments:    text - HH:MM[:SS], +N[s|m|h|d] or YYYY-MM-DD[T ]HH:MM[:SS].
+ *               out - Receives the parsed time.
+ *
+ * Output:       None.
+ * Modifies:     out.
+ * Returns:      0 on success, -1 if text matches no form.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Absolute times are UTC, matching parse_to_epoch() and the way the
+ *               BTD-300 files are recorded.
+ */
+static int parse_replay_time(const char *text, ReplayTime *out) {
+    int year, mon, day, hour, min, sec = 0;
+    char sep, tail;
+
+    if (text[0] == '+') {
+        char *end;
+        double n = strtod(text + 1, &end);
+        double unit = 1.0;
+        switch (*end) {
+            case '\0': case 's': break;
+            case 'm': unit = 60.0; break;
+            case 'h': unit = 3600.0; break;
+            case 'd': unit = 86400.0; break;
+            default: return -1;
+        }
+        if (end == text + 1 || n < 0 || (*end && end[1] != '\0')) return -1;
+        out->kind = REPLAY_TIME_OFFSET;
+        out->ms = (int64_t)(n * unit * 1000.0);
+        return 0;
+    }
+
+    int fields = sscanf(text, "%d-%d-%d%c%d:%d:%d%c", &year, &mon, &day, &sep, &hour, &min, &sec, &tail);
+    if ((fields == 6 || fields == 7) && (sep == 'T' || sep == ' ')) {
+        struct tm tm = {0};
+        tm.tm_year = year - 1900;
+        tm.tm_mon = mon - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        tm.tm_min = min;
+        tm.tm_sec = sec;
+        time_t t = timegm(&tm);
+        if (t == (time_t)-1) return -1;
+        out->kind = REPLAY_TIME_ABSOLUTE;
+        out->ms = (int64_t)t * 1000;
+        return 0;
+    }
+
+    sec = 0;
+    fields = sscanf(text, "%d:%d:%d%c", &hour, &min, &sec, &tail);
+    if ((fields == 2 || fields == 3) && hour >= 0 && hour < 48 && min >= 0 && min < 60 && sec >= 0 && sec < 61) {
+        out->kind = REPLAY_TIME_OF_DAY;
+        out->ms = ((int64_t)hour * 3600 + min * 60 + sec) * 1000;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Name:         replay_parse_options
+ * Purpose:      Takes --start, --end, --speed, --live and --live-depth off the command line.
+ * Arguments:    argc - Address of argc.
+ *               argv - Argument vector.
+ *               opts - Receives the options.
+ *
+ * Output:       Error message to stderr on a malformed option.
+ * Modifies:     *argc, argv (remaining arguments are shifted down), opts.
+ * Returns:      0 on success, -1 on a malformed option.
+ * Assumptions:  argv[*argc] is NULL, as passed to main().
+ *
+ * Bugs:         None known.
+ * Notes:        Both --opt=value and --opt value are accepted, anywhere on the
+ *               line. --speed takes a factor (10, 10x, 0.5) or "max".
+ *               --live on its own is --live=latest, its policy has to be joined
+ *               with = so a following data file path is not taken for one.
+ */
+int replay_parse_options(int *argc, char **argv, ReplayOptions *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->speed = 1.0;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *names[] = { "--start", "--end", "--speed", "--live", "--live-depth" };
+        const char *value = NULL;
+        int which = -1;
+
+        if (strcmp(argv[i], "--live") == 0) {
+            opts->live = LIVE_LATEST;
+            continue;
+        }
+        for (int k = 0; k < 5 && which < 0; k++) {
+            size_t n = strlen(names[k]);
+            if (strncmp(argv[i], names[k], n) != 0) continue;
+            if (argv[i][n] == '=') {
+                value = argv[i] + n + 1;
+                which = k;
+            } else if (argv[i][n] == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+                which = k;
+            }
+        }
+        if (which < 0) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        if (which == 3) {
+            opts->live = live_policy(value);
+            if (opts->live == LIVE_OFF) {
+                fprintf(stderr, "Invalid --live '%s': use latest, block or repeat\n", value);
+                return -1;
+            }
+        } else if (which == 4) {
+            char *end;
+            unsigned long depth = strtoul(value, &end, 10);
+            if (end == value || *end != '\0' || depth < 2 || depth > LIVE_DEPTH_MAX) {
+                fprintf(stderr, "Invalid --live-depth '%s': use 2 to %d records\n", value, LIVE_DEPTH_MAX);
+                return -1;
+            }
+            opts->live_depth = (size_t)depth;
+        } else if (which == 2) {
+            char *end = NULL;
+            if (strcasecmp(value, "max") == 0) {
+                opts->speed = REPLAY_SPEED_MAX;
+            } else {
+                opts->speed = strtod(value, &end);
+                if (end == value || (*end != '\0' && strcasecmp(end, "x") != 0)) opts->speed = -1.0; // Trailing junk.
+            }
+            if (!(opts->speed > 0.0)) {
+                fprintf(stderr, "Invalid --speed '%s': use a factor such as 10 or 0.5, or max\n", value);
+                return -1;
+            }
+            if (opts->speed > REPLAY_SPEED_MAX) opts->speed = REPLAY_SPEED_MAX;
+        } else if (parse_replay_time(value, which == 0 ? &opts->start : &opts->end) != 0) {
+            fprintf(stderr, "Invalid %s '%s': use HH:MM[:SS], +N[s|m|h|d] or YYYY-MM-DDTHH:MM[:SS]\n", names[which], value);
+            return -1;
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+ * Name:         resolve_replay_time
+ * Purpose:      Converts a --start/--end value to the time base of the index.
+ * Arguments:    t - The parsed option.
+ *               first_ms - Recorded time of the first entry.
+ *               day_ms - UTC midnight of the first entry's day.
+ *
+ * Returns:      The time in index milliseconds.
+ */
+static int64_t resolve_replay_time(const ReplayTime *t, int64_t first_ms, int64_t day_ms) {
+    switch (t->kind) {
+        case REPLAY_TIME_OF_DAY: return day_ms + t->ms;
+        case REPLAY_TIME_OFFSET: return first_ms + t->ms;
+        default: return t->ms;
+    }
+}
+
+/*
+ * Name:         select_window
+ * Purpose:      Builds a timestamp index of a generation and narrows its replay window.
+ * Arguments:    map - The generation, not yet published or still private to main().
+ *               opts - Options from replay_parse_options(), --start or --end given.
+ *               time_fn - Reads the recorded time of an entry, may be NULL.
+ *               period_ms - Spacing of entries that carry no time.
+ *
+ * Output:       An error to stderr if no window can be selected.
+ * Modifies:     map->window_first, map->window_count.
+ * Returns:      0 on success, -1 if the window is empty or the index cannot be built.
+ * Assumptions:  No reader can see map yet.
+ *
+ * Bugs:         None known.
+ * Notes:        The index is one int64_t per entry, built only when --start or
+ *               --end is given and freed once the window is known, as the window
+ *               is fixed until the file is reloaded.
+ *
+ *               Entries without a recorded time are spaced period_ms apart from
+ *               midnight, so on a 24 h file recorded from 00:00 HH:MM selects the
+ *               same moment as on a timestamped file. Entries are assumed to be in
+ *               time order; the window runs from the first entry at or after
+ *               --start to the last entry before --end.
+ */
+static int select_window(ReplayMap *map, const ReplayOptions *opts, ReplayTimeFn time_fn, int64_t period_ms) {
+    size_t count = map->header ? map->record_count : map->line_count;
+    if (!map->data || count == 0) {
+        fprintf(stderr, "--start/--end need a regular, non-empty data file\n");
+        return -1;
+    }
+
+    int64_t *times = malloc(count * sizeof(int64_t));
+    if (!times) {
+        fprintf(stderr, "Unable to index data file times: %s\n", strerror(ENOMEM));
+        return -1;
+    }
+
+    bool timed = false;
+    for (size_t i = 0; i < count; i++) {
+        const void *item;
+        size_t len;
+        if (map->header) {
+            copy_record(map, i, record_copy);
+            item = record_copy;
+            len = map->record_size;
+        } else {
+            item = map->data + map->line_offsets[i];
+            len = map->line_lengths[i];
+        }
+        int64_t t;
+        if (time_fn && time_fn(item, len, map->header != NULL, &t)) {
+            times[i] = t;
+            timed = true;
+        } else {
+            times[i] = i ? times[i - 1] + period_ms : 0;
+        }
+    }
+
+    int64_t day_ms = 0;
+    if (timed) { // UTC midnight of the first entry, for HH:MM.
+        day_ms = times[0] - ((times[0] % 86400000) + 86400000) % 86400000;
+    }
+
+    size_t first = 0;
+    size_t last = count;
+    if (opts->start.kind != REPLAY_TIME_NONE) {
+        int64_t start = resolve_replay_time(&opts->start, times[0], day_ms);
+        while (first < count && times[first] < start) first++;
+    }
+    if (opts->end.kind != REPLAY_TIME_NONE) {
+        int64_t end = resolve_replay_time(&opts->end, times[0], day_ms);
+        last = first;
+        while (last < count && times[last] < end) last++;
+    }
+    free(times);
+
+    if (first >= last) {
+        fprintf(stderr, "No data file entries between --start and --end\n");
+        return -1;
+    }
+
+    map->window_first = first;
+    map->window_count = last - first;
+    return 0;
+}
+
+/*
+ * Name:         replay_apply_options
+ * Purpose:      Narrows the replay window and sets the clock speed.
+ * Arguments:    src - The replay source, may be NULL when no window is asked for.
+ *               opts - Options from replay_parse_options().
+ *               time_fn - Reads the recorded time of an entry, may be NULL.
+ *               period_ms - Spacing of entries that carry no time.
+ *
+ * Output:       The selected window, or an error, to stderr.
+ * Modifies:     The generation's window, src->cursor, the options replay_reload()
+ *               applies again, the replay clock.
+ * Returns:      0 on success, -1 if a window was asked for and cannot be selected.
+ * Assumptions:  Called once from main() before the sender and receiver threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        The window itself is chosen by select_window().
+ */
+int replay_apply_options(ReplaySource *src, const ReplayOptions *opts, ReplayTimeFn time_fn, int64_t period_ms) {
+    double speed = opts->speed > 0.0 ? opts->speed : 1.0;
+    clock_gettime(CLOCK_MONOTONIC, &clock_set.anchor);
+    clock_set.speed = speed;
+    atomic_store_explicit(&replay_clock, &clock_set, memory_order_release);
+
+    if (src) {
+        src->window_opts = *opts;
+        src->time_fn = time_fn;
+        src->period_ms = period_ms;
+    }
+    if (opts->start.kind == REPLAY_TIME_NONE && opts->end.kind == REPLAY_TIME_NONE) return 0;
+
+    ReplayMap *map = src ? atomic_load(&src->map) : NULL;
+    if (!map) {
+        fprintf(stderr, "--start/--end need a regular, non-empty data file\n");
+        return -1;
+    }
+    if (select_window(map, opts, time_fn, period_ms) != 0) return -1;
+
+    atomic_store(&src->cursor, 0);
+    fprintf(stderr, "Replaying entries %zu-%zu of %zu at %gx\n", map->window_first + 1,
+            map->window_first + map->window_count, map->header ? map->record_count : map->line_count, speed);
+    return 0;
+}
+
+/*
+ * Name:         replay_clock_now
+ * Purpose:      Reads the replay clock.
+ * Arguments:    ts - Receives the replay time.
+ *
+ * Output:       None.
+ * Modifies:     ts.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        At the default speed this is clock_gettime(CLOCK_MONOTONIC). Above
+ *               it, time since the anchor is multiplied by the speed, so every
+ *               interval an emulator measures or waits for shrinks by the same
+ *               factor without touching its configured interval. The arithmetic is
+ *               done in double seconds, at 10000x a year of wall time still keeps
+ *               sub-millisecond resolution. The speed and anchor are set once
+ *               before the threads start, so the read takes no lock.
+ */
+void replay_clock_now(struct timespec *ts) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+
+    const ReplayClock *clock = atomic_load_explicit(&replay_clock, memory_order_acquire);
+    double speed = clock->speed;
+    struct timespec anchor = clock->anchor;
+    if (speed == 1.0) return;
+
+    double elapsed = (double)(ts->tv_sec - anchor.tv_sec) + (double)(ts->tv_nsec - anchor.tv_nsec) / 1e9;
+    double scaled = elapsed * speed;
+    time_t whole = (time_t)scaled;
+    long nsec = anchor.tv_nsec + (long)((scaled - (double)whole) * 1e9);
+    ts->tv_sec = anchor.tv_sec + whole + nsec / 1000000000L;
+    ts->tv_nsec = nsec % 1000000000L;
+}
+
+/*
+ * Name:         replay_clock_deadline
+ * Purpose:      Converts a replay clock deadline to CLOCK_MONOTONIC.
+ * Arguments:    replay_ts - Deadline on the replay clock.
+ *               mono_ts - Receives the CLOCK_MONOTONIC deadline.
+ *
+ * Output:       None.
+ * Modifies:     mono_ts.
+ * Returns:      None.
+ * Assumptions:  replay_ts came from replay_clock_now() plus an interval.
+ *
+ * Bugs:         None known.
+ * Notes:        The inverse of replay_clock_now(), mono_ts may alias replay_ts.
+ */
+void replay_clock_deadline(const struct timespec *replay_ts, struct timespec *mono_ts) {
+    const ReplayClock *clock = atomic_load_explicit(&replay_clock, memory_order_acquire);
+    double speed = clock->speed;
+    struct timespec anchor = clock->anchor;
+    if (speed == 1.0) {
+        *mono_ts = *replay_ts;
+        return;
+    }
+
+    double elapsed = (double)(replay_ts->tv_sec - anchor.tv_sec) + (double)(replay_ts->tv_nsec - anchor.tv_nsec) / 1e9;
+    double real = elapsed / speed;
+    time_t whole = (time_t)real;
+    long nsec = anchor.tv_nsec + (long)((real - (double)whole) * 1e9);
+    if (nsec < 0) { // A deadline before the anchor.
+        nsec += 1000000000L;
+        whole--;
+    }
+    mono_ts->tv_sec = anchor.tv_sec + whole + nsec / 1000000000L;
+    mono_ts->tv_nsec = nsec % 1000000000L;
+}
+
+/*
+ * Name:         replay_clock_speed
+ * Purpose:      Returns the replay clock speed factor.
+ *
+ * Returns:      1.0 unless --speed was given.
+ */
+double replay_clock_speed(void) {
+    return atomic_load_explicit(&replay_clock, memory_order_acquire)->speed;
+}
+
+// ---------------- Reload ----------------
+
+// A watched source and the directory entry of its data file.
+typedef struct {
+    ReplaySource *src;
+    int wd;                     // inotify watch on the file's directory, -1 for SIGHUP only.
+    char name[NAME_MAX + 1];    // The file's name in that directory.
+    bool pending;               // Changed, reloaded once the directory goes quiet.
+} ReplayWatch;
+
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ReplayWatch watches[REPLAY_MAX_WATCHED];
+static size_t watch_count = 0;
+static int inotify_fd = -1;
+static int hup_fd = -1;         // signalfd for SIGHUP.
+static int wake_fd = -1;        // eventfd, stops the watcher.
+static pthread_t watcher;
+static bool watcher_started = false;
+static atomic_bool watcher_stop = false;
+
+/*
+ * Name:         replay_reload
+ * Purpose:      Maps the data file again and publishes it in place of the current one.
+ * Arguments:    src - The replay source.
+ *
+ * Output:       The outcome to stderr.
+ * Modifies:     src->map, src->cursor.
+ * Returns:      0 on success, -1 if the new file cannot be used.
+ * Assumptions:  None, safe while the sender and receiver are reading src.
+ *
+ * Bugs:         None known.
+ * Notes:        The new generation is mapped, indexed, checked and windowed before
+ *               any reader can see it, then swapped in with one atomic exchange,
+ *               so a reader gets either the old file or the new one, never a mix.
+ *               The old mapping is freed once no reader is left inside it, which
+ *               takes one line copy at most. A file that fails any check leaves
+ *               the current data playing. Replay starts again from the top of
+ *               the new window.
+ *
+ *               Replace a watched file by renaming a new one over it, as
+ *               wxb_convert does. Truncating a mapped file in place makes a
+ *               reader fault before the reload can happen.
+ */
+int replay_reload(ReplaySource *src) {
+    if (!src->path || !atomic_load(&src->map)) {
+        fprintf(stderr, "Reload: only a regular data file can be reloaded\n");
+        return -1;
+    }
+    pthread_mutex_lock(&src->reload_mutex);
+
+    const char *why = NULL;
+    ReplayMap *map = NULL;
+    struct stat st;
+    int fd = open(src->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        why = strerror(errno);
+        if (fd >= 0) close(fd);
+    } else if (!S_ISREG(st.st_mode)) {
+        why = "no longer a regular file";
+        close(fd);
+    } else if (!(map = map_file(fd, &st))) {
+        why = strerror(errno);
+    } else if (map->header && (src->expect_record_size != map->record_size ||
+                               strncmp(map->header->sensor, src->sensor, WXB_SENSOR_LEN) != 0)) {
+        why = "not converted for this sensor or this build, rerun wxb_convert";
+    } else if ((map->header ? map->record_count : map->line_count) == 0) {
+        why = "no entries";
+    } else if ((src->window_opts.start.kind != REPLAY_TIME_NONE || src->window_opts.end.kind != REPLAY_TIME_NONE) &&
+               select_window(map, &src->window_opts, src->time_fn, src->period_ms) != 0) {
+        why = "no entries in the --start/--end window";
+    }
+    if (why) {
+        fprintf(stderr, "[%ld] Reload of %s failed: %s, keeping the current data\n", time(NULL), src->path, why);
+        free_map(map);
+        pthread_mutex_unlock(&src->reload_mutex);
+        return -1;
+    }
+
+    ReplayMap *old = atomic_exchange(&src->map, map);
+    atomic_store_explicit(&src->cursor, 0, memory_order_relaxed);
+    while (atomic_load(&src->readers) != 0) { // Readers that may still hold old.
+        struct timespec pause = { 0, REPLAY_RECLAIM_NS };
+        nanosleep(&pause, NULL);
+    }
+    free_map(old);
+    atomic_fetch_add_explicit(&src->generation, 1, memory_order_release);
+    pthread_mutex_unlock(&src->reload_mutex);
+
+    metrics_count(METRIC_REPLAY_RELOADS, 1);
+    fprintf(stderr, "[%ld] Reloaded %s: %zu %s\n", time(NULL), src->path, map->window_count,
+            map->header ? "records" : "lines");
+    return 0;
+}
+
+/*
+ * Name:         replay_generation
+ * Purpose:      Counts the reloads of a source.
+ * Arguments:    src - The replay source, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The number of successful reloads, 0 for a NULL source.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A reader that renders ahead, like the wind FrameRing, compares
+ *               this between ticks and throws away what it read from the old file.
+ */
+unsigned replay_generation(const ReplaySource *src) {
+    return src ? atomic_load_explicit(&src->generation, memory_order_acquire) : 0;
+}
+
+/*
+ * Name:         read_changes
+ * Purpose:      Marks the watched files named by the pending inotify events.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     watches[].pending.
+ * Returns:      true if a watched file changed.
+ * Assumptions:  Called from the watcher thread, inotify_fd is non-blocking.
+ *
+ * Bugs:         None known.
+ * Notes:        IN_CLOSE_WRITE covers a file written in place, IN_MOVED_TO a
+ *               new file renamed over it. Other files in the directory are ignored.
+ */
+static bool read_changes(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        pthread_mutex_lock(&watch_mutex);
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len == 0) continue;
+            for (size_t i = 0; i < watch_count; i++) {
+                if (watches[i].wd == ev->wd && strcmp(watches[i].name, ev->name) == 0) {
+                    watches[i].pending = true;
+                    changed = true;
+                }
+            }
+        }
+        pthread_mutex_unlock(&watch_mutex);
+    }
+    return changed;
+}
+
+/*
+ * Name:         watch_thread
+ * Purpose:      Reloads watched sources after their files change or on SIGHUP.
+ * Arguments:    arg - Unused.
+ *
+ * Output:       Reload results to stderr.
+ * Modifies:     The watched sources.
+ * Returns:      NULL.
+ * Assumptions:  Started by replay_watch() with every signal blocked.
+ *
+ * Bugs:         None known.
+ * Notes:        A change starts a REPLAY_SETTLE_MS timer that every further
+ *               event restarts, so a save that truncates, writes and renames is
+ *               one reload of the finished file. SIGHUP reloads every source.
+ *               Reloads run with watch_mutex held, so replay_close() waits for
+ *               one in progress before the source goes away.
+ */
+static void *watch_thread(void *arg) {
+    (void)arg;
+    bool pending = false;
+
+    while (!atomic_load(&watcher_stop)) {
+        struct pollfd pfd[3] = {
+            { .fd = inotify_fd, .events = POLLIN },
+            { .fd = hup_fd, .events = POLLIN },
+            { .fd = wake_fd, .events = POLLIN },
+        };
+        int ready = poll(pfd, 3, pending ? REPLAY_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Reload: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (ready == 0) { // Quiet since the last change.
+            pending = false;
+            pthread_mutex_lock(&watch_mutex);
+            for (size_t i = 0; i < watch_count; i++) {
+                if (!watches[i].pending) continue;
+                watches[i].pending = false;
+                replay_reload(watches[i].src);
+            }
+            pthread_mutex_unlock(&watch_mutex);
+            continue;
+        }
+
+        if (pfd[0].revents & POLLIN) pending |= read_changes();
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(hup_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {}
+            fprintf(stderr, "[%ld] SIGHUP, reloading data files\n", time(NULL));
+            pthread_mutex_lock(&watch_mutex);
+            for (size_t i = 0; i < watch_count; i++) watches[i].pending = true;
+            pthread_mutex_unlock(&watch_mutex);
+            pending = true;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Name:         start_watcher
+ * Purpose:      Blocks SIGHUP and starts the watcher thread.
+ * Arguments:    None.
+ *
+ * Output:       An error message to stderr on failure.
+ * Modifies:     The calling thread's signal mask, the watcher state.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  watch_mutex is held, called from main() before other threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        SIGHUP stays blocked in every thread and is only read through
+ *               hup_fd, so it no longer ends the process.
+ */
+static int start_watcher(void) {
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+    hup_fd = signalfd(-1, &hup, SFD_CLOEXEC | SFD_NONBLOCK);
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int ret = (hup_fd < 0 || inotify_fd < 0 || wake_fd < 0) ? errno : 0;
+
+    if (ret == 0) {
+        atomic_store(&watcher_stop, false);
+        sigset_t all, previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &previous);
+        ret = pthread_create(&watcher, NULL, watch_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Unable to watch data files: %s\n", strerror(ret));
+        if (hup_fd >= 0) close(hup_fd);
+        if (inotify_fd >= 0) close(inotify_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        hup_fd = inotify_fd = wake_fd = -1;
+        return -1;
+    }
+    watcher_started = true;
+    return 0;
+}
+
+/*
+ * Name:         replay_watch
+ * Purpose:      Follows a mapped source's data file and reloads it when it changes.
+ * Arguments:    src - The replay source, may be NULL.
+ *
+ * Output:       An error message to stderr on failure.
+ * Modifies:     The watch list, starts the watcher thread on first use.
+ * Returns:      0 on success, or for a NULL or stream source, which has nothing
+ *               to reload. -1 on failure.
+ * Assumptions:  Called from main() before the emulator's other threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        The directory is watched rather than the file, so a file
+ *               renamed over the old one is seen. A directory inotify cannot
+ *               watch leaves the file reloadable by SIGHUP only.
+ */
+int replay_watch(ReplaySource *src) {
+    if (!src || !src->path || !atomic_load(&src->map)) return 0;
+
+    pthread_mutex_lock(&watch_mutex);
+    if (watch_count >= REPLAY_MAX_WATCHED) {
+        pthread_mutex_unlock(&watch_mutex);
+        fprintf(stderr, "Unable to watch %s: more than %d data files\n", src->path, REPLAY_MAX_WATCHED);
+        return -1;
+    }
+    if (!watcher_started && start_watcher() != 0) {
+        pthread_mutex_unlock(&watch_mutex);
+        return -1;
+    }
+
+    ReplayWatch *w = &watches[watch_count];
+    const char *slash = strrchr(src->path, '/');
+    const char *name = slash ? slash + 1 : src->path;
+    char dir[PATH_MAX];
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else if (slash == src->path) snprintf(dir, sizeof(dir), "/");
+    else snprintf(dir, sizeof(dir), "%.*s", (int)(slash - src->path), src->path);
+
+    w->src = src;
+    w->pending = false;
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    w->wd = inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (w->wd < 0) fprintf(stderr, "Unable to watch %s: %s, send SIGHUP to reload it\n", dir, strerror(errno));
+    watch_count++;
+    pthread_mutex_unlock(&watch_mutex);
+    return 0;
+}
+
+/*
+ * Name:         unwatch
+ * Purpose:      Drops a source from the watch list, stopping the watcher after the last.
+ * Arguments:    src - The replay source.
+ *
+ * Output:       None.
+ * Modifies:     The watch list, the watcher thread.
+ * Returns:      None.
+ * Assumptions:  Called from replay_close().
+ *
+ * Bugs:         None known.
+ * Notes:        Taking watch_mutex waits out a reload of src in progress. The
+ *               directory watch is kept while another source still uses it,
+ *               inotify hands out one descriptor per directory.
+ */
+static void unwatch(ReplaySource *src) {
+    pthread_mutex_lock(&watch_mutex);
+    bool found = false;
+    for (size_t i = 0; i < watch_count; i++) {
+        if (watches[i].src != src) continue;
+        int wd = watches[i].wd;
+        watches[i] = watches[--watch_count];
+        found = true;
+        bool shared = false;
+        for (size_t k = 0; k < watch_count; k++) shared |= watches[k].wd == wd;
+        if (wd >= 0 && !shared) inotify_rm_watch(inotify_fd, wd);
+        break;
+    }
+    bool stop = found && watch_count == 0 && watcher_started;
+    if (stop) watcher_started = false;
+    pthread_mutex_unlock(&watch_mutex);
+    if (!stop) return;
+
+    atomic_store(&watcher_stop, true);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {} // Full only if already woken.
+    pthread_join(watcher, NULL);
+    close(hup_fd);
+    close(inotify_fd);
+    close(wake_fd);
+    hup_fd = inotify_fd = wake_fd = -1;
+}
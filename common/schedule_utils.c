@@ -0,0 +1,307 @@
+/*
+ * File:     schedule_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  timerfd backed, drift-free scheduler shared by the emulator sender
+ *           threads, see schedule_utils.h.
+ *
+ *           Each deadline is the previous deadline plus the interval, never
+ *           "now" plus the interval, and is programmed into a one-shot
+ *           TFD_TIMER_ABSTIME timer. One-shot arming lets every deadline be
+ *           converted from the replay clock separately, so --speed works, and
+ *           lets the policy decide what follows a deadline that was missed.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "schedule_utils.h"
+#include "replay_utils.h"
+#include "console_utils.h"
+#include "metrics_utils.h"
+#include "trace_utils.h"
+
+static int64_t ts_to_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * SCHED_NS_PER_SEC + ts->tv_nsec;
+}
+
+static struct timespec ns_to_ts(int64_t ns) {
+    struct timespec ts = { .tv_sec = (time_t)(ns / SCHED_NS_PER_SEC), .tv_nsec = (long)(ns % SCHED_NS_PER_SEC) };
+    return ts;
+}
+
+static int64_t replay_now_ns(void) {
+    struct timespec ts;
+    replay_clock_now(&ts);
+    return ts_to_ns(&ts);
+}
+
+/*
+ * Name:         arm_deadline
+ * Purpose:      Programs s->next_ns into the timerfd.
+ * Arguments:    s: the schedule.
+ *
+ * Output:       None.
+ * Modifies:     s->armed_mono_ns, the timerfd.
+ * Returns:      None.
+ * Assumptions:  s->interval_ns is not 0.
+ *
+ * Bugs:         None known.
+ * Notes:        A deadline already in the past expires at once, which is how
+ * 				 SCHEDULE_CATCH_UP sends its backlog.
+ */
+static void arm_deadline(SendSchedule *s) {
+    struct timespec replay = ns_to_ts(s->next_ns);
+    struct itimerspec its = { 0 };
+    replay_clock_deadline(&replay, &its.it_value); // Back to CLOCK_MONOTONIC, --speed shortens the wait.
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1; // All zero disarms.
+    s->armed_mono_ns = ts_to_ns(&its.it_value);
+    timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Name:         schedule_init
+ * Purpose:      Creates the timerfd and eventfd of a stopped schedule.
+ * Arguments:    s: the schedule to initialize.
+ * 				 policy: what to do with missed deadlines.
+ *
+ * Output:       None.
+ * Modifies:     s.
+ * Returns:      0 on success, -1 with errno set on failure.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Both descriptors are non-blocking, schedule_wait() polls them.
+ */
+int schedule_init(SendSchedule *s, SchedulePolicy policy) {
+    memset(s, 0, sizeof(*s));
+    s->policy = policy;
+    s->stats.late_min_ns = INT64_MAX;
+    s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->timer_fd < 0 || s->wake_fd < 0) {
+        int saved = errno;
+        schedule_destroy(s);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         schedule_start
+ * Purpose:      Starts periodic ticks, or changes their interval.
+ * Arguments:    s: the schedule.
+ * 				 interval_ns: replay clock nanoseconds between ticks, 0 ticks back to back.
+ *
+ * Output:       None.
+ * Modifies:     s.
+ * Returns:      None.
+ * Assumptions:  Called from the thread that calls schedule_wait().
+ *
+ * Bugs:         None known.
+ * Notes:        Does nothing if already running at this interval, so the sender
+ * 				 can call it after every configuration change without losing
+ * 				 phase. The first deadline is the next multiple of the interval.
+ */
+void schedule_start(SendSchedule *s, uint64_t interval_ns) {
+    if (s->running && s->interval_ns == interval_ns) return;
+    s->running = true;
+    s->interval_ns = interval_ns;
+    if (interval_ns == 0) {
+        struct itimerspec off = { 0 };
+        timerfd_settime(s->timer_fd, 0, &off, NULL);
+        return;
+    }
+    int64_t now = replay_now_ns();
+    int64_t interval = (int64_t)interval_ns;
+    s->next_ns = ((now + interval - 1) / interval) * interval;
+    arm_deadline(s);
+}
+
+/*
+ * Name:         schedule_stop
+ * Purpose:      Stops the ticks, schedule_wait() then returns only when woken.
+ * Arguments:    s: the schedule.
+ *
+ * Output:       None.
+ * Modifies:     s, disarms the timerfd.
+ * Returns:      None.
+ * Assumptions:  Called from the thread that calls schedule_wait().
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void schedule_stop(SendSchedule *s) {
+    if (!s->running) return;
+    struct itimerspec off = { 0 };
+    timerfd_settime(s->timer_fd, 0, &off, NULL);
+    s->running = false;
+}
+
+/*
+ * Name:         record_tick
+ * Purpose:      Adds one tick's lateness to the statistics.
+ * Arguments:    s: the schedule.
+ * 				 late_ns: wake-up time minus deadline.
+ *
+ * Returns:      None.
+ */
+static void record_tick(SendSchedule *s, int64_t late_ns) {
+    ScheduleStats *st = &s->stats;
+    st->ticks++;
+    if (late_ns < st->late_min_ns) st->late_min_ns = late_ns;
+    if (late_ns > st->late_max_ns) st->late_max_ns = late_ns;
+    st->late_sum_ns += (double)late_ns;
+    st->late_sumsq_ns += (double)late_ns * (double)late_ns;
+    metrics_observe(METRIC_SEND_LATE_NS, late_ns);
+}
+
+/*
+ * Name:         schedule_wait
+ * Purpose:      Blocks until the next deadline or a schedule_wake().
+ * Arguments:    s: the schedule.
+ *
+ * Output:       None.
+ * Modifies:     s, advances the deadline on a tick.
+ * Returns:      SCHEDULE_TICK, SCHEDULE_WOKEN, or SCHEDULE_ERROR with errno set.
+ * Assumptions:  One thread waits on a schedule.
+ *
+ * Bugs:         None known.
+ * Notes:        A wake is reported before a tick that is due at the same time,
+ * 				 so a new configuration is read before the next send. Under
+ * 				 SCHEDULE_SKIP a missed deadline moves to the first one still
+ * 				 in the future; under SCHEDULE_CATCH_UP it is armed in the past
+ * 				 and the next wait returns at once.
+ */
+ScheduleEvent schedule_wait(SendSchedule *s) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = s->wake_fd, .events = POLLIN },
+            { .fd = s->timer_fd, .events = POLLIN },
+        };
+        bool back_to_back = s->running && s->interval_ns == 0;
+        int n = poll(fds, (s->running && !back_to_back) ? 2 : 1, back_to_back ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return SCHEDULE_ERROR;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(s->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) return SCHEDULE_ERROR;
+            WX_TRACE2(sender_wake, SCHEDULE_WOKEN, 0);
+            return SCHEDULE_WOKEN;
+        }
+        if (back_to_back) {
+            record_tick(s, 0);
+            WX_TRACE2(sender_wake, SCHEDULE_TICK, 0);
+            return SCHEDULE_TICK;
+        }
+        if (!(fds[1].revents & POLLIN)) continue;
+
+        uint64_t expirations;
+        if (read(s->timer_fd, &expirations, sizeof(expirations)) < 0) {
+            if (errno == EAGAIN) continue; // Re-armed since poll() returned.
+            return SCHEDULE_ERROR;
+        }
+
+        struct timespec mono;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        int64_t late_ns = ts_to_ns(&mono) - s->armed_mono_ns;
+        record_tick(s, late_ns);
+        WX_TRACE2(sender_wake, SCHEDULE_TICK, late_ns);
+
+        int64_t interval = (int64_t)s->interval_ns;
+        s->next_ns += interval;
+        if (s->policy == SCHEDULE_SKIP) {
+            int64_t now = replay_now_ns();
+            if (now >= s->next_ns) {
+                int64_t missed = (now - s->next_ns) / interval + 1;
+                s->next_ns += missed * interval;
+                s->stats.skipped += (uint64_t)missed;
+            }
+        }
+        arm_deadline(s);
+        return SCHEDULE_TICK;
+    }
+}
+
+/*
+ * Name:         schedule_wake
+ * Purpose:      Makes the current or next schedule_wait() return SCHEDULE_WOKEN.
+ * Arguments:    s: the schedule.
+ *
+ * Output:       None.
+ * Modifies:     The eventfd counter.
+ * Returns:      None.
+ * Assumptions:  schedule_init() succeeded.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe from any thread, takes no lock. Wakes before the sender
+ * 				 waits are merged into one.
+ */
+void schedule_wake(SendSchedule *s) {
+    uint64_t one = 1;
+    if (s->wake_fd >= 0 && write(s->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        safe_console_error("schedule_wake: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Name:         schedule_report
+ * Purpose:      Prints the tick count and lateness statistics to the console.
+ * Arguments:    s: the schedule.
+ * 				 name: prefix for the line, usually program_name.
+ *
+ * Output:       One line on stdout, nothing if no tick was timed.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  The waiting thread has stopped.
+ *
+ * Bugs:         None known.
+ * Notes:        Back to back ticks count with a lateness of 0.
+ */
+void schedule_report(const SendSchedule *s, const char *name) {
+    const ScheduleStats *st = &s->stats;
+    if (st->ticks == 0) return;
+    double n = (double)st->ticks;
+    double mean = st->late_sum_ns / n;
+    double var = st->late_sumsq_ns / n - mean * mean;
+    safe_console_print("%s: %llu ticks, %llu skipped, lateness mean %.1f us, sd %.1f us, min %.1f us, max %.1f us\n",
+                       name, (unsigned long long)st->ticks, (unsigned long long)st->skipped,
+                       mean / 1e3, sqrt(var > 0.0 ? var : 0.0) / 1e3,
+                       (double)st->late_min_ns / 1e3, (double)st->late_max_ns / 1e3);
+}
+
+/*
+ * Name:         schedule_destroy
+ * Purpose:      Closes the schedule's descriptors.
+ * Arguments:    s: the schedule.
+ *
+ * Output:       None.
+ * Modifies:     s->timer_fd, s->wake_fd set to -1.
+ * Returns:      None.
+ * Assumptions:  No thread is waiting on s.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe on a schedule whose schedule_init() failed.
+ */
+void schedule_destroy(SendSchedule *s) {
+    if (s->timer_fd >= 0) close(s->timer_fd);
+    if (s->wake_fd >= 0) close(s->wake_fd);
+    s->timer_fd = -1;
+    s->wake_fd = -1;
+    s->running = false;
+}
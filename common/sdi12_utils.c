@@ -0,0 +1,644 @@
+/*
+ * File:     sdi12_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  SDI-12 responder engine, see sdi12_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include "sdi12_utils.h"
+#include "serial_utils.h"
+#include "console_utils.h"
+#include "crc_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+
+#define SDI12_NS_PER_SEC 1000000000LL
+#define SDI12_READ_MAX 64          // Bytes taken from the bus per read, a command is at most a few.
+#define SDI12_M_MAX_VALUES 9       // n of an M reply is one digit.
+
+/*
+ * Name:         mono_ns
+ * Purpose:      Reads CLOCK_MONOTONIC.
+ * Returns:      Nanoseconds.
+ */
+static int64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * SDI12_NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Name:         sdi12_valid_address
+ * Purpose:      Tells whether a character is an SDI-12 sensor address.
+ * Arguments:    address: the character.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      true for '0'-'9', 'A'-'Z' and 'a'-'z'.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        '?' is the query address of ?!, not a sensor's.
+ */
+bool sdi12_valid_address(char address) {
+    return (address >= '0' && address <= '9') || (address >= 'A' && address <= 'Z') || (address >= 'a' && address <= 'z');
+}
+
+/*
+ * Name:         find_sensor
+ * Purpose:      Looks up the sensor answering to an address.
+ * Returns:      The sensor, or NULL if none on the bus has it.
+ */
+static Sdi12Sensor *find_sensor(Sdi12Bus *bus, char address) {
+    for (int i = 0; i < bus->sensor_count; i++) {
+        if (bus->sensors[i].address == address) return &bus->sensors[i];
+    }
+    return NULL;
+}
+
+/*
+ * Name:         sdi12_bus_init
+ * Purpose:      Sets up the engine for a bus opened by open_serial_port().
+ * Arguments:    bus: the engine.
+ *               fd: the bus, in SERIAL_SDI12 mode for a serial device.
+ *               always_awake: answer commands without a preceding break.
+ *
+ * Output:       Error message to stderr if the timer cannot be created.
+ * Modifies:     bus.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  Sensors are added with sdi12_bus_add() before sdi12_bus_run().
+ *
+ * Bugs:         None known.
+ * Notes:        always_awake is for a pty or TCP host, which has no way to send a
+ *               break. An RFC 2217 client can, see transport_utils.c.
+ */
+int sdi12_bus_init(Sdi12Bus *bus, int fd, bool always_awake) {
+    memset(bus, 0, sizeof(*bus));
+    bus->fd = fd;
+    bus->always_awake = always_awake;
+    bus->last_activity_ns = INT64_MIN / 2; // Asleep until the first break.
+    bus->stats.latency_min_ns = INT64_MAX;
+    bus->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (bus->timer_fd < 0) {
+        fprintf(stderr, "SDI-12: timerfd_create: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         sdi12_bus_add
+ * Purpose:      Puts a sensor on the bus.
+ * Arguments:    bus: the engine.
+ *               address: the sensor's address.
+ *               ident: the aI! reply after the address and "13", truncated to fit.
+ *               measure_s: the ttt of its M and C replies, at most 999.
+ *               measure: takes a measurement, called on the engine thread.
+ *               ctx: passed to measure.
+ *
+ * Output:       Error message to stderr on a bad or duplicate address.
+ * Modifies:     bus->sensors, bus->sensor_count.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  sdi12_bus_run() has not started.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+int sdi12_bus_add(Sdi12Bus *bus, char address, const char *ident, unsigned measure_s, Sdi12MeasureFn measure, void *ctx) {
+    if (!sdi12_valid_address(address) || find_sensor(bus, address)) {
+        fprintf(stderr, "SDI-12: address '%c' is %s\n", address, sdi12_valid_address(address) ? "already in use" : "not 0-9, A-Z or a-z");
+        return -1;
+    }
+    if (bus->sensor_count >= SDI12_MAX_SENSORS || measure_s > 999) {
+        fprintf(stderr, "SDI-12: sensor '%c' does not fit the bus\n", address);
+        return -1;
+    }
+    Sdi12Sensor *s = &bus->sensors[bus->sensor_count++];
+    memset(s, 0, sizeof(*s));
+    s->address = address;
+    snprintf(s->ident, sizeof(s->ident), "%s", ident);
+    s->measure_s = measure_s;
+    s->measure = measure;
+    s->ctx = ctx;
+    return 0;
+}
+
+/*
+ * Name:         append_crc
+ * Purpose:      Appends the three character SDI-12 CRC of buf[0..*len).
+ * Returns:      None.
+ */
+static void append_crc(char *buf, size_t *len) {
+    uint16_t crc = crc16_arc((const uint8_t *)buf, *len);
+    buf[(*len)++] = (char)(0x40 | (crc >> 12));
+    buf[(*len)++] = (char)(0x40 | ((crc >> 6) & 0x3F));
+    buf[(*len)++] = (char)(0x40 | (crc & 0x3F));
+}
+
+/*
+ * Name:         queue_reply
+ * Purpose:      Formats a reply and arms it for after the command's marking.
+ * Arguments:    bus: the engine.
+ *               cmd_ns: arrival of the command's last character.
+ *               fmt, ...: the reply, without its CR/LF.
+ *
+ * Returns:      None.
+ */
+static void queue_reply(Sdi12Bus *bus, int64_t cmd_ns, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void queue_reply(Sdi12Bus *bus, int64_t cmd_ns, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(bus->reply, sizeof(bus->reply) - 2, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    size_t len = (size_t)n < sizeof(bus->reply) - 2 ? (size_t)n : sizeof(bus->reply) - 3;
+    bus->reply[len++] = '\r';
+    bus->reply[len++] = '\n';
+    bus->reply_len = len;
+    bus->reply_cmd_ns = cmd_ns;
+    bus->reply_due_ns = cmd_ns + SDI12_MARKING_NS + SDI12_REPLY_MARGIN_NS;
+}
+
+/*
+ * Name:         split_values
+ * Purpose:      Divides a sensor's values between the D replies.
+ * Arguments:    s: the sensor.
+ *               limit: characters of values per reply, SDI12_M_VALUES_LEN or SDI12_C_VALUES_LEN.
+ *
+ * Returns:      None.
+ * Notes:        Values that would need an eleventh D reply are dropped.
+ */
+static void split_values(Sdi12Sensor *s, size_t limit) {
+    size_t used = 0;
+    s->d_count = 0;
+    s->d_start[0] = 0;
+    for (int i = 0; i < s->data.count; i++) {
+        size_t len = strlen(s->data.values[i]);
+        if (s->d_count == 0 || used + len > limit) {
+            if (s->d_count == 10) {
+                s->data.count = i;
+                break;
+            }
+            s->d_start[s->d_count++] = (uint8_t)i;
+            used = 0;
+        }
+        used += len;
+    }
+    s->d_start[s->d_count] = (uint8_t)s->data.count;
+}
+
+/*
+ * Name:         take_measurement
+ * Purpose:      Fetches a sensor's values through its measure function.
+ * Arguments:    s: the sensor.
+ *               max_values: most values the command can report.
+ *               limit: characters of values per D reply.
+ *               crc: the command asked for CRCs.
+ *
+ * Returns:      None.
+ */
+static void take_measurement(Sdi12Sensor *s, int max_values, size_t limit, bool crc) {
+    s->data.count = 0;
+    if (s->measure && s->measure(s->ctx, s->address, &s->data) != 0) s->data.count = 0;
+    if (s->data.count > max_values) s->data.count = max_values;
+    if (s->data.count < 0) s->data.count = 0;
+    split_values(s, limit);
+    s->have_data = true;
+    s->crc = crc;
+}
+
+/*
+ * Name:         queue_data
+ * Purpose:      Queues the reply to aDn! or aRn!, one share of the values.
+ * Arguments:    bus: the engine.
+ *               s: the sensor.
+ *               n: which share.
+ *               cmd_ns: arrival of the command.
+ *
+ * Returns:      None.
+ * Notes:        Values not yet ready, or a share past the last, give the bare
+ *               address, as the standard asks.
+ */
+static void queue_data(Sdi12Bus *bus, Sdi12Sensor *s, int n, int64_t cmd_ns) {
+    char out[SDI12_REPLY_MAX];
+    size_t len = 0;
+    out[len++] = s->address;
+    if (s->have_data && cmd_ns >= s->ready_ns && n < s->d_count) {
+        for (int i = s->d_start[n]; i < s->d_start[n + 1]; i++) {
+            size_t v = strlen(s->data.values[i]);
+            memcpy(out + len, s->data.values[i], v);
+            len += v;
+        }
+    }
+    if (s->crc) append_crc(out, &len);
+    out[len] = '\0';
+    queue_reply(bus, cmd_ns, "%s", out);
+}
+
+/*
+ * Name:         measurement_kind
+ * Purpose:      Matches the start of a measurement command, as in M, MC2 or RC0.
+ * Arguments:    body: the command after the address, without the '!'.
+ *               letter: 'M', 'C' or 'R'.
+ *               crc: receives whether a 'C' for CRC follows the letter.
+ *               index: receives the digit that follows, 0 if there is none.
+ *
+ * Returns:      true if body is such a command.
+ * Notes:        R requires its digit, M and C take 1 to 9 or none.
+ */
+static bool measurement_kind(const char *body, char letter, bool *crc, int *index) {
+    if (body[0] != letter) return false;
+    const char *p = body + 1;
+    *crc = (*p == 'C');
+    if (*crc) p++;
+    *index = 0;
+    if (*p >= '0' && *p <= '9') *index = *p++ - '0';
+    else if (letter == 'R') return false;
+    if (letter != 'R' && p > body + 1 && p[-1] == '0') return false; // aM0! is not a command.
+    return *p == '\0';
+}
+
+/*
+ * Name:         handle_command
+ * Purpose:      Answers the command just completed in bus->cmd.
+ * Arguments:    bus: the engine.
+ *               cmd_ns: arrival of its '!'.
+ *
+ * Output:       None.
+ * Modifies:     The addressed sensor, bus->reply.
+ * Returns:      None.
+ * Assumptions:  bus->cmd is NUL terminated and ends in '!'.
+ *
+ * Bugs:         None known.
+ * Notes:        A command for an address not on the bus, or one the standard does
+ *               not define, gets no reply, as from a real sensor. Any command to
+ *               a sensor part way through an M measurement aborts it.
+ */
+static void handle_command(Sdi12Bus *bus, int64_t cmd_ns) {
+    WX_TRACE3(line_received, bus->fd, &bus->cmd[0], bus->cmd_len);
+    char address = bus->cmd[0];
+    Sdi12Sensor *s = (address == '?') ? (bus->sensor_count > 0 ? &bus->sensors[0] : NULL) : find_sensor(bus, address);
+    if (!s) return; // Another sensor's.
+
+    bus->stats.commands++;
+    metrics_count(METRIC_COMMANDS, 1);
+    if (s->service_pending) {
+        s->service_pending = false;
+        s->have_data = false;
+        bus->stats.aborted++;
+    }
+
+    bus->cmd[bus->cmd_len - 1] = '\0'; // Drop the '!'.
+    const char *body = bus->cmd + 1;
+    bool crc;
+    int index;
+
+    if (address == '?' && body[0] != '\0') {
+        metrics_count(METRIC_BAD_COMMANDS, 1); // Only ?! takes the query address.
+    } else if (body[0] == '\0') {
+        queue_reply(bus, cmd_ns, "%c", s->address);
+    } else if (strcmp(body, "I") == 0) {
+        queue_reply(bus, cmd_ns, "%c13%s", s->address, s->ident);
+    } else if (body[0] == 'A' && body[1] != '\0' && body[2] == '\0') {
+        char to = body[1];
+        if (sdi12_valid_address(to) && (to == s->address || !find_sensor(bus, to))) s->address = to;
+        queue_reply(bus, cmd_ns, "%c", s->address); // An address that cannot be taken is left, and reported, unchanged.
+    } else if (measurement_kind(body, 'M', &crc, &index)) {
+        take_measurement(s, SDI12_M_MAX_VALUES, SDI12_M_VALUES_LEN, crc);
+        s->ready_ns = cmd_ns + (int64_t)s->measure_s * SDI12_NS_PER_SEC;
+        s->service_pending = s->measure_s > 0;
+        queue_reply(bus, cmd_ns, "%c%03u%d", s->address, s->measure_s, s->data.count);
+    } else if (measurement_kind(body, 'C', &crc, &index)) {
+        take_measurement(s, SDI12_MAX_VALUES, SDI12_C_VALUES_LEN, crc);
+        s->ready_ns = cmd_ns + (int64_t)s->measure_s * SDI12_NS_PER_SEC;
+        queue_reply(bus, cmd_ns, "%c%03u%02d", s->address, s->measure_s, s->data.count);
+    } else if (strcmp(body, "V") == 0) {
+        s->data.count = 0;
+        split_values(s, SDI12_M_VALUES_LEN);
+        s->have_data = true;
+        s->crc = false;
+        s->ready_ns = cmd_ns;
+        queue_reply(bus, cmd_ns, "%c0000", s->address); // No verification values, ready at once.
+    } else if (measurement_kind(body, 'R', &crc, &index)) {
+        take_measurement(s, SDI12_MAX_VALUES, SDI12_C_VALUES_LEN, crc);
+        s->ready_ns = cmd_ns;
+        queue_data(bus, s, index, cmd_ns);
+    } else if (body[0] == 'D' && body[1] >= '0' && body[1] <= '9' && body[2] == '\0') {
+        queue_data(bus, s, body[1] - '0', cmd_ns);
+    } else {
+        metrics_count(METRIC_BAD_COMMANDS, 1);
+    }
+}
+
+/*
+ * Name:         on_break
+ * Purpose:      Wakes the bus on a break, dropping any command or reply in progress.
+ * Arguments:    bus: the engine.
+ *               now: arrival of the break marker.
+ *
+ * Returns:      None.
+ * Notes:        A break aborts M measurements, C measurements carry on.
+ */
+static void on_break(Sdi12Bus *bus, int64_t now) {
+    WX_TRACE1(sdi12_break, bus->fd);
+    bus->stats.breaks++;
+    bus->cmd_len = 0;
+    bus->reply_len = 0; // The recorder has taken the line.
+    bus->last_activity_ns = now;
+    for (int i = 0; i < bus->sensor_count; i++) {
+        Sdi12Sensor *s = &bus->sensors[i];
+        if (!s->service_pending) continue;
+        s->service_pending = false;
+        s->have_data = false;
+        bus->stats.aborted++;
+    }
+}
+
+/*
+ * Name:         receive_char
+ * Purpose:      Adds one received character to the command being assembled.
+ * Arguments:    bus: the engine.
+ *               c: the character, parity stripped.
+ *               now: its arrival.
+ *
+ * Returns:      None.
+ * Notes:        Characters during our own transmission are its echo. A bus that
+ *               has been marking for SDI12_SLEEP_NS is asleep and ignores them
+ *               until the next break.
+ */
+static void receive_char(Sdi12Bus *bus, char c, int64_t now) {
+    if (now < bus->quiet_until_ns) return;
+    if (!bus->always_awake && now - bus->last_activity_ns > SDI12_SLEEP_NS) {
+        if (c == '!') bus->stats.asleep++;
+        bus->cmd_len = 0;
+        return;
+    }
+    bus->last_activity_ns = now;
+    if (bus->reply_len > 0) bus->reply_len = 0; // The recorder spoke again before our reply, it has given up on it.
+
+    if (bus->cmd_len == 0 && c != '?' && !sdi12_valid_address(c)) return; // Noise between commands.
+    if (bus->cmd_len >= SDI12_CMD_MAX - 1) {
+        bus->cmd_len = 0;
+        return;
+    }
+    bus->cmd[bus->cmd_len++] = c;
+    if (c != '!') return;
+    bus->cmd[bus->cmd_len] = '\0';
+    handle_command(bus, now);
+    bus->cmd_len = 0;
+}
+
+/*
+ * Name:         receive_byte
+ * Purpose:      Decodes the PARMRK input stream one byte at a time.
+ * Arguments:    bus: the engine.
+ *               b: the byte read.
+ *               now: when the read returned.
+ *
+ * Returns:      None.
+ * Notes:        \377 \0 \0 is a break, \377 \0 X a parity or framing error on X,
+ *               \377 \377 a data byte of 0xFF. A 7E1 character is never 0xFF.
+ */
+static void receive_byte(Sdi12Bus *bus, uint8_t b, int64_t now) {
+    switch (bus->mark) {
+        case 0:
+            if (b == 0xFF) {
+                bus->mark = 1;
+                return;
+            }
+            break;
+        case 1:
+            bus->mark = 0;
+            if (b == 0x00) {
+                bus->mark = 2;
+                return;
+            }
+            break;
+        default:
+            bus->mark = 0;
+            if (b == 0x00) {
+                on_break(bus, now);
+            } else {
+                bus->stats.bad_chars++;
+                bus->cmd_len = 0; // The command is corrupt, the recorder will retry it.
+            }
+            return;
+    }
+    receive_char(bus, (char)(b & 0x7F), now);
+}
+
+/*
+ * Name:         transmit
+ * Purpose:      Writes a reply or service request now, and times it.
+ * Arguments:    bus: the engine.
+ *               buf, len: the bytes.
+ *               cmd_ns: arrival of the command answered, 0 for a service request.
+ *
+ * Returns:      None.
+ * Notes:        The line is ours for len characters from the write, the echo of
+ *               a one-wire adaptor is ignored until a character after that.
+ */
+static void transmit(Sdi12Bus *bus, const char *buf, size_t len, int64_t cmd_ns) {
+    int64_t start = mono_ns();
+    serial_write_buf(bus->fd, buf, len);
+    int64_t end = start + (int64_t)len * SDI12_CHAR_NS;
+    bus->quiet_until_ns = end + SDI12_CHAR_NS;
+    bus->last_activity_ns = end;
+
+    if (cmd_ns == 0) {
+        bus->stats.service_requests++;
+        return;
+    }
+    int64_t latency = start - cmd_ns;
+    WX_TRACE2(sdi12_reply, bus->fd, latency);
+    Sdi12Stats *st = &bus->stats;
+    st->replies++;
+    if (latency > SDI12_RESPONSE_NS) st->late++;
+    if (latency < st->latency_min_ns) st->latency_min_ns = latency;
+    if (latency > st->latency_max_ns) st->latency_max_ns = latency;
+    st->latency_sum_ns += (double)latency;
+}
+
+/*
+ * Name:         service_due
+ * Purpose:      When a sensor's service request may go out.
+ * Returns:      CLOCK_MONOTONIC nanoseconds, its values must be ready and the line marking.
+ */
+static int64_t service_due(const Sdi12Bus *bus, const Sdi12Sensor *s) {
+    int64_t idle = bus->last_activity_ns + SDI12_MARKING_NS;
+    return s->ready_ns > idle ? s->ready_ns : idle;
+}
+
+/*
+ * Name:         send_due
+ * Purpose:      Sends the reply or service request whose time has come.
+ * Arguments:    bus: the engine.
+ *               now: the current time.
+ *
+ * Returns:      None.
+ * Notes:        A service request waits for a reply in flight, and only one
+ *               goes out per call; the timer brings the next.
+ */
+static void send_due(Sdi12Bus *bus, int64_t now) {
+    if (bus->reply_len > 0) {
+        if (now < bus->reply_due_ns) return;
+        size_t len = bus->reply_len;
+        bus->reply_len = 0;
+        transmit(bus, bus->reply, len, bus->reply_cmd_ns);
+        return;
+    }
+    for (int i = 0; i < bus->sensor_count; i++) {
+        Sdi12Sensor *s = &bus->sensors[i];
+        if (!s->service_pending || now < service_due(bus, s)) continue;
+        s->service_pending = false;
+        char req[3] = { s->address, '\r', '\n' };
+        transmit(bus, req, sizeof(req), 0);
+        return;
+    }
+}
+
+/*
+ * Name:         arm_timer
+ * Purpose:      Arms the timerfd for the next reply or service request, or disarms it.
+ * Returns:      None.
+ */
+static void arm_timer(Sdi12Bus *bus) {
+    int64_t next = INT64_MAX;
+    if (bus->reply_len > 0) {
+        next = bus->reply_due_ns;
+    } else {
+        for (int i = 0; i < bus->sensor_count; i++) {
+            const Sdi12Sensor *s = &bus->sensors[i];
+            if (s->service_pending && service_due(bus, s) < next) next = service_due(bus, s);
+        }
+    }
+
+    struct itimerspec its = { 0 };
+    if (next != INT64_MAX) {
+        if (next <= 0) next = 1; // 0 would disarm it.
+        its.it_value.tv_sec = (time_t)(next / SDI12_NS_PER_SEC);
+        its.it_value.tv_nsec = (long)(next % SDI12_NS_PER_SEC);
+    }
+    timerfd_settime(bus->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Name:         sdi12_bus_run
+ * Purpose:      Serves the bus until *stop is set.
+ * Arguments:    bus: the engine, with its sensors added.
+ *               stop: set by the signal thread to end the loop.
+ *
+ * Output:       Error message to stderr on a read error.
+ * Modifies:     bus, the calling thread's timer slack.
+ * Returns:      None.
+ * Assumptions:  Called from one thread, which owns bus from here on.
+ *
+ * Bugs:         None known.
+ * Notes:        Input is handled before anything due is sent, so a break that
+ *               arrives with a reply's deadline still cancels the reply. The
+ *               timer slack is cut to 1 ns so the timerfd wakes on time rather
+ *               than up to 50 us late. stop is checked every SERIAL_POLL_MS.
+ */
+void sdi12_bus_run(Sdi12Bus *bus, volatile sig_atomic_t *stop) {
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    while (!*stop) {
+        arm_timer(bus);
+        struct pollfd fds[2] = {
+            { .fd = bus->fd, .events = POLLIN },
+            { .fd = bus->timer_fd, .events = POLLIN },
+        };
+        int n = poll(fds, 2, SERIAL_POLL_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "SDI-12: poll: %s\n", strerror(errno));
+            return;
+        }
+        int64_t now = mono_ns();
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(bus->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                fprintf(stderr, "SDI-12: timer: %s\n", strerror(errno));
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            uint8_t buf[SDI12_READ_MAX];
+            ssize_t got = read(bus->fd, buf, sizeof(buf));
+            if (got < 0 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "SDI-12: read: %s\n", strerror(errno));
+                return;
+            }
+            if (got > 0) {
+                capture_bytes(bus->fd, CAPTURE_RX, buf, (size_t)got);
+                for (ssize_t i = 0; i < got; i++) receive_byte(bus, buf[i], now);
+            }
+        }
+        send_due(bus, mono_ns());
+    }
+}
+
+/*
+ * Name:         sdi12_bus_report
+ * Purpose:      Prints the reply timing and traffic counts to the console.
+ * Arguments:    bus: the engine.
+ *               name: prefix for the lines, usually program_name.
+ *
+ * Output:       Two lines on stdout, the first only if a reply was sent.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  sdi12_bus_run() has returned.
+ *
+ * Bugs:         None known.
+ * Notes:        Latency runs from the read that delivered the command's '!' to the
+ *               write of the reply, the adaptor's own delay comes on top.
+ */
+void sdi12_bus_report(const Sdi12Bus *bus, const char *name) {
+    const Sdi12Stats *st = &bus->stats;
+    if (st->replies > 0) {
+        safe_console_print("%s: %llu SDI-12 replies, %llu over 15 ms, latency mean %.2f ms, min %.2f ms, max %.2f ms\n",
+                           name, (unsigned long long)st->replies, (unsigned long long)st->late,
+                           st->latency_sum_ns / (double)st->replies / 1e6,
+                           (double)st->latency_min_ns / 1e6, (double)st->latency_max_ns / 1e6);
+    }
+    safe_console_print("%s: %llu commands, %llu breaks, %llu ignored asleep, %llu bad characters, "
+                       "%llu M measurements aborted, %llu service requests\n",
+                       name, (unsigned long long)st->commands, (unsigned long long)st->breaks,
+                       (unsigned long long)st->asleep, (unsigned long long)st->bad_chars,
+                       (unsigned long long)st->aborted, (unsigned long long)st->service_requests);
+}
+
+/*
+ * Name:         sdi12_bus_close
+ * Purpose:      Releases the engine's timer.
+ * Arguments:    bus: the engine.
+ *
+ * Output:       None.
+ * Modifies:     bus->timer_fd set to -1.
+ * Returns:      None.
+ * Assumptions:  sdi12_bus_run() has returned.
+ *
+ * Bugs:         None known.
+ * Notes:        The bus fd is the caller's, closed with close_serial_port().
+ */
+void sdi12_bus_close(Sdi12Bus *bus) {
+    if (bus->timer_fd >= 0) close(bus->timer_fd);
+    bus->timer_fd = -1;
+}
@@ -0,0 +1,157 @@
+/*
+ * File:     seqlock_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Sequence lock used to hand sensor configuration snapshots from the
+ *           receiver thread to the sender thread without sensor_mutex.
+ *
+ *           The writer makes the counter odd, copies, then makes it even again.
+ *           A reader copies between two reads of the counter and keeps the copy
+ *           only if both reads are the same even value. The shared copy is read
+ *           and written with relaxed atomic word accesses, so a reader that
+ *           races the writer sees torn data it then throws away, never
+ *           undefined behaviour.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include "seqlock_utils.h"
+
+#define SEQLOCK_SPINS 64 // Retries before a reader yields to a writer that was preempted mid-copy.
+
+/*
+ * Name:         copy_out
+ * Purpose:      Copies len bytes out of the shared buffer with relaxed atomic loads.
+ * Arguments:    dst: private destination.
+ * 				 shared: the published copy.
+ * 				 len: number of bytes.
+ *
+ * Output:       None.
+ * Modifies:     dst.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Whole words when shared is word aligned (it is for any struct
+ * 				 with static storage), bytes otherwise and for the tail.
+ */
+static void copy_out(void *dst, const void *shared, size_t len) {
+    unsigned char *d = dst;
+    const unsigned char *s = shared;
+    size_t i = 0;
+
+    if (((uintptr_t)s % sizeof(unsigned long)) == 0) {
+        for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+            unsigned long w = __atomic_load_n((const unsigned long *)(s + i), __ATOMIC_RELAXED);
+            memcpy(d + i, &w, sizeof(w));
+        }
+    }
+    for (; i < len; i++) d[i] = __atomic_load_n(s + i, __ATOMIC_RELAXED);
+}
+
+/*
+ * Name:         copy_in
+ * Purpose:      Copies len bytes into the shared buffer with relaxed atomic stores.
+ * Arguments:    shared: the published copy.
+ * 				 src: private source.
+ * 				 len: number of bytes.
+ *
+ * Output:       None.
+ * Modifies:     shared.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Mirror of copy_out().
+ */
+static void copy_in(void *shared, const void *src, size_t len) {
+    unsigned char *d = shared;
+    const unsigned char *s = src;
+    size_t i = 0;
+
+    if (((uintptr_t)d % sizeof(unsigned long)) == 0) {
+        for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+            unsigned long w;
+            memcpy(&w, s + i, sizeof(w));
+            __atomic_store_n((unsigned long *)(d + i), w, __ATOMIC_RELAXED);
+        }
+    }
+    for (; i < len; i++) __atomic_store_n(d + i, s[i], __ATOMIC_RELAXED);
+}
+
+/*
+ * Name:         seqlock_write
+ * Purpose:      Publishes a new copy of a struct.
+ * Arguments:    lock: the sequence lock guarding shared.
+ * 				 shared: the published copy readers take snapshots of.
+ * 				 src: the writer's private struct.
+ * 				 len: size of the struct.
+ *
+ * Output:       None.
+ * Modifies:     shared, lock->seq advances by two.
+ * Returns:      None.
+ * Assumptions:  Only one thread ever writes through a given lock.
+ *
+ * Bugs:         None known.
+ * Notes:        Never blocks. The release fence orders the odd counter before
+ * 				 the data, the release store orders the data before the even one.
+ */
+void seqlock_write(SeqLock *lock, void *shared, const void *src, size_t len) {
+    uint32_t seq = atomic_load_explicit(&lock->seq, memory_order_relaxed);
+    atomic_store_explicit(&lock->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    copy_in(shared, src, len);
+    atomic_store_explicit(&lock->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Name:         seqlock_read
+ * Purpose:      Takes a consistent snapshot of a published struct.
+ * Arguments:    lock: the sequence lock guarding shared.
+ * 				 dst: receives the snapshot.
+ * 				 shared: the published copy.
+ * 				 len: size of the struct.
+ *
+ * Output:       None.
+ * Modifies:     dst.
+ * Returns:      The sequence number of the snapshot, for seqlock_sequence() comparisons.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Spins while a write is in progress, yielding after SEQLOCK_SPINS
+ * 				 attempts. Writes are a single memcpy sized struct, so a retry is rare.
+ */
+uint32_t seqlock_read(const SeqLock *lock, void *dst, const void *shared, size_t len) {
+    for (unsigned spins = 0;; spins++) {
+        uint32_t seq = atomic_load_explicit(&lock->seq, memory_order_acquire);
+        if ((seq & 1u) == 0) {
+            copy_out(dst, shared, len);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&lock->seq, memory_order_relaxed) == seq) return seq;
+        }
+        if (spins >= SEQLOCK_SPINS) sched_yield();
+    }
+}
+
+/*
+ * Name:         seqlock_sequence
+ * Purpose:      Reads the current sequence number.
+ * Arguments:    lock: the sequence lock.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The sequence number, odd while a write is in progress.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A value different from the one seqlock_read() returned means
+ * 				 the snapshot is out of date.
+ */
+uint32_t seqlock_sequence(const SeqLock *lock) {
+    return atomic_load_explicit(&lock->seq, memory_order_acquire);
+}
@@ -27,69 +27,765 @@
 #include <stdatomic.h>
 #include <stdarg.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "serial_utils.h"
+#include "transport_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "fault_utils.h"
+#include "trace_utils.h"
+#include "arena_utils.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B9600	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 #define MAX_MSG_BUF 256 // regerror message buffer max size.
-static pthread_mutex_t serial_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define TX_FORMAT_BUF 1024 // safe_serial_write() formats into the stack when the output fits.
+#define TX_IOV_MAX 64 // Pieces handed to one writev() by the writer thread.
+#define TX_HDR_LEN sizeof(uint32_t) // Every queued message is prefixed with its length.
 
+typedef struct {
+    char data[SERIAL_TX_RING_SIZE];
+    size_t head; // Free running producer index.
+    size_t tail; // Free running writer index.
+    bool reserved; // A SerialTxFrame is being written at head, other producers wait.
+} TxRing;
+
+typedef struct {
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;    // Signalled when a message is queued, a drain is requested, or on stop.
+    pthread_cond_t space_cond;   // Signalled when the writer frees ring space or completes a drain.
+    TxRing rings[SERIAL_TX_PRIORITIES];
+    unsigned long drain_requested; // Generation counters for serial_tx_drain().
+    unsigned long drain_done;
+    bool stopping;
+} SerialTxQueue;
+
+_Static_assert((SERIAL_TX_RING_SIZE & (SERIAL_TX_RING_SIZE - 1)) == 0, "SERIAL_TX_RING_SIZE must be a power of two");
+
+static SerialTxQueue *tx_queues[SERIAL_TX_MAX_PORTS]; // Written only by attach/detach, see serial_tx_attach().
+static pthread_mutex_t direct_write_mutex = PTHREAD_MUTEX_INITIALIZER; // Only for fds without a queue.
+static __thread SerialTxPriority tx_thread_priority = SERIAL_TX_CONTINUOUS;
+
+/*
+ * Name:         find_tx_queue
+ * Purpose:      Returns the transmit queue attached to fd.
+ * Arguments:    fd: the serial file descriptor.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The queue, or NULL if fd has none.
+ * Assumptions:  See serial_tx_attach().
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static SerialTxQueue *find_tx_queue(int fd) {
+    for (int i = 0; i < SERIAL_TX_MAX_PORTS; i++) {
+        if (tx_queues[i] && tx_queues[i]->fd == fd) return tx_queues[i];
+    }
+    return NULL;
+}
+
+/*
+ * Name:         write_all
+ * Purpose:      Writes an iovec array completely, resuming after partial writes.
+ * Arguments:    fd: the serial file descriptor.
+ *               iov: the pieces to write, modified as they are consumed.
+ *               iovcnt: the number of pieces.
+ *
+ * Output:       Error message to stderr on a write error.
+ * Modifies:     iov.
+ * Returns:      0 on success, -1 on error.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A non-blocking fd is waited on with poll() rather than spun on.
+ */
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        WX_TRACE2(write_start, fd, iovcnt);
+        ssize_t n = writev(fd, iov, iovcnt);
+        WX_TRACE2(write_end, fd, n);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, SERIAL_POLL_MS);
+                continue;
+            }
+            fprintf(stderr, "Serial write error: %s\n", strerror(errno));
+            return -1;
+        }
+        metrics_count(METRIC_BYTES_WRITTEN, (uint64_t)n);
+        capture_writev(fd, CAPTURE_TX, iov, iovcnt, (size_t)n); // As the device took them.
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Name:         ring_put / ring_get
+ * Purpose:      Copy bytes into / out of a transmit ring at a free running index, across the wrap.
+ */
+static void ring_put(TxRing *ring, size_t at, const void *src, size_t len) {
+    size_t start = at & (SERIAL_TX_RING_SIZE - 1);
+    size_t first = SERIAL_TX_RING_SIZE - start;
+    if (first > len) first = len;
+    memcpy(ring->data + start, src, first);
+    memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+static void ring_get(const TxRing *ring, size_t at, void *dst, size_t len) {
+    size_t start = at & (SERIAL_TX_RING_SIZE - 1);
+    size_t first = SERIAL_TX_RING_SIZE - start;
+    if (first > len) first = len;
+    memcpy(dst, ring->data + start, first);
+    memcpy((char *)dst + first, ring->data, len - first);
+}
+
+/*
+ * Name:         tx_writer_thread
+ * Purpose:      Per-port writer, moves queued messages from the rings to the serial device.
+ * Arguments:    arg: the SerialTxQueue to service.
+ *
+ * Output:       Error message to stderr on a write error.
+ * Modifies:     The queue's ring tails and drain counter.
+ * Returns:      NULL.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Bytes are written straight out of the ring with writev(): producers
+ *               only ever write beyond head, so the writer does not hold the lock
+ *               while the device accepts the data. Poll responses are sent as a
+ *               batch; continuous output one message at a time, so a reply waits
+ *               for at most one frame. tcdrain() is only called when a thread has
+ *               asked for it with serial_tx_drain().
+ */
+static void *tx_writer_thread(void *arg) {
+    SerialTxQueue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        TxRing *ring = NULL;
+        for (int p = 0; p < SERIAL_TX_PRIORITIES; p++) {
+            if (q->rings[p].head != q->rings[p].tail) {
+                ring = &q->rings[p];
+                break;
+            }
+        }
+
+        if (!ring) {
+            if (q->drain_done != q->drain_requested) {
+                unsigned long generation = q->drain_requested;
+                pthread_mutex_unlock(&q->lock);
+                int64_t drain_start = metrics_start_timer();
+                WX_TRACE1(tcdrain_start, q->fd);
+                tcdrain(q->fd);
+                WX_TRACE1(tcdrain_done, q->fd);
+                metrics_observe_since(METRIC_TCDRAIN_NS, drain_start);
+                pthread_mutex_lock(&q->lock);
+                q->drain_done = generation;
+                pthread_cond_broadcast(&q->space_cond);
+                continue;
+            }
+            if (q->stopping) break;
+            pthread_cond_wait(&q->work_cond, &q->lock);
+            WX_TRACE1(tx_wake, q->fd);
+            continue;
+        }
+
+        struct iovec iov[TX_IOV_MAX];
+        int cnt = 0;
+        size_t end = ring->tail;
+        bool batch = (ring == &q->rings[SERIAL_TX_POLL]);
+        while (end != ring->head && cnt <= TX_IOV_MAX - 2) {
+            uint32_t len;
+            ring_get(ring, end, &len, TX_HDR_LEN);
+            size_t start = (end + TX_HDR_LEN) & (SERIAL_TX_RING_SIZE - 1);
+            size_t first = SERIAL_TX_RING_SIZE - start;
+            if (first > len) first = len;
+            iov[cnt++] = (struct iovec){ ring->data + start, first };
+            if (len > first) iov[cnt++] = (struct iovec){ ring->data, len - first };
+            end += TX_HDR_LEN + len;
+            if (!batch) break;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        write_all(q->fd, iov, cnt);
+
+        pthread_mutex_lock(&q->lock);
+        ring->tail = end;
+        pthread_cond_broadcast(&q->space_cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/*
+ * Name:         serial_tx_attach
+ * Purpose:      Creates a transmit queue and writer thread for a serial port.
+ * Arguments:    fd: the serial file descriptor returned by open_serial_port().
+ *
+ * Output:       Error message to stderr on failure.
+ * Modifies:     The queue registry.
+ * Returns:      0 on success, -1 on failure (writes to fd then go direct).
+ * Assumptions:  Called before any thread writes to fd. The registry is not locked
+ *               on lookup, so attach/detach must not race with writers.
+ *
+ * Bugs:         None known.
+ * Notes:        A transport port needs no queue, its ring never blocks a writer.
+ */
+int serial_tx_attach(int fd) {
+    if (transport_find(fd)) return 0;
+
+    int slot = -1;
+    for (int i = 0; i < SERIAL_TX_MAX_PORTS; i++) {
+        if (!tx_queues[i]) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        fprintf(stderr, "Serial transmit queue: more than %d ports\n", SERIAL_TX_MAX_PORTS);
+        return -1;
+    }
+
+    SerialTxQueue *q = calloc(1, sizeof(SerialTxQueue));
+    if (!q) return -1;
+    q->fd = fd;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work_cond, NULL);
+    pthread_cond_init(&q->space_cond, NULL);
+
+    // The writer must never take a signal meant for the program's signal_thread,
+    // and attach is called before main() blocks them, so create it with all blocked.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int ret = pthread_create(&q->writer, NULL, tx_writer_thread, q);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "Serial transmit queue: pthread_create failed: %s\n", strerror(ret));
+        pthread_cond_destroy(&q->space_cond);
+        pthread_cond_destroy(&q->work_cond);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+        return -1;
+    }
+    tx_queues[slot] = q;
+    return 0;
+}
+
+/*
+ * Name:         serial_tx_detach
+ * Purpose:      Flushes and drains a port's transmit queue, then stops its writer.
+ * Arguments:    fd: the serial file descriptor.
+ *
+ * Output:       None.
+ * Modifies:     The queue registry.
+ * Returns:      None.
+ * Assumptions:  No other thread is still writing to fd.
+ *
+ * Bugs:         None known.
+ * Notes:        Does nothing if fd has no queue.
+ */
+void serial_tx_detach(int fd) {
+    for (int i = 0; i < SERIAL_TX_MAX_PORTS; i++) {
+        SerialTxQueue *q = tx_queues[i];
+        if (!q || q->fd != fd) continue;
+
+        pthread_mutex_lock(&q->lock);
+        q->stopping = true;
+        pthread_cond_broadcast(&q->work_cond);
+        pthread_cond_broadcast(&q->space_cond);
+        pthread_mutex_unlock(&q->lock);
+        pthread_join(q->writer, NULL);
+        tcdrain(fd); // Let the last frame leave the UART before the caller closes the port.
+
+        tx_queues[i] = NULL;
+        pthread_cond_destroy(&q->space_cond);
+        pthread_cond_destroy(&q->work_cond);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+    }
+}
+
+/*
+ * Name:         serial_tx_drain
+ * Purpose:      Blocks until everything queued on fd so far has been transmitted by the UART.
+ * Arguments:    fd: the serial file descriptor.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The drain-completion notification for RS-485 turnaround. Only call
+ *               it where the protocol needs the line idle before it continues (bus
+ *               hand-over, SDI-12 timing); every other caller should let the queue
+ *               run ahead.
+ */
+void serial_tx_drain(int fd) {
+    Transport *t = transport_find(fd);
+    if (t) {
+        transport_drain(t);
+        return;
+    }
+    SerialTxQueue *q = find_tx_queue(fd);
+    if (!q) {
+        int64_t drain_start = metrics_start_timer();
+        WX_TRACE1(tcdrain_start, fd);
+        tcdrain(fd);
+        WX_TRACE1(tcdrain_done, fd);
+        metrics_observe_since(METRIC_TCDRAIN_NS, drain_start);
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    unsigned long generation = ++q->drain_requested;
+    pthread_cond_signal(&q->work_cond);
+    while ((long)(q->drain_done - generation) < 0 && !q->stopping) {
+        pthread_cond_wait(&q->space_cond, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Name:         serial_tx_set_priority
+ * Purpose:      Sets the priority used for the calling thread's serial writes.
+ * Arguments:    priority: SERIAL_TX_POLL or SERIAL_TX_CONTINUOUS.
+ *
+ * Output:       None.
+ * Modifies:     Thread local priority.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        serial_reader_run() sets SERIAL_TX_POLL, so command handlers need
+ *               no changes for their replies to overtake continuous output.
+ */
+void serial_tx_set_priority(SerialTxPriority priority) {
+    if (priority < SERIAL_TX_PRIORITIES) tx_thread_priority = priority;
+}
+
+static void queue_message(int fd, const struct iovec *iov, int iovcnt, size_t total);
+
+/*
+ * Name:         faulted_writev
+ * Purpose:      Queues one message after the WX_FAULTS faults, see fault_utils.h.
+ *
+ * Returns:      None. A delayed message holds back the calling thread, as a
+ *               slow sensor would, a dropped one is not queued at all.
+ */
+static void faulted_writev(int fd, const struct iovec *iov, int iovcnt, size_t total) {
+    char faulted[FAULT_MAX_MESSAGE];
+    unsigned delay_ms = 0;
+    ssize_t len = fault_apply(fd, iov, iovcnt, total, faulted, &delay_ms);
+
+    if (delay_ms > 0) {
+        struct timespec pause = { delay_ms / 1000, (long)(delay_ms % 1000) * 1000000L };
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {}
+    }
+    if (len < 0) {
+        queue_message(fd, iov, iovcnt, total);
+    } else if (len > 0) {
+        struct iovec one = { faulted, (size_t)len };
+        queue_message(fd, &one, 1, (size_t)len);
+    }
+}
+
+/*
+ * Name:         serial_writev
+ * Purpose:      Queues one message, given as pieces, for transmission on fd.
+ * Arguments:    fd: the serial file descriptor.
+ *               iov: the pieces of the message, e.g. STX, payload, ETX, checksum.
+ *               iovcnt: the number of pieces.
+ *
+ * Output:       Error message to stderr if the message cannot be sent.
+ * Modifies:     The port's transmit queue.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The pieces are copied once into the ring, with no format parsing.
+ *               Blocks only if the ring is full, which is the back-pressure a slow
+ *               baud rate has always applied. An fd without a queue is written
+ *               directly, serialized by a mutex but without tcdrain(). A
+ *               transport port publishes the message to its clients instead.
+ *               With WX_FAULTS set the message goes through faulted_writev().
+ */
+void serial_writev(int fd, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (total == 0) return;
+    if (fault_active()) {
+        faulted_writev(fd, iov, iovcnt, total);
+        return;
+    }
+    queue_message(fd, iov, iovcnt, total);
+}
+
+/*
+ * Name:         queue_message
+ * Purpose:      Queues one message of total bytes for transmission on fd, see serial_writev().
+ *
+ * Returns:      None.
+ */
+static void queue_message(int fd, const struct iovec *iov, int iovcnt, size_t total) {
+    WX_TRACE2(frame_queued, fd, total);
+
+    Transport *t = transport_find(fd);
+    if (t) {
+        WX_TRACE2(write_start, fd, iovcnt);
+        transport_writev(t, iov, iovcnt);
+        WX_TRACE2(write_end, fd, total);
+        capture_writev(fd, CAPTURE_TX, iov, iovcnt, total);
+        return;
+    }
+
+    SerialTxQueue *q = find_tx_queue(fd);
+    if (!q) {
+        struct iovec local[iovcnt];
+        memcpy(local, iov, sizeof(struct iovec) * (size_t)iovcnt);
+        pthread_mutex_lock(&direct_write_mutex);
+        write_all(fd, local, iovcnt);
+        pthread_mutex_unlock(&direct_write_mutex);
+        metrics_count(METRIC_FRAMES_SENT, 1);
+        return;
+    }
+
+    if (total + TX_HDR_LEN > SERIAL_TX_RING_SIZE) {
+        fprintf(stderr, "Serial write error: %zu byte message exceeds the transmit queue\n", total);
+        return;
+    }
+
+    TxRing *ring = &q->rings[tx_thread_priority];
+    pthread_mutex_lock(&q->lock);
+    while ((ring->reserved || SERIAL_TX_RING_SIZE - (ring->head - ring->tail) < total + TX_HDR_LEN) && !q->stopping) {
+        pthread_cond_wait(&q->space_cond, &q->lock);
+    }
+    if (!q->stopping) {
+        uint32_t len = (uint32_t)total;
+        size_t at = ring->head;
+        ring_put(ring, at, &len, TX_HDR_LEN);
+        at += TX_HDR_LEN;
+        for (int i = 0; i < iovcnt; i++) {
+            ring_put(ring, at, iov[i].iov_base, iov[i].iov_len);
+            at += iov[i].iov_len;
+        }
+        ring->head = at;
+        pthread_cond_signal(&q->work_cond);
+    }
+    bool queued = !q->stopping;
+    pthread_mutex_unlock(&q->lock);
+    if (queued) metrics_count(METRIC_FRAMES_SENT, 1);
+}
+
+/*
+ * Name:         serial_tx_frame_begin
+ * Purpose:      Reserves room for one message in fd's transmit queue, to be filled with
+ *               serial_tx_frame_append() and released with serial_tx_frame_commit().
+ * Arguments:    frame: the frame to start.
+ *               fd: the serial file descriptor.
+ *               max_len: an upper bound on the bytes that will be appended.
+ *
+ * Output:       Error message to stderr if the message cannot be sent.
+ * Modifies:     frame, the port's transmit queue.
+ * Returns:      0 on success, -1 if max_len can never fit or the queue is stopping.
+ *               frame is inactive on failure, appends and commit are then no-ops.
+ * Assumptions:  The caller commits every frame it begins, from the same thread.
+ *
+ * Bugs:         None known.
+ * Notes:        Waits for space like serial_writev(). Until the commit the writer does
+ *               not see the message, and other writes of the same priority wait
+ *               behind it, so the frame is never interleaved. Poll replies use the
+ *               other ring and are not held up while a continuous frame is built.
+ *               An fd without a queue holds the direct write lock until the commit.
+ *               With WX_FAULTS set the frame is gathered in memory instead and
+ *               sent by the commit, like serial_writev().
+ */
+int serial_tx_frame_begin(SerialTxFrame *frame, int fd, size_t max_len) {
+    memset(frame, 0, sizeof(SerialTxFrame));
+    frame->fd = fd;
+
+    if (fault_active() && max_len <= FAULT_MAX_MESSAGE && (frame->fault_buf = malloc(max_len ? max_len : 1))) {
+        frame->limit = max_len; // Faulted whole at the commit.
+        frame->active = true;
+        return 0;
+    }
+
+    Transport *t = transport_find(fd);
+    if (t) {
+        transport_frame_begin(t);
+        frame->transport = t;
+        frame->active = true;
+        return 0;
+    }
+
+    SerialTxQueue *q = find_tx_queue(fd);
+    if (!q) {
+        pthread_mutex_lock(&direct_write_mutex);
+        frame->active = true;
+        return 0;
+    }
+
+    if (max_len + TX_HDR_LEN > SERIAL_TX_RING_SIZE) {
+        fprintf(stderr, "Serial write error: %zu byte message exceeds the transmit queue\n", max_len);
+        return -1;
+    }
+
+    TxRing *ring = &q->rings[tx_thread_priority];
+    pthread_mutex_lock(&q->lock);
+    while ((ring->reserved || SERIAL_TX_RING_SIZE - (ring->head - ring->tail) < max_len + TX_HDR_LEN) && !q->stopping) {
+        pthread_cond_wait(&q->space_cond, &q->lock);
+    }
+    if (!q->stopping) {
+        ring->reserved = true;
+        frame->queue = q;
+        frame->ring = ring;
+        frame->start = ring->head;
+        frame->at = ring->head + TX_HDR_LEN;
+        frame->limit = frame->at + max_len;
+        frame->active = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return frame->active ? 0 : -1;
+}
+
+/*
+ * Name:         serial_tx_frame_append
+ * Purpose:      Adds the next piece of a message started with serial_tx_frame_begin().
+ * Arguments:    frame: the frame being built.
+ *               buf: the bytes to add.
+ *               len: the number of bytes.
+ *
+ * Output:       Error message to stderr if the reservation is exceeded.
+ * Modifies:     frame, the reserved ring space.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Copies into the ring without taking the queue lock, the reserved
+ *               space belongs to this frame until it is committed. Bytes beyond
+ *               max_len are dropped.
+ */
+void serial_tx_frame_append(SerialTxFrame *frame, const void *buf, size_t len) {
+    if (!frame->active || len == 0) return;
+
+    if (frame->fault_buf) {
+        if (len > frame->limit - frame->at) {
+            fprintf(stderr, "Serial write error: frame exceeds its reserved length\n");
+            len = frame->limit - frame->at;
+        }
+        memcpy(frame->fault_buf + frame->at, buf, len);
+        frame->at += len;
+        return;
+    }
+    if (frame->transport) {
+        transport_frame_append(frame->transport, buf, len);
+        capture_bytes(frame->fd, CAPTURE_TX, buf, len);
+        return;
+    }
+    if (!frame->queue) {
+        struct iovec iov = { (void *)buf, len };
+        write_all(frame->fd, &iov, 1);
+        return;
+    }
+
+    if (len > frame->limit - frame->at) {
+        fprintf(stderr, "Serial write error: frame exceeds its reserved length\n");
+        len = frame->limit - frame->at;
+    }
+    ring_put(frame->ring, frame->at, buf, len);
+    frame->at += len;
+}
+
+/*
+ * Name:         serial_tx_frame_commit
+ * Purpose:      Releases a message built with serial_tx_frame_append() to the writer.
+ * Arguments:    frame: the frame to commit.
+ *
+ * Output:       None.
+ * Modifies:     frame, the port's transmit queue.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The message is queued at the length actually appended, which may be
+ *               less than the reservation. An empty frame queues nothing.
+ */
+void serial_tx_frame_commit(SerialTxFrame *frame) {
+    if (!frame->active) return;
+    frame->active = false;
+
+    if (frame->fault_buf) {
+        if (frame->at > 0) {
+            struct iovec iov = { frame->fault_buf, frame->at };
+            faulted_writev(frame->fd, &iov, 1, frame->at);
+        }
+        free(frame->fault_buf);
+        frame->fault_buf = NULL;
+        return;
+    }
+    if (frame->transport) {
+        transport_frame_commit(frame->transport);
+        WX_TRACE2(frame_queued, frame->fd, 0);
+        return;
+    }
+    if (!frame->queue) {
+        WX_TRACE2(frame_queued, frame->fd, 0);
+        pthread_mutex_unlock(&direct_write_mutex);
+        metrics_count(METRIC_FRAMES_SENT, 1);
+        return;
+    }
+
+    SerialTxQueue *q = frame->queue;
+    TxRing *ring = frame->ring;
+    uint32_t len = (uint32_t)(frame->at - frame->start - TX_HDR_LEN);
+    WX_TRACE2(frame_queued, frame->fd, len);
+    pthread_mutex_lock(&q->lock);
+    if (len > 0) {
+        ring_put(ring, frame->start, &len, TX_HDR_LEN);
+        ring->head = frame->at;
+        pthread_cond_signal(&q->work_cond);
+    }
+    ring->reserved = false;
+    pthread_cond_broadcast(&q->space_cond);
+    pthread_mutex_unlock(&q->lock);
+    if (len > 0) metrics_count(METRIC_FRAMES_SENT, 1);
+}
+
+/*
+ * Name:         serial_write_buf
+ * Purpose:      Queues a pre-built buffer for transmission on fd.
+ * Arguments:    fd: the serial file descriptor.
+ *               buf: the bytes to send.
+ *               len: the number of bytes.
+ *
+ * Output:       See serial_writev().
+ * Modifies:     See serial_writev().
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+void serial_write_buf(int fd, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    serial_writev(fd, &iov, 1);
+}
 
 /*
  * Name:         safe_serial_write
- * Purpose:      Serializes writes to the serial device to ensure that all writes do not
- *               interleave and create errors.
+ * Purpose:      Formats a message and queues it for transmission, so that writes from
+ *               different threads never interleave.
  * Arguments:    fmt -  the string representing the format you want the the function to print.
  *               ... - a list of potential unfixed arguments, that can be supplied to the format string.
  *               i.e. if you supplied safe_write_response("%s%c%d", string_var, char_var, decimal_var); it would
- *               use vdprintf to print those variables in the format specified by fmt.
+ *               use vsnprintf to format those variables in the format specified by fmt.
  *
- * Output:       Error message, if the file is not open.
- * Modifies:     None.
+ * Output:       Error message, if the message cannot be formatted.
+ * Modifies:     The port's transmit queue.
  * Returns:      None.
- * Assumptions:  The file is open, and the line read is less than MAX_LINE_LENGTH
+ * Assumptions:  None.
  *
  * Bugs:         None known.
- * Notes:        va_start is a C macro that initializes a variable argument list, which
- *               is a list of arguments passed to a function that can have a variable
- * 		 		 number of parameters. It must be called before any other variable argument
- * 		 		 macros, such as va_arg, and requires two arguments: the va_list variable and
- *  		 	 the name of the last fixed argument in the function's parameter list in our case fmt.
+ * Notes:        Returns once the message is queued rather than after tcdrain(), and
+ *               no longer shares one mutex between every port in the process.
+ *               Output that does not fit the stack buffer is formatted in the
+ *               thread's scratch arena, see arena_utils.h.
  */
 void safe_serial_write(int fd, const char *fmt, ...) {
+    char stack_buf[TX_FORMAT_BUF];
     va_list args;
-    pthread_mutex_lock(&serial_write_mutex);
     va_start(args, fmt);
-    int result = vdprintf(fd, fmt, args);
+    int len = vsnprintf(stack_buf, sizeof(stack_buf), fmt, args);
     va_end(args);
 
-	if (result >= 0) {
-        tcdrain(fd);  // Wait for output to be transmitted
+    if (len < 0) {
+        fprintf(stderr, "Serial write error: %s\n", strerror(errno));
+        return;
+    }
+    if ((size_t)len < sizeof(stack_buf)) {
+        WX_TRACE3(frame_formatted, fd, &stack_buf[0], len);
+        serial_write_buf(fd, stack_buf, (size_t)len);
+        return;
     }
 
-    pthread_mutex_unlock(&serial_write_mutex);
-
-    if (result < 0) {
+    // Longer output goes in the thread's scratch arena, the heap only if that is full.
+    Arena *scratch = arena_scratch();
+    size_t mark = scratch ? arena_mark(scratch) : 0;
+    char *big_buf = scratch ? arena_alloc(scratch, (size_t)len + 1, 1) : NULL;
+    bool on_heap = false;
+    if (!big_buf) {
+        big_buf = malloc((size_t)len + 1);
+        on_heap = true;
+    }
+    if (!big_buf) {
         fprintf(stderr, "Serial write error: %s\n", strerror(errno));
+        return;
     }
+    va_start(args, fmt);
+    vsnprintf(big_buf, (size_t)len + 1, fmt, args);
+    va_end(args);
+    WX_TRACE3(frame_formatted, fd, big_buf, len);
+    serial_write_buf(fd, big_buf, (size_t)len);
+    if (on_heap) free(big_buf);
+    else arena_rewind(scratch, mark);
+}
+
+/*
+ * Name:         close_serial_port
+ * Purpose:      Flushes a port's transmit queue and closes it.
+ * Arguments:    fd: the serial file descriptor returned by open_serial_port().
+ *
+ * Output:       None.
+ * Modifies:     Closes fd.
+ * Returns:      None.
+ * Assumptions:  The receiver and sender threads have been joined.
+ *
+ * Bugs:         None known.
+ * Notes:        A transport port is stopped and closed by transport_close().
+ */
+void close_serial_port(int fd) {
+    if (fd < 0) return;
+    serial_tx_detach(fd);
+    if (transport_close(fd)) return;
+    close(fd);
 }
 
 /*
  * Name:         serial_utils_cleanup
- * Purpose:      Cleans up the serial_write_mutex, by callinf mutex_destroy.
+ * Purpose:      Stops any transmit queue or transport still open and destroys the direct write mutex.
  * Arguments:    None.
  *
  * Output:       None.
- * Modifies:     Destroys serial_write_mutex.
+ * Modifies:     The queue and transport registries, destroys direct_write_mutex.
  * Returns:      None.
- * Assumptions:  serial_write_mutex exists.
+ * Assumptions:  No thread is still writing to a serial port.
  *
  * Bugs:         None known.
  * Notes:
  */
 void serial_utils_cleanup(void) {
-    pthread_mutex_destroy(&serial_write_mutex);
+    for (int i = 0; i < SERIAL_TX_MAX_PORTS; i++) {
+        if (tx_queues[i]) serial_tx_detach(tx_queues[i]->fd);
+    }
+    transport_cleanup();
+    fault_stop();
+    pthread_mutex_destroy(&direct_write_mutex);
 }
 
 /*
@@ -158,12 +854,16 @@ speed_t get_baud_rate(const char *baud_rate) {
  *               characters other than white space, and points to an FD.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        /dev/pts/N is accepted as well, so an emulator can run on one side of a
+ *               pseudo-terminal pair (socat, bench). So are the transport names,
+ *               tcp://, rfc2217:// and pty, see transport_utils.h.
  */
 int is_valid_tty(const char *str) {
     regex_t regex;
     int reti;
-    const char *pattern = "^/dev/tty(S|USB|ACM)[0-9]+$";
+    const char *pattern = "^/dev/(tty(S|USB|ACM)|pts/)[0-9]+$";
+
+    if (transport_kind(str) != TRANSPORT_TTY) return 0;
 
     // Compile the regular expression
     reti = regcomp(&regex, pattern, REG_EXTENDED);
@@ -236,15 +936,29 @@ SerialMode get_mode(const char *mode) {
  * Assumptions:  None.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The standard asks for at least 12 ms of break and then 8.33 ms of marking.
+ *               tcsendbreak() holds the line for 250 ms or more on Linux, so the break is
+ *               raised and dropped with TIOCSBRK/TIOCCBRK around an absolute sleep, which
+ *               does not stretch by the time taken to wake as two usleep()s did.
  */
 void sdi12_wake_sensor(int fd) {
-    // Send a break signal.
-    tcsendbreak(fd, 0);
-    // The SDI-12 standard requires at least 12ms of break
-    // followed by an 8.3ms "marking" (idle) period.
-    usleep(12000); // 12ms
-    usleep(8300);  // 8.3ms
+    const long break_ns = 12500000L;  // 12 ms, and a margin for the UART.
+    const long marking_ns = 8330000L; // 8.33 ms before the first character of the command.
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if (ioctl(fd, TIOCSBRK) < 0) {
+        tcsendbreak(fd, 0); // Not a UART, a pty or socket cannot hold a break.
+        return;
+    }
+    t.tv_nsec += break_ns;
+    if (t.tv_nsec >= 1000000000L) { t.tv_sec++; t.tv_nsec -= 1000000000L; }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {}
+    ioctl(fd, TIOCCBRK);
+
+    t.tv_nsec += marking_ns;
+    if (t.tv_nsec >= 1000000000L) { t.tv_sec++; t.tv_nsec -= 1000000000L; }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {}
 }
 
 
@@ -262,9 +976,18 @@ void sdi12_wake_sensor(int fd) {
  *               characters other than white space, and points to an FD.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        A tcp://, rfc2217:// or pty name opens a transport instead, see
+ *               transport_open(). The port is named to --capture by portname.
+ *               The first call reads WX_FAULTS, see fault_utils.h.
  */
 int open_serial_port(const char* portname, speed_t baud_rate, SerialMode mode) {
+    fault_init(); // Once, before the emulator starts its threads.
+
+    if (transport_kind(portname) != TRANSPORT_TTY) {
+        int fd = transport_open(portname, baud_rate, mode);
+        if (fd >= 0) capture_port(fd, portname);
+        return fd;
+    }
 
     int fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
     if (fd < 0) {
@@ -320,16 +1043,17 @@ int open_serial_port(const char* portname, speed_t baud_rate, SerialMode mode) {
     	// For SDI-12, do NOT ignore breaks
     	// the driver must respect the timing of the bus.
     	tty.c_iflag &= ~IGNBRK;
-		tty.c_iflag |= BRKINT;   // Turn the break into an interrupt/event
-		tty.c_iflag |= PARMRK;   // Mark parity errors and breaks in the input stream
+		tty.c_iflag |= PARMRK;   // Mark parity errors and breaks in the input stream, as \377 \0 X and \377 \0 \0
+		tty.c_iflag |= INPCK;    // Check parity, so errors are marked at all
+		// BRKINT stays clear: with it set the tty flushes its queues on a break instead of marking it.
 	} else {
     	// For RS-485/422, ignoring breaks is safer
     	tty.c_iflag |= IGNBRK;
 	}
 
-    // Non-blocking read with timeout
+    // read() returns whatever is buffered immediately, waiting is done in poll() by serial_reader_poll().
     tty.c_cc[VMIN]  = 0;
-    tty.c_cc[VTIME] = 1;
+    tty.c_cc[VTIME] = 0;
 
 	if (tcsetattr(fd, TCSANOW, &tty) != 0) {
         perror("Error from tcsetattr\n");
@@ -337,6 +1061,15 @@ int open_serial_port(const char* portname, speed_t baud_rate, SerialMode mode) {
         return -1;
     }
 
+	if (mode == SERIAL_SDI12) {
+		// The 15 ms reply window leaves no room for a USB adaptor's 16 ms receive latency timer.
+		struct serial_struct ss;
+		if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+			ss.flags |= ASYNC_LOW_LATENCY;
+			ioctl(fd, TIOCSSERIAL, &ss); // Not every driver takes it, the engine reports late replies.
+		}
+	}
+
 #ifdef TIOCSRS485
     if (mode == SERIAL_RS485) {
         struct serial_rs485 rs485conf;
@@ -370,5 +1103,220 @@ int open_serial_port(const char* portname, speed_t baud_rate, SerialMode mode) {
         				mode_str,
         				(mode == SERIAL_SDI12) ? "7E1 @ 1200 baud" : "8N1");
     // printf("Opened %s (%s, 8N1 @ baud)\n", portname, (mode == SERIAL_RS485) ? "RS-485" : "RS-422");
+    capture_port(fd, portname);
     return fd;
 }
+
+#define RING_MASK (SERIAL_RX_RING_SIZE - 1)
+
+_Static_assert((SERIAL_RX_RING_SIZE & RING_MASK) == 0, "SERIAL_RX_RING_SIZE must be a power of two");
+_Static_assert(SERIAL_LINE_MAX < SERIAL_RX_RING_SIZE, "a full line must fit in the receive ring");
+
+/*
+ * Name:         serial_reader_init
+ * Purpose:      Prepares a line reader for a serial file descriptor.
+ * Arguments:    reader: the reader to initialize.
+ *               fd: the serial device to read from.
+ *               handler: called once per complete CR/LF terminated line.
+ *               ctx: passed through to handler, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     reader.
+ * Returns:      None.
+ * Assumptions:  fd was opened by open_serial_port().
+ *
+ * Bugs:         None known.
+ * Notes:        flush_on_idle is off by default, set it after init for protocols
+ *               that do not terminate their commands (ice).
+ */
+void serial_reader_init(SerialLineReader *reader, int fd, serial_line_handler handler, void *ctx) {
+    memset(reader, 0, sizeof(SerialLineReader));
+    reader->fd = fd;
+    reader->handler = handler;
+    reader->ctx = ctx;
+}
+
+/*
+ * Name:         emit_line
+ * Purpose:      Copies ring bytes [tail, end) into the contiguous line buffer and calls the handler.
+ * Arguments:    reader: the reader.
+ *               end: free running index one past the last byte of the line.
+ *
+ * Output:       None.
+ * Modifies:     reader->line.
+ * Returns:      None.
+ * Assumptions:  end - tail < SERIAL_LINE_MAX.
+ *
+ * Bugs:         None known.
+ * Notes:        At most two memcpy() calls, one either side of the ring wrap.
+ */
+static void emit_line(SerialLineReader *reader, size_t end) {
+    size_t len = end - reader->tail;
+    size_t start = reader->tail & RING_MASK;
+    size_t first = SERIAL_RX_RING_SIZE - start;
+    if (first > len) first = len;
+
+    memcpy(reader->line, reader->ring + start, first);
+    memcpy(reader->line + first, reader->ring, len - first);
+    reader->line[len] = '\0';
+    metrics_count(METRIC_LINES_RECEIVED, 1);
+    WX_TRACE3(line_received, reader->fd, &reader->line[0], len);
+    reader->handler(reader->line, reader->ctx);
+}
+
+/*
+ * Name:         assemble_lines
+ * Purpose:      Scans newly received bytes for CR/LF and hands each complete line to the handler.
+ * Arguments:    reader: the reader.
+ *
+ * Output:       None.
+ * Modifies:     reader->tail, reader->scan, reader->discarding.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Empty lines (the LF of a CR/LF pair) are skipped. A line longer than
+ *               SERIAL_LINE_MAX - 1 is dropped whole, rather than passing its tail on
+ *               as if it were a command in its own right. That holds whether it ends
+ *               inside the read that brought it, the ring holds up to
+ *               SERIAL_RX_RING_SIZE bytes between scans, or in a later one.
+ */
+static void assemble_lines(SerialLineReader *reader) {
+    while (reader->scan != reader->head) {
+        char c = reader->ring[reader->scan & RING_MASK];
+        if (c == '\r' || c == '\n') {
+            size_t len = reader->scan - reader->tail;
+            if (reader->discarding) {
+                reader->discarding = false;
+            } else if (len >= SERIAL_LINE_MAX) {
+                metrics_count(METRIC_LINES_DISCARDED, 1); // Arrived whole in one read, too long for line.
+            } else if (len > 0) {
+                emit_line(reader, reader->scan);
+            }
+            reader->tail = reader->scan + 1;
+        }
+        reader->scan++;
+    }
+
+    if (reader->head - reader->tail >= SERIAL_LINE_MAX) {
+        reader->tail = reader->head; // Over-long line, drop what we have and the rest up to its terminator.
+        reader->discarding = true;
+        metrics_count(METRIC_LINES_DISCARDED, 1);
+    }
+}
+
+/*
+ * Name:         serial_reader_drain
+ * Purpose:      Reads everything currently buffered by the driver and dispatches complete lines.
+ * Arguments:    reader: the reader.
+ *
+ * Output:       None.
+ * Modifies:     reader.
+ * Returns:      Number of bytes read, or -1 on a read error with errno set.
+ * Assumptions:  fd is non-blocking, or configured VMIN=0/VTIME=0 by open_serial_port().
+ *
+ * Bugs:         None known.
+ * Notes:        Uses readv() so a read that straddles the end of the ring is still a
+ *               single system call. Callable directly from an epoll loop.
+ */
+long serial_reader_drain(SerialLineReader *reader) {
+    long total = 0;
+
+    for (;;) {
+        size_t free_bytes = SERIAL_RX_RING_SIZE - (reader->head - reader->tail);
+        size_t start = reader->head & RING_MASK;
+        size_t first = SERIAL_RX_RING_SIZE - start;
+        if (first > free_bytes) first = free_bytes;
+
+        struct iovec iov[2] = {
+            { reader->ring + start, first },
+            { reader->ring, free_bytes - first },
+        };
+        ssize_t n = readv(reader->fd, iov, iov[1].iov_len ? 2 : 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (n == 0) break; // Nothing buffered.
+
+        capture_writev(reader->fd, CAPTURE_RX, iov, 2, (size_t)n);
+        reader->head += (size_t)n;
+        total += n;
+        assemble_lines(reader);
+
+        if ((size_t)n < free_bytes) break; // Short read, the driver buffer is empty.
+    }
+    return total;
+}
+
+/*
+ * Name:         serial_reader_poll
+ * Purpose:      Waits up to timeout_ms for input, then drains it.
+ * Arguments:    reader: the reader.
+ *               timeout_ms: poll() timeout in milliseconds, -1 waits forever.
+ *
+ * Output:       None.
+ * Modifies:     reader.
+ * Returns:      Bytes read, 0 on timeout, -1 on error with errno set.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        On a timeout with flush_on_idle set, a pending unterminated line is
+ *               dispatched. This is the behaviour VTIME=1 gave the ice receiver.
+ */
+int serial_reader_poll(SerialLineReader *reader, int timeout_ms) {
+    struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout_ms);
+
+    if (ready < 0) return (errno == EINTR) ? 0 : -1;
+
+    if (ready == 0) {
+        if (reader->flush_on_idle && !reader->discarding && reader->head != reader->tail) {
+            emit_line(reader, reader->head);
+            reader->tail = reader->scan = reader->head;
+        }
+        return 0;
+    }
+
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        errno = EIO;
+        return -1;
+    }
+
+    long n = serial_reader_drain(reader);
+    if (n == 0 && (pfd.revents & POLLHUP)) {
+        errno = EPIPE;
+        return -1;
+    }
+    return (int)n;
+}
+
+/*
+ * Name:         serial_reader_run
+ * Purpose:      Receiver thread body: polls the serial fd and dispatches lines until *stop is set.
+ * Arguments:    reader: an initialized reader.
+ *               stop: the program's terminate flag.
+ *
+ * Output:       Error message to stderr on a read error.
+ * Modifies:     reader.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Replaces the per-byte read()/usleep() loops. The thread sleeps in
+ *               poll() and wakes as soon as the first byte of a command arrives.
+ *               After an error it backs off for one poll interval, so an unplugged
+ *               adaptor does not spin a core. Replies written by the handler are
+ *               queued at SERIAL_TX_POLL priority.
+ */
+void serial_reader_run(SerialLineReader *reader, volatile sig_atomic_t *stop) {
+    serial_tx_set_priority(SERIAL_TX_POLL); // Everything sent from here on is a reply to a command.
+    while (!*stop) {
+        if (serial_reader_poll(reader, SERIAL_POLL_MS) < 0) {
+            fprintf(stderr, "Serial read error: %s\n", strerror(errno));
+            struct timespec backoff = { 0, SERIAL_POLL_MS * 1000000L };
+            nanosleep(&backoff, NULL);
+        }
+    }
+}
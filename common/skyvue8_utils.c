@@ -11,8 +11,37 @@
 #include <math.h>
 #include <ctype.h>
 #include "crc_utils.h"
+#include "replay_utils.h"
 #include "skyvue8_utils.h"
 
+#define FEET_TO_METRES 0.3048
+#define BOUNDARY_LAYER_M 340.0		// e-folding height of the boundary layer aerosol.
+#define CLEAR_AIR_BS 8300.0			// Backscatter at the window through a clean window.
+#define CLOUD_PEAK_BS 60000.0		// Backscatter at a cloud base.
+#define CLOUD_DEPTH_M 25.0			// Spread of the return around the cloud base.
+#define CLOUD_EXTINCTION_M 60.0		// Two-way e-folding depth of the signal inside cloud.
+#define NOISE_SPAN 97				// Detector noise, uniform in +/- NOISE_SPAN / 2.
+#define BIN_MAX 0x7FFFF				// Largest value 5 hex characters of two's complement hold.
+#define BIN_MIN (-0x80000)
+
+static const Skyvue8Layout layout_table[] = {
+	{ MSG_001,    0,  5, false, false },
+	{ MSG_002, 2048,  5, false, false },
+	{ MSG_003,    0,  5, true,  false },
+	{ MSG_004, 2048,  5, true,  false },
+	{ MSG_101,  770, 10, false, true },
+	{ MSG_102,  385, 20, false, true },
+	{ MSG_103, 1500,  5, false, true },
+	{ MSG_104,  770,  5, false, true },
+	{ MSG_105,    0,  0, false, true },
+	{ MSG_106, 2048,  5, false, true }
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Coverage given to the reported cloud layers, lowest first, see skyvue8_format_sky_condition().
+static const uint8_t layer_oktas[] = { 7, 5, 3, 1 };
+
 
 /*
  * Name:         init_skyvue8_sensor
@@ -49,7 +78,8 @@ int init_skyvue8_sensor(skyvue8_sensor **ptr) {
 	s->initialized = true;
 	s->measurement_period = 0; 		// 2-600, or 0 equals polled.
 	s->message_interval = 0; 		// 2-600, or 0 equals polled.
-	clock_gettime(CLOCK_MONOTONIC, &s->last_send_time);
+	s->message_id = MSG_004;		// Factory default message.
+	replay_clock_now(&s->last_send_time);
 	time_t now = time(NULL);
 	strftime(s->date_string, sizeof(s->date_string), "%Y/%m/%d", gmtime(&now));
 	strftime(s->time_string, sizeof(s->time_string), "%H:%M:%S", gmtime(&now));
@@ -71,16 +101,275 @@ int init_skyvue8_sensor(skyvue8_sensor **ptr) {
  *
  * Bugs:         None known.
  * Notes:        Uses CLOCK_MONOTONIC to ensure timing remains consistent even
- * 				 if the system real-time clock is adjusted.
+ * 				 if the system real-time clock is adjusted, read through
+ * 				 replay_clock_now() so --speed shortens the interval.
  */
 bool skyvue8_is_ready_to_send(skyvue8_sensor *sensor) {
     if (!sensor || sensor->mode != SMODE_RUN) return false;
 
     struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    replay_clock_now(&now);
 
     long seconds = now.tv_sec - sensor->last_send_time.tv_sec;
     if (seconds >= (long)sensor->message_interval) return true;
 
     return false;
 }
+
+
+/*
+ * Name:         skyvue8_layout
+ * Purpose:      Looks up the shape of an output message.
+ * Arguments:    message_id - the message number, e.g. MSG_004.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The layout, or NULL for a message that is not implemented.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        CL31 message 1 subclasses 101-106 only, message 2 and the CT25K
+ *               messages are not implemented.
+ */
+const Skyvue8Layout *skyvue8_layout(uint8_t message_id) {
+	for (size_t i = 0; i < sizeof(layout_table) / sizeof(layout_table[0]); i++) {
+		if (layout_table[i].message_id == message_id) return &layout_table[i];
+	}
+	return NULL;
+}
+
+/*
+ * Name:         height_in_metres
+ * Purpose:      Converts a reported cloud height field to metres.
+ * Arguments:    height - the five character height field, "/////" when not reported.
+ *               metres - true if the sensor reports in metres, false for feet.
+ *
+ * Returns:      The height in metres, 0 if the field holds no height.
+ */
+static double height_in_metres(const char *height, bool metres) {
+	if (!isdigit((unsigned char)height[0])) return 0.0;
+	double h = atof(height);
+	return metres ? h : h * FEET_TO_METRES;
+}
+
+/*
+ * Name:         skyvue8_profile_begin
+ * Purpose:      Starts a backscatter profile for a data record.
+ * Arguments:    gen - the generator to initialize.
+ *               msg - the record the profile belongs to.
+ *               layout - the message layout, gives the bin count and resolution.
+ *
+ * Output:       None.
+ * Modifies:     gen.
+ * Returns:      None.
+ * Assumptions:  layout->bins <= SKYVUE8_MAX_BINS.
+ *
+ * Bugs:         None known.
+ * Notes:        The data files carry cloud heights but no profile, so one is modelled:
+ *               boundary layer aerosol decaying with height, scaled by the window
+ *               transmission, a return at the first cloud base with the signal
+ *               extinguished above it, and detector noise. The noise is seeded from
+ *               the record, so the same record always gives the same profile.
+ */
+void skyvue8_profile_begin(Skyvue8ProfileGen *gen, const ParsedMessage *msg, const Skyvue8Layout *layout) {
+	memset(gen, 0, sizeof(Skyvue8ProfileGen));
+	gen->bins = layout->bins;
+	gen->resolution_m = layout->resolution_m;
+
+	double window = msg->win_trans_per / 100.0;
+	gen->aerosol = CLEAR_AIR_BS * window;
+	gen->aerosol_decay = exp(-(double)layout->resolution_m / BOUNDARY_LAYER_M);
+	gen->attenuation = 1.0;
+	gen->cloud_m = height_in_metres(msg->first_height, (msg->most_sig_alarm & 0x8000) != 0);
+	gen->cloud_peak = CLOUD_PEAK_BS * window;
+
+	Crc16Context seed;
+	crc16_init(&seed, CRC16_XMODEM);
+	crc16_update(&seed, msg->first_height, strlen(msg->first_height));
+	crc16_update(&seed, msg->second_height, strlen(msg->second_height));
+	gen->noise = 0x9E3779B9u ^ ((uint32_t)crc16_final(&seed) << 8) ^ msg->win_trans_per;
+}
+
+/*
+ * Name:         skyvue8_profile_next
+ * Purpose:      Generates the next bin of a profile.
+ * Arguments:    gen - a generator started with skyvue8_profile_begin().
+ *
+ * Output:       None.
+ * Modifies:     gen.
+ * Returns:      The backscatter in units of 10^-8 sr^-1 m^-1, clamped to 20 bits.
+ * Assumptions:  gen->next_bin < gen->bins.
+ *
+ * Bugs:         None known.
+ * Notes:        The aerosol and attenuation terms are updated by a multiply per bin,
+ *               exp() is only evaluated within a few cloud depths of the base.
+ */
+int32_t skyvue8_profile_next(Skyvue8ProfileGen *gen) {
+	double height = (double)gen->next_bin * gen->resolution_m;
+	double value = gen->aerosol * gen->attenuation;
+
+	if (gen->cloud_m > 0.0) {
+		double offset = height - gen->cloud_m;
+		if (offset > -4.0 * CLOUD_DEPTH_M && offset < 4.0 * CLOUD_DEPTH_M) {
+			value += gen->cloud_peak * gen->attenuation * exp(-(offset * offset) / (2.0 * CLOUD_DEPTH_M * CLOUD_DEPTH_M));
+		}
+		if (offset > 0.0) gen->attenuation *= exp(-(double)gen->resolution_m / CLOUD_EXTINCTION_M);
+	}
+	gen->aerosol *= gen->aerosol_decay;
+
+	gen->noise ^= gen->noise << 13;
+	gen->noise ^= gen->noise >> 17;
+	gen->noise ^= gen->noise << 5;
+	int32_t bin = (int32_t)value + (int32_t)(gen->noise % NOISE_SPAN) - NOISE_SPAN / 2;
+
+	gen->next_bin++;
+	if (bin > BIN_MAX) return BIN_MAX;
+	if (bin < BIN_MIN) return BIN_MIN;
+	return bin;
+}
+
+/*
+ * Name:         skyvue8_profile_encode
+ * Purpose:      Generates the next bins of a profile as hex text.
+ * Arguments:    gen - a generator started with skyvue8_profile_begin().
+ *               out - receives SKYVUE8_BIN_CHARS characters per bin, not NULL terminated.
+ *               max_bins - the most bins to generate.
+ *
+ * Output:       None.
+ * Modifies:     gen, out.
+ * Returns:      The number of characters written, 0 once the profile is complete.
+ * Assumptions:  out holds max_bins * SKYVUE8_BIN_CHARS characters.
+ *
+ * Bugs:         None known.
+ * Notes:        Each bin is 5 lowercase hex digits of two's complement, as in
+ *               data_files/ceilometer/skyvue8_test_data2.txt. Called repeatedly so a
+ *               caller can stream a 10,240 character profile through a small buffer.
+ */
+size_t skyvue8_profile_encode(Skyvue8ProfileGen *gen, char *out, size_t max_bins) {
+	size_t n = 0;
+	while (n < max_bins && gen->next_bin < gen->bins) {
+		uint32_t v = (uint32_t)skyvue8_profile_next(gen) & 0xFFFFF;
+		out[0] = hex_digits[(v >> 16) & 0xF];
+		out[1] = hex_digits[(v >> 12) & 0xF];
+		out[2] = hex_digits[(v >> 8) & 0xF];
+		out[3] = hex_digits[(v >> 4) & 0xF];
+		out[4] = hex_digits[v & 0xF];
+		out += SKYVUE8_BIN_CHARS;
+		n++;
+	}
+	return n * SKYVUE8_BIN_CHARS;
+}
+
+/*
+ * Name:         skyvue8_profile_sum
+ * Purpose:      Returns the sum of backscatter for the profile header line.
+ * Arguments:    gen - a generator that has not produced any bins yet.
+ *
+ * Output:       None.
+ * Modifies:     None, a copy of gen is run.
+ * Returns:      The integrated backscatter in units of 10^-4 sr^-1, at most 999.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The header precedes the profile, so this costs one extra generation
+ *               pass without encoding, still well under a millisecond for 2048 bins.
+ */
+unsigned int skyvue8_profile_sum(const Skyvue8ProfileGen *gen) {
+	Skyvue8ProfileGen probe = *gen;
+	double sum = 0.0;
+	while (probe.next_bin < probe.bins) {
+		int32_t v = skyvue8_profile_next(&probe);
+		if (v > 0) sum += v;
+	}
+	sum = sum * gen->resolution_m / 10000.0;
+	return sum > 999.0 ? 999 : (unsigned int)sum;
+}
+
+/*
+ * Name:         skyvue8_format_sky_condition
+ * Purpose:      Formats the sky condition line of messages 003 and 004.
+ * Arguments:    msg - the data record.
+ *               buf - receives the line, without CR/LF.
+ *               buf_len - the size of buf.
+ *
+ * Output:       None.
+ * Modifies:     buf.
+ * Returns:      The length of the line, or -1 if it does not fit.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Five "okta height" pairs. The data files have no coverage, so each
+ *               reported cloud base becomes a layer with a fixed coverage that falls
+ *               with height. Full obscuration (detection status 5) is reported as an
+ *               okta of 9 at the vertical visibility. Unused layers are "0 /////".
+ */
+int skyvue8_format_sky_condition(const ParsedMessage *msg, char *buf, size_t buf_len) {
+	const char *heights[] = { msg->first_height, msg->second_height, msg->third_height, msg->fourth_height };
+	size_t len = 0;
+
+	for (int i = 0; i < SKYVUE8_SKY_LAYERS; i++) {
+		int okta = 0;
+		const char *height = "/////";
+		if (i < 4 && isdigit((unsigned char)heights[i][0])) {
+			okta = (msg->detection_status == '5' && i == 0) ? 9 : layer_oktas[i];
+			height = heights[i];
+		}
+		int n = snprintf(buf + len, buf_len - len, "%s%d %s", i ? " " : "", okta, height);
+		if (n < 0 || (size_t)n >= buf_len - len) return -1;
+		len += (size_t)n;
+	}
+	return (int)len;
+}
+
+/*
+ * Name:         skyvue8_parse_message
+ * Purpose:      Tokenizes a space-delimited sensor string and populates a ParsedMessage struct.
+ * Arguments:    msg: the raw input string to be parsed (modified by strtok_r).
+ * 				 p_message: pointer to the struct where parsed data will be stored.
+ *
+ * Output:       None (internal debug prints to console only).
+ * Modifies:     p_message: overwrites with new data.
+ * 				 msg: the input string is modified (nulls inserted by strtok_r).
+ * Returns:      None
+ * Assumptions:  msg is a valid space-delimited string matching the sensor protocol.
+ *               p_message has been allocated by the caller.
+ *
+ * Bugs:         None known.
+ * Notes:        Uses a local macro NEXT_T to sequence through 32 expected fields.
+ *               Shared by the emulator and wxb_convert.
+ *               Ensures string fields (METAR, BLM) are safely null-terminated.
+ */
+void skyvue8_parse_message(char *msg, ParsedMessage *p_message) {
+	memset(p_message, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
+	char *saveptr; // Our place keeper in the msg string.
+	char *token; // Where we temporarily store each token.
+
+	if ((token = strtok_r(msg, ",", &saveptr))) p_message->detection_status = (char)token[0];  // Set detection status.
+   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
+	// These are pulled from a text file in this format:
+	// 1,0,085,010000,/////,/////,/////,8000,0000,0000
+	// Detection Status, Alarm Status, Window Trans %, 1st Height, 2nd Height, 3rd Height, 4th Height, Most Significant Alarm Word, Middle Alarm Word, Least Significant Alarm Word
+   	if ((token = NEXT_T)) p_message->alarm_status = (char)token[0]; // Set Alarm Status.
+   	if ((token = NEXT_T)) p_message->win_trans_per = atoi(token); // Set Window Transmission Percentage.
+	if ((token = NEXT_T)) {
+		strncpy(p_message->first_height, token, MAX_HEIGHT_STR - 1); // Set the First Cloud Height.
+		p_message->first_height[MAX_HEIGHT_STR - 1] = '\0';
+	}
+	if ((token = NEXT_T)) {
+		strncpy(p_message->second_height, token, MAX_HEIGHT_STR - 1); // Set the Second Cloud Height.
+		p_message->second_height[MAX_HEIGHT_STR - 1] = '\0';
+	}
+	if ((token = NEXT_T)) {
+		strncpy(p_message->third_height, token, MAX_HEIGHT_STR - 1); // Set the Third Cloud Height.
+		p_message->third_height[MAX_HEIGHT_STR - 1] = '\0';
+	}
+	if ((token = NEXT_T)) {
+		strncpy(p_message->fourth_height, token, MAX_HEIGHT_STR - 1); // Set the Fourth Cloud Height.
+		p_message->fourth_height[MAX_HEIGHT_STR - 1] = '\0';
+	}
+	if ((token = NEXT_T)) p_message->most_sig_alarm = (uint16_t)strtol(token, NULL, 16);  // Set Most Significant Alarm Word "8000" -> 0x8000.
+	if ((token = NEXT_T)) p_message->middle_sig_alarm = (uint16_t)strtol(token, NULL, 16);  // Set Middle Significant Alarm Word "0000" -> 0x0000.
+	if ((token = NEXT_T)) p_message->least_sig_alarm = (uint16_t)strtol(token, NULL, 16);  // Set Least Significant Alarm Word "0000" -> 0x0000.
+	// The backscatter profile of messages 002/004/1xx is generated from these fields, see skyvue8_profile_begin().
+	#undef NEXT_T
+}
@@ -0,0 +1,371 @@
+/*
+ * File:     storm_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Procedural thunderstorm generator, see storm_utils.h.
+ *
+ *           Each cell's flash count in a step is Poisson distributed around its
+ *           rate at the middle of the step, the rate following half a sine over
+ *           the cell's life. Flash positions scatter normally around the cell
+ *           centre as it drifts. The generator is xoshiro256** seeded through
+ *           splitmix64, as its authors recommend.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "storm_utils.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define STORM_POISSON_EXACT 30.0 // Means below this are drawn exactly, above it from a normal approximation.
+
+/*
+ * Name:         storm_default_config
+ * Purpose:      Fills in the settings used when only --storm is given.
+ * Arguments:    cfg: the configuration to fill.
+ *
+ * Output:       None.
+ * Modifies:     cfg.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Three cells, 60 flashes a minute at peak, drifting at 40 km/h
+ * 				 from up to 60 km out, one flash in four cloud-to-ground.
+ */
+void storm_default_config(StormConfig *cfg) {
+    cfg->enabled = false;
+    cfg->seed = 1;
+    cfg->cells = 3;
+    cfg->rate_per_min = 60.0;
+    cfg->speed_kmh = 40.0;
+    cfg->range_km = 60.0;
+    cfg->cg_fraction = 0.25;
+}
+
+/*
+ * Name:         parse_number
+ * Purpose:      Reads a whole option value as a number within limits.
+ * Arguments:    name: the option, for the error message.
+ * 				 value: the text.
+ * 				 min, max: the accepted range.
+ * 				 out: receives the number.
+ *
+ * Output:       Error message to stderr on a bad value.
+ * Returns:      0 on success, -1 otherwise.
+ */
+static int parse_number(const char *name, const char *value, double min, double max, double *out) {
+    char *end = NULL;
+    double v = strtod(value, &end);
+    if (end == value || *end != '\0' || !(v >= min && v <= max)) {
+        fprintf(stderr, "Invalid %s '%s': use %g to %g\n", name, value, min, max);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/*
+ * Name:         storm_parse_options
+ * Purpose:      Takes the storm options off the command line.
+ * Arguments:    argc: the argument count, reduced by the arguments taken.
+ * 				 argv: the arguments, the rest are kept in order.
+ * 				 cfg: receives the settings, defaults for any not given.
+ *
+ * Output:       Error message to stderr on a bad value.
+ * Modifies:     argc, argv, cfg.
+ * Returns:      0 on success, -1 on a bad value.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        --storm SEED enables the generator; --storm-rate FLASHES_PER_MIN,
+ * 				 --storm-cells N, --storm-speed KMH and --storm-range KM tune it.
+ * 				 Each takes its value as the next argument or after '='.
+ * 				 Mirrors replay_parse_options().
+ */
+int storm_parse_options(int *argc, char **argv, StormConfig *cfg) {
+    static const char *names[] = { "--storm", "--storm-rate", "--storm-cells", "--storm-speed", "--storm-range" };
+    storm_default_config(cfg);
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        int which = -1;
+        const char *value = NULL;
+        for (int k = 0; k < (int)(sizeof(names) / sizeof(names[0])); k++) {
+            size_t len = strlen(names[k]);
+            if (strncmp(argv[i], names[k], len) != 0) continue;
+            if (argv[i][len] == '=') {
+                value = argv[i] + len + 1;
+            } else if (argv[i][len] == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+            } else {
+                continue;
+            }
+            which = k;
+            break;
+        }
+        if (which < 0) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        double v;
+        switch (which) {
+            case 0: {
+                char *end = NULL;
+                cfg->seed = strtoull(value, &end, 0);
+                if (end == value || *end != '\0' || value[0] == '-') {
+                    fprintf(stderr, "Invalid --storm '%s': the seed is a whole number\n", value);
+                    return -1;
+                }
+                cfg->enabled = true;
+                break;
+            }
+            case 1:
+                if (parse_number(names[1], value, 0, 1000000, &cfg->rate_per_min) != 0) return -1;
+                break;
+            case 2:
+                if (parse_number(names[2], value, 1, STORM_MAX_CELLS, &v) != 0) return -1;
+                cfg->cells = (unsigned)v;
+                break;
+            case 3:
+                if (parse_number(names[3], value, 0, 200, &cfg->speed_kmh) != 0) return -1;
+                break;
+            default:
+                if (parse_number(names[4], value, 1, 500, &cfg->range_km) != 0) return -1;
+                break;
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+ * Name:         storm_rng_seed
+ * Purpose:      Seeds a generator.
+ * Arguments:    rng: the generator.
+ * 				 seed: any value, 0 included.
+ *
+ * Output:       None.
+ * Modifies:     rng.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        splitmix64 spreads the seed over the 256 bit state, which is
+ * 				 then never all zero.
+ */
+void storm_rng_seed(StormRng *rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * Name:         storm_rng_next
+ * Purpose:      Returns the next 64 random bits.
+ * Arguments:    rng: a seeded generator.
+ *
+ * Output:       None.
+ * Modifies:     rng.
+ * Returns:      The bits.
+ * Assumptions:  storm_rng_seed() was called on rng.
+ *
+ * Bugs:         None known.
+ * Notes:        xoshiro256**, a few shifts and multiplies, no division.
+ */
+uint64_t storm_rng_next(StormRng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/*
+ * Name:         storm_rng_uniform
+ * Purpose:      Returns a uniform double in [0, 1).
+ * Arguments:    rng: a seeded generator.
+ *
+ * Output:       None.
+ * Modifies:     rng.
+ * Returns:      The number, from the top 53 bits.
+ * Assumptions:  storm_rng_seed() was called on rng.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+double storm_rng_uniform(StormRng *rng) {
+    return (double)(storm_rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Name:         rng_gauss
+ * Purpose:      Returns a standard normal number, Box-Muller.
+ * Arguments:    rng: a seeded generator.
+ *
+ * Returns:      The number.
+ */
+static double rng_gauss(StormRng *rng) {
+    double u = 1.0 - storm_rng_uniform(rng); // (0, 1], log() stays finite.
+    double v = storm_rng_uniform(rng);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/*
+ * Name:         rng_poisson
+ * Purpose:      Returns a Poisson distributed count.
+ * Arguments:    rng: a seeded generator.
+ * 				 mean: the expected count.
+ *
+ * Returns:      The count.
+ */
+static unsigned long rng_poisson(StormRng *rng, double mean) {
+    if (mean <= 0.0) return 0;
+    if (mean < STORM_POISSON_EXACT) { // Knuth: multiply uniforms until below e^-mean.
+        double limit = exp(-mean);
+        double p = storm_rng_uniform(rng);
+        unsigned long k = 0;
+        while (p > limit) {
+            k++;
+            p *= storm_rng_uniform(rng);
+        }
+        return k;
+    }
+    double k = floor(mean + sqrt(mean) * rng_gauss(rng) + 0.5);
+    return k > 0.0 ? (unsigned long)k : 0;
+}
+
+/*
+ * Name:         spawn_cell
+ * Purpose:      Forms a new cell somewhere within range, heading roughly for the sensor.
+ * Arguments:    e: the engine.
+ * 				 c: the cell to replace.
+ * 				 mid_life: true for the cells present at start, which are given a random age.
+ *
+ * Returns:      None.
+ */
+static void spawn_cell(StormEngine *e, StormCell *c, bool mid_life) {
+    StormRng *r = &e->rng;
+    double angle = 2.0 * M_PI * storm_rng_uniform(r);
+    double dist = e->cfg.range_km * sqrt(storm_rng_uniform(r)); // Uniform over the disc.
+    c->x_km = dist * sin(angle);
+    c->y_km = dist * cos(angle);
+
+    double heading = atan2(-c->x_km, -c->y_km) + (storm_rng_uniform(r) - 0.5) * (M_PI / 2.0); // Towards the sensor, +/- 45 degrees.
+    double speed = e->cfg.speed_kmh * (0.5 + storm_rng_uniform(r));
+    c->vx_kmh = speed * sin(heading);
+    c->vy_kmh = speed * cos(heading);
+
+    c->spread_km = 2.0 + 6.0 * storm_rng_uniform(r);
+    c->peak_per_min = e->cfg.rate_per_min / e->cfg.cells * (0.5 + storm_rng_uniform(r));
+    c->life_s = 1800.0 + 3600.0 * storm_rng_uniform(r); // 30 to 90 minutes.
+    c->age_s = mid_life ? c->life_s * storm_rng_uniform(r) : 0.0;
+}
+
+/*
+ * Name:         storm_init
+ * Purpose:      Seeds the engine and forms the first cells.
+ * Arguments:    e: the engine.
+ * 				 cfg: the settings, copied.
+ *
+ * Output:       None.
+ * Modifies:     e.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The first cells are at random points of their lives, so a run
+ * 				 starts with a storm already in progress.
+ */
+void storm_init(StormEngine *e, const StormConfig *cfg) {
+    memset(e, 0, sizeof(*e));
+    e->cfg = *cfg;
+    if (e->cfg.cells < 1) e->cfg.cells = 1;
+    if (e->cfg.cells > STORM_MAX_CELLS) e->cfg.cells = STORM_MAX_CELLS;
+    storm_rng_seed(&e->rng, cfg->seed);
+    for (unsigned i = 0; i < e->cfg.cells; i++) spawn_cell(e, &e->cells[i], true);
+}
+
+static int flash_time_cmp(const void *a, const void *b) {
+    double x = ((const StormFlash *)a)->t_s;
+    double y = ((const StormFlash *)b)->t_s;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Name:         storm_step
+ * Purpose:      Advances the storm by dt_s simulated seconds and returns its flashes.
+ * Arguments:    e: an initialized engine.
+ * 				 dt_s: the step length.
+ * 				 out: receives the flashes in time order.
+ * 				 max: room in out.
+ *
+ * Output:       None.
+ * Modifies:     e, out.
+ * Returns:      The number of flashes stored.
+ * Assumptions:  Called from one thread at a time.
+ *
+ * Bugs:         None known.
+ * Notes:        Flashes past max are still drawn, so the run stays the same for
+ * 				 any max, and are counted in e->dropped.
+ */
+size_t storm_step(StormEngine *e, double dt_s, StormFlash *out, size_t max) {
+    size_t n = 0;
+    if (dt_s <= 0.0) return 0;
+
+    for (unsigned i = 0; i < e->cfg.cells; i++) {
+        StormCell *c = &e->cells[i];
+        double mid = c->age_s + dt_s / 2.0;
+        double rate = mid < c->life_s ? c->peak_per_min * sin(M_PI * mid / c->life_s) : 0.0;
+        unsigned long count = rng_poisson(&e->rng, rate * dt_s / 60.0);
+
+        for (unsigned long k = 0; k < count; k++) {
+            double dt = dt_s * storm_rng_uniform(&e->rng);
+            double x = c->x_km + c->vx_kmh * dt / 3600.0 + c->spread_km * rng_gauss(&e->rng);
+            double y = c->y_km + c->vy_kmh * dt / 3600.0 + c->spread_km * rng_gauss(&e->rng);
+            bool cg = storm_rng_uniform(&e->rng) < e->cfg.cg_fraction;
+            e->flashes++;
+            if (n >= max) {
+                e->dropped++;
+                continue;
+            }
+            double bearing = atan2(x, y) * 180.0 / M_PI;
+            out[n].t_s = e->time_s + dt;
+            out[n].distance_km = (float)hypot(x, y);
+            out[n].bearing_deg = (float)(bearing < 0.0 ? bearing + 360.0 : bearing);
+            out[n].cloud_to_ground = cg;
+            n++;
+        }
+
+        c->x_km += c->vx_kmh * dt_s / 3600.0;
+        c->y_km += c->vy_kmh * dt_s / 3600.0;
+        c->age_s += dt_s;
+        if (c->age_s >= c->life_s || hypot(c->x_km, c->y_km) > 2.0 * e->cfg.range_km) spawn_cell(e, c, false);
+    }
+    e->time_s += dt_s;
+
+    qsort(out, n, sizeof(*out), flash_time_cmp);
+    return n;
+}
@@ -0,0 +1,1175 @@
+/*
+ * File:     transport_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  TCP, RFC 2217 and pseudo-terminal stand-ins for a serial port, see
+ *           transport_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#define _GNU_SOURCE // accept4(), posix_openpt(), ptsname_r()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <termios.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "transport_utils.h"
+#include "metrics_utils.h"
+
+#define RING_MASK (TRANSPORT_RING_SIZE - 1)
+#define TRANSPORT_BACKLOG 8
+#define TRANSPORT_READ_MAX 2048    // Bytes taken from a client or the emulator per read.
+#define TRANSPORT_CTL_MAX 256      // Telnet replies waiting to go to one client.
+#define TRANSPORT_SB_MAX 32        // Longest Telnet subnegotiation kept.
+#define TELNET_CARRY_MAX 2         // Data bytes a read can add over its length, finishing one split from the last.
+#define TRANSPORT_NAME_MAX 128
+
+_Static_assert((TRANSPORT_RING_SIZE & RING_MASK) == 0, "TRANSPORT_RING_SIZE must be a power of two");
+
+// Telnet (RFC 854) and COM-PORT-OPTION (RFC 2217) codes.
+#define TN_IAC  255
+#define TN_DONT 254
+#define TN_DO   253
+#define TN_WONT 252
+#define TN_WILL 251
+#define TN_SB   250
+#define TN_SE   240
+#define TN_OPT_BINARY 0
+#define TN_OPT_SGA 3
+#define TN_OPT_COM_PORT 44
+#define CPO_SET_BAUDRATE 1
+#define CPO_SET_DATASIZE 2
+#define CPO_SET_PARITY 3
+#define CPO_SET_STOPSIZE 4
+#define CPO_SET_CONTROL 5
+#define CPO_BREAK_ON 5             // SET-CONTROL value asking the server to hold a break.
+#define CPO_PURGE_DATA 12
+#define CPO_SERVER_OFFSET 100      // A server's reply carries the client's code plus 100.
+
+typedef enum {
+    TN_STATE_DATA,
+    TN_STATE_IAC,
+    TN_STATE_OPTION,               // After WILL, WONT, DO or DONT.
+    TN_STATE_SB,
+    TN_STATE_SB_IAC
+} TelnetState;
+
+typedef struct {
+    int fd;                        // -1 when the slot is free.
+    size_t cursor;                 // Free running ring index of the next byte to send.
+    bool telnet;                   // RFC 2217 client, 0xFF is doubled and IAC sequences parsed.
+    bool keep;                     // The pty master, never dropped.
+    bool owe_iac;                  // The 0xFF just sent still needs its second IAC.
+    bool last_cr;                  // Telnet sends CR NUL for a bare CR, the NUL is dropped.
+    uint8_t ctl[TRANSPORT_CTL_MAX];
+    size_t ctl_len;
+    TelnetState state;
+    uint8_t verb;
+    uint8_t sb[TRANSPORT_SB_MAX];
+    size_t sb_len;
+    uint8_t us[32];                // Options we have agreed to, one bit each.
+    uint8_t them[32];              // Options the client has agreed to.
+    unsigned long long dropped;    // Output bytes skipped while lapped.
+    char peer[TRANSPORT_NAME_MAX];
+} TransportClient;
+
+struct Transport {
+    TransportKind kind;
+    int app_fd;                    // The emulator's end of the socketpair, its "serial port".
+    int hub_fd;                    // The hub's end.
+    int listen_fd;                 // -1 for a pty.
+    int wake_fd;                   // eventfd, written when output is published or on close.
+    int slave_fd;                  // Held open so the pty master never reads EIO, -1 otherwise.
+    char name[TRANSPORT_NAME_MAX];
+    char link[TRANSPORT_NAME_MAX]; // The pty symlink, "" for none.
+    char slave_path[TRANSPORT_NAME_MAX];
+    pthread_t hub;
+    pthread_mutex_t write_lock;    // Serialises producers, held from frame begin to commit.
+    pthread_mutex_t lock;          // The ring indexes and the clients.
+    pthread_cond_t progress;       // Broadcast after each send pass, for transport_drain().
+    size_t head;                   // Free running index of the end of published output.
+    size_t reserve;                // End of the bytes written to the ring, published or not.
+    size_t frame_start[TRANSPORT_FRAME_SLOTS];
+    size_t frame_count;
+    bool stopping;
+    unsigned long long input_dropped; // Client bytes lost while the emulator was not reading.
+    uint32_t baud;                 // Line settings an RFC 2217 client sees.
+    uint8_t datasize;
+    uint8_t parity;
+    uint8_t stopsize;
+    bool sdi12;                    // Input is PARMRK marked, as a tty in SERIAL_SDI12 mode reads.
+    TransportClient clients[TRANSPORT_MAX_CLIENTS];
+    char ring[TRANSPORT_RING_SIZE];
+};
+
+static Transport *transports[TRANSPORT_MAX_PORTS]; // Written only by open/close, like the tx queue registry.
+static int transport_count = 0;
+
+/*
+ * Name:         transport_kind
+ * Purpose:      Tells which backend a port name asks for.
+ * Arguments:    portname: the serial device argument.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      TRANSPORT_TTY for anything that is not a transport name.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+TransportKind transport_kind(const char *portname) {
+    if (strncmp(portname, "tcp://", 6) == 0) return TRANSPORT_TCP;
+    if (strncmp(portname, "rfc2217://", 10) == 0) return TRANSPORT_RFC2217;
+    if (strcmp(portname, "pty") == 0 || strncmp(portname, "pty:", 4) == 0) return TRANSPORT_PTY;
+    return TRANSPORT_TTY;
+}
+
+/*
+ * Name:         transport_find
+ * Purpose:      Returns the transport behind an fd from transport_open().
+ * Arguments:    fd: the emulator's port fd.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The transport, or NULL for a real serial port.
+ * Assumptions:  Open and close do not race with writers, as for serial_tx_attach().
+ *
+ * Bugs:         None known.
+ * Notes:        Every serial write asks, so a process with no transport returns
+ *               at once.
+ */
+Transport *transport_find(int fd) {
+    if (transport_count == 0) return NULL;
+    for (int i = 0; i < TRANSPORT_MAX_PORTS; i++) {
+        if (transports[i] && transports[i]->app_fd == fd) return transports[i];
+    }
+    return NULL;
+}
+
+/*
+ * Name:         wake_hub
+ * Purpose:      Gets the hub thread out of poll().
+ */
+static void wake_hub(Transport *t) {
+    uint64_t one = 1;
+    ssize_t n;
+    do {
+        n = write(t->wake_fd, &one, sizeof(one));
+    } while (n < 0 && errno == EINTR);
+}
+
+/*
+ * Name:         ring_write_locked
+ * Purpose:      Copies bytes into the ring at reserve, across the wrap.
+ * Arguments:    t: the transport.
+ *               buf: the bytes.
+ *               len: at most TRANSPORT_RING_SIZE.
+ *
+ * Output:       None.
+ * Modifies:     t->ring, t->reserve.
+ * Returns:      None.
+ * Assumptions:  t->lock is held, so the hub is not sending from the bytes overwritten.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void ring_write_locked(Transport *t, const void *buf, size_t len) {
+    size_t start = t->reserve & RING_MASK;
+    size_t first = TRANSPORT_RING_SIZE - start;
+    if (first > len) first = len;
+    memcpy(t->ring + start, buf, first);
+    memcpy(t->ring, (const char *)buf + first, len - first);
+    t->reserve += len;
+}
+
+/*
+ * Name:         publish_locked
+ * Purpose:      Makes the bytes written since the last publish one frame clients can see.
+ * Arguments:    t: the transport.
+ *
+ * Output:       None.
+ * Modifies:     t->head, t->frame_start, t->frame_count.
+ * Returns:      Bytes published.
+ * Assumptions:  t->lock is held.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static size_t publish_locked(Transport *t) {
+    size_t len = t->reserve - t->head;
+    if (len == 0) return 0;
+    t->frame_start[t->frame_count++ % TRANSPORT_FRAME_SLOTS] = t->head;
+    t->head = t->reserve;
+    return len;
+}
+
+/*
+ * Name:         transport_writev
+ * Purpose:      Publishes one message, given as pieces, to every client.
+ * Arguments:    t: the transport.
+ *               iov: the pieces of the message.
+ *               iovcnt: the number of pieces.
+ *
+ * Output:       Error message to stderr if the message is larger than the ring.
+ * Modifies:     The transport's ring.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The message is copied once, the hub sends every client the same
+ *               bytes. Never waits on a client.
+ */
+void transport_writev(Transport *t, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (total == 0) return;
+    if (total > TRANSPORT_RING_SIZE) {
+        fprintf(stderr, "Serial write error: %zu byte message exceeds the transport ring\n", total);
+        return;
+    }
+
+    pthread_mutex_lock(&t->write_lock);
+    pthread_mutex_lock(&t->lock);
+    for (int i = 0; i < iovcnt; i++) ring_write_locked(t, iov[i].iov_base, iov[i].iov_len);
+    publish_locked(t);
+    pthread_mutex_unlock(&t->lock);
+    pthread_mutex_unlock(&t->write_lock);
+
+    wake_hub(t);
+    metrics_count(METRIC_FRAMES_SENT, 1);
+    metrics_count(METRIC_BYTES_WRITTEN, total);
+}
+
+/*
+ * Name:         transport_frame_begin / transport_frame_append / transport_frame_commit
+ * Purpose:      Build one message in pieces, see serial_tx_frame_begin().
+ *
+ * Notes:        Other producers wait from begin to commit, so the frame is never
+ *               interleaved. Clients see nothing until the commit. Bytes beyond
+ *               TRANSPORT_RING_SIZE are dropped.
+ */
+void transport_frame_begin(Transport *t) {
+    pthread_mutex_lock(&t->write_lock);
+}
+
+void transport_frame_append(Transport *t, const void *buf, size_t len) {
+    pthread_mutex_lock(&t->lock);
+    size_t room = TRANSPORT_RING_SIZE - (t->reserve - t->head);
+    if (len > room) {
+        fprintf(stderr, "Serial write error: frame exceeds the transport ring\n");
+        len = room;
+    }
+    ring_write_locked(t, buf, len);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void transport_frame_commit(Transport *t) {
+    pthread_mutex_lock(&t->lock);
+    size_t len = publish_locked(t);
+    pthread_mutex_unlock(&t->lock);
+    pthread_mutex_unlock(&t->write_lock);
+
+    if (len > 0) {
+        wake_hub(t);
+        metrics_count(METRIC_FRAMES_SENT, 1);
+        metrics_count(METRIC_BYTES_WRITTEN, len);
+    }
+}
+
+/*
+ * Name:         client_pending
+ * Purpose:      Whether a client has anything left to send.
+ */
+static bool client_pending(const Transport *t, const TransportClient *c) {
+    return c->cursor != t->head || c->ctl_len > 0 || c->owe_iac;
+}
+
+/*
+ * Name:         transport_drain
+ * Purpose:      Waits until every connected client has been sent the output published so far.
+ * Arguments:    t: the transport.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The tcdrain() of a network port, for the RS-485 turnaround and
+ *               SDI-12 timing. Gives up after TRANSPORT_DRAIN_MS, so a stalled
+ *               client cannot hold the emulator.
+ */
+void transport_drain(Transport *t) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += TRANSPORT_DRAIN_MS / 1000;
+    deadline.tv_nsec += (long)(TRANSPORT_DRAIN_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int64_t drain_start = metrics_start_timer();
+    pthread_mutex_lock(&t->lock);
+    size_t target = t->head;
+    while (!t->stopping) {
+        bool behind = false;
+        for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) {
+            const TransportClient *c = &t->clients[i];
+            if (c->fd >= 0 && (long)(c->cursor - target) < 0) behind = true;
+        }
+        if (!behind) break;
+        if (pthread_cond_timedwait(&t->progress, &t->lock, &deadline) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&t->lock);
+    metrics_observe_since(METRIC_TCDRAIN_NS, drain_start);
+}
+
+/*
+ * Name:         queue_ctl
+ * Purpose:      Queues Telnet bytes for a client, sent ahead of its next data.
+ */
+static void queue_ctl(TransportClient *c, const uint8_t *bytes, size_t len) {
+    if (c->ctl_len + len > TRANSPORT_CTL_MAX) return; // A client flooding negotiations loses replies.
+    memcpy(c->ctl + c->ctl_len, bytes, len);
+    c->ctl_len += len;
+}
+
+/*
+ * Name:         queue_option
+ * Purpose:      Queues IAC <verb> <option>.
+ */
+static void queue_option(TransportClient *c, uint8_t verb, uint8_t option) {
+    uint8_t msg[3] = { TN_IAC, verb, option };
+    queue_ctl(c, msg, sizeof(msg));
+}
+
+/*
+ * Name:         queue_com_port
+ * Purpose:      Queues a COM-PORT-OPTION reply, doubling any 0xFF in the value.
+ */
+static void queue_com_port(TransportClient *c, uint8_t command, const uint8_t *value, size_t len) {
+    uint8_t msg[4 + 2 * 4 + 2];
+    size_t n = 0;
+    msg[n++] = TN_IAC;
+    msg[n++] = TN_SB;
+    msg[n++] = TN_OPT_COM_PORT;
+    msg[n++] = command + CPO_SERVER_OFFSET;
+    for (size_t i = 0; i < len && i < 4; i++) {
+        msg[n++] = value[i];
+        if (value[i] == TN_IAC) msg[n++] = TN_IAC;
+    }
+    msg[n++] = TN_IAC;
+    msg[n++] = TN_SE;
+    queue_ctl(c, msg, n);
+}
+
+static bool bit_get(const uint8_t *bits, uint8_t option) { return bits[option >> 3] & (1u << (option & 7)); }
+static void bit_set(uint8_t *bits, uint8_t option, bool on) {
+    if (on) bits[option >> 3] |= (uint8_t)(1u << (option & 7));
+    else bits[option >> 3] &= (uint8_t)~(1u << (option & 7));
+}
+
+static bool option_supported(uint8_t option) {
+    return option == TN_OPT_BINARY || option == TN_OPT_SGA || option == TN_OPT_COM_PORT;
+}
+
+/*
+ * Name:         handle_option
+ * Purpose:      Answers WILL, WONT, DO or DONT from a Telnet client.
+ *
+ * Notes:        Only a change of state is answered, so the two sides cannot
+ *               loop. BINARY, SGA and COM-PORT-OPTION are agreed both ways,
+ *               everything else, ECHO included, is refused.
+ */
+static void handle_option(TransportClient *c, uint8_t verb, uint8_t option) {
+    switch (verb) {
+        case TN_DO:
+            if (!option_supported(option)) {
+                queue_option(c, TN_WONT, option);
+            } else if (!bit_get(c->us, option)) {
+                bit_set(c->us, option, true);
+                queue_option(c, TN_WILL, option);
+            }
+            break;
+        case TN_DONT:
+            if (bit_get(c->us, option)) {
+                bit_set(c->us, option, false);
+                queue_option(c, TN_WONT, option);
+            }
+            break;
+        case TN_WILL:
+            if (!option_supported(option)) {
+                queue_option(c, TN_DONT, option);
+            } else if (!bit_get(c->them, option)) {
+                bit_set(c->them, option, true);
+                queue_option(c, TN_DO, option);
+            }
+            break;
+        case TN_WONT:
+            if (bit_get(c->them, option)) {
+                bit_set(c->them, option, false);
+                queue_option(c, TN_DONT, option);
+            }
+            break;
+    }
+}
+
+/*
+ * Name:         handle_com_port
+ * Purpose:      Answers an RFC 2217 COM-PORT-OPTION subnegotiation.
+ * Arguments:    t: the transport, whose line settings are shared by its clients.
+ *               c: the client.
+ *
+ * Output:       None.
+ * Modifies:     t's line settings, c->ctl, c->cursor on a transmit purge.
+ * Returns:      None.
+ * Assumptions:  t->lock is held.
+ *
+ * Bugs:         None known.
+ * Notes:        Settings are accepted and reported back as set, so clients
+ *               such as pyserial's rfc2217:// see their change take. A value of
+ *               0 asks for the current setting. There is no UART behind the
+ *               port, the emulator keeps sending at whatever rate it sends.
+ */
+static void handle_com_port(Transport *t, TransportClient *c) {
+    if (c->sb_len < 2 || c->sb[0] != TN_OPT_COM_PORT) return;
+    uint8_t command = c->sb[1];
+    const uint8_t *value = c->sb + 2;
+    size_t len = c->sb_len - 2;
+    uint8_t reply;
+
+    switch (command) {
+        case CPO_SET_BAUDRATE: {
+            if (len < 4) return;
+            uint32_t baud = (uint32_t)value[0] << 24 | (uint32_t)value[1] << 16 | (uint32_t)value[2] << 8 | value[3];
+            if (baud != 0) t->baud = baud;
+            uint8_t out[4] = { t->baud >> 24, t->baud >> 16, t->baud >> 8, t->baud };
+            queue_com_port(c, command, out, sizeof(out));
+            return;
+        }
+        case CPO_SET_DATASIZE:
+            if (len >= 1 && value[0] != 0) t->datasize = value[0];
+            queue_com_port(c, command, &t->datasize, 1);
+            return;
+        case CPO_SET_PARITY:
+            if (len >= 1 && value[0] != 0) t->parity = value[0];
+            queue_com_port(c, command, &t->parity, 1);
+            return;
+        case CPO_SET_STOPSIZE:
+            if (len >= 1 && value[0] != 0) t->stopsize = value[0];
+            queue_com_port(c, command, &t->stopsize, 1);
+            return;
+        case CPO_SET_CONTROL:
+            if (len < 1) return;
+            switch (value[0]) {
+                case 0: reply = 1; break;   // Flow control query: none.
+                case 4: reply = 6; break;   // BREAK query: off.
+                case 7: reply = 8; break;   // DTR query: on.
+                case 10: reply = 11; break; // RTS query: on.
+                case 13: reply = 14; break; // Inbound flow control query: none.
+                default: reply = value[0]; break;
+            }
+            queue_com_port(c, command, &reply, 1);
+            return;
+        case CPO_PURGE_DATA:
+            if (len < 1) return;
+            if (value[0] & 2) c->cursor = t->head; // Transmit buffer, the client drops its backlog.
+            queue_com_port(c, command, value, 1);
+            return;
+        default:
+            queue_com_port(c, command, value, len > 4 ? 4 : len); // Masks and flow control, acknowledged.
+            return;
+    }
+}
+
+/*
+ * Name:         telnet_put
+ * Purpose:      Appends one data byte for telnet_input(), if there is room.
+ */
+static inline void telnet_put(uint8_t *out, size_t *n, size_t room, uint8_t b) {
+    if (*n < room) out[(*n)++] = b;
+}
+
+/*
+ * Name:         telnet_input
+ * Purpose:      Strips Telnet commands from client bytes, answering them, and keeps the data.
+ * Arguments:    t: the transport.
+ *               c: the client.
+ *               in: bytes read from the client.
+ *               len: their number.
+ *               out: receives the data bytes.
+ *               room: bytes available at out, len + TELNET_CARRY_MAX never runs short.
+ *
+ * Output:       None.
+ * Modifies:     c's parser and negotiation state.
+ * Returns:      The number of data bytes in out.
+ * Assumptions:  t->lock is held.
+ *
+ * Bugs:         None known.
+ * Notes:        Parser state carries across reads, a sequence may be split.
+ *               On an SDI-12 port, BREAK ON from the client reaches the emulator
+ *               as \377 \0 \0 and a data 0xFF as \377 \377, as PARMRK has a tty
+ *               deliver them. Within one read neither is longer than the bytes
+ *               that asked for it, but the tail of a sequence split across reads
+ *               is: the second IAC of a doubled 0xFF gives two bytes, the SE of
+ *               a BREAK ON three. Every store is checked against room, and
+ *               anything past it is dropped.
+ */
+static size_t telnet_input(Transport *t, TransportClient *c, const uint8_t *in, size_t len, uint8_t *out, size_t room) {
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b = in[i];
+        switch (c->state) {
+            case TN_STATE_DATA:
+                if (b == TN_IAC) {
+                    c->state = TN_STATE_IAC;
+                } else if (!(b == 0 && c->last_cr)) {
+                    telnet_put(out, &n, room, b);
+                }
+                c->last_cr = (b == '\r');
+                break;
+            case TN_STATE_IAC:
+                c->last_cr = false;
+                if (b == TN_IAC) {
+                    if (t->sdi12) telnet_put(out, &n, room, b);
+                    telnet_put(out, &n, room, b);
+                    c->state = TN_STATE_DATA;
+                } else if (b >= TN_WILL && b <= TN_DONT) {
+                    c->verb = b;
+                    c->state = TN_STATE_OPTION;
+                } else if (b == TN_SB) {
+                    c->sb_len = 0;
+                    c->state = TN_STATE_SB;
+                } else {
+                    c->state = TN_STATE_DATA; // NOP, AYT and friends.
+                }
+                break;
+            case TN_STATE_OPTION:
+                handle_option(c, c->verb, b);
+                c->state = TN_STATE_DATA;
+                break;
+            case TN_STATE_SB:
+                if (b == TN_IAC) {
+                    c->state = TN_STATE_SB_IAC;
+                } else if (c->sb_len < TRANSPORT_SB_MAX) {
+                    c->sb[c->sb_len++] = b;
+                }
+                break;
+            case TN_STATE_SB_IAC:
+                if (b == TN_SE) {
+                    handle_com_port(t, c);
+                    if (t->sdi12 && c->sb_len >= 3 && c->sb[0] == TN_OPT_COM_PORT &&
+                        c->sb[1] == CPO_SET_CONTROL && c->sb[2] == CPO_BREAK_ON) {
+                        telnet_put(out, &n, room, 0xFF);
+                        telnet_put(out, &n, room, 0x00);
+                        telnet_put(out, &n, room, 0x00);
+                    }
+                    c->state = TN_STATE_DATA;
+                } else if (b == TN_IAC) {
+                    if (c->sb_len < TRANSPORT_SB_MAX) c->sb[c->sb_len++] = b;
+                    c->state = TN_STATE_SB;
+                } else {
+                    c->state = TN_STATE_DATA;
+                }
+                break;
+        }
+    }
+    return n;
+}
+
+/*
+ * Name:         drop_client
+ * Purpose:      Closes a client connection and frees its slot.
+ */
+static void drop_client(Transport *t, TransportClient *c, const char *why) {
+    if (c->keep) return;
+    printf("%s: client %s disconnected (%s)\n", t->name, c->peer, why);
+    if (c->dropped) printf("%s: client %s missed %llu bytes while behind\n", t->name, c->peer, c->dropped);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/*
+ * Name:         skip_lapped
+ * Purpose:      Moves a client the ring has lapped to the oldest whole frame still held.
+ * Arguments:    t: the transport.
+ *               c: the client.
+ *
+ * Output:       A message to stderr.
+ * Modifies:     c->cursor, c->dropped, c->owe_iac.
+ * Returns:      None.
+ * Assumptions:  t->lock is held.
+ *
+ * Bugs:         None known.
+ * Notes:        This is the per-client backpressure: a slow client loses its
+ *               oldest output, the emulator and the other clients carry on.
+ *               The frame it was part way through is cut short.
+ */
+static void skip_lapped(Transport *t, TransportClient *c) {
+    size_t target = t->head;
+    size_t first = t->frame_count > TRANSPORT_FRAME_SLOTS ? t->frame_count - TRANSPORT_FRAME_SLOTS : 0;
+    for (size_t i = first; i < t->frame_count; i++) {
+        size_t start = t->frame_start[i % TRANSPORT_FRAME_SLOTS];
+        if (t->reserve - start <= TRANSPORT_RING_SIZE) {
+            target = start;
+            break;
+        }
+    }
+    fprintf(stderr, "%s: client %s fell %zu bytes behind, skipping to the oldest frame held\n",
+            t->name, c->peer, t->head - c->cursor);
+    c->dropped += target - c->cursor;
+    c->cursor = target;
+    c->owe_iac = false;
+}
+
+/*
+ * Name:         send_client
+ * Purpose:      Sends a client what it can take, without blocking, straight from the ring.
+ * Arguments:    t: the transport.
+ *               c: the client.
+ *
+ * Output:       None.
+ * Modifies:     c.
+ * Returns:      None.
+ * Assumptions:  t->lock is held, so producers do not overwrite the bytes being sent.
+ *
+ * Bugs:         None known.
+ * Notes:        Telnet replies go between data spans. For an RFC 2217 client a
+ *               span ends after any 0xFF, whose second IAC follows it.
+ */
+static void send_client(Transport *t, TransportClient *c) {
+    if (t->reserve - c->cursor > TRANSPORT_RING_SIZE) skip_lapped(t, c);
+
+    for (;;) {
+        ssize_t n;
+        if (c->owe_iac) {
+            uint8_t iac = TN_IAC;
+            n = send(c->fd, &iac, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) goto failed;
+            c->owe_iac = false;
+        }
+        if (c->ctl_len > 0) {
+            n = send(c->fd, c->ctl, c->ctl_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) goto failed;
+            memmove(c->ctl, c->ctl + n, c->ctl_len - (size_t)n);
+            c->ctl_len -= (size_t)n;
+            if (c->ctl_len > 0) return;
+        }
+        if (c->cursor == t->head) return;
+
+        size_t start = c->cursor & RING_MASK;
+        size_t len = t->head - c->cursor;
+        if (len > TRANSPORT_RING_SIZE - start) len = TRANSPORT_RING_SIZE - start;
+        bool escape = false;
+        if (c->telnet) {
+            const char *ff = memchr(t->ring + start, TN_IAC, len);
+            if (ff) {
+                len = (size_t)(ff - (t->ring + start)) + 1;
+                escape = true;
+            }
+        }
+
+        if (c->keep) {
+            n = write(c->fd, t->ring + start, len); // A pty master is not a socket.
+        } else {
+            n = send(c->fd, t->ring + start, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        if (n < 0) goto failed;
+        c->cursor += (size_t)n;
+        if ((size_t)n < len) return;
+        if (escape) c->owe_iac = true;
+    }
+
+failed:
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return; // Waits for POLLOUT.
+    if (c->keep) {
+        c->cursor = t->head; // No pty client, nothing to keep for.
+        return;
+    }
+    drop_client(t, c, strerror(errno));
+}
+
+/*
+ * Name:         forward_input
+ * Purpose:      Hands client bytes to the emulator, through the hub's end of the socketpair.
+ *
+ * Notes:        An emulator that is not reading loses them, rather than the hub
+ *               stalling every client.
+ */
+static void forward_input(Transport *t, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(t->hub_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            t->input_dropped += len;
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * Name:         accept_client
+ * Purpose:      Takes a new connection on a network port.
+ */
+static void accept_client(Transport *t) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept4(t->listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    char host[INET6_ADDRSTRLEN] = "?", serv[8] = "?";
+    getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+
+    TransportClient *c = NULL;
+    for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) {
+        if (t->clients[i].fd < 0) {
+            c = &t->clients[i];
+            break;
+        }
+    }
+    if (!c) {
+        fprintf(stderr, "%s: refusing %s:%s, already %d clients\n", t->name, host, serv, TRANSPORT_MAX_CLIENTS);
+        close(fd);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Frames are small and timed.
+
+    pthread_mutex_lock(&t->lock);
+    memset(c, 0, sizeof(TransportClient));
+    c->fd = fd;
+    c->cursor = t->head; // Live output from here on.
+    c->telnet = (t->kind == TRANSPORT_RFC2217);
+    snprintf(c->peer, sizeof(c->peer), "%s:%s", host, serv);
+    if (c->telnet) {
+        static const uint8_t offer[][2] = {
+            { TN_WILL, TN_OPT_BINARY }, { TN_DO, TN_OPT_BINARY },
+            { TN_WILL, TN_OPT_SGA }, { TN_DO, TN_OPT_SGA },
+            { TN_WILL, TN_OPT_COM_PORT },
+        };
+        for (size_t i = 0; i < sizeof(offer) / sizeof(offer[0]); i++) {
+            queue_option(c, offer[i][0], offer[i][1]);
+            bit_set(offer[i][0] == TN_WILL ? c->us : c->them, offer[i][1], true);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    printf("%s: client %s connected\n", t->name, c->peer);
+}
+
+/*
+ * Name:         read_client
+ * Purpose:      Reads what a client sent and hands the data to the emulator.
+ */
+static void read_client(Transport *t, TransportClient *c) {
+    uint8_t buf[TRANSPORT_READ_MAX];
+    uint8_t data[TRANSPORT_READ_MAX + TELNET_CARRY_MAX];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || c->keep) return;
+        pthread_mutex_lock(&t->lock);
+        drop_client(t, c, strerror(errno));
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    if (n == 0) {
+        pthread_mutex_lock(&t->lock);
+        drop_client(t, c, "closed");
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+
+    if (c->telnet) {
+        pthread_mutex_lock(&t->lock);
+        size_t len = telnet_input(t, c, buf, (size_t)n, data, sizeof(data));
+        pthread_mutex_unlock(&t->lock);
+        forward_input(t, data, len);
+    } else {
+        forward_input(t, buf, (size_t)n);
+    }
+}
+
+/*
+ * Name:         read_emulator
+ * Purpose:      Publishes bytes the emulator wrote to its fd directly (wxsensord).
+ */
+static void read_emulator(Transport *t) {
+    char buf[TRANSPORT_READ_MAX];
+    ssize_t n = read(t->hub_fd, buf, sizeof(buf));
+    if (n <= 0) return;
+
+    pthread_mutex_lock(&t->write_lock);
+    pthread_mutex_lock(&t->lock);
+    ring_write_locked(t, buf, (size_t)n);
+    publish_locked(t);
+    pthread_mutex_unlock(&t->lock);
+    pthread_mutex_unlock(&t->write_lock);
+}
+
+/*
+ * Name:         hub_thread
+ * Purpose:      Accepts clients, fans output out to them and merges their input.
+ * Arguments:    arg: the Transport.
+ *
+ * Output:       Connection messages to stdout.
+ * Modifies:     The transport's clients.
+ * Returns:      NULL.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Every socket is non-blocking and polled for POLLOUT only while it
+ *               has something pending, so one slow client never delays another.
+ *               On close it makes one last non-blocking pass.
+ */
+static void *hub_thread(void *arg) {
+    Transport *t = arg;
+    struct pollfd pfd[3 + TRANSPORT_MAX_CLIENTS];
+    int slot[3 + TRANSPORT_MAX_CLIENTS];
+
+    for (;;) {
+        int n = 0;
+        pfd[n++] = (struct pollfd){ .fd = t->wake_fd, .events = POLLIN };
+        pfd[n++] = (struct pollfd){ .fd = t->hub_fd, .events = POLLIN };
+        if (t->listen_fd >= 0) pfd[n++] = (struct pollfd){ .fd = t->listen_fd, .events = POLLIN };
+        int first_client = n;
+
+        pthread_mutex_lock(&t->lock);
+        bool stopping = t->stopping;
+        for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) {
+            TransportClient *c = &t->clients[i];
+            if (c->fd < 0) continue;
+            slot[n] = i;
+            pfd[n++] = (struct pollfd){ .fd = c->fd, .events = POLLIN | (client_pending(t, c) ? POLLOUT : 0) };
+        }
+        pthread_mutex_unlock(&t->lock);
+        if (stopping) break;
+
+        if (poll(pfd, (nfds_t)n, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s: poll: %s\n", t->name, strerror(errno));
+            break;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(t->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) break;
+        }
+        if (pfd[1].revents & POLLIN) read_emulator(t);
+        if (t->listen_fd >= 0 && (pfd[2].revents & POLLIN)) accept_client(t);
+        for (int k = first_client; k < n; k++) {
+            TransportClient *c = &t->clients[slot[k]];
+            if (c->fd == pfd[k].fd && (pfd[k].revents & (POLLIN | POLLHUP | POLLERR))) read_client(t, c);
+        }
+
+        pthread_mutex_lock(&t->lock);
+        for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) {
+            if (t->clients[i].fd >= 0) send_client(t, &t->clients[i]);
+        }
+        pthread_cond_broadcast(&t->progress);
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) {
+        if (t->clients[i].fd >= 0) send_client(t, &t->clients[i]);
+    }
+    pthread_cond_broadcast(&t->progress);
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/*
+ * Name:         open_listener
+ * Purpose:      Binds and listens on the [host]:port after a tcp:// or rfc2217:// scheme.
+ */
+static int open_listener(const char *address) {
+    char host[TRANSPORT_NAME_MAX];
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon[1] == '\0' || (size_t)(colon - address) >= sizeof(host)) {
+        fprintf(stderr, "Transport: expected [host]:port, got '%s'\n", address);
+        return -1;
+    }
+    memcpy(host, address, (size_t)(colon - address));
+    host[colon - address] = '\0';
+    char *h = host;
+    size_t hlen = strlen(h);
+    if (hlen >= 2 && h[0] == '[' && h[hlen - 1] == ']') { // [::1]:4001
+        h[hlen - 1] = '\0';
+        h++;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    int err = getaddrinfo(*h ? h : NULL, colon + 1, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Transport: %s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, TRANSPORT_BACKLOG) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) fprintf(stderr, "Transport: cannot listen on %s: %s\n", address, strerror(errno));
+    return fd;
+}
+
+/*
+ * Name:         open_pty
+ * Purpose:      Creates a pseudo-terminal and makes its master the transport's one client.
+ */
+static int open_pty(Transport *t, const char *link, speed_t baud_rate) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 ||
+        ptsname_r(master, t->slave_path, sizeof(t->slave_path)) != 0) {
+        fprintf(stderr, "Transport: cannot create a pseudo-terminal: %s\n", strerror(errno));
+        if (master >= 0) close(master);
+        return -1;
+    }
+
+    t->slave_fd = open(t->slave_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (t->slave_fd < 0) {
+        fprintf(stderr, "Transport: %s: %s\n", t->slave_path, strerror(errno));
+        close(master);
+        return -1;
+    }
+    struct termios tty;
+    if (tcgetattr(t->slave_fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        cfsetospeed(&tty, baud_rate);
+        cfsetispeed(&tty, baud_rate);
+        tcsetattr(t->slave_fd, TCSANOW, &tty);
+    }
+
+    if (link && *link) {
+        struct stat st;
+        if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode)) unlink(link); // Left by an earlier run.
+        if (symlink(t->slave_path, link) != 0) {
+            fprintf(stderr, "Transport: cannot link %s to %s: %s\n", link, t->slave_path, strerror(errno));
+        } else {
+            snprintf(t->link, sizeof(t->link), "%s", link);
+        }
+    }
+
+    TransportClient *c = &t->clients[0];
+    c->fd = master;
+    c->keep = true;
+    snprintf(c->peer, sizeof(c->peer), "%s", t->slave_path);
+    return 0;
+}
+
+/*
+ * Name:         free_transport
+ * Purpose:      Closes everything a transport holds and frees it.
+ */
+static void free_transport(Transport *t) {
+    for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) {
+        if (t->clients[i].fd >= 0) close(t->clients[i].fd);
+    }
+    if (t->link[0]) {
+        char target[TRANSPORT_NAME_MAX];
+        ssize_t n = readlink(t->link, target, sizeof(target) - 1);
+        if (n >= 0) {
+            target[n] = '\0';
+            if (strcmp(target, t->slave_path) == 0) unlink(t->link); // Still ours.
+        }
+    }
+    if (t->slave_fd >= 0) close(t->slave_fd);
+    if (t->listen_fd >= 0) close(t->listen_fd);
+    if (t->wake_fd >= 0) close(t->wake_fd);
+    if (t->hub_fd >= 0) close(t->hub_fd);
+    if (t->app_fd >= 0) close(t->app_fd);
+    pthread_cond_destroy(&t->progress);
+    pthread_mutex_destroy(&t->lock);
+    pthread_mutex_destroy(&t->write_lock);
+    free(t);
+}
+
+/*
+ * Name:         baud_value
+ * Purpose:      The bits per second a speed_t stands for, reported to RFC 2217 clients.
+ */
+static uint32_t baud_value(speed_t speed) {
+    static const struct { speed_t speed; uint32_t baud; } rates[] = {
+        { B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+        { B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 }, { B230400, 230400 },
+    };
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (rates[i].speed == speed) return rates[i].baud;
+    }
+    return 9600;
+}
+
+/*
+ * Name:         transport_open
+ * Purpose:      Opens a TCP, RFC 2217 or pseudo-terminal port and starts its hub thread.
+ * Arguments:    portname: tcp://[host]:port, rfc2217://[host]:port or pty[:link].
+ *               baud_rate: the rate given on the command line, for the pty and RFC 2217 clients.
+ *               mode: only SERIAL_SDI12 matters, for the 7E1 an RFC 2217 client is told of
+ *               and the breaks it can send, see telnet_input().
+ *
+ * Output:       Prints the address clients connect to, errors to stderr.
+ * Modifies:     The transport registry.
+ * Returns:      The emulator's fd, -1 on failure.
+ * Assumptions:  Called before main() blocks its signals, like serial_tx_attach().
+ *
+ * Bugs:         None known.
+ * Notes:        The fd is one end of a non-blocking AF_UNIX socketpair. Reads
+ *               return client input; writes through serial_utils go to the
+ *               ring, and any other write() is picked up by the hub and sent on.
+ */
+int transport_open(const char *portname, speed_t baud_rate, SerialMode mode) {
+    TransportKind kind = transport_kind(portname);
+    if (kind == TRANSPORT_TTY) return -1;
+
+    int slot = -1;
+    for (int i = 0; i < TRANSPORT_MAX_PORTS; i++) {
+        if (!transports[i]) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        fprintf(stderr, "Transport: more than %d ports\n", TRANSPORT_MAX_PORTS);
+        return -1;
+    }
+
+    Transport *t = calloc(1, sizeof(Transport));
+    if (!t) return -1;
+    t->kind = kind;
+    t->app_fd = t->hub_fd = t->listen_fd = t->wake_fd = t->slave_fd = -1;
+    for (int i = 0; i < TRANSPORT_MAX_CLIENTS; i++) t->clients[i].fd = -1;
+    snprintf(t->name, sizeof(t->name), "%s", portname);
+    t->baud = baud_value(baud_rate);
+    t->sdi12 = (mode == SERIAL_SDI12);
+    t->datasize = (mode == SERIAL_SDI12) ? 7 : 8;
+    t->parity = (mode == SERIAL_SDI12) ? 3 : 1; // RFC 2217: 1 none, 3 even.
+    t->stopsize = 1;
+    pthread_mutex_init(&t->write_lock, NULL);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->progress, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) != 0 ||
+        (t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Transport: %s\n", strerror(errno));
+        free_transport(t);
+        return -1;
+    }
+    t->app_fd = pair[0];
+    t->hub_fd = pair[1];
+
+    int ok;
+    const char *kind_str;
+    if (kind == TRANSPORT_PTY) {
+        ok = open_pty(t, portname[3] == ':' ? portname + 4 : NULL, baud_rate);
+        kind_str = "pseudo-terminal";
+    } else {
+        t->listen_fd = open_listener(strstr(portname, "://") + 3);
+        ok = t->listen_fd >= 0 ? 0 : -1;
+        kind_str = (kind == TRANSPORT_TCP) ? "raw TCP" : "RFC 2217";
+    }
+    if (ok != 0) {
+        free_transport(t);
+        return -1;
+    }
+
+    // As with the transmit queue writer, the hub must never take the signal_thread's signals.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int ret = pthread_create(&t->hub, NULL, hub_thread, t);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "Transport: pthread_create failed: %s\n", strerror(ret));
+        free_transport(t);
+        return -1;
+    }
+
+    transports[slot] = t;
+    transport_count++;
+    if (kind == TRANSPORT_PTY) {
+        printf("Opened %s (%s, clients open %s)\n", portname, kind_str, t->link[0] ? t->link : t->slave_path);
+    } else {
+        printf("Opened %s (%s, up to %d clients)\n", portname, kind_str, TRANSPORT_MAX_CLIENTS);
+    }
+    return t->app_fd;
+}
+
+/*
+ * Name:         transport_close
+ * Purpose:      Stops a transport's hub, closes its clients and the emulator's fd.
+ * Arguments:    fd: the fd transport_open() returned.
+ *
+ * Output:       The input bytes lost, if any, to stderr.
+ * Modifies:     The transport registry, closes fd.
+ * Returns:      true if fd was a transport and is now closed, false otherwise.
+ * Assumptions:  No other thread is still writing to fd.
+ *
+ * Bugs:         None known.
+ * Notes:        Output already published gets one last non-blocking send.
+ */
+bool transport_close(int fd) {
+    for (int i = 0; i < TRANSPORT_MAX_PORTS; i++) {
+        Transport *t = transports[i];
+        if (!t || t->app_fd != fd) continue;
+
+        pthread_mutex_lock(&t->lock);
+        t->stopping = true;
+        pthread_cond_broadcast(&t->progress);
+        pthread_mutex_unlock(&t->lock);
+        wake_hub(t);
+        pthread_join(t->hub, NULL);
+
+        if (t->input_dropped) fprintf(stderr, "%s: %llu client bytes dropped, the emulator was not reading\n", t->name, t->input_dropped);
+        transports[i] = NULL;
+        transport_count--;
+        free_transport(t);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Name:         transport_cleanup
+ * Purpose:      Closes every transport still open.
+ */
+void transport_cleanup(void) {
+    for (int i = 0; i < TRANSPORT_MAX_PORTS; i++) {
+        if (transports[i]) transport_close(transports[i]->app_fd);
+    }
+}
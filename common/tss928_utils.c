@@ -3,6 +3,9 @@
  * Author:   Bruce Dearing
  * Date:     16/01/2026
  * Purpose:  Implementation of BTD-300-specific logic.
+ * Mods:     14/10/2026 StrikeBin rows of running totals from an Arena, aged with
+ *           SSE2/NEON row differences.
+ *           14/10/2026 Added TSS928_record_storm().
  */
 
 #include <stdio.h>
@@ -10,6 +13,12 @@
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "crc_utils.h"
 #include "tss928_utils.h"
 
@@ -20,10 +29,13 @@
  * 				 all members (serial, baud, modules, etc.) to default factory values.
  * Arguments:    ptr - A pointer to a pointer of type ptb330_sensor, used to
  * 				 return the address of the allocated memory.
+ * 				 arena - Where the strike history is allocated.
+ * 				 history_mins - Minutes of one minute strike bins to keep, at
+ * 				 least MAX_AGING_MINS.
  *
  * Output:       An allocated and populated ptb330_sensor structure.
  * Modifies:     Allocates memory on the heap and updates the provided pointer.
- * Returns:      0 on success, -1 if memory allocation fails.
+ * Returns:      0 on success, -1 if memory allocation fails or history_mins is out of range.
  * Assumptions:  The provided ptr is a valid address of a pointer.
  *
  * Bugs:         None known.
@@ -31,11 +43,15 @@
  * 				 the initial date string.
  *				 Must be freed by the caller.
  */
-int init_TSS928_sensor(TSS928_sensor **ptr) {
+int init_TSS928_sensor(TSS928_sensor **ptr, Arena *arena, uint32_t history_mins) {
     *ptr = malloc(sizeof(TSS928_sensor));
     if (!*ptr) return -1;
     TSS928_sensor *s = *ptr;
-	memset(&s->strikes, 0, sizeof(s->strikes));
+	if (strike_bin_init(&s->strikes, arena, history_mins, SECONDS_IN_MIN) != 0) {
+		free(s);
+		*ptr = NULL;
+		return -1;
+	}
 	// Identity
 	strncpy(s->serial_number, "000008675309", MAX_SN_LEN);
 	strncpy(s->loader_version, "TSS928 Loader Version 1.5", MAX_UNIT_STR);
@@ -50,8 +66,6 @@ int init_TSS928_sensor(TSS928_sensor **ptr) {
     s->near = 10; // sets the overhead lightning limit to 20 NM or 3704 decametres
     s->distant = 30; // sets the overhead lightning limit to 30 NM or 5556 decametres
 	s->rotation_angle = 120;
-	s->strikes.aging_interval = 15;
-	s->strikes.current_minute_index = 0;
     s->strikes.total_strikes_since_reset = 0; // Stores the total strikes since the system has been running.
 
 	// Timing
@@ -93,6 +107,130 @@ bool TSS928_is_ready_to_send(TSS928_sensor *sensor) {
     return false;
 }
 
+/*
+ * Name:         row_difference()
+ * Purpose:      Subtracts one StrikeRow from another, counter by counter.
+ * Arguments:    out - Receives a - b, may be a or b.
+ *               a - The later running totals.
+ *               b - The earlier running totals.
+ * Output:       NIL.
+ * Returns:      NIL.
+ * Modifies:     out.
+ * Assumptions:  All three rows are 16 byte aligned, as StrikeRow is.
+ *
+ * Bugs:         None known.
+ * Notes:        Five SSE2 or NEON subtractions, 32 bit wrap-around is what makes
+ *               the difference of two wrapped running totals exact.
+ */
+static void row_difference(StrikeRow *out, const StrikeRow *a, const StrikeRow *b) {
+#if defined(__SSE2__)
+	for (int i = 0; i < STRIKE_CELLS; i += 4) {
+		__m128i x = _mm_load_si128((const __m128i *)&a->cell[i]);
+		__m128i y = _mm_load_si128((const __m128i *)&b->cell[i]);
+		_mm_store_si128((__m128i *)&out->cell[i], _mm_sub_epi32(x, y));
+	}
+#elif defined(__ARM_NEON)
+	for (int i = 0; i < STRIKE_CELLS; i += 4) {
+		vst1q_u32(&out->cell[i], vsubq_u32(vld1q_u32(&a->cell[i]), vld1q_u32(&b->cell[i])));
+	}
+#else
+	for (int i = 0; i < STRIKE_CELLS; i++) out->cell[i] = a->cell[i] - b->cell[i];
+#endif
+}
+
+/*
+ * Name:         strike_bin_init()
+ * Purpose:      Allocates the history of a StrikeBin and clears it.
+ * Arguments:    bin - The StrikeBin to initialize.
+ *               arena - Where the history rows are allocated.
+ *               history_slots - Number of slots kept, the longest window strike_bin_window() can sum.
+ *               slot_seconds - Length of one slot, a divisor of 60: 60 for minute bins, 1 for second bins.
+ * Output:       NIL.
+ * Returns:      0 on success, -1 with errno set to EINVAL if the history cannot hold
+ *               MAX_AGING_MINS or slot_seconds does not divide a minute, or ENOMEM
+ *               if the arena is full.
+ * Modifies:     bin, takes (history_slots + 1) * sizeof(StrikeRow) bytes from arena.
+ * Assumptions:  The arena is not used by another thread at the same time.
+ *
+ * Bugs:         None known.
+ * Notes:        The aging interval starts at 15 minutes, the TSS928 default.
+ */
+int strike_bin_init(StrikeBin *bin, Arena *arena, uint32_t history_slots, uint32_t slot_seconds) {
+	memset(bin, 0, sizeof(*bin));
+	if (slot_seconds == 0 || SECONDS_IN_MIN % slot_seconds != 0 ||
+		history_slots < MAX_AGING_MINS * (SECONDS_IN_MIN / slot_seconds) || history_slots >= UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	bin->history = arena_alloc(arena, ((size_t)history_slots + 1) * sizeof(StrikeRow), _Alignof(StrikeRow));
+	if (!bin->history) return -1;
+	bin->history_slots = history_slots;
+	bin->slot_seconds = slot_seconds;
+	strike_bin_clear(bin);
+	strike_bin_set_aging(bin, 15);
+	return 0;
+}
+
+/*
+ * Name:         strike_bin_clear()
+ * Purpose:      Zeroes every count in a StrikeBin.
+ * Arguments:    bin - An initialized StrikeBin.
+ * Output:       NIL.
+ * Returns:      NIL.
+ * Modifies:     bin->history, bin->totals, bin->current_slot, bin->total_strikes_since_reset.
+ * Assumptions:  strike_bin_init() succeeded on bin.
+ *
+ * Bugs:         None known.
+ * Notes:        The history rows and the aging interval are kept.
+ */
+void strike_bin_clear(StrikeBin *bin) {
+	memset(bin->history, 0, ((size_t)bin->history_slots + 1) * sizeof(StrikeRow));
+	memset(&bin->totals, 0, sizeof(bin->totals));
+	bin->current_slot = 0;
+	bin->total_strikes_since_reset = 0;
+}
+
+/*
+ * Name:         strike_bin_window()
+ * Purpose:      Sums every counter over the last slots slots, the current one included.
+ * Arguments:    bin - An initialized StrikeBin.
+ *               slots - Window length, clamped to bin->history_slots.
+ *               out - Receives the counts.
+ * Output:       NIL.
+ * Returns:      NIL.
+ * Modifies:     out.
+ * Assumptions:  strike_bin_init() succeeded on bin.
+ *
+ * Bugs:         None known.
+ * Notes:        One row difference whatever the window, e.g. the last 24 hours of a
+ *               second binned history.
+ */
+void strike_bin_window(const StrikeBin *bin, uint32_t slots, StrikeRow *out) {
+	uint32_t rows = bin->history_slots + 1;
+	if (slots > bin->history_slots) slots = bin->history_slots;
+	uint32_t before = (bin->current_slot + rows - slots) % rows; // End of the slot before the window.
+	row_difference(out, &bin->history[bin->current_slot], &bin->history[before]);
+}
+
+/*
+ * Name:         strike_bin_set_aging()
+ * Purpose:      Sets the aging interval and recounts the totals over it.
+ * Arguments:    bin - An initialized StrikeBin.
+ *               minutes - 5, 10, 15 or 30.
+ * Output:       NIL.
+ * Returns:      NIL.
+ * Modifies:     bin->aging_interval, bin->window_slots, bin->totals.
+ * Assumptions:  minutes is at most MAX_AGING_MINS.
+ *
+ * Bugs:         None known.
+ * Notes:        The totals change at once, from the history already recorded.
+ */
+void strike_bin_set_aging(StrikeBin *bin, uint8_t minutes) {
+	bin->aging_interval = minutes;
+	bin->window_slots = (uint32_t)minutes * (SECONDS_IN_MIN / bin->slot_seconds);
+	strike_bin_window(bin, bin->window_slots, &bin->totals);
+}
+
 /*
  * Name:         record_ground_strike()
  * Purpose:      Record the number of strikes/flashes of Cloud-Ground lightning.
@@ -101,8 +239,8 @@ bool TSS928_is_ready_to_send(TSS928_sensor *sensor) {
  * 		         quadrant_index - the uint8_t representing the quadrant of the strike 0/N,1/NE,2/E,3/SE,4/S,5/SW,6/W,7/NW.
  *				 strike_count - the number of strikes/flashes to record during this interval.
  * Output:       NIL.
- * Modifies:     ground_history[][][].
- *				 ground_total[][].
+ * Modifies:     history[current_slot].ground[][].
+ *				 totals.ground[][].
  * Returns:      NIL.
  * Assumptions:  The provided bin is a valid address of a StrikeBin * pointer, and the ring_index, and quadrant_index are within range.
  *
@@ -111,8 +249,8 @@ bool TSS928_is_ready_to_send(TSS928_sensor *sensor) {
  *
  */
 void record_ground_strike(StrikeBin *bin, uint8_t ring_index, uint8_t quadrant_index, uint8_t strike_count){
-	bin->ground_history[ring_index][quadrant_index][bin->current_minute_index]+= strike_count;
-	bin->ground_totals[ring_index][quadrant_index]+= strike_count;
+	bin->history[bin->current_slot].ground[ring_index][quadrant_index]+= strike_count;
+	bin->totals.ground[ring_index][quadrant_index]+= strike_count;
 }
 
 /*
@@ -122,8 +260,8 @@ void record_ground_strike(StrikeBin *bin, uint8_t ring_index, uint8_t quadrant_i
  *				 strike_count - the number of strikes/flashes to record during this interval.
  * Output:       NIL.
  * Returns:      NIL.
- * Modifies:     overhead_history[]
- *				 overhead_total
+ * Modifies:     history[current_slot].overhead
+ *				 totals.overhead
  * Assumptions:  The provided bin is a valid address of a StrikeBin * pointer.
  *
  * Bugs:         None known.
@@ -131,8 +269,8 @@ void record_ground_strike(StrikeBin *bin, uint8_t ring_index, uint8_t quadrant_i
  *
  */
 void record_overhead_strike(StrikeBin *bin, uint8_t strike_count){
-	bin->overhead_history[bin->current_minute_index]+= strike_count;
-	bin->overhead_total+= strike_count;
+	bin->history[bin->current_slot].overhead+= strike_count;
+	bin->totals.overhead+= strike_count;
 }
 
 
@@ -143,8 +281,8 @@ void record_overhead_strike(StrikeBin *bin, uint8_t strike_count){
  *				 strike_count - the number of strikes/flashes to record during this interval.
  * Output:       NIL.
  * Returns:      NIL.
- * Modifies:     cloud_history[]
- *				 cloud_total
+ * Modifies:     history[current_slot].cloud
+ *				 totals.cloud
  * Assumptions:  The provided bin is a valid address of a StrikeBin * pointer.
  *
  * Bugs:         None known.
@@ -152,42 +290,64 @@ void record_overhead_strike(StrikeBin *bin, uint8_t strike_count){
  *
  */
 void record_cloud_strike(StrikeBin *bin, uint8_t strike_count){
-	bin->cloud_history[bin->current_minute_index]+= strike_count;
-	bin->cloud_total+= strike_count;
+	bin->history[bin->current_slot].cloud+= strike_count;
+	bin->totals.cloud+= strike_count;
 }
 
 
 /*
- * Name:         advance_one_minute()
- * Purpose:      Advance the circular bin array storing strike/flash counts.
+ * Name:         strike_bin_advance()
+ * Purpose:      Starts the next slot, ageing out the oldest slot of the aging interval.
  * Arguments:    bin - A StrikeBin struct containing a cicular bin of the strikes up to the aging interval.
  * Output:       NIL.
  * Returns:      NIL.
- * Modifies:     cloud_history[]
- *				 cloud_total
+ * Modifies:     bin->current_slot, the row it moves to.
+ *				 bin->totals
  * Assumptions:  The provided bin is a valid address of a StrikeBin * pointer.
  *
  * Bugs:         None known.
- * Notes:
- *
+ * Notes:        A row copy and a row difference, whatever the history length; the
+ *               slot being overwritten is the oldest one kept.
  */
-void advance_one_minute(StrikeBin *bin){
-	uint8_t stale_index = bin->current_minute_index; // Set the stale index to the current minute index.
+void strike_bin_advance(StrikeBin *bin){
+	uint32_t next = (bin->current_slot + 1) % (bin->history_slots + 1);
+	bin->history[next] = bin->history[bin->current_slot]; // Nothing recorded yet in the new slot.
+	bin->current_slot = next;
+	strike_bin_window(bin, bin->window_slots, &bin->totals);
+}
+
 
-	for (int i = 0; i < RANGE_RINGS; i++) {
-		for (int j = 0; j < QUADRANTS; j++) {
-			bin->ground_totals[i][j] -= bin->ground_history[i][j][stale_index]; // loop through and subtract the stale bin from the totals
-			bin->ground_history[i][j][stale_index] = 0; // zero out the stale bin.
+/*
+ * Name:         TSS928_record_storm()
+ * Purpose:      Records generated storm flashes into the sensor's strike bins.
+ * Arguments:    sensor - A TSS-928 sensor struct.
+ *               flashes - Flashes from storm_step().
+ *               count - Number of flashes.
+ * Output:       NIL.
+ * Returns:      NIL.
+ * Modifies:     sensor->strikes.
+ * Assumptions:  The caller holds the lock guarding sensor->strikes.
+ *
+ * Bugs:         None known.
+ * Notes:        Cloud-Ground flashes within the overhead limit count as OVHD,
+ *               within the near limit in the NEAR ring and within the distant
+ *               limit in the DIST ring, by 45 degree quadrant of bearing.
+ *               Intracloud flashes within the distant limit count as CLOUD.
+ *               Anything further out is not detected.
+ */
+void TSS928_record_storm(TSS928_sensor *sensor, const StormFlash *flashes, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		double nm = flashes[i].distance_km / STORM_KM_PER_NM;
+		if (nm > sensor->distant) continue;
+		if (!flashes[i].cloud_to_ground) {
+			record_cloud_strike(&sensor->strikes, 1);
+		} else if (nm <= sensor->overhead) {
+			record_overhead_strike(&sensor->strikes, 1);
+		} else {
+			uint8_t quadrant = (uint8_t)((int)((flashes[i].bearing_deg + 22.5f) / 45.0f) % QUADRANTS);
+			record_ground_strike(&sensor->strikes, nm <= sensor->near ? NEAR : DIST, quadrant, 1);
 		}
 	}
-
-	bin->overhead_total -= bin->overhead_history[stale_index];
-	bin->overhead_history[stale_index] = 0;
-
-	bin->cloud_total -= bin->cloud_history[stale_index];
-	bin->cloud_history[stale_index] = 0;
-
-	bin->current_minute_index = (bin->current_minute_index + 1) % bin->aging_interval;
 }
 
 
@@ -223,7 +383,7 @@ void conduct_self_test(TSS928_sensor *sensor) {
  *
  */
 void reset_sensor(TSS928_sensor *sensor) {
-	memset(&sensor->strikes, 0, sizeof(sensor->strikes)); // zero out the strike struct
+	strike_bin_clear(&sensor->strikes); // zero out the strike counts, the aging interval is kept
 	clock_gettime(CLOCK_MONOTONIC, &sensor->sensor_start_time); // Reset the runtime of the sensor.
 }
 
@@ -280,5 +440,5 @@ int update_sensor_time(const char *time_str, struct tm *sensor_time) {
 */
 void restore_sensor(TSS928_sensor *sensor) {
 	sensor->rotation_angle = 0;
-	sensor->strikes.aging_interval = 15;
+	strike_bin_set_aging(&sensor->strikes, 15);
 }
@@ -0,0 +1,369 @@
+/*
+ * File:     upsample_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Lazy interpolating upsampler over a replay source, see
+ *           upsample_utils.h.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include "console_utils.h"
+#include "upsample_utils.h"
+
+#define NS_PER_SEC 1000000000LL
+
+/*
+ * Name:         upsample_parse_options
+ * Purpose:      Removes --upsample, --noise and --seed from argv so the positional
+ *               arguments of an emulator keep their place.
+ * Arguments:    argc - Address of argc, reduced by the options removed.
+ *               argv - Argument vector, compacted in place.
+ *               opts - Receives the options, upsampling off when none are given.
+ *
+ * Output:       Error message to stderr on a malformed option.
+ * Modifies:     argc, argv, opts.
+ * Returns:      0 on success, -1 on a malformed option.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors replay_parse_options(). --upsample alone is cubic, and
+ *               --noise or --seed alone turns on linear.
+ */
+int upsample_parse_options(int *argc, char **argv, UpsampleOptions *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->seed = UPSAMPLE_SEED_DEFAULT;
+    bool given = false;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *names[] = { "--upsample", "--noise", "--seed" };
+        const char *value = NULL;
+        int which = -1;
+
+        if (strcmp(argv[i], "--upsample") == 0 &&
+                (i + 1 >= *argc || (strcasecmp(argv[i + 1], "linear") != 0 && strcasecmp(argv[i + 1], "cubic") != 0))) {
+            opts->mode = UPSAMPLE_CUBIC; // Bare, the next argument is not a mode.
+            continue;
+        }
+        for (int k = 0; k < 3 && which < 0; k++) {
+            size_t n = strlen(names[k]);
+            if (strncmp(argv[i], names[k], n) != 0) continue;
+            if (argv[i][n] == '=') {
+                value = argv[i] + n + 1;
+                which = k;
+            } else if (argv[i][n] == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+                which = k;
+            }
+        }
+        if (which < 0) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        if (which == 0) {
+            if (strcasecmp(value, "linear") == 0) opts->mode = UPSAMPLE_LINEAR;
+            else if (strcasecmp(value, "cubic") == 0) opts->mode = UPSAMPLE_CUBIC;
+            else {
+                fprintf(stderr, "Invalid --upsample '%s': use linear or cubic\n", value);
+                return -1;
+            }
+        } else if (which == 1) {
+            char *end;
+            opts->noise = strtod(value, &end);
+            if (end == value || *end != '\0' || !(opts->noise >= 0.0)) {
+                fprintf(stderr, "Invalid --noise '%s': use a factor such as 1 or 0.5\n", value);
+                return -1;
+            }
+            given = true;
+        } else {
+            char *end;
+            opts->seed = strtoull(value, &end, 0);
+            if (end == value || *end != '\0') {
+                fprintf(stderr, "Invalid --seed '%s': use a whole number\n", value);
+                return -1;
+            }
+            given = true;
+        }
+    }
+    if (given && opts->mode == UPSAMPLE_OFF) opts->mode = UPSAMPLE_LINEAR;
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+ * Name:         next_random
+ * Purpose:      Steps the xorshift64* generator.
+ * Returns:      64 random bits.
+ */
+static uint64_t next_random(Upsampler *u) {
+    u->rng ^= u->rng >> 12;
+    u->rng ^= u->rng << 25;
+    u->rng ^= u->rng >> 27;
+    return u->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Name:         next_normal
+ * Purpose:      A standard normal deviate, by Box-Muller.
+ * Returns:      The deviate.
+ */
+static double next_normal(Upsampler *u) {
+    if (u->have_spare) {
+        u->have_spare = false;
+        return u->spare;
+    }
+    double a = ((double)(next_random(u) >> 11) + 1.0) / 9007199254740993.0; // (0, 1], log() needs it above zero.
+    double b = (double)(next_random(u) >> 11) / 9007199254740992.0;
+    double r = sqrt(-2.0 * log(a));
+    u->spare = r * sin(2.0 * M_PI * b);
+    u->have_spare = true;
+    return r * cos(2.0 * M_PI * b);
+}
+
+// Reads a field of a record as a double.
+static double read_field(const unsigned char *record, const UpsampleField *f) {
+    const unsigned char *p = record + f->offset;
+    switch (f->type) {
+        case UPSAMPLE_FLOAT: { float v; memcpy(&v, p, sizeof(v)); return v; }
+        case UPSAMPLE_BEARING: { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+        default: { double v; memcpy(&v, p, sizeof(v)); return v; }
+    }
+}
+
+// Stores v in a field, a bearing rounded and wrapped to 0-359.
+static void write_field(unsigned char *record, const UpsampleField *f, double v) {
+    unsigned char *p = record + f->offset;
+    switch (f->type) {
+        case UPSAMPLE_FLOAT: { float x = (float)v; memcpy(p, &x, sizeof(x)); break; }
+        case UPSAMPLE_BEARING: {
+            long deg = lround(v) % 360;
+            uint16_t x = (uint16_t)(deg < 0 ? deg + 360 : deg);
+            memcpy(p, &x, sizeof(x));
+            break;
+        }
+        default: memcpy(p, &v, sizeof(v)); break;
+    }
+}
+
+// The signed difference a - b on the circle, in (-180, 180].
+static double bearing_delta(double a, double b) {
+    double d = fmod(a - b, 360.0);
+    if (d > 180.0) d -= 360.0;
+    else if (d <= -180.0) d += 360.0;
+    return d;
+}
+
+/*
+ * Name:         interpolate
+ * Purpose:      Produces one output record at u of the way from window[1] to window[2].
+ * Arguments:    up - The upsampler.
+ *               u - The fraction, 0 to 1.
+ *               out - Receives the record.
+ * Returns:      None.
+ * Notes:        A bearing's neighbours are unwrapped about window[1] first,
+ *               so 350 to 10 passes through 0 rather than 180.
+ */
+static void interpolate(Upsampler *up, double u, unsigned char *out) {
+    const size_t rs = up->record_size;
+    memcpy(out, up->window + rs, rs);
+
+    for (int i = 0; i < up->field_count; i++) {
+        const UpsampleField *f = &up->fields[i];
+        double p[UPSAMPLE_WINDOW];
+        for (int k = 0; k < UPSAMPLE_WINDOW; k++) p[k] = read_field(up->window + (size_t)k * rs, f);
+        if (f->type == UPSAMPLE_BEARING) {
+            p[0] = p[1] + bearing_delta(p[0], p[1]);
+            p[2] = p[1] + bearing_delta(p[2], p[1]);
+            p[3] = p[2] + bearing_delta(p[3], p[2]);
+        }
+
+        double v;
+        if (up->mode == UPSAMPLE_CUBIC) { // Catmull-Rom through p[1] and p[2].
+            v = 0.5 * (2.0 * p[1] + (p[2] - p[0]) * u
+                       + (2.0 * p[0] - 5.0 * p[1] + 4.0 * p[2] - p[3]) * u * u
+                       + (3.0 * (p[1] - p[2]) + p[3] - p[0]) * u * u * u);
+        } else {
+            v = p[1] + (p[2] - p[1]) * u;
+        }
+        if (up->noise > 0.0 && f->noise > 0.0) v += next_normal(up) * f->noise * up->noise;
+        if (f->min < f->max) v = v < f->min ? f->min : (v > f->max ? f->max : v);
+        write_field(out, f, v);
+    }
+}
+
+/*
+ * Name:         fetch_into
+ * Purpose:      Reads the next record into a window slot, holding the previous one if there is none.
+ * Returns:      true if a record was read.
+ */
+static bool fetch_into(Upsampler *u, int slot) {
+    unsigned char *dst = u->window + (size_t)slot * u->record_size;
+    if (u->fetch(dst, u->ctx)) {
+        u->fetched++;
+        return true;
+    }
+    if (slot > 0) memcpy(dst, dst - u->record_size, u->record_size);
+    u->held++;
+    return false;
+}
+
+/*
+ * Name:         prime
+ * Purpose:      Fills the window from the source with window[1] at now.
+ * Returns:      true if at least one record was read.
+ * Notes:        window[0] repeats window[1], there is nothing before the first record.
+ */
+static bool prime(Upsampler *u, int64_t now) {
+    if (!fetch_into(u, 1)) return false;
+    memcpy(u->window, u->window + u->record_size, u->record_size);
+    fetch_into(u, 2);
+    fetch_into(u, 3);
+    u->start_ns = now;
+    u->primed = true;
+    if (u->src) u->generation = replay_generation(u->src);
+    return true;
+}
+
+/*
+ * Name:         upsample_init
+ * Purpose:      Sets up an upsampler for one replay source.
+ * Arguments:    u - The upsampler.
+ *               opts - Options from upsample_parse_options().
+ *               record_size - sizeof(ParsedMessage) of the caller.
+ *               fields - The fields to interpolate, the rest are held.
+ *               field_count - Number of fields.
+ *               period_ns - Spacing of the data file's records.
+ *               fetch - Reads the next record.
+ *               ctx - Passed to fetch.
+ *               src - The replay source, its reloads re-prime the window, may be NULL.
+ *
+ * Output:       Error message to the console on failure.
+ * Modifies:     u.
+ * Returns:      0 on success or when upsampling is off, -1 on failure.
+ * Assumptions:  fields outlives u.
+ *
+ * Bugs:         None known.
+ * Notes:        Nothing is fetched until the first upsample_next(), so the
+ *               recording starts at the first message.
+ */
+int upsample_init(Upsampler *u, const UpsampleOptions *opts, size_t record_size, const UpsampleField *fields, int field_count,
+                  int64_t period_ns, UpsampleFetchFn fetch, void *ctx, const ReplaySource *src) {
+    memset(u, 0, sizeof(*u));
+    u->mode = UPSAMPLE_OFF;
+    if (opts->mode == UPSAMPLE_OFF) return 0;
+
+    u->window = calloc(UPSAMPLE_WINDOW, record_size);
+    if (!u->window) {
+        safe_console_error("Failed to allocate the upsampler window: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&u->mutex, NULL);
+    u->mode = opts->mode;
+    u->fields = fields;
+    u->field_count = field_count;
+    u->record_size = record_size;
+    u->period_ns = period_ns > 0 ? period_ns : NS_PER_SEC;
+    u->noise = opts->noise;
+    u->fetch = fetch;
+    u->ctx = ctx;
+    u->src = src;
+    u->rng = opts->seed ^ 0x9E3779B97F4A7C15ULL; // Never zero for any seed a user types.
+    if (u->rng == 0) u->rng = 0x9E3779B97F4A7C15ULL;
+    return 0;
+}
+
+/*
+ * Name:         upsample_next
+ * Purpose:      Produces the record for now on the replay clock.
+ * Arguments:    u - The upsampler, set up by upsample_init().
+ *               out - Receives the record, record_size bytes.
+ *
+ * Output:       None.
+ * Modifies:     u, out, advances the replay cursor as the clock passes records.
+ * Returns:      true if out was filled, false if the source has given no record yet.
+ * Assumptions:  Upsampling is on.
+ *
+ * Bugs:         None known.
+ * Notes:        Every record now has passed is fetched in turn, so a gap in
+ *               polling leaves the recording where the clock says it is. A
+ *               source with nothing new, a --live feed between datagrams, holds
+ *               its last record and the output stays level.
+ */
+bool upsample_next(Upsampler *u, void *out) {
+    struct timespec ts;
+    replay_clock_now(&ts);
+    int64_t now = (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+
+    pthread_mutex_lock(&u->mutex);
+    if (u->primed && u->src && replay_generation(u->src) != u->generation) u->primed = false; // Reloaded, start on the new file.
+    if (!u->primed && !prime(u, now)) {
+        pthread_mutex_unlock(&u->mutex);
+        return false;
+    }
+
+    while (now - u->start_ns >= u->period_ns) {
+        memmove(u->window, u->window + u->record_size, (UPSAMPLE_WINDOW - 1) * u->record_size);
+        fetch_into(u, UPSAMPLE_WINDOW - 1);
+        u->start_ns += u->period_ns;
+    }
+    double frac = now > u->start_ns ? (double)(now - u->start_ns) / (double)u->period_ns : 0.0;
+    interpolate(u, frac, out);
+    u->outputs++;
+    pthread_mutex_unlock(&u->mutex);
+    return true;
+}
+
+/*
+ * Name:         upsample_report
+ * Purpose:      Prints the upsampler's counts at exit.
+ * Arguments:    u - The upsampler.
+ *               name - Program name for the line.
+ *
+ * Output:       One line on the console, none if upsampling was off.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+void upsample_report(const Upsampler *u, const char *name) {
+    if (u->mode == UPSAMPLE_OFF || u->outputs == 0) return;
+    safe_console_print("%s: %llu messages upsampled %s from %llu records, %llu held\n",
+                       name, (unsigned long long)u->outputs, u->mode == UPSAMPLE_CUBIC ? "cubic" : "linear",
+                       (unsigned long long)u->fetched, (unsigned long long)u->held);
+}
+
+/*
+ * Name:         upsample_close
+ * Purpose:      Frees the window.
+ * Arguments:    u - The upsampler.
+ *
+ * Output:       None.
+ * Modifies:     u, upsampling is off after.
+ * Returns:      None.
+ * Assumptions:  No thread is in upsample_next().
+ *
+ * Bugs:         None known.
+ * Notes:        Safe on an UPSAMPLE_INITIALIZER upsampler and when called twice.
+ */
+void upsample_close(Upsampler *u) {
+    if (u->mode == UPSAMPLE_OFF) return;
+    pthread_mutex_destroy(&u->mutex);
+    free(u->window);
+    u->window = NULL;
+    u->mode = UPSAMPLE_OFF;
+}
@@ -11,8 +11,14 @@
 #include <math.h>
 #include <ctype.h>
 #include "crc_utils.h"
+#include "replay_utils.h"
 #include "windobserver75_utils.h"
 
+// What --upsample interpolates, with the noise of each at --noise 1. Status and address hold.
+const UpsampleField WO75_upsample_fields[WO75_UPSAMPLE_FIELDS] = {
+	UPSAMPLE_FIELD(ParsedMessage, wind_direction, UPSAMPLE_BEARING, 2.0,  0.0, 0.0),   // Degrees, the short way round.
+	UPSAMPLE_FIELD(ParsedMessage, wind_speed,     UPSAMPLE_FLOAT,   0.05, 0.0, 999.99) // Data file units, never below calm or past %06.2f.
+};
 
 /*
  * Name:         init_WO75_sensor
@@ -46,7 +52,7 @@ int init_WO75_sensor(WO75_sensor **ptr) {
 	time_t now;
 	time(&now); // Get our current epoch time.
 	gmtime_r(&now, &s->sensor_time); // Store current epoch time in our tm struct.
-	clock_gettime(CLOCK_MONOTONIC, &s->last_send_time); // timespec time, for when the sensor sent last message.
+	replay_clock_now(&s->last_send_time); // timespec time, for when the sensor sent last message.
 	clock_gettime(CLOCK_MONOTONIC, &s->sensor_start_time); // timespec time for when the sensor initialized.
 	s->initialized = true;
     return 0;
@@ -77,3 +83,61 @@ bool WO75_is_ready_to_send(WO75_sensor *sensor) {
     if (sensor->mode == SMODE_M5) return true;
     return false;
 }
+
+/*
+ * Name:         WO75_parse_message
+ * Purpose:      Tokenizes a comma-delimited wind record and populates a ParsedMessage struct.
+ * Arguments:    msg: the raw input string to be parsed (modified by strtok_r).
+ * 				 p_msg: pointer to the struct where parsed data will be stored.
+ * 				 units: the unit character currently configured on the sensor.
+ *
+ * Output:       None.
+ * Modifies:     p_msg: overwrites with new data.
+ * 				 msg: the input string is modified (nulls inserted by strtok_r).
+ * Returns:      None
+ * Assumptions:  msg matches the data file format A,121,000.8,M,00
+ *
+ * Bugs:         None known.
+ * Notes:        Shared by the standalone emulator and the wxsensord personality.
+ */
+void WO75_parse_message(char *msg, ParsedMessage *p_msg, char units) {
+	memset(p_msg, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
+	char *saveptr; // Our place keeper in the msg string.
+	char *token; // Where we temporarily store each token.
+
+	if ((token = strtok_r(msg, ",", &saveptr))) p_msg->msg_address = (char)token[0]; // Sensor Address A-Z
+   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
+   	if ((token = NEXT_T)) p_msg->wind_direction = (uint16_t)atoi(token); 	// Wind Direction Polar
+   	if ((token = NEXT_T)) p_msg->wind_speed = (float)atof(token); 	// Wind Speed
+   	if ((token = NEXT_T)) p_msg->msg_status = (uint8_t)atoi(token); 	// Sensor Message Status 00, 60, or see Appendix K
+	#undef NEXT_T
+	p_msg->msg_units = units;
+}
+
+/*
+ * Name:         WO75_format_frame
+ * Purpose:      Builds a complete polar output frame <STX>...<ETX>XX<CR><LF>.
+ * Arguments:    p_msg: the parsed record to format.
+ * 				 buf: destination buffer.
+ * 				 buf_len: size of buf in bytes.
+ *
+ * Output:       None.
+ * Modifies:     buf.
+ * Returns:      Length of the frame in bytes, or -1 if buf is too small.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The XOR checksum covers the characters between STX and ETX.
+ */
+int WO75_format_frame(const ParsedMessage *p_msg, char *buf, size_t buf_len) {
+	if (buf_len < 8) return -1;
+	int len = snprintf(buf + 1, buf_len - 1, "%c,%03d,%06.2f,%c,%02d,",
+						p_msg->msg_address, p_msg->wind_direction, p_msg->wind_speed, p_msg->msg_units, p_msg->msg_status);
+	if (len < 0 || (size_t)len + 6 > buf_len) return -1; // STX + ETX + 2 hex + CR + LF
+
+	uint8_t cs = checksumXOR(buf + 1);
+	buf[0] = '\x02';
+	int tail = snprintf(buf + 1 + len, buf_len - 1 - (size_t)len, "\x03%02X\r\n", cs);
+	if (tail < 0) return -1;
+	return 1 + len + tail;
+}
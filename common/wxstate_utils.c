@@ -0,0 +1,385 @@
+/*
+ * File:     wxstate_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Shared memory weather state, see wxstate_utils.h.
+ *
+ *           The producer maps the segment read-write and publishes with
+ *           seqlock_write(), readers map it PROT_READ and copy a snapshot out
+ *           with seqlock_read(). Neither side takes a lock the other can hold,
+ *           so a stopped reader never delays the producer and a stalled
+ *           producer leaves its readers the last complete state.
+ *
+ *           wxstate_render() writes a state as one line of a sensor's data
+ *           file, in the units and field order that sensor's files use.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wxstate_utils.h"
+
+#define SKYVUE8_METRES_FLAG "8000" // Most significant alarm word with the heights-in-metres bit.
+
+/*
+ * Name:         segment_name
+ * Purpose:      Turns a state name into the "/NAME" shm_open() takes.
+ * Arguments:    name: the name, without a '/'.
+ * 				 out: receives the segment name, WXSTATE_NAME_MAX + 2 bytes.
+ *
+ * Returns:      0 on success, -1 with errno EINVAL for an empty, long or nested name.
+ */
+static int segment_name(const char *name, char *out) {
+    size_t len = strlen(name);
+    if (len == 0 || len > WXSTATE_NAME_MAX || strchr(name, '/')) {
+        errno = EINVAL;
+        return -1;
+    }
+    out[0] = '/';
+    memcpy(out + 1, name, len + 1);
+    return 0;
+}
+
+/*
+ * Name:         wxstate_create
+ * Purpose:      Creates, or takes over, the segment a producer publishes in.
+ * Arguments:    p: receives the mapping.
+ * 				 name: the state name, e.g. WXSTATE_NAME_DEFAULT.
+ *
+ * Output:       None.
+ * Modifies:     p, the segment header.
+ * Returns:      0 on success, -1 with errno set.
+ * Assumptions:  One producer per name at a time.
+ *
+ * Bugs:         None known.
+ * Notes:        A segment left by an earlier producer of this build keeps its
+ * 				 state and sequence, so mapped readers carry on. A sequence left
+ * 				 odd by a producer that died mid-publish is made even again, the
+ * 				 half-written state is replaced by the first wxstate_publish().
+ * 				 Anything else at the name is cleared and laid out afresh.
+ */
+int wxstate_create(WxStatePublisher *p, const char *name) {
+    memset(p, 0, sizeof(*p));
+    if (segment_name(name, p->name) != 0) return -1;
+
+    int fd = shm_open(p->name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ftruncate(fd, sizeof(WxStateSegment)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    WxStateSegment *seg = mmap(NULL, sizeof(WxStateSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping holds the segment.
+    if (seg == MAP_FAILED) return -1;
+
+    bool reuse = (size_t)st.st_size == sizeof(WxStateSegment) && memcmp(seg->magic, WXSTATE_MAGIC, 4) == 0 &&
+                 seg->version == WXSTATE_VERSION && seg->state_size == sizeof(WxState);
+    if (reuse) {
+        uint32_t seq = seqlock_sequence(&seg->lock);
+        if (seq & 1u) atomic_store_explicit(&seg->lock.seq, seq + 1, memory_order_release);
+    } else {
+        memset(seg, 0, sizeof(*seg));
+        seg->version = WXSTATE_VERSION;
+        seg->header_size = (uint16_t)offsetof(WxStateSegment, state);
+        seg->state_size = sizeof(WxState);
+        atomic_thread_fence(memory_order_release);
+        memcpy(seg->magic, WXSTATE_MAGIC, 4); // Last, a reader attaching meanwhile is refused rather than misled.
+    }
+    seg->pid = (int32_t)getpid();
+    p->seg = seg;
+    return 0;
+}
+
+/*
+ * Name:         wxstate_publish
+ * Purpose:      Publishes a new state to every reader.
+ * Arguments:    p: the producer's mapping.
+ * 				 state: the state to publish, copied.
+ *
+ * Output:       None.
+ * Modifies:     The segment's state and sequence.
+ * Returns:      None.
+ * Assumptions:  wxstate_create() succeeded. Called from one thread.
+ *
+ * Bugs:         None known.
+ * Notes:        Never blocks, see seqlock_write().
+ */
+void wxstate_publish(WxStatePublisher *p, const WxState *state) {
+    seqlock_write(&p->seg->lock, &p->seg->state, state, sizeof(WxState));
+}
+
+/*
+ * Name:         wxstate_destroy
+ * Purpose:      Unmaps the producer's segment.
+ * Arguments:    p: the producer's mapping.
+ * 				 unlink_segment: remove the name as well, readers then keep
+ * 				 the last state until they detach.
+ *
+ * Output:       None.
+ * Modifies:     p.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Safe on a publisher wxstate_create() failed on.
+ */
+void wxstate_destroy(WxStatePublisher *p, bool unlink_segment) {
+    if (p->seg) munmap(p->seg, sizeof(WxStateSegment));
+    if (unlink_segment && p->name[0]) shm_unlink(p->name);
+    p->seg = NULL;
+}
+
+/*
+ * Name:         wxstate_attach
+ * Purpose:      Maps a producer's segment read-only.
+ * Arguments:    name: the state name.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The view, malloc()ed, or NULL with errno set: ENOENT if no
+ * 				 producer has created the segment, EINVAL if it is from
+ * 				 another build.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Free with wxstate_detach().
+ */
+WxStateView *wxstate_attach(const char *name) {
+    WxStateView *v = calloc(1, sizeof(WxStateView));
+    if (!v) return NULL;
+    if (segment_name(name, v->name) != 0) goto fail;
+
+    int fd = shm_open(v->name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) goto fail;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        goto fail;
+    }
+    if ((size_t)st.st_size != sizeof(WxStateSegment)) {
+        close(fd);
+        errno = EINVAL;
+        goto fail;
+    }
+    const WxStateSegment *seg = mmap(NULL, sizeof(WxStateSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) goto fail;
+    if (memcmp(seg->magic, WXSTATE_MAGIC, 4) != 0 || seg->version != WXSTATE_VERSION || seg->state_size != sizeof(WxState)) {
+        munmap((void *)seg, sizeof(WxStateSegment));
+        errno = EINVAL;
+        goto fail;
+    }
+    v->seg = seg;
+    return v;
+
+fail:
+    {
+        int saved = errno;
+        free(v);
+        errno = saved;
+    }
+    return NULL;
+}
+
+/*
+ * Name:         wxstate_read
+ * Purpose:      Takes a consistent snapshot of the published state.
+ * Arguments:    v: the view.
+ * 				 out: receives the state.
+ *
+ * Output:       None.
+ * Modifies:     out.
+ * Returns:      false if nothing has been published yet, out is then unset.
+ * Assumptions:  None, safe from any thread.
+ *
+ * Bugs:         A producer killed in the few microseconds of a publish leaves
+ * 				 its readers waiting until a new producer takes the segment over.
+ * Notes:        See seqlock_read().
+ */
+bool wxstate_read(const WxStateView *v, WxState *out) {
+    if (seqlock_sequence(&v->seg->lock) == 0) return false;
+    seqlock_read(&v->seg->lock, out, &v->seg->state, sizeof(WxState));
+    return true;
+}
+
+/*
+ * Name:         wxstate_detach
+ * Purpose:      Unmaps a view and frees it.
+ * Arguments:    v: the view, may be NULL.
+ *
+ * Returns:      None.
+ */
+void wxstate_detach(WxStateView *v) {
+    if (!v) return;
+    munmap((void *)v->seg, sizeof(WxStateSegment));
+    free(v);
+}
+
+/*
+ * Name:         wxstate_flashes
+ * Purpose:      Copies out the flashes published since the last call.
+ * Arguments:    s: a snapshot from wxstate_read().
+ * 				 seen: the reader's cursor, WXSTATE_FLASHES_NEW before the first call.
+ * 				 out: receives the flashes in time order.
+ * 				 max: room in out.
+ *
+ * Output:       None.
+ * Modifies:     seen, out.
+ * Returns:      The number of flashes copied.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Flashes the ring has already overwritten, and any past max, are
+ * 				 skipped. A cursor ahead of the state, the first call or a
+ * 				 restarted producer, is moved to the newest flash.
+ */
+size_t wxstate_flashes(const WxState *s, uint64_t *seen, StormFlash *out, size_t max) {
+    if (*seen > s->flash_count) {
+        *seen = s->flash_count;
+        return 0;
+    }
+    uint64_t first = *seen;
+    if (s->flash_count - first > WXSTATE_FLASHES) first = s->flash_count - WXSTATE_FLASHES;
+    if (s->flash_count - first > max) first = s->flash_count - max;
+
+    size_t n = 0;
+    for (uint64_t i = first; i < s->flash_count; i++) out[n++] = s->flashes[i % WXSTATE_FLASHES];
+    *seen = s->flash_count;
+    return n;
+}
+
+/*
+ * Name:         present_weather
+ * Purpose:      Classifies the state as an AtmosVUE 30 present weather pair.
+ * Arguments:    s: the state.
+ * 				 metar: receives the METAR code.
+ *
+ * Returns:      The SYNOP code, one of those in synop_codes[].
+ */
+static int present_weather(const WxState *s, const char **metar) {
+    static const char *rain[] = { "-RA", "RA", "+RA" };
+    static const char *snow[] = { "-SN", "SN", "+SN" };
+
+    if (s->precip_rate_mmh >= 0.1) {
+        int level = s->precip_rate_mmh < 2.5 ? 0 : s->precip_rate_mmh < 10.0 ? 1 : 2;
+        bool frozen = s->temperature_c <= 0.0;
+        *metar = frozen ? snow[level] : rain[level];
+        return (frozen ? 71 : 61) + level;
+    }
+    if (s->visibility_m < 1000.0) {
+        *metar = "FG";
+        return 30;
+    }
+    if (s->visibility_m < 5000.0) {
+        *metar = s->humidity_pct >= 80.0 ? "BR" : "HZ";
+        return s->humidity_pct >= 80.0 ? 10 : 4;
+    }
+    *metar = "NSW";
+    return 0;
+}
+
+/*
+ * Name:         render_skyvue8
+ * Purpose:      Writes a state as a SkyVUE8 data line, heights in metres.
+ * Arguments:    s: the state.
+ * 				 buf, buf_len: the destination.
+ *
+ * Returns:      snprintf()'s result.
+ */
+static int render_skyvue8(const WxState *s, char *buf, size_t buf_len) {
+    char heights[4][8];
+    char status = (char)('0' + (s->cloud_layers < WXSTATE_LAYERS ? s->cloud_layers : WXSTATE_LAYERS));
+    for (int i = 0; i < 4; i++) {
+        if ((unsigned)i < s->cloud_layers && i < WXSTATE_LAYERS) {
+            snprintf(heights[i], sizeof(heights[i]), "%05d", (int)lround(fmin(s->cloud_base_m[i], 99999.0)));
+        } else {
+            snprintf(heights[i], sizeof(heights[i]), "/////");
+        }
+    }
+    if (s->visibility_m < 200.0 && s->cloud_layers == 0) { // Fog to the ground, the first height is the vertical visibility.
+        status = '5';
+        snprintf(heights[0], sizeof(heights[0]), "%05d", (int)lround(s->visibility_m / 2.0));
+    }
+    int window = (int)lround(100.0 - fmin(s->precip_rate_mmh, 20.0)); // A wet window passes less.
+    return snprintf(buf, buf_len, "%c,0,%03d,%s,%s,%s,%s,%s,0000,0000", status, window,
+                    heights[0], heights[1], heights[2], heights[3], SKYVUE8_METRES_FLAG);
+}
+
+/*
+ * Name:         wxstate_render
+ * Purpose:      Writes a state as one line of a sensor's data file.
+ * Arguments:    s: a snapshot from wxstate_read().
+ * 				 sensor: the sensor, as given to replay_check_records() or replay_set_sensor().
+ * 				 buf: receives the NUL terminated line.
+ * 				 buf_len: size of buf.
+ *
+ * Output:       None.
+ * Modifies:     buf.
+ * Returns:      Length of the line, 0 for a sensor with no line format here.
+ * Assumptions:  buf_len is at least 1.
+ *
+ * Bugs:         None known.
+ * Notes:        The lines match the files in data_files/:
+ * 				 wind         A,DIR,SPEED,00 in m/s, as wind_data_M.txt.
+ * 				 ptb330       three transducers, their temperatures, no errors,
+ * 				              the average and the 3 hour trend as both trend and tendency.
+ * 				 dsp8100      the three transducer pressures.
+ * 				 rh_temp      the HC2 {F00rdd ...} answer, hc2s3 reads the same line.
+ * 				 pres_weather the 32 AtmosVUE 30 fields.
+ * 				 ceilometer   the SkyVUE8 line, see render_skyvue8().
+ * 				 rain         mm/h and the seconds until the next state.
+ * 				 The three barometer transducers read a few hundredths of a hPa
+ * 				 apart, as real ones do. The lightning sensors take flashes from
+ * 				 wxstate_flashes() instead of a line.
+ */
+size_t wxstate_render(const WxState *s, const char *sensor, char *buf, size_t buf_len) {
+    int n = 0;
+    buf[0] = '\0';
+
+    if (strcmp(sensor, "wind") == 0) {
+        int dir = (int)lround(s->wind_dir_deg) % 360;
+        n = snprintf(buf, buf_len, "A,%03d,%06.2f,00", dir < 0 ? dir + 360 : dir, s->wind_speed_ms);
+    } else if (strcmp(sensor, "ptb330") == 0) {
+        n = snprintf(buf, buf_len, "%.2f,%.2f,%.2f,%.1f,%.1f,%.1f,0,0,0,%.2f,%.2f,%.2f",
+                     s->pressure_hpa + 0.01, s->pressure_hpa - 0.01, s->pressure_hpa,
+                     s->temperature_c, s->temperature_c - 0.1, s->temperature_c + 0.1,
+                     s->pressure_hpa, s->trend_hpa, s->trend_hpa);
+    } else if (strcmp(sensor, "dsp8100") == 0) {
+        n = snprintf(buf, buf_len, "%.2f,%.2f,%.2f", s->pressure_hpa + 0.01, s->pressure_hpa - 0.01, s->pressure_hpa);
+    } else if (strcmp(sensor, "rh_temp") == 0 || strcmp(sensor, "hc2s3") == 0) {
+        n = snprintf(buf, buf_len, "{F00rdd 001;% .2f;%%RH;000;=;% .2f;°C;000;=;nc;---.-;°C;000; ;001;V1.7-1;0060568338;HC2-S3 ;000}",
+                     s->humidity_pct, s->temperature_c);
+    } else if (strcmp(sensor, "pres_weather") == 0) {
+        const char *metar;
+        int synop = present_weather(s, &metar);
+        double vis = fmin(fmax(s->visibility_m, 10.0), 100000.0);
+        n = snprintf(buf, buf_len, "14 0 0 4 %u M 1 %.2f 1 0 0 0 0 0 0 0 0 0 0 0 0 %.2f %.2f %d %s %.1f %d BLM %.1f 0 %d 1",
+                     (unsigned)lround(vis), 3000.0 / vis, s->precip_rate_mmh * 20.0, s->precip_rate_mmh, synop, metar,
+                     s->temperature_c, (int)lround(s->humidity_pct), s->luminance_cdm2, s->luminance_cdm2 < 50.0);
+    } else if (strcmp(sensor, "ceilometer") == 0) {
+        n = render_skyvue8(s, buf, buf_len);
+    } else if (strcmp(sensor, "rain") == 0) {
+        unsigned period_s = s->period_ms >= 1000 ? s->period_ms / 1000 : 1;
+        n = snprintf(buf, buf_len, "%.1f,%u", s->precip_rate_mmh, period_s);
+    }
+
+    if (n <= 0) {
+        buf[0] = '\0';
+        return 0;
+    }
+    return (size_t)n < buf_len ? (size_t)n : buf_len - 1;
+}
@@ -0,0 +1,620 @@
+/*
+ * File:     wxz_utils.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Block encoding and writer for .wxz replay caches, see wxz_utils.h.
+ *           replay_utils.c decodes the blocks, wxb_convert -z writes them.
+ *
+ *           A column starts with a byte: its transform times two, plus 1 if
+ *           its residuals are second differences rather than first. A float
+ *           or double column then has a byte of decimal places. The residuals
+ *           follow as varints. An even varint is one nonzero residual, zigzag
+ *           encoded and shifted up a bit; an odd one is a run of (v >> 1) + 1
+ *           zero residuals.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include "wxz_utils.h"
+#include "crc_utils.h"
+
+_Static_assert(sizeof(WxzHeader) == 80, "WxzHeader is an on-disk format");
+_Static_assert(sizeof(WxzBlock) == 16, "WxzBlock is an on-disk format");
+
+#define WXZ_WORD 4                  // Bytes per column.
+#define WXZ_VARINT_MAX 9            // Bytes of the longest token, a 57 bit decimal literal.
+#define WXZ_SCALE_MAX 6             // Most decimal places a float or double column is tried at.
+#define WXZ_DECIMAL_LIMIT 9007199254740992.0 // 2^53, scaled values at or past it are left raw.
+
+// How a column's values are taken from the record, the high bits of its first byte.
+enum { WXZ_RAW, WXZ_FLOAT, WXZ_DOUBLE };
+
+// Residual orders, the low bit of its first byte.
+enum { WXZ_DELTA, WXZ_DELTA2 };
+
+static const double powers_of_ten[WXZ_SCALE_MAX + 1] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+
+static size_t column_count(size_t record_size) {
+    return (record_size + WXZ_WORD - 1) / WXZ_WORD;
+}
+
+// Bytes one encoded column can take, a double column takes two columns' worth.
+static size_t column_bound(size_t rows) {
+    return 2 + rows * WXZ_VARINT_MAX;
+}
+
+/*
+ * Name:         load_word
+ * Purpose:      Reads column col of a record, zero padded past its end.
+ * Returns:      The word in host order.
+ */
+static uint32_t load_word(const unsigned char *record, size_t record_size, size_t col) {
+    uint32_t v = 0;
+    size_t at = col * WXZ_WORD;
+    size_t n = record_size - at < WXZ_WORD ? record_size - at : WXZ_WORD;
+    memcpy(&v, record + at, n);
+    return v;
+}
+
+/*
+ * Name:         store_word
+ * Purpose:      Writes column col of a record, dropping the padding past its end.
+ */
+static void store_word(unsigned char *record, size_t record_size, size_t col, uint32_t v) {
+    size_t at = col * WXZ_WORD;
+    size_t n = record_size - at < WXZ_WORD ? record_size - at : WXZ_WORD;
+    memcpy(record + at, &v, n);
+}
+
+/*
+ * Name:         load_decimal
+ * Purpose:      Reads the float or double at at as the integer it codes.
+ * Returns:      The value times 10^scale, rounded.
+ */
+static uint64_t load_decimal(const unsigned char *at, int transform, int scale) {
+    if (transform == WXZ_FLOAT) {
+        float f;
+        memcpy(&f, at, sizeof(f));
+        return (uint64_t)llround((double)f * powers_of_ten[scale]);
+    }
+    double d;
+    memcpy(&d, at, sizeof(d));
+    return (uint64_t)llround(d * powers_of_ten[scale]);
+}
+
+/*
+ * Name:         store_decimal
+ * Purpose:      Writes the float or double a decoded integer codes at at.
+ */
+static void store_decimal(unsigned char *at, int transform, int scale, uint64_t v) {
+    double d = (double)(int64_t)v / powers_of_ten[scale];
+    if (transform == WXZ_FLOAT) {
+        float f = (float)d;
+        memcpy(at, &f, sizeof(f));
+    } else {
+        memcpy(at, &d, sizeof(d));
+    }
+}
+
+/*
+ * Name:         decimal_scale
+ * Purpose:      Finds the fewest decimal places that hold every value of a
+ *               float or double column exactly.
+ * Arguments:    records: the block, rows records of record_size bytes.
+ *               col: the column, the first of two for a double.
+ *               transform: WXZ_FLOAT or WXZ_DOUBLE.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The scale, or -1 if some value does not come back bit for bit
+ *               at any scale up to WXZ_SCALE_MAX.
+ * Assumptions:  The column lies wholly inside the record.
+ *
+ * Bugs:         None known.
+ * Notes:        A reading parsed from "1013.25" is the double nearest 101325 / 100,
+ *               which is what the decoder's correctly rounded division gives
+ *               back. Anything that is not a float or double, or was computed
+ *               rather than parsed, fails the round trip and stays raw. So
+ *               does -0.0, and NaN.
+ */
+static int decimal_scale(const unsigned char *records, size_t record_size, size_t rows, size_t col, int transform) {
+    size_t width = transform == WXZ_FLOAT ? sizeof(float) : sizeof(double);
+    for (int scale = 0; scale <= WXZ_SCALE_MAX; scale++) {
+        size_t r = 0;
+        for (; r < rows; r++) {
+            const unsigned char *at = records + r * record_size + col * WXZ_WORD;
+            double v;
+            if (transform == WXZ_FLOAT) {
+                float f;
+                memcpy(&f, at, sizeof(f));
+                v = f;
+            } else {
+                memcpy(&v, at, sizeof(v));
+            }
+            if (!isfinite(v) || fabs(v) * powers_of_ten[scale] >= WXZ_DECIMAL_LIMIT) return -1;
+
+            unsigned char back[sizeof(double)];
+            store_decimal(back, transform, scale, load_decimal(at, transform, scale));
+            if (memcmp(back, at, width) != 0) break;
+        }
+        if (r == rows) return scale;
+    }
+    return -1;
+}
+
+static uint64_t zigzag(uint64_t v) {
+    return (v << 1) ^ (0 - (v >> 63));
+}
+
+static uint64_t unzigzag(uint64_t z) {
+    return (z >> 1) ^ (0 - (z & 1));
+}
+
+static size_t put_varint(unsigned char *out, size_t n, uint64_t v) {
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+/*
+ * Name:         get_varint
+ * Purpose:      Reads one varint token.
+ * Returns:      true with *v and *pos advanced, false if the token runs past
+ *               the end or is longer than any the encoder writes.
+ */
+static bool get_varint(const unsigned char *in, size_t len, size_t *pos, uint64_t *v) {
+    uint64_t value = 0;
+    for (int i = 0; i < WXZ_VARINT_MAX; i++) {
+        if (*pos >= len) return false;
+        unsigned char b = in[(*pos)++];
+        value |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            *v = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Name:         encode_column
+ * Purpose:      Encodes one column of a block one way.
+ * Arguments:    records: the block, rows records of record_size bytes.
+ *               col: the column.
+ *               transform: WXZ_RAW, WXZ_FLOAT or WXZ_DOUBLE.
+ *               scale: decimal places of a float or double, from decimal_scale().
+ *               order: WXZ_DELTA or WXZ_DELTA2.
+ *               out: receives at most column_bound(rows) bytes.
+ *
+ * Output:       None.
+ * Modifies:     out.
+ * Returns:      Bytes written.
+ * Assumptions:  rows is at most WXZ_BLOCK_RECORDS_MAX.
+ *
+ * Bugs:         None known.
+ * Notes:        Raw words difference modulo 2^32, so a wrapped difference
+ *               decodes back to the same word whatever the field's type, and
+ *               the residual is sign extended from 32 bits to stay short.
+ */
+static size_t encode_column(const unsigned char *records, size_t record_size, size_t rows, size_t col,
+                            int transform, int scale, int order, unsigned char *out) {
+    size_t n = 0;
+    out[n++] = (unsigned char)(transform << 1 | order);
+    if (transform != WXZ_RAW) out[n++] = (unsigned char)scale;
+
+    uint64_t prev = 0, prev_d = 0;
+    size_t zeros = 0;
+    for (size_t r = 0; r < rows; r++) {
+        const unsigned char *record = records + r * record_size;
+        uint64_t v = transform == WXZ_RAW ? load_word(record, record_size, col) : load_decimal(record + col * WXZ_WORD, transform, scale);
+        uint64_t d = v - prev;
+        uint64_t res = order == WXZ_DELTA2 ? d - prev_d : d;
+        if (transform == WXZ_RAW) res = (uint64_t)(int64_t)(int32_t)(uint32_t)res;
+        prev = v;
+        prev_d = d;
+
+        if (res == 0) {
+            zeros++;
+            continue;
+        }
+        if (zeros) n = put_varint(out, n, ((uint64_t)(zeros - 1) << 1) | 1);
+        zeros = 0;
+        n = put_varint(out, n, zigzag(res) << 1);
+    }
+    if (zeros) n = put_varint(out, n, ((uint64_t)(zeros - 1) << 1) | 1);
+    return n;
+}
+
+/*
+ * Name:         encode_best
+ * Purpose:      Encodes one column every way its transform allows, keeping the shortest.
+ * Arguments:    As encode_column(), scratch: column_bound(rows) bytes.
+ *
+ * Returns:      Bytes written to out.
+ */
+static size_t encode_best(const unsigned char *records, size_t record_size, size_t rows, size_t col,
+                          int transform, int scale, unsigned char *out, unsigned char *scratch) {
+    size_t best = encode_column(records, record_size, rows, col, transform, scale, WXZ_DELTA, out);
+    size_t second = encode_column(records, record_size, rows, col, transform, scale, WXZ_DELTA2, scratch);
+    if (second < best) {
+        memcpy(out, scratch, second);
+        best = second;
+    }
+    return best;
+}
+
+/*
+ * Name:         encode_single
+ * Purpose:      Encodes one column as raw words, or as a float if that is shorter.
+ * Arguments:    As encode_column(), scratch and alt: column_bound(rows) bytes each.
+ *
+ * Returns:      Bytes written to out.
+ */
+static size_t encode_single(const unsigned char *records, size_t record_size, size_t rows, size_t col,
+                            unsigned char *out, unsigned char *scratch, unsigned char *alt) {
+    size_t len = encode_best(records, record_size, rows, col, WXZ_RAW, 0, out, scratch);
+    int scale = (col + 1) * WXZ_WORD <= record_size ? decimal_scale(records, record_size, rows, col, WXZ_FLOAT) : -1;
+    if (scale >= 0) {
+        size_t f = encode_best(records, record_size, rows, col, WXZ_FLOAT, scale, alt, scratch);
+        if (f < len) {
+            memcpy(out, alt, f);
+            len = f;
+        }
+    }
+    return len;
+}
+
+/*
+ * Name:         wxz_encode_bound
+ * Purpose:      Returns the most bytes wxz_encode_block() can write for a block.
+ * Arguments:    record_size: bytes per record.
+ *               rows: records in the block.
+ *
+ * Returns:      The bound in bytes.
+ */
+size_t wxz_encode_bound(size_t record_size, size_t rows) {
+    return column_count(record_size) * column_bound(rows);
+}
+
+/*
+ * Name:         wxz_scratch_bound
+ * Purpose:      Returns the working space wxz_encode_block() needs for a block.
+ * Arguments:    rows: records in the block.
+ *
+ * Returns:      The size in bytes.
+ */
+size_t wxz_scratch_bound(size_t rows) {
+    return 2 * column_bound(rows);
+}
+
+/*
+ * Name:         wxz_encode_block
+ * Purpose:      Encodes a block of records, by column.
+ * Arguments:    records: rows records of record_size bytes.
+ *               record_size: bytes per record.
+ *               rows: records in the block, 1 to WXZ_BLOCK_RECORDS_MAX.
+ *               out: receives up to wxz_encode_bound() bytes.
+ *               scratch: wxz_scratch_bound() bytes of working space.
+ *
+ * Output:       None.
+ * Modifies:     out, scratch.
+ * Returns:      Bytes written to out.
+ * Assumptions:  The padding in every record is zeroed, as the parse functions' memset() leaves it.
+ *
+ * Bugs:         None known.
+ * Notes:        Each column is tried as raw words and, when every value in the
+ *               block survives it, as a float of a few decimal places; every 8
+ *               byte aligned pair of columns as a double too. Each of those is
+ *               tried in first differences, which suit readings that wander,
+ *               and second, which suit timestamps and counters that step by a
+ *               fixed amount. The shortest is kept, so the layout of the record
+ *               is never needed.
+ */
+size_t wxz_encode_block(const void *records, size_t record_size, size_t rows, unsigned char *out, unsigned char *scratch) {
+    const unsigned char *recs = records;
+    unsigned char *alt = scratch + column_bound(rows);
+    size_t n = 0;
+    size_t col = 0;
+
+    while (col < column_count(record_size)) {
+        size_t len = encode_single(recs, record_size, rows, col, out + n, scratch, alt);
+        int scale = col % 2 == 0 && (col + 2) * WXZ_WORD <= record_size ?
+                    decimal_scale(recs, record_size, rows, col, WXZ_DOUBLE) : -1;
+        if (scale < 0) {
+            n += len;
+            col++;
+            continue;
+        }
+
+        // Both halves one at a time, against the pair as a double.
+        len += encode_single(recs, record_size, rows, col + 1, out + n + len, scratch, alt);
+        size_t d = encode_best(recs, record_size, rows, col, WXZ_DOUBLE, scale, alt, scratch);
+        if (d < len) {
+            memcpy(out + n, alt, d);
+            len = d;
+        }
+        n += len;
+        col += 2;
+    }
+    return n;
+}
+
+/*
+ * Name:         wxz_decode_block
+ * Purpose:      Decodes a block written by wxz_encode_block().
+ * Arguments:    in: the encoded block.
+ *               in_len: its size.
+ *               records: receives rows records of record_size bytes.
+ *               record_size: bytes per record.
+ *               rows: records in the block.
+ *
+ * Output:       None.
+ * Modifies:     records.
+ * Returns:      0 on success, -1 with errno set to EINVAL if the block is
+ *               malformed or does not decode to exactly rows records.
+ * Assumptions:  None, in may be corrupt.
+ *
+ * Bugs:         None known.
+ * Notes:        Columns are written straight into the records, so the only
+ *               memory used is the caller's block. A block that decodes but
+ *               was damaged is caught by the caller's CRC.
+ */
+int wxz_decode_block(const unsigned char *in, size_t in_len, void *records, size_t record_size, size_t rows) {
+    unsigned char *out = records;
+    size_t pos = 0;
+    size_t col = 0;
+
+    while (col < column_count(record_size)) {
+        if (pos >= in_len) goto bad;
+        int transform = in[pos] >> 1;
+        int order = in[pos++] & 1;
+        int scale = 0;
+        size_t width = transform == WXZ_DOUBLE ? 2 : 1;
+        if (transform > WXZ_DOUBLE || (transform != WXZ_RAW && (col + width) * WXZ_WORD > record_size)) goto bad;
+        if (transform != WXZ_RAW) {
+            if (pos >= in_len || in[pos] > WXZ_SCALE_MAX) goto bad;
+            scale = in[pos++];
+        }
+
+        uint64_t prev = 0, prev_d = 0;
+        size_t r = 0;
+        while (r < rows) {
+            uint64_t token;
+            if (!get_varint(in, in_len, &pos, &token)) goto bad;
+
+            size_t run = 1;
+            uint64_t res = 0;
+            if (token & 1) {
+                if ((token >> 1) >= rows - r) goto bad; // Run past the end of the block.
+                run = (size_t)(token >> 1) + 1;
+            } else {
+                res = unzigzag(token >> 1);
+            }
+            for (; run > 0; run--, r++) {
+                uint64_t d = order == WXZ_DELTA2 ? prev_d + res : res;
+                prev += d;
+                prev_d = d;
+                if (transform == WXZ_RAW) store_word(out + r * record_size, record_size, col, (uint32_t)prev);
+                else store_decimal(out + r * record_size + col * WXZ_WORD, transform, scale, prev);
+            }
+        }
+        col += width;
+    }
+    if (pos != in_len) goto bad;
+    return 0;
+
+bad:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Name:         flush_block
+ * Purpose:      Encodes the records held by the writer and appends the block.
+ * Arguments:    w: the writer.
+ *
+ * Output:       None.
+ * Modifies:     The file, w->index, w->offset, w->rows.
+ * Returns:      0 on success, -1 with errno set.
+ * Assumptions:  w->rows is nonzero.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static int flush_block(WxzWriter *w) {
+    size_t bytes = wxz_encode_block(w->block, w->record_size, w->rows, w->encoded, w->scratch);
+
+    if (w->header.block_count == w->index_cap) {
+        size_t cap = w->index_cap ? w->index_cap * 2 : 64;
+        WxzBlock *index = realloc(w->index, cap * sizeof(WxzBlock));
+        if (!index) {
+            errno = ENOMEM;
+            return -1;
+        }
+        w->index = index;
+        w->index_cap = cap;
+    }
+
+    Crc16Context crc;
+    crc16_init(&crc, CRC16_XMODEM);
+    crc16_update(&crc, w->block, w->rows * w->record_size);
+
+    WxzBlock *b = &w->index[w->header.block_count];
+    memset(b, 0, sizeof(*b));
+    b->offset = w->offset;
+    b->size = (uint32_t)bytes;
+    b->checksum = crc16_final(&crc);
+
+    if (fwrite(w->encoded, 1, bytes, w->out) != bytes) return -1;
+    w->offset += bytes;
+    w->header.block_count++;
+    w->rows = 0;
+    return 0;
+}
+
+/*
+ * Name:         wxz_writer_open
+ * Purpose:      Starts a .wxz cache.
+ * Arguments:    w: the writer.
+ *               path: the cache to create or replace.
+ *               sensor: sensor name stored in the header.
+ *               record_size: bytes per record.
+ *               block_records: records per block, 0 for WXZ_BLOCK_RECORDS.
+ *               source: stat() of the text file the records come from, may be NULL.
+ *
+ * Output:       None.
+ * Modifies:     w, creates path.tmp.
+ * Returns:      0 on success, -1 with errno set.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The header is written last, by wxz_writer_close(), a cache that
+ *               was never closed keeps a zero magic and is not read.
+ */
+int wxz_writer_open(WxzWriter *w, const char *path, const char *sensor, size_t record_size, size_t block_records,
+                    const struct stat *source) {
+    memset(w, 0, sizeof(*w));
+    if (block_records == 0) block_records = WXZ_BLOCK_RECORDS;
+    if (record_size == 0 || record_size > REPLAY_LINE_MAX || block_records > WXZ_BLOCK_RECORDS_MAX ||
+        strlen(sensor) >= WXB_SENSOR_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (snprintf(w->path, sizeof(w->path), "%s", path) >= (int)sizeof(w->path) ||
+        snprintf(w->tmp_path, sizeof(w->tmp_path), "%s.tmp", path) >= (int)sizeof(w->tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    w->record_size = record_size;
+    w->block_records = block_records;
+    w->block = calloc(block_records, record_size);
+    w->encoded = malloc(wxz_encode_bound(record_size, block_records));
+    w->scratch = malloc(wxz_scratch_bound(block_records));
+    if (!w->block || !w->encoded || !w->scratch) {
+        wxz_writer_close(w, false);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    WxbHeader *base = &w->header.base;
+    base->version = WXZ_VERSION;
+    base->header_size = sizeof(WxzHeader);
+    base->byte_order = WXB_BYTE_ORDER;
+    base->record_size = (uint32_t)record_size;
+    strncpy(base->sensor, sensor, WXB_SENSOR_LEN - 1);
+    base->time_size = sizeof(time_t);
+    if (source) {
+        base->source_size = (uint64_t)source->st_size;
+        base->source_mtime = (int64_t)source->st_mtime;
+    }
+    w->header.block_records = (uint32_t)block_records;
+
+    w->out = fopen(w->tmp_path, "wb");
+    if (!w->out) {
+        int saved = errno;
+        wxz_writer_close(w, false);
+        errno = saved;
+        return -1;
+    }
+    WxzHeader blank = {0};
+    if (fwrite(&blank, sizeof(blank), 1, w->out) != 1) {
+        int saved = errno;
+        wxz_writer_close(w, false);
+        errno = saved;
+        return -1;
+    }
+    w->offset = sizeof(WxzHeader);
+    return 0;
+}
+
+/*
+ * Name:         wxz_writer_append
+ * Purpose:      Adds one record, writing out the block when it fills.
+ * Arguments:    w: the writer.
+ *               record: record_size bytes.
+ *
+ * Returns:      0 on success, -1 with errno set.
+ */
+int wxz_writer_append(WxzWriter *w, const void *record) {
+    memcpy(w->block + w->rows * w->record_size, record, w->record_size);
+    w->rows++;
+    w->header.base.record_count++;
+    return w->rows == w->block_records ? flush_block(w) : 0;
+}
+
+/*
+ * Name:         wxz_writer_close
+ * Purpose:      Finishes a .wxz cache and renames it into place, or abandons it.
+ * Arguments:    w: the writer.
+ *               commit: false to discard what was written.
+ *
+ * Output:       None.
+ * Modifies:     Replaces path, frees the writer's buffers.
+ * Returns:      0 on success, -1 with errno set, path is then left as it was.
+ * Assumptions:  w was set up by wxz_writer_open(), successfully or not.
+ *
+ * Bugs:         None known.
+ * Notes:        The last, short block is written, then the index on an 8 byte
+ *               boundary so a reader can use it in place, then the header.
+ *               The rename makes the new cache appear whole to an emulator
+ *               watching the path.
+ */
+int wxz_writer_close(WxzWriter *w, bool commit) {
+    int ok = commit && w->out != NULL;
+    if (ok && w->rows > 0) ok = flush_block(w) == 0;
+
+    if (ok) {
+        static const unsigned char pad[8];
+        size_t pad_len = (size_t)(-w->offset & 7);
+        w->header.index_offset = w->offset + pad_len;
+
+        Crc16Context crc;
+        crc16_init(&crc, CRC16_XMODEM);
+        crc16_update(&crc, w->index, w->header.block_count * sizeof(WxzBlock));
+        w->header.base.checksum = crc16_final(&crc);
+        memcpy(w->header.base.magic, WXZ_MAGIC, 4);
+
+        ok = fwrite(pad, 1, pad_len, w->out) == pad_len &&
+             (w->header.block_count == 0 || fwrite(w->index, sizeof(WxzBlock), w->header.block_count, w->out) == w->header.block_count) &&
+             fseek(w->out, 0, SEEK_SET) == 0 &&
+             fwrite(&w->header, sizeof(w->header), 1, w->out) == 1;
+    }
+    int saved = errno;
+    if (w->out && fclose(w->out) != 0) {
+        saved = errno;
+        ok = 0;
+    }
+    if (w->out) {
+        if (ok && rename(w->tmp_path, w->path) != 0) {
+            saved = errno;
+            ok = 0;
+        }
+        if (!ok) unlink(w->tmp_path);
+    }
+    w->out = NULL;
+
+    free(w->block);
+    free(w->encoded);
+    free(w->scratch);
+    free(w->index);
+    w->block = w->encoded = w->scratch = NULL;
+    w->index = NULL;
+
+    if (!ok && commit) {
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
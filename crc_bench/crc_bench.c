@@ -0,0 +1,189 @@
+/*
+ * File:     crc_bench.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Micro-benchmark for the CRC routines in common/crc_utils.c.
+ *           Times the table driven crc16() / crc16_ccitt() / incremental API against
+ *           the original bit-at-a-time implementations, kept here as the reference,
+ *           and checks that every result is bit identical before reporting.
+ *
+ *           Buffer sizes cover a WindObserver frame (32 B), the old 256 B limit and
+ *           a SkyVUE8 backscatter profile message (~10 KB).
+ *
+ * Usage:    crc_bench [seconds_per_case]   // default 0.5 seconds per case
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "crc_utils.h"
+
+#define DEFAULT_SECONDS 0.5
+#define MAX_BUFFER 16384
+
+static volatile uint32_t sink; // Keeps the compiler from discarding timed calls.
+
+/*
+ * Name:         legacy_crc16
+ * Purpose:      The bitwise CRC-16/GENIBUS crc16() shipped before the table version.
+ * Arguments:    buffer - the bytes to checksum.
+ *               length - the number of bytes.
+ *
+ * Returns:      The CRC value.
+ * Notes:        Without the old 256 byte limit, so large buffers can be compared.
+ */
+static unsigned short legacy_crc16(const char *buffer, int length) {
+    unsigned short crc = 0xFFFF;
+    unsigned short m;
+    for (int i = 0; i < length; ++i) {
+        crc ^= (unsigned char)buffer[i] << 8;
+        for (int j = 0; j < 8; ++j) {
+            m = (crc & 0x8000) ? 0x1021 : 0;
+            crc <<= 1;
+            crc ^= m;
+        }
+    }
+    return crc ^ 0xFFFF;
+}
+
+/*
+ * Name:         legacy_crc16_ccitt
+ * Purpose:      The bitwise CRC-16/XMODEM crc16_ccitt() shipped before the table version.
+ * Arguments:    data - the bytes to checksum.
+ *               length - the number of bytes.
+ *
+ * Returns:      The CRC value.
+ */
+static uint16_t legacy_crc16_ccitt(const uint8_t *data, size_t length) {
+    uint16_t crc = 0x0000;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int j = 0; j < 8; j++) {
+            if (crc & 0x8000) crc = (crc << 1) ^ 0x1021;
+            else crc <<= 1;
+        }
+    }
+    return crc;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// The function under test, one call over len bytes.
+typedef uint32_t (*crc_fn)(const uint8_t *buf, size_t len);
+
+static uint32_t run_legacy_crc16(const uint8_t *b, size_t n)  { return legacy_crc16((const char *)b, (int)n); }
+static uint32_t run_table_crc16(const uint8_t *b, size_t n)   { return crc16((char *)b, (int)n); }
+static uint32_t run_legacy_xmodem(const uint8_t *b, size_t n) { return legacy_crc16_ccitt(b, n); }
+static uint32_t run_table_xmodem(const uint8_t *b, size_t n)  { return crc16_ccitt(b, n); }
+
+/*
+ * Name:         run_incremental
+ * Purpose:      Checksums the buffer through init/update/final in 13 byte pieces, the
+ *               way a frame is checksummed while it is built field by field.
+ */
+static uint32_t run_incremental(const uint8_t *b, size_t n) {
+    Crc16Context ctx;
+    crc16_init(&ctx, CRC16_GENIBUS);
+    for (size_t off = 0; off < n; off += 13) {
+        crc16_update(&ctx, b + off, n - off < 13 ? n - off : 13);
+    }
+    return crc16_final(&ctx);
+}
+
+/*
+ * Name:         time_case
+ * Purpose:      Calls fn repeatedly for about seconds and returns the throughput.
+ * Arguments:    fn - the function under test.
+ *               buf, len - the input.
+ *               seconds - the time to spend.
+ *
+ * Returns:      Mebibytes per second.
+ */
+static double time_case(crc_fn fn, const uint8_t *buf, size_t len, double seconds) {
+    unsigned long calls = 0;
+    unsigned long batch = 1 + 65536 / len;
+    double start = now_seconds();
+    double elapsed;
+    do {
+        for (unsigned long i = 0; i < batch; i++) sink ^= fn(buf, len);
+        calls += batch;
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+    return ((double)calls * (double)len) / elapsed / (1024.0 * 1024.0);
+}
+
+/*
+ * Name:         verify
+ * Purpose:      Checks the table routines against the bitwise reference for every
+ *               length from 0 to MAX_BUFFER at a sample of offsets.
+ *
+ * Returns:      0 if every result matched, -1 otherwise.
+ */
+static int verify(const uint8_t *buf) {
+    for (size_t len = 0; len <= MAX_BUFFER; len += (len < 64 ? 1 : 61)) {
+        for (size_t off = 0; off < 8 && off + len <= MAX_BUFFER; off++) {
+            const uint8_t *p = buf + off;
+            if (len > 0 && run_table_crc16(p, len) != run_legacy_crc16(p, len)) {
+                fprintf(stderr, "crc16 mismatch at length %zu offset %zu\n", len, off);
+                return -1;
+            }
+            if (len > 0 && run_incremental(p, len) != run_legacy_crc16(p, len)) {
+                fprintf(stderr, "incremental crc16 mismatch at length %zu offset %zu\n", len, off);
+                return -1;
+            }
+            if (run_table_xmodem(p, len) != run_legacy_xmodem(p, len)) {
+                fprintf(stderr, "crc16_ccitt mismatch at length %zu offset %zu\n", len, off);
+                return -1;
+            }
+        }
+    }
+    // Published check values for "123456789".
+    if (crc16("123456789", 9) != 0xD64E || crc16_ccitt((const uint8_t *)"123456789", 9) != 0x31C3) {
+        fprintf(stderr, "check value mismatch\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = DEFAULT_SECONDS;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+        if (seconds <= 0.0) {
+            fprintf(stderr, "Usage: %s [seconds_per_case]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    static uint8_t buf[MAX_BUFFER + 8];
+    srand(1);
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)rand();
+
+    if (verify(buf) != 0) return EXIT_FAILURE;
+    printf("Results match the bitwise reference.\n\n");
+
+    static const size_t sizes[] = { 32, 256, 10240 };
+    printf("%-8s %-20s %12s %12s %9s\n", "bytes", "variant", "bitwise MB/s", "table MB/s", "speedup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        double a = time_case(run_legacy_crc16, buf, n, seconds);
+        double b = time_case(run_table_crc16, buf, n, seconds);
+        double c = time_case(run_incremental, buf, n, seconds);
+        double d = time_case(run_legacy_xmodem, buf, n, seconds);
+        double e = time_case(run_table_xmodem, buf, n, seconds);
+        printf("%-8zu %-20s %12.1f %12.1f %8.1fx\n", n, "crc16", a, b, b / a);
+        printf("%-8zu %-20s %12.1f %12.1f %8.1fx\n", n, "crc16 incremental", a, c, c / a);
+        printf("%-8zu %-20s %12.1f %12.1f %8.1fx\n", n, "crc16_ccitt", d, e, e / d);
+    }
+    return EXIT_SUCCESS;
+}
@@ -12,6 +12,8 @@
  *             Measurement Commands:
  *               R        - Get current pressure reading
  *               *R       - Get pressure reading with units
+ *               R9       - Emulator only: raw frequency and diode voltage behind R
+ *               *R9      - The same with units
  *
  *             Information Commands:
  *               I        - Get transducer identity and setup information
@@ -94,7 +96,29 @@
  *           - QFF: Local station pressure reduced to mean sea level
  *           - MSL: Mean sea level pressure
  *
- * Mods:
+ * Mods:     14/10/2026 The sender polls on a 10ms SendSchedule, and each sensor's
+ *                      window follows the last window rather than the last send.
+ *           14/10/2026 Addressed commands wait out the sensor's B interval before
+ *                      the reply, as on a multi-drop bus.
+ *           14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ *                      wait metrics on a UNIX socket. The bus wait is served
+ *                      before sensor_mutex is taken rather than while holding it.
+ *           14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 Each data file pressure is turned into a diaphragm
+ *                      frequency and diode voltage, and the pressure sent is
+ *                      compensated back from them through the coefficient table,
+ *                      for the whole bus in one batch.
+ *           14/10/2026 A data file of wxstate://NAME reads the pressures from the
+ *                      shared weather state, see wxstate/.
+ *           14/10/2026 --state PATH keeps each sensor's settings and the replay
+ *                      position over a restart, see persist_utils.h.
+ *           14/10/2026 R1 and R2 are unimplemented again, as a DPS has them. The
+ *                      raw readings are sent by R9, an emulator command.
  *
  */
 
@@ -113,8 +137,13 @@
 #include "dsp8100_utils.h"
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "crc_utils.h"
+#include "schedule_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+#include "persist_utils.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B9600	     // Adjust as needed, main has logic to take arguments for a new baud rate
@@ -124,11 +153,14 @@
 #define MIN_TRANS_INTERVAL 0.0f
 #define MAX_TRANS_INTERVAL 9999.0f
 #define CPU_WAIT_MILLISECONDS 10000
-#define CPU_WAIT_NANOSECONDS 10000000
+#define CPU_WAIT_NANOSECONDS 10000000LL
 #define MAX_SENSOR_ADDRESS 99
 #define MAX_UNIT_TYPE 24
+#define BUS_WAIT_CHAR_NS 1041667LL // One character, 10 bits at 9600 baud, the unit of the B wait interval.
+#define BUS_SENSORS 3 // sensor_one to sensor_three.
+#define STATE_LAYOUT 1 // --state payload, BUS_SENSORS bp_sensors. Bump when the saved fields change meaning.
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -137,12 +169,12 @@ volatile sig_atomic_t kill_flag = 0;
 
 // Global variables
 int serial_fd = -1;
+const char *program_name = "unknown";
 //ParsedCommand p_cmd;
 
 // Synchronization primitives
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main to allow for CLOCK_MONOTONIC
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // The sender's 10ms polling ticks.
 
 pthread_t recv_thread, send_thread, sig_thread;
 
@@ -150,8 +182,6 @@ bool recv_thread_created = false;
 bool sig_thread_created = false;
 bool send_thread_created = false;
 
-bool sensor_cond_init = false;
-
 // These need to be freed upon exit.
 bp_sensor *sensor_one = NULL; // Global pointer to struct for Barometric sensor 1.
 bp_sensor *sensor_two = NULL; // Global pointer to struct for Barometric sensor 2.
@@ -160,6 +190,9 @@ bp_sensor *sensor_three = NULL; // Global pointer to struct for Barometric senso
 // Array of 99 pointers (0-98), initialized to NULL to use as a bp_sensor address map.
 bp_sensor *sensor_map[MAX_SENSOR_ADDRESS] = {NULL};
 
+static PersistFile *state_file = NULL; // --state, NULL when settings are not kept.
+static bp_sensor saved_settings[BUS_SENSORS]; // The last --state commit, readings cleared.
+
 /*
  * Name:         cleanup_and_exit
  * Purpose:      helper function to cleanup sensors, and arrays.
@@ -176,8 +209,8 @@ bp_sensor *sensor_map[MAX_SENSOR_ADDRESS] = {NULL};
 void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex);
     terminate = 1;
-	if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
     pthread_mutex_unlock(&sensor_mutex);
+	schedule_wake(&sender_sched);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -186,6 +219,7 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
     }
 
     if (sig_thread_created) {
@@ -195,15 +229,17 @@ void cleanup_and_exit(int exit_code) {
     }
 
 	pthread_mutex_destroy(&sensor_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
+    schedule_destroy(&sender_sched);
 
+    persist_close(state_file); // After the threads, nothing commits to it now.
     if (sensor_one) free(sensor_one);
     if (sensor_two) free(sensor_two);
     if (sensor_three) free(sensor_three);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -470,12 +506,14 @@ CommandType parse_command(const char *buf, ParsedCommand *p_cmd) {
                     if (p_cmd->is_formatted) {
                         if (variant == 1) return CMD_R1_UNITS;
                         if (variant == 2) return CMD_R2_UNITS;
+                        if (variant == 9) return CMD_R9_UNITS;
                     } else {
                         if (variant == 1) return CMD_R1;
                         if (variant == 2) return CMD_R2;
                         if (variant == 3) return CMD_R3;
                         if (variant == 4) return CMD_R4;
                         if (variant == 5) return CMD_R5;
+                        if (variant == 9) return CMD_R9;
                     }
                 } else {
 					if (*payload == '?') {
@@ -499,6 +537,83 @@ CommandType parse_command(const char *buf, ParsedCommand *p_cmd) {
 }
 
 
+/*
+ * Name:         bus_wait
+ * Purpose:      Holds an addressed reply back for the sensor's bus wait interval.
+ * Arguments:    p_cmd: the parsed command.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread, which owns sensor_map.
+ *
+ * Bugs:         None known.
+ * Notes:        The interval is in characters at 9600 baud (B,<wait>, default 22),
+ *               so a poller sees the turnaround a DPS8100 on RS-485 gives it.
+ *               Unaddressed broadcasts are answered at once. Called before
+ *               sensor_mutex is taken, so the sender is not held up by the wait.
+ */
+static void bus_wait(const ParsedCommand *p_cmd) {
+    if (!p_cmd->is_addressed || p_cmd->address == 0 || p_cmd->address >= MAX_SENSOR_ADDRESS) return;
+    const bp_sensor *s = sensor_map[p_cmd->address];
+    if (s == NULL || s->wait_interval == 0) return;
+
+    int64_t ns = (int64_t)s->wait_interval * BUS_WAIT_CHAR_NS;
+    struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000LL), .tv_nsec = (long)(ns % 1000000000LL) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR && !terminate);
+}
+
+/*
+ * Name:         send_raw
+ * Purpose:      Sends a sensor's raw frequency and diode voltage, for R9.
+ * Arguments:    s: the sensor.
+ *               units: append Hz and V.
+ *
+ * Output:       The reading on the serial port.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  sensor_mutex is held.
+ *
+ * Bugs:         None known.
+ * Notes:        1 mHz and 1 uV, finer than the 0.001 mbar of R.
+ */
+static void send_raw(const bp_sensor *s, bool units) {
+	safe_serial_write(serial_fd, units ? "%.3f Hz,%.6f V\r\n" : "%.3f,%.6f\r\n", s->raw_frequency, s->diode_voltage);
+}
+
+/*
+ * Name:         compensate_bus
+ * Purpose:      Recomputes every sensor's pressure from its raw readings.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     current_pressure of each sensor in sensor_map.
+ * Returns:      None.
+ * Assumptions:  sensor_mutex is held.
+ *
+ * Bugs:         None known.
+ * Notes:        One dsp8100_compensate() call for the bus, however many sensors
+ * 				 are on it. User gain and offset are applied after, as on the sensor.
+ */
+static void compensate_bus(void) {
+	bp_sensor *batch[MAX_SENSOR_ADDRESS];
+	double freq[MAX_SENSOR_ADDRESS], volt[MAX_SENSOR_ADDRESS], pressure[MAX_SENSOR_ADDRESS];
+	size_t n = 0;
+
+	for (int i = 0; i < MAX_SENSOR_ADDRESS; i++) {
+		bp_sensor *s = sensor_map[i];
+		if (s == NULL) continue;
+		batch[n] = s;
+		freq[n] = s->raw_frequency;
+		volt[n] = s->diode_voltage;
+		n++;
+	}
+	dsp8100_compensate(coefficients, freq, volt, pressure, n);
+	for (size_t i = 0; i < n; i++) {
+		batch[i]->current_pressure = (float)(pressure[i] * batch[i]->user_gain + batch[i]->user_offset);
+	}
+}
+
 /*
  * Name:         handle_command
  * Purpose:      Handle each command and send response on serial.
@@ -698,6 +813,17 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			break; // RPS Sensor do not implement
 		case CMD_R2_UNITS:
 			break; // RPS Sensor do not implement
+		case CMD_R9:
+		case CMD_R9_UNITS:
+			// Emulator only, the raw readings behind R for checking a host's own compensation.
+			if (p_cmd->is_addressed && p_cmd->address != 0 && sensor_map[p_cmd->address] != NULL) {
+				send_raw(sensor_map[p_cmd->address], cmd == CMD_R9_UNITS);
+			} else {
+				send_raw(sensor_one, cmd == CMD_R9_UNITS);
+				send_raw(sensor_two, cmd == CMD_R9_UNITS);
+				send_raw(sensor_three, cmd == CMD_R9_UNITS);
+			}
+			break;
 		case CMD_R3:
 			break; // RPS Sensor do not implement
 		case CMD_R4:
@@ -792,18 +918,120 @@ void* signal_thread(void* arg) {
     terminate = 1;
     kill_flag = 1;
 
-    // Now safely wake any threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    // Now safely wake the sender
+    schedule_wake(&sender_sched);
 
     return NULL;
 }
 
+/*
+ * Name:         settings_of
+ * Purpose:      Copies a sensor with the readings the sender updates cleared.
+ *
+ * Returns:      None.
+ */
+static void settings_of(bp_sensor *out, const bp_sensor *s) {
+	memcpy(out, s, sizeof(*out));
+	out->current_pressure = 0.0f;
+	out->raw_frequency = 0.0;
+	out->diode_voltage = 0.0;
+	memset(&out->last_send_time, 0, sizeof(out->last_send_time));
+}
+
+/*
+ * Name:         save_state
+ * Purpose:      Commits the settings of every sensor on the bus to the --state
+ *               file, if a command has changed them.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     saved_settings, state_file.
+ * Returns:      None.
+ * Assumptions:  sensor_mutex is held.
+ *
+ * Bugs:         None known.
+ * Notes:        Readings are left out, so a command that only reports does not
+ *               write the file.
+ */
+static void save_state(void) {
+	if (!state_file) return;
+	const bp_sensor *bus[BUS_SENSORS] = { sensor_one, sensor_two, sensor_three };
+	bp_sensor settings[BUS_SENSORS];
+	for (int k = 0; k < BUS_SENSORS; k++) settings_of(&settings[k], bus[k]);
+	if (memcmp(settings, saved_settings, sizeof(settings)) == 0) return;
+	memcpy(saved_settings, settings, sizeof(settings));
+	persist_commit(state_file, settings);
+}
+
+/*
+ * Name:         load_state
+ * Purpose:      Takes every sensor's settings from the last --state commit.
+ * Arguments:    None.
+ *
+ * Output:       A note on the console when settings are restored.
+ * Modifies:     sensor_one to sensor_three, sensor_map, saved_settings.
+ * Returns:      None.
+ * Assumptions:  Called from main after the sensors are registered, before the
+ *               threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        Readings and send times stay as init_sensor() left them. The
+ *               address map is rebuilt from the saved addresses, as N left it.
+ */
+static void load_state(void) {
+	const bp_sensor *saved = persist_load(state_file, NULL);
+	if (!saved) return;
+	memcpy(saved_settings, saved, sizeof(saved_settings));
+
+	bp_sensor *bus[BUS_SENSORS] = { sensor_one, sensor_two, sensor_three };
+	memset(sensor_map, 0, sizeof(sensor_map));
+	for (int k = 0; k < BUS_SENSORS; k++) {
+		bp_sensor readings = *bus[k];
+		memcpy(bus[k], &saved_settings[k], sizeof(bp_sensor));
+		bus[k]->current_pressure = readings.current_pressure;
+		bus[k]->raw_frequency = readings.raw_frequency;
+		bus[k]->diode_voltage = readings.diode_voltage;
+		bus[k]->last_send_time = readings.last_send_time;
+		if (bus[k]->device_address < MAX_SENSOR_ADDRESS) sensor_map[bus[k]->device_address] = bus[k];
+	}
+	safe_console_print("%s: settings restored from the state file\n", program_name);
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command().
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    metrics_count(METRIC_COMMANDS, 1);
+    if (cmd_type == CMD_UNKNOWN) metrics_count(METRIC_BAD_COMMANDS, 1);
+
+    bus_wait(&local_cmd);
+    metrics_mutex_lock(&sensor_mutex);   // <--- LOCK HERE
+    handle_command(cmd_type, &local_cmd); // handle received command here.
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    save_state();
+    pthread_mutex_unlock(&sensor_mutex); // <--- UNLOCK HERE
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -816,47 +1044,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0';
-
-					ParsedCommand local_cmd;
-					CommandType cmd_type = parse_command(line, &local_cmd);
-
-					pthread_mutex_lock(&sensor_mutex);   // <--- LOCK HERE
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    pthread_mutex_unlock(&sensor_mutex); // <--- UNLOCK HERE
-					len = 0;
-                } else { // empty line ignore
-                  }
-            } else {
-                  if (len < sizeof(line)-1) {
-                    line[len++] = c;
-                  } else {
-                        len = 0;
-                    }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(10000);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -865,45 +1062,44 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Runs on 10ms sender_sched ticks; advance_send_time() keeps each
+ * 				 sensor's own interval from drifting between them.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-	struct timespec ts;
+	schedule_start(&sender_sched, CPU_WAIT_NANOSECONDS); // Every 10ms, from the last tick rather than the last pass.
 	while (!terminate) {
-        pthread_mutex_lock(&sensor_mutex);
-
-		// Calculate the next wakeup time (Current time + 10ms)
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        ts.tv_nsec += (CPU_WAIT_NANOSECONDS); // 10000000
-        if (ts.tv_nsec >= 1000000000L) {
-            ts.tv_sec += 1;
-            ts.tv_nsec -= 1000000000L;
-        }
-
-        // Wait until signaled OR timeout reached.
-        // This automatically unlocks sensor_mutex while waiting.
-        pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
+        // Wait for the next tick, only woken early by terminate.
+        ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+        if (event == SCHEDULE_ERROR) {
+            safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
             break;
         }
+        if (event != SCHEDULE_TICK) continue;
+
+        metrics_mutex_lock(&sensor_mutex);
 
         // Fetch simulated data from file to update global sensor states
-        char *line = get_next_line_copy(file_ptr, &file_mutex);
-        if (line) {
-            int count = sscanf(line, "%f,%f,%f",
-                               &sensor_one->current_pressure,
-                               &sensor_two->current_pressure,
-                               &sensor_three->current_pressure);
+        char line[REPLAY_LINE_MAX];
+        if (replay_next_line(replay_src, line, sizeof(line)) > 0) {
+            persist_note_replay(state_file, replay_src);
+            double target[3];
+            int count = sscanf(line, "%lf,%lf,%lf", &target[0], &target[1], &target[2]);
             if (count != 3) {
                 // If the file line is malformed, we keep last known or zero out
                 sensor_one->current_pressure = 0.0f;
                 sensor_two->current_pressure = 0.0f;
                 sensor_three->current_pressure = 0.0f;
+            } else {
+                // The transducer's view of the line: a diaphragm frequency at its diode voltage.
+                bp_sensor *fed[3] = { sensor_one, sensor_two, sensor_three };
+                for (int k = 0; k < 3; k++) {
+                    fed[k]->diode_voltage = dsp8100_diode_voltage(fed[k]->current_temperature);
+                    fed[k]->raw_frequency = dsp8100_raw_frequency(coefficients, target[k], fed[k]->diode_voltage);
+                }
+                compensate_bus();
             }
-			free(line);
         }
         // Iterate through the sensor map and check if any sensor is "due" for a transmission
         for (int i = 0; i < MAX_SENSOR_ADDRESS; i++) {
@@ -914,16 +1110,12 @@ void* sender_thread(void* arg) {
                 // Perform the serial write
                 safe_serial_write(serial_fd, "%f\r\n", s->current_pressure);
 
-                // Update the last_send_time to the current monotonic clock
-                clock_gettime(CLOCK_MONOTONIC, &s->last_send_time);
+                // Open the next window one interval after this one
+                advance_send_time(s);
             }
         }
 
         pthread_mutex_unlock(&sensor_mutex);
-
-        // Sleep for a short duration (10ms) to prevent CPU spiking.
-        // while maintaining 0.01s timing resolution.
-        // usleep(CPU_WAIT_MILLISECONDS); //10000
     }
     return NULL;
 }
@@ -954,18 +1146,25 @@ void* sender_thread(void* arg) {
 
 int main(int argc, char *argv[]) {
 
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) return 1; // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) return 1; // Strips --capture.
+    PersistOptions persist_opts;
+    if (persist_parse_options(&argc, argv, &persist_opts) != 0) return 1; // Strips --state.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--metrics PATH] [--capture PATH] [--state PATH]\n", argv[0]);
         return 1;
     }
-
+	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         perror("Failed to open file");
     	cleanup_and_exit(1);
     }
+    replay_set_sensor(replay_src, "dsp8100"); // Names the lines a wxstate:// source renders.
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -980,6 +1179,12 @@ int main(int argc, char *argv[]) {
     	cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
+    init_coefficients(); // Before the sensors, whose raw readings it maps to pressure.
+
 	    // Initialize BP Sensors BEFORE creating threads
     if (init_sensor(&sensor_one) != 1) {
         safe_console_error("Failed to initialize sensor_one\n");
@@ -1006,14 +1211,15 @@ int main(int argc, char *argv[]) {
     sensor_map[2] = sensor_two;
     sensor_map[3] = sensor_three;
 
-	pthread_condattr_t attr;
-
-	pthread_condattr_init(&attr);
-	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-	pthread_cond_init(&sensor_cond, &attr);
-	sensor_cond_init = true;
+    if (persist_open(&state_file, &persist_opts, "dsp8100", STATE_LAYOUT, BUS_SENSORS * sizeof(bp_sensor)) != 0) cleanup_and_exit(1);
+    load_state();
+    persist_resume_replay(state_file, replay_src);
 
-	pthread_condattr_destroy(&attr);
+	// Polling ticks for the sender, missed ticks are skipped rather than run back to back.
+	if (schedule_init(&sender_sched, SCHEDULE_SKIP) != 0) {
+        safe_console_error("Failed to create sender schedule: %s\n", strerror(errno));
+    	cleanup_and_exit(1);
+	}
 
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
@@ -1023,7 +1229,12 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
+
 
+	if (metrics_start(&metrics_opts, program_name) != 0) return 1;
+	if (capture_start(&capture_opts, program_name) != 0) return 1;
+	metrics_watch_replay(replay_src);
 
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
 	    perror("Failed to create signal thread");
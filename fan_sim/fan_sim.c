@@ -34,14 +34,19 @@
  * 				- Starting RPM: 3000. Adjustable in RPM_STEP increments between
  * 				MIN_RPM and max_rpm (default MAX_RPM_DEFAULT, overridable via argv).
  *
- * Usage:       ./fan_rpm_sim [gpio_chip] [gpio_pin] [max_rpm]
+ * Usage:       ./fan_rpm_sim [gpio_chip] [gpio_pin] [max_rpm] [--pwm CHIP:CHANNEL] [--rt-priority N]
  * 				Example: ./fan_rpm_sim /dev/gpiochip4 17 6000
+ * 				--pwm hands the tach to a kernel PWM channel instead of the GPIO
+ * 				line (see pulse_utils.h); gpio_chip and gpio_pin are then unused.
  * 				Controls: Up arrow = +RPM_STEP, Down arrow = -RPM_STEP, Ctrl+C = quit.
  *
  * Build:       Requires libgpiod and pthread. (Handled by the supplied make file.)
  * 				gcc -o fan_rpm_sim fan_rpm_sim.c -lgpiod -lpthread
  *
  * Mods:
+ * 				14/10/2026 Tach pulses come from the shared pulse engine (pulse_utils.c),
+ * 				SCHED_FIFO with a busy-waited final edge or PWM hardware, and the
+ * 				achieved timing is printed on exit.
  *
  */
 
@@ -61,6 +66,7 @@
 #include <poll.h>
 #include <gpiod.h>
 #include "console_utils.h"
+#include "pulse_utils.h"
 
 #define GPIO_CHIP           "/dev/gpiochip4"   // Pi 4 and earlier gpiochip0, Pi 5 gpiochip4
 #define GPIO_PIN            27                  // BCM pin 5, physical pin 13
@@ -106,24 +112,21 @@ const char *program_name = "unknown";
 // RPM / timing state
 int current_rpm = DEFAULT_RPM;      // Only ever written by input_thread
 int max_rpm = MAX_RPM_DEFAULT;      // Set once in main() before threads start
-volatile long long shared_interval_ns = 0; // ns between pulses, 0 == stalled/no pulses
+
+// Tach pulse train, driven by sender_thread, its interval set by input_thread (0 == stalled/no pulses)
+static PulseTrain tach_train = PULSE_TRAIN_INITIALIZER;
+static PulseOptions pulse_opts;
 
 // Terminal state
 static struct termios orig_termios;
 static bool termios_saved = false;
 
-// Synchronization primitives
-pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;        // Protects shared_interval_ns
-static pthread_mutex_t pulse_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  pulse_sleep_cond;  // Initialized in main() against CLOCK_MONOTONIC
-
 // Global pointers to threads
 pthread_t input_thread_id, send_thread, sig_thread;
 
 bool input_thread_created = false;
 bool send_thread_created = false;
 bool sig_thread_created = false;
-bool pulse_cond_init = false;
 
 /*
  * Name:         restore_terminal
@@ -158,9 +161,7 @@ void cleanup_and_exit(int exit_code) {
     terminate = 1;
 
     // Wake sender
-    pthread_mutex_lock(&pulse_sleep_mutex);
-    if (pulse_cond_init) pthread_cond_broadcast(&pulse_sleep_cond);
-    pthread_mutex_unlock(&pulse_sleep_mutex);
+    pulse_train_wake(&tach_train);
 
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
@@ -178,9 +179,7 @@ void cleanup_and_exit(int exit_code) {
         sig_thread_created = false;
     }
 
-    pthread_mutex_destroy(&pulse_sleep_mutex);
-    pthread_mutex_destroy(&data_mutex);
-    if (pulse_cond_init) pthread_cond_destroy(&pulse_sleep_cond);
+    pulse_train_destroy(&tach_train);
 
     // Close GPIO resources
 #ifdef GPIOD_V2
@@ -206,6 +205,7 @@ void cleanup_and_exit(int exit_code) {
 
     restore_terminal();
     printf("\n"); // Leave the status line intact and drop the shell prompt below it
+    pulse_train_report(&tach_train, program_name);
     console_cleanup();
     exit(exit_code);
 }
@@ -214,31 +214,19 @@ void cleanup_and_exit(int exit_code) {
 // ---------------- Helpers ----------------
 
 /*
- * Name:        sleep_ns
- * Purpose:     Sleep for a given number of nanoseconds using nanosleep.
- * Arguments:   ns: nanoseconds to sleep.
- */
-static void sleep_ns(long long ns) {
-    struct timespec ts = {.tv_nsec = ns};
-    nanosleep(&ts, NULL);
-}
-
-/*
- * Name:        simulate_pulse
- * Purpose:     Drives the output pin active for PULSE_WIDTH_NS then returns
- *              inactive — simulating one fan tach pulse via the NPN transistor
- *              sinking the tach line.
- * Arguments:   None.
+ * Name:        set_tach_line
+ * Purpose:     Drives the output pin, active sinks the tach line through the
+ *              NPN transistor. The pulse engine calls it at both edges of each
+ *              tach pulse.
+ * Arguments:   ctx: unused.
+ *              active: true for the pulse.
  */
-static void simulate_pulse(void) {
+static void set_tach_line(void *ctx, bool active) {
+    (void)ctx;
 #ifdef GPIOD_V2
-    gpiod_line_request_set_value(request, offset, GPIOD_LINE_VALUE_ACTIVE);
-    sleep_ns(PULSE_WIDTH_NS);
-    gpiod_line_request_set_value(request, offset, GPIOD_LINE_VALUE_INACTIVE);
+    gpiod_line_request_set_value(request, offset, active ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
 #else
-    gpiod_line_set_value(gpio_line, 1);
-    sleep_ns(PULSE_WIDTH_NS);
-    gpiod_line_set_value(gpio_line, 0);
+    gpiod_line_set_value(gpio_line, active ? 1 : 0);
 #endif
 }
 
@@ -296,64 +284,28 @@ void* signal_thread(void* arg) {
 
     terminate = 1;
 
-    pthread_mutex_lock(&pulse_sleep_mutex);
-    pthread_cond_broadcast(&pulse_sleep_cond);
-    pthread_mutex_unlock(&pulse_sleep_mutex);
+    pulse_train_wake(&tach_train);
 
     return NULL;
 }
 
 /*
  * Name:         sender_thread
- * Purpose:      Emits fan tach pulses on the GPIO pin at the interval set by
- *               shared_interval_ns, using absolute CLOCK_MONOTONIC timing so
- *               the rate holds steady even as pulse handling jitters slightly.
- *               When shared_interval_ns == 0 (RPM at floor), it idles until
- *               signaled by the input thread.
+ * Purpose:      Emits fan tach pulses at the interval set by input_thread,
+ *               through the shared pulse engine, until terminate is set.
+ *               At 0 RPM it idles until the input thread raises the rate.
  * Arguments:    arg: thread arguments (unused).
- * Output:       None.
- * Modifies:     GPIO pin state.
+ * Output:       Pulses on the GPIO line or the PWM channel.
+ * Modifies:     The thread's scheduling policy, tach_train's statistics.
  * Returns:      NULL.
- * Assumptions:  None.
+ * Assumptions:  pulse_train_init() succeeded.
  * Bugs:         None known.
- * Notes:
+ * Notes:        An RPM step takes effect from the pulse after the one just
+ *               sent, rather than after a stale wait.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec next_pulse;
-    clock_gettime(CLOCK_MONOTONIC, &next_pulse);
-
-    while (!terminate) {
-        long long current_interval_ns;
-
-        pthread_mutex_lock(&data_mutex);
-        current_interval_ns = shared_interval_ns;
-        pthread_mutex_unlock(&data_mutex);
-
-        if (current_interval_ns > 0) {
-            simulate_pulse();
-
-            long long next_ns = (long long)next_pulse.tv_sec * NS_PER_SEC + next_pulse.tv_nsec + current_interval_ns;
-            next_pulse.tv_sec = (time_t)(next_ns / NS_PER_SEC);
-            next_pulse.tv_nsec = (long)(next_ns % NS_PER_SEC);
-
-            pthread_mutex_lock(&pulse_sleep_mutex);
-            if (!terminate) {
-                // Wakes exactly at next_pulse, OR immediately if the input
-                // thread changes the RPM (broadcast), so a step-change takes
-                // effect on the very next pulse rather than after a stale wait.
-                pthread_cond_timedwait(&pulse_sleep_cond, &pulse_sleep_mutex, &next_pulse);
-            }
-            pthread_mutex_unlock(&pulse_sleep_mutex);
-        } else {
-            // Stalled: wait for the input thread to bring RPM above 0
-            pthread_mutex_lock(&pulse_sleep_mutex);
-            if (!terminate) pthread_cond_wait(&pulse_sleep_cond, &pulse_sleep_mutex);
-            pthread_mutex_unlock(&pulse_sleep_mutex);
-            // Reset reference clock so we don't burst out stale pulses
-            clock_gettime(CLOCK_MONOTONIC, &next_pulse);
-        }
-    }
+    pulse_train_run(&tach_train, &terminate);
     return NULL;
 }
 
@@ -401,7 +353,7 @@ static arrow_key_t read_key(void) {
  *               interval to the sender thread, and redraws the status line.
  * Arguments:    arg: thread arguments (unused).
  * Output:       Writes the status line to stdout via print_rpm().
- * Modifies:     current_rpm, shared_interval_ns.
+ * Modifies:     current_rpm, tach_train's interval.
  * Returns:      NULL.
  * Assumptions:  Terminal has already been put into raw mode by main().
  * Bugs:         None known.
@@ -429,15 +381,7 @@ void* input_thread(void* arg) {
         if (new_rpm == current_rpm) continue; // Already at a bound
 
         current_rpm = new_rpm;
-        long long new_interval = compute_interval_ns(current_rpm);
-
-        pthread_mutex_lock(&data_mutex);
-        shared_interval_ns = new_interval;
-        pthread_mutex_unlock(&data_mutex);
-
-        pthread_mutex_lock(&pulse_sleep_mutex);
-        pthread_cond_broadcast(&pulse_sleep_cond); // Wake sender so the new rate applies immediately
-        pthread_mutex_unlock(&pulse_sleep_mutex);
+        pulse_train_set_interval(&tach_train, compute_interval_ns(current_rpm)); // Wakes sender so the new rate applies immediately
 
         print_rpm(current_rpm);
     }
@@ -502,6 +446,7 @@ static int enable_raw_mode(void) {
  */
 int main(int argc, char *argv[]) {
 
+    if (pulse_parse_options(&argc, argv, &pulse_opts) != 0) return 1;
 	if (argc < 2) {
         safe_console_error("Usage: %s <file_path> <GPIO_chip> <GPIO_pin>\n", argv[0]);
         return 1;
@@ -521,41 +466,49 @@ int main(int argc, char *argv[]) {
 
     // Sanity check: the pulse must fully complete within the tightest (max RPM) period.
     long long tightest_interval_ns = compute_interval_ns(max_rpm);
-    if (tightest_interval_ns > 0 && PULSE_WIDTH_NS >= tightest_interval_ns) {
+    // The pulse engine also needs the line off for at least a pulse width between pulses.
+    if (tightest_interval_ns > 0 && 2 * PULSE_WIDTH_NS > tightest_interval_ns) {
         safe_console_error(
-            "PULSE_WIDTH_NS (%lld ns) does not fit inside the pulse period at max_rpm=%d "
+            "PULSE_WIDTH_NS (%lld ns) is more than half the pulse period at max_rpm=%d "
             "(%lld ns). Lower max_rpm, reduce PULSE_WIDTH_NS, or reduce PULSES_PER_REV.\n",
             PULSE_WIDTH_NS, max_rpm, tightest_interval_ns);
         return 1;
     }
 
-    chip = gpiod_chip_open(chip_path);
-    if (!chip) {
-        perror("gpiod_chip_open");
-        cleanup_and_exit(1);
+    if (pulse_train_init(&tach_train, &pulse_opts, PULSE_WIDTH_NS, set_tach_line, NULL) != 0) {
+        safe_console_error("Failed to set up the tach output: %s\n", strerror(errno));
+        return 1;
     }
 
+    if (pulse_opts.pwm_chip < 0) { // A PWM channel owns the pin, the GPIO line is only requested for software pulses.
+        chip = gpiod_chip_open(chip_path);
+        if (!chip) {
+            perror("gpiod_chip_open");
+            cleanup_and_exit(1);
+        }
+
 #ifdef GPIOD_V2
-    settings = gpiod_line_settings_new();
-    if (!settings) { perror("settings"); cleanup_and_exit(1); }
-    gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
-    gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+        settings = gpiod_line_settings_new();
+        if (!settings) { perror("settings"); cleanup_and_exit(1); }
+        gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+        gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
 
-    line_cfg = gpiod_line_config_new();
-    if (!line_cfg) { perror("line_cfg"); cleanup_and_exit(1); }
+        line_cfg = gpiod_line_config_new();
+        if (!line_cfg) { perror("line_cfg"); cleanup_and_exit(1); }
 
-    req_ret = gpiod_line_config_add_line_settings(line_cfg, &offset, 1, settings);
-    if (req_ret) { perror("add line settings"); cleanup_and_exit(1); }
+        req_ret = gpiod_line_config_add_line_settings(line_cfg, &offset, 1, settings);
+        if (req_ret) { perror("add line settings"); cleanup_and_exit(1); }
 
-    request = gpiod_chip_request_lines(chip, NULL, line_cfg);
-    if (!request) { perror("request lines"); cleanup_and_exit(1); }
+        request = gpiod_chip_request_lines(chip, NULL, line_cfg);
+        if (!request) { perror("request lines"); cleanup_and_exit(1); }
 #else
-    gpio_line = gpiod_chip_get_line(chip, offset);
-    if (!gpio_line) { perror("get line"); cleanup_and_exit(1); }
+        gpio_line = gpiod_chip_get_line(chip, offset);
+        if (!gpio_line) { perror("get line"); cleanup_and_exit(1); }
 
-    req_ret = gpiod_line_request_output(gpio_line, "fan_rpm_sim", 0); // 0 = initial low
-    if (req_ret) { perror("request output"); cleanup_and_exit(1); }
+        req_ret = gpiod_line_request_output(gpio_line, "fan_rpm_sim", 0); // 0 = initial low
+        if (req_ret) { perror("request output"); cleanup_and_exit(1); }
 #endif
+    }
 
     if (enable_raw_mode() != 0) {
         cleanup_and_exit(1);
@@ -569,16 +522,8 @@ int main(int argc, char *argv[]) {
     sigaddset(&block_set, SIGQUIT);
     pthread_sigmask(SIG_BLOCK, &block_set, NULL);
 
-    // Initialize the pulse condition to use CLOCK_MONOTONIC
-    pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&pulse_sleep_cond, &attr);
-    pulse_cond_init = true;
-    pthread_condattr_destroy(&attr);
-
-    // Set the initial pulse interval before any thread reads it
-    shared_interval_ns = compute_interval_ns(current_rpm);
+    // Set the initial pulse interval before the sender starts
+    pulse_train_set_interval(&tach_train, compute_interval_ns(current_rpm));
 
     if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
         safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
@@ -17,8 +17,12 @@
  *
  *	            Data output includes: relative humidity (%), temperature (°C), status, and checksum
  *
- * Usage:	    use case ' tmp_rh_listen <file_path> // The serial port and baud rate will be set to  defaults /dev/ttyUSB0, and B9600
- *           	use case ' tmp_rh_listen <file_path> <serial_port_location> <baud_rate> <RS422|RS485> The serial port currently must match /dev/tty(S|USB)[0-9]+
+ * Usage:	    use case ' hc2s3 <file_path> [i2c_bus] [--rate HZ] [--speed N]
+ *           	Each data file line is one {F00rdd ...} answer, taken DATA_PERIOD_SEC apart. RH goes
+ *           	out on channel A and temperature on channel B of the MCP4728, ramped between lines
+ *           	at --rate updates per second (default DAC_RATE_HZ) by the DAC streaming engine.
+ *           	A file_path of wxstate://NAME follows the shared weather state instead, one
+ *           	sample per state published, see wxstate/.
  *
  * Sensor:   	Rotronic HC2A-S3 HygroClip2 Probe
  *           	- Digital temperature and relative humidity probe
@@ -33,6 +37,14 @@
  *           	- 12 VDC fan operation
  *
  * Mods:
+ * 				14/10/2026 The DAC is driven by the streaming engine (dac_stream.c) from the data file,
+ * 				one batched I2C_RDWR per update with both channels latched together; the
+ * 				placeholder simulation loop and the blocking ramp_voltage() are gone.
+ * 				14/10/2026 --metrics PATH serves the DAC update counts and the schedule's
+ * 				lateness on a UNIX socket.
+ * 				14/10/2026 volt_to_dac() is a q1_31 multiply when built with WX_FIXED_POINT.
+ * 				14/10/2026 A data file of wxstate://NAME feeds the DAC stream live from the
+ * 				shared weather state, see dac_stream_set_feed().
  *
  */
 
@@ -55,7 +67,12 @@
 #include <linux/i2c-dev.h>
 #include <math.h>
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
+#include "dac_stream.h"
+#include "metrics_utils.h"
+#ifdef WX_FIXED_POINT
+#include "q1_31_utils.h"
+#endif
 
 // I2C Configuration
 #define I2C_ADDR 0x60
@@ -88,6 +105,10 @@
 #define DAC_MAX_VOLTS_1_0     2000  // Approx 1.0V with 2.048V VREF
 #define DAC_MIN_VAL           0
 
+#define DATA_PERIOD_SEC 10    // Data file lines are taken as recorded this far apart
+#define DAC_RATE_HZ 50        // Default DAC updates per second, the old ramp_voltage() rate
+#define DAC_CHANNELS 2        // A: humidity, B: temperature
+
 #define NS_PER_SEC 1000000000LL
 #define NS_PER_MS  1000000LL
 #define SEC_PER_HOUR 3600
@@ -102,7 +123,7 @@
 
 // Global GPIO handles
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -112,18 +133,11 @@ volatile sig_atomic_t kill_flag = 0;
 const char *program_name = "unknown";
 
 // Shared globals
-volatile long long shared_interval_ns = 0; // 0 for no rain
 int i2c_fd = -1;
+static DacStream dac_stream = DAC_STREAM_INITIALIZER; // Waveform from the data file, streamed by sender_thread
 
-// Synchronization primitives
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
-pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the shared variable 'shared_interval_ns'
-static pthread_mutex_t pulse_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  pulse_sleep_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
-pthread_mutex_t reader_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  reader_sleep_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
-// Global pointers to receiver and sender threads.
-pthread_t read_thread, send_thread, sig_thread;
+// Global pointers to sender and signal threads.
+pthread_t send_thread, sig_thread;
 
 
 /*
@@ -141,39 +155,25 @@ pthread_t read_thread, send_thread, sig_thread;
  */
 void cleanup_and_exit(int exit_code) {
     terminate = 1;
-	pthread_kill(sig_thread, SIGTERM);
+	if (sig_thread != 0) pthread_kill(sig_thread, SIGTERM);
     // Wake sender
-    pthread_mutex_lock(&pulse_sleep_mutex);
-    pthread_cond_broadcast(&pulse_sleep_cond);
-    pthread_mutex_unlock(&pulse_sleep_mutex);
-
-    // Wake reader
-    pthread_mutex_lock(&reader_sleep_mutex);
-    pthread_cond_signal(&reader_sleep_cond);
-    pthread_mutex_unlock(&reader_sleep_mutex);
-
-    if (read_thread != 0) {
-		pthread_join(read_thread, NULL);
-		read_thread = 0;
-	}
+    dac_stream_wake(&dac_stream);
+
     if (send_thread != 0) {
 		pthread_join(send_thread, NULL);
 		send_thread = 0;
+		dac_stream_report(&dac_stream, program_name);
 	}
     if (sig_thread != 0) {
 		pthread_join(sig_thread, NULL);
-		send_thread = 0;
+		sig_thread = 0;
 	}
 
-    pthread_mutex_destroy(&pulse_sleep_mutex);
-    pthread_mutex_destroy(&reader_sleep_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    pthread_mutex_destroy(&data_mutex);
-    pthread_cond_destroy(&pulse_sleep_cond);
-    pthread_cond_destroy(&reader_sleep_cond);
-
     // Close resources
-    if (file_ptr) fclose(file_ptr);
+    dac_stream_destroy(&dac_stream);
+    if (i2c_fd >= 0) close(i2c_fd);
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
 
 	// Cleanup utilities
     console_cleanup();
@@ -232,12 +232,19 @@ void write_to_specific_channel(int i2c_fd, int channel, uint16_t dac_val) {
 
 /**
  * Converts a target voltage (0-1.0V) to a 12-bit DAC value
- * based on the 2.048V internal reference.
+ * based on the 2.048V internal reference. Built with WX_FIXED_POINT
+ * the voltage is a q1_31, capped just under 1V by saturation, and the
+ * scale is one fixed-point multiply giving the code over 2048.
  */
 uint16_t volt_to_dac(double voltage) {
     if (voltage < 0.0) voltage = 0.0;
+#ifdef WX_FIXED_POINT
+    q1_31 code = q1_sat_mul(q1_sat_from_double(voltage), q1_from_double(MAX_DAC / VREF_INT / 2048.0));
+    return (uint16_t)(code >> (Q1_SHIFT - 11));
+#else
     if (voltage > 1.0) voltage = 1.0; // Safety cap at 1V
     return (uint16_t)((voltage / VREF_INT) * MAX_DAC);
+#endif
 }
 
 /**
@@ -261,49 +268,148 @@ void update_dac_channel(int i2c_fd, uint8_t command, uint16_t dac_val) {
 // ---------------- Command handling ----------------
 
 /*
- * Name:        sleep_ms
- * Purpose:     Sleep for a given number of milliseconds using nanosleep.
- * Arguments:   ms: milliseconds to sleep.
+ * Name:         parse_hc2_line
+ * Purpose:      Takes the humidity and temperature out of one {F00rdd ...} data file line.
+ * Arguments:    line: the line, NUL terminated.
+ * 				 rh: receives the relative humidity in %.
+ * 				 temp: receives the temperature in degrees C.
+ *
+ * Output:       None.
+ * Modifies:     rh, temp.
+ * Returns:      true if both values were found.
+ * Assumptions:  Fields are ';' separated, RH is field 1 and temperature field 5, as the probe answers.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
  */
-static void sleep_ns(long long ns) {
-    struct timespec ts = {.tv_nsec = ns};
-    nanosleep(&ts, NULL);
+static bool parse_hc2_line(const char *line, double *rh, double *temp) {
+    const char *field = line;
+    bool have_rh = false, have_temp = false;
+    for (int k = 0; field && k <= 5; k++) {
+        if (k == 1 || k == 5) {
+            char *end = NULL;
+            double v = strtod(field, &end);
+            bool ok = end != field && (*end == ';' || *end == ' ' || *end == '\0');
+            if (k == 1) { *rh = v; have_rh = ok; }
+            else { *temp = v; have_temp = ok; }
+        }
+        field = strchr(field, ';');
+        if (field) field++;
+    }
+    return have_rh && have_temp;
 }
 
-
-
-/**
- * Ramps the voltage from current to target over a specified duration.
- * duration_sec: Time in seconds to complete the climb
+/*
+ * Name:         hc2_sample
+ * Purpose:      Converts a humidity and temperature to the pair of DAC codes.
+ * Returns:      The sample, RH on channel A and temperature on channel B.
  */
-void ramp_voltage(int fd, int channel, float current_v, float target_v, float duration_sec) {
-    // 1. Setup timing (50 updates per second for smoothness)
-    const int updates_per_sec = 50;
-    const int interval_us = 1000000 / updates_per_sec; // 20,000 microseconds
-    int total_steps = (int)(duration_sec * updates_per_sec);
-
-    if (total_steps <= 0) total_steps = 1;
-
-    // 2. Calculate how much the DAC value changes per step
-    // Convert Volts to DAC units (0-4095)
-    float current_dac = (current_v / 2.048) * 4095;
-    float target_dac = (target_v / 2.048) * 4095;
-    float step_size = (target_dac - current_dac) / total_steps;
+static DacSample hc2_sample(double rh, double temp) {
+    DacSample sample = { { 0 } };
+    sample.code[0] = volt_to_dac(rh / 100.0);
+    sample.code[1] = volt_to_dac((temp + 40.0) / 100.0);
+    return sample;
+}
 
-    printf("Ramping Channel %d: %.2fV -> %.2fV over %.1fs\n", 
-            channel, current_v, target_v, duration_sec);
+/*
+ * Name:         load_samples
+ * Purpose:      Converts every line of the data file to a pair of DAC codes.
+ * Arguments:    src: the data file.
+ * 				 count: receives the number of samples.
+ *
+ * Output:       An error message for each line that cannot be parsed.
+ * Modifies:     count, the replay position of src (back at the first line after a full pass).
+ * Returns:      The samples, malloc()ed, or NULL if no line could be used.
+ * Assumptions:  src is a text data file.
+ *
+ * Bugs:         None known.
+ * Notes:        RH: 0% = 0V, 100% = 1V. Temp: -40 = 0V, 60 = 1V (Span of 100 degrees).
+ */
+static DacSample *load_samples(ReplaySource *src, size_t *count) {
+    size_t lines = replay_line_count(src);
+    DacSample *samples = lines ? calloc(lines, sizeof(DacSample)) : NULL;
+    *count = 0;
+    if (!samples) return NULL;
+
+    char line[REPLAY_LINE_MAX];
+    for (size_t i = 0; i < lines; i++) {
+        double rh, temp;
+        if (replay_next_line(src, line, sizeof(line)) == 0) continue;
+        if (!parse_hc2_line(line, &rh, &temp)) {
+            safe_console_error("Skipping data file line %zu, no RH and temperature\n", i + 1);
+            continue;
+        }
+        samples[(*count)++] = hc2_sample(rh, temp);
+    }
+    if (*count == 0) {
+        free(samples);
+        return NULL;
+    }
+    return samples;
+}
 
-    // 3. The Ramp Loop
-    for (int i = 1; i <= total_steps; i++) {
-        uint16_t next_val = (uint16_t)(current_dac + (step_size * i));
-        // Safety Clamps (ensure we don't exceed 12-bit or your safety ceiling)
-        if (next_val > MAX_VOLT_STEP) next_val = MAX_VOLT_STEP; // Your 1.0V ceiling
+/*
+ * Name:         next_sample
+ * Purpose:      Reads the probe's next answer from a wxstate:// source as a DAC sample.
+ * Arguments:    next: receives the sample.
+ * 				 ctx: the replay source.
+ *
+ * Output:       None.
+ * Modifies:     next.
+ * Returns:      true if the state gave an RH and a temperature, false to hold the last sample.
+ * Assumptions:  replay_set_sensor() named the source "hc2s3".
+ *
+ * Bugs:         None known.
+ * Notes:        The DAC stream's feed, called on its thread as each segment ends.
+ * 				 The state is read through the same {F00rdd ...} line a data file holds.
+ */
+static bool next_sample(DacSample *next, void *ctx) {
+    char line[REPLAY_LINE_MAX];
+    double rh, temp;
+    if (replay_next_line(ctx, line, sizeof(line)) == 0 || !parse_hc2_line(line, &rh, &temp)) return false;
+    *next = hc2_sample(rh, temp);
+    return true;
+}
 
-        write_to_specific_channel(fd, channel, next_val);
+/*
+ * Name:         parse_rate_option
+ * Purpose:      Takes --rate HZ or --rate=HZ off the command line.
+ * Arguments:    argc: the argument count, reduced by the arguments taken.
+ * 				 argv: the arguments, the rest are kept in order.
+ * 				 rate_hz: receives the DAC update rate, left alone if --rate is absent.
+ *
+ * Output:       Error message to stderr on a bad rate.
+ * Modifies:     argc, argv, rate_hz.
+ * Returns:      0 on success, -1 if the rate is not 1 to DAC_STREAM_MAX_RATE_HZ.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors replay_parse_options().
+ */
+static int parse_rate_option(int *argc, char **argv, unsigned *rate_hz) {
+	int out = 1;
+	for (int i = 1; i < *argc; i++) {
+		const char *value = NULL;
+		if (strncmp(argv[i], "--rate=", 7) == 0) {
+			value = argv[i] + 7;
+		} else if (strcmp(argv[i], "--rate") == 0 && i + 1 < *argc) {
+			value = argv[++i];
+		} else {
+			argv[out++] = argv[i]; // Not ours, keep it in order.
+			continue;
+		}
 
-        // Wait for the next step
-        usleep(interval_us);
-    }
+		char *end = NULL;
+		long hz = strtol(value, &end, 10);
+		if (end == value || (*end != '\0' && strcasecmp(end, "hz") != 0) || hz < 1 || hz > DAC_STREAM_MAX_RATE_HZ) {
+			fprintf(stderr, "Invalid --rate '%s': use 1 to %d DAC updates per second\n", value, DAC_STREAM_MAX_RATE_HZ);
+			return -1;
+		}
+		*rate_hz = (unsigned)hz;
+	}
+	argv[out] = NULL;
+	*argc = out;
+	return 0;
 }
 
 // ---------------- Threads ----------------
@@ -324,240 +430,132 @@ void* signal_thread(void* arg) {
     kill_flag = 1;
 
     // safely wake threads
-    pthread_mutex_lock(&pulse_sleep_mutex);
-    pthread_cond_broadcast(&pulse_sleep_cond);
-    pthread_mutex_unlock(&pulse_sleep_mutex);
-
-    pthread_mutex_lock(&reader_sleep_mutex);
-    pthread_cond_broadcast(&reader_sleep_cond);
-    pthread_mutex_unlock(&reader_sleep_mutex);
+    dac_stream_wake(&dac_stream);
 
     return NULL;
 }
 
 
-/*
- * Name:         reader_thread
- * Purpose:      Handles reading in the data file, and setting the nanosecond interval spacing that the sender_thread should fire at.
- *
- * Arguments:    arg: thread arguments.
- *
- * Output:       NIL
- * Modifies:     shared_interval_ns.
- * Returns:      NULL.
- * Assumptions:  NIL
- *
- * Bugs:         None known.
- * Notes:
- */
-void* reader_thread(void* arg) {
-    (void) arg;
-	char *line = NULL;
-    double mm_per_hour;
-	unsigned long duration_sec;
-
-    while (!terminate) {
-        line = get_next_line_copy(file_ptr, &file_mutex);
-        if (line) {
-			char *saveptr; // Our place keeper in the string.
-			char *token; // Where we temporarily store each token.
-			if ((token = strtok_r(line, " ,", &saveptr))) mm_per_hour = (double)atof(token);
-			if ((token = strtok_r(NULL, " ,", &saveptr))) duration_sec = (long) atol(token);
-
-			free(line);
-			line = NULL;
-
-            long long new_interval_ns = 0;
-
-            if (mm_per_hour > 0) {
-                // (Seconds per Hour * Nanoseconds per second) / (Target mm / mm per tip)
-                //double tips_per_hour = mm_per_hour / MM_PER_TIP;
-                //new_interval_ns = (long long)((SEC_PER_HOUR * NS_PER_SEC) / tips_per_hour);
-            } else {
-                //new_interval_ns = 0; // Flag for "dry"
-            }
-
-            pthread_mutex_lock(&data_mutex);
-            shared_interval_ns = new_interval_ns; // Change the shared interval
-            pthread_mutex_unlock(&data_mutex);
-
-			pthread_mutex_lock(&pulse_sleep_mutex);
-            pthread_cond_broadcast(&pulse_sleep_cond); // Alert sender of change
-			pthread_mutex_unlock(&pulse_sleep_mutex);
-
-            // Wait for the duration of this weather block
-            struct timespec ts;
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-
-            long long duration_ns = (long long)(duration_sec * NS_PER_SEC);
-            ts.tv_sec += (time_t)(duration_ns / NS_PER_SEC);
-            ts.tv_nsec += (long)(duration_ns % NS_PER_SEC);
-
-            // handle nsec overflow
-            if (ts.tv_nsec >= NS_PER_SEC) {
-                ts.tv_sec++;
-                ts.tv_nsec -= NS_PER_SEC;
-            }
-
-            pthread_mutex_lock(&reader_sleep_mutex);
-            if (!terminate) pthread_cond_timedwait(&reader_sleep_cond, &reader_sleep_mutex, &ts);
-            pthread_mutex_unlock(&reader_sleep_mutex);
-        }
-    }
-    return NULL;
-}
-
-
 /*
  * Name:         sender_thread
- * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ * Purpose:      Streams the data file waveform to the DAC until terminate is set.
  * Arguments:    arg: thread arguments.
  *
- * Output:       Error messages if encountered, prints to serial device.
- * Modifies:     None.
+ * Output:       Error messages if encountered, DAC updates over I2C.
+ * Modifies:     The DAC outputs.
  * Returns:      NULL.
- * Assumptions:  serial port will have data, and that data will translate to a command.
+ * Assumptions:  dac_stream_init() succeeded.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        All the timing and I2C work is in dac_stream_run().
  */
 void* sender_thread(void* arg) {
     (void)arg;
-	struct timespec next_pulse;
-    clock_gettime(CLOCK_MONOTONIC, &next_pulse);
-
-    while (!terminate) {
-        long long current_interval_ns;
-
-        pthread_mutex_lock(&data_mutex);
-        current_interval_ns = shared_interval_ns;
-        pthread_mutex_unlock(&data_mutex);
-
-        if (current_interval_ns > 0) {
-//            simulate_tip(); // Pulse the pin
-
-            // Calculate exact time for NEXT pulse using nanoseconds
-            long long next_ns = (long long)next_pulse.tv_sec * NS_PER_SEC + next_pulse.tv_nsec + current_interval_ns;
-
-            next_pulse.tv_sec = (time_t)(next_ns / NS_PER_SEC);
-            next_pulse.tv_nsec = (long)(next_ns % NS_PER_SEC);
-
-            pthread_mutex_lock(&pulse_sleep_mutex);
-            if (!terminate) {
-                // Timedwait wakes up exactly at the nanosecond next_pulse is due
-                pthread_cond_timedwait(&pulse_sleep_cond, &pulse_sleep_mutex, &next_pulse);
-            }
-            pthread_mutex_unlock(&pulse_sleep_mutex);
-        } else {
-            // Dry period: Just wait for the Reader to signal a change
-            pthread_mutex_lock(&pulse_sleep_mutex);
-            if (!terminate) pthread_cond_wait(&pulse_sleep_cond, &pulse_sleep_mutex);
-            pthread_mutex_unlock(&pulse_sleep_mutex);
-            // Reset reference clock after a dry spell to prevent a "burst" of old pulses
-            clock_gettime(CLOCK_MONOTONIC, &next_pulse);
-        }
-    }
+    dac_stream_run(&dac_stream, &terminate);
     return NULL;
 }
 
 
 /*
  * Name:         Main
- * Purpose:      Main funstion, which opens up serial port, and creates a receiver and transmit threads to listen, and respond to commands
- *               over that serial port. Can take two arguments or no arguments. If changing the serial device name and baud rate, you must supply both.
- *               i.e. tmp_bp_listen <file_path> [serial_device] [baud_rate]
- *		 		 uses ternary statements to set either default values for SERIAL_PORT, and BAUD_RATE which are defined above.
- * 		 		 (condition) ? (value if true) : (value if false)
+ * Purpose:      Main function, which opens the I2C bus, turns the data file into DAC codes and starts the sender thread
+ *               that streams them to the MCP4728, then waits for 'q' or a signal.
+ *               i.e. hc2s3 <file_path> [i2c_bus] [--rate HZ] [--speed N]
  *
  * Arguments:    file_path: The location of the file we want to read from, line by line.
- *               device: the string representing the file descriptor of the serial port which should
- * 				 match the pattern ^/dev/tty(S|USB)[0-9]+$. This is tested with function is_valid_tty()
- *				 baud: the string value representing the proposed baud rate, this string is sent to get_baud_rate() which returns a speed_t value.
+ *               i2c_bus: the i2c-dev adapter the MCP4728 is on, default I2C_BUS.
+ *               --rate: DAC updates per second, default DAC_RATE_HZ.
+ *               --speed: run the waveform N times faster than real time.
  *
  * Output:       Prints to stderr the appropriate error messages if encountered.
- * Modifies:     None.
- * Returns:      Returns an int 0 representing success once the program closes the i2c_fd, and joins the threads, or 1 if unable to open the serial port.
- * Assumptions:  device is a valid char * pointer and the line contains
- *               characters other than white space, and points to an FD.
- *		 		 The int provided by arguments is a valid baud rate, although B9600 is set on any errors.
+ * Modifies:     The DAC outputs.
+ * Returns:      Returns an int 0 representing success once the program closes the i2c_fd, and joins the threads, or 1 on a
+ *               setup failure.
+ * Assumptions:  The MCP4728 answers at I2C_ADDR.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The DAC is latched with a general call software update, which also updates any other MCP4728 on the bus.
  */
 int main(int argc, char *argv[]) {
 
-	//int fd;
-
-    // Open the I2C Bus
-    if ((i2c_fd = open(I2C_BUS, O_RDWR)) < 0) {
-        perror("Failed to open I2C bus");
-        return 1;
-    }
-
-    // Set the I2C Slave Address
-    if (ioctl(i2c_fd, I2C_SLAVE, I2C_ADDR) < 0) {
-        perror("Failed to acquire bus access/talk to slave");
+    unsigned rate_hz = DAC_RATE_HZ;
+    ReplayOptions replay_opts;
+    if (parse_rate_option(&argc, argv, &rate_hz) != 0) return 1;
+    if (replay_parse_options(&argc, argv, &replay_opts) != 0) return 1;
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) return 1; // Strips --metrics.
+    if (replay_opts.start.kind != REPLAY_TIME_NONE || replay_opts.end.kind != REPLAY_TIME_NONE) {
+        safe_console_error("--start/--end are not supported, the whole data file is streamed\n");
         return 1;
     }
 
-    printf("Starting HC2A-S3 Simulation on MCP4728...\n");
-    printf("Channel A: Humidity (0-100%% -> 0-1V)\n");
-    printf("Channel B: Temperature (-40 to 60C -> 0-1V)\n");
-    printf("--------------------------------------------\n");
-
-    // Simulation loop
-    while (1) {
-        // --- DATA INPUT SECTION ---
-        // In your final version, these values would come from your CSV generator
-        double sim_rh = 55.5;    // 55.5% Relative Humidity
-        double sim_temp = 12.3;  // 12.3 Degrees Celsius
-
-        // --- CALCULATION SECTION ---
-        // RH: 0% = 0V, 100% = 1V
-        double rh_volts = sim_rh / 100.0;
-        // Temp: -40 = 0V, 60 = 1V (Span of 100 degrees)
-        double temp_volts = (sim_temp + 40.0) / 100.0;
-
-        uint16_t rh_dac_val = volt_to_dac(rh_volts);
-        uint16_t temp_dac_val = volt_to_dac(temp_volts);
-
-        // --- I2C OUTPUT SECTION ---
-        update_dac_channel(i2c_fd, 0, rh_dac_val);
-        update_dac_channel(i2c_fd, 1, temp_dac_val);
-
-        printf("OUT -> RH: %.1f%% (%.3fV) | Temp: %.1fC (%.3fV)\n", 
-                sim_rh, rh_volts, sim_temp, temp_volts);
-
-        // Wait 2 seconds before next update
-        sleep(2);
-    }
-
-
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> [i2c_bus] [--rate HZ] [--speed N] [--metrics PATH]\n", argv[0]);
         return 1;
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
+    const char *i2c_bus = (argc >= 3) ? argv[2] : I2C_BUS;
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
-    //ternary statement to set GPIO_CHIP if supplied in args or the default
-//    const char *chip_path = (argc >= 3) ? argv[2] : GPIO_CHIP;
+    replay_apply_options(replay_src, &replay_opts, NULL, DATA_PERIOD_SEC * 1000);
+
+    const WxStateView *state = replay_state(replay_src);
+    double sample_period_s = DATA_PERIOD_SEC;
+    size_t sample_count = 0;
+    DacSample *samples = NULL;
+    if (state) { // Two samples to ramp between, the feed moves them on.
+        replay_set_sensor(replay_src, "hc2s3");
+        WxState snapshot;
+        samples = calloc(2, sizeof(DacSample));
+        if (samples && wxstate_read(state, &snapshot) && next_sample(&samples[0], replay_src)) {
+            samples[1] = samples[0];
+            sample_count = 2;
+            sample_period_s = snapshot.period_ms / 1000.0;
+        }
+    } else {
+        samples = load_samples(replay_src, &sample_count);
+    }
+    if (sample_count == 0) {
+        free(samples);
+        safe_console_error("No usable lines in %s\n", file_path);
+		cleanup_and_exit(1);
+    }
 
-    // ternary statement to set GPIO_OUT_PIN if supplied in args or default
-  //  offset = (argc >= 4) ? atoi(argv[3]) : GPIO_PIN;
+    // Open the I2C Bus
+    if ((i2c_fd = open(i2c_bus, O_RDWR)) < 0) {
+        perror("Failed to open I2C bus");
+        free(samples);
+		cleanup_and_exit(1);
+    }
 
+    // Set the I2C Slave Address, for the plain write() helpers, the stream addresses each message itself
+    if (ioctl(i2c_fd, I2C_SLAVE, I2C_ADDR) < 0) {
+        perror("Failed to acquire bus access/talk to slave");
+        free(samples);
+		cleanup_and_exit(1);
+    }
 
-//    if (!chip) {
-//        perror("gpiod_chip_open");
-//		cleanup_and_exit(1);
-//    }
+    int init_ret = dac_stream_init(&dac_stream, i2c_fd, I2C_ADDR, DAC_CHANNELS, samples, sample_count, sample_period_s, rate_hz, true);
+    free(samples);
+    if (init_ret == 0 && state) init_ret = dac_stream_set_feed(&dac_stream, next_sample, replay_src);
+    if (init_ret != 0) {
+        safe_console_error("Failed to set up the DAC stream: %s\n", strerror(errno));
+		cleanup_and_exit(1);
+    }
 
+    printf("Starting HC2A-S3 Simulation on MCP4728...\n");
+    printf("Channel A: Humidity (0-100%% -> 0-1V)\n");
+    printf("Channel B: Temperature (-40 to 60C -> 0-1V)\n");
+    if (state) {
+        printf("Following %s, a sample every %.1f s, %u DAC updates per second\n", file_path, sample_period_s, rate_hz);
+    } else {
+        printf("%zu samples %d s apart, %u DAC updates per second\n", sample_count, DATA_PERIOD_SEC, rate_hz);
+    }
+    printf("--------------------------------------------\n");
 
 	// Block signals in main (inherited by all threads)
 	sigset_t block_set;
@@ -567,13 +565,8 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
 
-	// Initialize the pulse and reader conditions to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&pulse_sleep_cond, &attr); // Initialize the global variable here
-    pthread_cond_init(&reader_sleep_cond, &attr); // Initialize the global variable here
-    pthread_condattr_destroy(&attr);
+	if (metrics_start(&metrics_opts, program_name) != 0) return 1;
+	metrics_watch_replay(replay_src);
 
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
         safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
@@ -581,15 +574,9 @@ int main(int argc, char *argv[]) {
 		cleanup_and_exit(1);
 	}
 
-    if (pthread_create(&read_thread, NULL, reader_thread, NULL) != 0) {
-        safe_console_error("Failed to create reader thread: %s\n", strerror(errno));
-        terminate = 1;          // <- needed becausr sig_thread is running
-		cleanup_and_exit(1);
-    }
-
     if (pthread_create(&send_thread, NULL, sender_thread, NULL) != 0) {
         safe_console_error("Failed to create sender thread: %s\n", strerror(errno));
-        terminate = 1;          // <- needed because read_thread is running
+        terminate = 1;          // <- needed because sig_thread is running
 		cleanup_and_exit(1);
     }
 
@@ -618,6 +605,5 @@ int main(int argc, char *argv[]) {
     }
     safe_console_print("Program %s terminated.\n", program_name);
 	cleanup_and_exit(0);
-	sleep_ns(0);
 	return 0; // We won't get here, but it quiets verbose warnings on a no return value.
 }
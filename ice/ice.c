@@ -61,7 +61,16 @@
  *           - Operating temperature: Designed for harsh outdoor environments
  *           - Power consumption: 10W monitoring, 385W during de-ice cycle
  *
- * Mods:
+ * Mods:     14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ *                      wait metrics on a UNIX socket.
+ *           14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 Replies are framed in the thread's scratch arena, not
+ *                      malloc()ed per reply.
  *
  */
 
@@ -80,15 +89,19 @@
 #include <ctype.h>
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "crc_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+#include "arena_utils.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B2400	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 // #define MAX_PACKET_LENGTH 25
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -99,7 +112,6 @@ volatile sig_atomic_t kill_flag = 0;
 int serial_fd = -1;
 
 /* Synchronization primitives */
-static pthread_mutex_t file_mutex  = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 
 pthread_t sig_thread, recv_thread;
 bool sig_thread_created = false;
@@ -132,11 +144,12 @@ void cleanup_and_exit(int exit_code) {
 		sig_thread_created = false;
 	}
 
-    pthread_mutex_destroy(&file_mutex);
 
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -145,30 +158,55 @@ void cleanup_and_exit(int exit_code) {
 
 /*
  * Name:         prepend_to_buffer
- * Purpose:      Takes a destination and source string, and appends "STX \r \n" to the beginning.
- * Arguments:    str_to_chk the string that checksum will be calculated for, it is set to uint_8 to eliminate any sign errors.
- *				 length the length of the string to check.
+ * Purpose:      Copies a string into an arena with "STX \r \n" in front of it.
+ * Arguments:    scratch: the arena to build it in, the caller rewinds it.
+ *				 original: the reply data.
  * Output:       None.
- * Modifies:     None.
- * Returns:      returns an unsigned 8 bit integer of the checksum of str_to_chk.
- * Assumptions:  Terminate is set to false.
+ * Modifies:     scratch.
+ * Returns:      The framed string, or NULL if the arena is full.
+ * Assumptions:  None.
  *
  * Bugs:         None known.
  * Notes:        To print in HEX utilize dprintf(serial_fd, "%s%02X\r\n", str_to_chk, check_sum(str_to_chk));
  */
-char* prepend_to_buffer(const char* original) {
+char* prepend_to_buffer(Arena *scratch, const char* original) {
     // Length: 3 (for STX, \r, \n) + length of data + 1 (for null terminator)
-    size_t new_len = 3 + strlen(original) + 1;
-    char* new_str = malloc(new_len);
+    size_t len = strlen(original);
+    char* new_str = arena_alloc(scratch, 3 + len + 1, 1);
     if (new_str == NULL) return NULL;
 
     // \x02 is STX, \r is Carriage Return, \n is Newline
-    // %s is your original data
-    snprintf(new_str, new_len, "\x02\r\n%s", original);
+    memcpy(new_str, "\x02\r\n", 3);
+    memcpy(new_str + 3, original, len + 1);
 
     return new_str;
 }
 
+/*
+ * Name:         send_framed
+ * Purpose:      Sends one reply framed as STX CR LF <data><checksum> ETX CR LF.
+ * Arguments:    data: the reply data.
+ *
+ * Output:       The reply to the serial port.
+ * Modifies:     None, the scratch arena is rewound before it returns.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void send_framed(const char *data) {
+	Arena *scratch = arena_scratch();
+	if (!scratch) return;
+	size_t mark = arena_mark(scratch);
+	char *msg = prepend_to_buffer(scratch, data);
+	if (msg) {
+		uint8_t crc = checksum_m256((const uint8_t *)msg, strlen(msg));
+		safe_serial_write(serial_fd, "%s%02X\x03\r\n", msg, crc);
+	}
+	arena_rewind(scratch, mark);
+}
+
 
 // ---------------- Command handling ----------------
 
@@ -195,10 +233,12 @@ typedef enum {
  * Notes:
  */
 CommandType parse_command(const char *buf) {
+    metrics_count(METRIC_COMMANDS, 1);
     if (buf[0] == 'Z' && buf[1] == '1' && buf[2] == '\0')						return CMD_Z1;
     if (buf[0] == 'Z' && buf[1] == '3' && isdigit(buf[2]) && isdigit(buf[3]))	return CMD_Z3;
     if (buf[0] == 'Z' && buf[1] == '4' && buf[2] == '\0')						return CMD_Z4;
     if (buf[0] == 'F' && buf[1] == '4' && buf[2] == '\0')						return CMD_F4;
+    metrics_count(METRIC_BAD_COMMANDS, 1);
     return CMD_UNKNOWN;
 }
 
@@ -217,39 +257,22 @@ CommandType parse_command(const char *buf) {
  * Notes:
  */
 void handle_command(CommandType cmd) {
-    char *resp_copy = NULL;
+    char resp_copy[REPLAY_LINE_MAX];
     switch (cmd) {
         case CMD_Z1: {
-            resp_copy = get_next_line_copy(file_ptr, &file_mutex);
-            if (resp_copy) {
-				char *msg = prepend_to_buffer(resp_copy);
-				uint8_t crc = checksum_m256((const uint8_t *)msg, strlen(msg));
-		    	safe_serial_write(serial_fd, "%s%02X\x03\r\n", msg, crc);
-				free(msg);
-				msg = NULL;
+            if (replay_next_line(replay_src, resp_copy, sizeof(resp_copy)) > 0) {
+				send_framed(resp_copy);
 			} else {
 				// safe_write_response("%s\r\n", "OK");
 			}
-			free(resp_copy);
-			resp_copy = NULL;
             break;
 			}
-        case CMD_Z3: {
-			char *msg = prepend_to_buffer("ZDOK51");
-			uint8_t crc = checksum_m256((const uint8_t *)msg, strlen(msg));
-		    safe_serial_write(serial_fd, "%s%02X\x03\r\n", msg, crc); // Hardcoded response to Z3.
-			free(msg);
-			msg = NULL;
+        case CMD_Z3:
+			send_framed("ZDOK51"); // Hardcoded response to Z3.
             break;
-			}
-        case CMD_Z4: {
-			char* msg = prepend_to_buffer("ZP E3");
-			uint8_t crc = checksum_m256((const uint8_t *)msg, strlen(msg));
-		    safe_serial_write(serial_fd, "%s%02X\x03\r\n", msg, crc); // Hardcoded response to Z4.
-			free(msg);
-			msg = NULL;
+        case CMD_Z4:
+			send_framed("ZP E3"); // Hardcoded response to Z4.
 			break;
-			}
         case CMD_F4:
 			break;
         default:
@@ -293,72 +316,88 @@ void* signal_thread(void* arg) {
 }
 
 /*
- * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
- * Arguments:    arg: thread arguments.
+ * Name:         run_command
+ * Purpose:      Parses and handles one command split out by on_serial_line().
+ * Arguments:    cmd: the command, NULL terminated.
+ *
+ * Returns:      None.
+ */
+static void run_command(const char *cmd) {
+    CommandType cmd_type = parse_command(cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    handle_command(cmd_type);
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, splits the received text into
+ *               commands and sends each to handle_command().
+ * Arguments:    line: the received text, CR/LF removed and NULL terminated.
+ *               ctx: unused.
  *
  * Output:       None.
  * Modifies:     None.
- * Returns:      NULL.
- * Assumptions:  serial port will have data, and that data will translate to a command.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Ice commands are a letter followed by up to 3 digits (Z1, F5, Z360)
+ *               and are not CR/LF terminated, so the reader runs with flush_on_idle
+ *               and this may receive several commands run together. A new letter
+ *               starts a new command, a fourth character ends one, and anything
+ *               else (spaces, nulls) is ignored, as the byte-wise receiver did.
  */
-void* receiver_thread(void* arg) {
-    (void)arg;
-    char line[5]; // Buffer for 1 letter + 3 digits + null terminator
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    char cmd[5]; // Buffer for 1 letter + 3 digits + null terminator
     size_t len = 0;
 
-    while (!terminate) {
-        char c;
-        // n=0 means VTIME (0.1s) reached. n=1 means a byte arrived.
-        int n = read(serial_fd, &c, 1);
-
-        if (n == 1) { // n will be 1 for a single byte
-            // Start of new command, detected by a letter (Z, F, etc.)
-            if (isalpha(c)) {
-                // If we have an existing command, process it before starting the new one
-                if (len >= 2) {
-                    line[len] = '\0';
-                    handle_command(parse_command(line));
-                }
-                line[0] = c;
-                len = 1;
-            }
-            // Collect up to 3 digits, i.e. Z360
-            else if (isdigit(c) && len > 0) {
-                line[len++] = c;
-
-                // trigger if we hit the absolute maximum length (e.g., Z3XX)
-                if (len == 4) {
-                    line[len] = '\0';
-                    handle_command(parse_command(line));
-                    len = 0;
-                }
-            }
-            // Ignore anything else (\r, \n, spaces, nulls)
-        }
-        else if (n == 0) {
-            // Timeout Trigger: The line went silent (Handles Z1, Z4, F5)
+    for (const char *p = line; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (isalpha(c)) {
+            // If we have an existing command, process it before starting the new one
             if (len >= 2) {
-                line[len] = '\0';
-                handle_command(parse_command(line));
-                len = 0;
+                cmd[len] = '\0';
+                run_command(cmd);
             }
-        }
-		else
-		{
-            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("Serial Read Error");
+            cmd[0] = (char)c;
+            len = 1;
+        } else if (isdigit(c) && len > 0) {
+            cmd[len++] = (char)c;
+            if (len == 4) { // trigger if we hit the absolute maximum length (e.g., Z3XX)
+                cmd[len] = '\0';
+                run_command(cmd);
+                len = 0;
             }
-			else {
-            	// avoid busy loop
-               	usleep(1000);
-			}
         }
     }
+    if (len >= 2) { // The line went silent (Handles Z1, Z4, F5)
+        cmd[len] = '\0';
+        run_command(cmd);
+    }
+}
+
+/*
+ * Name:         receiver_thread
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
+ * Arguments:    arg: thread arguments.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      NULL.
+ * Assumptions:  serial port will have data, and that data will translate to a command.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+void* receiver_thread(void* arg) {
+    (void)arg;
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    reader.flush_on_idle = true; // Ice commands are not CR/LF terminated.
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
@@ -388,15 +427,19 @@ void* receiver_thread(void* arg) {
 
 int main(int argc, char *argv[]) {
 
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--metrics PATH] [--capture PATH]\n", argv[0]);
         cleanup_and_exit(1);
     }
 
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
         cleanup_and_exit(1);
     }
@@ -413,6 +456,10 @@ int main(int argc, char *argv[]) {
     if (serial_fd < 0) {
         cleanup_and_exit(1);
     }
+
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -421,6 +468,11 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
+
+	if (metrics_start(&metrics_opts, argv[0]) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, argv[0]) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
 
 	// create the signal thread
 
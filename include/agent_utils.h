@@ -0,0 +1,100 @@
+/*
+ * File:     agent_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  The control protocol between sensor_control and the wxagent on
+ *           each node of a rig. One TCP connection per node carries every
+ *           sensor on it, as lines of space separated fields:
+ *
+ *               <tag> <verb> [field ...]    request, from the controller
+ *               <tag> ok [field ...]        reply, one per request, in order
+ *               <tag> err <message>
+ *               * <event> [field ...]       from the agent, at any time
+ *
+ *           The tag is chosen by the controller and only echoed back, so a
+ *           controller writes as many requests as it has without waiting and
+ *           matches the replies as they come. Requests:
+ *
+ *               hello <version> [token]                ok wxagent <version> <host>
+ *               define <name> <program> <0|1> [arg ...] add or change a sensor, 1 restarts it after a crash
+ *               start <name> | stop <name> | reload <name> | forget <name>
+ *               put <path> <size>                      then <size> bytes, written to path under the agent's root
+ *               ping
+ *
+ *           Events:
+ *
+ *               * sensor <name> <state> <pid> <restarts> <exit> <frames> <bytes>
+ *               * log <name> <out|err|note> <line>
+ *
+ *           The agent sends a sensor event when anything in it changes, at
+ *           most once per AGENT_BATCH_MS, every changed sensor in one write.
+ *           <exit> is "-" before the first exit, the exit status, or minus the
+ *           signal that ended it. <frames> and <bytes> are the sensor's
+ *           wx_frames_sent_total and wx_bytes_written_total when its
+ *           arguments hold --metrics, see metrics_utils.h. A log event is
+ *           one line of the sensor's stdout or stderr, or a note from the
+ *           agent about it, such as an exit or a restart.
+ *
+ *           A field is escaped with %XX for '%', space, and every control
+ *           character, so a path or an argument holding those arrives whole.
+ *           A lone "%" is the empty string.
+ *
+ *           An agent started with --token-file takes nothing but a hello
+ *           holding its token, and drops a controller that sends anything
+ *           else first. No events are sent before that hello.
+ *
+ * Mods:     14/10/2026 hello takes the agent's token, see wxagent --token-file.
+ *
+ */
+
+#ifndef AGENT_UTILS_H
+#define AGENT_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define AGENT_PROTOCOL 1               // hello version, bumped on any incompatible change.
+#define AGENT_PORT 7400                // wxagent listens here unless --listen says otherwise.
+#define AGENT_LINE_MAX 65536           // Longest line, a peer sending longer is dropped.
+#define AGENT_FIELDS_MAX 256           // Fields in one line, the tag and verb included.
+#define AGENT_BATCH_MS 100             // Sensor events are gathered this long before they are sent.
+
+// What a sensor on an agent is doing, the same states as a sensor_control row.
+typedef enum {
+    AGENT_STOPPED,                     // Never started, or stopped by request.
+    AGENT_RUNNING,
+    AGENT_RESTARTING,                  // Crashed, waiting out the backoff.
+    AGENT_FAILED,                      // Exited on its own and will not restart.
+    AGENT_STATES
+} AgentState;
+
+// Bytes waiting to be parsed or written, data[head, len).
+typedef struct {
+    char *data;
+    size_t head;
+    size_t len;
+    size_t cap;
+} AgentBuffer;
+
+int agent_buffer_append(AgentBuffer *b, const void *data, size_t len) __attribute__((nonnull(1)));
+int agent_buffer_printf(AgentBuffer *b, const char *fmt, ...) __attribute__((nonnull(1, 2))) __attribute__((format(printf, 2, 3)));
+int agent_buffer_field(AgentBuffer *b, const char *field) __attribute__((nonnull(1, 2)));
+int agent_buffer_fields(AgentBuffer *b, const char *const *fields, size_t count) __attribute__((nonnull(1, 2)));
+ssize_t agent_buffer_fill(AgentBuffer *b, int fd) __attribute__((nonnull(1)));
+int agent_buffer_flush(AgentBuffer *b, int fd) __attribute__((nonnull(1)));
+char *agent_buffer_line(AgentBuffer *b) __attribute__((nonnull(1)));
+void agent_buffer_consume(AgentBuffer *b, size_t n) __attribute__((nonnull(1)));
+void agent_buffer_free(AgentBuffer *b);
+
+static inline size_t agent_buffer_pending(const AgentBuffer *b) {
+    return b->len - b->head;
+}
+
+int agent_split(char *line, char **fields, int max) __attribute__((nonnull(1, 2)));
+const char *agent_state_name(AgentState state);
+int agent_state_parse(const char *name) __attribute__((nonnull(1)));
+
+#endif // AGENT_UTILS_H
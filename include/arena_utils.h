@@ -0,0 +1,54 @@
+/*
+ * File:     arena_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Bump allocator over one anonymous mapping. Long lived tables that
+ *           are sized at startup (strike histories and the like) are carved
+ *           out of an arena instead of malloc()ed one by one, so thousands of
+ *           emulated sensors in one process cost one mapping and no per table
+ *           heap headers, and are released together.
+ *
+ *           Each thread also has a scratch arena, arena_scratch(), for the
+ *           bytes of the message it is building. A builder takes an
+ *           arena_mark() before it allocates and hands the mark back to
+ *           arena_rewind() once the message is sent, so the send path makes
+ *           no heap allocation, and a builder that calls another one (a
+ *           frame formatted through safe_serial_write()) only gives back
+ *           what it took.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef ARENA_UTILS_H
+#define ARENA_UTILS_H
+
+#include <stddef.h>
+
+typedef struct {
+    unsigned char *base;     // Start of the mapping, NULL before arena_init().
+    size_t size;             // Bytes reserved.
+    size_t used;             // Bytes handed out, including alignment padding.
+} Arena;
+
+#define ARENA_INITIALIZER { 0 }
+#define ARENA_SCRATCH_SIZE (256 * 1024) // Per thread, only the pages touched are backed.
+
+int arena_init(Arena *a, size_t size);
+void *arena_alloc(Arena *a, size_t size, size_t align);
+char *arena_strndup(Arena *a, const char *s, size_t len);
+void arena_reset(Arena *a);
+void arena_destroy(Arena *a);
+Arena *arena_scratch(void);
+
+static inline size_t arena_mark(const Arena *a) {
+    return a->used;
+}
+
+// Gives back everything allocated from a since mark was taken.
+static inline void arena_rewind(Arena *a, size_t mark) {
+    if (mark < a->used) a->used = mark;
+}
+
+#endif
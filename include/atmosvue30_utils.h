@@ -6,7 +6,7 @@
  * Purpose:  Header file for AtmosVUE 30 Aviation Weather System emulation.
  *           Defines data structures, enumerations, and function prototypes
  *           for handling Campbell Scientific AtmosVUE 30 communication protocol.
- * Mods:
+ * Mods:     14/10/2026 CommandMap and CMD_ENTRY() moved to command_utils.h.
  *
  *
  */
@@ -17,6 +17,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include "command_utils.h"
 
 #define MAX_INPUT_STR 512
 #define MAX_SERIAL_STR 16
@@ -267,14 +268,6 @@ typedef enum {
     CMD_INVALID_FORMAT  // Command format error
 } CommandType;
 
-typedef struct {
-    const char *name;
-    CommandType type;
-    size_t len;
-} CommandMap;
-
-#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
-
 static const CommandMap cmd_table[] = {
     CMD_ENTRY("POLL",   	CMD_POLL),
     CMD_ENTRY("GET",     	CMD_GET),
@@ -5,6 +5,8 @@ D0nkeyneedlebuttersponge
  * Date:     27/02/2026
  * Version:  1.0
  * Purpose:  Structures and prototypes for Campbell Scientific SkyVue8 emulation.
+ * Mods:     14/10/2026 Added BTD300_storm_message().
+ *           14/10/2026 CommandMap and CMD_ENTRY() moved to command_utils.h.
  */
 
 #ifndef BTD300_UTILS_H
@@ -13,6 +15,8 @@ D0nkeyneedlebuttersponge
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include "command_utils.h"
+#include "storm_utils.h"
 
 #define MAX_FORM_STR 128
 #define MAX_SN_LEN 16
@@ -22,6 +26,7 @@ D0nkeyneedlebuttersponge
 #define MAX_HEADER_STR 7
 #define MAX_SELF_TEST_FLAG 6
 #define MAX_FLASHES 4
+#define BTD300_RANGE_KM 83.0 // Detection range, flashes further out are not reported.
 
 typedef enum {
     SMODE_STOP,  // No output
@@ -64,14 +69,6 @@ typedef enum {
     CMD_GET_SER // "SN?" get sensor serial number.
 } CommandType;
 
-typedef struct {
-    const char *name;
-    CommandType type;
-	size_t len;
-} CommandMap;
-
-#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
-
 static const CommandMap cmd_table[] = {
     CMD_ENTRY("RUN",		CMD_RUN),
     CMD_ENTRY("STOP",		CMD_STOP),
@@ -127,6 +124,9 @@ bool BTD300_is_ready_to_send(BTD300_sensor *sensor);
 int set_dist(BTD300_sensor **ptr, int distance_id, int distance);
 int reset_flash(BTD300_sensor **ptr);
 time_t parse_to_epoch(const char *date_token, const char *time_token);
+void BTD300_parse_message(char *msg, ParsedMessage *p_message);
+void BTD300_storm_message(const BTD300_sensor *sensor, const StormFlash *flashes, size_t count,
+                          double step_end_s, ParsedMessage *p_message);
 void epoch_to_date(time_t epoch, char *buf);
 void epoch_to_time(time_t epoch, char *buf);
 
@@ -0,0 +1,48 @@
+/*
+ * File:     calendar_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Cached calendar conversion for message time stamps. A Calendar
+ *           holds the broken-down time and the date and time text the
+ *           emulators send for one second. Setting it to a new second in the
+ *           same day is a few divisions and digit stores; gmtime_r() or
+ *           localtime_r() and the date text only run when the day rolls
+ *           over, or for local time, the hour, so a change to or from summer
+ *           time is seen at the hour it happens.
+ *
+ *           A Calendar is not shared: give each thread its own, as a
+ *           __thread static in the module that formats the message.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef CALENDAR_UTILS_H
+#define CALENDAR_UTILS_H
+
+#include <time.h>
+
+typedef enum {
+    CALENDAR_UTC,
+    CALENDAR_LOCAL
+} CalendarZone;
+
+typedef struct {
+    CalendarZone zone;
+    time_t second;           // The second the fields hold, -1 before the first calendar_set().
+    time_t window_start;     // The date fields hold from here, a UTC day or a local hour.
+    time_t window_end;       // To here, exclusive.
+    long window_sod;         // Seconds into the day at window_start.
+    struct tm tm;            // The broken-down time of second.
+    char ddmmyy[7];          // "141026"
+    char hhmmss[7];          // "135655"
+    char ymd[11];            // "2026-10-14"
+    char hms[9];             // "13:56:55"
+} Calendar;
+
+#define CALENDAR_INITIALIZER(z) { .zone = (z), .second = (time_t)-1 }
+
+const Calendar *calendar_set(Calendar *c, time_t t) __attribute__((nonnull(1)));
+
+#endif
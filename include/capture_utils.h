@@ -0,0 +1,105 @@
+/*
+ * File:     capture_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Built-in wire recorder. With --capture PATH every byte an emulator
+ *           writes to or reads from a port is recorded with a monotonic
+ *           timestamp, so a misbehaving logger can be studied without strace
+ *           or a sniffer changing the timing.
+ *
+ *           Each thread that touches a port gets its own ring. Recording is a
+ *           clock read and a copy into that ring, with no lock and no system
+ *           call, done after the write or read it records. A drainer thread
+ *           empties the rings every CAPTURE_FLUSH_MS into the capture file,
+ *           merging them by timestamp. A thread whose ring is full loses the
+ *           record, never its place on the line; the file then carries a gap
+ *           record with the count lost.
+ *
+ *           The file is a CaptureFileHeader followed by CaptureRecords, each
+ *           followed by its len bytes. A CAPTURE_PORT record names a port the
+ *           first time it appears. wxcap dumps a capture or plays one port's
+ *           output back to a host at the recorded timing.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef CAPTURE_UTILS_H
+#define CAPTURE_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#define CAPTURE_MAGIC "WXC1"            // First four bytes of a capture file.
+#define CAPTURE_VERSION 1               // Bumped whenever the file layout changes.
+#define CAPTURE_BYTE_ORDER 0x01020304u  // Written in host order, as in a .wxb header.
+#define CAPTURE_PROGRAM_LEN 16          // Program name field, NUL padded.
+#define CAPTURE_PORT_NAME_LEN 64        // Longest port name kept.
+
+#define CAPTURE_RING_SIZE 262144        // Bytes per thread ring, a power of two. Seconds of a flooded pty.
+#define CAPTURE_MAX_THREADS 64          // Rings, a thread beyond this is not recorded.
+#define CAPTURE_MAX_PORTS 64            // Ports named in one capture.
+#define CAPTURE_CHUNK 4096              // Largest payload of one record, longer writes are split.
+#define CAPTURE_FLUSH_MS 50             // How often the drainer empties the rings.
+#define CAPTURE_NO_PORT 0xff            // Port id of an fd open_serial_port() did not open.
+
+typedef enum {
+    CAPTURE_RX,                         // Bytes read from the port.
+    CAPTURE_TX,                         // Bytes written to the port.
+    CAPTURE_PORT,                       // The port's name, the payload is not NUL terminated.
+    CAPTURE_GAP                         // A uint64_t count of records lost to full rings.
+} CaptureDirection;
+
+// On-disk header of a capture file.
+typedef struct {
+    char magic[4];                      // CAPTURE_MAGIC, not NUL terminated.
+    uint16_t version;                   // CAPTURE_VERSION.
+    uint16_t header_size;               // sizeof(CaptureFileHeader), offset of the first record.
+    uint32_t byte_order;                // CAPTURE_BYTE_ORDER.
+    uint32_t record_size;               // sizeof(CaptureRecord).
+    int64_t start_unix_ns;              // Wall clock when the capture started.
+    char program[CAPTURE_PROGRAM_LEN];  // The emulator that wrote it, e.g. "ptb330".
+} CaptureFileHeader;
+
+// One record in a thread ring and in the file, followed by len bytes.
+typedef struct {
+    uint64_t t_ns;                      // Monotonic time since the capture started.
+    uint16_t len;                       // Payload bytes.
+    uint8_t port;                       // Port id, in order of first appearance, or CAPTURE_NO_PORT.
+    uint8_t dir;                        // CaptureDirection.
+    uint32_t reserved;                  // Zero.
+} CaptureRecord;
+
+// Options taken off the command line by capture_parse_options().
+typedef struct {
+    const char *path;                   // Capture file to write, NULL for no capture.
+} CaptureOptions;
+
+extern atomic_bool capture_on;
+
+void capture_iov(int fd, CaptureDirection dir, const struct iovec *iov, int iovcnt, size_t len);
+
+/*
+ * Records the first len bytes of iov. One relaxed load and a branch when
+ * capture is off.
+ */
+static inline void capture_writev(int fd, CaptureDirection dir, const struct iovec *iov, int iovcnt, size_t len) {
+    if (!atomic_load_explicit(&capture_on, memory_order_relaxed) || len == 0) return;
+    capture_iov(fd, dir, iov, iovcnt, len);
+}
+
+static inline void capture_bytes(int fd, CaptureDirection dir, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    capture_writev(fd, dir, &iov, 1, len);
+}
+
+int capture_parse_options(int *argc, char **argv, CaptureOptions *opts);
+void capture_port(int fd, const char *name);
+int capture_start(const CaptureOptions *opts, const char *name);
+void capture_stop(void);
+
+#endif
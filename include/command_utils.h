@@ -0,0 +1,79 @@
+/*
+ * File:     command_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Shared keyword dispatch for the emulators' terminal commands.
+ *           Each sensor header declares its cmd_table[] of CMD_ENTRY() lines
+ *           as before, and its parser declares one CommandDispatch over that
+ *           table with COMMAND_DISPATCH_INITIALIZER(). The first lookup turns
+ *           the table into a case folded trie, with a jump table on the first
+ *           character, so a poll costs one step per keyword character instead
+ *           of a strncasecmp() against every entry.
+ *
+ *           A lookup returns the same entry the old linear scans did: the
+ *           first table entry that is a prefix of the line and is followed by
+ *           a character the sensor accepts as a terminator.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef COMMAND_UTILS_H
+#define COMMAND_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define COMMAND_MAX_NODES 512      // Trie nodes, one per distinct keyword prefix across a table.
+#define COMMAND_ROOT_SIZE 128      // Jump table on the first keyword character, ASCII only.
+#define COMMAND_NONE UINT16_MAX
+
+// Characters accepted straight after a keyword, '\0' is always accepted.
+#define CMD_TERM_ALNUM   0x01      // "J2", the argument runs on from the keyword.
+#define CMD_TERM_SPACE   0x02      // "SEND 0", white space.
+#define CMD_TERM_QUERY   0x04      // "INTV?".
+#define CMD_TERM_EQUALS  0x08      // "ADDR=2".
+#define CMD_SKIP_CONTROL 0x10      // Skip leading control characters (<STX>) as well as white space.
+
+typedef struct {
+    const char *name;
+    int type;              // The sensor's CommandType.
+	size_t len;
+} CommandMap;
+
+#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
+
+typedef struct {
+    char ch;               // Upper cased keyword character.
+    uint16_t child;        // First node one character further on, or COMMAND_NONE.
+    uint16_t sibling;      // Next node at this depth under the same parent, or COMMAND_NONE.
+    uint16_t entry;        // Lowest table index whose keyword ends here, or COMMAND_NONE.
+} CommandNode;
+
+typedef struct {
+    const CommandMap *table;
+    size_t count;
+    unsigned flags;        // CMD_TERM_* and CMD_SKIP_CONTROL.
+    _Atomic bool built;
+    bool linear;           // The table did not fit COMMAND_MAX_NODES, lookups scan it instead.
+    pthread_mutex_t lock;  // Serialises the build.
+    uint16_t empty;        // Entry with an empty keyword, or COMMAND_NONE.
+    uint16_t root[COMMAND_ROOT_SIZE];
+    uint16_t node_count;
+    CommandNode nodes[COMMAND_MAX_NODES];
+} CommandDispatch;
+
+// For a static CommandDispatch over a sensor's cmd_table[], built on first use.
+#define COMMAND_DISPATCH_INITIALIZER(tbl, cnt, flg) \
+    { .table = (tbl), .count = (cnt), .flags = (flg), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+const CommandMap *command_lookup(CommandDispatch *d, const char *buf, const char **args);
+size_t command_copy_params(const char *args, char *dst, size_t size);
+int command_arg_long(const char *s, long min, long max, long *out);
+int command_arg_double(const char *s, double min, double max, double *out);
+
+#endif
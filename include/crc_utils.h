@@ -13,12 +13,32 @@
 #define CRC_UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+// CRC-16 variants used by the sensors, all CCITT polynomial 0x1021 MSB first.
+typedef enum {
+    CRC16_GENIBUS, // init 0xFFFF, xorout 0xFFFF, crc16(), SkyVUE8.
+    CRC16_XMODEM   // init 0x0000, xorout 0x0000, crc16_ccitt(), AtmosVue30.
+} Crc16Variant;
+
+// Running state for an incremental CRC-16, see crc16_init().
+typedef struct {
+    uint16_t value;
+    uint16_t xor_out;
+} Crc16Context;
+
+void crc16_init(Crc16Context *ctx, Crc16Variant variant);
+void crc16_update(Crc16Context *ctx, const void *data, size_t length);
+uint16_t crc16_final(const Crc16Context *ctx);
 
 unsigned short crc16(char *buffer, int length);
 unsigned int crc_ccitt(char *line_of_data);
 
 uint16_t crc16_ccitt(const uint8_t *data, size_t length);
 
+// CRC-16/ARC, reflected polynomial 0xA001, as SDI-12 appends to a reply.
+uint16_t crc16_arc(const uint8_t *data, size_t length);
+
 // Checksum 8 Modulo 256
 uint8_t checksum_m256(const uint8_t *str_to_chk, size_t length);
 
@@ -0,0 +1,84 @@
+/*
+ * File:     dac_stream.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Waveform streaming engine for the MCP4728 quad DAC behind the
+ *           analogue emulators (hc2s3). The data file is turned into one DAC
+ *           code per channel per sample at load, and the engine ramps between
+ *           consecutive samples at a fixed update rate from its own thread, on
+ *           the absolute deadlines of a SendSchedule.
+ *
+ *           Ticks are pre-encoded a sample period at a time. Each tick is one
+ *           I2C_RDWR ioctl carrying a multi-write of every channel with UDAC
+ *           set and, when latching, a general call software update, so all
+ *           channels change together at one stop condition and the CPU does
+ *           one system call per update however many channels there are.
+ *
+ *           A stream with a feed, see dac_stream_set_feed(), takes each next
+ *           sample from the feed as a segment ends instead of cycling through
+ *           the samples it was given, for a source that is not known in advance.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef DAC_STREAM_H
+#define DAC_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <signal.h>
+#include "schedule_utils.h"
+
+#define DAC_STREAM_CHANNELS 4        // MCP4728 channels A-D.
+#define DAC_STREAM_MAX_RATE_HZ 1000  // Two channels and the latch take about 0.3 ms at 400 kHz.
+#define DAC_STREAM_CODE_MAX 4095
+#define DAC_STREAM_BYTES_PER_CHANNEL 3
+
+// One data file entry, channel codes in the order A, B, C, D.
+typedef struct {
+    uint16_t code[DAC_STREAM_CHANNELS];
+} DacSample;
+
+// Fetches the sample a live stream ramps to next. Returns false to hold the last one.
+typedef bool (*DacFeedFn)(DacSample *next, void *ctx);
+
+typedef struct {
+    uint64_t updates;      // Ticks written to the DAC.
+    uint64_t errors;       // Ticks whose ioctl failed.
+    uint64_t segments;     // Sample periods encoded.
+} DacStreamStats;
+
+typedef struct {
+    int fd;                // Open i2c-dev adapter.
+    uint16_t addr;         // 7-bit address of the DAC.
+    unsigned channels;     // Channels A.. written each tick.
+    bool latch;            // Follow each write with a general call software update.
+    DacSample *samples;    // Copy of the caller's samples.
+    size_t sample_count;
+    size_t sample;         // Segment being streamed ramps from samples[sample] to the next one.
+    uint32_t ticks_per_sample;
+    uint32_t tick;         // Next tick of the segment.
+    size_t frame_size;     // Bytes of one tick's multi-write.
+    uint8_t *frames;       // ticks_per_sample pre-encoded multi-writes.
+    uint64_t interval_ns;  // Between ticks.
+    SendSchedule schedule;
+    DacStreamStats stats;
+    DacFeedFn feed;        // NULL to cycle through samples, see dac_stream_set_feed().
+    void *feed_ctx;
+} DacStream;
+
+// For a static DacStream, so dac_stream_wake() and dac_stream_destroy() are safe before dac_stream_init().
+#define DAC_STREAM_INITIALIZER { .fd = -1, .schedule = SCHEDULE_INITIALIZER }
+
+int dac_stream_init(DacStream *s, int fd, uint16_t addr, unsigned channels, const DacSample *samples,
+                    size_t sample_count, double sample_period_s, unsigned rate_hz, bool latch);
+int dac_stream_set_feed(DacStream *s, DacFeedFn feed, void *ctx) __attribute__((nonnull(1, 2)));
+void dac_stream_run(DacStream *s, volatile sig_atomic_t *stop) __attribute__((nonnull(1, 2)));
+void dac_stream_wake(DacStream *s);
+void dac_stream_report(const DacStream *s, const char *name);
+void dac_stream_destroy(DacStream *s);
+
+#endif
@@ -5,7 +5,8 @@
  * Date:     26/11/2025
  * Version:  1.0
  * Purpose:  Program to handle setting up a serial connection and two threads
- * Mods:
+ * Mods:     14/10/2026 Added advance_send_time().
+ *           14/10/2026 Added the pressure compensation engine, dsp8100_compensate().
  *
  *
  */
@@ -14,14 +15,24 @@
 #define DSP8100_UTILS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 #define MAX_INPUT_STR 256
 #define MAX_SERIAL_STR 16
 #define MAX_MODEL_NUM 32
 #define MAX_MSG_STR 17
 
+// Coefficient table: f0 (Hz), V0 (V), then the K(i,j) pressure surface row by row.
+#define DSP8100_COEFFICIENTS 58
+#define DSP8100_F_TERMS 8              // Powers 0-7 of the normalised frequency f / f0 - 1.
+#define DSP8100_V_TERMS 7              // Powers 0-6 of the diode voltage offset V - V0.
+#define DSP8100_DIODE_V25 0.600        // Simulated diode voltage at 25 C.
+#define DSP8100_DIODE_V_PER_C -0.0021  // And its temperature coefficient.
+
 extern char units_of_measure[25][50];
-extern double coefficients[58];
+extern double coefficients[DSP8100_COEFFICIENTS];
 extern int current_u_of_m;
 
 /// BAROMETRIC PRESSURE SENSOR ///
@@ -70,6 +81,8 @@ typedef struct {
     // Simulated data tracking
     float current_pressure;
     float current_temperature;
+    double raw_frequency;    // Diaphragm frequency, Hz, that reads as the data file pressure.
+    double diode_voltage;    // Temperature diode, V.
 
 	// Time stamping for interleaved sensor data sending.
 	struct timespec last_send_time;
@@ -90,6 +103,8 @@ typedef enum {
     CMD_R3,             // IEEE binary pressure
     CMD_R4,             // IEEE binary both
     CMD_R5,             // IEEE binary temperature
+    CMD_R9,             // Raw frequency + diode voltage (emulator only)
+    CMD_R9_UNITS,       // Raw frequency + diode voltage with units
 
     // Information
     CMD_I,              // Identity
@@ -214,11 +229,15 @@ typedef struct {
 const char* get_pressure_units_text(uint8_t code);
 
 void init_coefficients();
+void dsp8100_compensate(const double *coef, const double *freq, const double *volt, double *pressure, size_t n);
+double dsp8100_raw_frequency(const double *coef, double pressure, double volt);
+double dsp8100_diode_voltage(double temperature);
 int init_sensor(bp_sensor **ptr);
 int update_message(bp_sensor **ptr, char *msg);
 int update_units(bp_sensor **ptr, uint8_t unit_id);
 void reassign_sensor_address(uint8_t old_addr, uint8_t new_addr);
 bool is_ready_to_send(bp_sensor *s);
+void advance_send_time(bp_sensor *s);
 
 /// END BAROMETRIC PRESSURE SENSOR
 
@@ -0,0 +1,88 @@
+/*
+ * File:     fault_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Fault injection on the transmit path, for testing how a logger
+ *           copes with a bad line. With WX_FAULTS set, every message an
+ *           emulator sends through serial_utils is given, each with its own
+ *           probability:
+ *
+ *               drop       not sent at all
+ *               truncate   cut short after a random byte
+ *               etx        sent without its terminator, the last ETX, or the
+ *                          trailing CR/LF of a message with no ETX
+ *               checksum   the last byte before the trailing CR, LF, ETX and
+ *                          EOT changed, the last checksum digit of a frame
+ *                          that ends in one, otherwise the last data byte
+ *               flip       one random bit flipped
+ *               delay      held back up to delay_ms before it is queued
+ *               stuck      the port's previous message sent in its place, and
+ *                          for the next stuck_frames messages
+ *
+ *           WX_FAULTS is a list of those names with their probability per
+ *           message, with delay_ms, stuck_frames and seed, separated by commas
+ *           or white space:
+ *
+ *               WX_FAULTS=checksum=0.01,etx=0.002,delay=0.05,delay_ms=800,seed=7
+ *
+ *           or @FILE, a file holding such a list, where '#' starts a comment.
+ *           SIGUSR2 reads the file again, or turns an inline list off and back
+ *           on. A seed gives the same faults for the same messages; without
+ *           one a seed is picked and printed, so a run can be repeated.
+ *
+ *           Unset, each message costs one relaxed load and a branch.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef FAULT_UTILS_H
+#define FAULT_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FAULT_ENV "WX_FAULTS"
+#define FAULT_MAX_MESSAGE 8192          // Longest message faulted, longer ones are sent untouched.
+#define FAULT_MAX_PORTS 16              // Ports whose last message is kept for stuck faults.
+#define FAULT_DELAY_MS 500              // Longest delay unless delay_ms is given.
+#define FAULT_STUCK_FRAMES 10           // Messages a stuck port repeats unless stuck_frames is given.
+
+typedef enum {
+    FAULT_DROP,
+    FAULT_TRUNCATE,
+    FAULT_ETX,
+    FAULT_CHECKSUM,
+    FAULT_FLIP,
+    FAULT_DELAY,
+    FAULT_STUCK,
+    FAULT_KINDS
+} FaultKind;
+
+// One WX_FAULTS list.
+typedef struct {
+    double rate[FAULT_KINDS];           // Probability per message, 0 for never.
+    unsigned delay_ms;
+    unsigned stuck_frames;
+    uint64_t seed;
+} FaultConfig;
+
+extern atomic_bool fault_on;
+
+// One relaxed load, the only cost on the transmit path while no fault is set.
+static inline bool fault_active(void) {
+    return atomic_load_explicit(&fault_on, memory_order_relaxed);
+}
+
+int fault_parse(const char *spec, FaultConfig *config) __attribute__((nonnull(1, 2)));
+void fault_configure(const FaultConfig *faults);
+void fault_init(void);
+ssize_t fault_apply(int fd, const struct iovec *iov, int iovcnt, size_t total, char *out, unsigned *delay_ms) __attribute__((nonnull(2, 5)));
+void fault_stop(void);
+
+#endif
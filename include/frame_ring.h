@@ -0,0 +1,49 @@
+/*
+ * File:     frame_ring.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Single producer, single consumer ring of pre-rendered output frames.
+ *           A render thread formats upcoming frames (checksums included) ahead
+ *           of time, so the sender only has to hand ready bytes to the serial
+ *           port on each tick. The consumer never blocks or takes a lock; the
+ *           producer sleeps on a semaphore while the ring is full.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#define FRAME_RING_SLOTS 64 // Power of two, two seconds of output at 32 Hz.
+#define FRAME_RING_BYTES 64 // Largest frame one slot holds.
+
+typedef struct {
+    uint16_t len;            // Bytes in the frame, 0 if the producer had nothing to render.
+    uint16_t tag;            // Left to the caller, e.g. the settings the frame was rendered with.
+    char bytes[FRAME_RING_BYTES];
+} RingFrame;
+
+typedef struct {
+    _Atomic uint64_t head;   // Frames published by the producer.
+    _Atomic uint64_t tail;   // Frames released by the consumer.
+    sem_t space;             // Free slots, plus any frame_ring_wake() tokens.
+    RingFrame slots[FRAME_RING_SLOTS];
+} FrameRing;
+
+int frame_ring_init(FrameRing *r);
+RingFrame *frame_ring_claim(FrameRing *r);
+void frame_ring_publish(FrameRing *r);
+const RingFrame *frame_ring_peek(FrameRing *r);
+void frame_ring_release(FrameRing *r);
+size_t frame_ring_drain(FrameRing *r);
+void frame_ring_wake(FrameRing *r);
+void frame_ring_destroy(FrameRing *r);
+
+#endif
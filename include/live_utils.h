@@ -0,0 +1,67 @@
+/*
+ * File:     live_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Live data ingestion for a replay source fed by a pipe, FIFO or
+ *           UDP socket, e.g. a model run or a relay from another station.
+ *           An ingestion thread reads the stream in bulk, splits it into lines,
+ *           parses each line into the emulator's ParsedMessage and publishes it
+ *           into a fixed ring. The sender takes records out of the ring without
+ *           a lock, a system call or a wait, so a slow or bursty upstream never
+ *           moves its schedule.
+ *
+ *           The ring has one producer, the ingestion thread. A poll reply can
+ *           take a record from the receiver thread while the sender takes one,
+ *           so the consumer side claims a slot with a compare and swap and
+ *           throws away a copy that lost the race.
+ *
+ *           What happens when the two sides run at different rates is the
+ *           feed's policy:
+ *
+ *               latest  The sender always gets the newest record, the ingester
+ *                       overwrites and never waits. A quiet upstream repeats
+ *                       the last record. The default.
+ *               block   Every record is sent once, in order. The ingester waits
+ *                       for a free slot, which backs the upstream up through the
+ *                       pipe. A quiet upstream sends nothing for that interval.
+ *               repeat  Records are sent in order and a quiet upstream repeats
+ *                       the last one. A record arriving at a full ring is dropped.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef LIVE_UTILS_H
+#define LIVE_UTILS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define LIVE_DEPTH_DEFAULT 64      // Ring slots unless --live-depth is given, a power of two.
+#define LIVE_DEPTH_MAX 65536       // Largest --live-depth.
+#define LIVE_READ_SIZE 65536       // Bytes the ingester asks for per read().
+#define LIVE_POLL_MS 100           // How often a blocked ingester checks for live_stop().
+
+typedef enum {
+    LIVE_OFF,                      // Not a live feed, the stream is read on the sender's schedule.
+    LIVE_LATEST,
+    LIVE_BLOCK,
+    LIVE_REPEAT
+} LivePolicy;
+
+/*
+ * Parses one line of the feed into a record of the feed's record_size.
+ * line is NUL terminated without its CR/LF and may be modified.
+ */
+typedef void (*LiveParseFn)(char *line, void *record);
+
+typedef struct LiveFeed LiveFeed;
+
+LivePolicy live_policy(const char *name);
+const char *live_policy_name(LivePolicy policy);
+LiveFeed *live_start(int fd, bool datagram, LivePolicy policy, size_t depth, size_t record_size, LiveParseFn parse) __attribute__((warn_unused_result));
+bool live_next(LiveFeed *feed, void *out) __attribute__((nonnull(1, 2)));
+void live_stop(LiveFeed *feed);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * File:     metrics_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Hot path counters and latency histograms for the emulators, served
+ *           in the Prometheus text format on a UNIX socket named with
+ *           --metrics PATH:
+ *
+ *               curl --unix-socket /tmp/ptb330.sock http://localhost/metrics
+ *
+ *           Every thread counts into its own cache line sized shard, claimed on
+ *           first use, with relaxed loads and stores and no lock or atomic
+ *           read-modify-write; a scrape sums the shards. Without --metrics each
+ *           call is one relaxed load and a branch, and nothing is timed.
+ *
+ *           serial_utils, schedule_utils and command_utils count for every
+ *           emulator, so an emulator only parses the option, starts the
+ *           listener and locks its shared state with metrics_mutex_lock().
+ *
+ * Mods:
+ *
+ */
+
+#ifndef METRICS_UTILS_H
+#define METRICS_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "replay_utils.h"
+
+#define METRICS_MAX_THREADS 64     // Shards, threads beyond this share one with atomic adds.
+#define METRICS_BUCKETS 32         // Histogram buckets, bucket i counts values below 2^i ns, the last 2^30 ns (1.07 s) and over.
+
+typedef enum {
+    METRIC_FRAMES_SENT,            // Messages queued or written to a serial port.
+    METRIC_BYTES_WRITTEN,          // Bytes accepted by the serial device.
+    METRIC_LINES_RECEIVED,         // Lines handed to a command handler.
+    METRIC_LINES_DISCARDED,        // Lines dropped for being longer than SERIAL_LINE_MAX - 1.
+    METRIC_COMMANDS,               // Lines looked up in a command table.
+    METRIC_BAD_COMMANDS,           // Of those, lines that matched no command.
+    METRIC_LIVE_RECORDS,           // Records parsed from a live feed.
+    METRIC_LIVE_DROPPED,           // Live records overwritten or turned away before they were sent.
+    METRIC_LIVE_REPEATS,           // Sends that reused the last live record, none newer had arrived.
+    METRIC_REPLAY_RELOADS,         // Data files swapped in by replay_reload().
+    METRIC_CAPTURE_RECORDS,        // Records written into the --capture rings.
+    METRIC_CAPTURE_LOST,           // Records turned away by a full capture ring.
+    METRIC_FAULTS_INJECTED,        // Faults WX_FAULTS put into sent messages.
+    METRIC_COUNTERS
+} MetricCounter;
+
+typedef enum {
+    METRIC_TCDRAIN_NS,             // Time spent in tcdrain().
+    METRIC_SEND_LATE_NS,           // Sender wake-up time minus deadline, early ticks count as 0.
+    METRIC_LOCK_WAIT_NS,           // Time to take a metrics_mutex_lock() mutex, 0 when uncontended.
+    METRIC_HISTOGRAMS
+} MetricHistogram;
+
+typedef struct {
+    _Atomic uint64_t counter[METRIC_COUNTERS];
+    _Atomic uint64_t bucket[METRIC_HISTOGRAMS][METRICS_BUCKETS];
+    _Atomic uint64_t sum_ns[METRIC_HISTOGRAMS];
+    bool shared;                   // The overflow shard, written by several threads.
+} __attribute__((aligned(64))) MetricsShard;
+
+// Options taken off the command line by metrics_parse_options().
+typedef struct {
+    const char *path;              // UNIX socket to listen on, NULL for no metrics.
+} MetricsOptions;
+
+extern atomic_bool metrics_on;
+extern __thread MetricsShard *metrics_thread_shard;
+
+MetricsShard *metrics_claim_shard(void);
+int64_t metrics_now_ns(void);
+
+static inline MetricsShard *metrics_shard(void) {
+    return metrics_thread_shard ? metrics_thread_shard : metrics_claim_shard();
+}
+
+/*
+ * Adds to a shard field. The owning thread is the only writer, so a plain
+ * relaxed load and store is enough and the scrape reads a whole value.
+ */
+static inline void metrics_shard_add(MetricsShard *s, _Atomic uint64_t *field, uint64_t n) {
+    if (s->shared) {
+        atomic_fetch_add_explicit(field, n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(field, atomic_load_explicit(field, memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+/*
+ * Counts n events. One relaxed load and a branch when metrics are off.
+ */
+static inline void metrics_count(MetricCounter c, uint64_t n) {
+    if (!atomic_load_explicit(&metrics_on, memory_order_relaxed)) return;
+    MetricsShard *s = metrics_shard();
+    metrics_shard_add(s, &s->counter[c], n);
+}
+
+/*
+ * Adds one observation, in nanoseconds, to a histogram.
+ */
+static inline void metrics_observe(MetricHistogram h, int64_t ns) {
+    if (!atomic_load_explicit(&metrics_on, memory_order_relaxed)) return;
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    unsigned b = v ? 64u - (unsigned)__builtin_clzll(v) : 0;
+    if (b >= METRICS_BUCKETS) b = METRICS_BUCKETS - 1;
+    MetricsShard *s = metrics_shard();
+    metrics_shard_add(s, &s->bucket[h][b], 1);
+    metrics_shard_add(s, &s->sum_ns[h], v);
+}
+
+/*
+ * Start time for metrics_observe_since(), 0 when metrics are off so nothing is timed.
+ */
+static inline int64_t metrics_start_timer(void) {
+    return atomic_load_explicit(&metrics_on, memory_order_relaxed) ? metrics_now_ns() : 0;
+}
+
+static inline void metrics_observe_since(MetricHistogram h, int64_t start_ns) {
+    if (start_ns != 0) metrics_observe(h, metrics_now_ns() - start_ns);
+}
+
+int metrics_parse_options(int *argc, char **argv, MetricsOptions *opts);
+int metrics_start(const MetricsOptions *opts, const char *name);
+void metrics_watch_replay(const ReplaySource *src);
+int metrics_mutex_lock(pthread_mutex_t *m);
+void metrics_stop(void);
+
+#endif
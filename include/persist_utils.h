@@ -0,0 +1,137 @@
+/*
+ * File:     persist_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Settings that survive a restart, as the real sensors keep theirs
+ *           in EEPROM. With --state PATH an emulator maps PATH and, on start,
+ *           takes its configuration from the last commit instead of the
+ *           factory defaults, and carries on replaying from the entry it had
+ *           reached.
+ *
+ *           The file is a PersistHeader page followed by two slots, each a
+ *           PersistSlot and one payload, the emulator's own settings struct. A
+ *           commit copies the payload into the slot not holding the newest
+ *           one, checksums it and only then stores its sequence number, so a
+ *           crash part way through a commit leaves the previous one to load.
+ *           The replay cursor is a single word in the header, stored in place
+ *           after each message. Pages are handed to msync(MS_ASYNC) after a
+ *           commit and synced on close; nothing on the send path waits on
+ *           the disk.
+ *
+ *           A file written for another sensor, layout or build is started
+ *           again from the defaults.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef PERSIST_UTILS_H
+#define PERSIST_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "replay_utils.h"
+
+#define PERSIST_MAGIC "WXP1"            // First four bytes of a state file.
+#define PERSIST_VERSION 1               // Bumped whenever PersistHeader or PersistSlot changes.
+#define PERSIST_BYTE_ORDER 0x01020304u  // Written in host order, as in a .wxb header.
+#define PERSIST_SENSOR_LEN 16           // Sensor name field, NUL padded.
+#define PERSIST_PAGE 4096               // Header size and slot alignment, msync() works in pages.
+
+// First page of a state file.
+typedef struct {
+    char magic[4];                      // PERSIST_MAGIC, not NUL terminated.
+    uint16_t version;                   // PERSIST_VERSION.
+    uint16_t header_size;               // PERSIST_PAGE, offset of the first slot.
+    uint32_t byte_order;                // PERSIST_BYTE_ORDER.
+    uint32_t layout;                    // The emulator's payload layout number.
+    uint64_t payload_size;              // Bytes of one payload.
+    uint64_t slot_size;                 // Bytes of one slot, a whole number of pages.
+    char sensor[PERSIST_SENSOR_LEN];    // Sensor the payload belongs to, e.g. "ptb330".
+    _Atomic uint64_t replay_taken;      // Entries the replay cursor had taken.
+    _Atomic uint64_t replay_entries;    // Size of the replay window, 0 until the first message.
+} PersistHeader;
+
+// Start of each slot, followed by the payload.
+typedef struct {
+    _Atomic uint64_t sequence;          // Commit number, 0 for a slot never written. Stored last.
+    int64_t saved_unix_ns;              // Wall clock of the commit.
+    uint64_t size;                      // Payload bytes.
+    uint16_t checksum;                  // CRC-16/XMODEM of the payload.
+    uint16_t reserved[3];               // Zero.
+} PersistSlot;
+
+// Options taken off the command line by persist_parse_options().
+typedef struct {
+    const char *path;                   // State file, NULL when settings are not kept.
+} PersistOptions;
+
+typedef struct {
+    int fd;
+    unsigned char *map;                 // The whole file, MAP_SHARED.
+    size_t map_size;
+    PersistHeader *header;
+    size_t payload_size;
+    size_t slot_size;
+    int newest;                         // Slot of the newest complete commit, -1 for none.
+    uint64_t sequence;                  // Its sequence number, the next commit goes to the other slot.
+    pthread_mutex_t mutex;              // One commit at a time.
+} PersistFile;
+
+int persist_parse_options(int *argc, char **argv, PersistOptions *opts) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * Name:         persist_open
+ * Purpose:      Opens or creates the --state file for an emulator.
+ * Arguments:    ptr - Receives the state file, NULL when no --state was given.
+ *               opts - Options from persist_parse_options().
+ *               sensor - Sensor name stored in the header, e.g. "ptb330".
+ *               layout - The emulator's payload layout number, bumped when the payload changes.
+ *               payload_size - Bytes of the emulator's payload.
+ *
+ * Returns:      0 on success or without --state, -1 with a console message otherwise.
+ */
+int persist_open(PersistFile **ptr, const PersistOptions *opts, const char *sensor, uint32_t layout,
+                 size_t payload_size) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * Name:         persist_load
+ * Purpose:      Returns the payload of the newest complete commit.
+ * Arguments:    p - The state file, may be NULL.
+ *               saved_unix_ns - Receives the wall clock of the commit, may be NULL.
+ *
+ * Returns:      Pointer into the mapping, good until the next commit, or NULL
+ *               for no file or no complete commit.
+ */
+const void *persist_load(const PersistFile *p, int64_t *saved_unix_ns);
+
+void persist_commitv(PersistFile *p, const struct iovec *iov, int iovcnt);
+void persist_commit(PersistFile *p, const void *payload);
+
+/*
+ * Name:         persist_note_replay
+ * Purpose:      Stores the replay cursor in the header, after each message.
+ * Arguments:    p - The state file, may be NULL.
+ *               src - The replay source.
+ */
+void persist_note_replay(PersistFile *p, const ReplaySource *src);
+
+/*
+ * Name:         persist_resume_replay
+ * Purpose:      Moves the replay cursor to where the state file left it.
+ * Arguments:    p - The state file, may be NULL.
+ *               src - The replay source, after replay_apply_options().
+ *
+ * Returns:      true if the cursor was moved, false when there is nothing to
+ *               resume or the replay window is not the one it was taken in.
+ */
+bool persist_resume_replay(const PersistFile *p, ReplaySource *src);
+
+void persist_close(PersistFile *p);
+
+#endif
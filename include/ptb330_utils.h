@@ -4,6 +4,9 @@
  * Date:     16/01/2026
  * Version:  1.0
  * Purpose:  Structures and prototypes for Vaisala PTB330 emulation.
+ * Mods:     14/10/2026 CommandMap and CMD_ENTRY() moved to command_utils.h.
+ *           14/10/2026 Added ptb330_upsample_fields[] for --upsample.
+ *           14/10/2026 The compiled FORM is per unit, ptb330_sensor.form.
  */
 
 #ifndef PTB330_UTILS_H
@@ -12,6 +15,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include "command_utils.h"
+#include "upsample_utils.h"
 
 #define MAX_FORM_STR 128
 #define MAX_ADDR_LEN 4
@@ -25,6 +30,7 @@
 #define SECONDS_IN_MIN 60
 #define SECONDS_IN_HOUR 3600
 #define SECONDS_IN_DAY 86400
+#define PTB330_UPSAMPLE_FIELDS 9 // Pressures, temperatures, their average, trend and tendency.
 
 typedef enum {
     SMODE_STOP,  // No output
@@ -129,6 +135,9 @@ typedef struct {
 	uint16_t multiplier;
 } IntervalData;
 
+// A unit's compiled FORM, private to ptb330_utils.c.
+typedef struct PTB330Form PTB330Form;
+
 typedef struct {
     // Identity
     char serial_number[MAX_SN_LEN];
@@ -141,6 +150,7 @@ typedef struct {
     PTB330_Unit units;
 	IntervalData intv_data;
     char format_string[MAX_FORM_STR];
+    PTB330Form *form;        // format_string compiled, owned by this unit. Copies share it.
     uint16_t send_delay;     // ms
     bool echo_enabled;
 	char date_string[MAX_DATE_STR];
@@ -244,14 +254,6 @@ typedef enum {
     CMD_INVALID_FORMAT  // Command format error
 } CommandType;
 
-typedef struct {
-    const char *name;
-    CommandType type;
-	size_t len;
-} CommandMap;
-
-#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
-
 static const CommandMap cmd_table[] = {
     CMD_ENTRY("UNDELETE", CMD_UNDELETE), 	CMD_ENTRY("DELETE",	CMD_DELETE),
     CMD_ENTRY("BNUM",     CMD_BNUM),		CMD_ENTRY("SERI",     CMD_SERI),
@@ -369,18 +371,18 @@ typedef struct {
 	uint8_t precision; // y in the x.y or n.n field.
 } FormItem;
 
-// Store the compiled format here
-// FormItem compiled_form[MAX_FORM_ITEMS];
-// int form_item_count = 0;
-
-
 // Function Prototypes
 int init_ptb330_sensor(ptb330_sensor **ptr);
+void free_ptb330_sensor(ptb330_sensor *sensor);
 bool ptb330_is_ready_to_send(ptb330_sensor *sensor);
 //void ptb330_parse_command(const char *input, ptb330_command *cmd);
 void ptb330_format_output(ptb330_sensor *sensor, char *dest, size_t max_len);
-void parse_form_string(const char *input);
-void build_dynamic_output(ParsedMessage *live_date, char *output_buf, size_t buf_len);
+void parse_form_string(PTB330Form *form, const char *input);
+void ptb330_parse_message(char *msg, ParsedMessage *p_message, const ptb330_sensor *sensor);
+void ptb330_apply_sensor(ParsedMessage *p_message, const ptb330_sensor *sensor);
+void build_dynamic_output(const PTB330Form *form, ParsedMessage *live_date, char *output_buf, size_t buf_len);
 double get_hcp_pressure(double station_p, double altitude_m);
+
+extern const UpsampleField ptb330_upsample_fields[PTB330_UPSAMPLE_FIELDS];
 const char* get_unit_str(PTB330_Unit unit);
 #endif
@@ -0,0 +1,96 @@
+/*
+ * File:     pulse_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Precision pulse train engine for the GPIO emulators (cs700h tips,
+ *           fan_sim tach). One thread owns the output and emits a pulse of a
+ *           fixed width every interval, with the interval changed at any time
+ *           from another thread by pulse_train_set_interval().
+ *
+ *           In software the thread runs SCHED_FIFO with its memory locked,
+ *           sleeps until PULSE_SPIN_NS before each edge and busy-waits the
+ *           rest, so an edge lands within a few microseconds of its deadline
+ *           instead of the scheduler's tick. With --pwm the train is handed to
+ *           a kernel PWM channel (the RP1 PWM on a Pi 5) and no system call is
+ *           made per pulse at all; the thread only rewrites the period when
+ *           the rate changes.
+ *
+ *           The engine drives the line through a caller supplied function, so
+ *           it does not depend on libgpiod and links into every emulator.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef PULSE_UTILS_H
+#define PULSE_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#define PULSE_NS_PER_SEC 1000000000LL
+#define PULSE_SPIN_NS 50000LL          // Busy-wait this long before each edge, covers wake-up latency under SCHED_FIFO.
+#define PULSE_RT_PRIORITY 80           // Default SCHED_FIFO priority, above other real-time work, below the kernel watchdogs.
+#define PULSE_PWM_SYSFS "/sys/class/pwm"
+
+// Drives the output, active true for the pulse. ctx is the pointer given to pulse_train_init().
+typedef void (*PulseSetFn)(void *ctx, bool active);
+
+// Settings taken off the command line by pulse_parse_options().
+typedef struct {
+    int rt_priority;       // --rt-priority N, SCHED_FIFO priority of the pulse thread, 0 leaves it SCHED_OTHER.
+    int pwm_chip;          // --pwm CHIP:CHANNEL, -1 for software pulses.
+    int pwm_channel;
+} PulseOptions;
+
+// Achieved timing of the software pulses, on CLOCK_MONOTONIC.
+typedef struct {
+    uint64_t pulses;       // Pulses emitted by the thread.
+    uint64_t late;         // Rising edges more than PULSE_SPIN_NS after their deadline.
+    int64_t late_min_ns;   // Rising edge minus deadline.
+    int64_t late_max_ns;
+    double late_sum_ns;
+    double late_sumsq_ns;
+    int64_t width_min_ns;  // Falling edge minus rising edge.
+    int64_t width_max_ns;
+    double width_sum_ns;
+    double pwm_pulses;     // Pulses the PWM channel is expected to have produced.
+} PulseStats;
+
+typedef struct {
+    int chip, channel;
+    int period_fd;         // pwmN/period, pwmN/duty_cycle and pwmN/enable of the channel.
+    int duty_fd;
+    int enable_fd;
+    int64_t period_ns;     // Period written last, 0 while disabled.
+    int64_t since_ns;      // When that period was written, for PulseStats.pwm_pulses.
+} PulsePwm;
+
+typedef struct {
+    PulseSetFn set;
+    void *ctx;
+    int64_t width_ns;
+    int rt_priority;
+    bool realtime;         // SCHED_FIFO and mlockall() both succeeded.
+    bool use_pwm;
+    PulsePwm pwm;
+    _Atomic int64_t interval_ns; // Set by pulse_train_set_interval(), 0 for no pulses.
+    int wake_fd;           // eventfd written by pulse_train_wake().
+    PulseStats stats;
+} PulseTrain;
+
+// For a static PulseTrain, so pulse_train_wake() and pulse_train_destroy() are safe before pulse_train_init().
+#define PULSE_TRAIN_INITIALIZER { .wake_fd = -1, .pwm = { .period_fd = -1, .duty_fd = -1, .enable_fd = -1 } }
+
+int pulse_parse_options(int *argc, char **argv, PulseOptions *opts);
+int pulse_train_init(PulseTrain *t, const PulseOptions *opts, int64_t width_ns, PulseSetFn set, void *ctx);
+void pulse_train_set_interval(PulseTrain *t, int64_t interval_ns);
+void pulse_train_run(PulseTrain *t, volatile sig_atomic_t *stop) __attribute__((nonnull(1, 2)));
+void pulse_train_wake(PulseTrain *t);
+void pulse_train_report(const PulseTrain *t, const char *name);
+void pulse_train_destroy(PulseTrain *t);
+
+#endif
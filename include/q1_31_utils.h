@@ -0,0 +1,126 @@
+/*
+ * File:     q1_31_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Fixed-point kernels on top of q1_31.h, for targets without a
+ *           hardware FPU where a soft-float pow() on every frame costs more
+ *           than the frame.
+ *
+ *           The saturating ops clamp to [Q1_MIN, Q1_MAX] where q1_31.h wraps.
+ *           q1_sat_mul() rounds, and agrees bit for bit with NEON's vqrdmulh.
+ *
+ *           Logarithms and exponents are base 2 and kept in q5_26, a signed
+ *           5.26 format wide enough for log2 of any positive q1_31. log2 and
+ *           exp2 are a 256 entry table with quadratic interpolation, good to
+ *           about 1E-8, so pow(b, e) is exp2(e * log2(b)) with no libm call
+ *           after q1_tables_init(). The barometric formula is a log2_1p, a
+ *           multiply by g / (R * L) and a q1_scale_exp2() of the pressure.
+ *
+ *           The block kernels take arrays of any length. SSE2 and NEON do
+ *           four lanes a step and a scalar pass the rest, and every path
+ *           gives the same result. The table kernels are NEON or scalar,
+ *           SSE2 has no per-lane shift or leading zero count to build them.
+ *
+ *           Built in when ptb330_utils.c, dsp8100_utils.c and hc2s3.c are
+ *           compiled with -DWX_FIXED_POINT, see README.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef Q1_31_UTILS_H
+#define Q1_31_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "q1_31.h"
+
+#define Q1_MAX INT32_MAX                // Just under +1.0.
+#define Q1_MIN INT32_MIN                // -1.0.
+
+typedef int32_t q5_26;                  // Log domain, [-32, 32) in steps of 2^-26.
+
+#define Q5_SHIFT 26
+#define Q5_ONE (1 << Q5_SHIFT)
+#define Q5_MIN INT32_MIN                // log2 of zero or less.
+#define Q5_LOG2E ((q5_26)(1.4426950408889634 * Q5_ONE + 0.5))   // log2(e), for q1_exp().
+#define Q5_LN2 ((q5_26)(0.6931471805599453 * Q5_ONE + 0.5))     // ln(2), for q1_ln().
+
+#define Q1_TABLE_BITS 8                 // Table intervals per octave are 2^Q1_TABLE_BITS.
+#define Q1_BLOCK 64                     // Scratch the block kernels' callers use per pass.
+
+static inline q1_31 q1_sat(int64_t v) {
+    if (v > Q1_MAX) return Q1_MAX;
+    if (v < Q1_MIN) return Q1_MIN;
+    return (q1_31)v;
+}
+
+// Converts with rounding, clamping anything outside [-1, 1).
+static inline q1_31 q1_sat_from_double(double x) {
+    double v = x * (double)Q1_SCALE;
+    if (v >= (double)Q1_MAX) return Q1_MAX;
+    if (v <= (double)Q1_MIN) return Q1_MIN;
+    return (q1_31)(v < 0.0 ? v - 0.5 : v + 0.5);
+}
+
+static inline q1_31 q1_sat_add(q1_31 a, q1_31 b) {
+    return q1_sat((int64_t)a + b);
+}
+
+static inline q1_31 q1_sat_sub(q1_31 a, q1_31 b) {
+    return q1_sat((int64_t)a - b);
+}
+
+static inline q1_31 q1_sat_neg(q1_31 a) {
+    return a == Q1_MIN ? Q1_MAX : -a;
+}
+
+// Rounded product. Only -1 * -1 saturates.
+static inline q1_31 q1_sat_mul(q1_31 a, q1_31 b) {
+    return q1_sat(((int64_t)a * b + (1LL << (Q1_SHIFT - 1))) >> Q1_SHIFT);
+}
+
+// a / b, saturating when |a| >= |b| and by the sign of a when b is zero.
+static inline q1_31 q1_sat_div(q1_31 a, q1_31 b) {
+    if (b == 0) return a < 0 ? Q1_MIN : Q1_MAX;
+    return q1_sat(((int64_t)a * Q1_SCALE) / b);
+}
+
+static inline q5_26 q5_from_double(double x) {
+    double v = x * (double)Q5_ONE;
+    if (v >= (double)INT32_MAX) return INT32_MAX;
+    if (v <= (double)INT32_MIN) return INT32_MIN;
+    return (q5_26)(v < 0.0 ? v - 0.5 : v + 0.5);
+}
+
+static inline double q5_to_double(q5_26 x) {
+    return (double)x / (double)Q5_ONE;
+}
+
+// Rounded, saturating product of two q5_26.
+static inline q5_26 q5_sat_mul(q5_26 a, q5_26 b) {
+    int64_t v = ((int64_t)a * b + (1LL << (Q5_SHIFT - 1))) >> Q5_SHIFT;
+    if (v > INT32_MAX) return INT32_MAX;
+    if (v < INT32_MIN) return INT32_MIN;
+    return (q5_26)v;
+}
+
+void q1_tables_init(void);
+q5_26 q1_log2(q1_31 x);
+q5_26 q1_log2_1p(q1_31 x);
+q5_26 q1_ln(q1_31 x);
+q1_31 q1_exp2(q5_26 y);
+q1_31 q1_exp(q5_26 y);
+q1_31 q1_pow(q1_31 base, q5_26 exponent);
+int32_t q1_scale_exp2(int32_t value, q5_26 y);
+
+void q1_block_add_sat(const q1_31 *a, const q1_31 *b, q1_31 *out, size_t n);
+void q1_block_mul_sat(const q1_31 *a, const q1_31 *b, q1_31 *out, size_t n);
+void q1_block_mac_sat(q1_31 *acc, const q1_31 *x, const q1_31 *add, size_t n);
+void q1_block_horner(const q1_31 *coef, int terms, const q1_31 *x, q1_31 *out, size_t n);
+void q1_block_log2(const q1_31 *x, q5_26 *out, size_t n);
+void q1_block_exp2(const q5_26 *y, q1_31 *out, size_t n);
+void q1_block_pow(const q1_31 *base, q5_26 exponent, q1_31 *out, size_t n);
+
+#endif
@@ -0,0 +1,405 @@
+/*
+ * File:     replay_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Memory-mapped, pre-indexed replay source for sensor data files.
+ *           Replaces get_next_line_copy() on the transmit path with a
+ *           lock-free, allocation-free line cursor.
+ *           A data file converted by wxb_convert is recognised by its header and
+ *           replayed as fixed-size pre-parsed records instead of text lines.
+ *           --start/--end restrict replay to a time window of the data file,
+ *           --speed runs the emulator's schedule faster than real time.
+ *           --live reads a pipe, FIFO or udp:// source ahead of the sender on an
+ *           ingestion thread, see live_utils.h.
+ *           replay_watch() reloads the data file when it is replaced or on
+ *           SIGHUP, without stopping the emulator.
+ *           A .wxz cache holds the same records delta-encoded in blocks, see
+ *           wxz_utils.h, and is decoded a block at a time as the cursor reaches it.
+ *           wxstate://NAME reads the station's shared weather state instead of
+ *           a file, each line rendered from it for the sensor, see wxstate_utils.h.
+ *           replay_seek() puts the cursor back where a --state file left it.
+ */
+
+#ifndef REPLAY_UTILS_H
+#define REPLAY_UTILS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "live_utils.h"
+#include "wxstate_utils.h"
+
+#define REPLAY_LINE_MAX 1024 // Largest line handed to a parse function, matches MAX_LINE_LENGTH in file_utils.c
+
+#define REPLAY_SPEED_MAX 10000.0 // --speed=max, faster than any baud rate can carry a message.
+
+#define WXB_MAGIC "WXB1"            // First four bytes of a binary replay cache.
+#define WXB_VERSION 1               // Bumped whenever WxbHeader changes.
+#define WXB_BYTE_ORDER 0x01020304u  // Written in host order, reads back differently on a foreign host.
+#define WXB_SENSOR_LEN 16           // Sensor name field, NUL padded.
+
+// On-disk header of a .wxb replay cache, followed by record_count records of record_size bytes.
+typedef struct {
+    char magic[4];                  // WXB_MAGIC, not NUL terminated.
+    uint16_t version;               // WXB_VERSION.
+    uint16_t header_size;           // sizeof(WxbHeader), offset of the first record.
+    uint32_t byte_order;            // WXB_BYTE_ORDER.
+    uint32_t record_size;           // sizeof(ParsedMessage) of the sensor, on the host that wrote it.
+    uint64_t record_count;          // Number of records.
+    char sensor[WXB_SENSOR_LEN];    // Sensor the records belong to, e.g. "ptb330".
+    uint16_t checksum;              // CRC-16/XMODEM of the record area.
+    uint16_t reserved;              // Zero.
+    uint32_t time_size;             // sizeof(time_t), records embed time_t on some sensors.
+    uint64_t source_size;           // Size of the text file the records were converted from.
+    int64_t source_mtime;           // Modification time of that text file.
+} WxbHeader;
+
+#define WXZ_MAGIC "WXZ1"            // First four bytes of a block-compressed replay cache.
+#define WXZ_VERSION 1               // Bumped whenever WxzHeader, WxzBlock or the block encoding changes.
+#define WXZ_BLOCK_RECORDS 4096      // Records per block written by wxb_convert -z.
+#define WXZ_BLOCK_RECORDS_MAX 65536 // Largest block a reader accepts, bounds its one decoded block.
+
+// On-disk header of a .wxz cache, followed by block_count encoded blocks and then the block index.
+typedef struct {
+    WxbHeader base;                 // magic WXZ_MAGIC, version WXZ_VERSION, checksum of the block index.
+    uint32_t block_records;         // Records per block, the last block may hold fewer.
+    uint32_t block_count;           // Blocks, record_count / block_records rounded up.
+    uint64_t index_offset;          // Offset of the WxzBlock index from the start of the file.
+} WxzHeader;
+
+// One entry of the .wxz block index.
+typedef struct {
+    uint64_t offset;                // Offset of the encoded block from the start of the file.
+    uint32_t size;                  // Encoded bytes.
+    uint16_t checksum;              // CRC-16/XMODEM of the decoded records.
+    uint16_t reserved;              // Zero.
+} WxzBlock;
+
+// How a --start/--end value is measured.
+typedef enum {
+    REPLAY_TIME_NONE,       // Not given.
+    REPLAY_TIME_OF_DAY,     // HH:MM[:SS] UTC on the day of the first record.
+    REPLAY_TIME_OFFSET,     // +N[s|m|h|d] after the first record.
+    REPLAY_TIME_ABSOLUTE    // YYYY-MM-DD[T ]HH:MM[:SS] UTC.
+} ReplayTimeKind;
+
+typedef struct {
+    ReplayTimeKind kind;
+    int64_t ms;             // Milliseconds of day, of offset, or since the epoch.
+} ReplayTime;
+
+// Replay options taken off the command line by replay_parse_options().
+typedef struct {
+    ReplayTime start;
+    ReplayTime end;
+    double speed;           // Schedule speed factor, 1.0 is real time.
+    LivePolicy live;        // --live policy, LIVE_OFF unless given.
+    size_t live_depth;      // --live-depth, 0 for LIVE_DEPTH_DEFAULT.
+} ReplayOptions;
+
+/*
+ * Extracts the recorded time of one data file entry.
+ * item is a text line (len bytes, not NUL terminated) or, when is_record is set, a .wxb record.
+ * Returns false if the entry carries no time, the previous time plus the nominal period is used.
+ */
+typedef bool (*ReplayTimeFn)(const void *item, size_t len, bool is_record, int64_t *time_ms);
+
+// One generation of a mapped data file. replay_reload() swaps in a whole new one.
+typedef struct {
+    const char *data;           // Base of the read-only mapping, NULL for an empty file.
+    size_t size;                // Size of the mapping in bytes.
+    uint32_t *line_offsets;     // Byte offset of the start of every non-empty line.
+    uint32_t *line_lengths;     // Length of every line, excluding CR/LF.
+    size_t line_count;          // Number of entries in the index.
+
+    // Record mode (.wxb caches)
+    const WxbHeader *header;    // Header at the start of the mapping, NULL for text files.
+    const unsigned char *records; // First record.
+    size_t record_size;         // Bytes per record.
+    size_t record_count;        // Number of records, the cursor wraps on this in record mode.
+
+    // Block mode (.wxz caches), header and record_size/record_count are set as for a .wxb
+    const WxzBlock *blocks;     // Block index in the mapping, NULL unless the file is a .wxz.
+    size_t block_records;       // Records per block.
+    pthread_mutex_t block_mutex; // Guards the decoded block.
+    unsigned char *block;       // The one decoded block, block_records records.
+    size_t block_index;         // Block held in block, SIZE_MAX before the first decode.
+
+    // Replay window (--start/--end), the whole file unless replay_apply_options() narrows it.
+    size_t window_first;        // First line or record replayed.
+    size_t window_count;        // Lines or records replayed before wrapping to window_first.
+} ReplayMap;
+
+typedef struct {
+    // Memory-mapped mode (regular files)
+    ReplayMap *_Atomic map;     // Current generation, NULL in stream mode.
+    _Atomic unsigned readers;   // Threads between loading map and finishing with it.
+    atomic_uint_fast64_t cursor; // Monotonic line counter, index = cursor % window_count.
+
+    // Reload (replay_watch(), replay_reload())
+    char *path;                 // The data file, reopened on reload.
+    pthread_mutex_t reload_mutex; // One reload at a time.
+    _Atomic unsigned generation; // Reloads so far, see replay_generation().
+    ReplayOptions window_opts;  // --start/--end, applied again to a reloaded file.
+    ReplayTimeFn time_fn;
+    int64_t period_ms;
+    char sensor[WXB_SENSOR_LEN]; // From replay_check_records(), a reloaded cache must match.
+    size_t expect_record_size;  // 0 until replay_check_records(), a .wxb reload is then refused.
+
+    // Stream mode (pipes, FIFOs, process substitution, udp://)
+    FILE *stream;               // Opened only when the path cannot be mapped.
+    pthread_mutex_t stream_mutex; // Serializes fgets() on stream.
+    bool datagram;              // stream is a UDP socket, one message per datagram.
+
+    // Live mode (--live), the stream read ahead by an ingestion thread
+    LiveFeed *live;             // NULL unless replay_start_live() started one.
+    bool live_records;          // The feed holds parsed records, not lines.
+
+    // Shared state mode (wxstate://NAME)
+    WxStateView *state;         // The producer's segment, lines are rendered for sensor.
+} ReplaySource;
+
+/*
+ * Name:         replay_open
+ * Purpose:      Opens a data file, maps it read-only and builds a line-offset index.
+ *               Non-seekable inputs (pipes, sockets) fall back to a buffered stream,
+ *               udp://[host]:port binds a UDP socket and reads it as one.
+ *               wxstate://NAME maps the shared weather state published as NAME.
+ * Arguments:    ptr - Address of a ReplaySource pointer to receive the new source.
+ *               path - Path to the data file.
+ *
+ * Returns:      0 on success, -1 on failure with errno set.
+ */
+int replay_open(ReplaySource **ptr, const char *path) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_start_live
+ * Purpose:      Starts reading a stream source ahead of the sender when --live
+ *               was given, or the source is udp://.
+ * Arguments:    src - The replay source.
+ *               opts - Options from replay_parse_options().
+ *               record_size - sizeof(ParsedMessage) of the caller.
+ *               parse - Parses a line into a record with the converter's default
+ *               sensor, as wxb_convert does. NULL keeps lines for replay_next_line().
+ *
+ * Returns:      0 on success or when live mode is off, -1 with a console message otherwise.
+ */
+int replay_start_live(ReplaySource *src, const ReplayOptions *opts, size_t record_size, LiveParseFn parse) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_next_view
+ * Purpose:      Returns a zero-copy view of the next line, wrapping at the end of the file.
+ * Arguments:    src - The replay source.
+ *               len - Receives the length of the line (not NUL terminated).
+ *
+ * Returns:      Pointer into the mapping, or NULL in stream mode / on an empty file.
+ *               The view is only safe on a source that is not watched, a reload
+ *               can unmap it. replay_next_line() copies the line out in time.
+ */
+const char *replay_next_view(ReplaySource *src, size_t *len) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_next_line
+ * Purpose:      Copies the next line into a caller-owned buffer and NUL terminates it,
+ *               so existing strtok_r() based parse functions can modify it in place.
+ * Arguments:    src - The replay source.
+ *               buf - Destination buffer, usually a REPLAY_LINE_MAX stack array.
+ *               buf_len - Size of buf in bytes.
+ *
+ * Returns:      Number of characters copied, 0 if no line is available.
+ *               A wxstate:// source renders the current state, see wxstate_render().
+ */
+size_t replay_next_line(ReplaySource *src, char *buf, size_t buf_len) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_next_record
+ * Purpose:      Returns the next pre-parsed record of a .wxb or .wxz cache, wrapping at the end.
+ * Arguments:    src - The replay source.
+ *
+ * Returns:      Pointer to a per-thread copy of the record, NULL if the source holds
+ *               no records. The pointer is good until the calling thread's next call.
+ */
+const void *replay_next_record(ReplaySource *src) __attribute__((nonnull(1)));
+
+/*
+ * Name:         replay_check_records
+ * Purpose:      Confirms a .wxb or .wxz cache was converted for this sensor and this build.
+ * Arguments:    src - The replay source.
+ *               sensor - Sensor name the caller expects, e.g. "ptb330".
+ *               record_size - sizeof(ParsedMessage) of the caller.
+ *
+ * Returns:      0 for a text source or a matching cache, -1 with errno set to EINVAL otherwise.
+ */
+int replay_check_records(ReplaySource *src, const char *sensor, size_t record_size) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_set_sensor
+ * Purpose:      Names the sensor of a text source, as replay_check_records() does for a cache.
+ * Arguments:    src - The replay source.
+ *               sensor - The sensor, e.g. "rh_temp", selects the line a wxstate:// source renders.
+ */
+void replay_set_sensor(ReplaySource *src, const char *sensor) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_state
+ * Purpose:      Returns the shared weather state of a wxstate:// source.
+ * Arguments:    src - The replay source, may be NULL.
+ *
+ * Returns:      The view, NULL for any other source. Valid until replay_close().
+ */
+const WxStateView *replay_state(const ReplaySource *src);
+
+/*
+ * Name:         replay_write_records
+ * Purpose:      Writes a .wxb cache: a WxbHeader followed by count records.
+ * Arguments:    path - File to create or replace.
+ *               sensor - Sensor name stored in the header.
+ *               records - The records, count * record_size bytes.
+ *               record_size - Bytes per record.
+ *               count - Number of records.
+ *               source - stat() of the text file the records came from, may be NULL.
+ *
+ * Returns:      0 on success, -1 on failure with errno set.
+ */
+int replay_write_records(const char *path, const char *sensor, const void *records, size_t record_size,
+                         size_t count, const struct stat *source) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_parse_options
+ * Purpose:      Removes --start, --end, --speed, --live and --live-depth from argv so the positional
+ *               arguments of an emulator keep their place.
+ * Arguments:    argc - Address of argc, reduced by the options removed.
+ *               argv - Argument vector, compacted in place.
+ *               opts - Receives the options, defaults when none are given.
+ *
+ * Returns:      0 on success, -1 with a console message on a malformed option.
+ */
+int replay_parse_options(int *argc, char **argv, ReplayOptions *opts) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * Name:         replay_apply_options
+ * Purpose:      Indexes the recorded time of every entry, narrows replay to the
+ *               --start/--end window and sets the replay clock speed.
+ * Arguments:    src - The replay source.
+ *               opts - Options from replay_parse_options().
+ *               time_fn - Reads the recorded time of an entry, NULL if the file has none.
+ *               period_ms - Spacing of entries without a recorded time.
+ *
+ * Returns:      0 on success, -1 with a console message if the window is empty or invalid.
+ */
+int replay_apply_options(ReplaySource *src, const ReplayOptions *opts, ReplayTimeFn time_fn, int64_t period_ms) __attribute__((nonnull(2)));
+
+/*
+ * Name:         replay_clock_now
+ * Purpose:      Reads the replay clock: CLOCK_MONOTONIC, sped up by --speed.
+ *               Sender threads and is_ready_to_send() functions use it in place
+ *               of clock_gettime(CLOCK_MONOTONIC).
+ * Arguments:    ts - Receives the replay time.
+ */
+void replay_clock_now(struct timespec *ts) __attribute__((nonnull(1)));
+
+/*
+ * Name:         replay_clock_deadline
+ * Purpose:      Converts a replay clock deadline to the CLOCK_MONOTONIC deadline
+ *               pthread_cond_timedwait() waits for.
+ * Arguments:    replay_ts - Deadline on the replay clock.
+ *               mono_ts - Receives the CLOCK_MONOTONIC deadline, may alias replay_ts.
+ */
+void replay_clock_deadline(const struct timespec *replay_ts, struct timespec *mono_ts) __attribute__((nonnull(1, 2)));
+
+/*
+ * Name:         replay_clock_speed
+ * Purpose:      Returns the replay clock speed factor, 1.0 unless --speed was given.
+ */
+double replay_clock_speed(void);
+
+/*
+ * Name:         replay_watch
+ * Purpose:      Reloads a mapped source whenever its data file is replaced, or
+ *               the process gets SIGHUP.
+ * Arguments:    src - The replay source, may be NULL or a stream, neither is watched.
+ *
+ * Returns:      0 on success, -1 with a console message otherwise.
+ *               Call from main() before any other thread starts, SIGHUP is
+ *               blocked in the caller so every later thread inherits the mask.
+ */
+int replay_watch(ReplaySource *src);
+
+/*
+ * Name:         replay_reload
+ * Purpose:      Maps the data file again and swaps it in for the sender and receiver.
+ * Arguments:    src - The replay source.
+ *
+ * Returns:      0 on success, -1 with a console message if the file cannot be used,
+ *               the current data is kept.
+ */
+int replay_reload(ReplaySource *src) __attribute__((nonnull(1)));
+
+/*
+ * Name:         replay_generation
+ * Purpose:      Counts the reloads of a source, so output read ahead of a reload can be dropped.
+ * Arguments:    src - The replay source, may be NULL.
+ *
+ * Returns:      The number of successful reloads, 0 for a NULL source.
+ */
+unsigned replay_generation(const ReplaySource *src);
+
+/*
+ * Name:         replay_progress
+ * Purpose:      Reads the replay cursor for the metrics scrape.
+ * Arguments:    src - The replay source.
+ *               position - Receives the entry the cursor is on.
+ *               entries - Receives the size of the replay window.
+ *               taken - Receives the entries taken so far.
+ *
+ * Returns:      false for a stream or an empty window, outputs are then unset.
+ */
+bool replay_progress(const ReplaySource *src, size_t *position, size_t *entries, uint64_t *taken) __attribute__((nonnull(1, 2, 3, 4)));
+
+/*
+ * Name:         replay_seek
+ * Purpose:      Sets the replay cursor to a count replay_progress() reported, see persist_utils.h.
+ * Arguments:    src - The replay source.
+ *               taken - Entries taken.
+ *
+ * Returns:      false for a stream or an empty window, the cursor is then unchanged.
+ */
+bool replay_seek(ReplaySource *src, uint64_t taken) __attribute__((nonnull(1)));
+
+/*
+ * Name:         replay_is_binary
+ * Purpose:      Returns true if the source is a .wxb or .wxz record cache.
+ */
+bool replay_is_binary(const ReplaySource *src);
+
+/*
+ * Name:         replay_line_count
+ * Purpose:      Returns the number of indexed lines or cached records, 0 in stream mode.
+ */
+size_t replay_line_count(const ReplaySource *src);
+
+/*
+ * Name:         replay_is_mapped
+ * Purpose:      Returns true if the source is memory-mapped rather than streamed.
+ */
+bool replay_is_mapped(const ReplaySource *src);
+
+/*
+ * Name:         replay_is_live
+ * Purpose:      Returns true if records come from a live feed started by replay_start_live().
+ */
+bool replay_is_live(const ReplaySource *src);
+
+/*
+ * Name:         replay_close
+ * Purpose:      Unmaps the file, frees the index and the source itself.
+ */
+void replay_close(ReplaySource *src);
+
+#endif // REPLAY_UTILS_H
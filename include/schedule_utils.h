@@ -0,0 +1,75 @@
+/*
+ * File:     schedule_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Drift-free periodic scheduler for the emulator sender threads.
+ *           Deadlines are absolute, kept in nanoseconds on the replay clock
+ *           (CLOCK_MONOTONIC scaled by --speed), and each one is armed on a
+ *           timerfd, so processing time never accumulates as drift and any
+ *           interval down to a nanosecond can be used. Intervals start on a
+ *           multiple of themselves, so two emulators running the same interval
+ *           on one host send in phase.
+ *
+ *           The receiver thread interrupts a wait with schedule_wake() after it
+ *           publishes a new configuration; the wake is remembered until the
+ *           sender next waits, so none is lost.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef SCHEDULE_UTILS_H
+#define SCHEDULE_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SCHED_NS_PER_SEC 1000000000LL
+#define SCHED_NS_PER_MS  1000000LL
+
+// What to do when the sender falls more than one interval behind.
+typedef enum {
+    SCHEDULE_CATCH_UP, // Send every missed deadline back to back until on time again.
+    SCHEDULE_SKIP      // Drop the missed deadlines and resume on the next one in the future.
+} SchedulePolicy;
+
+typedef enum {
+    SCHEDULE_TICK,     // A deadline was reached, send now.
+    SCHEDULE_WOKEN,    // schedule_wake() was called, re-read the configuration.
+    SCHEDULE_ERROR     // poll() or read() failed, errno is set.
+} ScheduleEvent;
+
+// Measured lateness of each tick: wake-up time minus deadline, on CLOCK_MONOTONIC.
+typedef struct {
+    uint64_t ticks;        // Deadlines reached.
+    uint64_t skipped;      // Deadlines dropped under SCHEDULE_SKIP.
+    int64_t late_min_ns;
+    int64_t late_max_ns;
+    double late_sum_ns;
+    double late_sumsq_ns;
+} ScheduleStats;
+
+typedef struct {
+    int timer_fd;          // timerfd armed with the next deadline.
+    int wake_fd;           // eventfd written by schedule_wake().
+    SchedulePolicy policy;
+    bool running;
+    uint64_t interval_ns;  // Replay clock nanoseconds, 0 sends back to back.
+    int64_t next_ns;       // Next deadline on the replay clock.
+    int64_t armed_mono_ns; // The same deadline on CLOCK_MONOTONIC, for the lateness.
+    ScheduleStats stats;
+} SendSchedule;
+
+// For a static SendSchedule, so schedule_wake() and schedule_destroy() are safe before schedule_init().
+#define SCHEDULE_INITIALIZER { .timer_fd = -1, .wake_fd = -1 }
+
+int schedule_init(SendSchedule *s, SchedulePolicy policy);
+void schedule_start(SendSchedule *s, uint64_t interval_ns);
+void schedule_stop(SendSchedule *s);
+ScheduleEvent schedule_wait(SendSchedule *s);
+void schedule_wake(SendSchedule *s);
+void schedule_report(const SendSchedule *s, const char *name);
+void schedule_destroy(SendSchedule *s);
+
+#endif
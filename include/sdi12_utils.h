@@ -0,0 +1,125 @@
+/*
+ * File:     sdi12_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  SDI-12 responder engine. One thread serves every sensor address on
+ *           a bus opened by open_serial_port() in SERIAL_SDI12 mode (7E1 at
+ *           1200 baud, breaks marked in the input by PARMRK).
+ *
+ *           Breaks are read from the PARMRK stream as \377 \0 \0 and wake the
+ *           bus; 100 ms of marking without a command puts it back to sleep, and
+ *           a command that arrives asleep is ignored as a real sensor would.
+ *           Each reply is armed on a timerfd for the 8.33 ms of marking after
+ *           the command's stop bit, plus a small margin, inside the 15 ms the
+ *           standard allows, and written from the same thread with no queue in
+ *           between. Every reply's latency is timed for sdi12_bus_report().
+ *
+ *           Commands served for each address a: a!, ?!, aI!, aAb!, aM!, aMC!,
+ *           aM1!-aM9!, aC!, aCC!, aC1!-aC9!, aV!, aD0!-aD9!, aR0!-aR9! and
+ *           aRC0!-aRC9!. An M measurement sends its service request when its
+ *           time is up and is aborted by a break; C measurements run
+ *           concurrently on any number of addresses and survive breaks and
+ *           commands to other sensors.
+ *
+ *           Values come from a caller supplied function, called on the engine
+ *           thread when the measurement is started.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef SDI12_UTILS_H
+#define SDI12_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <signal.h>
+
+#define SDI12_CHAR_NS 8333333LL        // One 7E1 character, 10 bits at 1200 baud.
+#define SDI12_MARKING_NS 8330000LL     // Marking a sensor holds after a command before replying.
+#define SDI12_RESPONSE_NS 15000000LL   // A reply must start this soon after the command's stop bit.
+#define SDI12_REPLY_MARGIN_NS 500000LL // Aim this far past the marking, room for the adaptor's latency.
+#define SDI12_SLEEP_NS 100000000LL     // Marking after which a sensor is back in standby and needs a break.
+#define SDI12_MAX_SENSORS 62           // Addresses 0-9, A-Z and a-z.
+#define SDI12_MAX_VALUES 20            // Values kept per measurement.
+#define SDI12_VALUE_LEN 10             // One value, "+1234.567" and its NUL.
+#define SDI12_IDENT_LEN 32             // aI! reply after "a13": vendor(8) model(6) version(3) serial(<=13).
+#define SDI12_CMD_MAX 16               // Longest command kept, longer ones are dropped.
+#define SDI12_REPLY_MAX 96             // Address, 75 characters of values, CRC and CR/LF.
+#define SDI12_M_VALUES_LEN 35          // Characters of values in one D reply to an M measurement.
+#define SDI12_C_VALUES_LEN 75          // And to a C or R measurement.
+
+// One measurement, each value already signed and formatted, as "+1.23" or "-0.5".
+typedef struct {
+    char values[SDI12_MAX_VALUES][SDI12_VALUE_LEN];
+    int count;
+} Sdi12Reading;
+
+// Fills r for the sensor at address, returns 0, or -1 for no values. ctx is the sensor's.
+typedef int (*Sdi12MeasureFn)(void *ctx, char address, Sdi12Reading *r);
+
+typedef struct {
+    char address;                      // '0'-'9', 'A'-'Z' or 'a'-'z', changed by aAb!.
+    char ident[SDI12_IDENT_LEN];       // aI! reply after the address and "13".
+    unsigned measure_s;                // ttt reported by M and C, seconds until the values are ready.
+    Sdi12MeasureFn measure;
+    void *ctx;
+
+    // Engine state.
+    Sdi12Reading data;                 // Values for the D commands.
+    uint8_t d_start[11];               // First value of each aDn! reply, d_start[n + 1] ends it.
+    uint8_t d_count;                   // D replies the values span.
+    bool have_data;
+    bool crc;                          // The measurement asked for CRCs on its D replies.
+    bool service_pending;              // An M measurement owes a service request at ready_ns.
+    int64_t ready_ns;                  // CLOCK_MONOTONIC time the values become valid.
+} Sdi12Sensor;
+
+// Timing and traffic counts, on CLOCK_MONOTONIC.
+typedef struct {
+    uint64_t commands;                 // Commands addressed to a sensor on the bus.
+    uint64_t replies;
+    uint64_t late;                     // Replies started more than SDI12_RESPONSE_NS after the command.
+    uint64_t breaks;
+    uint64_t asleep;                   // Commands ignored, no break since the bus went to sleep.
+    uint64_t bad_chars;                // Parity and framing errors.
+    uint64_t aborted;                  // M measurements aborted by a break or a new command.
+    uint64_t service_requests;
+    int64_t latency_min_ns;            // Reply start minus command arrival.
+    int64_t latency_max_ns;
+    double latency_sum_ns;
+} Sdi12Stats;
+
+typedef struct {
+    int fd;                            // The bus, from open_serial_port().
+    int timer_fd;                      // timerfd armed with the next reply or service request.
+    bool always_awake;                 // Answer without a break, for a host that cannot send one.
+    Sdi12Sensor sensors[SDI12_MAX_SENSORS];
+    int sensor_count;
+
+    uint8_t mark;                      // PARMRK parser: bytes of a \377 sequence seen.
+    char cmd[SDI12_CMD_MAX];
+    size_t cmd_len;
+    int64_t last_activity_ns;          // Last break or character, either way; asleep SDI12_SLEEP_NS after.
+    int64_t quiet_until_ns;            // End of our own transmission, and its echo on a one-wire adaptor.
+
+    char reply[SDI12_REPLY_MAX];       // The reply waiting for its marking, reply_len 0 for none.
+    size_t reply_len;
+    int64_t reply_due_ns;
+    int64_t reply_cmd_ns;              // Arrival of the command it answers, 0 for a service request.
+    Sdi12Stats stats;
+} Sdi12Bus;
+
+// For a static Sdi12Bus, so sdi12_bus_close() is safe before sdi12_bus_init().
+#define SDI12_BUS_INITIALIZER { .fd = -1, .timer_fd = -1 }
+
+int sdi12_bus_init(Sdi12Bus *bus, int fd, bool always_awake);
+int sdi12_bus_add(Sdi12Bus *bus, char address, const char *ident, unsigned measure_s, Sdi12MeasureFn measure, void *ctx);
+bool sdi12_valid_address(char address);
+void sdi12_bus_run(Sdi12Bus *bus, volatile sig_atomic_t *stop);
+void sdi12_bus_report(const Sdi12Bus *bus, const char *name);
+void sdi12_bus_close(Sdi12Bus *bus);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * File:     seqlock_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Sequence lock for publishing a sensor configuration from the receiver
+ *           thread to the sender thread. The receiver edits its own private
+ *           *_sensor struct and publishes a copy after each command; the sender
+ *           takes a consistent snapshot of that copy without a mutex, so a slow
+ *           command (FORM compilation, a long reply) never delays output.
+ *
+ *           One writer only. Readers retry while the writer is copying.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef SEQLOCK_UTILS_H
+#define SEQLOCK_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Sequence counter, odd while a write is in progress.
+typedef struct {
+    _Atomic uint32_t seq;
+} SeqLock;
+
+#define SEQLOCK_INITIALIZER { 0 }
+
+void seqlock_write(SeqLock *lock, void *shared, const void *src, size_t len);
+uint32_t seqlock_read(const SeqLock *lock, void *dst, const void *shared, size_t len);
+uint32_t seqlock_sequence(const SeqLock *lock);
+
+#endif
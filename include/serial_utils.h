@@ -13,6 +13,10 @@
 #define SERIAL_UTILS_H
 
 #include <termios.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <sys/uio.h>
 
 	typedef enum {
     SERIAL_RS422,  // or RS-232 fallback
@@ -22,13 +26,76 @@
 
 // #define MAX_INPUT_STR 256
 
+#define SERIAL_RX_RING_SIZE 1024 // Receive ring, must be a power of two.
+#define SERIAL_LINE_MAX 256      // Longest command line handed to a line handler, including the NULL.
+#define SERIAL_POLL_MS 100       // poll() timeout, bounds shutdown latency and the idle flush.
+
+#define SERIAL_TX_RING_SIZE 32768 // Bytes queued per priority per port, must be a power of two.
+#define SERIAL_TX_MAX_PORTS 8     // Ports that may have a transmit queue attached at once.
+
+// Transmit priority, a queued poll response is sent before any queued continuous output.
+typedef enum {
+    SERIAL_TX_POLL,         // Replies to a command, the default for the receiver thread.
+    SERIAL_TX_CONTINUOUS,   // Unsolicited output, the default for every other thread.
+    SERIAL_TX_PRIORITIES
+} SerialTxPriority;
+
+/*
+ * One message streamed into a port's transmit queue in pieces, so a large frame can
+ * be generated chunk by chunk straight into the ring. See serial_tx_frame_begin().
+ */
+typedef struct {
+    int fd;
+    void *queue;     // The port's transmit queue, NULL when writing directly.
+    void *transport; // The port's Transport, NULL for a serial device.
+    void *ring;      // The ring the message is reserved in.
+    size_t start;    // Free running ring index of the message's length prefix.
+    size_t at;       // Free running ring index of the next byte.
+    size_t limit;    // End of the reservation.
+    bool active;     // false once the queue has stopped, appends are then discarded.
+    char *fault_buf; // With WX_FAULTS set, the message is gathered here, at and limit index it.
+} SerialTxFrame;
+
+/*
+ * Called once per complete command line, with the CR/LF removed and NULL terminated.
+ * line may be modified by the handler (strtok_r etc.) and is only valid during the call.
+ */
+typedef void (*serial_line_handler)(char *line, void *ctx);
+
+typedef struct {
+    int fd;
+    char ring[SERIAL_RX_RING_SIZE]; // Bytes read from fd and not yet consumed as a line.
+    size_t head;                    // Free running write index, masked on use.
+    size_t tail;                    // Free running index of the first unconsumed byte.
+    size_t scan;                    // Free running index of the first byte not yet checked for CR/LF.
+    bool discarding;                // Dropping the rest of an over-long line until its terminator.
+    bool flush_on_idle;             // Emit an unterminated line once the bus has been idle for SERIAL_POLL_MS.
+    char line[SERIAL_LINE_MAX];     // Contiguous copy handed to the handler.
+    serial_line_handler handler;
+    void *ctx;
+} SerialLineReader;
+
 speed_t get_baud_rate(const char *baud_rate);
 int is_valid_tty(const char *str) __attribute__((nonnull(1)));
 SerialMode get_mode(const char *mode) __attribute__((nonnull(1)));
 int open_serial_port(const char* portname, speed_t baud_rate, SerialMode mode)__attribute__((nonnull(1))) __attribute__((warn_unused_result));
 /* Format: __attribute__((format(ARCHETYPE, STRING_INDEX, FIRST_TO_CHECK))) */
 void safe_serial_write(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void serial_write_buf(int fd, const void *buf, size_t len) __attribute__((nonnull(2)));
+void serial_writev(int fd, const struct iovec *iov, int iovcnt) __attribute__((nonnull(2)));
+int serial_tx_frame_begin(SerialTxFrame *frame, int fd, size_t max_len) __attribute__((nonnull(1)));
+void serial_tx_frame_append(SerialTxFrame *frame, const void *buf, size_t len) __attribute__((nonnull(1, 2)));
+void serial_tx_frame_commit(SerialTxFrame *frame) __attribute__((nonnull(1)));
+int serial_tx_attach(int fd) __attribute__((warn_unused_result));
+void serial_tx_detach(int fd);
+void serial_tx_drain(int fd);
+void serial_tx_set_priority(SerialTxPriority priority);
+void close_serial_port(int fd);
 void serial_utils_cleanup(void);
 void sdi12_wake_sensor(int fd);
+void serial_reader_init(SerialLineReader *reader, int fd, serial_line_handler handler, void *ctx) __attribute__((nonnull(1, 3)));
+long serial_reader_drain(SerialLineReader *reader) __attribute__((nonnull(1)));
+int serial_reader_poll(SerialLineReader *reader, int timeout_ms) __attribute__((nonnull(1)));
+void serial_reader_run(SerialLineReader *reader, volatile sig_atomic_t *stop) __attribute__((nonnull(1, 2)));
 
 #endif
@@ -4,6 +4,7 @@
  * Date:     27/02/2026
  * Version:  1.0
  * Purpose:  Structures and prototypes for Campbell Scientific SkyVue8 emulation.
+ * Mods:     14/10/2026 CommandMap and CMD_ENTRY() moved to command_utils.h.
  */
 
 #ifndef SKYVUE8_UTILS_H
@@ -12,6 +13,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include "command_utils.h"
 
 #define MAX_FORM_STR 128
 #define MAX_ADDR_LEN 4
@@ -29,6 +31,9 @@
 #define SECONDS_IN_MIN 60
 #define SECONDS_IN_HOUR 3600
 #define SECONDS_IN_DAY 86400
+#define SKYVUE8_MAX_BINS 2048		// Longest backscatter profile, message 002/004/106.
+#define SKYVUE8_BIN_CHARS 5			// Hex characters per profile bin.
+#define SKYVUE8_SKY_LAYERS 5		// Layers reported in the sky condition line.
 
 
 typedef enum {
@@ -143,6 +148,7 @@ typedef struct {
 	Skyvue8_SerialMode smode;
     uint16_t measurement_period; // 0, or 2-600 seconds  - 0 is polled.
     uint16_t message_interval; // 0, or 2-600 seconds - 0 is polled.
+    uint8_t message_id;        // Message sent in RUN mode, and on a POLL without a message number.
 
     // Timing
     struct timespec last_send_time;
@@ -162,14 +168,6 @@ typedef enum {
     CMD_INVALID_FORMAT  // Command format error
 } CommandType;
 
-typedef struct {
-    const char *name;
-    CommandType type;
-	size_t len;
-} CommandMap;
-
-#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
-
 static const CommandMap cmd_table[] = {
     CMD_ENTRY("POLL",     CMD_POLL)
 };
@@ -222,7 +220,36 @@ typedef struct {
 	uint8_t message_id;
 } ParsedMessage;
 
+// Shape of an output message, see skyvue8_layout().
+typedef struct {
+	uint8_t message_id;
+	uint16_t bins;				// Backscatter bins, 0 for a message without a profile.
+	uint8_t resolution_m;		// Bin resolution in metres.
+	bool sky_condition;			// Carries the sky condition line (003/004).
+	bool cl31;					// CL31 compatibility framing (101-112).
+} Skyvue8Layout;
+
+// Streaming backscatter profile generator, see skyvue8_profile_begin().
+typedef struct {
+	uint16_t bins;				// Bins in the profile.
+	uint16_t next_bin;			// Next bin to generate.
+	uint8_t resolution_m;
+	double aerosol;				// Boundary layer backscatter at next_bin.
+	double aerosol_decay;		// Per bin decay of the boundary layer.
+	double attenuation;			// Two-way transmission remaining at next_bin.
+	double cloud_m;				// First cloud base in metres, 0 if none.
+	double cloud_peak;			// Backscatter at the cloud base.
+	uint32_t noise;				// xorshift32 state for detector noise.
+} Skyvue8ProfileGen;
+
 // Function Prototypes
+void skyvue8_parse_message(char *msg, ParsedMessage *p_message);
+const Skyvue8Layout *skyvue8_layout(uint8_t message_id);
+void skyvue8_profile_begin(Skyvue8ProfileGen *gen, const ParsedMessage *msg, const Skyvue8Layout *layout);
+int32_t skyvue8_profile_next(Skyvue8ProfileGen *gen);
+size_t skyvue8_profile_encode(Skyvue8ProfileGen *gen, char *out, size_t max_bins);
+unsigned int skyvue8_profile_sum(const Skyvue8ProfileGen *gen);
+int skyvue8_format_sky_condition(const ParsedMessage *msg, char *buf, size_t buf_len);
 int init_skyvue8_sensor(skyvue8_sensor **ptr);
 bool skyvue8_is_ready_to_send(skyvue8_sensor *sensor);
 
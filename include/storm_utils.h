@@ -0,0 +1,80 @@
+/*
+ * File:     storm_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Procedural thunderstorm generator for the lightning emulators.
+ *           A storm is a set of cells that drift across the sensor, each with
+ *           a life cycle of flash rate (build up, mature, decay) and a spread
+ *           of flashes around its centre. storm_step() advances simulated time
+ *           and returns the flashes that fell in the step, with the distance
+ *           and bearing a sensor at the origin would report.
+ *
+ *           Everything is drawn from one seeded xoshiro256** generator and the
+ *           flashes depend only on the seed and the sequence of step lengths,
+ *           so a run can be repeated exactly, whatever --speed or the host.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef STORM_UTILS_H
+#define STORM_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define STORM_MAX_CELLS 64
+#define STORM_MAX_STEP_FLASHES 4096 // Flashes one storm_step() can return, the rest are counted in dropped.
+#define STORM_KM_PER_NM 1.852
+
+typedef struct {
+    uint64_t s[4];
+} StormRng;
+
+// Settings taken off the command line by storm_parse_options().
+typedef struct {
+    bool enabled;          // --storm was given.
+    uint64_t seed;
+    unsigned cells;        // Cells alive at once, a cell that dies is replaced.
+    double rate_per_min;   // Flashes per minute of the whole storm with every cell at its peak.
+    double speed_kmh;      // Mean cell speed.
+    double range_km;       // Cells form within this distance of the sensor.
+    double cg_fraction;    // Share of flashes that are cloud-to-ground.
+} StormConfig;
+
+typedef struct {
+    double x_km, y_km;     // Centre, x east and y north of the sensor.
+    double vx_kmh, vy_kmh; // Drift.
+    double spread_km;      // Standard deviation of flash positions around the centre.
+    double peak_per_min;   // Flash rate at maturity.
+    double age_s;
+    double life_s;
+} StormCell;
+
+typedef struct {
+    double t_s;            // Simulated seconds since storm_init().
+    float distance_km;     // From the sensor.
+    float bearing_deg;     // 0 north, clockwise.
+    bool cloud_to_ground;  // false for an intracloud flash.
+} StormFlash;
+
+typedef struct {
+    StormConfig cfg;
+    StormRng rng;
+    StormCell cells[STORM_MAX_CELLS];
+    double time_s;         // Simulated time.
+    uint64_t flashes;      // Flashes generated.
+    uint64_t dropped;      // Flashes that did not fit in a step's output.
+} StormEngine;
+
+void storm_default_config(StormConfig *cfg);
+int storm_parse_options(int *argc, char **argv, StormConfig *cfg);
+void storm_rng_seed(StormRng *rng, uint64_t seed);
+uint64_t storm_rng_next(StormRng *rng);
+double storm_rng_uniform(StormRng *rng);
+void storm_init(StormEngine *e, const StormConfig *cfg);
+size_t storm_step(StormEngine *e, double dt_s, StormFlash *out, size_t max);
+
+#endif
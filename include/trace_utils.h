@@ -0,0 +1,65 @@
+/*
+ * File:     trace_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Statically defined tracepoints (USDT probes) on the send, receive
+ *           and parse paths, for perf and bpftrace on a running emulator
+ *           without a rebuild.
+ *
+ *           With <sys/sdt.h> installed (systemtap-sdt-dev) each WX_TRACE
+ *           is a single nop in the code and a note in the binary naming the
+ *           probe and where its arguments live. Nothing runs until a tracer
+ *           attaches and turns the nop into a breakpoint. Without the header,
+ *           or with -DWX_NO_TRACE, the macros compile to nothing.
+ *
+ *           Every probe belongs to the wxsensors provider and takes only
+ *           integers and pointers already at hand, so a probe never adds work
+ *           to compute its arguments. An array is passed as &a[0], sys/sdt.h
+ *           cannot take one. The bpftrace scripts in trace/ use the probes.
+ *
+ *           Probes, with their arguments:
+ *             line_received(fd, line, len)     A CR/LF terminated line is handed to its handler.
+ *             command_parsed(fd, cmd)          parse_command() returned cmd.
+ *             command_handled(fd, cmd)         handle_command() returned, cmd -1 in wxsensord, whose
+ *                                              personalities parse and handle in one call.
+ *             sender_wake(event, late_ns)      schedule_wait() returned a ScheduleEvent.
+ *             data_fetched(len, is_record)     The replay source returned a line or record, len 0
+ *                                              for a record from a live feed.
+ *             frame_formatted(fd, buf, len)    safe_serial_write() formatted a message.
+ *             frame_queued(fd, len)            A message was handed to the port, len 0 for a frame
+ *                                              already written or streamed as it was built.
+ *             write_start(fd, iovcnt)          writev() of iovcnt pieces is about to be called.
+ *             write_end(fd, written)           The device took written bytes, -1 on error.
+ *             tcdrain_start(fd)                tcdrain() is about to be called.
+ *             tcdrain_done(fd)                 tcdrain() returned, the UART is empty.
+ *             tx_wake(fd)                      A port's transmit writer woke for work.
+ *             sdi12_break(fd)                  The SDI-12 engine read a break from the bus.
+ *             sdi12_reply(fd, latency_ns)      It started a reply latency_ns after the command's '!'.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef TRACE_UTILS_H
+#define TRACE_UTILS_H
+
+#if !defined(WX_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WX_TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef WX_TRACE_ENABLED
+#define WX_TRACE1(name, a)          DTRACE_PROBE1(wxsensors, name, a)
+#define WX_TRACE2(name, a, b)       DTRACE_PROBE2(wxsensors, name, a, b)
+#define WX_TRACE3(name, a, b, c)    DTRACE_PROBE3(wxsensors, name, a, b, c)
+#else
+// sizeof keeps the arguments used without evaluating them.
+#define WX_TRACE1(name, a)          do { (void)sizeof(a); } while (0)
+#define WX_TRACE2(name, a, b)       do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define WX_TRACE3(name, a, b, c)    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif
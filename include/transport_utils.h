@@ -0,0 +1,63 @@
+/*
+ * File:     transport_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Stand-ins for a serial adaptor, so an emulator can run with no
+ *           hardware. open_serial_port() hands these names to transport_open():
+ *
+ *               tcp://[host]:port      raw TCP server
+ *               rfc2217://[host]:port  Telnet COM-PORT-OPTION server (RFC 2217)
+ *               pty[:link]             pseudo-terminal, with an optional symlink
+ *                                      to its slave side
+ *
+ *           The emulator gets back one fd and reads its commands from it as
+ *           it would from a tty. A network port takes up to
+ *           TRANSPORT_MAX_CLIENTS clients at once, all seeing the same output
+ *           and all able to send commands, as listeners on one shared line.
+ *
+ *           Output is copied once into a ring, and a hub thread sends every
+ *           client its bytes straight from there, each from its own cursor.
+ *           The emulator never waits on a client. A client that falls a whole
+ *           ring behind skips ahead to the oldest complete frame still held,
+ *           so it loses stale output instead of slowing the others.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef TRANSPORT_UTILS_H
+#define TRANSPORT_UTILS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "serial_utils.h"
+
+#define TRANSPORT_MAX_PORTS 64     // Transports open at once in one process.
+#define TRANSPORT_MAX_CLIENTS 16   // Clients per network port, more are turned away.
+#define TRANSPORT_RING_SIZE 65536  // Output held for slow clients, a power of two.
+#define TRANSPORT_FRAME_SLOTS 1024 // Frame starts remembered, where a lapped client resumes.
+#define TRANSPORT_DRAIN_MS 1000    // Longest transport_drain() waits on a client.
+
+typedef enum {
+    TRANSPORT_TTY,                 // A real serial device, not handled here.
+    TRANSPORT_TCP,
+    TRANSPORT_RFC2217,
+    TRANSPORT_PTY
+} TransportKind;
+
+typedef struct Transport Transport;
+
+TransportKind transport_kind(const char *portname) __attribute__((nonnull(1)));
+int transport_open(const char *portname, speed_t baud_rate, SerialMode mode) __attribute__((nonnull(1))) __attribute__((warn_unused_result));
+Transport *transport_find(int fd);
+void transport_writev(Transport *t, const struct iovec *iov, int iovcnt) __attribute__((nonnull(1, 2)));
+void transport_frame_begin(Transport *t) __attribute__((nonnull(1)));
+void transport_frame_append(Transport *t, const void *buf, size_t len) __attribute__((nonnull(1, 2)));
+void transport_frame_commit(Transport *t) __attribute__((nonnull(1)));
+void transport_drain(Transport *t) __attribute__((nonnull(1)));
+bool transport_close(int fd);
+void transport_cleanup(void);
+
+#endif
@@ -4,6 +4,10 @@
  * Date:     15/04/2026
  * Version:  1.0
  * Purpose:  Structures and prototypes for Vaisala TSS928 emulation.
+ * Mods:     14/10/2026 Minute-major StrikeBin with a runtime sized history.
+ *           14/10/2026 Added TSS928_record_storm().
+ *           14/10/2026 CommandMap and CMD_ENTRY() moved to command_utils.h.
+ *           14/10/2026 rotation_angle widened to hold 256-359.
  */
 
 #ifndef TSS928_UTILS_H
@@ -12,6 +16,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include "command_utils.h"
+#include "arena_utils.h"
+#include "storm_utils.h"
 
 #define MAX_FORM_STR 128
 #define MAX_SN_LEN 16
@@ -21,7 +28,9 @@
 #define MAX_HEADER_STR 7
 #define MAX_SELF_TEST_FLAG 6
 #define MAX_FLASHES 4
-#define MAX_HISTORY_MINS 30
+#define MAX_AGING_MINS 30 // Longest aging interval, J4.
+#define DEFAULT_HISTORY_MINS 30
+#define MAX_HISTORY_MINS 1440 // 24 hours.
 #define RANGE_RINGS 2 // 0:NEAR, 1:DIST
 #define QUADRANTS 8 //0:N, 1:NE, 2:E, 3:SE, 4:S, 5:SW, 6:W, 7:NW
 #define NORTH 0
@@ -47,20 +56,34 @@ typedef enum {
     SMODE_FLASH  // Output on receipt of a flash
 } TSS928_SMode;
 
-typedef struct {
-	// Ground Strikes [2 range rings][8 quadrants][30 mins]
-	uint32_t ground_history[RANGE_RINGS][QUADRANTS][MAX_HISTORY_MINS];
-	uint32_t ground_totals[RANGE_RINGS][QUADRANTS];
+#define STRIKE_CELLS 20 // Counters in a StrikeRow, 18 padded to a multiple of four for 128 bit vectors.
+
+// One time slot of every counter, laid out so a row is five aligned 128 bit vectors.
+typedef union {
+	_Alignas(16) uint32_t cell[STRIKE_CELLS];
+	struct {
+		uint32_t ground[RANGE_RINGS][QUADRANTS]; // Cloud-Ground strikes, cells 0-15.
+		uint32_t overhead;                       // Overhead strikes, cell 16.
+		uint32_t cloud;                          // Intracloud strikes, cell 17.
+	};
+} StrikeRow;
 
-	// Overhead Strikes [30 mins]
-	uint32_t overhead_history[MAX_HISTORY_MINS];
-	uint32_t overhead_total;
+/*
+ * history is a ring of running totals, minute (or slot) major: row n holds every
+ * counter summed from start up to the end of slot n. A slot is recorded into the
+ * current row only, the count over any window is the current row minus the row
+ * that many slots back, and a slot ages out without touching the row it leaves.
+ * Running totals are unsigned and wrap, the difference stays exact.
+ */
+typedef struct {
+	StrikeRow *history;     // history_slots + 1 rows, from an Arena.
+	uint32_t history_slots; // Longest window that can be summed, in slots.
+	uint32_t slot_seconds;  // Length of one slot, 60 for the TSS928's one minute bins.
+	uint32_t current_slot;  // Row being recorded into.
+	uint32_t window_slots;  // aging_interval in slots.
 
-	// Cloud Strikes [30 mins]
-	uint32_t cloud_history[MAX_HISTORY_MINS];
-	uint32_t cloud_total;
+	StrikeRow totals;       // Counts over the aging interval, what the A message reports.
 
-	uint8_t current_minute_index;
 	uint8_t aging_interval; // 15, 10, 5 or 30 minutes (arguments to J command are 1,2,3,4)
 
 	uint32_t total_strikes_since_reset;
@@ -81,7 +104,7 @@ typedef struct {
 	uint16_t overhead;
 	uint16_t near;
     uint16_t distant;
-	uint8_t rotation_angle;
+	uint16_t rotation_angle;
     // Timing
     struct timespec last_send_time;
     struct timespec sensor_start_time;
@@ -112,14 +135,6 @@ typedef enum {
     CMD_RESTORE 	// "" or *DEF recieved from the terminal, restore default settings.
 } CommandType;
 
-typedef struct {
-    const char *name;
-    CommandType type;
-	size_t len;
-} CommandMap;
-
-#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
-
 static const CommandMap cmd_table[] = {
     CMD_ENTRY("A",			CMD_SEND),
     CMD_ENTRY("B",			CMD_STATUS),
@@ -166,16 +181,21 @@ typedef struct {
 } ParsedMessage;
 
 // Function Prototypes
-int init_TSS928_sensor(TSS928_sensor **ptr);
+int init_TSS928_sensor(TSS928_sensor **ptr, Arena *arena, uint32_t history_mins);
 bool TSS928_is_ready_to_send(TSS928_sensor *sensor);
 
 void reset_sensor(TSS928_sensor *sensor);
 void restore_sensor(TSS928_sensor *sensor);
 
+int strike_bin_init(StrikeBin *bin, Arena *arena, uint32_t history_slots, uint32_t slot_seconds);
+void strike_bin_clear(StrikeBin *bin);
+void strike_bin_set_aging(StrikeBin *bin, uint8_t minutes);
+void strike_bin_window(const StrikeBin *bin, uint32_t slots, StrikeRow *out);
+void strike_bin_advance(StrikeBin *bin);
 void record_ground_strike(StrikeBin *bin, uint8_t ring_index, uint8_t quadrant_index, uint8_t strike_count);
 void record_overhead_strike(StrikeBin *bin, uint8_t strike_count);
 void record_cloud_strike(StrikeBin *bin, uint8_t strike_count);
-void advance_one_minute(StrikeBin *bin);
+void TSS928_record_storm(TSS928_sensor *sensor, const StormFlash *flashes, size_t count);
 void conduct_self_test(TSS928_sensor *sensor);
 
 int update_sensor_time(const char *time_str, struct tm *sensor_time);
@@ -0,0 +1,107 @@
+/*
+ * File:     upsample_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Interpolating upsampler between a replay source and an emulator's
+ *           output. A data file recorded at one rate is read out at the time
+ *           of each message on the replay clock, so a shorter PTB330 INTV or a
+ *           faster wind --rate no longer runs the recording faster than it was
+ *           made.
+ *
+ *           Only UPSAMPLE_WINDOW parsed records are held. Records are fetched
+ *           as the replay clock passes them, each one nominal period after the
+ *           last, and the output is interpolated between the two either side
+ *           of now: linear, or Catmull-Rom cubic through the four. Bearings
+ *           are interpolated the short way round the circle. Fields without
+ *           an UpsampleField come from the record before now.
+ *
+ *           --noise adds seeded Gaussian noise of each field's standard
+ *           deviation, times the factor given, to every output. The same
+ *           --seed gives the same noise on every run.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef UPSAMPLE_UTILS_H
+#define UPSAMPLE_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "replay_utils.h"
+
+#define UPSAMPLE_WINDOW 4               // Records held, two either side of the output.
+#define UPSAMPLE_SEED_DEFAULT 1         // --seed when not given.
+
+typedef enum {
+    UPSAMPLE_OFF,                       // Every message takes the next record, as without an upsampler.
+    UPSAMPLE_LINEAR,
+    UPSAMPLE_CUBIC
+} UpsampleMode;
+
+typedef enum {
+    UPSAMPLE_DOUBLE,                    // A double.
+    UPSAMPLE_FLOAT,                     // A float.
+    UPSAMPLE_BEARING                    // A uint16_t bearing in degrees, 0-359, interpolated on the circle.
+} UpsampleType;
+
+// One interpolated field of a sensor's ParsedMessage.
+typedef struct {
+    size_t offset;                      // offsetof() the field.
+    UpsampleType type;
+    double noise;                       // Standard deviation at --noise 1, in the field's units.
+    double min;                         // Clamp to [min, max] after the noise, none when min >= max.
+    double max;
+} UpsampleField;
+
+#define UPSAMPLE_FIELD(record, member, type, noise, min, max) { offsetof(record, member), type, noise, min, max }
+
+// Options taken off the command line by upsample_parse_options().
+typedef struct {
+    UpsampleMode mode;                  // --upsample, UPSAMPLE_OFF unless given.
+    double noise;                       // --noise factor, 0 for none.
+    uint64_t seed;                      // --seed.
+} UpsampleOptions;
+
+// Reads the next record from the replay source. Returns false when none is available.
+typedef bool (*UpsampleFetchFn)(void *record, void *ctx);
+
+typedef struct {
+    UpsampleMode mode;
+    const UpsampleField *fields;
+    int field_count;
+    size_t record_size;
+    int64_t period_ns;                  // Spacing of the records on the replay clock.
+    double noise;
+    UpsampleFetchFn fetch;
+    void *ctx;
+    const ReplaySource *src;            // Re-primed when its generation changes, may be NULL.
+    unsigned generation;
+
+    pthread_mutex_t mutex;              // Senders and pollers share the window.
+    unsigned char *window;              // UPSAMPLE_WINDOW records, oldest first, now between [1] and [2].
+    bool primed;                        // The window holds records.
+    int64_t start_ns;                   // Replay clock time of window[1].
+    uint64_t rng;                       // xorshift64* state.
+    bool have_spare;                    // Box-Muller makes normals in pairs.
+    double spare;
+
+    uint64_t outputs;                   // Messages interpolated.
+    uint64_t fetched;                   // Records read from the source.
+    uint64_t held;                      // Fetches that failed, the last record was held.
+} Upsampler;
+
+// For a static Upsampler, so upsample_close() is safe before upsample_init().
+#define UPSAMPLE_INITIALIZER { .mode = UPSAMPLE_OFF }
+
+int upsample_parse_options(int *argc, char **argv, UpsampleOptions *opts);
+int upsample_init(Upsampler *u, const UpsampleOptions *opts, size_t record_size, const UpsampleField *fields, int field_count,
+                  int64_t period_ns, UpsampleFetchFn fetch, void *ctx, const ReplaySource *src);
+bool upsample_next(Upsampler *u, void *out);
+void upsample_report(const Upsampler *u, const char *name);
+void upsample_close(Upsampler *u);
+
+#endif
@@ -4,6 +4,9 @@
  * Date:     15/07/2026
  * Version:  1.0
  * Purpose:  Structures and prototypes for Gill Wind Observer 75 emulation.
+ * Mods:     14/10/2026 Added WO75_MAX_RATE_HZ for the --rate option.
+ *           14/10/2026 CommandMap and CMD_ENTRY() moved to command_utils.h.
+ *           14/10/2026 Added WO75_upsample_fields[] for --upsample.
  */
 
 #ifndef WO75_UTILS_H
@@ -11,7 +14,10 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
+#include "command_utils.h"
+#include "upsample_utils.h"
 
 #define MAX_FORM_STR 128
 #define MAX_SN_LEN 16
@@ -21,6 +27,8 @@
 #define MAX_HEADER_STR 7
 #define MAX_SELF_TEST_FLAG 6
 #define NS_PER_SEC 1000000000LL
+#define WO75_MAX_RATE_HZ 32 // Highest --rate, above the sensor's own 10 Hz for acquisition testing.
+#define WO75_UPSAMPLE_FIELDS 2 // Direction and speed.
 
 // Index 0 is unused (or set to 0 to disable continuous sending)
 static const long HZ_TO_NANOSECONDS[] = {
@@ -62,7 +70,7 @@ typedef struct {
 	char units;	  // U1 through U5, M, N, P, K, F default = m/s
     // Configuration
     WO75_SMode mode;
-    long output_rate; // 1-10 outputs per second, default is 4 (once every 0.25 seconds) stored as nanoseconds.
+    long output_rate; // 1-10 outputs per second (up to WO75_MAX_RATE_HZ with --rate), default is 4 (once every 0.25 seconds) stored as nanoseconds.
     // Timing
     struct timespec last_send_time;
     struct timespec sensor_start_time;
@@ -80,14 +88,6 @@ typedef enum {
     CMD_CONFIG	 	// "*<A-Z>" recieved from the terminal, enter configuration mode.
 } CommandType;
 
-typedef struct {
-    const char *name;
-    CommandType type;
-	size_t len;
-} CommandMap;
-
-#define CMD_ENTRY(str, enum_val) { str, enum_val, sizeof(str) - 1 }
-
 static const CommandMap cmd_table[] = {
     CMD_ENTRY("?",			CMD_ENABLE),
     CMD_ENTRY("A",			CMD_POLL),
@@ -143,5 +143,9 @@ typedef struct {
 // Function Prototypes
 int init_WO75_sensor(WO75_sensor **ptr);
 bool WO75_is_ready_to_send(WO75_sensor *sensor);
+void WO75_parse_message(char *msg, ParsedMessage *p_msg, char units);
+int WO75_format_frame(const ParsedMessage *p_msg, char *buf, size_t buf_len);
+
+extern const UpsampleField WO75_upsample_fields[WO75_UPSAMPLE_FIELDS];
 
 #endif
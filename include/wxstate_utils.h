@@ -0,0 +1,105 @@
+/*
+ * File:     wxstate_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Shared weather state for a whole emulated station. One producer
+ *           (wxstate/wxstate.c) publishes a timestamped WxState in a POSIX
+ *           shared memory segment, behind a SeqLock, and every emulator maps
+ *           the segment read-only and renders its own protocol from the same
+ *           snapshot, so wind, pressure, humidity, visibility, cloud, rain
+ *           and lightning agree with each other.
+ *
+ *           An emulator reads the state through its replay source: a data
+ *           file path of wxstate://NAME opens the segment /NAME, and each
+ *           replay_next_line() is the current state written as one line of
+ *           that sensor's data file, see wxstate_render(). The emulator's own
+ *           parse function then runs unchanged. Lightning is taken as the
+ *           flashes published since the last call, see wxstate_flashes().
+ *
+ *           The segment outlives the producer, so a restarted producer
+ *           carries on in the same mapping and its readers never reattach.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef WXSTATE_UTILS_H
+#define WXSTATE_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "seqlock_utils.h"
+#include "storm_utils.h"
+
+#define WXSTATE_MAGIC "WXS1"            // First four bytes of the segment.
+#define WXSTATE_VERSION 1               // Bumped whenever WxState or WxStateSegment changes.
+#define WXSTATE_NAME_DEFAULT "wxstate"  // Segment name when none is given, /dev/shm/wxstate.
+#define WXSTATE_NAME_MAX 64             // Longest segment name, without the leading '/'.
+#define WXSTATE_LAYERS 3                // Cloud layers in the state, a SkyVUE8 reports up to four.
+#define WXSTATE_FLASHES 256             // Recent flashes held, about four minutes of a severe storm.
+#define WXSTATE_FLASHES_NEW UINT64_MAX  // Initial wxstate_flashes() cursor, skips the flashes already held.
+
+// The weather at the station at one instant.
+typedef struct {
+    int64_t time_ms;                    // UTC, milliseconds since the epoch.
+    uint64_t step;                      // States published since the producer started.
+    uint32_t period_ms;                 // Time between states.
+    uint32_t cloud_layers;              // Valid entries of cloud_base_m, 0 for a clear sky.
+
+    double pressure_hpa;                // Station pressure.
+    double trend_hpa;                   // Pressure change over the last three hours.
+    double temperature_c;
+    double dew_point_c;
+    double humidity_pct;                // Relative humidity over water.
+    double wind_dir_deg;                // Direction the wind blows from, 0 north, clockwise.
+    double wind_speed_ms;
+    double visibility_m;                // Meteorological optical range.
+    double precip_rate_mmh;
+    double precip_total_mm;             // Since the producer started.
+    double luminance_cdm2;              // Background luminance.
+    double cloud_base_m[WXSTATE_LAYERS]; // Lowest first.
+
+    double storm_time_s;                // StormEngine.time_s, the time base of the flashes.
+    uint64_t flash_count;               // Flashes published, flashes[i % WXSTATE_FLASHES] is flash i.
+    StormFlash flashes[WXSTATE_FLASHES];
+} WxState;
+
+// The shared memory segment, created by wxstate_create().
+typedef struct {
+    char magic[4];                      // WXSTATE_MAGIC, not NUL terminated.
+    uint16_t version;                   // WXSTATE_VERSION.
+    uint16_t header_size;               // offsetof(WxStateSegment, state).
+    uint32_t state_size;                // sizeof(WxState), a reader from another build is refused.
+    int32_t pid;                        // The producer publishing, or the last one to.
+    SeqLock lock;                       // Odd while wxstate_publish() is copying.
+    uint32_t reserved;                  // Zero.
+    WxState state;
+} WxStateSegment;
+
+// The producer's writable mapping.
+typedef struct {
+    WxStateSegment *seg;
+    char name[WXSTATE_NAME_MAX + 2];    // "/NAME".
+} WxStatePublisher;
+
+// A reader's read-only mapping, from wxstate_attach().
+typedef struct {
+    const WxStateSegment *seg;
+    char name[WXSTATE_NAME_MAX + 2];
+} WxStateView;
+
+int wxstate_create(WxStatePublisher *p, const char *name) __attribute__((nonnull(1, 2)));
+void wxstate_publish(WxStatePublisher *p, const WxState *state) __attribute__((nonnull(1, 2)));
+void wxstate_destroy(WxStatePublisher *p, bool unlink_segment) __attribute__((nonnull(1)));
+
+WxStateView *wxstate_attach(const char *name) __attribute__((nonnull(1)));
+bool wxstate_read(const WxStateView *v, WxState *out) __attribute__((nonnull(1, 2)));
+void wxstate_detach(WxStateView *v);
+
+size_t wxstate_flashes(const WxState *s, uint64_t *seen, StormFlash *out, size_t max) __attribute__((nonnull(1, 2)));
+size_t wxstate_render(const WxState *s, const char *sensor, char *buf, size_t buf_len) __attribute__((nonnull(1, 2, 3)));
+
+#endif // WXSTATE_UTILS_H
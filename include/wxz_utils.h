@@ -0,0 +1,67 @@
+/*
+ * File:     wxz_utils.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Block encoding of .wxz replay caches, for multi-day data files on
+ *           an SD card. A .wxz holds the records of a .wxb in blocks of
+ *           WXZ_BLOCK_RECORDS, with an index of every block at the end of the
+ *           file, see WxzHeader in replay_utils.h. A reader maps the file and
+ *           decodes only the block the cursor is in, so its memory is one
+ *           block whatever the length of the file.
+ *
+ *           A block is stored by column: every 32 bit word of the record is
+ *           one column, written for all the block's records before the next.
+ *           A float, or a double over two columns, that was parsed from a few
+ *           decimal places is stored as the integer it was written as. Each
+ *           column is the difference from the record before, or the
+ *           difference of those differences, whichever is shorter, as zigzag
+ *           varints. A run of zeros, a field that does not change or a
+ *           timestamp that steps evenly, is a single varint. Every block
+ *           starts from zero, so any one can be decoded on its own.
+ *
+ *           A WxzWriter encodes records as they are appended, holding one
+ *           block, so a month of data converts in the same memory as an hour.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef WXZ_UTILS_H
+#define WXZ_UTILS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "replay_utils.h"
+
+// A .wxz being written by wxz_writer_open() and wxz_writer_append().
+typedef struct {
+    FILE *out;
+    char path[4096];                // The cache, renamed into place by wxz_writer_close().
+    char tmp_path[4096];            // Written here first.
+    WxzHeader header;
+    size_t record_size;
+    size_t block_records;
+    unsigned char *block;           // Records of the block being filled.
+    size_t rows;                    // Records in block.
+    unsigned char *encoded;         // wxz_encode_bound() bytes.
+    unsigned char *scratch;         // wxz_scratch_bound() bytes, columns encoded other ways.
+    WxzBlock *index;                // One entry per block written.
+    size_t index_cap;
+    uint64_t offset;                // Where the next block goes.
+} WxzWriter;
+
+size_t wxz_encode_bound(size_t record_size, size_t rows);
+size_t wxz_scratch_bound(size_t rows);
+size_t wxz_encode_block(const void *records, size_t record_size, size_t rows, unsigned char *out, unsigned char *scratch);
+int wxz_decode_block(const unsigned char *in, size_t in_len, void *records, size_t record_size, size_t rows);
+
+int wxz_writer_open(WxzWriter *w, const char *path, const char *sensor, size_t record_size, size_t block_records,
+                    const struct stat *source) __attribute__((nonnull(1, 2, 3)));
+int wxz_writer_append(WxzWriter *w, const void *record) __attribute__((nonnull(1, 2)));
+int wxz_writer_close(WxzWriter *w, bool commit) __attribute__((nonnull(1)));
+
+#endif // WXZ_UTILS_H
@@ -179,7 +179,21 @@
  *           SW3: Temporary RS-232 @ 38400 bps (ON = override to RS-232, temporary)
  *           SW4: Must be OFF for AtmosVUE 30 operation
  *
- * Mods:
+ * Mods:     14/10/2026 The sender works from a seqlock snapshot of sensor_one and no
+ *                      longer shares sensor_mutex with command handling.
+ *           14/10/2026 The sender runs on a SendSchedule, deadlines follow the
+ *                      last deadline rather than the end of the last send.
+ *           14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ *                      wait metrics on a UNIX socket.
+ *           14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 A data file of wxstate://NAME reports visibility, present
+ *                      weather, temperature and humidity from the shared weather
+ *                      state, see wxstate/.
  *
  */
 
@@ -200,8 +214,13 @@
 #include "crc_utils.h"
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "atmosvue30_utils.h"
+#include "seqlock_utils.h"
+#include "schedule_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B38400	     // Adjust as needed, main has logic to take arguments for a new baud rate
@@ -209,7 +228,6 @@
 #define CPU_WAIT_NANOSECONDS 10000000
 #define MAX_CMD_LENGTH 256
 #define MAX_MSG_LENGTH 512
-#define CPU_WAIT_USEC 10000
 
 #define DEBUG_MODE // Comment this line out to disable all debug prints
 
@@ -220,7 +238,7 @@
 #endif
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -228,14 +246,22 @@ volatile sig_atomic_t terminate = 0;
 volatile sig_atomic_t kill_flag = 0;
 
 int serial_fd = -1;
+const char *program_name = "unknown";
 
 // This needs to be freed upon exit.
 av30_sensor *sensor_one = NULL; // Global pointer to struct for atmosvue30 sensor .
 
+/*
+ * sensor_one belongs to the receiver thread. After each command it is published to
+ * sensor_shared, and the sender takes snapshots of that copy through sensor_lock.
+ * sensor_mutex only guards terminate; the sender sleeps on sender_sched.
+ */
+static av30_sensor sensor_shared;
+static SeqLock sensor_lock = SEQLOCK_INITIALIZER;
+
 /* Synchronization primitives */
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // RUN mode deadlines, woken by publish_sensor().
 
 // Global pointers to receiver and sender threads.
 pthread_t recv_thread, send_thread, sig_thread;
@@ -244,7 +270,6 @@ bool recv_thread_created = false;
 bool send_thread_created = false;
 bool sig_thread_created = false;
 
-bool sensor_cond_init = false;
 
 /*
  * Name:         cleanup_and_exit
@@ -262,8 +287,8 @@ bool sensor_cond_init = false;
 void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex);
     terminate = 1;
-	if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
     pthread_mutex_unlock(&sensor_mutex);
+	schedule_wake(&sender_sched);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -272,6 +297,7 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
     }
 
     if (sig_thread_created) {
@@ -281,13 +307,14 @@ void cleanup_and_exit(int exit_code) {
     }
 
 	pthread_mutex_destroy(&sensor_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
+    schedule_destroy(&sender_sched);
 
     if (sensor_one) free(sensor_one);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -389,6 +416,7 @@ void parse_message(char *msg, ParsedMessage *p_message) {
  * Name:         process_and_send
  * Purpose:      Parse a data line, format the message string, and send with CRC.
  * Arguments:    msg: Pointer to the ParsedMessage struct containing the data stripped from the file/buffer.
+ * 				 sensor: the configuration to report, sensor_one or a sender snapshot.
  *
  * Output:       Prints the formatted sensor message with STX/ETX and CRC to serial.
  * Modifies:     None.
@@ -398,21 +426,21 @@ void parse_message(char *msg, ParsedMessage *p_message) {
  * Bugs:         None known.
  * Notes:        Ensures the 32-field format matches the hardware specification.
  */
-void process_and_send(ParsedMessage *msg) {
+void process_and_send(ParsedMessage *msg, const av30_sensor *sensor) {
 
 	char msg_buffer[MAX_MSG_LENGTH]; // 512
 
 	int length = snprintf(msg_buffer, sizeof(msg_buffer),
 			"%u %u %u %u %u %c %d %.2f %u %u %u %u %u %u %u %u %u %u %u %u %u %.2f %.2f %u %s %.1f %d %s %.1f %d %d %u",
-    		(uint8_t)sensor_one->message_format,			// 1.  uint8_t - Message ID
-    		sensor_one->sensor_id,   			   			// 2.  uint8_t - Sensor ID
+    		(uint8_t)sensor->message_format,			// 1.  uint8_t - Message ID
+    		sensor->sensor_id,   			   			// 2.  uint8_t - Sensor ID
     		(uint8_t)msg->sys_status,       				// 3.  uint8_t - System Status
-    		sensor_one->continuous_interval,  				// 4.  uint16_t - Continuous Interval
+    		sensor->continuous_interval,  				// 4.  uint16_t - Continuous Interval
     		msg->visibility,           						// 5.  uint32_t (use %u if 32-bit, %lu if 64-bit) - Visability Value
-    		(sensor_one->visibility_units == UNITS_METRES) ? 'M' : 'F',	// 6.  char - Viasability Units
+    		(sensor->visibility_units == UNITS_METRES) ? 'M' : 'F',	// 6.  char - Viasability Units
     		(int)msg->mor_format,      						// 7.  enum (cast to int for %d) - MOR Format
     		msg->exco,                 						// 8.  float - EXCO
-    		(uint8_t)sensor_one->averaging_period,  		// 9.  uint8_t - Avergaing Period
+    		(uint8_t)sensor->averaging_period,  		// 9.  uint8_t - Avergaing Period
     		msg->sys_alarms.emitter_failure,				// 10. uint8_t - Emitter Failure
     		msg->sys_alarms.emitter_lens_dirty,				// 11. uint8_t - Emitter Dirty Lens
     		msg->sys_alarms.emitter_temperature,   			// 12. uint8_t - Emitter Temperature Failure
@@ -440,7 +468,16 @@ void process_and_send(ParsedMessage *msg) {
 
 	if (length > 0 && length < (int)sizeof(msg_buffer)) {
 		uint16_t calculated_crc = crc16_ccitt((uint8_t*)msg_buffer, length);
-		safe_serial_write(serial_fd, "\x02%s %04X\x03\r\n", msg_buffer, calculated_crc);
+		char crc_str[8];
+		snprintf(crc_str, sizeof(crc_str), " %04X", calculated_crc);
+		// <STX>message <CRC><ETX><CR><LF>, queued as pieces so the message is not re-formatted.
+		struct iovec frame[] = {
+			{ (void *)"\x02", 1 },
+			{ msg_buffer, (size_t)length },
+			{ crc_str, 5 },
+			{ (void *)"\x03\r\n", 3 },
+		};
+		serial_writev(serial_fd, frame, 4);
 	}
 }
 
@@ -511,7 +548,7 @@ CommandType parse_command(const char *buf, ParsedCommand *cmd) {
 	uint16_t received = (uint16_t)strtol(hex_tmp, NULL, 16);
 
  	// Check if the CRC received is the same as the data sent with it.
-	//TODO: Add in a mutex lock here, when accessing sensor_one.
+	// sensor_one is only written by the receiver thread, which is the thread running this.
 	if (calculated != received && sensor_one->crc_checking_enabled) return CMD_INVALID_CRC;
 
     // --- IDENTIFY ENUM & PARSE CONTENT ---
@@ -659,13 +696,11 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 
 	 switch (cmd) {
         case CMD_POLL:
-        	char *line = get_next_line_copy(file_ptr, &file_mutex);
-        	if (line) {
+        	char line[REPLAY_LINE_MAX];
+        	if (replay_next_line(replay_src, line, sizeof(line)) > 0) {
 				ParsedMessage local_msg;
 				parse_message(line, &local_msg);
-				process_and_send(&local_msg);
-            	free(line); // caller of get_next_line_copy() must free resource.
-				line = NULL;
+				process_and_send(&local_msg, sensor_one);
         	}
 			break;
         case CMD_GET:
@@ -811,8 +846,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 				sensor_one->data_format = p_cmd->params.set_params.data_format;
 			}
 			safe_serial_write(serial_fd, "%s", p_cmd->params.set_params.full_cmd_string);
-			// Wake up our sender thread, to check if continuous interval changed, or our mode went from polled to continuous.
-			pthread_cond_signal(&sensor_cond);
+			// publish_sensor() wakes our sender thread, to check if continuous interval changed, or our mode went from polled to continuous.
             break;
 		case CMD_MSGSET: {
         	uint32_t requested_bits = p_cmd->params.msgset.field_bitmap;
@@ -899,18 +933,66 @@ void* signal_thread(void* arg) {
     terminate = 1;
     kill_flag = 1;
 
-    // Now safely wake any threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    // Now safely wake the sender
+    schedule_wake(&sender_sched);
 
     return NULL;
 }
 
+/*
+ * Name:         publish_sensor
+ * Purpose:      Publishes sensor_one to the sender thread, and wakes it if anything changed.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     sensor_shared, sensor_lock.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Queries such as GET and POLL change nothing and are not published.
+ * 				 The wake is remembered by sender_sched until the sender next
+ * 				 waits, so a change is never missed.
+ */
+static void publish_sensor(void) {
+	if (memcmp(&sensor_shared, sensor_one, sizeof(sensor_shared)) == 0) return;
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared));
+	schedule_wake(&sender_sched); // Wake our sender thread, to check if our mode has changed.
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command(), then publishes the result.
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    metrics_count(METRIC_COMMANDS, 1);
+    if (cmd_type == CMD_UNKNOWN || cmd_type >= CMD_ERROR) metrics_count(METRIC_BAD_COMMANDS, 1);
+
+    handle_command(cmd_type, &local_cmd); // handle received command here, sensor_one is ours.
+
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    publish_sensor();
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -920,45 +1002,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    	if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0'; // Terminate with NULL for safety.
-                    ParsedCommand local_cmd;
-                    CommandType cmd_type = parse_command(line, &local_cmd);
-					pthread_mutex_lock(&sensor_mutex);   // <--- LOCK HERE
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    pthread_mutex_unlock(&sensor_mutex); // <--- UNLOCK HERE
-                    len = 0;
-                } else { // empty line ignore
-                }
-            } else {
-              	  if (len < sizeof(line)-1) {
-				      line[len++] = c;
-                  } else {
-                    	len = 0;
-                  }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(CPU_WAIT_USEC);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -967,63 +1020,41 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Sends on sender_sched deadlines, each one the previous deadline
+ * 				 plus the interval, so the time taken to send never adds up as drift.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec ts;
-	bool should_send = false;
-	int interval = 0;
+	av30_sensor cfg; // Snapshot of sensor_one, private to this thread.
+	seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
 
     while (!terminate) {
-        pthread_mutex_lock(&sensor_mutex);
-
-		// Determine if we should wait for a specific time or indefinitely
-        if (sensor_one != NULL && sensor_one->mode == MODE_CONTINUOUS) {
-            interval = sensor_one->continuous_interval;
-			// Calculate absolute time: Last Send Time + Interval
-            // Use current REALTIME + (Interval - Time Since Last Send)
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            // Add the continuous interval (in seconds) to the current time
-            ts.tv_sec += interval;
-
-            // Wait until that specific second arrives OR a signal interrupts us
-            pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-        } else {
-            // If in Polling Mode, wait indefinitely for a signal from the receiver
-            pthread_cond_wait(&sensor_cond, &sensor_mutex);
-        }
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
-            break;
-        }
-
-        // is_ready_to_send() handles the interval and timing logic internally, and checks if the sensor is Pollling or Continuous.
-		should_send = (sensor_one != NULL && av30_is_ready_to_send(sensor_one));
-
-		pthread_mutex_unlock(&sensor_mutex);  // <-- UNLOCK BEFORE I/O
-
-        if (should_send) {
-        	char *line = get_next_line_copy(file_ptr, &file_mutex); // Moved this into the check for is_ready_to_send to avoid depleting the data file.
+		if (cfg.mode == MODE_CONTINUOUS) {
+			// Keeps its phase while the interval is unchanged, an interval of 0 sends back to back.
+			schedule_start(&sender_sched, (uint64_t)cfg.continuous_interval * SCHED_NS_PER_SEC);
+		} else {
+			// If in Polling/Stop Mode, wait indefinitely for the receiver to publish a change.
+			schedule_stop(&sender_sched);
+		}
 
-        	if (line) {
-				ParsedMessage local_msg;  // LOCAL, not global
-				parse_message(line, &local_msg);
-				process_and_send(&local_msg);
-				fflush(NULL);
-            	free(line); // caller of get_next_line_copy() must free resource.
-				line = NULL;
-        	}
+		ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+		if (event == SCHEDULE_ERROR) {
+			safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
+			break;
+		}
+		if (event == SCHEDULE_WOKEN) {
+			seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg)); // The receiver has published since.
+			continue;
+		}
 
-            // Update timestamp with lock
-            pthread_mutex_lock(&sensor_mutex);
-            // Update the last_send_time to the current monotonic clock
-            if (sensor_one != NULL) {
-				clock_gettime(CLOCK_MONOTONIC, &sensor_one->last_send_time);
-			}
-	        pthread_mutex_unlock(&sensor_mutex);
-        }
+		char line[REPLAY_LINE_MAX];
+		if (replay_next_line(replay_src, line, sizeof(line)) > 0) {
+			ParsedMessage local_msg;  // LOCAL, not global
+			parse_message(line, &local_msg);
+			process_and_send(&local_msg, &cfg);
+			fflush(NULL);
+		}
     }
     return NULL;
 }
@@ -1053,18 +1084,24 @@ void* sender_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--metrics PATH] [--capture PATH]\n", argv[0]);
         cleanup_and_exit(1);
     }
 
+	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
+    replay_set_sensor(replay_src, "pres_weather"); // Names the lines a wxstate:// source renders.
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -1079,10 +1116,15 @@ int main(int argc, char *argv[]) {
         cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
 	if (init_av30_sensor(&sensor_one) != 0) {
         safe_console_error("Failed to initialize sensor_one\n");
 	  	cleanup_and_exit(1);
     }
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared)); // The sender's first snapshot.
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -1091,15 +1133,18 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
 
-	// Initialize the send condition to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&sensor_cond, &attr); // Initialize the global variable here
-	sensor_cond_init = true;
-    pthread_condattr_destroy(&attr);
+	// RUN mode deadlines for the sender, on CLOCK_MONOTONIC.
+	if (schedule_init(&sender_sched, SCHEDULE_SKIP) != 0) {
+        safe_console_error("Failed to create sender schedule: %s\n", strerror(errno));
+		cleanup_and_exit(1);
+	}
+
+	if (metrics_start(&metrics_opts, program_name) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, program_name) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
 
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
         safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
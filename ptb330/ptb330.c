@@ -62,7 +62,30 @@
  * 	Note: 		PTB330 calculates WMO pressure trend/tendency (3-hour history).
  * 				Supports PA11A emulation mode for legacy system replacement.
  *
- * Mods:
+ * Mods:		14/10/2026 The sender works from a seqlock snapshot of sensor_one and no
+ * 				longer shares sensor_mutex with command handling.
+ * 				14/10/2026 The sender runs on a SendSchedule, deadlines follow the
+ * 				last deadline rather than the end of the last send.
+ * 				14/10/2026 Commands are matched by command_lookup(), ADDR and OPEN
+ * 				addresses are range checked by command_arg_long().
+ * 				14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ * 				wait metrics on a UNIX socket.
+ * 				14/10/2026 --live reads a pipe, FIFO or udp:// source ahead of the
+ * 				sender, parsed records come out of a lock-free ring.
+ * 				14/10/2026 The data file is reloaded when it is replaced or on
+ * 				SIGHUP, without a restart.
+ * 				14/10/2026 --capture PATH records every byte on the port with
+ * 				timestamps, see wxcap.
+ * 				14/10/2026 USDT probes on command parsing and handling, see
+ * 				trace_utils.h and trace/.
+ * 				14/10/2026 --upsample interpolates the 10 s data file at the time
+ * 				of each message, with optional seeded --noise.
+ * 				14/10/2026 A data file of wxstate://NAME reports the pressure of the
+ * 				shared weather state, see wxstate/.
+ * 				14/10/2026 DATE, TIME and ? read a cached Calendar instead of
+ * 				localtime(), which is not thread safe.
+ * 				14/10/2026 --state PATH keeps the settings and the replay position
+ * 				over a restart, see persist_utils.h.
  *
  */
 
@@ -83,14 +106,24 @@
 #include "crc_utils.h"
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "ptb330_utils.h"
-
+#include "seqlock_utils.h"
+#include "schedule_utils.h"
+#include "command_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+#include "upsample_utils.h"
+#include "calendar_utils.h"
+#include "persist_utils.h"
+
+#define DATA_PERIOD_MS 10000 // ptb330_data_*.txt are recorded every 10 seconds from 00:00.
+#define STATE_LAYOUT 2 // --state payload, a ptb330_sensor. Bump when the saved fields change meaning.
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B4800	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_CMD_LENGTH 256
 #define MAX_MSG_LENGTH 512
-#define CPU_WAIT_USEC 10000
 
 #define DEBUG_MODE // Comment this line out to disable all debug prints
 
@@ -101,7 +134,7 @@
 #endif
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -113,10 +146,19 @@ const char *program_name = "unknown";
 // This needs to be freed upon exit.
 ptb330_sensor *sensor_one = NULL; // Global pointer to struct for atmosvue30 sensor .
 
+/*
+ * sensor_one belongs to the receiver thread. After each command it is published to
+ * sensor_shared, and the sender takes snapshots of that copy through sensor_lock.
+ * sensor_mutex only guards terminate; the sender sleeps on sender_sched.
+ */
+static ptb330_sensor sensor_shared;
+static SeqLock sensor_lock = SEQLOCK_INITIALIZER;
+
 /* Synchronization primitives */
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // RUN mode deadlines, woken by publish_sensor().
+static Upsampler upsampler = UPSAMPLE_INITIALIZER; // --upsample, shared by the sender and SEND.
+static PersistFile *state_file = NULL; // --state, NULL when settings are not kept.
 
 // Global pointers to receiver and sender threads.
 pthread_t recv_thread, send_thread, sig_thread;
@@ -125,8 +167,6 @@ bool recv_thread_created = false;
 bool send_thread_created = false;
 bool sig_thread_created = false;
 
-bool sensor_cond_init = false;
-
 /*
  * Name:         cleanup_and_exit
  * Purpose:      helper function to cleanup sensors, and arrays.
@@ -143,8 +183,8 @@ bool sensor_cond_init = false;
 void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex);
     terminate = 1;
-	if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
     pthread_mutex_unlock(&sensor_mutex);
+	schedule_wake(&sender_sched);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -153,6 +193,8 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
+		upsample_report(&upsampler, program_name);
     }
 
     if (sig_thread_created) {
@@ -162,13 +204,16 @@ void cleanup_and_exit(int exit_code) {
     }
 
 	pthread_mutex_destroy(&sensor_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
+    schedule_destroy(&sender_sched);
 
-    if (sensor_one) free(sensor_one);
+    free_ptb330_sensor(sensor_one);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    upsample_close(&upsampler);
+    persist_close(state_file); // After the threads, nothing commits to it now.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -183,6 +228,7 @@ void cleanup_and_exit(int exit_code) {
  * Purpose:      Tokenizes a space-delimited sensor string and populates a ParsedMessage struct.
  * Arguments:    msg: the raw input string to be parsed (modified by strtok_r).
  * 				 p_message: pointer to the struct where parsed data will be stored.
+ * 				 sensor: the configuration to apply, sensor_one or a sender snapshot.
  *
  * Output:       None (internal debug prints to console only).
  * Modifies:     p_message: overwrites with new data.
@@ -195,51 +241,109 @@ void cleanup_and_exit(int exit_code) {
  * Notes:        Uses a local macro NEXT_T to sequence through 32 expected fields.
  *               Ensures string fields (METAR, BLM) are safely null-terminated.
  */
-void parse_message(char *msg, ParsedMessage *p_message) {
-	memset(p_message, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
-	char *saveptr; // Our place keeper in the msg string.
-	char *token; // Where we temporarily store each token.
-
-	if ((token = strtok_r(msg, ",", &saveptr))) p_message->p1_pressure = atof(token);  // Set P1 pressure.
-   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
-	// These are pulled from a text file in this format:
-	// 1013.25,1013.24,1013.26,23.4,23.5,23.2,0,0,0,1013.25,0.00
-	// P1 Pressure,P2 Pressure,P3 Pressure,P1 Temp,P2 Temp,P3 Temp,P1 Error,P2 Error, P3, Error,Pressure Average,Pressure Trend
-   	if ((token = NEXT_T)) p_message->p2_pressure = atof(token); // Set P2 pressure.
-   	if ((token = NEXT_T)) p_message->p3_pressure = atof(token); // Set P3 pressure.
-	if ((token = NEXT_T)) p_message->p1_temperature = atof(token); // Set P1 temperature.
-	if ((token = NEXT_T)) p_message->p2_temperature = atof(token); // Set P2 temperature.
-	if ((token = NEXT_T)) p_message->p3_temperature = atof(token); // Set P3 temperature.
-   	if ((token = NEXT_T)) { // Set P1 error.
-		if (atoi(token) == 1) {
-			p_message->p1_sensor_error = IS_ERROR;
-		} else p_message->p1_sensor_error = NO_ERROR;
-	}
-   	if ((token = NEXT_T)) { // Set P2 error.
-		if (atoi(token) == 1) {
-			p_message->p2_sensor_error = IS_ERROR;
-		} else p_message->p2_sensor_error = NO_ERROR;
-	}
-   	if ((token = NEXT_T)) { // Set P3 error.
-		if (atoi(token) == 1) {
-			p_message->p3_sensor_error = IS_ERROR;
-		} else p_message->p3_sensor_error = NO_ERROR;
+void parse_message(char *msg, ParsedMessage *p_message, const ptb330_sensor *sensor) {
+	ptb330_parse_message(msg, p_message, sensor);
+}
+
+/*
+ * Name:         live_parse
+ * Purpose:      Parses a --live line into a record, as wxb_convert does.
+ * Arguments:    line: the line, modified by the parse.
+ * 				 record: the ParsedMessage to fill.
+ *
+ * Output:       None.
+ * Modifies:     record, line.
+ * Returns:      None.
+ * Assumptions:  Called on the live feed's ingestion thread.
+ *
+ * Bugs:         None known.
+ * Notes:        Sensor fields are left zero, next_message() fills them in from
+ * 				 the live configuration as it does for a cached record.
+ */
+static void live_parse(char *line, void *record) {
+	static const ptb330_sensor live_sensor; // All zero, next_message() applies the real one.
+	ptb330_parse_message(line, record, &live_sensor);
+}
+
+/*
+ * Name:         read_message
+ * Purpose:      Fetches the next record from the data file.
+ * Arguments:    p_message: pointer to the struct where the record will be stored.
+ * 				 sensor: the configuration to apply, sensor_one or a sender snapshot.
+ *
+ * Output:       None.
+ * Modifies:     p_message, advances the replay cursor and its copy in state_file.
+ * Returns:      true if a record was stored, false if the data file has no line available.
+ * Assumptions:  replay_src has been opened and checked with replay_check_records().
+ *
+ * Bugs:         None known.
+ * Notes:        A .wxb cache made by wxb_convert is copied out record by record,
+ *               as is a --live record, a text file is read a line at a time and parsed.
+ */
+static bool read_message(ParsedMessage *p_message, const ptb330_sensor *sensor) {
+	const void *record = replay_next_record(replay_src);
+	if (record) {
+		memcpy(p_message, record, sizeof(ParsedMessage));
+		ptb330_apply_sensor(p_message, sensor); // Cached records carry the converter's default sensor.
+		persist_note_replay(state_file, replay_src);
+		return true;
 	}
-	if ((token = NEXT_T)) p_message->p_average = atof(token); // Set Pressure Average.
-	if ((token = NEXT_T)) p_message->trend = atof(token); // Set Pressure Trend.
-	if ((token = NEXT_T)) p_message->tendency = atof(token); // Set Pressure Tendency.
-	#undef NEXT_T
-	p_message->altitude = sensor_one->hcp_altitude; // Update the sensor hcp_altitude.
-	strncpy(p_message->serial_num, sensor_one->serial_number, MAX_SN_LEN - 1); // Copy the serial numbers over.
-	p_message->serial_num[MAX_SN_LEN - 1] = '\0';
-	p_message->address = sensor_one->address;
-	p_message->units = sensor_one->units;
+	char line[REPLAY_LINE_MAX];
+	if (replay_next_line(replay_src, line, sizeof(line)) == 0) return false;
+	parse_message(line, p_message, sensor);
+	persist_note_replay(state_file, replay_src);
+	return true;
+}
+
+/*
+ * Name:         upsample_fetch
+ * Purpose:      Reads a record into the upsampler's window.
+ * Arguments:    record: the ParsedMessage to fill.
+ * 				 ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     record, advances the replay cursor.
+ * Returns:      true if a record was stored.
+ * Assumptions:  Called from upsample_next() only.
+ *
+ * Bugs:         None known.
+ * Notes:        Sensor fields are left zero, next_message() applies the
+ * 				 configuration to the interpolated record.
+ */
+static bool upsample_fetch(void *record, void *ctx) {
+	(void)ctx;
+	static const ptb330_sensor no_sensor; // All zero, next_message() applies the real one.
+	return read_message(record, &no_sensor);
+}
+
+/*
+ * Name:         next_message
+ * Purpose:      Fetches the next record to send.
+ * Arguments:    p_message: pointer to the struct where the record will be stored.
+ * 				 sensor: the configuration to apply, sensor_one or a sender snapshot.
+ *
+ * Output:       None.
+ * Modifies:     p_message, advances the replay cursor.
+ * Returns:      true if a record was stored, false if the data file has no line available.
+ * Assumptions:  replay_src has been opened and checked with replay_check_records().
+ *
+ * Bugs:         None known.
+ * Notes:        With --upsample the record is interpolated for now on the replay
+ *               clock, so an INTV under 10 s no longer plays the file faster.
+ *               Otherwise each message takes the next record.
+ */
+bool next_message(ParsedMessage *p_message, const ptb330_sensor *sensor) {
+	if (upsampler.mode == UPSAMPLE_OFF) return read_message(p_message, sensor);
+	if (!upsample_next(&upsampler, p_message)) return false;
+	ptb330_apply_sensor(p_message, sensor);
+	return true;
 }
 
 /*
  * Name:         process_and_send
  * Purpose:      Parse a data line, format the message string, and send with CRC.
  * Arguments:    msg: Pointer to the ParsedMessage struct containing the data stripped from the file/buffer.
+ * 				 sensor: sensor_one or a sender snapshot, whose FORM formats the message.
  *
  * Output:       Prints the formatted sensor message with STX/ETX and CRC to serial.
  * Modifies:     None.
@@ -249,14 +353,17 @@ void parse_message(char *msg, ParsedMessage *p_message) {
  * Bugs:         None known.
  * Notes:        Ensures the 32-field format matches the hardware specification.
  */
-void process_and_send(ParsedMessage *msg) {
+void process_and_send(ParsedMessage *msg, const ptb330_sensor *sensor) {
 
 	char msg_buffer[MAX_MSG_LENGTH]; // 512
 	if (msg == NULL) return;
-	build_dynamic_output(msg, msg_buffer, sizeof(msg_buffer));
+	build_dynamic_output(sensor->form, msg, msg_buffer, sizeof(msg_buffer));
 	safe_serial_write(serial_fd, "%s\r\n", msg_buffer);
 }
 
+// Built into a trie from cmd_table[] on the first command.
+static CommandDispatch dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_SPACE | CMD_TERM_QUERY | CMD_TERM_EQUALS);
+
 /*
  * Name:         parse_command
  * Purpose:      Translates a received string to command enum.
@@ -269,43 +376,22 @@ void process_and_send(ParsedMessage *msg) {
  * Assumptions:  The string recieved is a string and should be able to translate to one of the commands.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The keyword is matched by command_lookup() on dispatch.
  */
 CommandType parse_command(const char *buf, ParsedCommand *cmd) {
     if (buf == NULL || cmd == NULL) return CMD_UNKNOWN;
 
 	memset(cmd, 0, sizeof(ParsedCommand)); // zero out the contents of our ParsedCommand
-    const char *ptr = buf;
 
-    while (*ptr && isspace((unsigned char)*ptr)) ptr++; // Skip any leading whitespace.
-
-    for (size_t i = 0; i < CMD_TABLE_SIZE; i++) {
-
-        if (strncasecmp(ptr, cmd_table[i].name, cmd_table[i].len) == 0) {
-            // Ensure exact match (don't match "R" if the command is "RESET")
-            char next = ptr[cmd_table[i].len];
-            if (next == '\0' || isspace((unsigned char)next) || next == '?' || next == '=') {
-                cmd->type = cmd_table[i].type;
-                ptr += cmd_table[i].len; // Jump past command
-
-                // Skip spaces to point at arguments
-                while (*ptr && isspace((unsigned char)*ptr)) ptr++;
-
-				size_t param_len = strcspn(ptr, "\n\r"); // Get the size of the string, up to the \n \r
-
-				if (param_len > sizeof(cmd->raw_params) - 1) {
-    				param_len = sizeof(cmd->raw_params) - 1;
-				}
-
-				strncpy(cmd->raw_params, ptr, param_len);
-				cmd->raw_params[param_len] = '\0'; // Always null-terminate
-
-                return cmd->type;
-            }
-        }
+    const char *args;
+    const CommandMap *m = command_lookup(&dispatch, buf, &args);
+    if (m == NULL) {
+        cmd->type = CMD_UNKNOWN;
+        return CMD_UNKNOWN;
     }
-    cmd->type = CMD_UNKNOWN;
-    return CMD_UNKNOWN;
+    cmd->type = (CommandType)m->type;
+    command_copy_params(args, cmd->raw_params, sizeof(cmd->raw_params)); // Up to the \n \r, truncated to fit.
+    return cmd->type;
 }
 
 
@@ -389,9 +475,8 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 		case CMD_LOCK:
 			break;
 		case CMD_INFO:
-			char current_time[20];
-			time_t now = time(NULL);
-			strftime(current_time, sizeof(current_time), "%H:%M:%S", localtime(&now));
+			static __thread Calendar info_clock = CALENDAR_INITIALIZER(CALENDAR_LOCAL);
+			const char *current_time = calendar_set(&info_clock, time(NULL))->hms;
 			safe_serial_write(serial_fd, "\nPTB330 / %s\nSerial number\t: %s\n"
 									"Batch number\t: %s\n"
 									"Output format\t: %s\n"
@@ -453,7 +538,6 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			break;
 		case CMD_R:
 			sensor_one->mode = SMODE_RUN;
-			pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
 			break;
 		case CMD_INTV: {
     		int val = 0;
@@ -513,19 +597,13 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 				sensor_one->intv_data.multiplier = multiplier;
 				safe_serial_write(serial_fd, "Output interval %d %s\r\n", sensor_one->intv_data.interval, sensor_one->intv_data.interval_units);
     		}
-			pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
     		break;
 		}
 		case CMD_SEND:
-        	char *line = get_next_line_copy(file_ptr, &file_mutex);
-
-        	if (line) {
-		        ParsedMessage local_msg;  // LOCAL
-				parse_message(line, &local_msg);
-				process_and_send(&local_msg);
+        	ParsedMessage local_msg;  // LOCAL
+        	if (next_message(&local_msg, sensor_one)) {
+				process_and_send(&local_msg, sensor_one);
 				fflush(NULL);
-            	free(line); // caller of get_next_line_copy() must free resource.
-				line = NULL;
         	}
 			break;
 		case CMD_SMODE:
@@ -543,35 +621,34 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 				} else {
 				}
 			}
-			pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
 			break;
 		case CMD_SDELAY:
-		case CMD_ADDR:
-			if (p_cmd->raw_params[0] != '\0') {
-				uint8_t new_address = (uint8_t)atoi(p_cmd->raw_params);
-				sensor_one->address = new_address;
+		case CMD_ADDR:{
+			long new_address;
+			if (p_cmd->raw_params[0] != '\0' && command_arg_long(p_cmd->raw_params, 0, 255, &new_address) == 0) {
+				sensor_one->address = (uint8_t)new_address;
 				safe_serial_write(serial_fd, "Address : 2 ?  %hhu\r\n",sensor_one->address);
 			} else {
 				safe_serial_write(serial_fd, "Address : 2 ?  %hhu\r\n",sensor_one->address);
 			}
 			break;
-		case CMD_OPEN:
-			if (p_cmd->raw_params[0] != '\0') {
-				uint8_t req_address = (uint8_t)atoi(p_cmd->raw_params);
+		}
+		case CMD_OPEN:{
+			long req_address;
+			if (p_cmd->raw_params[0] != '\0' && command_arg_long(p_cmd->raw_params, 0, 255, &req_address) == 0) {
 				if (sensor_one->mode == SMODE_POLL && sensor_one->address == req_address) {
 					sensor_one->mode = SMODE_STOP;
 					safe_serial_write(serial_fd, "PTB330: %hhu line opened for operator commands\r\n", sensor_one->address);
-					pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
 				}
 			} else {
-				safe_console_error("%s: %s\n", program_name, "Open command received without an address");
+				safe_console_error("%s: %s\n", program_name, "Open command received without a valid address");
 			}
 			break;
+		}
 		case CMD_CLOSE:
 			if (sensor_one->mode == SMODE_STOP) {
 				sensor_one->mode = SMODE_POLL;
 				safe_serial_write(serial_fd, "line closed\r\n");
-				pthread_cond_signal(&sensor_cond); // Wake our sender thread, to check if our mode has changed.
 			}
 			break;
 		case CMD_SCOM:
@@ -606,7 +683,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			} else {
 				strncpy(sensor_one->format_string, p_cmd->raw_params, MAX_FORM_STR - 1); // Copy the param string to the sensor, error handling?
 				sensor_one->format_string[MAX_FORM_STR - 1] = '\0';
-				parse_form_string(p_cmd->raw_params); // This is going to go through the remaing string after FORM, and build the compiled_form[] fields.
+				parse_form_string(sensor_one->form, p_cmd->raw_params); // This is going to go through the remaing string after FORM, and build the unit's FORM program.
 			}
 			break;
 		case CMD_TIME:
@@ -741,18 +818,95 @@ void* signal_thread(void* arg) {
 
     terminate = 1;
 
-    // Now safely wake any threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    // Now safely wake the sender
+    schedule_wake(&sender_sched);
 
     return NULL;
 }
 
+/*
+ * Name:         publish_sensor
+ * Purpose:      Publishes sensor_one to the sender thread, and wakes it if anything changed.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     sensor_shared, sensor_lock.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread, or from main before the threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        Most commands only report settings, so the copy is skipped when
+ * 				 sensor_one still matches what was last published. The wake is
+ * 				 remembered by sender_sched until the sender next waits, so a
+ * 				 change is never missed.
+ */
+static void publish_sensor(void) {
+	if (memcmp(&sensor_shared, sensor_one, sizeof(sensor_shared)) == 0) return;
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared));
+	schedule_wake(&sender_sched); // Wake our sender thread, to check if our mode has changed.
+	persist_commit(state_file, sensor_one); // As the real PTB330 writes its settings to EEPROM.
+}
+
+/*
+ * Name:         load_state
+ * Purpose:      Takes sensor_one's settings from the last --state commit.
+ * Arguments:    None.
+ *
+ * Output:       A note on the console when settings are restored.
+ * Modifies:     sensor_one, the compiled FORM.
+ * Returns:      None.
+ * Assumptions:  Called from main after init_ptb330_sensor(), before the threads start.
+ *
+ * Bugs:         None known.
+ * Notes:        The saved pressure, send time and FORM pointer are not used,
+ * 				 they belong to the run that saved them. The FORM is compiled
+ * 				 again from its saved text.
+ */
+static void load_state(void) {
+	const ptb330_sensor *saved = persist_load(state_file, NULL);
+	if (!saved) return;
+	struct timespec last_send_time = sensor_one->last_send_time;
+	double pressure = sensor_one->pressure;
+	PTB330Form *form = sensor_one->form;
+	memcpy(sensor_one, saved, sizeof(*sensor_one));
+	sensor_one->last_send_time = last_send_time;
+	sensor_one->pressure = pressure;
+	sensor_one->form = form;
+	parse_form_string(sensor_one->form, sensor_one->format_string);
+	safe_console_print("%s: settings restored from the state file\n", program_name);
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command(), then publishes the result.
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+
+    handle_command(cmd_type, &local_cmd); // handle received command here, sensor_one is ours.
+
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    publish_sensor();
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -762,47 +916,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    	if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0'; // Terminate with NULL for safety.
-
-                    ParsedCommand local_cmd;
-                    CommandType cmd_type = parse_command(line, &local_cmd);
-
-					pthread_mutex_lock(&sensor_mutex);   // <--- LOCK HERE
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    pthread_mutex_unlock(&sensor_mutex); // <--- UNLOCK HERE
-                    len = 0;
-                } else { // empty line ignore
-                }
-            } else {
-              	  if (len < sizeof(line)-1) {
-				      line[len++] = c;
-                  } else {
-                    	len = 0;
-                  }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(CPU_WAIT_USEC);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -811,61 +934,39 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Sends on sender_sched deadlines, each one the previous deadline
+ * 				 plus INTV, so the time taken to send never adds up as drift.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec ts;
-	bool should_send = false;
-	int interval = 0;
+	ptb330_sensor cfg; // Snapshot of sensor_one, private to this thread.
+	seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
 
     while (!terminate) {
-        pthread_mutex_lock(&sensor_mutex);
-
-		// Determine if we should wait for a specific time or indefinitely
-        if (sensor_one != NULL && sensor_one->mode == SMODE_RUN) {
-			interval = (sensor_one->intv_data.interval * sensor_one->intv_data.multiplier);
-            // Calculate absolute time: Last Send Time + Interval
-            // Use current REALTIME + (Interval - Time Since Last Send)
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            // Add the continuous interval (in seconds) to the current time
-            ts.tv_sec += interval;
-            // Wait until that specific second arrives OR a signal interrupts us
-            pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-        } else {
-            // If in Polling/Stop Mode, wait indefinitely for a signal from the receiver
-            pthread_cond_wait(&sensor_cond, &sensor_mutex);
-        }
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
-            break;
-        }
-
-        // is_ready_to_send() handles the interval and timing logic internally, and checks if the sensor is Pollling or Continuous.
-        should_send = (sensor_one != NULL && ptb330_is_ready_to_send(sensor_one));
+		if (cfg.mode == SMODE_RUN) {
+			// Keeps its phase while INTV is unchanged, INTV 0 sends back to back.
+			schedule_start(&sender_sched, (uint64_t)cfg.intv_data.interval * cfg.intv_data.multiplier * SCHED_NS_PER_SEC);
+		} else {
+			// If in Polling/Stop Mode, wait indefinitely for the receiver to publish a change.
+			schedule_stop(&sender_sched);
+		}
 
-		pthread_mutex_unlock(&sensor_mutex);  // <-- UNLOCK BEFORE I/O
+		ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+		if (event == SCHEDULE_ERROR) {
+			safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
+			break;
+		}
+		if (event == SCHEDULE_WOKEN) {
+			seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg)); // The receiver has published since.
+			continue;
+		}
 
         // Do I/O operations WITHOUT holding the mutex
-        if (should_send) {
-            char *line = get_next_line_copy(file_ptr, &file_mutex);
-
-            if (line) {
-                ParsedMessage local_msg;  // LOCAL, not global
-                parse_message(line, &local_msg);
-                process_and_send(&local_msg);
-                fflush(NULL);  // Flush all output streams
-                free(line);
-                line = NULL;
-            }
-
-            // Update timestamp with lock
-            pthread_mutex_lock(&sensor_mutex);
-            if (sensor_one != NULL) {
-                clock_gettime(CLOCK_MONOTONIC, &sensor_one->last_send_time);
-            }
-            pthread_mutex_unlock(&sensor_mutex);
+        ParsedMessage local_msg;  // LOCAL, not global
+        if (next_message(&local_msg, &cfg)) {
+            process_and_send(&local_msg, &cfg);
+            fflush(NULL);  // Flush all output streams
         }
     }
     return NULL;
@@ -896,18 +997,38 @@ void* sender_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    ReplayOptions replay_opts;
+    if (replay_parse_options(&argc, argv, &replay_opts) != 0) cleanup_and_exit(1); // Strips --start/--end/--speed/--live.
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+    UpsampleOptions upsample_opts;
+    if (upsample_parse_options(&argc, argv, &upsample_opts) != 0) cleanup_and_exit(1); // Strips --upsample/--noise/--seed.
+    PersistOptions persist_opts;
+    if (persist_parse_options(&argc, argv, &persist_opts) != 0) cleanup_and_exit(1); // Strips --state.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--start T] [--end T] [--speed N|max] [--live[=latest|block|repeat]] [--live-depth N] [--upsample[=linear|cubic]] [--noise K] [--seed N] [--metrics PATH] [--capture PATH] [--state PATH]\n", argv[0]);
         cleanup_and_exit(1);
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
+    if (replay_check_records(replay_src, "ptb330", sizeof(ParsedMessage)) != 0) {
+        safe_console_error("%s: %s was not converted for this sensor or this build, rerun wxb_convert\n", program_name, file_path);
+        cleanup_and_exit(1);
+    }
+    if (replay_apply_options(replay_src, &replay_opts, NULL, DATA_PERIOD_MS) != 0) cleanup_and_exit(1);
+    if (persist_open(&state_file, &persist_opts, "ptb330", STATE_LAYOUT, sizeof(ptb330_sensor)) != 0) cleanup_and_exit(1);
+    persist_resume_replay(state_file, replay_src); // Before the upsampler reads its first records.
+    if (replay_start_live(replay_src, &replay_opts, sizeof(ParsedMessage), live_parse) != 0) cleanup_and_exit(1);
+    if (upsample_init(&upsampler, &upsample_opts, sizeof(ParsedMessage), ptb330_upsample_fields, PTB330_UPSAMPLE_FIELDS,
+                      DATA_PERIOD_MS * 1000000LL, upsample_fetch, NULL, replay_src) != 0) cleanup_and_exit(1);
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -922,10 +1043,16 @@ int main(int argc, char *argv[]) {
         cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
 	if (init_ptb330_sensor(&sensor_one) != 0) {
         safe_console_error("Failed to initialize sensor_one\n");
 	  	cleanup_and_exit(1);
     }
+	load_state();
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared)); // The sender's first snapshot.
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -934,15 +1061,18 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
 
-	// Initialize the send condition to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&sensor_cond, &attr); // Initialize the global variable here
-	sensor_cond_init = true;
-    pthread_condattr_destroy(&attr);
+	// RUN mode deadlines for the sender, on CLOCK_MONOTONIC.
+	if (schedule_init(&sender_sched, SCHEDULE_SKIP) != 0) {
+        safe_console_error("Failed to create sender schedule: %s\n", strerror(errno));
+		cleanup_and_exit(1);
+	}
+
+	if (metrics_start(&metrics_opts, program_name) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, program_name) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
 
 	// create the signal thread
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
@@ -26,13 +26,22 @@
  * 				- Pulse Width: 50 ms (emulating reed switch closure).
  * 				- Timing: Nanosecond precision via CLOCK_MONOTONIC.
  *
- * Usage:       ./cs700h <file_path> [gpio_chip] [gpio_pin]
+ * Usage:       ./cs700h <file_path> [gpio_chip] [gpio_pin] [--pwm CHIP:CHANNEL] [--rt-priority N]
  * 				Example: ./cs700h rain_data.txt /dev/gpiochip4 17
+ * 				--pwm hands the tips to a kernel PWM channel instead of the GPIO
+ * 				line (see pulse_utils.h); gpio_chip and gpio_pin are then unused.
  *
  * Build:       Requires libgpiod v2 and pthread. (Handled by the supplied make file.)
  * 				gcc -o cs700h cs700h.c -lgpiod -lpthread
  *
  * Mods:
+ * 				14/10/2026 Tips come from the shared pulse engine (pulse_utils.c),
+ * 				SCHED_FIFO with a busy-waited final edge or PWM hardware, and the
+ * 				achieved timing is printed on exit.
+ * 				14/10/2026 The data file is reloaded when it is replaced or on
+ * 				SIGHUP, without a restart.
+ * 				14/10/2026 A data file of wxstate://NAME tips at the rain rate of the
+ * 				shared weather state, re-read every state period, see wxstate/.
  *
  */
 
@@ -52,7 +61,8 @@
 #include <poll.h>
 #include <gpiod.h>
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
+#include "pulse_utils.h"
 
 
 #define MAX_LINE_LENGTH 1024
@@ -64,6 +74,7 @@
 #define GPIO_PIN    	17                // BCM pin 17, physical pin 11
 #define MM_PER_TIP      0.254             // CS700H: 0.254mm per tip
 #define PULSE_WIDTH_NS  50000000LL        // Reed switch closure duration in nanoseconds
+#define MIN_INTERVAL_NS (2 * PULSE_WIDTH_NS) // Fastest tipping, the switch is open at least as long as it is closed
 
 #define NS_PER_SEC 1000000000LL
 #define NS_PER_MS  1000000LL
@@ -89,7 +100,7 @@ struct gpiod_chip *chip = NULL;
 unsigned int offset = GPIO_PIN;
 int req_ret;
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -97,14 +108,11 @@ volatile sig_atomic_t terminate = 0;
 
 const char *program_name = "unknown";
 
-// Shared globals
-volatile long long shared_interval_ns = 0; // 0 for no rain
+// Tip pulse train, driven by sender_thread, its interval set by reader_thread (0 for no rain)
+static PulseTrain tip_train = PULSE_TRAIN_INITIALIZER;
+static PulseOptions pulse_opts;
 
 // Synchronization primitives
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
-pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the shared variable 'shared_interval_ns'
-static pthread_mutex_t pulse_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  pulse_sleep_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
 pthread_mutex_t reader_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  reader_sleep_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
 // Global pointers to receiver and sender threads.
@@ -114,7 +122,6 @@ bool read_thread_created = false;
 bool send_thread_created = false;
 bool sig_thread_created = false;
 
-bool pulse_cond_init = false;
 bool reader_cond_init = false;
 
 /*
@@ -133,9 +140,7 @@ bool reader_cond_init = false;
 void cleanup_and_exit(int exit_code) {
     terminate = 1;
     // Wake sender
-    pthread_mutex_lock(&pulse_sleep_mutex);
-    if (pulse_cond_init) pthread_cond_broadcast(&pulse_sleep_cond);
-    pthread_mutex_unlock(&pulse_sleep_mutex);
+    pulse_train_wake(&tip_train);
 
     // Wake reader
     pthread_mutex_lock(&reader_sleep_mutex);
@@ -150,6 +155,7 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
 		pthread_join(send_thread, NULL);
 		send_thread_created = false;
+		pulse_train_report(&tip_train, program_name);
 	}
 
     if (sig_thread_created) {
@@ -158,15 +164,12 @@ void cleanup_and_exit(int exit_code) {
 		sig_thread_created = false;
 	}
 
-    pthread_mutex_destroy(&pulse_sleep_mutex);
     pthread_mutex_destroy(&reader_sleep_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    pthread_mutex_destroy(&data_mutex);
-    if (pulse_cond_init) pthread_cond_destroy(&pulse_sleep_cond);
     if (reader_cond_init) pthread_cond_destroy(&reader_sleep_cond);
 
     // Close resources
-    if (file_ptr) fclose(file_ptr);
+    if (replay_src) replay_close(replay_src);
+    pulse_train_destroy(&tip_train);
 
 #ifdef GPIOD_V2
     if (request != NULL) {
@@ -198,30 +201,18 @@ void cleanup_and_exit(int exit_code) {
 // ---------------- Command handling ----------------
 
 /*
- * Name:        sleep_ns
- * Purpose:     Sleep for a given number of nanoseconds using nanosleep.
- * Arguments:   ns: nanoseconds to sleep.
+ * Name:        set_tip_line
+ * Purpose:     Drives the output pin, active closes the simulated reed switch.
+ *              The pulse engine calls it at both edges of each tip.
+ * Arguments:   ctx: unused.
+ *              active: true for the closure.
  */
-static void sleep_ns(long long ns) {
-    struct timespec ts = {.tv_nsec = ns};
-    nanosleep(&ts, NULL);
-}
-
-/*
- * Name:        simulate_tip
- * Purpose:     Drives the output pin low for PULSE_WIDTH_MS then returns
- *              high — simulating one reed switch closure (one bucket tip).
- * Arguments:   line: the open gpiod line to drive.
- */
-static void simulate_tip() {
+static void set_tip_line(void *ctx, bool active) {
+    (void)ctx;
 #ifdef GPIOD_V2
-    gpiod_line_request_set_value(request, offset, GPIOD_LINE_VALUE_ACTIVE);
-    sleep_ns(PULSE_WIDTH_NS);
-    gpiod_line_request_set_value(request, offset, GPIOD_LINE_VALUE_INACTIVE);
+    gpiod_line_request_set_value(request, offset, active ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
 #else
-    gpiod_line_set_value(gpio_line, 1);
-    sleep_ns(PULSE_WIDTH_NS);
-    gpiod_line_set_value(gpio_line, 0);
+    gpiod_line_set_value(gpio_line, active ? 1 : 0);
 #endif
 }
 
@@ -244,9 +235,7 @@ void* signal_thread(void* arg) {
     terminate = 1;
 
     // safely wake threads
-    pthread_mutex_lock(&pulse_sleep_mutex);
-    pthread_cond_broadcast(&pulse_sleep_cond);
-    pthread_mutex_unlock(&pulse_sleep_mutex);
+    pulse_train_wake(&tip_train);
 
     pthread_mutex_lock(&reader_sleep_mutex);
     pthread_cond_broadcast(&reader_sleep_cond);
@@ -263,7 +252,7 @@ void* signal_thread(void* arg) {
  * Arguments:    arg: thread arguments.
  *
  * Output:       NIL
- * Modifies:     shared_interval_ns.
+ * Modifies:     tip_train's interval.
  * Returns:      NULL.
  * Assumptions:  NIL
  *
@@ -272,20 +261,17 @@ void* signal_thread(void* arg) {
  */
 void* reader_thread(void* arg) {
     (void) arg;
-	char *line = NULL;
+	char line[REPLAY_LINE_MAX];
     double mm_per_hour = 0;
 	unsigned long duration_sec = 0;
 
     while (!terminate) {
-        line = get_next_line_copy(file_ptr, &file_mutex);
-        if (line) {
+        if (replay_next_line(replay_src, line, sizeof(line)) > 0) {
 			char *saveptr; // Our place keeper in the string.
 			char *token; // Where we temporarily store each token.
 			if ((token = strtok_r(line, " ,", &saveptr))) mm_per_hour = (double)atof(token);
 			if ((token = strtok_r(NULL, " ,", &saveptr))) duration_sec = (long) atol(token);
 
-			free(line);
-			line = NULL;
 
             long long new_interval_ns;
 
@@ -293,17 +279,12 @@ void* reader_thread(void* arg) {
                 // (Seconds per Hour * Nanoseconds per second) / (Target mm / mm per tip)
                 double tips_per_hour = mm_per_hour / MM_PER_TIP;
                 new_interval_ns = (long long)((SEC_PER_HOUR * NS_PER_SEC) / tips_per_hour);
+                if (new_interval_ns < MIN_INTERVAL_NS) new_interval_ns = MIN_INTERVAL_NS;
             } else {
                 new_interval_ns = 0; // Flag for "dry"
             }
 
-            pthread_mutex_lock(&data_mutex);
-            shared_interval_ns = new_interval_ns; // Change the shared interval
-            pthread_mutex_unlock(&data_mutex);
-
-			pthread_mutex_lock(&pulse_sleep_mutex);
-            pthread_cond_broadcast(&pulse_sleep_cond); // Alert sender of change
-			pthread_mutex_unlock(&pulse_sleep_mutex);
+            pulse_train_set_interval(&tip_train, new_interval_ns); // Alert sender of change
 
             // Wait for the duration of this weather block
             struct timespec ts;
@@ -330,54 +311,22 @@ void* reader_thread(void* arg) {
 
 /*
  * Name:         sender_thread
- * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ * Purpose:      Emits one PULSE_WIDTH_NS closure per tip at the interval set by reader_thread, through the
+ *               shared pulse engine, until terminate is set.
  * Arguments:    arg: thread arguments.
  *
- * Output:       Error messages if encountered, prints to serial device.
- * Modifies:     None.
+ * Output:       Pulses on the GPIO line or the PWM channel.
+ * Modifies:     The thread's scheduling policy, tip_train's statistics.
  * Returns:      NULL.
- * Assumptions:  serial port will have data, and that data will translate to a command.
+ * Assumptions:  pulse_train_init() succeeded.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The engine moves this thread to SCHED_FIFO when permitted, a dry spell resets the reference clock
+ *               so no burst of old pulses follows, and a rate change neither adds nor loses a tip.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-	struct timespec next_pulse;
-    clock_gettime(CLOCK_MONOTONIC, &next_pulse);
-
-    while (!terminate) {
-        long long current_interval_ns;
-
-        pthread_mutex_lock(&data_mutex);
-        current_interval_ns = shared_interval_ns;
-        pthread_mutex_unlock(&data_mutex);
-
-        if (current_interval_ns > 0) {
-            simulate_tip(); // Pulse the pin
-
-            // Calculate exact time for NEXT pulse using nanoseconds
-            long long next_ns = (long long)next_pulse.tv_sec * NS_PER_SEC + next_pulse.tv_nsec + current_interval_ns;
-
-            next_pulse.tv_sec = (time_t)(next_ns / NS_PER_SEC);
-            next_pulse.tv_nsec = (long)(next_ns % NS_PER_SEC);
-
-            pthread_mutex_lock(&pulse_sleep_mutex);
-            if (!terminate) {
-                // Timedwait wakes up exactly at the nanosecond next_pulse is due
-                pthread_cond_timedwait(&pulse_sleep_cond, &pulse_sleep_mutex, &next_pulse);
-            }
-            pthread_mutex_unlock(&pulse_sleep_mutex);
-        } else {
-            // Dry period: Just wait for the Reader to signal a change
-            pthread_mutex_lock(&pulse_sleep_mutex);
-            if (!terminate) pthread_cond_wait(&pulse_sleep_cond, &pulse_sleep_mutex);
-            pthread_mutex_unlock(&pulse_sleep_mutex);
-            // Reset reference clock after a dry spell to prevent a "burst" of old pulses
-            clock_gettime(CLOCK_MONOTONIC, &next_pulse);
-        }
-    }
+    pulse_train_run(&tip_train, &terminate);
     return NULL;
 }
 
@@ -407,52 +356,60 @@ void* sender_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    if (pulse_parse_options(&argc, argv, &pulse_opts) != 0) return 1;
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <GPIO_chip> <GPIO_pin>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> [GPIO_chip] [GPIO_pin] [--pwm CHIP:CHANNEL] [--rt-priority N]\n", argv[0]);
         return 1;
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
+    replay_set_sensor(replay_src, "rain"); // Names the lines a wxstate:// source renders.
     //ternary statement to set GPIO_CHIP if supplied in args or the default
     const char *chip_path = (argc >= 3) ? argv[2] : GPIO_CHIP;
 
     // ternary statement to set GPIO_OUT_PIN if supplied in args or default
     offset = (argc >= 4) ? atoi(argv[3]) : GPIO_PIN;
 
-    chip = gpiod_chip_open(chip_path);
-
-    if (!chip) {
-        perror("gpiod_chip_open");
+    if (pulse_train_init(&tip_train, &pulse_opts, PULSE_WIDTH_NS, set_tip_line, NULL) != 0) {
+        safe_console_error("Failed to set up the tip output: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
 
+    if (pulse_opts.pwm_chip < 0) { // A PWM channel owns the pin, the GPIO line is only requested when tipping in software.
+        chip = gpiod_chip_open(chip_path);
+
+        if (!chip) {
+            perror("gpiod_chip_open");
+            cleanup_and_exit(1);
+        }
+
 #ifdef GPIOD_V2
-    settings = gpiod_line_settings_new();
-    if (!settings) { perror("settings"); cleanup_and_exit(1); }
-    gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
-    gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+        settings = gpiod_line_settings_new();
+        if (!settings) { perror("settings"); cleanup_and_exit(1); }
+        gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+        gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
 
-    line_cfg = gpiod_line_config_new();
-    if (!line_cfg) { perror("line_cfg"); cleanup_and_exit(1); }
+        line_cfg = gpiod_line_config_new();
+        if (!line_cfg) { perror("line_cfg"); cleanup_and_exit(1); }
 
-    req_ret = gpiod_line_config_add_line_settings(line_cfg, &offset, 1, settings);
-    if (req_ret) { perror("add line settings"); cleanup_and_exit(1); }
+        req_ret = gpiod_line_config_add_line_settings(line_cfg, &offset, 1, settings);
+        if (req_ret) { perror("add line settings"); cleanup_and_exit(1); }
 
-    request = gpiod_chip_request_lines(chip, NULL, line_cfg);
-    if (!request) { perror("request lines"); cleanup_and_exit(1); }
+        request = gpiod_chip_request_lines(chip, NULL, line_cfg);
+        if (!request) { perror("request lines"); cleanup_and_exit(1); }
 #else
-    gpio_line = gpiod_chip_get_line(chip, offset);
-    if (!gpio_line) { perror("get line"); cleanup_and_exit(1); }
+        gpio_line = gpiod_chip_get_line(chip, offset);
+        if (!gpio_line) { perror("get line"); cleanup_and_exit(1); }
 
-    req_ret = gpiod_line_request_output(gpio_line, "cs700h", 0); // 0 = initial low
-    if (req_ret) { perror("request output"); cleanup_and_exit(1); }
+        req_ret = gpiod_line_request_output(gpio_line, "cs700h", 0); // 0 = initial low
+        if (req_ret) { perror("request output"); cleanup_and_exit(1); }
 #endif
+    }
 
 	// Block signals in main (inherited by all threads)
 	sigset_t block_set;
@@ -461,13 +418,12 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
-	// Initialize the pulse and reader conditions to use CLOCK_MONOTONIC
+	// Initialize the reader condition to use CLOCK_MONOTONIC
 	pthread_condattr_t attr;
     pthread_condattr_init(&attr);
     pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&pulse_sleep_cond, &attr); // Initialize the global variable here
-	pulse_cond_init = true;
     pthread_cond_init(&reader_sleep_cond, &attr); // Initialize the global variable here
     reader_cond_init = true;
 	pthread_condattr_destroy(&attr);
@@ -33,7 +33,14 @@
  *           - Minimizes solar radiation effects on temperature measurement
  *           - 12 VDC fan operation
  *
- * Mods:
+ * Mods:     14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 A data file of wxstate://NAME answers RDD from the shared
+ *                      weather state, see wxstate/.
  *
  */
 
@@ -51,14 +58,16 @@
 #include <time.h>
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B19200	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 // Shared state
 volatile sig_atomic_t terminate = 0;
@@ -67,7 +76,6 @@ volatile sig_atomic_t kill_flag = 0;
 int serial_fd = -1;
 
 /* Synchronization primitives */
-static pthread_mutex_t file_mutex  = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 
 pthread_t sig_thread, recv_thread;
 
@@ -100,11 +108,11 @@ void cleanup_and_exit(int exit_code) {
         sig_thread = 0;
     }
 
-    pthread_mutex_destroy(&file_mutex);
 
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -154,14 +162,12 @@ CommandType parse_command(const char* buf) {
  * Notes:
  */
 void handle_command(CommandType cmd) {
-    char *resp_copy = NULL;
+    char resp_copy[REPLAY_LINE_MAX];
 
     switch (cmd) {
         case CMD_RDD:
-            resp_copy = get_next_line_copy(file_ptr, &file_mutex);
-            if (resp_copy) {
+            if (replay_next_line(replay_src, resp_copy, sizeof(resp_copy)) > 0) {
                 safe_serial_write(serial_fd, "%s\r\n", resp_copy);
-                free(resp_copy);
             } else {
                 safe_console_error("ERR: Empty file\r\n");
             }
@@ -207,10 +213,33 @@ void* signal_thread(void* arg) {
 }
 
 
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command().
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    CommandType cmd_type = parse_command(line);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    handle_command(cmd_type);
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -223,29 +252,9 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[256];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0';
-				    handle_command(parse_command(line));
-                    len = 0;
-                }
-            } else if (len < sizeof(line)-1) {
-                line[len++] = c;
-            } else len = 0;
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available, avoid busy loop
-            usleep(10000);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
@@ -274,18 +283,20 @@ void* receiver_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--capture PATH]\n", argv[0]);
         cleanup_and_exit(1);
     }
 
     file_path = argv[1]; // gets the supplied file path
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
         cleanup_and_exit(1);
     }
+    replay_set_sensor(replay_src, "rh_temp"); // Names the lines a wxstate:// source renders.
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -301,6 +312,10 @@ int main(int argc, char *argv[]) {
 		cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
 	// Block signals in main (inherited by all threads)
 	sigset_t block_set;
 	sigemptyset(&block_set);
@@ -308,6 +323,8 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
+	if (capture_start(&capture_opts, argv[0]) != 0) cleanup_and_exit(1);
 
 	// Then create signal thread
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
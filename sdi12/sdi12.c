@@ -0,0 +1,481 @@
+/*
+ * File:     sdi12.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Emulates one or more SDI-12 sensors sharing a bus, on an SDI-12 USB
+ *           adaptor (7E1 @ 1200 baud). This program sets up a serial connection
+ *           with one thread:
+ *            - Receiver thread: runs the SDI-12 engine (sdi12_utils.c), which
+ *              wakes on breaks, answers each address inside the 15 ms window
+ *              and sends the service request when an M measurement is done.
+ *
+ *           Supported commands, for every address a on the bus:
+ *             a!  ?!  aI!  aAb!        acknowledge, query, identify, change address
+ *             aM! aMC! aM1!-aM9!       measurement, service request when ready
+ *             aC! aCC! aC1!-aC9!       concurrent measurement, several addresses at once
+ *             aD0!-aD9!                send data
+ *             aR0!-aR9! aRC0!-aRC9!    continuous measurement
+ *             aV!                      verify
+ *           A C after the letter asks for a CRC on the data replies.
+ *
+ * Usage:    sdi12 <data_file> [serial_device] [--addresses LIST] [--measure-seconds N] [--awake]
+ *                 [--metrics PATH] [--capture PATH]
+ *           sdi12 ./data_files/sdi12/sdi12_data.txt /dev/ttyUSB8
+ *           sdi12 ./data_files/sdi12/sdi12_data.txt pty:/tmp/sdi12 --awake
+ *
+ *           Each data file line is an address and that sensor's values, as
+ *             0 +21.4 +63.2 +1013.25
+ *           A line that starts with a value belongs to every sensor. Each sensor
+ *           steps through its own lines, one per measurement, wrapping at the end.
+ *           --addresses lists the sensors on the bus (e.g. 0,1,A), the default is
+ *           every address in the data file. --measure-seconds is the ttt of the M
+ *           and C replies, default MEASURE_SECONDS. --awake answers commands with
+ *           no break first, for a pty or tcp:// host, which cannot send one.
+ *
+ * Sensor:   Generic SDI-12 v1.4 sensor
+ *           - Half duplex, 1200 baud, 7 data bits, even parity, 1 stop bit
+ *           - Wakes on a 12 ms break, sleeps after 100 ms of marking
+ *           - Up to 9 values per M measurement, 20 per C or R measurement
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ctype.h>
+#include "serial_utils.h"
+#include "console_utils.h"
+#include "replay_utils.h"
+#include "sdi12_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+
+#define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main takes an argument for a new location
+#define MEASURE_SECONDS 1            // ttt of the M and C replies unless --measure-seconds is given
+#define DEFAULT_ADDRESS '0'          // The bus when the data file names no address
+#define IDENT_VENDOR "WXSENSOR"      // aI! fields, 8, 6 and 3 characters
+#define IDENT_MODEL "SDI12E"
+#define IDENT_VERSION "100"
+
+// One emulated sensor's share of the data file.
+typedef struct {
+    char file_address;               // Address its lines carry, kept when aAb! moves the sensor.
+    ReplaySource *src;
+} SensorData;
+
+typedef struct {
+    char addresses[SDI12_MAX_SENSORS + 1]; // --addresses, "" for those in the data file.
+    unsigned measure_s;
+    bool awake;
+} Sdi12Options;
+
+SensorData sensor_data[SDI12_MAX_SENSORS];
+int sensor_data_count = 0;
+char *file_path = NULL; // path to file
+
+// Shared state
+volatile sig_atomic_t terminate = 0;
+volatile sig_atomic_t kill_flag = 0;
+
+int serial_fd = -1;
+static Sdi12Bus bus = SDI12_BUS_INITIALIZER;
+const char *program_name = "sdi12";
+
+pthread_t sig_thread, recv_thread;
+bool sig_thread_created = false;
+bool recv_thread_created = false;
+
+
+/*
+ * Name:         cleanup_and_exit
+ * Purpose:      helper function to cleanup the bus, data sources and serial device.
+ * Arguments:    exit_code, the exit code to send on close.
+ *
+ * Output:       The bus report once the receiver has run.
+ * Modifies:     Closes the replay sources, the timer and the serial device.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+void cleanup_and_exit(int exit_code) {
+    terminate = 1;
+    if (recv_thread_created) {
+        pthread_join(recv_thread, NULL);
+        recv_thread_created = false;
+        sdi12_bus_report(&bus, program_name);
+    }
+    if (sig_thread_created) {
+        pthread_cancel(sig_thread);
+        pthread_join(sig_thread, NULL);
+        sig_thread_created = false;
+    }
+
+    // Close resources
+    sdi12_bus_close(&bus);
+    if (serial_fd >= 0) close_serial_port(serial_fd);
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay sources it watches.
+    for (int i = 0; i < sensor_data_count; i++) {
+        if (sensor_data[i].src) replay_close(sensor_data[i].src);
+    }
+
+    // Cleanup utilities
+    console_cleanup();
+    serial_utils_cleanup();
+    exit(exit_code);
+}
+
+// ---------------- Data file ----------------
+
+/*
+ * Name:         line_address
+ * Purpose:      Tells which sensor a data file line is for.
+ * Arguments:    line: the line, NUL terminated.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The address the line starts with, '\0' for a line of values for any sensor.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        An address is a single character followed by white space, a value
+ *               always starts with a sign or a digit and runs on.
+ */
+static char line_address(const char *line) {
+    while (*line == ' ' || *line == '\t') line++;
+    if (sdi12_valid_address(line[0]) && (line[1] == ' ' || line[1] == '\t' || line[1] == '\0')) return line[0];
+    return '\0';
+}
+
+/*
+ * Name:         format_value
+ * Purpose:      Writes a data file value the way SDI-12 sends it, with its sign.
+ * Arguments:    token: the value as written in the file.
+ *               out: receives it, SDI12_VALUE_LEN long.
+ *
+ * Output:       None.
+ * Modifies:     out.
+ * Returns:      true if token is a number that fits the 9 characters a value may take.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The file's own digits are kept, so the precision is the recorded one.
+ */
+static bool format_value(const char *token, char *out) {
+    char *end = NULL;
+    strtod(token, &end);
+    if (end == token || *end != '\0' || strpbrk(token, "eEnNiI")) return false; // No exponents, NaN or inf on SDI-12.
+    int n = snprintf(out, SDI12_VALUE_LEN, "%s%s", (token[0] == '+' || token[0] == '-') ? "" : "+", token);
+    return n > 0 && n < SDI12_VALUE_LEN;
+}
+
+/*
+ * Name:         measure_sensor
+ * Purpose:      Sdi12MeasureFn for every sensor: the sensor's next line of values.
+ * Arguments:    ctx: the sensor's SensorData.
+ *               address: its current address, unused, lines follow file_address.
+ *               r: receives the values.
+ *
+ * Output:       A console error for a value that cannot be sent.
+ * Modifies:     r, the sensor's replay position.
+ * Returns:      0, or -1 if the data file holds no line for the sensor.
+ * Assumptions:  Called on the receiver thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        At most one full pass of the file is made looking for a line.
+ */
+static int measure_sensor(void *ctx, char address, Sdi12Reading *r) {
+    (void)address;
+    SensorData *d = ctx;
+    size_t lines = replay_line_count(d->src);
+    char line[REPLAY_LINE_MAX];
+
+    for (size_t tries = 0; tries < lines; tries++) {
+        if (replay_next_line(d->src, line, sizeof(line)) == 0) return -1;
+        char a = line_address(line);
+        if (a != '\0' && a != d->file_address) continue;
+
+        char *save = NULL;
+        char *tok = strtok_r(line, " \t,", &save);
+        if (a != '\0') tok = strtok_r(NULL, " \t,", &save); // Past the address.
+        r->count = 0;
+        for (; tok && r->count < SDI12_MAX_VALUES; tok = strtok_r(NULL, " \t,", &save)) {
+            if (format_value(tok, r->values[r->count])) r->count++;
+            else safe_console_error("Skipping value '%s' for sensor %c, not a number of 9 characters or less\n", tok, d->file_address);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Name:         file_addresses
+ * Purpose:      Collects the addresses the data file has lines for, in order of first use.
+ * Arguments:    src: the data file.
+ *               out: receives them, SDI12_MAX_SENSORS + 1 long, NUL terminated.
+ *
+ * Output:       None.
+ * Modifies:     out, the replay position of src (back at the first line after a full pass).
+ * Returns:      None.
+ * Assumptions:  src is a mapped text file.
+ *
+ * Bugs:         None known.
+ * Notes:        out is left empty for a file with no addressed lines.
+ */
+static void file_addresses(ReplaySource *src, char *out) {
+    size_t lines = replay_line_count(src);
+    size_t n = 0;
+    char line[REPLAY_LINE_MAX];
+    for (size_t i = 0; i < lines; i++) {
+        if (replay_next_line(src, line, sizeof(line)) == 0) continue;
+        char a = line_address(line);
+        if (a != '\0' && !memchr(out, a, n) && n < SDI12_MAX_SENSORS) out[n++] = a;
+    }
+    out[n] = '\0';
+}
+
+// ---------------- Options ----------------
+
+/*
+ * Name:         parse_sdi12_options
+ * Purpose:      Takes --addresses, --measure-seconds and --awake off the command line.
+ * Arguments:    argc: the argument count, reduced by the arguments taken.
+ * 				 argv: the arguments, the rest are kept in order.
+ * 				 opts: receives the options.
+ *
+ * Output:       Error message to stderr on a bad value.
+ * Modifies:     argc, argv, opts.
+ * Returns:      0 on success, -1 on a bad address list or time.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors replay_parse_options(). Commas and spaces in the address list are ignored.
+ */
+static int parse_sdi12_options(int *argc, char **argv, Sdi12Options *opts) {
+    opts->addresses[0] = '\0';
+    opts->measure_s = MEASURE_SECONDS;
+    opts->awake = false;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *value = NULL;
+        bool addresses = false;
+        if (strcmp(argv[i], "--awake") == 0) {
+            opts->awake = true;
+            continue;
+        } else if (strncmp(argv[i], "--addresses=", 12) == 0) {
+            value = argv[i] + 12;
+            addresses = true;
+        } else if (strcmp(argv[i], "--addresses") == 0 && i + 1 < *argc) {
+            value = argv[++i];
+            addresses = true;
+        } else if (strncmp(argv[i], "--measure-seconds=", 18) == 0) {
+            value = argv[i] + 18;
+        } else if (strcmp(argv[i], "--measure-seconds") == 0 && i + 1 < *argc) {
+            value = argv[++i];
+        } else {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        if (addresses) {
+            size_t n = 0;
+            for (const char *p = value; *p; p++) {
+                if (*p == ',' || *p == ' ') continue;
+                if (!sdi12_valid_address(*p) || memchr(opts->addresses, *p, n) || n >= SDI12_MAX_SENSORS) {
+                    fprintf(stderr, "Invalid --addresses '%s': use distinct addresses 0-9, A-Z or a-z\n", value);
+                    return -1;
+                }
+                opts->addresses[n++] = *p;
+            }
+            opts->addresses[n] = '\0';
+        } else {
+            char *end = NULL;
+            long s = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || s < 0 || s > 999) {
+                fprintf(stderr, "Invalid --measure-seconds '%s': use 0 to 999\n", value);
+                return -1;
+            }
+            opts->measure_s = (unsigned)s;
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+// ---------------- Threads ----------------
+
+/*
+ * Name:         signal_thread
+ * Purpose:      Captures any kill signals, and sets volitile bool 'terminate' and 'kill_flag' to true,
+ *				 allowing the engine loop to return, and threads to join.
+ * Arguments:    None
+ *
+ * Output:       None.
+ * Modifies:     Changes terminate to true.
+ * Returns:      None.
+ * Assumptions:  Terminate is set to false.
+ *
+ * Bugs:         None known.
+ * Notes:        The engine sees terminate within SERIAL_POLL_MS.
+ */
+void* signal_thread(void* arg) {
+    (void)arg;
+    int sig;
+    sigset_t wait_set;
+    sigemptyset(&wait_set);
+    sigaddset(&wait_set, SIGINT);
+    sigaddset(&wait_set, SIGTERM);
+    sigaddset(&wait_set, SIGQUIT); // Ctrl+backslash
+
+    sigwait(&wait_set, &sig);     // Blocks until a signal arrives
+
+    terminate = 1;
+    kill_flag = 1;
+
+    return NULL;
+}
+
+/*
+ * Name:         receiver_thread
+ * Purpose:      thread which serves the bus with sdi12_bus_run() until terminate is set.
+ * Arguments:    arg: thread arguments.
+ *
+ * Output:       Replies and service requests on the serial port.
+ * Modifies:     bus.
+ * Returns:      NULL.
+ * Assumptions:  The sensors have been added to bus.
+ *
+ * Bugs:         None known.
+ * Notes:        Receiving, timing and sending are all on this thread, nothing
+ *               queues between a command and its reply.
+ */
+void* receiver_thread(void* arg) {
+    (void)arg;
+    sdi12_bus_run(&bus, &terminate);
+    return NULL;
+}
+
+/*
+ * Name:         Main
+ * Purpose:      Main function, which opens the SDI-12 bus, puts a sensor on it for each address and starts the
+ *               receiver thread that serves them.
+ *               i.e. sdi12 <file_path> [serial_device] [--addresses LIST] [--measure-seconds N] [--awake]
+ *
+ * Arguments:    file_path: The location of the file we want to read values from.
+ *               device: the serial device, matching ^/dev/tty(S|USB|ACM)[0-9]+$ or a transport name,
+ *               tested with is_valid_tty().
+ *
+ * Output:       Prints to stderr the appropriate error messages if encountered.
+ * Modifies:     None.
+ * Returns:      Returns an int 0 representing success once the program closes the fd, and joins the threads,
+ *               or 1 on a setup failure.
+ * Assumptions:  The adaptor passes breaks through, as SDI-12 USB adaptors do.
+ *
+ * Bugs:         None known.
+ * Notes:        The port is always 7E1 at 1200 baud, there is no baud rate or mode argument.
+ */
+int main(int argc, char *argv[]) {
+
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+    Sdi12Options opts;
+    if (parse_sdi12_options(&argc, argv, &opts) != 0) cleanup_and_exit(1);
+
+    if (argc < 2) {
+        safe_console_error("Usage: %s <file_path> [serial_device] [--addresses LIST] [--measure-seconds N] [--awake] "
+                           "[--metrics PATH] [--capture PATH]\n", argv[0]);
+        cleanup_and_exit(1);
+    }
+    program_name = argv[0];
+    file_path = argv[1];
+
+    // The first sensor's source also finds the default addresses.
+    if (replay_open(&sensor_data[0].src, file_path) != 0) {
+        safe_console_error("Failed to open file: %s\n", strerror(errno));
+        cleanup_and_exit(1);
+    }
+    sensor_data_count = 1;
+    if (!replay_is_mapped(sensor_data[0].src) || replay_is_binary(sensor_data[0].src)) {
+        safe_console_error("%s must be a text file, each sensor reads it at its own pace\n", file_path);
+        cleanup_and_exit(1);
+    }
+    if (opts.addresses[0] == '\0') file_addresses(sensor_data[0].src, opts.addresses);
+    if (opts.addresses[0] == '\0') {
+        opts.addresses[0] = DEFAULT_ADDRESS;
+        opts.addresses[1] = '\0';
+    }
+
+    const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
+    serial_fd = open_serial_port(device, B1200, SERIAL_SDI12);
+    if (serial_fd < 0) {
+        cleanup_and_exit(1);
+    }
+    if (sdi12_bus_init(&bus, serial_fd, opts.awake) != 0) cleanup_and_exit(1);
+
+    for (int i = 0; opts.addresses[i]; i++) {
+        SensorData *d = &sensor_data[i];
+        d->file_address = opts.addresses[i];
+        if (i > 0) {
+            if (replay_open(&d->src, file_path) != 0) {
+                safe_console_error("Failed to open file: %s\n", strerror(errno));
+                cleanup_and_exit(1);
+            }
+            sensor_data_count = i + 1;
+        }
+        char ident[SDI12_IDENT_LEN];
+        snprintf(ident, sizeof(ident), "%s%s%sSN%06d", IDENT_VENDOR, IDENT_MODEL, IDENT_VERSION, 100 + i);
+        if (sdi12_bus_add(&bus, d->file_address, ident, opts.measure_s, measure_sensor, d) != 0) cleanup_and_exit(1);
+    }
+
+	sigset_t block_set;
+	sigemptyset(&block_set);
+	sigaddset(&block_set, SIGINT);
+	sigaddset(&block_set, SIGTERM);
+	sigaddset(&block_set, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	for (int i = 0; i < sensor_data_count; i++) {
+		if (replay_watch(sensor_data[i].src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
+	}
+
+	if (metrics_start(&metrics_opts, argv[0]) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, argv[0]) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(sensor_data[0].src);
+
+	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
+        perror("Failed to create signal thread");
+        terminate = 1;
+		cleanup_and_exit(1);
+	} else sig_thread_created = true;
+
+    if (pthread_create(&recv_thread, NULL, receiver_thread, NULL) != 0) {
+        perror("Failed to create receiver thread");
+        terminate = 1;
+		cleanup_and_exit(1);
+	} else recv_thread_created = true;
+
+    safe_console_print("SDI-12 sensors at %s, %u s measurements%s\n", opts.addresses, opts.measure_s,
+                       opts.awake ? ", always awake" : "");
+    safe_console_print("Press 'ctrl-c' to quit.\n");
+
+	pthread_join(sig_thread, NULL); // Wait until the signal handle thread joins.
+	sig_thread_created = false;
+    safe_console_print("Program terminated.\n");
+	cleanup_and_exit(0);
+    return 0;
+}
@@ -6,19 +6,40 @@
  * Purpose:  GTK 3 GUI application to control wxsensors emulator programs.
  *           Provides start/stop buttons, status LEDs, and flag entry for each sensor.
  *
- * Compile:  gcc -o sensor_control sensor_control.c $(pkg-config --cflags --libs gtk+-3.0) -Wall -Wextra
+ * Compile:  gcc -Iinclude -o sensor_control sensor_control.c common/agent_utils.c $(pkg-config --cflags --libs gtk+-3.0) -Wall -Wextra
  *
- * Usage:    ./sensor_control
+ * Usage:    ./sensor_control [config_file]
+ *
+ * Mods:     14/10/2026 Sensors are read from a key file (sensor_control/sensor_control.conf
+ *                      by default) with no fixed limit, children are supervised with
+ *                      g_child_watch_add() instead of a 1 s waitpid() poll per sensor,
+ *                      their stdout/stderr go to a bounded log view through
+ *                      non-blocking pipes, and a crashed sensor can restart with backoff.
+ *           14/10/2026 A Reload button sends a running sensor SIGHUP, which reloads
+ *                      its data file without a restart.
+ *           14/10/2026 A sensor with node= runs under the wxagent on that node, over
+ *                      one connection per node with pipelined requests and batched
+ *                      status, see agent_utils.h. Push Data copies data files to
+ *                      their nodes.
+ *           14/10/2026 A [node:] group's token_file= gives the token its wxagent
+ *                      needs in the hello.
  */
 
 #include <gtk/gtk.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "agent_utils.h"
 
 /* AddressSanitizer suppression for GTK/GLib internal leaks.
  * This function is automatically called by the LeakSanitizer at startup.
@@ -36,52 +57,125 @@ extern const char* __lsan_default_suppressions() {
 #endif
 
 
-#define MAX_SENSORS 10
 #define MAX_PATH_LEN 256
-#define MAX_FLAGS_LEN 512
-#define MAX_WINDOW_WIDTH 950
+#define MAX_WINDOW_WIDTH 1100
 #define MAX_WINDOW_HEIGHT 650
-
-// Sensor definition structure
+#define DEFAULT_CONFIG "sensor_control/sensor_control.conf"
+
+#define LOG_MAX_LINES 500          // Per sensor, older lines are dropped.
+#define LOG_READ_CHUNK 4096
+#define RESTART_MIN_MS 1000        // First restart delay after a crash.
+#define RESTART_MAX_MS 60000       // The delay doubles up to this.
+#define RESTART_STABLE_US (30 * G_USEC_PER_SEC) // A run this long resets the delay.
+#define STOP_KILL_MS 3000          // SIGKILL a sensor that has not exited this long after SIGTERM.
+#define NODE_GROUP_PREFIX "node:"  // Config groups naming a wxagent node rather than a sensor.
+#define NODE_RETRY_MS 2000         // Time between connection attempts to a node.
+
+// Sensor definition structure, one group of the config file.
 typedef struct {
-    const char *name;
-    const char *display_name;
-    const char *default_flags;
+    gchar *name;                   // Group name, unique.
+    gchar *program;                // Executable in ./bin/<program>/<program>, or a path.
+    gchar *display_name;
+    gchar *default_flags;
+    gboolean restart;              // Restart after a crash.
+    gchar *node;                   // The wxagent node it runs on, NULL to run it here.
 } SensorDef;
 
+// What the LED shows.
+typedef enum {
+    SENSOR_STOPPED,                // Never started, or stopped from the panel.
+    SENSOR_RUNNING,
+    SENSOR_RESTARTING,             // Crashed, waiting out the backoff.
+    SENSOR_FAILED,                 // Exited on its own and will not restart.
+    SENSOR_OFFLINE                 // On a node that is not connected.
+} SensorStatus;
+
+// A node running wxagent, one [node:NAME] group of the config file.
+typedef struct {
+    gchar *name;
+    gchar *address;                // host[:port], port AGENT_PORT by default.
+    gchar *token;                  // Sent in the hello, NULL for an agent without --token-file.
+    GSocketClient *connector;
+    GSocketConnection *connection; // NULL when not connected.
+    gint fd;                       // The connection's socket, -1 when not connected.
+    gboolean connecting;
+    gboolean reported;             // A failed connection was printed, quiet until one succeeds.
+    guint in_watch_id;
+    guint out_watch_id;
+    guint flush_id;                // Idle flush of the requests queued this main loop pass.
+    guint retry_id;
+    AgentBuffer in;
+    AgentBuffer out;
+    guint next_tag;
+    GQueue *pending;               // NodeRequest *, oldest first, the replies come in order.
+} NodeState;
+
 // Runtime sensor state structure
 typedef struct {
-    SensorDef *def;
+    SensorDef def;
     GtkWidget *led_area;
     GtkWidget *flags_entry;
+    GtkWidget *restart_check;
     GtkWidget *start_button;
     GtkWidget *stop_button;
-    pid_t pid;
-    gboolean running;
-    guint timeout_id;
+    GtkWidget *reload_button;
+    GtkTextBuffer *log;
+    GtkTextMark *log_end;
+    GPid pid;
+    SensorStatus status;
+    gboolean stopping;             // Stop was asked for, the exit is not a crash.
+    guint child_watch_id;
+    gint out_fd;                   // Read ends of the child's stdout and stderr, -1 when closed.
+    gint err_fd;
+    guint out_watch_id;
+    guint err_watch_id;
+    guint restart_id;
+    guint kill_id;
+    guint backoff_ms;
+    gint64 started_us;
+    NodeState *node;               // The node it runs on, NULL for a local sensor.
+    GtkWidget *node_label;
+    gint remote_pid;               // From the node's sensor events.
 } SensorState;
 
-// Global sensor definitions *** Make all changes and additions here, the code will handle the rest.
-// {<NAME_OF_EXECUTABLE>, <GUI_SENSOR_LABEL>, <FLAGS_PROVIDED_TO_SENSOR>}
-static SensorDef sensor_defs[] = {
-    {"wind",        "Gill WindObserver 75",     "./data_files/wind/wind_data_P.txt /dev/ttyUSB0 9600 RS485"},
-    {"rh_temp",     "Rotronic HC2A-S3",         "./data_files/rh_temp/rh_temp_data.txt /dev/ttyUSB1 9600 RS485"},
-    {"pres_weather","Campbell AtmosVue30",      "./data_files/pres_weather/pres_weather.txt /dev/ttyUSB2 38400 RS232"},
-    {"dsp8100",  	"Barometric Sensor",        "./data_files/barometric/barometric_data.txt /dev/ttyUSB3 9600 RS485"},
-    {"ceilometer",  "Ceilometer",               "./data_files/ceilometer/ceil_data.txt /dev/ttyUSB4 115200 RS232"},
-    {"btd300",      "Biral BTD-300",            "./data_files/flash/flash_data.txt /dev/ttyUSB5 9600 RS422"},
-    {"ice",         "Goodrich 0872F1",          "./data_files/ice/ice_data.txt /dev/ttyUSB6 2400 RS232"},
-    {"rain",        "Campbell CS700H",          "./data_files/rain/rain_data.txt /dev/ttyUSB7 1200 SDI-12"},
-    {NULL, NULL, NULL}
+// A request sent to a node and not yet answered.
+typedef struct {
+    guint tag;
+    gchar *verb;
+    SensorState *sensor;           // The sensor it is about, NULL for hello.
+} NodeRequest;
+
+// Built-in sensor list, used when no config file is found.
+// {<GROUP>, <NAME_OF_EXECUTABLE>, <GUI_SENSOR_LABEL>, <FLAGS_PROVIDED_TO_SENSOR>, <RESTART>}
+static const SensorDef default_defs[] = {
+    {"wind",        "wind",         "Gill WindObserver 75",     "./data_files/wind/wind_data_P.txt /dev/ttyUSB0 9600 RS485", FALSE, NULL},
+    {"rh_temp",     "rh_temp",      "Rotronic HC2A-S3",         "./data_files/rh_temp/rh_temp_data.txt /dev/ttyUSB1 9600 RS485", FALSE, NULL},
+    {"pres_weather","pres_weather", "Campbell AtmosVue30",      "./data_files/pres_weather/pres_weather.txt /dev/ttyUSB2 38400 RS232", FALSE, NULL},
+    {"dsp8100",     "dsp8100",      "Barometric Sensor",        "./data_files/barometric/barometric_data.txt /dev/ttyUSB3 9600 RS485", FALSE, NULL},
+    {"ceilometer",  "ceilometer",   "Ceilometer",               "./data_files/ceilometer/ceil_data.txt /dev/ttyUSB4 115200 RS232", FALSE, NULL},
+    {"btd300",      "btd300",       "Biral BTD-300",            "./data_files/flash/flash_data.txt /dev/ttyUSB5 9600 RS422", FALSE, NULL},
+    {"ice",         "ice",          "Goodrich 0872F1",          "./data_files/ice/ice_data.txt /dev/ttyUSB6 2400 RS232", FALSE, NULL},
+    {"rain",        "rain",         "Campbell CS700H",          "./data_files/rain/rain_data.txt /dev/ttyUSB7 1200 SDI-12", FALSE, NULL},
 };
 
-// Global array of sensor states
-static SensorState sensors[MAX_SENSORS];
-static int num_sensors = 0;
+// Every sensor row, SensorState *.
+static GPtrArray *sensors = NULL;
+
+// Every wxagent node, NodeState *.
+static GPtrArray *nodes = NULL;
+
+// The log pane, showing one sensor's buffer at a time.
+static GtkWidget *log_view = NULL;
+static GtkWidget *log_title = NULL;
+static SensorState *log_sensor = NULL;
+
+static gboolean start_sensor(SensorState *sensor, GError **error);
+static gboolean on_node_writable(gint fd, GIOCondition condition, gpointer data);
 
 /*
  * Name:         draw_led
- * Purpose:      Draw the status LED circle (green=running, red=stopped)
+ * Purpose:      Draw the status LED circle (green=running, amber=restarting, red=stopped or failed,
+ *               grey=node not connected)
  */
 static gboolean draw_led(GtkWidget *widget, cairo_t *cr, gpointer data) {
     SensorState *sensor = (SensorState *)data;
@@ -97,10 +191,22 @@ static gboolean draw_led(GtkWidget *widget, cairo_t *cr, gpointer data) {
     // Draw filled circle
     cairo_arc(cr, center_x, center_y, radius, 0, 2 * G_PI);
 
-    if (sensor->running) {
-        cairo_set_source_rgb(cr, 0.2, 0.8, 0.2);  // Green
-    } else {
-        cairo_set_source_rgb(cr, 0.8, 0.2, 0.2);  // Red
+    switch (sensor->status) {
+        case SENSOR_RUNNING:
+            cairo_set_source_rgb(cr, 0.2, 0.8, 0.2);  // Green
+            break;
+        case SENSOR_RESTARTING:
+            cairo_set_source_rgb(cr, 0.95, 0.65, 0.1); // Amber
+            break;
+        case SENSOR_FAILED:
+            cairo_set_source_rgb(cr, 0.55, 0.0, 0.0);  // Dark red
+            break;
+        case SENSOR_OFFLINE:
+            cairo_set_source_rgb(cr, 0.6, 0.6, 0.6);   // Grey
+            break;
+        default:
+            cairo_set_source_rgb(cr, 0.8, 0.2, 0.2);  // Red
+            break;
     }
     cairo_fill_preserve(cr);
 
@@ -113,35 +219,628 @@ static gboolean draw_led(GtkWidget *widget, cairo_t *cr, gpointer data) {
 }
 
 /*
- * Name:         check_process
- * Purpose:      Periodically check if the sensor process is still running
+ * Name:         update_controls
+ * Purpose:      Bring the LED and buttons of a row in line with its status
+ */
+static void update_controls(SensorState *sensor) {
+    gboolean live = sensor->status == SENSOR_RUNNING || sensor->status == SENSOR_RESTARTING;
+
+    gtk_widget_queue_draw(sensor->led_area);
+    gtk_widget_set_sensitive(sensor->start_button, !live && sensor->status != SENSOR_OFFLINE);
+    gtk_widget_set_sensitive(sensor->stop_button, live && !sensor->stopping);
+    gtk_widget_set_sensitive(sensor->reload_button, sensor->status == SENSOR_RUNNING && !sensor->stopping);
+    gtk_widget_set_sensitive(sensor->flags_entry, !live);
+}
+
+/*
+ * Name:         log_append
+ * Purpose:      Add text to a sensor's log, dropping the oldest lines past LOG_MAX_LINES
+ */
+static void log_append(SensorState *sensor, const char *text, gssize len, const char *tag) {
+    GtkTextIter end;
+    gchar *valid = g_utf8_make_valid(text, len); // Emulators print raw sensor bytes.
+
+    gtk_text_buffer_get_end_iter(sensor->log, &end);
+    if (tag) {
+        gtk_text_buffer_insert_with_tags_by_name(sensor->log, &end, valid, -1, tag, NULL);
+    } else {
+        gtk_text_buffer_insert(sensor->log, &end, valid, -1);
+    }
+    g_free(valid);
+
+    gint excess = gtk_text_buffer_get_line_count(sensor->log) - LOG_MAX_LINES;
+    if (excess > 0) {
+        GtkTextIter start, cut;
+        gtk_text_buffer_get_start_iter(sensor->log, &start);
+        gtk_text_buffer_get_iter_at_line(sensor->log, &cut, excess);
+        gtk_text_buffer_delete(sensor->log, &start, &cut);
+    }
+
+    if (log_sensor == sensor) {
+        gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(log_view), sensor->log_end);
+    }
+}
+
+/*
+ * Name:         log_note
+ * Purpose:      Add a line from the panel itself to a sensor's log
+ */
+static void log_note(SensorState *sensor, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
+static void log_note(SensorState *sensor, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    gchar *msg = g_strdup_vprintf(fmt, args);
+    va_end(args);
+
+    gchar *line = g_strdup_printf("[sensor_control] %s\n", msg);
+    log_append(sensor, line, -1, "note");
+    g_free(line);
+    g_free(msg);
+}
+
+/*
+ * Name:         on_child_output
+ * Purpose:      Drain a child's stdout or stderr pipe into its log without blocking
+ */
+static gboolean on_child_output(gint fd, GIOCondition condition, gpointer data) {
+    SensorState *sensor = (SensorState *)data;
+    gboolean is_err = fd == sensor->err_fd;
+    char buf[LOG_READ_CHUNK];
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            log_append(sensor, buf, n, is_err ? "stderr" : NULL);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return G_SOURCE_CONTINUE;
+        break; // EOF or a read error, the child has closed its end.
+    }
+
+    (void)condition;
+    close(fd);
+    if (is_err) {
+        sensor->err_fd = -1;
+        sensor->err_watch_id = 0;
+    } else {
+        sensor->out_fd = -1;
+        sensor->out_watch_id = 0;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Name:         watch_pipe
+ * Purpose:      Make a child's pipe non-blocking and read it from the main loop
+ */
+static guint watch_pipe(SensorState *sensor, gint fd) {
+    g_unix_set_fd_nonblocking(fd, TRUE, NULL);
+    return g_unix_fd_add(fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_child_output, sensor);
+}
+
+/*
+ * Name:         close_pipes
+ * Purpose:      Drop the pipe watches left from a previous run
  */
-static gboolean check_process(gpointer data) {
+static void close_pipes(SensorState *sensor) {
+    // Something the sensor started may still hold the write ends.
+    if (sensor->out_watch_id) g_source_remove(sensor->out_watch_id);
+    if (sensor->err_watch_id) g_source_remove(sensor->err_watch_id);
+    if (sensor->out_fd >= 0) close(sensor->out_fd);
+    if (sensor->err_fd >= 0) close(sensor->err_fd);
+    sensor->out_watch_id = sensor->err_watch_id = 0;
+    sensor->out_fd = sensor->err_fd = -1;
+}
+
+/*
+ * Name:         on_restart_timeout
+ * Purpose:      Restart a crashed sensor once its backoff has run
+ */
+static gboolean on_restart_timeout(gpointer data) {
     SensorState *sensor = (SensorState *)data;
-    int status;
-    pid_t result;
+    GError *error = NULL;
+
+    sensor->restart_id = 0;
+    if (!start_sensor(sensor, &error)) {
+        log_note(sensor, "restart failed: %s", error->message);
+        g_error_free(error);
+        sensor->status = SENSOR_RESTARTING;
+        sensor->restart_id = g_timeout_add(sensor->backoff_ms, on_restart_timeout, sensor);
+        sensor->backoff_ms = MIN(sensor->backoff_ms * 2, RESTART_MAX_MS);
+    }
+    update_controls(sensor);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Name:         on_child_exit
+ * Purpose:      Child watch callback, runs as soon as the sensor process exits
+ */
+static void on_child_exit(GPid pid, gint wait_status, gpointer data) {
+    SensorState *sensor = (SensorState *)data;
+    gboolean clean = WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0;
+
+    g_spawn_close_pid(pid);
+    sensor->pid = 0;
+    sensor->child_watch_id = 0;
+    if (sensor->kill_id) {
+        g_source_remove(sensor->kill_id);
+        sensor->kill_id = 0;
+    }
+
+    if (WIFSIGNALED(wait_status)) {
+        log_note(sensor, "%s killed by signal %d (%s)", sensor->def.name, WTERMSIG(wait_status), strsignal(WTERMSIG(wait_status)));
+    } else {
+        log_note(sensor, "%s exited with status %d", sensor->def.name, WEXITSTATUS(wait_status));
+    }
+
+    if (sensor->stopping) {
+        sensor->status = SENSOR_STOPPED;
+    } else if (!clean && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(sensor->restart_check))) {
+        if (g_get_monotonic_time() - sensor->started_us >= RESTART_STABLE_US) sensor->backoff_ms = RESTART_MIN_MS;
+        log_note(sensor, "restarting in %.1f s", sensor->backoff_ms / 1000.0);
+        sensor->status = SENSOR_RESTARTING;
+        sensor->restart_id = g_timeout_add(sensor->backoff_ms, on_restart_timeout, sensor);
+        sensor->backoff_ms = MIN(sensor->backoff_ms * 2, RESTART_MAX_MS);
+    } else {
+        sensor->status = clean ? SENSOR_STOPPED : SENSOR_FAILED;
+    }
+    sensor->stopping = FALSE;
+    update_controls(sensor);
+}
+
+/*
+ * Name:         child_setup
+ * Purpose:      Runs in the child before exec, gives it its own process group
+ */
+static void child_setup(gpointer data) {
+    (void)data;
+    setsid(); // So stop can signal the sensor and anything it starts.
+}
+
+/*
+ * Name:         start_sensor
+ * Purpose:      Spawn the sensor process with its output piped to the log
+ */
+static gboolean start_sensor(SensorState *sensor, GError **error) {
+    const gchar *flags;
+    char executable[MAX_PATH_LEN];
+    gchar **flag_argv = NULL;
+    gint flag_argc = 0;
+    gint out_fd = -1, err_fd = -1;
+    GPid pid;
+
+    flags = gtk_entry_get_text(GTK_ENTRY(sensor->flags_entry));
+    if (strlen(flags) == 0) {
+        g_set_error_literal(error, G_SHELL_ERROR, G_SHELL_ERROR_EMPTY_STRING,
+                            "Please enter flags (at minimum: data file path)");
+        return FALSE;
+    }
+    if (!g_shell_parse_argv(flags, &flag_argc, &flag_argv, error)) return FALSE; // Quotes work, a path may hold spaces.
+
+    // Build executable path
+    if (strchr(sensor->def.program, '/')) {
+        snprintf(executable, sizeof(executable), "%s", sensor->def.program);
+    } else {
+        snprintf(executable, sizeof(executable), "./bin/%s/%s", sensor->def.program, sensor->def.program);
+    }
+
+    gchar **args = g_new0(gchar *, (gsize)flag_argc + 2);
+    args[0] = executable;
+    for (gint i = 0; i < flag_argc; i++) args[i + 1] = flag_argv[i];
+
+    g_print("Starting: %s %s\n", executable, flags);
+    gboolean ok = g_spawn_async_with_pipes(NULL, args, NULL, G_SPAWN_DO_NOT_REAP_CHILD, child_setup, NULL,
+                                           &pid, NULL, &out_fd, &err_fd, error);
+    g_free(args);
+    g_strfreev(flag_argv);
+    if (!ok) return FALSE;
+
+    close_pipes(sensor);
+    sensor->pid = pid;
+    sensor->status = SENSOR_RUNNING;
+    sensor->stopping = FALSE;
+    sensor->started_us = g_get_monotonic_time();
+    sensor->child_watch_id = g_child_watch_add(pid, on_child_exit, sensor);
+    sensor->out_fd = out_fd;
+    sensor->err_fd = err_fd;
+    sensor->out_watch_id = watch_pipe(sensor, out_fd);
+    sensor->err_watch_id = watch_pipe(sensor, err_fd);
+    log_note(sensor, "started %s (PID: %d)", executable, pid);
+    return TRUE;
+}
+
+/*
+ * Name:         sensor_of_node
+ * Purpose:      Find a node's sensor by the name its events use
+ */
+static SensorState *sensor_of_node(NodeState *node, const char *name) {
+    for (guint i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (sensor->node == node && strcmp(sensor->def.name, name) == 0) return sensor;
+    }
+    return NULL;
+}
+
+/*
+ * Name:         node_request_free
+ * Purpose:      Free a NodeRequest, a GDestroyNotify
+ */
+static void node_request_free(gpointer data) {
+    NodeRequest *request = data;
+    g_free(request->verb);
+    g_free(request);
+}
+
+static void node_disconnect(NodeState *node, const char *why);
+
+/*
+ * Name:         node_flush
+ * Purpose:      Write the requests queued for a node, watching for G_IO_OUT while its socket is full
+ */
+static void node_flush(NodeState *node) {
+    if (node->fd < 0) return;
+    int rc = agent_buffer_flush(&node->out, node->fd);
+    if (rc < 0) {
+        node_disconnect(node, g_strerror(errno));
+        return;
+    }
+    if (rc > 0 && !node->out_watch_id) {
+        node->out_watch_id = g_unix_fd_add(node->fd, G_IO_OUT, on_node_writable, node);
+    }
+}
+
+/*
+ * Name:         on_node_writable
+ * Purpose:      Carry on writing to a node once its socket has room
+ */
+static gboolean on_node_writable(gint fd, GIOCondition condition, gpointer data) {
+    NodeState *node = (NodeState *)data;
+
+    (void)fd;
+    (void)condition;
+
+    node->out_watch_id = 0;
+    node_flush(node); // Watches again if it is still full.
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Name:         on_node_flush_idle
+ * Purpose:      Write everything queued for a node in this pass of the main loop at once
+ */
+static gboolean on_node_flush_idle(gpointer data) {
+    NodeState *node = (NodeState *)data;
+
+    node->flush_id = 0;
+    node_flush(node);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Name:         node_send
+ * Purpose:      Queue a request for a node without waiting for its reply
+ *
+ * Notes:        The write happens once the handler that queued it returns, so
+ *               Start All over a hundred sensors is one write per node, and
+ *               the replies are matched in order by on_node_input().
+ */
+static gboolean node_send(NodeState *node, SensorState *sensor, const char *verb, const char *const *args, gsize count) {
+    if (node->fd < 0) return FALSE;
+
+    const char **fields = g_new(const char *, count + 2);
+    gchar *tag = g_strdup_printf("%u", node->next_tag + 1);
+    fields[0] = tag;
+    fields[1] = verb;
+    for (gsize i = 0; i < count; i++) fields[i + 2] = args[i];
+    int rc = agent_buffer_fields(&node->out, fields, count + 2);
+    g_free(fields);
+    g_free(tag);
+    if (rc != 0) return FALSE;
+
+    NodeRequest *request = g_new0(NodeRequest, 1);
+    request->tag = ++node->next_tag;
+    request->verb = g_strdup(verb);
+    request->sensor = sensor;
+    g_queue_push_tail(node->pending, request);
+    if (!node->flush_id && !node->out_watch_id) node->flush_id = g_idle_add(on_node_flush_idle, node);
+    return TRUE;
+}
 
-    if (sensor->pid <= 0) {
+/*
+ * Name:         node_sensor_request
+ * Purpose:      Queue a request that takes only the sensor's name, start, stop or reload
+ */
+static gboolean node_sensor_request(SensorState *sensor, const char *verb) {
+    const char *name[] = { sensor->def.name };
+    return node_send(sensor->node, sensor, verb, name, 1);
+}
+
+/*
+ * Name:         node_define
+ * Purpose:      Send a remote sensor's program, flags and restart setting to its node
+ */
+static gboolean node_define(SensorState *sensor, GError **error) {
+    const gchar *flags = gtk_entry_get_text(GTK_ENTRY(sensor->flags_entry));
+    gboolean restart = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(sensor->restart_check));
+    gchar **flag_argv = NULL;
+    gint flag_argc = 0;
+
+    if (flags[0] && !g_shell_parse_argv(flags, &flag_argc, &flag_argv, error)) return FALSE;
+
+    const char **fields = g_new(const char *, (gsize)flag_argc + 3);
+    fields[0] = sensor->def.name;
+    fields[1] = sensor->def.program;
+    fields[2] = restart ? "1" : "0"; // The node restarts it, with the panel's backoff.
+    for (gint i = 0; i < flag_argc; i++) fields[i + 3] = flag_argv[i];
+    gboolean ok = node_send(sensor->node, sensor, "define", fields, (gsize)flag_argc + 3);
+    g_free(fields);
+    g_strfreev(flag_argv);
+    if (!ok) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED, "%s is not connected", sensor->node->name);
+    }
+    return ok;
+}
+
+/*
+ * Name:         start_remote
+ * Purpose:      Have a sensor's node start it, with the flags and restart setting now in its row
+ */
+static gboolean start_remote(SensorState *sensor, GError **error) {
+    const gchar *flags = gtk_entry_get_text(GTK_ENTRY(sensor->flags_entry));
+
+    if (strlen(flags) == 0) {
+        g_set_error_literal(error, G_SHELL_ERROR, G_SHELL_ERROR_EMPTY_STRING,
+                            "Please enter flags (at minimum: data file path)");
         return FALSE;
     }
+    if (!node_define(sensor, error)) return FALSE;
+    node_sensor_request(sensor, "start");
+    return TRUE;
+}
 
-    result = waitpid(sensor->pid, &status, WNOHANG);
+/*
+ * Name:         node_event
+ * Purpose:      Apply a sensor or log event from a node to its row
+ */
+static void node_event(NodeState *node, char **f, int count) {
+    SensorState *sensor = count > 2 ? sensor_of_node(node, f[2]) : NULL;
+
+    if (strcmp(f[1], "sensor") == 0 && sensor && count >= 9) {
+        switch (agent_state_parse(f[3])) {
+            case AGENT_STOPPED:    sensor->status = SENSOR_STOPPED; break;
+            case AGENT_RUNNING:    sensor->status = SENSOR_RUNNING; break;
+            case AGENT_RESTARTING: sensor->status = SENSOR_RESTARTING; break;
+            case AGENT_FAILED:     sensor->status = SENSOR_FAILED; break;
+            default:               return; // A state from a newer agent.
+        }
+        sensor->remote_pid = atoi(f[4]);
+
+        gchar *label = g_strdup_printf("%s, %s frames", node->name, f[7]);
+        gchar *tip = g_strdup_printf("PID %s, %s restarts, last exit %s, %s bytes written", f[4], f[5], f[6], f[8]);
+        gtk_label_set_text(GTK_LABEL(sensor->node_label), label);
+        gtk_widget_set_tooltip_text(sensor->node_label, tip);
+        g_free(label);
+        g_free(tip);
+        update_controls(sensor);
+    } else if (strcmp(f[1], "log") == 0 && sensor && count >= 5) {
+        if (strcmp(f[3], "note") == 0) {
+            gchar *line = g_strdup_printf("[%s] %s\n", node->name, f[4]);
+            log_append(sensor, line, -1, "note");
+            g_free(line);
+        } else {
+            gchar *line = g_strconcat(f[4], "\n", NULL);
+            log_append(sensor, line, -1, strcmp(f[3], "err") == 0 ? "stderr" : NULL);
+            g_free(line);
+        }
+    } else if (strcmp(f[1], "bye") == 0) {
+        g_print("%s: %s\n", node->name, count > 2 ? f[2] : "closed by the agent");
+    }
+}
 
-    if (result == sensor->pid) {
-        // Process has exited
-        sensor->running = FALSE;
-        sensor->pid = 0;
-        sensor->timeout_id = 0;
+/*
+ * Name:         node_line
+ * Purpose:      Handle one line from a node, an event or the reply to the oldest request
+ */
+static void node_line(NodeState *node, char *line) {
+    char *f[AGENT_FIELDS_MAX];
+    int count = agent_split(line, f, AGENT_FIELDS_MAX);
 
-        gtk_widget_queue_draw(sensor->led_area);
-        gtk_widget_set_sensitive(sensor->start_button, TRUE);
-        gtk_widget_set_sensitive(sensor->stop_button, FALSE);
-        gtk_widget_set_sensitive(sensor->flags_entry, TRUE);
+    if (count < 2) return;
+    if (strcmp(f[0], "*") == 0) {
+        node_event(node, f, count);
+        return;
+    }
 
-        return FALSE;  // Stop the timeout
+    NodeRequest *request = g_queue_pop_head(node->pending);
+    if (!request) return;
+    if (g_ascii_strtoull(f[0], NULL, 10) != request->tag) {
+        g_printerr("%s: reply %s to request %u, the link is out of step\n", node->name, f[0], request->tag);
     }
 
-    return TRUE;  // Continue checking
+    if (strcmp(f[1], "ok") != 0) {
+        const char *msg = count > 2 ? f[2] : "failed";
+        if (request->sensor) log_note(request->sensor, "%s on %s failed: %s", request->verb, node->name, msg);
+        else g_printerr("%s: %s failed: %s\n", node->name, request->verb, msg);
+    } else if (strcmp(request->verb, "hello") == 0 && count >= 5) {
+        g_print("Connected to %s, %s %s on %s\n", node->name, f[2], f[3], f[4]);
+    } else if (strcmp(request->verb, "put") == 0 && request->sensor && count >= 3) {
+        log_note(request->sensor, "pushed the data file to %s, %s bytes", node->name, f[2]);
+    }
+    node_request_free(request);
+}
+
+/*
+ * Name:         on_node_input
+ * Purpose:      Read everything a node has sent and handle it line by line
+ */
+static gboolean on_node_input(gint fd, GIOCondition condition, gpointer data) {
+    NodeState *node = (NodeState *)data;
+    ssize_t n = agent_buffer_fill(&node->in, fd);
+    int read_errno = errno;
+    char *line;
+
+    (void)condition;
+
+    while ((line = agent_buffer_line(&node->in)) != NULL) node_line(node, line);
+
+    const char *why = NULL;
+    if (agent_buffer_pending(&node->in) > AGENT_LINE_MAX) why = "line too long";
+    else if (n == 0) why = "connection closed";
+    else if (n < 0 && read_errno != EAGAIN && read_errno != EWOULDBLOCK) why = g_strerror(read_errno);
+    if (!why) return G_SOURCE_CONTINUE;
+
+    node->in_watch_id = 0; // This source, removed by the return.
+    node_disconnect(node, why);
+    return G_SOURCE_REMOVE;
+}
+
+static void node_connect(NodeState *node);
+
+/*
+ * Name:         on_node_retry
+ * Purpose:      Try a node's connection again
+ */
+static gboolean on_node_retry(gpointer data) {
+    NodeState *node = (NodeState *)data;
+
+    node->retry_id = 0;
+    node_connect(node);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Name:         node_disconnect
+ * Purpose:      Drop a node's connection, grey out its sensors and retry in NODE_RETRY_MS
+ *
+ * Notes:        The sensors keep running under the agent, the next connection
+ *               reports them.
+ */
+static void node_disconnect(NodeState *node, const char *why) {
+    if (node->in_watch_id) g_source_remove(node->in_watch_id);
+    if (node->out_watch_id) g_source_remove(node->out_watch_id);
+    if (node->flush_id) g_source_remove(node->flush_id);
+    node->in_watch_id = node->out_watch_id = node->flush_id = 0;
+    if (node->connection) {
+        g_io_stream_close(G_IO_STREAM(node->connection), NULL, NULL);
+        g_object_unref(node->connection);
+        node->connection = NULL;
+    }
+    node->fd = -1;
+    agent_buffer_free(&node->in);
+    agent_buffer_free(&node->out);
+    g_queue_free_full(node->pending, node_request_free);
+    node->pending = g_queue_new();
+    g_printerr("Lost %s: %s\n", node->name, why);
+
+    for (guint i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (sensor->node != node) continue;
+        sensor->status = SENSOR_OFFLINE;
+        sensor->remote_pid = 0;
+        gchar *label = g_strdup_printf("%s (offline)", node->name);
+        gtk_label_set_text(GTK_LABEL(sensor->node_label), label);
+        g_free(label);
+        update_controls(sensor);
+    }
+    if (!node->retry_id) node->retry_id = g_timeout_add(NODE_RETRY_MS, on_node_retry, node);
+}
+
+/*
+ * Name:         on_node_connected
+ * Purpose:      Finish connecting to a node, then send hello and every sensor it runs
+ */
+static void on_node_connected(GObject *source, GAsyncResult *result, gpointer data) {
+    NodeState *node = (NodeState *)data;
+    GError *error = NULL;
+    GSocketConnection *connection = g_socket_client_connect_to_host_finish(G_SOCKET_CLIENT(source), result, &error);
+
+    node->connecting = FALSE;
+    if (!connection) {
+        if (!node->reported) {
+            g_printerr("Unable to connect to %s at %s: %s, retrying every %d s\n",
+                       node->name, node->address, error->message, NODE_RETRY_MS / 1000);
+        }
+        node->reported = TRUE;
+        g_error_free(error);
+        node->retry_id = g_timeout_add(NODE_RETRY_MS, on_node_retry, node);
+        return;
+    }
+
+    GSocket *socket = g_socket_connection_get_socket(connection);
+    g_socket_set_blocking(socket, FALSE);
+    g_socket_set_option(socket, IPPROTO_TCP, TCP_NODELAY, 1, NULL); // Requests are batched already.
+    node->reported = FALSE;
+    node->connection = connection;
+    node->fd = g_socket_get_fd(socket);
+    node->in_watch_id = g_unix_fd_add(node->fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_node_input, node);
+
+    gchar *version = g_strdup_printf("%d", AGENT_PROTOCOL);
+    const char *hello[] = { version, node->token };
+    node_send(node, NULL, "hello", hello, node->token ? 2 : 1);
+    g_free(version);
+
+    // The panel's rows are the node's configuration, each sensor is defined again.
+    for (guint i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (sensor->node != node) continue;
+        if (!node_define(sensor, &error)) {
+            log_note(sensor, "not defined on %s: %s", node->name, error->message);
+            g_clear_error(&error);
+        }
+    }
+}
+
+/*
+ * Name:         node_connect
+ * Purpose:      Start connecting to a node's wxagent, off the main loop
+ */
+static void node_connect(NodeState *node) {
+    if (node->connecting || node->connection) return;
+    node->connecting = TRUE;
+    g_socket_client_connect_to_host_async(node->connector, node->address, AGENT_PORT, NULL, on_node_connected, node);
+}
+
+/*
+ * Name:         push_data_file
+ * Purpose:      Send a remote sensor's data file, the first of its flags, to the same path on its node
+ *
+ * Notes:        The agent renames the file into place, so a sensor already
+ *               replaying it reloads it. pushed holds "<node>/<path>" of every
+ *               file sent, so a file shared by several sensors goes once.
+ */
+static void push_data_file(SensorState *sensor, GHashTable *pushed) {
+    const gchar *flags = gtk_entry_get_text(GTK_ENTRY(sensor->flags_entry));
+    gchar **flag_argv = NULL;
+    gint flag_argc = 0;
+
+    if (!flags[0] || !g_shell_parse_argv(flags, &flag_argc, &flag_argv, NULL)) return;
+    const gchar *path = flag_argv[0];
+    gchar *key = g_strconcat(sensor->node->name, "/", path, NULL);
+
+    if (g_hash_table_contains(pushed, key)) {
+        g_free(key);
+    } else if (g_path_is_absolute(path) || strstr(path, "://") || !g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        log_note(sensor, "%s is not a data file under the working directory, not pushed", path);
+        g_free(key);
+    } else {
+        gchar *contents = NULL;
+        gsize length = 0;
+        GError *error = NULL;
+        g_hash_table_add(pushed, key);
+        if (!g_file_get_contents(path, &contents, &length, &error)) {
+            log_note(sensor, "push failed: %s", error->message);
+            g_error_free(error);
+        } else {
+            gchar *size = g_strdup_printf("%" G_GSIZE_FORMAT, length);
+            const char *fields[] = { path, size };
+            if (node_send(sensor->node, sensor, "put", fields, 2)) agent_buffer_append(&sensor->node->out, contents, length);
+            g_free(size);
+            g_free(contents);
+        }
+    }
+    g_strfreev(flag_argv);
 }
 
 /*
@@ -166,73 +865,37 @@ static void show_error_dialog(GtkWidget *parent, const char *message) {
  */
 static void on_start_clicked(GtkWidget *widget, gpointer data) {
     SensorState *sensor = (SensorState *)data;
-    const gchar *flags;
-    char executable[MAX_PATH_LEN];
-    char command[MAX_PATH_LEN + MAX_FLAGS_LEN];
-    pid_t pid;
+    GError *error = NULL;
 
     (void)widget;
 
-    flags = gtk_entry_get_text(GTK_ENTRY(sensor->flags_entry));
-
-    if (strlen(flags) == 0) {
-        show_error_dialog(sensor->start_button,
-                         "Please enter flags (at minimum: data file path)");
-        return;
+    if (sensor->restart_id) {
+        g_source_remove(sensor->restart_id);
+        sensor->restart_id = 0;
     }
+    sensor->backoff_ms = RESTART_MIN_MS; // A manual start begins a fresh backoff.
 
-    // Build executable path
-    snprintf(executable, sizeof(executable), "./bin/%s/%s",
-             sensor->def->name, sensor->def->name);
-
-    // Build full command for display/debug
-    snprintf(command, sizeof(command), "%s %s", executable, flags);
-    g_print("Starting: %s\n", command);
-
-    pid = fork();
-
-    if (pid == -1) {
-        show_error_dialog(sensor->start_button, "Failed to fork process");
+    if (!(sensor->node ? start_remote(sensor, &error) : start_sensor(sensor, &error))) {
+        show_error_dialog(sensor->start_button, error->message);
+        g_error_free(error);
         return;
     }
-    if (pid == 0) {
-        // Child process
-        char *args[32];
-        char flags_copy[MAX_FLAGS_LEN];
-        int argc = 0;
-        char *token;
-        char *saveptr;
-
-        // Create new process group
-        setsid();
-
-        // Build argument array
-        args[argc++] = executable;
-        strncpy(flags_copy, flags, sizeof(flags_copy) - 1);
-        flags_copy[sizeof(flags_copy) - 1] = '\0';
-        token = strtok_r(flags_copy, " ", &saveptr);
-        while (token != NULL && argc < 31) {
-            args[argc++] = token;
-            token = strtok_r(NULL, " ", &saveptr);
-        }
-        args[argc] = NULL;
-
-        execvp(executable, args);
-        // If exec fails
-        perror("execvp failed");
-        _exit(1);
-    }
-    // Parent process
-    sensor->pid = pid;
-    sensor->running = TRUE;
+    update_controls(sensor);
+}
 
-    gtk_widget_queue_draw(sensor->led_area);
-    gtk_widget_set_sensitive(sensor->start_button, FALSE);
-    gtk_widget_set_sensitive(sensor->stop_button, TRUE);
-    gtk_widget_set_sensitive(sensor->flags_entry, FALSE);
+/*
+ * Name:         on_kill_timeout
+ * Purpose:      Force a sensor that ignored SIGTERM to exit
+ */
+static gboolean on_kill_timeout(gpointer data) {
+    SensorState *sensor = (SensorState *)data;
 
-    // Start monitoring the process
-    sensor->timeout_id = g_timeout_add(1000, check_process, sensor);
+    sensor->kill_id = 0;
+    if (sensor->pid > 0) {
+        log_note(sensor, "no exit %d ms after SIGTERM, sending SIGKILL", STOP_KILL_MS);
+        kill(-sensor->pid, SIGKILL);
+    }
+    return G_SOURCE_REMOVE;
 }
 
 /*
@@ -244,25 +907,62 @@ static void on_stop_clicked(GtkWidget *widget, gpointer data) {
 
     (void)widget;
 
-    if (sensor->pid > 0) {
-        g_print("Stopping %s (PID: %d)\n", sensor->def->name, sensor->pid);
-        // Send SIGTERM to process group
+    if (sensor->node) {
+        // The node stops it, SIGKILL included, the row follows its events.
+        if (!node_sensor_request(sensor, "stop")) log_note(sensor, "%s is not connected", sensor->node->name);
+        return;
+    }
+    if (sensor->restart_id > 0) {
+        g_source_remove(sensor->restart_id);
+        sensor->restart_id = 0;
+        sensor->status = SENSOR_STOPPED;
+    }
+    if (sensor->pid > 0 && !sensor->stopping) {
+        g_print("Stopping %s (PID: %d)\n", sensor->def.name, sensor->pid);
+        // Send SIGTERM to process group, on_child_exit() reaps it.
+        sensor->stopping = TRUE;
         kill(-sensor->pid, SIGTERM);
-        // Wait for process to terminate
-        waitpid(sensor->pid, NULL, 0);
-        sensor->pid = 0;
+        sensor->kill_id = g_timeout_add(STOP_KILL_MS, on_kill_timeout, sensor);
     }
-    if (sensor->timeout_id > 0) {
-        g_source_remove(sensor->timeout_id);
-        sensor->timeout_id = 0;
+    update_controls(sensor);
+}
+
+/*
+ * Name:         on_reload_clicked
+ * Purpose:      Handle reload button click - have the sensor reload its data file
+ */
+static void on_reload_clicked(GtkWidget *widget, gpointer data) {
+    SensorState *sensor = (SensorState *)data;
+
+    (void)widget;
+
+    if (sensor->node) {
+        if (!node_sensor_request(sensor, "reload")) log_note(sensor, "%s is not connected", sensor->node->name);
+        return;
+    }
+    if (sensor->pid > 0 && !sensor->stopping) {
+        // The sensor itself only, anything it started keeps running.
+        if (kill(sensor->pid, SIGHUP) == 0) log_note(sensor, "sent SIGHUP, reloading the data file");
+        else log_note(sensor, "reload failed: %s", g_strerror(errno));
     }
+}
+
+/*
+ * Name:         on_log_clicked
+ * Purpose:      Show a sensor's output in the log pane
+ */
+static void on_log_clicked(GtkWidget *widget, gpointer data) {
+    SensorState *sensor = (SensorState *)data;
+    gchar *title;
 
-    sensor->running = FALSE;
+    (void)widget;
 
-    gtk_widget_queue_draw(sensor->led_area);
-    gtk_widget_set_sensitive(sensor->start_button, TRUE);
-    gtk_widget_set_sensitive(sensor->stop_button, FALSE);
-    gtk_widget_set_sensitive(sensor->flags_entry, TRUE);
+    log_sensor = sensor;
+    gtk_text_view_set_buffer(GTK_TEXT_VIEW(log_view), sensor->log);
+    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(log_view), sensor->log_end);
+    title = g_strdup_printf("Output: %s", sensor->def.display_name);
+    gtk_label_set_text(GTK_LABEL(log_title), title);
+    g_free(title);
 }
 
 /*
@@ -270,14 +970,17 @@ static void on_stop_clicked(GtkWidget *widget, gpointer data) {
  * Purpose:      Start all sensors that are not currently running
  */
 static void on_start_all_clicked(GtkWidget *widget, gpointer data) {
-    int i;
+    guint i;
 
     (void)widget;
     (void)data;
 
-    for (i = 0; i < num_sensors; i++) {
-        if (!sensors[i].running) {
-            on_start_clicked(NULL, &sensors[i]);
+    for (i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (sensor->status == SENSOR_OFFLINE) {
+            log_note(sensor, "%s is not connected, not started", sensor->node->name);
+        } else if (sensor->status != SENSOR_RUNNING) {
+            on_start_clicked(NULL, sensor); // A remote start is queued, not waited for.
         }
     }
 }
@@ -287,30 +990,87 @@ static void on_start_all_clicked(GtkWidget *widget, gpointer data) {
  * Purpose:      Stop all running sensors
  */
 static void on_stop_all_clicked(GtkWidget *widget, gpointer data) {
-    int i;
+    guint i;
 
     (void)widget;
     (void)data;
 
-    for (i = 0; i < num_sensors; i++) {
-        if (sensors[i].running) {
-            on_stop_clicked(NULL, &sensors[i]);
+    for (i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (sensor->status == SENSOR_RUNNING || sensor->status == SENSOR_RESTARTING) {
+            on_stop_clicked(NULL, sensor);
         }
     }
 }
 
+/*
+ * Name:         on_push_clicked
+ * Purpose:      Push every connected remote sensor's data file to its node
+ */
+static void on_push_clicked(GtkWidget *widget, gpointer data) {
+    GHashTable *pushed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    guint i;
+
+    (void)widget;
+    (void)data;
+
+    for (i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (!sensor->node) continue;
+        if (sensor->node->fd < 0) {
+            log_note(sensor, "%s is not connected, not pushed", sensor->node->name);
+            continue;
+        }
+        push_data_file(sensor, pushed);
+    }
+    g_hash_table_destroy(pushed);
+}
+
 /*
  * Name:         on_window_destroy
- * Purpose:      Clean up when window is closed - stop all sensors
+ * Purpose:      Clean up when window is closed - stop all local sensors
+ *
+ * Notes:        Sensors on a node keep running under its wxagent and are
+ *               picked up again by the next panel to connect.
  */
 static void on_window_destroy(GtkWidget *widget, gpointer data) {
+    guint i;
+
     (void)widget;
     (void)data;
 
-    on_stop_all_clicked(NULL, NULL);
+    for (i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (!sensor->node && (sensor->status == SENSOR_RUNNING || sensor->status == SENSOR_RESTARTING)) {
+            on_stop_clicked(NULL, sensor);
+        }
+    }
     gtk_main_quit();
 }
 
+/*
+ * Name:         reap_remaining
+ * Purpose:      After the main loop, wait for sensors still exiting so none are orphaned
+ */
+static void reap_remaining(void) {
+    gint64 deadline = g_get_monotonic_time() + (gint64)STOP_KILL_MS * 1000;
+    guint i;
+
+    for (i = 0; i < sensors->len; i++) {
+        SensorState *sensor = g_ptr_array_index(sensors, i);
+        if (sensor->pid <= 0) continue;
+        while (waitpid(sensor->pid, NULL, WNOHANG) == 0) {
+            if (g_get_monotonic_time() >= deadline) {
+                kill(-sensor->pid, SIGKILL);
+                waitpid(sensor->pid, NULL, 0);
+                break;
+            }
+            g_usleep(10000);
+        }
+        sensor->pid = 0;
+    }
+}
+
 /*
  * Name:         create_sensor_row
  * Purpose:      Create a GTK box containing all widgets for one sensor
@@ -318,6 +1078,7 @@ static void on_window_destroy(GtkWidget *widget, gpointer data) {
 static GtkWidget *create_sensor_row(SensorState *sensor) {
     GtkWidget *hbox;
     GtkWidget *label;
+    GtkWidget *log_button;
 
     hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
     gtk_widget_set_margin_start(hbox, 10);
@@ -332,19 +1093,31 @@ static GtkWidget *create_sensor_row(SensorState *sensor) {
     gtk_box_pack_start(GTK_BOX(hbox), sensor->led_area, FALSE, FALSE, 5);
 
     // Sensor name label
-    label = gtk_label_new(sensor->def->display_name);
+    label = gtk_label_new(sensor->def.display_name);
     gtk_widget_set_size_request(label, 180, -1);
     gtk_label_set_xalign(GTK_LABEL(label), 0);
     gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 5);
 
+    // Where it runs, with the node's last frame count
+    sensor->node_label = gtk_label_new(sensor->node ? sensor->node->name : "local");
+    gtk_widget_set_size_request(sensor->node_label, 140, -1);
+    gtk_label_set_xalign(GTK_LABEL(sensor->node_label), 0);
+    gtk_label_set_ellipsize(GTK_LABEL(sensor->node_label), PANGO_ELLIPSIZE_END);
+    gtk_box_pack_start(GTK_BOX(hbox), sensor->node_label, FALSE, FALSE, 5);
+
     // Flags entry
     sensor->flags_entry = gtk_entry_new();
-    gtk_entry_set_text(GTK_ENTRY(sensor->flags_entry), sensor->def->default_flags);
+    gtk_entry_set_text(GTK_ENTRY(sensor->flags_entry), sensor->def.default_flags);
     gtk_entry_set_placeholder_text(GTK_ENTRY(sensor->flags_entry),
                                    "<data_file> [port] [baud] [mode]");
     gtk_widget_set_hexpand(sensor->flags_entry, TRUE);
     gtk_box_pack_start(GTK_BOX(hbox), sensor->flags_entry, TRUE, TRUE, 5);
 
+    // Restart after a crash
+    sensor->restart_check = gtk_check_button_new_with_label("Restart");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(sensor->restart_check), sensor->def.restart);
+    gtk_box_pack_start(GTK_BOX(hbox), sensor->restart_check, FALSE, FALSE, 5);
+
     // Start button
     sensor->start_button = gtk_button_new_with_label("Start");
     gtk_widget_set_size_request(sensor->start_button, 80, -1);
@@ -358,9 +1131,162 @@ static GtkWidget *create_sensor_row(SensorState *sensor) {
     g_signal_connect(sensor->stop_button, "clicked", G_CALLBACK(on_stop_clicked), sensor);
     gtk_box_pack_start(GTK_BOX(hbox), sensor->stop_button, FALSE, FALSE, 5);
 
+    // Reload button
+    sensor->reload_button = gtk_button_new_with_label("Reload");
+    gtk_widget_set_size_request(sensor->reload_button, 80, -1);
+    gtk_widget_set_sensitive(sensor->reload_button, FALSE);
+    g_signal_connect(sensor->reload_button, "clicked", G_CALLBACK(on_reload_clicked), sensor);
+    gtk_box_pack_start(GTK_BOX(hbox), sensor->reload_button, FALSE, FALSE, 5);
+
+    // Log button
+    log_button = gtk_button_new_with_label("Log");
+    g_signal_connect(log_button, "clicked", G_CALLBACK(on_log_clicked), sensor);
+    gtk_box_pack_start(GTK_BOX(hbox), log_button, FALSE, FALSE, 5);
+
     return hbox;
 }
 
+/*
+ * Name:         add_node
+ * Purpose:      Append a wxagent node to the node list, or find the one of that name
+ */
+static NodeState *add_node(const gchar *name, const gchar *address, const gchar *token) {
+    for (guint i = 0; i < nodes->len; i++) {
+        NodeState *node = g_ptr_array_index(nodes, i);
+        if (strcmp(node->name, name) == 0) return node;
+    }
+
+    NodeState *node = g_new0(NodeState, 1);
+    node->name = g_strdup(name);
+    node->address = g_strdup(address);
+    node->token = g_strdup(token);
+    node->fd = -1;
+    node->connector = g_socket_client_new();
+    g_socket_client_set_timeout(node->connector, 5);
+    node->pending = g_queue_new();
+    g_ptr_array_add(nodes, node);
+    return node;
+}
+
+/*
+ * Name:         add_sensor
+ * Purpose:      Append a sensor definition to the sensor list, taking ownership of its strings
+ */
+static void add_sensor(gchar *name, gchar *program, gchar *display_name, gchar *flags, gboolean restart, gchar *node) {
+    SensorState *sensor = g_new0(SensorState, 1);
+    GtkTextIter end;
+
+    sensor->def.name = name;
+    sensor->def.program = program;
+    sensor->def.display_name = display_name;
+    sensor->def.default_flags = flags;
+    sensor->def.restart = restart;
+    sensor->def.node = node;
+    sensor->status = node ? SENSOR_OFFLINE : SENSOR_STOPPED;
+    sensor->backoff_ms = RESTART_MIN_MS;
+    sensor->out_fd = -1;
+    sensor->err_fd = -1;
+
+    sensor->log = gtk_text_buffer_new(NULL);
+    gtk_text_buffer_create_tag(sensor->log, "stderr", "foreground", "#c62828", NULL);
+    gtk_text_buffer_create_tag(sensor->log, "note", "foreground", "#777777", "style", PANGO_STYLE_ITALIC, NULL);
+    gtk_text_buffer_get_end_iter(sensor->log, &end);
+    sensor->log_end = gtk_text_buffer_create_mark(sensor->log, NULL, &end, FALSE); // Right gravity, stays at the end.
+
+    g_ptr_array_add(sensors, sensor);
+}
+
+/*
+ * Name:         load_sensor_config
+ * Purpose:      Read the sensor list from a key file, one group per sensor
+ *
+ * Notes:        [group]             unique name, also the default program
+ *               program=<name|path> executable, ./bin/<name>/<name> unless it holds a '/'
+ *               label=<text>        row label, the group name by default
+ *               flags=<args>        default flags, shell quoting allowed
+ *               restart=true|false  restart after a crash, false by default
+ *               node=<name>         run it on that node's wxagent, see add_node()
+ *
+ *               [node:<name>]       a node, its sensors are grouped under it
+ *               address=<host[:port]> the node's wxagent, the name and AGENT_PORT by default
+ *               token_file=<path>   first line is the token of a wxagent run with --token-file
+ */
+static gboolean load_sensor_config(const char *path, GError **error) {
+    GKeyFile *key_file = g_key_file_new();
+    gchar **groups;
+    gsize count = 0;
+
+    if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, error)) {
+        g_key_file_free(key_file);
+        return FALSE;
+    }
+
+    groups = g_key_file_get_groups(key_file, &count);
+    for (gsize i = 0; i < count; i++) {
+        const gchar *group = groups[i];
+        if (g_str_has_prefix(group, NODE_GROUP_PREFIX)) {
+            const gchar *node_name = group + strlen(NODE_GROUP_PREFIX);
+            gchar *address = g_key_file_get_string(key_file, group, "address", NULL);
+            gchar *token_file = g_key_file_get_string(key_file, group, "token_file", NULL);
+            gchar *token = NULL;
+            if (token_file) {
+                GError *token_error = NULL;
+                if (g_file_get_contents(token_file, &token, NULL, &token_error)) {
+                    token[strcspn(token, "\r\n")] = '\0'; // The first line, as wxagent reads it.
+                } else {
+                    g_printerr("%s: %s, connecting without a token\n", node_name, token_error->message);
+                    g_error_free(token_error);
+                }
+            }
+            add_node(node_name, address ? address : node_name, token);
+            g_free(token);
+            g_free(token_file);
+            g_free(address);
+            continue;
+        }
+        gchar *program = g_key_file_get_string(key_file, group, "program", NULL);
+        gchar *label = g_key_file_get_string(key_file, group, "label", NULL);
+        gchar *flags = g_key_file_get_string(key_file, group, "flags", NULL);
+        gboolean restart = g_key_file_get_boolean(key_file, group, "restart", NULL); // FALSE when absent.
+        gchar *node = g_key_file_get_string(key_file, group, "node", NULL);
+
+        add_sensor(g_strdup(group), program ? program : g_strdup(group),
+                   label ? label : g_strdup(group), flags ? flags : g_strdup(""), restart, node);
+    }
+    g_strfreev(groups);
+    g_key_file_free(key_file);
+    return TRUE;
+}
+
+/*
+ * Name:         load_sensors
+ * Purpose:      Fill the sensor list from the config file, or the built-in list without one
+ */
+static void load_sensors(const char *path) {
+    GError *error = NULL;
+
+    sensors = g_ptr_array_new();
+    nodes = g_ptr_array_new();
+    if (load_sensor_config(path ? path : DEFAULT_CONFIG, &error)) {
+        // A node= with no [node:] group is a host name, with the default port.
+        for (guint i = 0; i < sensors->len; i++) {
+            SensorState *sensor = g_ptr_array_index(sensors, i);
+            if (sensor->def.node) sensor->node = add_node(sensor->def.node, sensor->def.node, NULL);
+        }
+        g_print("Loaded %u sensors on %u nodes from %s\n", sensors->len, nodes->len, path ? path : DEFAULT_CONFIG);
+        return;
+    }
+    if (path || !g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        g_printerr("Unable to read %s: %s, using the built-in sensor list\n", path ? path : DEFAULT_CONFIG, error->message);
+    }
+    g_error_free(error);
+
+    for (gsize i = 0; i < G_N_ELEMENTS(default_defs); i++) {
+        const SensorDef *d = &default_defs[i];
+        add_sensor(g_strdup(d->name), g_strdup(d->program), g_strdup(d->display_name), g_strdup(d->default_flags), d->restart, NULL);
+    }
+}
+
 /*
  * Name:         apply_css
  * Purpose:      Apply CSS styling to the application
@@ -397,9 +1323,13 @@ static GtkWidget *create_main_window(void) {
     GtkWidget *button_hbox;
     GtkWidget *start_all_btn;
     GtkWidget *stop_all_btn;
+    GtkWidget *push_btn;
+    GtkWidget *paned;
     GtkWidget *scrolled_window;
     GtkWidget *sensor_vbox;
-    int i;
+    GtkWidget *log_vbox;
+    GtkWidget *log_scrolled;
+    guint i;
 
     // Create main window
     window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -436,44 +1366,66 @@ static GtkWidget *create_main_window(void) {
     gtk_label_set_xalign(GTK_LABEL(sensor_lbl), 0);
     gtk_box_pack_start(GTK_BOX(header_hbox), sensor_lbl, FALSE, FALSE, 5);
 
+    GtkWidget *node_lbl = gtk_label_new("Node");
+    gtk_widget_set_size_request(node_lbl, 140, -1);
+    gtk_label_set_xalign(GTK_LABEL(node_lbl), 0);
+    gtk_box_pack_start(GTK_BOX(header_hbox), node_lbl, FALSE, FALSE, 5);
+
     GtkWidget *flags_lbl = gtk_label_new("Flags");
     gtk_box_pack_start(GTK_BOX(header_hbox), flags_lbl, TRUE, TRUE, 5);
 
     GtkWidget *controls_lbl = gtk_label_new("Controls");
-    gtk_widget_set_size_request(controls_lbl, 170, -1);
+    gtk_widget_set_size_request(controls_lbl, 320, -1);
     gtk_box_pack_start(GTK_BOX(header_hbox), controls_lbl, FALSE, FALSE, 5);
 
     gtk_box_pack_start(GTK_BOX(main_vbox), header_hbox, FALSE, FALSE, 5);
 
-    // Scrolled window for sensor list: Note This should be sized appropriately for all sensors.
+    // Sensor list above, the selected sensor's output below.
+    paned = gtk_paned_new(GTK_ORIENTATION_VERTICAL);
+    gtk_widget_set_vexpand(paned, TRUE);
+    gtk_box_pack_start(GTK_BOX(main_vbox), paned, TRUE, TRUE, 5);
+
+    // Scrolled window for sensor list, any number of rows.
     scrolled_window = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
                                    GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_widget_set_vexpand(scrolled_window, TRUE);
-    gtk_box_pack_start(GTK_BOX(main_vbox), scrolled_window, TRUE, TRUE, 5);
+    gtk_widget_set_size_request(scrolled_window, -1, 250);
+    gtk_paned_pack1(GTK_PANED(paned), scrolled_window, TRUE, FALSE);
 
     // Sensor list container
     sensor_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
     gtk_container_add(GTK_CONTAINER(scrolled_window), sensor_vbox);
 
     // Create sensor rows
-    num_sensors = 0;
-    for (i = 0; sensor_defs[i].name != NULL && num_sensors < MAX_SENSORS; i++) {
-        sensors[num_sensors].def = &sensor_defs[i];
-        sensors[num_sensors].pid = 0;
-        sensors[num_sensors].running = FALSE;
-        sensors[num_sensors].timeout_id = 0;
-        GtkWidget *row = create_sensor_row(&sensors[num_sensors]);
+    for (i = 0; i < sensors->len; i++) {
+        GtkWidget *row = create_sensor_row(g_ptr_array_index(sensors, i));
         gtk_box_pack_start(GTK_BOX(sensor_vbox), row, FALSE, FALSE, 0);
 
         // Add separator between rows
-        if (sensor_defs[i + 1].name != NULL) {
+        if (i + 1 < sensors->len) {
             separator = gtk_separator_new(GTK_ORIENTATION_HORIZONTAL);
             gtk_box_pack_start(GTK_BOX(sensor_vbox), separator, FALSE, FALSE, 0);
         }
-        num_sensors++;
     }
 
+    // Log pane
+    log_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    log_title = gtk_label_new("Output: press Log on a sensor");
+    gtk_label_set_xalign(GTK_LABEL(log_title), 0);
+    gtk_box_pack_start(GTK_BOX(log_vbox), log_title, FALSE, FALSE, 0);
+
+    log_scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(log_scrolled),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_vexpand(log_scrolled, TRUE);
+    log_view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(log_view), FALSE);
+    gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(log_view), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(log_view), TRUE);
+    gtk_container_add(GTK_CONTAINER(log_scrolled), log_view);
+    gtk_box_pack_start(GTK_BOX(log_vbox), log_scrolled, TRUE, TRUE, 0);
+    gtk_paned_pack2(GTK_PANED(paned), log_vbox, FALSE, FALSE);
+
     // Bottom separator
     separator = gtk_separator_new(GTK_ORIENTATION_HORIZONTAL);
     gtk_box_pack_start(GTK_BOX(main_vbox), separator, FALSE, FALSE, 5);
@@ -487,6 +1439,13 @@ static GtkWidget *create_main_window(void) {
     gtk_widget_set_hexpand(spacer, TRUE);
     gtk_box_pack_start(GTK_BOX(button_hbox), spacer, TRUE, TRUE, 0);
 
+    // Push Data button, for sensors on nodes
+    push_btn = gtk_button_new_with_label("Push Data");
+    gtk_widget_set_size_request(push_btn, 100, -1);
+    gtk_widget_set_sensitive(push_btn, nodes->len > 0);
+    g_signal_connect(push_btn, "clicked", G_CALLBACK(on_push_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(button_hbox), push_btn, FALSE, FALSE, 5);
+
     // Start All button
     start_all_btn = gtk_button_new_with_label("Start All");
     gtk_widget_set_size_request(start_all_btn, 100, -1);
@@ -510,10 +1469,13 @@ int main(int argc, char *argv[]) {
     GtkWidget *window;
 
     gtk_init(&argc, &argv);
+    load_sensors(argc > 1 ? argv[1] : NULL);
     apply_css();
     window = create_main_window();
     gtk_widget_show_all(window);
+    for (guint i = 0; i < nodes->len; i++) node_connect(g_ptr_array_index(nodes, i));
     gtk_main();
+    reap_remaining();
 
     return 0;
 }
@@ -131,7 +131,8 @@
  * 				2 - Vicinity: Lightning detected between 5-15 NM
  * 				3 - Overhead: Lightning detected within 0-5 NM
  *
- * Usage:		flash <file_path> <serial_port_location> <baud_rate> <RS422|RS232>
+ * Usage:		flash <file_path> <serial_port_location> <baud_rate> <RS422|RS232> [--history MINUTES]
+ *				flash - <serial_port_location> <baud_rate> <RS422|RS232> --storm SEED [--storm-rate N] [--storm-cells N]
  *				The serial port must match /dev/tty(S|USB)[0-9]+
  *
  * Example: 	./flash data.txt /dev/ttyUSB0 9600 RS232
@@ -148,7 +149,28 @@
  *				- Output: RS-232, RS-422, or RS-485
  *				- Default baud rate: 9600 (configurable to 19200)
  *
- * Mods:
+ * Mods:     14/10/2026 The sender reads its mode and interval from a seqlock
+ *                      snapshot of sensor_one instead of under sensor_mutex.
+ *           14/10/2026 The sender and data threads run on SendSchedules, deadlines
+ *                      follow the last deadline rather than the end of the last pass.
+ *           14/10/2026 Strike history is kept as running totals in an Arena, sized
+ *                      by --history (default 30, up to 1440 minutes).
+ *           14/10/2026 --storm records flashes from the storm engine instead of
+ *                      reading a data file.
+ *           14/10/2026 Commands are matched by command_lookup(), J and L arguments
+ *                      are range checked by command_arg_long().
+ *           14/10/2026 --metrics PATH serves frame, command, tcdrain and lock
+ *                      wait metrics on a UNIX socket.
+ *           14/10/2026 The data file is reloaded when it is replaced or on
+ *                      SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on the port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 A data file of wxstate://NAME records the flashes of the
+ *                      shared weather state's storm, see wxstate/.
+ *           14/10/2026 --state PATH keeps the settings, the strike history and
+ *                      the replay position over a restart, see persist_utils.h.
  *
  */
 
@@ -169,17 +191,27 @@
 #include "crc_utils.h"
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "tss928_utils.h"
+#include "seqlock_utils.h"
+#include "schedule_utils.h"
+#include "arena_utils.h"
+#include "storm_utils.h"
+#include "command_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "persist_utils.h"
+#include "trace_utils.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B9600	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 #define MAX_CMD_LENGTH 256
 #define MAX_MSG_LENGTH 512
-#define CPU_WAIT_USEC 10000
 #define MINUTE_INTERVAL 60
+#define DATA_PERIOD_SEC 10 // One data file line, or one storm step, per period.
 #define THIRTY_MIN_INTERVAL 1800
+#define STATE_LAYOUT 1 // --state payload, a TSS928_sensor then its history rows. Bump when the saved fields change meaning.
 
 #define DEBUG_MODE // Comment this line out to disable all debug prints
 
@@ -190,7 +222,7 @@
 #endif
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -202,18 +234,32 @@ const char *program_name = "unknown";
 
 // This needs to be freed upon exit.
 TSS928_sensor *sensor_one = NULL; // Global pointer to struct for skyvue8 sensor .
+static Arena strike_arena = ARENA_INITIALIZER; // Holds sensor_one->strikes.history.
+static PersistFile *state_file = NULL; // --state, NULL when settings are not kept.
+
+// --storm: the engine and its output belong to the data thread.
+static StormConfig storm_cfg;
+static StormEngine storm;
+static StormFlash storm_flashes[STORM_MAX_STEP_FLASHES];
+static uint64_t state_flashes_seen = WXSTATE_FLASHES_NEW; // wxstate:// cursor, data thread only.
+
+/*
+ * sensor_one is published to sensor_shared after each command, and the sender
+ * takes snapshots of that copy through sensor_lock to decide when to send. The
+ * strike bins in a snapshot are not used: the data thread updates them between
+ * commands, so process_and_send() reads the live bins under sensor_mutex.
+ */
+static TSS928_sensor sensor_shared;
+static SeqLock sensor_lock = SEQLOCK_INITIALIZER;
 
 // Synchronization primitives
 /*	MUTEX		|	OWNS
-	send_mutex	|	sensor_one->mode, sensor_one->message_interval, sensor_one->last_send_time, sensor_cond
+	sensor_mutex	|	sensor_one, sensor_lock writes
 	data_mutex	|	sensor_one->StrikeBin, advance_one_minute()
-	file_mutex	|	file_ptr
 */
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t data_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
-static pthread_cond_t  data_sleep_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // RUN mode deadlines, woken by publish_sensor().
+static SendSchedule data_sched = SCHEDULE_INITIALIZER;   // The data thread's 10 second reads, woken only by terminate.
 
 // Global pointers to receiver and sender threads.
 pthread_t recv_thread, send_thread, data_thread, sig_thread;
@@ -223,9 +269,6 @@ bool send_thread_created = false;
 bool data_thread_created = false;
 bool sig_thread_created = false;
 
-bool sensor_cond_init = false;
-bool data_sleep_cond_init = false;
-
 /*
  * Name:         cleanup_and_exit
  * Purpose:      helper function to cleanup sensors, and arrays.
@@ -243,8 +286,8 @@ void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex); // Lock before changing terminate to 1.
     terminate = 1;
     pthread_mutex_unlock(&sensor_mutex);
-    if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
-	if (data_sleep_cond_init) pthread_cond_broadcast(&data_sleep_cond);
+    schedule_wake(&sender_sched);
+	schedule_wake(&data_sched);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -253,10 +296,16 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
     }
 	if (data_thread_created) {
 		pthread_join(data_thread, NULL);
 		data_thread_created = false;
+		if (storm_cfg.enabled) {
+			safe_console_print("%s: storm seed %llu, %llu flashes in %.0f s, %llu past the step limit\n", program_name,
+							   (unsigned long long)storm_cfg.seed, (unsigned long long)storm.flashes, storm.time_s,
+							   (unsigned long long)storm.dropped);
+		}
 	}
 	if (sig_thread_created) {
 		pthread_cancel(sig_thread);
@@ -264,16 +313,18 @@ void cleanup_and_exit(int exit_code) {
 		sig_thread_created = false;
 	}
 
-    pthread_mutex_destroy(&file_mutex);
 	pthread_mutex_destroy(&sensor_mutex);
-	pthread_mutex_destroy(&data_sleep_mutex);
-	if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
-	if (data_sleep_cond_init) pthread_cond_destroy(&data_sleep_cond);
+	schedule_destroy(&sender_sched);
+	schedule_destroy(&data_sched);
 
+	persist_close(state_file); // After the threads, nothing commits to it now.
 	if (sensor_one) free(sensor_one);
+	arena_destroy(&strike_arena);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -307,7 +358,7 @@ void parse_message(char *msg) {
 	// QUADRANTS 8 //0:N, 1:NE, 2:E, 3:SE, 4:S, 5:SW, 6:W, 7:NW
 	char *saveptr; // Our place keeper in the msg string.
 	char *token; // Where we temporarily store each token.
-    pthread_mutex_lock(&sensor_mutex); // Lock before IO on sensor_one.
+    metrics_mutex_lock(&sensor_mutex); // Lock before IO on sensor_one.
 	// These are pulled from a text file in this format:
 	//	NEAR N,NEAR NE, NEAR E,NEAR SE,NEAR S,NEAR SW,NEAR W,NEAR NW,DIST N,DIST NE,DIST E,DIST SE,DIST S,DIST SW,DIST W,DIST NW, OVHD, CLOUD
 	//	  0		 0		  0		 0		 0		0		0		0	   0	  0		  0		 0		 0		0		0	   0		0	   0
@@ -352,35 +403,36 @@ void process_and_send(void) {
  	//	DIST: N [0-65535] NE [0-65535] E [0-65535] SE [0-65535] S [0-65535] SW [0-65535] W [0-65535] NW [0-65535]<CR><LF>
  	//	OVHD [0-65535] CLOUD [0-65535] TOTAL [0-65535] [P|F] [00-FF]H [0-99] C [0-65535] [0-65535] [0-65535] [0-65535] [0-65535] [0.000-9.999]<CR><LF>
 
-	int temp_total = 0;
+	uint32_t temp_total = 0;
 
-    pthread_mutex_lock(&sensor_mutex); // Lock before IO on sensor_one.
+    metrics_mutex_lock(&sensor_mutex); // Lock before IO on sensor_one.
+	const StrikeRow *totals = &sensor_one->strikes.totals;
 	for (int i = 0; i < RANGE_RINGS; i++) {
 		for (int j = 0; j < QUADRANTS; j++) {
-			temp_total += sensor_one->strikes.ground_totals[i][j];
+			temp_total += totals->ground[i][j];
 		}
 	}
 	safe_serial_write(serial_fd, "NEAR: N %u NE %u E %u SE %u S %u SW %u W %u NW %u\r\n"
 								 "DIST: N %u NE %u E %u SE %u S %u SW %u W %u NW %u\r\n"
 								 "OVHD %u CLOUD %u TOTAL %u %c %02xH %d C %u %u %u %u %u %f\r\n",
-									sensor_one->strikes.ground_totals[NEAR][NORTH], 		// NEAR N
-									sensor_one->strikes.ground_totals[NEAR][NORTH_EAST],	// NEAR NE
-									sensor_one->strikes.ground_totals[NEAR][EAST],			// NEAR E
-									sensor_one->strikes.ground_totals[NEAR][SOUTH_EAST],	// NEAR SE
-									sensor_one->strikes.ground_totals[NEAR][SOUTH],			// NEAR S
-									sensor_one->strikes.ground_totals[NEAR][SOUTH_WEST],	// NEAR SW
-									sensor_one->strikes.ground_totals[NEAR][WEST],			// NEAR W
-									sensor_one->strikes.ground_totals[NEAR][NORTH_WEST],	// NEAR NW
-									sensor_one->strikes.ground_totals[DIST][NORTH],			// DIST N
-									sensor_one->strikes.ground_totals[DIST][NORTH_EAST],	// DIST NE
-									sensor_one->strikes.ground_totals[DIST][EAST],			// DIST E
-									sensor_one->strikes.ground_totals[DIST][SOUTH_EAST],	// DIST SE
-									sensor_one->strikes.ground_totals[DIST][SOUTH],			// DIST S
-									sensor_one->strikes.ground_totals[DIST][SOUTH_WEST],	// DIST SW
-									sensor_one->strikes.ground_totals[DIST][WEST],			// DIST W
-									sensor_one->strikes.ground_totals[DIST][NORTH_WEST],	// DIST NW
-									sensor_one->strikes.overhead_total,						// OVHD
-									sensor_one->strikes.cloud_total,						// CLOUD
+									totals->ground[NEAR][NORTH], 		// NEAR N
+									totals->ground[NEAR][NORTH_EAST],	// NEAR NE
+									totals->ground[NEAR][EAST],			// NEAR E
+									totals->ground[NEAR][SOUTH_EAST],	// NEAR SE
+									totals->ground[NEAR][SOUTH],			// NEAR S
+									totals->ground[NEAR][SOUTH_WEST],	// NEAR SW
+									totals->ground[NEAR][WEST],			// NEAR W
+									totals->ground[NEAR][NORTH_WEST],	// NEAR NW
+									totals->ground[DIST][NORTH],			// DIST N
+									totals->ground[DIST][NORTH_EAST],	// DIST NE
+									totals->ground[DIST][EAST],			// DIST E
+									totals->ground[DIST][SOUTH_EAST],	// DIST SE
+									totals->ground[DIST][SOUTH],			// DIST S
+									totals->ground[DIST][SOUTH_WEST],	// DIST SW
+									totals->ground[DIST][WEST],			// DIST W
+									totals->ground[DIST][NORTH_WEST],	// DIST NW
+									totals->overhead,										// OVHD
+									totals->cloud,											// CLOUD
 									temp_total,												// TOTALS
 									'P',													// char P | F Pass or Fail
 									0,														// Status Code 00-FF
@@ -395,6 +447,9 @@ void process_and_send(void) {
     pthread_mutex_unlock(&sensor_mutex); // Unlock after IO on sensor_one.
 }
 
+// Built into a trie from cmd_table[] on the first command.
+static CommandDispatch dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_ALNUM);
+
 /*
  * Name:         parse_command
  * Purpose:      Translates a received string to command enum.
@@ -407,40 +462,22 @@ void process_and_send(void) {
  * Assumptions:  The string received is a string and should be able to translate to one of the commands.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The keyword is matched by command_lookup() on dispatch.
  */
 CommandType parse_command(const char *buf, ParsedCommand *cmd) {
     if (buf == NULL || cmd == NULL) return CMD_UNKNOWN;
 
 	memset(cmd, 0, sizeof(ParsedCommand)); // zero out the contents of our ParsedCommand
-    const char *ptr = buf;
-
-	while (*ptr && isspace((unsigned char)*ptr)) ptr++; // Skip any leading whitespace.
-
-    for (size_t i = 0; i < CMD_TABLE_SIZE; i++) {
-
-        if (strncasecmp(ptr, cmd_table[i].name, cmd_table[i].len) == 0) {
-            // Ensure exact match (don't match "R" if the command is "RESET")
-            char next = ptr[cmd_table[i].len];
-            if (next == '\0' || isalnum((unsigned char)next)) { // If the command is terminated, or has additional text. !! Excludes \t \n \r
-				cmd->type = cmd_table[i].type;
-                ptr += cmd_table[i].len; // Jump past command
-                // Skip any spaces to point at arguments
-                while (*ptr && isspace((unsigned char)*ptr)) ptr++;
 
-				size_t param_len = strcspn(ptr, "\n\r"); // Get the size of the string, up to the \n \r
-				if (param_len > sizeof(cmd->raw_params) - 1) { // Truncate if the remaining string is larger than our raw_params char*.
-    				param_len = sizeof(cmd->raw_params) - 1;
-				}
-
-				strncpy(cmd->raw_params, ptr, param_len);
-				cmd->raw_params[param_len] = '\0'; // Always null-terminate
-                return cmd->type;
-            }
-        }
+    const char *args;
+    const CommandMap *m = command_lookup(&dispatch, buf, &args);
+    if (m == NULL) {
+        cmd->type = CMD_UNKNOWN;
+        return CMD_UNKNOWN;
     }
-    cmd->type = CMD_UNKNOWN;
-    return CMD_UNKNOWN;
+    cmd->type = (CommandType)m->type;
+    command_copy_params(args, cmd->raw_params, sizeof(cmd->raw_params)); // Up to the \n \r, truncated to fit.
+    return cmd->type;
 }
 
 
@@ -468,7 +505,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			process_and_send();
 			break;
 		case CMD_RESET:
-			pthread_mutex_lock(&sensor_mutex);
+			metrics_mutex_lock(&sensor_mutex);
 			reset_sensor(sensor_one);
 			safe_serial_write(serial_fd, "%s\n%s\n%s\n%c %02xH %d C %u %u %u %u %u %f\r\n",
 							   sensor_one->loader_version,
@@ -478,7 +515,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			pthread_mutex_unlock(&sensor_mutex);
 			break;
 		case CMD_SELFTEST:
-			pthread_mutex_lock(&sensor_mutex);
+			metrics_mutex_lock(&sensor_mutex);
 			conduct_self_test(sensor_one);
 			safe_serial_write(serial_fd, "%c %02xH %d C %u %u %u %u %u %f\r\n",'P', 0, 27, sensor_one->strikes.total_strikes_since_reset, 0, 0, 0, 0, 0.000);
 			pthread_mutex_unlock(&sensor_mutex);
@@ -489,7 +526,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 		case CMD_RUNTIME: {
 			struct timespec current_time;
 			clock_gettime(CLOCK_MONOTONIC, &current_time);
-			pthread_mutex_lock(&sensor_mutex);
+			metrics_mutex_lock(&sensor_mutex);
 			long total_seconds = current_time.tv_sec - sensor_one->sensor_start_time.tv_sec;
 			safe_serial_write(serial_fd, "D %ld H %ld M %ld S %ld\r\n",
 												(total_seconds / SECONDS_IN_DAY),
@@ -500,7 +537,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			break;
 		}
 		case CMD_VERSION:
-			pthread_mutex_lock(&sensor_mutex);
+			metrics_mutex_lock(&sensor_mutex);
 			safe_serial_write(serial_fd,"%s\n%s\r\n", sensor_one->software_version, sensor_one->copyright_information);
 			pthread_mutex_unlock(&sensor_mutex);
 			break;
@@ -511,20 +548,21 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			//TODO: Implement a handler for handling diagnostics.
 			break;
 		case CMD_AGING:{
-			uint8_t new_interval = (uint8_t)atoi(p_cmd->raw_params);
-			pthread_mutex_lock(&sensor_mutex);
-			switch (new_interval) {
+			long new_interval = 0; // Anything but 1-4 only reports the current interval.
+			command_arg_long(p_cmd->raw_params, 1, 4, &new_interval);
+			metrics_mutex_lock(&sensor_mutex);
+			switch (new_interval) { // The totals are recounted over the new interval at once.
 				case 1:
-					sensor_one->strikes.aging_interval = 15;
+					strike_bin_set_aging(&sensor_one->strikes, 15);
 					break;
 				case 2:
-					sensor_one->strikes.aging_interval = 10;
+					strike_bin_set_aging(&sensor_one->strikes, 10);
 					break;
 				case 3:
-					sensor_one->strikes.aging_interval = 5;
+					strike_bin_set_aging(&sensor_one->strikes, 5);
 					break;
 				case 4:
-					sensor_one->strikes.aging_interval = 30;
+					strike_bin_set_aging(&sensor_one->strikes, 30);
 					break;
 				default:
 					break;
@@ -534,15 +572,17 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			break;
 		}
 		case CMD_ANGLE:{
-			uint8_t new_rotation_angle = (uint8_t)atoi(p_cmd->raw_params);
-			pthread_mutex_lock(&sensor_mutex);
-			sensor_one->rotation_angle = (new_rotation_angle % 359); // modulus by max degrees to ensure new angle is within limits.
+			long new_rotation_angle;
+			metrics_mutex_lock(&sensor_mutex);
+			if (command_arg_long(p_cmd->raw_params, 0, 359, &new_rotation_angle) == 0) { // A bad angle leaves the rotation as it was.
+				sensor_one->rotation_angle = (uint16_t)new_rotation_angle;
+			}
 			safe_serial_write(serial_fd,"A%u\r\n", sensor_one->rotation_angle);
 			pthread_mutex_unlock(&sensor_mutex);
 			break;
 		}
 		case CMD_TIME:
-			pthread_mutex_lock(&sensor_mutex);
+			metrics_mutex_lock(&sensor_mutex);
 			if (p_cmd->raw_params[0] == '\0') {
 				safe_serial_write(serial_fd, "N %02d:%02d:%02d\r\n", sensor_one->sensor_time.tm_hour, sensor_one->sensor_time.tm_min, sensor_one->sensor_time.tm_sec);
 			} else {
@@ -586,7 +626,7 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 										"?\n");
 			break;
 		case CMD_RESTORE:
-			pthread_mutex_lock(&sensor_mutex);
+			metrics_mutex_lock(&sensor_mutex);
 			restore_sensor(sensor_one); // Resets the sensor to default settings.
 			pthread_mutex_unlock(&sensor_mutex);
 			break;
@@ -630,24 +670,138 @@ void* signal_thread(void* arg) {
     terminate = 1;
 
     // Now safely wake any threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    schedule_wake(&sender_sched);
+    schedule_wake(&data_sched);
 
-    pthread_mutex_lock(&data_sleep_mutex);
-    pthread_cond_broadcast(&data_sleep_cond);
-    pthread_mutex_unlock(&data_sleep_mutex);
+    return NULL;
+}
 
 
-    return NULL;
+
+/*
+ * Name:         save_state
+ * Purpose:      Commits sensor_one and its strike history to the --state file.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     state_file.
+ * Returns:      None.
+ * Assumptions:  sensor_mutex is held.
+ *
+ * Bugs:         None known.
+ * Notes:        The history pointer saved with sensor_one is not used by
+ * 				 load_state(), the rows follow it in the payload.
+ */
+static void save_state(void) {
+	struct iovec iov[2] = {
+		{ .iov_base = sensor_one, .iov_len = sizeof(*sensor_one) },
+		{ .iov_base = sensor_one->strikes.history, .iov_len = ((size_t)sensor_one->strikes.history_slots + 1) * sizeof(StrikeRow) }
+	};
+	persist_commitv(state_file, iov, 2);
 }
 
+/*
+ * Name:         load_state
+ * Purpose:      Takes sensor_one's settings and strike history from the last
+ *               --state commit.
+ * Arguments:    None.
+ *
+ * Output:       A note on the console when the state is restored.
+ * Modifies:     sensor_one, its strike history.
+ * Returns:      None.
+ * Assumptions:  Called from main after init_TSS928_sensor(), before the threads
+ * 				 start. The payload size matched, so --history is unchanged.
+ *
+ * Bugs:         None known.
+ * Notes:        The bins are aged by the minutes the emulator was stopped, so
+ * 				 a strike recorded before a restart leaves the aging interval
+ * 				 when it would have; a stop longer than the history clears them.
+ * 				 The send and start times belong to this run.
+ */
+static void load_state(void) {
+	int64_t saved_ns;
+	const unsigned char *saved = persist_load(state_file, &saved_ns);
+	if (!saved) return;
+
+	StrikeRow *history = sensor_one->strikes.history;
+	struct timespec last_send_time = sensor_one->last_send_time;
+	struct timespec sensor_start_time = sensor_one->sensor_start_time;
+	memcpy(sensor_one, saved, sizeof(*sensor_one));
+	sensor_one->strikes.history = history;
+	sensor_one->last_send_time = last_send_time;
+	sensor_one->sensor_start_time = sensor_start_time;
+	StrikeBin *bin = &sensor_one->strikes;
+	memcpy(history, saved + sizeof(*sensor_one), ((size_t)bin->history_slots + 1) * sizeof(StrikeRow));
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t stopped_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - saved_ns;
+	int64_t slots = stopped_ns > 0 ? stopped_ns / ((int64_t)bin->slot_seconds * 1000000000LL) : 0;
+	if (slots > (int64_t)bin->history_slots) {
+		uint32_t total = bin->total_strikes_since_reset;
+		strike_bin_clear(bin);
+		bin->total_strikes_since_reset = total;
+	} else {
+		for (int64_t i = 0; i < slots; i++) strike_bin_advance(bin);
+	}
+	safe_console_print("%s: settings and %lld minute old strike history restored from the state file\n", program_name,
+					   (long long)(stopped_ns > 0 ? stopped_ns / (SECONDS_IN_MIN * 1000000000LL) : 0));
+}
 
+/*
+ * Name:         publish_sensor
+ * Purpose:      Publishes sensor_one to the sender thread, and wakes it if anything changed.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     sensor_shared, sensor_lock.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Made under sensor_mutex, because the data thread also writes
+ * 				 sensor_one. The copy and the --state commit are skipped when
+ * 				 nothing changed.
+ */
+static void publish_sensor(void) {
+	metrics_mutex_lock(&sensor_mutex);
+	if (memcmp(&sensor_shared, sensor_one, sizeof(sensor_shared)) != 0) {
+		seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared));
+		schedule_wake(&sender_sched); // Wake our sender thread, to check if our mode has changed.
+		if (state_file) save_state(); // A command's change is kept at once, as in the sensor's EEPROM.
+	}
+	pthread_mutex_unlock(&sensor_mutex);
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command(), then publishes the result.
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    handle_command(cmd_type, &local_cmd); // handle received command here.
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    publish_sensor();
+}
 
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -657,44 +811,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    	if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0'; // Terminate with NULL for safety.
-
-                    ParsedCommand local_cmd;
-                    CommandType cmd_type = parse_command(line, &local_cmd);
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    len = 0;
-                } else { // empty line ignore
-                }
-            } else {
-              	  if (len < sizeof(line)-1) {
-				      line[len++] = c;
-                  } else {
-                    	len = 0;
-                  }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(CPU_WAIT_USEC);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -703,54 +829,37 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Sends on sender_sched deadlines, each one the previous deadline
+ * 				 plus the interval, so the time taken to send never adds up as drift.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec ts;
-	bool should_send = false;
-	int interval = 0;
+	TSS928_sensor cfg; // Snapshot of sensor_one, private to this thread.
+	seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
 
     while (!terminate) {
+		if (cfg.mode == SMODE_RUN) {
+			// Keeps its phase while the interval is unchanged, an interval of 0 sends back to back.
+			schedule_start(&sender_sched, (uint64_t)cfg.message_interval * SCHED_NS_PER_SEC);
+		} else {
+			// If in Polling/Stop Mode, wait indefinitely for the receiver to publish a change.
+			schedule_stop(&sender_sched);
+		}
 
-        pthread_mutex_lock(&sensor_mutex);
-		// Determine if we should wait for a specific time or indefinitely
-        if (sensor_one != NULL && sensor_one->mode == SMODE_RUN) {
-			interval = sensor_one->message_interval; // If we are in polled mode, message_interval is zero.
-            // Calculate absolute time: Last Send Time + Interval
-            // Use current REALTIME + (Interval - Time Since Last Send)
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            // Add the continuous interval (in seconds) to the current time
-            ts.tv_sec += interval;
-            // Wait until that specific second arrives OR a signal interrupts us
-            pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-        } else {
-            // If in Polling/Stop Mode, wait indefinitely for a signal from the receiver
-            pthread_cond_wait(&sensor_cond, &sensor_mutex); // pthread_cond_wait atomically releases the mutex while it sleeps, so receiver_thread can actually acquire sensor_mutex.
-        }
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
-            break;
-        }
-
-        // is_ready_to_send() handles the interval and timing logic internally, and checks if the sensor is Polling or Continuous.
-        should_send = (sensor_one != NULL && TSS928_is_ready_to_send(sensor_one));
-
-		pthread_mutex_unlock(&sensor_mutex);  // <-- UNLOCK BEFORE I/O
+		ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+		if (event == SCHEDULE_ERROR) {
+			safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
+			break;
+		}
+		if (event == SCHEDULE_WOKEN) {
+			seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg)); // The receiver has published since.
+			continue;
+		}
 
         // Do I/O operations WITHOUT holding the mutex
-        if (should_send) {
-                process_and_send();
-                fflush(NULL);  // Flush all output streams
-
-			// Update timestamp with lock
-            pthread_mutex_lock(&sensor_mutex);
-            if (sensor_one != NULL) {
-                clock_gettime(CLOCK_MONOTONIC, &sensor_one->last_send_time);
-            }
-            pthread_mutex_unlock(&sensor_mutex);
-        }
+        process_and_send();
+        fflush(NULL);  // Flush all output streams
     }
     return NULL;
 }
@@ -759,8 +868,11 @@ void* sender_thread(void* arg) {
 /*
  * Name:         data_collection_thread
  * Purpose:      Every 10s reads one line from the data file, parses it into the strikes struct in sensor_one.
- *               Every 60s calls update_circular_buffer().
+ *               With --storm, advances the storm 10s and records its flashes instead.
+ *               From wxstate://NAME, records the flashes published in the last 10s.
+ *               Every 60s calls strike_bin_advance().
  *				 Every 30m calls conduct_self_test().
+ *               With --state, saves the bins every 10s.
  *               Never sends data — that is sender_thread's sole responsibility.
  * Arguments:    arg: unused.
  * Returns:      NULL.
@@ -776,49 +888,101 @@ void* data_collection_thread(void* arg) {
     last_buffer_update = ts.tv_sec;
 	last_thirty_minute_update = ts.tv_sec;
 
+	schedule_start(&data_sched, DATA_PERIOD_SEC * SCHED_NS_PER_SEC);
     while (!terminate) {
 		// 10s sleep — only woken early by terminate
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        ts.tv_sec += 10;
-
-        pthread_mutex_lock(&data_sleep_mutex);
-        while (!terminate) {
-            int rc = pthread_cond_timedwait(&data_sleep_cond, &data_sleep_mutex, &ts);
-            if (rc == ETIMEDOUT) break;
-        }
-        pthread_mutex_unlock(&data_sleep_mutex);
+        if (schedule_wait(&data_sched) != SCHEDULE_TICK || terminate) break;
 
-        if (terminate) break;
-
-        // --- Read one line and parse into shared_msg ---
-        char *line = get_next_line_copy(file_ptr, &file_mutex);
-        if (line) {
-            parse_message(line);
-            free(line);
-            line = NULL;
+        if (storm_cfg.enabled) {
+            size_t n = storm_step(&storm, DATA_PERIOD_SEC, storm_flashes, STORM_MAX_STEP_FLASHES);
+            metrics_mutex_lock(&sensor_mutex);
+            TSS928_record_storm(sensor_one, storm_flashes, n);
+            pthread_mutex_unlock(&sensor_mutex);
+        } else if (replay_state(replay_src)) {
+            WxState snapshot;
+            if (wxstate_read(replay_state(replay_src), &snapshot)) {
+                size_t n = wxstate_flashes(&snapshot, &state_flashes_seen, storm_flashes, STORM_MAX_STEP_FLASHES);
+                metrics_mutex_lock(&sensor_mutex);
+                TSS928_record_storm(sensor_one, storm_flashes, n);
+                pthread_mutex_unlock(&sensor_mutex);
+            }
+        } else {
+            // --- Read one line and parse into shared_msg ---
+            char line[REPLAY_LINE_MAX];
+            if (replay_next_line(replay_src, line, sizeof(line)) > 0) {
+                parse_message(line);
+                persist_note_replay(state_file, replay_src);
+            }
         }
 
         // Every 60s: update circular buffer
         clock_gettime(CLOCK_MONOTONIC, &ts);
         if ((ts.tv_sec - last_buffer_update) >= MINUTE_INTERVAL) {
-            pthread_mutex_lock(&sensor_mutex);
-            advance_one_minute(&sensor_one->strikes); // Advance the circular buffer
+            metrics_mutex_lock(&sensor_mutex);
+            strike_bin_advance(&sensor_one->strikes); // Start the next one minute bin
             pthread_mutex_unlock(&sensor_mutex);
             last_buffer_update = ts.tv_sec;
         }
 
         // Every 30 minutes: update the self-test values.
 		if ((ts.tv_sec - last_thirty_minute_update) >= THIRTY_MIN_INTERVAL) {
-    		pthread_mutex_lock(&sensor_mutex);
+    		metrics_mutex_lock(&sensor_mutex);
 			conduct_self_test(sensor_one);  // Conducts the resets of the sensor every 30 minutes.
 		    pthread_mutex_unlock(&sensor_mutex);
    			last_thirty_minute_update = ts.tv_sec;
 		}
+
+		if (state_file) {
+			metrics_mutex_lock(&sensor_mutex);
+			save_state(); // The bins as of this period.
+			pthread_mutex_unlock(&sensor_mutex);
+		}
     }
     return NULL;
 }
 
 
+/*
+ * Name:         parse_history_option
+ * Purpose:      Takes --history MINUTES or --history=MINUTES off the command line.
+ * Arguments:    argc: the argument count, reduced by the arguments taken.
+ * 				 argv: the arguments, the rest are kept in order.
+ * 				 history_mins: receives the minutes of strike history, left alone if --history is absent.
+ *
+ * Output:       Error message to stderr on a bad value.
+ * Modifies:     argc, argv, history_mins.
+ * Returns:      0 on success, -1 if the value is not MAX_AGING_MINS to MAX_HISTORY_MINS.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors replay_parse_options().
+ */
+static int parse_history_option(int *argc, char **argv, uint32_t *history_mins) {
+	int out = 1;
+	for (int i = 1; i < *argc; i++) {
+		const char *value = NULL;
+		if (strncmp(argv[i], "--history=", 10) == 0) {
+			value = argv[i] + 10;
+		} else if (strcmp(argv[i], "--history") == 0 && i + 1 < *argc) {
+			value = argv[++i];
+		} else {
+			argv[out++] = argv[i]; // Not ours, keep it in order.
+			continue;
+		}
+
+		char *end = NULL;
+		long mins = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || mins < MAX_AGING_MINS || mins > MAX_HISTORY_MINS) {
+			fprintf(stderr, "Invalid --history '%s': use %d to %d minutes\n", value, MAX_AGING_MINS, MAX_HISTORY_MINS);
+			return -1;
+		}
+		*history_mins = (uint32_t)mins;
+	}
+	argv[out] = NULL;
+	*argc = out;
+	return 0;
+}
+
 /*
  * Name:         Main
  * Purpose:      Main funstion, which opens up serial port, and creates a receiver and transmit threads to listen, and respond to commands
@@ -844,15 +1008,26 @@ void* data_collection_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+	uint32_t history_mins = DEFAULT_HISTORY_MINS;
+	if (parse_history_option(&argc, argv, &history_mins) != 0) cleanup_and_exit(1);
+	if (storm_parse_options(&argc, argv, &storm_cfg) != 0) cleanup_and_exit(1); // Strips --storm*.
+	MetricsOptions metrics_opts;
+	if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+	CaptureOptions capture_opts;
+	if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+	PersistOptions persist_opts;
+	if (persist_parse_options(&argc, argv, &persist_opts) != 0) cleanup_and_exit(1); // Strips --state.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path|-> <serial_device> <baud_rate> <RS422|RS485> [--history MINUTES] [--storm SEED] [--metrics PATH] [--capture PATH] [--state PATH]\n", argv[0]);
         cleanup_and_exit(1);
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (storm_cfg.enabled) { // The data file argument is not read.
+		storm_init(&storm, &storm_cfg);
+	} else if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
@@ -870,10 +1045,20 @@ int main(int argc, char *argv[]) {
         cleanup_and_exit(1);
     }
 
-	if (init_TSS928_sensor(&sensor_one) != 0) {
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
+	if (arena_init(&strike_arena, ((size_t)history_mins + 1) * sizeof(StrikeRow)) != 0 ||
+		init_TSS928_sensor(&sensor_one, &strike_arena, history_mins) != 0) {
         safe_console_error("Failed to initialize sensor_one\n");
 	  	cleanup_and_exit(1);
     }
+	size_t state_size = sizeof(TSS928_sensor) + ((size_t)history_mins + 1) * sizeof(StrikeRow);
+	if (persist_open(&state_file, &persist_opts, "tss928", STATE_LAYOUT, state_size) != 0) cleanup_and_exit(1);
+	load_state();
+	persist_resume_replay(state_file, replay_src);
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared)); // The sender's first snapshot.
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -882,17 +1067,18 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
 
-	// Initialize the send condition to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&sensor_cond, &attr); // Initialize the global variable here
-	sensor_cond_init = true;
-    pthread_cond_init(&data_sleep_cond, &attr); // Initialize the global variable here
-	data_sleep_cond_init = true;
-    pthread_condattr_destroy(&attr);
+	// Deadlines for the sender and data threads, on CLOCK_MONOTONIC.
+	if (schedule_init(&sender_sched, SCHEDULE_SKIP) != 0 || schedule_init(&data_sched, SCHEDULE_SKIP) != 0) {
+        safe_console_error("Failed to create thread schedules: %s\n", strerror(errno));
+		cleanup_and_exit(1);
+	}
+
+	if (metrics_start(&metrics_opts, program_name) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, program_name) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
 
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
         safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
@@ -75,8 +75,10 @@
  *			- 69 - Warning Heater Supply volts too high or pcb too hot.
  *
  * @section  Usage Usage:
- *			./windobserver75 <file_path> <serial_port_location> <baud_rate> <RS422|RS232>
+ *			./windobserver75 <file_path> <serial_port_location> <baud_rate> <RS422|RS232> [--rate HZ]
  *			The serial port must match /dev/tty(S|USB)[0-9]+
+ *			--rate sets the continuous output rate, 1 to 32 Hz, default 4. Rates above
+ *			10 Hz need 38400 baud or more to fit a frame into each interval.
  *
  * @section  Example Example:
  *			./windobserver75 data.txt /dev/ttyUSB0 9600 RS422
@@ -94,6 +96,17 @@
  *
  * @section  History Modifications:
  *			- 07/15/2026: Refactored sender loop to use absolute pthreads timed-waits for drift-free transmission.
+ *			- 14/10/2026: Sender reads a seqlock snapshot of sensor_one instead of taking sensor_mutex per frame.
+ *			- 14/10/2026: Sender runs on the shared timerfd SendSchedule instead of pthread timed-waits.
+ *			- 14/10/2026: Continuous frames are pre-rendered into a FrameRing by frame_render_thread, --rate up to 32 Hz.
+ *			- 14/10/2026: Commands are matched by command_lookup().
+ *			- 14/10/2026: --metrics PATH serves frame, command, tcdrain and lock wait metrics on a UNIX socket.
+ *			- 14/10/2026: --live reads a pipe, FIFO or udp:// source ahead of the sender, parsed records come out of a lock-free ring.
+ *			- 14/10/2026: The data file is reloaded when it is replaced or on SIGHUP, without a restart.
+ *			- 14/10/2026: --capture PATH records every byte on the port with timestamps, see wxcap.
+ *			- 14/10/2026: USDT probes on command parsing and handling, see trace_utils.h and trace/.
+ *			- 14/10/2026: --upsample interpolates the 4 Hz data file at the time of each frame, with optional seeded --noise.
+ *			- 14/10/2026: A data file of wxstate://NAME reports the wind of the shared weather state, see wxstate/.
  */
 
 
@@ -114,15 +127,23 @@
 #include "crc_utils.h"
 #include "serial_utils.h"
 #include "console_utils.h"
-#include "file_utils.h"
+#include "replay_utils.h"
 #include "windobserver75_utils.h"
-
+#include "seqlock_utils.h"
+#include "schedule_utils.h"
+#include "frame_ring.h"
+#include "command_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "trace_utils.h"
+#include "upsample_utils.h"
+
+#define DATA_PERIOD_MS 250 // Wind data files are recorded at the default 4 Hz from 00:00.
 #define SERIAL_PORT "/dev/ttyUSB0"   // Adjust as needed, main has logic to take arguments for a new location
 #define BAUD_RATE   B9600	     // Adjust as needed, main has logic to take arguments for a new baud rate
 #define MAX_LINE_LENGTH 1024
 #define MAX_CMD_LENGTH 256
 #define MAX_MSG_LENGTH 512
-#define CPU_WAIT_USEC 10000
 
 #define DEBUG_MODE // Comment this line out to disable all debug prints
 
@@ -133,7 +154,7 @@
 #endif
 
 
-FILE *file_ptr = NULL; // Global File pointer
+ReplaySource *replay_src = NULL; // Global memory-mapped replay source for the data file
 char *file_path = NULL; // path to file
 
 // Shared state
@@ -146,23 +167,36 @@ const char *program_name = "unknown";
 // This needs to be freed upon exit.
 WO75_sensor *sensor_one = NULL; // Global pointer to struct for skyvue8 sensor .
 
+/*
+ * sensor_one belongs to the receiver thread. After each command it is published to
+ * sensor_shared, and the sender takes snapshots of that copy through sensor_lock.
+ */
+static WO75_sensor sensor_shared;
+static SeqLock sensor_lock = SEQLOCK_INITIALIZER;
+
 // Synchronization primitives
 /*	MUTEX		|	OWNS
-	send_mutex	|	sensor_one->mode, sensor_one->message_interval, sensor_one->last_send_time, sensor_cond
-	file_mutex	|	file_ptr
+	sensor_mutex	|	terminate
 */
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // protects file_ptr / file access
 static pthread_mutex_t sensor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  sensor_cond; // Moved initialization down to main, to change REALTIME Clock to MONOTONIC.
+static SendSchedule sender_sched = SCHEDULE_INITIALIZER; // Continuous mode deadlines, woken by publish_sensor().
+
+/*
+ * Continuous frames, rendered ahead by frame_render_thread and written by the
+ * sender on each tick. Each frame is tagged with the units it was rendered in.
+ */
+static FrameRing frame_ring;
+static bool frame_ring_init_done = false;
+static uint64_t frame_ring_misses = 0; // Ticks the ring was empty and the sender rendered the frame itself.
+static Upsampler upsampler = UPSAMPLE_INITIALIZER; // --upsample, shared by the sender and polls.
 
 // Global pointers to receiver and sender threads.
-pthread_t recv_thread, send_thread, sig_thread;
+pthread_t recv_thread, send_thread, sig_thread, render_thread;
 
 bool recv_thread_created = false;
 bool send_thread_created = false;
 bool sig_thread_created = false;
-
-bool sensor_cond_init = false;
+bool render_thread_created = false;
 
 /*
  * Name:         cleanup_and_exit
@@ -181,7 +215,8 @@ void cleanup_and_exit(int exit_code) {
 	pthread_mutex_lock(&sensor_mutex); // Lock before changing terminate to 1.
     terminate = 1;
     pthread_mutex_unlock(&sensor_mutex);
-    if (sensor_cond_init) pthread_cond_broadcast(&sensor_cond);
+    schedule_wake(&sender_sched);
+	if (frame_ring_init_done) frame_ring_wake(&frame_ring);
 
 	if (recv_thread_created) {
         pthread_join(recv_thread, NULL);
@@ -190,21 +225,31 @@ void cleanup_and_exit(int exit_code) {
     if (send_thread_created) {
         pthread_join(send_thread, NULL);
         send_thread_created = false;
+		schedule_report(&sender_sched, program_name);
+		if (frame_ring_misses) safe_console_print("%s: %llu frames rendered late by the sender\n", program_name, (unsigned long long)frame_ring_misses);
+		upsample_report(&upsampler, program_name);
     }
+	if (render_thread_created) {
+		pthread_join(render_thread, NULL);
+		render_thread_created = false;
+	}
 	if (sig_thread_created) {
 		pthread_cancel(sig_thread);
 		pthread_join(sig_thread, NULL);
 		sig_thread_created = false;
 	}
 
-    pthread_mutex_destroy(&file_mutex);
 	pthread_mutex_destroy(&sensor_mutex);
-	if (sensor_cond_init) pthread_cond_destroy(&sensor_cond);
+	schedule_destroy(&sender_sched);
+	if (frame_ring_init_done) frame_ring_destroy(&frame_ring);
 
 	if (sensor_one) free(sensor_one);
     // Close resources
-    if (serial_fd >= 0) close(serial_fd);
-    if (file_ptr) fclose(file_ptr);
+    if (serial_fd >= 0) close_serial_port(serial_fd); // Flushes the transmit queue first.
+    capture_stop(); // The port's threads are joined, writes out the last records.
+    metrics_stop(); // Before the replay source it watches.
+    upsample_close(&upsampler);
+    if (replay_src) replay_close(replay_src);
     // Cleanup utilities
     console_cleanup();
     serial_utils_cleanup();
@@ -221,6 +266,7 @@ void cleanup_and_exit(int exit_code) {
  * Purpose:      Tokenizes a space-delimited sensor string and populates a ParsedMessage struct.
  * Arguments:    msg: the raw input string to be parsed (modified by strtok_r).
  * 				 p_message: pointer to the struct where parsed data will be stored.
+ * 				 sensor: the configuration to apply, sensor_one or a sender snapshot.
  *
  * Output:       None (internal debug prints to console only).
  * Modifies:     p_message: overwrites with new data.
@@ -233,22 +279,99 @@ void cleanup_and_exit(int exit_code) {
  * Notes:        Uses a local macro NEXT_T to sequence through 32 expected fields.
  *               Ensures string fields (METAR, BLM) are safely null-terminated.
  */
-void parse_message(char *msg, ParsedMessage *p_msg) {
-	memset(p_msg, 0, sizeof(ParsedMessage)); // zero out the ParsedMessage struct.
-	char *saveptr; // Our place keeper in the msg string.
-	char *token; // Where we temporarily store each token.
-
-	// These are pulled from a text file in this format:
-	// A,121,000.8,M,00
-	if ((token = strtok_r(msg, ",", &saveptr))) p_msg->msg_address = (char)token[0]; // Sensor Address A-Z
-   	#define NEXT_T strtok_r(NULL, ",", &saveptr) // Small macro to keep the code below cleaner.
-   	if ((token = NEXT_T)) p_msg->wind_direction = (uint16_t)atoi(token); 	// Wind Direction Polar
-   	if ((token = NEXT_T)) p_msg->wind_speed = (float)atof(token); 	// Wind Speed TODO: We could use strof(token, &endptr) to be more robust.
-   	if ((token = NEXT_T)) p_msg->msg_status = (uint8_t)atoi(token); 	// Sensor Message Status 00, 60, or see Appendix K
-	#undef NEXT_T
-    pthread_mutex_lock(&sensor_mutex); // Lock before IO on sensor_one.
-	p_msg->msg_units = sensor_one->units;
-    pthread_mutex_unlock(&sensor_mutex); // Unlock after IO on sensor_one.
+void parse_message(char *msg, ParsedMessage *p_msg, const WO75_sensor *sensor) {
+	WO75_parse_message(msg, p_msg, sensor->units);
+}
+
+/*
+ * Name:         live_parse
+ * Purpose:      Parses a --live line into a record, as wxb_convert does.
+ * Arguments:    line: the line, modified by the parse.
+ * 				 record: the ParsedMessage to fill.
+ *
+ * Output:       None.
+ * Modifies:     record, line.
+ * Returns:      None.
+ * Assumptions:  Called on the live feed's ingestion thread.
+ *
+ * Bugs:         None known.
+ * Notes:        Units are left unset, next_message() fills them in from the
+ * 				 live configuration as it does for a cached record.
+ */
+static void live_parse(char *line, void *record) {
+	WO75_parse_message(line, record, '\0');
+}
+
+/*
+ * Name:         read_message
+ * Purpose:      Fetches the next record from the data file.
+ * Arguments:    p_message: pointer to the struct where the record will be stored.
+ * 				 sensor: the configuration to apply, sensor_one or a sender snapshot.
+ *
+ * Output:       None.
+ * Modifies:     p_message, advances the replay cursor.
+ * Returns:      true if a record was stored, false if the data file has no line available.
+ * Assumptions:  replay_src has been opened and checked with replay_check_records().
+ *
+ * Bugs:         None known.
+ * Notes:        A .wxb cache made by wxb_convert is copied out record by record,
+ *               as is a --live record, a text file is read a line at a time and parsed.
+ */
+static bool read_message(ParsedMessage *p_message, const WO75_sensor *sensor) {
+	const void *record = replay_next_record(replay_src);
+	if (record) {
+		memcpy(p_message, record, sizeof(ParsedMessage));
+		p_message->msg_units = sensor->units; // Cached records carry the converter's default units.
+		return true;
+	}
+	char line[REPLAY_LINE_MAX];
+	if (replay_next_line(replay_src, line, sizeof(line)) == 0) return false;
+	parse_message(line, p_message, sensor);
+	return true;
+}
+
+/*
+ * Name:         upsample_fetch
+ * Purpose:      Reads a record into the upsampler's window.
+ * Arguments:    record: the ParsedMessage to fill.
+ * 				 ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     record, advances the replay cursor.
+ * Returns:      true if a record was stored.
+ * Assumptions:  Called from upsample_next() only.
+ *
+ * Bugs:         None known.
+ * Notes:        Units are left unset, as live_parse() leaves them, next_message()
+ * 				 fills them in on the interpolated record.
+ */
+static bool upsample_fetch(void *record, void *ctx) {
+	(void)ctx;
+	static const WO75_sensor no_sensor; // All zero, next_message() applies the real units.
+	return read_message(record, &no_sensor);
+}
+
+/*
+ * Name:         next_message
+ * Purpose:      Fetches the next record to send.
+ * Arguments:    p_message: pointer to the struct where the record will be stored.
+ * 				 sensor: the configuration to apply, sensor_one or a sender snapshot.
+ *
+ * Output:       None.
+ * Modifies:     p_message, advances the replay cursor.
+ * Returns:      true if a record was stored, false if the data file has no line available.
+ * Assumptions:  replay_src has been opened and checked with replay_check_records().
+ *
+ * Bugs:         None known.
+ * Notes:        With --upsample the record is interpolated for now on the replay
+ *               clock, so a --rate above 4 Hz no longer plays the file faster.
+ *               Otherwise each frame takes the next record.
+ */
+bool next_message(ParsedMessage *p_message, const WO75_sensor *sensor) {
+	if (upsampler.mode == UPSAMPLE_OFF) return read_message(p_message, sensor);
+	if (!upsample_next(&upsampler, p_message)) return false;
+	p_message->msg_units = sensor->units;
+	return true;
 }
 
 /*
@@ -266,12 +389,47 @@ void parse_message(char *msg, ParsedMessage *p_msg) {
  */
 void process_and_send(ParsedMessage *p_msg) {
 
-    char final_msg[MAX_LINE_LENGTH];
-    // Builds the msg string, from sensor struct values, and values read from provided file.
-    snprintf(final_msg, sizeof(final_msg), "%c,%03d,%06.2f,%c,%02d,", p_msg->msg_address, p_msg->wind_direction, p_msg->wind_speed, p_msg->msg_units, p_msg->msg_status);
-    safe_serial_write(serial_fd, "\x02%s\x03%02X\r\n", final_msg, checksumXOR(final_msg));
+    char frame[MAX_MSG_LENGTH];
+    // Builds the framed msg string, from sensor struct values, and values read from provided file.
+    int len = WO75_format_frame(p_msg, frame, sizeof(frame));
+    if (len > 0) {
+        serial_write_buf(serial_fd, frame, (size_t)len);
+    }
 }
 
+/*
+ * Name:         send_ring_frame
+ * Purpose:      Writes the next pre-rendered frame, or renders one if the ring is empty.
+ * Arguments:    sensor: the sender's configuration snapshot.
+ *
+ * Output:       Prints the frame to serial.
+ * Modifies:     frame_ring, frame_ring_misses.
+ * Returns:      None.
+ * Assumptions:  Called from sender_thread() only, the ring's one consumer.
+ *
+ * Bugs:         None known.
+ * Notes:        Frames rendered in other units than the snapshot's are dropped,
+ * 				 they predate a configuration change. Without a renderer, on a
+ * 				 --live feed or with --upsample, every frame is rendered here.
+ */
+static void send_ring_frame(const WO75_sensor *sensor) {
+	const RingFrame *f;
+	while ((f = frame_ring_peek(&frame_ring)) && f->tag != (uint16_t)sensor->units) frame_ring_release(&frame_ring);
+
+	if (f) {
+		if (f->len > 0) serial_write_buf(serial_fd, f->bytes, f->len); // Copied into the transmit queue.
+		frame_ring_release(&frame_ring);
+		return;
+	}
+
+	if (render_thread_created) frame_ring_misses++; // The renderer has fallen behind, format this one here.
+	ParsedMessage local_msg;
+	if (next_message(&local_msg, sensor)) process_and_send(&local_msg);
+}
+
+// Built into a trie from cmd_table[] on the first command.
+static CommandDispatch dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_ALNUM);
+
 /*
  * Name:         parse_command
  * Purpose:      Translates a received string to command enum.
@@ -284,45 +442,25 @@ void process_and_send(ParsedMessage *p_msg) {
  * Assumptions:  The string received is a string and should be able to translate to one of the commands.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        The keyword is matched by command_lookup() on dispatch.
  */
 CommandType parse_command(const char *buf, ParsedCommand *cmd) {
     if (buf == NULL || cmd == NULL) return CMD_UNKNOWN;
 
 	memset(cmd, 0, sizeof(ParsedCommand)); // zero out the contents of our ParsedCommand
-    const char *ptr = buf;
-
-	while (*ptr && isspace((unsigned char)*ptr)) ptr++; // Skip any leading whitespace.
-
-    for (size_t i = 0; i < CMD_TABLE_SIZE; i++) {
 
-        if (strncasecmp(ptr, cmd_table[i].name, cmd_table[i].len) == 0) {
-            // Ensure exact match (don't match "R" if the command is "RESET")
-            char next = ptr[cmd_table[i].len];
-            if (next == '\0' || isalnum((unsigned char)next)) { // If the command is terminated, or has additional text. !! Excludes \t \n \r
-				cmd->type = cmd_table[i].type;
-
-                if (cmd_table[i].len == 1 && isalpha((unsigned char)ptr[0])) {
-                    cmd->sensor_id = (char)toupper((unsigned char)ptr[0]);
-                }
-
-				ptr += cmd_table[i].len; // Jump past command
-                // Skip any spaces to point at arguments
-                while (*ptr && isspace((unsigned char)*ptr)) ptr++;
-
-				size_t param_len = strcspn(ptr, "\n\r"); // Get the size of the string, up to the \n \r
-				if (param_len > sizeof(cmd->raw_params) - 1) { // Truncate if the remaining string is larger than our raw_params char*.
-    				param_len = sizeof(cmd->raw_params) - 1;
-				}
-
-				strncpy(cmd->raw_params, ptr, param_len);
-				cmd->raw_params[param_len] = '\0'; // Always null-terminate
-                return cmd->type;
-            }
-        }
+    const char *args;
+    const CommandMap *m = command_lookup(&dispatch, buf, &args);
+    if (m == NULL) {
+        cmd->type = CMD_UNKNOWN;
+        return CMD_UNKNOWN;
+    }
+    cmd->type = (CommandType)m->type;
+    if (m->len == 1 && isalpha((unsigned char)m->name[0])) {
+        cmd->sensor_id = (char)toupper((unsigned char)m->name[0]); // A-Z poll the unit with that ID.
     }
-    cmd->type = CMD_UNKNOWN;
-    return CMD_UNKNOWN;
+    command_copy_params(args, cmd->raw_params, sizeof(cmd->raw_params)); // Up to the \n \r, truncated to fit.
+    return cmd->type;
 }
 
 
@@ -343,7 +481,6 @@ CommandType parse_command(const char *buf, ParsedCommand *cmd) {
 void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 	switch (cmd) {
 		case CMD_ENABLE:
-			pthread_mutex_lock(&sensor_mutex);
 			if (sensor_one->mode == SMODE_M4) {
 				sensor_one->mode = SMODE_M2;
 			}
@@ -353,24 +490,17 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			if (sensor_one->mode == SMODE_M14) {
 				sensor_one->mode = SMODE_M15;
 			}
-		    pthread_cond_broadcast(&sensor_cond); // Wake up the thread, if it was sleeping.
-			pthread_mutex_unlock(&sensor_mutex);
 			break;
 		case CMD_POLL:
 			// TODO: Kludged solution which just sends the configured sensor id, and the next line.
 			(void)p_cmd;
-			char *line = get_next_line_copy(file_ptr, &file_mutex);
-            if (line) {
-                ParsedMessage local_msg;  // LOCAL, not global
-                parse_message(line, &local_msg);
+			ParsedMessage local_msg;  // LOCAL, not global
+			if (next_message(&local_msg, sensor_one)) {
                 process_and_send(&local_msg);
                 fflush(NULL);  // Flush all output streams
-                free(line);
-                line = NULL;
             }
 			break;
 		case CMD_DISABLE:
-			pthread_mutex_lock(&sensor_mutex);
 			if (sensor_one->mode == SMODE_M2) {
 				sensor_one->mode = SMODE_M4;
 			}
@@ -380,15 +510,20 @@ void handle_command(CommandType cmd, ParsedCommand *p_cmd) {
 			if (sensor_one->mode == SMODE_M15) {
 				sensor_one->mode = SMODE_M14;
 			}
-		    pthread_cond_broadcast(&sensor_cond); // Wake up the thread, if it was sleeping.
-			pthread_mutex_unlock(&sensor_mutex);
 			break;
 		case CMD_UNIT_ID:
-		    char unit_id_msg[MAX_LINE_LENGTH];
-			pthread_mutex_lock(&sensor_mutex);
-		    snprintf(unit_id_msg, sizeof(unit_id_msg), "%c", sensor_one->address);
-			pthread_mutex_unlock(&sensor_mutex);
-    		safe_serial_write(serial_fd, "\x02%s\x03%02X\r\n", unit_id_msg, checksumXOR(unit_id_msg));
+		    char unit_id_msg[2];
+		    unit_id_msg[0] = sensor_one->address;
+			unit_id_msg[1] = '\0';
+			char cs_str[8];
+			snprintf(cs_str, sizeof(cs_str), "%02X\r\n", checksumXOR(unit_id_msg));
+			struct iovec unit_frame[] = { // <STX>A<ETX>XX<CR><LF>
+				{ (void *)"\x02", 1 },
+				{ unit_id_msg, 1 },
+				{ (void *)"\x03", 1 },
+				{ cs_str, 4 },
+			};
+			serial_writev(serial_fd, unit_frame, 4);
 			break;
 		case CMD_CONFIG:
 			// TODO: Unlikely we would need to configure the sensor on the fly.
@@ -432,20 +567,65 @@ void* signal_thread(void* arg) {
 
     terminate = 1;
 
-    // Now safely wake any threads
-    pthread_mutex_lock(&sensor_mutex);
-    pthread_cond_broadcast(&sensor_cond);
-    pthread_mutex_unlock(&sensor_mutex);
+    // Now safely wake the sender and the renderer
+    schedule_wake(&sender_sched);
+    frame_ring_wake(&frame_ring);
 
     return NULL;
 }
 
 
 
+/*
+ * Name:         publish_sensor
+ * Purpose:      Publishes sensor_one to the sender thread, and wakes it if anything changed.
+ * Arguments:    None.
+ *
+ * Output:       None.
+ * Modifies:     sensor_shared, sensor_lock.
+ * Returns:      None.
+ * Assumptions:  Called from the receiver thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Polls and unit id requests change nothing and are not published.
+ * 				 The wake is remembered by sender_sched until the sender next
+ * 				 waits, so a change is never missed.
+ */
+static void publish_sensor(void) {
+	if (memcmp(&sensor_shared, sensor_one, sizeof(sensor_shared)) == 0) return;
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared));
+	schedule_wake(&sender_sched); // Wake up the thread, if it was sleeping.
+}
+
+/*
+ * Name:         on_serial_line
+ * Purpose:      Line handler for the serial reader, parses each received line as a command
+ *               and sends it to handle_command(), then publishes the result.
+ * Arguments:    line: the received command, CR/LF removed and NULL terminated.
+ *               ctx: unused.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  Called from receiver_thread() only.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void on_serial_line(char *line, void *ctx) {
+    (void)ctx;
+    ParsedCommand local_cmd;
+    CommandType cmd_type = parse_command(line, &local_cmd);
+    WX_TRACE2(command_parsed, serial_fd, cmd_type);
+    handle_command(cmd_type, &local_cmd); // handle received command here, sensor_one is ours.
+    WX_TRACE2(command_handled, serial_fd, cmd_type);
+    publish_sensor();
+}
+
 /*
  * Name:         receiver_thread
- * Purpose:      thread which reads from a serial port, checks if there is data, if there is data read,
- *               it parses the string as a command, and sends the command to handle_command() function.
+ * Purpose:      thread which waits on the serial port with serial_reader_run(), and hands each
+ *               received line to on_serial_line().
  * Arguments:    arg: thread arguments.
  *
  * Output:       None.
@@ -455,44 +635,16 @@ void* signal_thread(void* arg) {
  */
 void* receiver_thread(void* arg) {
     (void)arg;
-    char line[MAX_CMD_LENGTH];
-    size_t len = 0;
-
-    while (!terminate) {
-        char c;
-        int n = read(serial_fd, &c, 1);
-        if (n > 0) {
-	    	if (c == '\r' || c == '\n') {
-                if (len > 0) {
-                    line[len] = '\0'; // Terminate with NULL for safety.
-
-                    ParsedCommand local_cmd;
-                    CommandType cmd_type = parse_command(line, &local_cmd);
-		    		handle_command(cmd_type, &local_cmd); // handle received command here.
-                    len = 0;
-                } else { // empty line ignore
-                }
-            } else {
-              	  if (len < sizeof(line)-1) {
-				      line[len++] = c;
-                  } else {
-                    	len = 0;
-                  }
-              }
-        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("read");
-        } else {
-            // no data available n == 0, avoid busy loop
-            usleep(CPU_WAIT_USEC);
-        }
-    }
+    SerialLineReader reader;
+    serial_reader_init(&reader, serial_fd, on_serial_line, NULL);
+    serial_reader_run(&reader, &terminate);
     return NULL;
 }
 
 /*
  * Name:         sender_thread
  * Purpose:      On continuous == 1 and assuming terminate != 1 it will get the next line from a specified file, usinf
- *               get_next_line_copy() and send that line to the serial device using safe_write_response() function every 2 seconds.
+ *               replay_next_line() and send that line to the serial device using safe_write_response() function every 2 seconds.
  * Arguments:    arg: thread arguments.
  *
  * Output:       Error messages if encountered, prints to serial device.
@@ -501,68 +653,126 @@ void* receiver_thread(void* arg) {
  * Assumptions:  serial port will have data, and that data will translate to a command.
  *
  * Bugs:         None known.
- * Notes:
+ * Notes:        Sends on sender_sched deadlines, each one the previous deadline
+ * 				 plus output_rate, so 4 Hz output stays at 4 Hz over any run.
  */
 void* sender_thread(void* arg) {
     (void)arg;
-    struct timespec ts;
-	bool should_send = false;
-	long interval = 0;
-
-	clock_gettime(CLOCK_MONOTONIC, &ts);
+	WO75_sensor cfg; // Snapshot of sensor_one, private to this thread.
+	seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
+	bool was_polled = false;
+	unsigned replay_gen = replay_generation(replay_src);
 
     while (!terminate) {
+		// is_ready_to_send() checks if the sensor is Polling or Continuous.
+		if (WO75_is_ready_to_send(&cfg)) {
+			if (was_polled) frame_ring_drain(&frame_ring); // Rendered before the sensor was polled, too old to send.
+			was_polled = false;
+			schedule_start(&sender_sched, (uint64_t)cfg.output_rate); // Nanoseconds, keeps its phase while the rate is unchanged.
+		} else {
+			// If in Polling/Stop Mode, wait indefinitely for the receiver to publish a change.
+			schedule_stop(&sender_sched);
+			was_polled = true;
+		}
+
+		ScheduleEvent event = schedule_wait(&sender_sched);
+        if (terminate) break;
+		if (event == SCHEDULE_ERROR) {
+			safe_console_error("%s: sender schedule failed: %s\n", program_name, strerror(errno));
+			break;
+		}
+		if (event == SCHEDULE_WOKEN) {
+			seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg)); // The receiver has published since.
+			continue;
+		}
+
+		unsigned gen = replay_generation(replay_src);
+		if (gen != replay_gen) { // Rendered from the data file before it was reloaded.
+			frame_ring_drain(&frame_ring);
+			replay_gen = gen;
+		}
+
+        // Do I/O operations WITHOUT holding the mutex, the frame is already rendered.
+		send_ring_frame(&cfg);
+    }
+    return NULL;
+}
 
-        pthread_mutex_lock(&sensor_mutex);
-		// Determine if we should wait for a specific time or indefinitely
-		interval = sensor_one->output_rate; // If we are in polled mode, output_rate is zero.
-
-		long long total_nsec = (long long)ts.tv_nsec + interval;
-		ts.tv_sec  += total_nsec / NS_PER_SEC; // 1000000000LL
-		ts.tv_nsec  = total_nsec % NS_PER_SEC; // 1000000000LL
-
-        if (sensor_one != NULL && !(sensor_one->mode == SMODE_M3 || sensor_one->mode == SMODE_M4 || sensor_one->mode == SMODE_M14)) {
-            // Wait until that specific interval time has passed OR a signal interrupts this thread.
-            pthread_cond_timedwait(&sensor_cond, &sensor_mutex, &ts);
-        } else {
-            // If in Polling/Stop Mode, wait indefinitely for a signal from the receiver
-            pthread_cond_wait(&sensor_cond, &sensor_mutex); // pthread_cond_wait atomically releases the mutex while it sleeps, so receiver_thread can acquire sensor_mutex.
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-        }
-
-        if (terminate) {
-            pthread_mutex_unlock(&sensor_mutex);
-            break;
-        }
-
-        // is_ready_to_send() handles the interval and timing logic internally, and checks if the sensor is Polling or Continuous.
-        should_send = (sensor_one != NULL && WO75_is_ready_to_send(sensor_one));
-
-		pthread_mutex_unlock(&sensor_mutex);  // <-- UNLOCK BEFORE I/O
-
-        // Do I/O operations WITHOUT holding the mutex
-        if (should_send) {
-			char *line = get_next_line_copy(file_ptr, &file_mutex);
+/*
+ * Name:         frame_render_thread
+ * Purpose:      Keeps frame_ring full of ready to write continuous frames.
+ * Arguments:    arg: thread arguments.
+ *
+ * Output:       None.
+ * Modifies:     frame_ring, advances the replay cursor.
+ * Returns:      NULL.
+ * Assumptions:  frame_ring was initialized, this is its only producer.
+ *
+ * Bugs:         None known.
+ * Notes:        Sleeps while the ring is full, so it reads at most FRAME_RING_SLOTS
+ * 				 records ahead of the sender. An empty frame is queued when the
+ * 				 data file has no line, as the sender then sends nothing.
+ */
+void* frame_render_thread(void* arg) {
+    (void)arg;
+	WO75_sensor cfg; // Snapshot for the units, taken per frame.
 
-            if (line) {
-                ParsedMessage local_msg;  // LOCAL, not global
-                parse_message(line, &local_msg);
-                process_and_send(&local_msg);
-                fflush(NULL);  // Flush all output streams
-                free(line);
-                line = NULL;
-            }
-			// Update timestamp with lock. Note: this is not a required step, as we removed this logic from WO75_is_ready_to_send().
-            pthread_mutex_lock(&sensor_mutex);
-            if (sensor_one != NULL) {
-                clock_gettime(CLOCK_MONOTONIC, &sensor_one->last_send_time);
-            }
-            pthread_mutex_unlock(&sensor_mutex);
-        }
+    while (!terminate) {
+		RingFrame *slot = frame_ring_claim(&frame_ring);
+		if (!slot) continue; // Woken with the ring full, check terminate.
+		if (terminate) break;
+
+		seqlock_read(&sensor_lock, &cfg, &sensor_shared, sizeof(cfg));
+		ParsedMessage local_msg;
+		int len = next_message(&local_msg, &cfg) ? WO75_format_frame(&local_msg, slot->bytes, sizeof(slot->bytes)) : 0;
+		slot->len = (uint16_t)(len > 0 ? len : 0);
+		slot->tag = (uint16_t)cfg.units;
+		frame_ring_publish(&frame_ring);
     }
     return NULL;
 }
 
+/*
+ * Name:         parse_rate_option
+ * Purpose:      Takes --rate HZ or --rate=HZ off the command line.
+ * Arguments:    argc: the argument count, reduced by the arguments taken.
+ * 				 argv: the arguments, the rest are kept in order.
+ * 				 output_rate: receives the interval in nanoseconds, left alone if --rate is absent.
+ *
+ * Output:       Error message to stderr on a bad rate.
+ * Modifies:     argc, argv, output_rate.
+ * Returns:      0 on success, -1 if the rate is not 1 to WO75_MAX_RATE_HZ.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Mirrors replay_parse_options().
+ */
+static int parse_rate_option(int *argc, char **argv, long *output_rate) {
+	int out = 1;
+	for (int i = 1; i < *argc; i++) {
+		const char *value = NULL;
+		if (strncmp(argv[i], "--rate=", 7) == 0) {
+			value = argv[i] + 7;
+		} else if (strcmp(argv[i], "--rate") == 0 && i + 1 < *argc) {
+			value = argv[++i];
+		} else {
+			argv[out++] = argv[i]; // Not ours, keep it in order.
+			continue;
+		}
+
+		char *end = NULL;
+		long hz = strtol(value, &end, 10);
+		if (end == value || (*end != '\0' && strcasecmp(end, "hz") != 0) || hz < 1 || hz > WO75_MAX_RATE_HZ) {
+			fprintf(stderr, "Invalid --rate '%s': use 1 to %d outputs per second\n", value, WO75_MAX_RATE_HZ);
+			return -1;
+		}
+		*output_rate = (long)(NS_PER_SEC / hz);
+	}
+	argv[out] = NULL;
+	*argc = out;
+	return 0;
+}
+
 /*
  * Name:         Main
  * Purpose:      Main funstion, which opens up serial port, and creates a receiver and transmit threads to listen, and respond to commands
@@ -588,18 +798,36 @@ void* sender_thread(void* arg) {
  */
 int main(int argc, char *argv[]) {
 
+    ReplayOptions replay_opts;
+    if (replay_parse_options(&argc, argv, &replay_opts) != 0) cleanup_and_exit(1); // Strips --start/--end/--speed/--live.
+	long output_rate = 0; // 0 keeps the sensor's default rate.
+	if (parse_rate_option(&argc, argv, &output_rate) != 0) cleanup_and_exit(1);
+	MetricsOptions metrics_opts;
+	if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) cleanup_and_exit(1); // Strips --metrics.
+	CaptureOptions capture_opts;
+	if (capture_parse_options(&argc, argv, &capture_opts) != 0) cleanup_and_exit(1); // Strips --capture.
+	UpsampleOptions upsample_opts;
+	if (upsample_parse_options(&argc, argv, &upsample_opts) != 0) cleanup_and_exit(1); // Strips --upsample/--noise/--seed.
+
     if (argc < 2) {
-        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485>\n", argv[0]);
+        safe_console_error("Usage: %s <file_path> <serial_device> <baud_rate> <RS422|RS485> [--start T] [--end T] [--speed N|max] [--live[=latest|block|repeat]] [--live-depth N] [--upsample[=linear|cubic]] [--noise K] [--seed N] [--rate HZ] [--metrics PATH] [--capture PATH]\n", argv[0]);
         cleanup_and_exit(1);
     }
 	program_name = argv[0]; // Global variable to hold the program name for console errors.
     file_path = argv[1];
 
-    file_ptr = fopen(file_path, "r");
-    if (!file_ptr) {
+    if (replay_open(&replay_src, file_path) != 0) {
         safe_console_error("Failed to open file: %s\n", strerror(errno));
 		cleanup_and_exit(1);
     }
+    if (replay_check_records(replay_src, "wind", sizeof(ParsedMessage)) != 0) {
+        safe_console_error("%s: %s was not converted for this sensor or this build, rerun wxb_convert\n", program_name, file_path);
+        cleanup_and_exit(1);
+    }
+    if (replay_apply_options(replay_src, &replay_opts, NULL, DATA_PERIOD_MS) != 0) cleanup_and_exit(1);
+    if (replay_start_live(replay_src, &replay_opts, sizeof(ParsedMessage), live_parse) != 0) cleanup_and_exit(1);
+    if (upsample_init(&upsampler, &upsample_opts, sizeof(ParsedMessage), WO75_upsample_fields, WO75_UPSAMPLE_FIELDS,
+                      DATA_PERIOD_MS * 1000000LL, upsample_fetch, NULL, replay_src) != 0) cleanup_and_exit(1);
     //ternary statement to set SERIAL_PORT if supplied in args or the default
     const char *device = (argc >= 3 && is_valid_tty(argv[2]) == 0) ? argv[2] : SERIAL_PORT;
 
@@ -614,10 +842,16 @@ int main(int argc, char *argv[]) {
         cleanup_and_exit(1);
     }
 
+    if (serial_tx_attach(serial_fd) != 0) {
+        safe_console_error("Failed to create transmit queue, writing directly\n");
+    }
+
 	if (init_WO75_sensor(&sensor_one) != 0) {
         safe_console_error("Failed to initialize sensor_one\n");
 	  	cleanup_and_exit(1);
     }
+	if (output_rate > 0) sensor_one->output_rate = output_rate;
+	seqlock_write(&sensor_lock, &sensor_shared, sensor_one, sizeof(sensor_shared)); // The sender's first snapshot.
     // define a signal handler, to capture kill signals and instead set our volatile bool 'terminate' to true,
     // allowing our c program, to close its loop, join threads, and close our serial device.
 	sigset_t block_set;
@@ -626,22 +860,23 @@ int main(int argc, char *argv[]) {
 	sigaddset(&block_set, SIGTERM);
 	sigaddset(&block_set, SIGQUIT);
 	pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+	if (replay_watch(replay_src) != 0) cleanup_and_exit(1); // Reloads the data file on change or SIGHUP.
 
-	// Initialize the send condition to use CLOCK_MONOTONIC
-	pthread_condattr_t attr;
-	int ret = 0;
-	if ((ret = pthread_condattr_init(&attr)) != 0) {
-    	fprintf(stderr, "Fatal: pthread_condattr_init failed: %d\n", ret);
+	// Continuous mode deadlines for the sender. Missed frames are caught up, so the
+	// frame count always matches the elapsed time at the configured rate.
+	if (schedule_init(&sender_sched, SCHEDULE_CATCH_UP) != 0) {
+    	fprintf(stderr, "Fatal: schedule_init failed: %s\n", strerror(errno));
 	 	cleanup_and_exit(1);
 	}
-    if ((ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) != 0) {
-    	fprintf(stderr, "Fatal: pthread_condattr_setclock failed: %d\n", ret);
-    	pthread_condattr_destroy(&attr);
-	  	cleanup_and_exit(1);
+	if (frame_ring_init(&frame_ring) != 0) {
+    	fprintf(stderr, "Fatal: frame_ring_init failed: %s\n", strerror(errno));
+	 	cleanup_and_exit(1);
 	}
-    pthread_cond_init(&sensor_cond, &attr); // Initialize the global variable here
-	sensor_cond_init = true;
-    pthread_condattr_destroy(&attr);
+	frame_ring_init_done = true;
+
+	if (metrics_start(&metrics_opts, program_name) != 0) cleanup_and_exit(1);
+	if (capture_start(&capture_opts, program_name) != 0) cleanup_and_exit(1);
+	metrics_watch_replay(replay_src);
 
 	if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
         safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
@@ -655,6 +890,17 @@ int main(int argc, char *argv[]) {
 		cleanup_and_exit(1);
     } else recv_thread_created = true;
 
+	// The renderer starts first, so the ring has frames by the sender's first tick.
+	// A live feed or an upsampled file is rendered on the tick instead, frames rendered ahead
+	// would be stale or interpolated for the wrong time.
+    if (!replay_is_live(replay_src) && upsampler.mode == UPSAMPLE_OFF) {
+        if (pthread_create(&render_thread, NULL, frame_render_thread, NULL) != 0) {
+            safe_console_error("Failed to create render thread: %s\n", strerror(errno));
+            terminate = 1;          // <- needed because recv_thread is running
+            cleanup_and_exit(1);
+        } else render_thread_created = true;
+    }
+
     if (pthread_create(&send_thread, NULL, sender_thread, NULL) != 0) {
         safe_console_error("Failed to create sender thread: %s\n", strerror(errno));
         terminate = 1;          // <- needed because recv_thread is running
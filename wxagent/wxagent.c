@@ -0,0 +1,1694 @@
+/*
+ * File:     wxagent.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Node agent for a rig spread over several machines. One wxagent
+ *           runs on each node and starts, stops and supervises the emulators
+ *           on it for sensor_control, over one TCP connection that carries
+ *           every sensor on the node, see agent_utils.h for the protocol.
+ *
+ *           Sensor_control does not wait on a reply before sending the next
+ *           request, and the agent answers every request it has read in one
+ *           write, so bringing up a node's sensors costs one round trip, not
+ *           one per sensor. State changes, exits, restarts and the counters
+ *           scraped from each sensor's --metrics socket, are gathered for
+ *           AGENT_BATCH_MS and sent together.
+ *
+ *           The agent supervises its sensors itself, with the same restart
+ *           backoff as sensor_control, so a node keeps its sensors running
+ *           when the controller goes away and reports them all again to the
+ *           next one that connects. A new connection replaces the old one.
+ *
+ *           Everything runs from one thread and one epoll set, as wxsensord:
+ *           the listener and controller sockets, every sensor's stdout and
+ *           stderr pipes, the metrics scrapes, a timerfd that ticks every
+ *           AGENT_BATCH_MS and a signalfd for SIGCHLD and the shutdown signals.
+ *
+ *           Programs and files are resolved under the agent's root, the
+ *           working directory or --root DIR, and may not leave it. A put is
+ *           written through no symbolic link and never into bin/, so the
+ *           programs the agent runs cannot be replaced over the link.
+ *
+ *           The agent listens on the loopback address unless --listen says
+ *           otherwise. With --token-file PATH a controller must give the
+ *           file's first line in its hello before any other request, and is
+ *           dropped if it does not. A new connection replaces the controller
+ *           only once its hello holds the token. Without a token, anyone who
+ *           can reach the port can run the programs under the root.
+ *
+ * Usage:    wxagent [--listen [HOST]:PORT] [--root DIR] [--token-file PATH]
+ *           e.g. wxagent --root /home/pi/wxsensors
+ *                wxagent --listen 192.168.10.21:7400 --token-file /home/pi/.wxagent_token
+ *
+ * Mods:     14/10/2026 Listens on 127.0.0.1 by default, --token-file, and put
+ *           refuses bin/ and symbolic links.
+ *           14/10/2026 With a token, a new connection waits for its hello
+ *           before it replaces the authenticated controller.
+ *
+ */
+
+#define _GNU_SOURCE // accept4(), pipe2(), strchrnul()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "agent_utils.h"
+#include "console_utils.h"
+
+#define DEFAULT_LISTEN "127.0.0.1:7400" // Loopback only, AGENT_PORT.
+#define LISTEN_BACKLOG 4
+#define MAX_EPOLL_EVENTS 32
+#define NAME_MAX_LEN 64                // Longest sensor name.
+#define TAG_MAX_LEN 64                 // Longest request tag.
+#define RESTART_MIN_MS 1000            // First restart delay after a crash.
+#define RESTART_MAX_MS 60000           // The delay doubles up to this.
+#define RESTART_STABLE_MS 30000        // A run this long resets the delay.
+#define STOP_KILL_MS 3000              // SIGKILL a sensor that has not exited this long after SIGTERM.
+#define SCRAPE_MS 1000                 // Time between metrics scrapes of one sensor.
+#define SCRAPE_MAX 262144              // Largest metrics page read.
+#define LOG_LINE_MAX 1024              // Output this long without a newline is sent as a line.
+#define LOG_BACKLOG 262144             // Output lines are dropped while this much waits for the controller.
+#define OUT_MAX (16u << 20)            // A controller this far behind is dropped.
+#define PUT_MAX ((uint64_t)4 << 30)    // Largest file a put may write.
+#define PUT_REFUSED_DIR "bin"          // Top directory a put may not write into, the programs the agent runs.
+#define TOKEN_MAX 256                  // Longest --token-file token.
+
+// epoll_event.data.u64 carries the sensor index in the upper half and the fd kind in the lower.
+#define EV_KIND_LISTEN 1u
+#define EV_KIND_CLIENT 2u
+#define EV_KIND_SIGNAL 3u
+#define EV_KIND_TICK   4u
+#define EV_KIND_OUT    5u
+#define EV_KIND_ERR    6u
+#define EV_KIND_SCRAPE 7u
+#define EV_KIND_PENDING 8u
+#define EV_TAG(idx, kind) (((uint64_t)(idx) << 32) | (kind))
+#define EV_INDEX(tag) ((size_t)((tag) >> 32))
+#define EV_KIND(tag) ((uint32_t)((tag) & 0xFFFFFFFFu))
+
+const char *program_name = "wxagent";
+
+// One sensor defined by the controller.
+typedef struct {
+    char *name;                        // NULL for a free slot.
+    char **argv;                       // Executable then the arguments, NULL terminated.
+    const char *metrics_path;          // The --metrics socket, into argv, NULL without one.
+    bool restart;                      // Restart after a crash.
+    AgentState state;
+    pid_t pid;                         // 0 when not running.
+    bool stopping;                     // Stop was asked for, the exit is not a crash.
+    char exit_text[16];                // The <exit> field of the sensor event.
+    unsigned restarts;
+    unsigned backoff_ms;
+    int64_t started_ms;
+    int64_t restart_at_ms;             // 0 when no restart is due.
+    int64_t kill_at_ms;                // 0 when no SIGKILL is due.
+    int out_fd;                        // Read ends of the sensor's stdout and stderr, -1 when closed.
+    int err_fd;
+    AgentBuffer out_text;              // Output not yet ended by a newline.
+    AgentBuffer err_text;
+    int scrape_fd;                     // Metrics scrape in progress, -1 for none.
+    AgentBuffer scrape;
+    int64_t scrape_at_ms;              // Next scrape, or the deadline of the one in progress.
+    uint64_t frames;                   // From the last scrape.
+    uint64_t bytes;
+    bool dirty;                        // Changed since its last sensor event.
+} AgentSensor;
+
+// The connected controller, at most one.
+typedef struct {
+    int fd;                            // -1 when none is connected.
+    bool authenticated;                // Requests are taken, a hello gave the token or none is needed.
+    AgentBuffer in;
+    AgentBuffer out;
+    bool want_out;                     // EPOLLOUT is in the interest set.
+    unsigned long logs_dropped;        // Output lines not sent while the link was behind.
+    // The put whose bytes are being read.
+    bool put_active;
+    uint64_t put_left;
+    uint64_t put_size;
+    int put_fd;                        // The temporary file, -1 once the put has failed.
+    int put_dir_fd;                    // The directory it is in, opened without following links.
+    char put_error[128];
+    char put_tag[TAG_MAX_LEN + 1];
+    char put_path[PATH_MAX];
+    char put_name[NAME_MAX + 1];       // The file's name in put_dir_fd.
+    char put_tmp[NAME_MAX + 1];        // The temporary file's name there.
+} AgentClient;
+
+// Request handler, fields[0] is the tag and fields[1] the verb.
+typedef void (*RequestFn)(char **fields, int count);
+
+typedef struct {
+    const char *verb;
+    int min_fields;                    // Tag and verb included.
+    int max_fields;
+    RequestFn handler;
+} AgentRequest;
+
+static AgentSensor *sensors = NULL;
+static size_t sensor_count = 0;        // Slots in use or free, indices never move.
+static AgentClient client = { .fd = -1, .put_fd = -1, .put_dir_fd = -1 };
+static int pending_fd = -1;              // A controller waiting to replace the authenticated one.
+static AgentBuffer pending_in;           // What it has sent, its hello first.
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int tick_fd = -1;
+static int listen_fd = -1;
+static char host_name[256] = "unknown";
+static char token[TOKEN_MAX + 1] = "";   // From --token-file, "" for none.
+
+/*
+ * Name:         now_ms
+ * Purpose:      Monotonic time for deadlines.
+ * Returns:      Milliseconds on CLOCK_MONOTONIC.
+ */
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Name:         watch_fd
+ * Purpose:      Adds an fd to the epoll set.
+ * Returns:      0 on success, -1 with errno set.
+ */
+static int watch_fd(int fd, uint32_t events, uint64_t tag) {
+    struct epoll_event ev = { .events = events, .data.u64 = tag };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Name:         close_watched
+ * Purpose:      Takes an fd out of the epoll set and closes it.
+ */
+static void close_watched(int *fd) {
+    if (*fd < 0) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+/*
+ * Name:         valid_name
+ * Purpose:      Checks a sensor or program name, letters, digits, '_', '-' and '.'
+ *               not first, so it is safe in a path.
+ */
+static bool valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > NAME_MAX_LEN || name[0] == '.' || name[0] == '-') return false;
+    for (const char *p = name; *p; p++) {
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+              *p == '_' || *p == '-' || *p == '.')) return false;
+    }
+    return true;
+}
+
+/*
+ * Name:         valid_path
+ * Purpose:      Checks that a path stays under the root: relative, with no ".." component.
+ */
+static bool valid_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/' || strlen(path) >= PATH_MAX) return false;
+    for (const char *p = path; *p;) {
+        const char *end = strchrnul(p, '/');
+        if (end - p == 2 && p[0] == '.' && p[1] == '.') return false;
+        p = *end ? end + 1 : end;
+    }
+    return path[strlen(path) - 1] != '/';
+}
+
+/*
+ * Name:         find_sensor
+ * Purpose:      Looks up a defined sensor by name.
+ * Returns:      The sensor, or NULL.
+ */
+static AgentSensor *find_sensor(const char *name) {
+    for (size_t i = 0; i < sensor_count; i++) {
+        if (sensors[i].name && strcmp(sensors[i].name, name) == 0) return &sensors[i];
+    }
+    return NULL;
+}
+
+/*
+ * Name:         send_fields
+ * Purpose:      Queues one line of fields for the controller, NULL terminated.
+ */
+static void send_fields(const char *field, ...) __attribute__((sentinel));
+static void send_fields(const char *field, ...) {
+    const char *f[AGENT_FIELDS_MAX];
+    size_t n = 0;
+    va_list args;
+    va_start(args, field);
+    for (const char *p = field; p && n < AGENT_FIELDS_MAX; p = va_arg(args, const char *)) f[n++] = p;
+    va_end(args);
+    if (client.fd < 0 || (!client.authenticated && strcmp(field, "*") == 0)) return; // No events before the hello.
+    agent_buffer_fields(&client.out, f, n);
+}
+
+/*
+ * Name:         reply_error
+ * Purpose:      Queues an err reply with a formatted message.
+ */
+static void reply_error(const char *tag, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void reply_error(const char *tag, const char *fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    send_fields(tag, "err", msg, NULL);
+}
+
+/*
+ * Name:         send_log
+ * Purpose:      Queues a log event for a sensor's output line or a note about it.
+ * Arguments:    s: the sensor.
+ * 				 stream: "out", "err" or "note".
+ * 				 text: the line, without its newline.
+ *
+ * Output:       None.
+ * Modifies:     client.out, client.logs_dropped.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Output lines are dropped while LOG_BACKLOG bytes wait for a slow
+ * 				 link, so a chatty sensor cannot hold up the sensor events, and
+ * 				 the count is reported once the link has caught up. Notes are
+ * 				 always sent.
+ */
+static void send_log(AgentSensor *s, const char *stream, const char *text) {
+    if (client.fd < 0) return;
+    bool note = strcmp(stream, "note") == 0;
+    if (!note && agent_buffer_pending(&client.out) > LOG_BACKLOG) {
+        client.logs_dropped++;
+        return;
+    }
+    if (client.logs_dropped > 0 && agent_buffer_pending(&client.out) <= LOG_BACKLOG) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "%lu lines of output dropped, the link was behind", client.logs_dropped);
+        client.logs_dropped = 0;
+        send_fields("*", "log", s->name, "note", msg, NULL);
+    }
+    send_fields("*", "log", s->name, stream, text, NULL);
+}
+
+/*
+ * Name:         note
+ * Purpose:      Sends a note about a sensor to the controller and prints it.
+ */
+static void note(AgentSensor *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void note(AgentSensor *s, const char *fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    safe_console_print("%s: %s: %s\n", program_name, s->name, msg);
+    send_log(s, "note", msg);
+}
+
+/*
+ * Name:         send_sensor
+ * Purpose:      Queues the sensor event for one sensor.
+ */
+static void send_sensor(AgentSensor *s) {
+    char pid[16], restarts[16], frames[24], bytes[24];
+    snprintf(pid, sizeof(pid), "%d", (int)s->pid);
+    snprintf(restarts, sizeof(restarts), "%u", s->restarts);
+    snprintf(frames, sizeof(frames), "%llu", (unsigned long long)s->frames);
+    snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long)s->bytes);
+    send_fields("*", "sensor", s->name, agent_state_name(s->state), pid, restarts, s->exit_text, frames, bytes, NULL);
+    s->dirty = false;
+}
+
+/*
+ * Name:         abandon_put
+ * Purpose:      Closes and removes a put's temporary file, and its directory.
+ */
+static void abandon_put(void) {
+    if (client.put_fd >= 0) {
+        close(client.put_fd);
+        unlinkat(client.put_dir_fd, client.put_tmp, 0);
+    }
+    client.put_fd = -1;
+    if (client.put_dir_fd >= 0) close(client.put_dir_fd);
+    client.put_dir_fd = -1;
+}
+
+/*
+ * Name:         drop_client
+ * Purpose:      Closes the controller connection and abandons a put in progress.
+ * Arguments:    why: printed with the disconnect.
+ *
+ * Output:       A line on stdout.
+ * Modifies:     client.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The sensors keep running, the next controller is sent all of them.
+ */
+static void drop_client(const char *why) {
+    if (client.fd < 0) return;
+    safe_console_print("%s: controller disconnected, %s\n", program_name, why);
+    close_watched(&client.fd);
+    abandon_put();
+    client.put_active = false;
+    client.authenticated = false;
+    client.want_out = false;
+    client.logs_dropped = 0;
+    agent_buffer_free(&client.in);
+    agent_buffer_free(&client.out);
+}
+
+/*
+ * Name:         flush_client
+ * Purpose:      Writes what the controller has waiting, watching for EPOLLOUT while
+ *               the socket is full.
+ */
+static void flush_client(void) {
+    if (client.fd < 0) return;
+    int rc = agent_buffer_flush(&client.out, client.fd);
+    if (rc < 0) {
+        drop_client(strerror(errno));
+        return;
+    }
+    if (rc > 0 && agent_buffer_pending(&client.out) > OUT_MAX) {
+        drop_client("too far behind");
+        return;
+    }
+    bool want = rc > 0;
+    if (want != client.want_out) {
+        struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.u64 = EV_TAG(0, EV_KIND_CLIENT) };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &ev);
+        client.want_out = want;
+    }
+}
+
+/*
+ * Name:         close_sensor_fds
+ * Purpose:      Stops reading a sensor's pipes and any scrape in progress.
+ */
+static void close_sensor_fds(AgentSensor *s) {
+    close_watched(&s->out_fd);
+    close_watched(&s->err_fd);
+    close_watched(&s->scrape_fd);
+    agent_buffer_free(&s->out_text);
+    agent_buffer_free(&s->err_text);
+    agent_buffer_free(&s->scrape);
+}
+
+/*
+ * Name:         free_sensor
+ * Purpose:      Releases a sensor's slot, which a later define may reuse.
+ */
+static void free_sensor(AgentSensor *s) {
+    close_sensor_fds(s);
+    for (char **a = s->argv; a && *a; a++) free(*a);
+    free(s->argv);
+    free(s->name);
+    memset(s, 0, sizeof(*s));
+    s->out_fd = s->err_fd = s->scrape_fd = -1;
+}
+
+/*
+ * Name:         spawn_sensor
+ * Purpose:      Starts a sensor's program with its output piped back to the agent.
+ * Arguments:    s: the sensor, not running.
+ *
+ * Output:       None.
+ * Modifies:     s, the epoll set.
+ * Returns:      0 on success, or the errno of the failure, an exec failure included.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The child gets its own session, so stop can signal the sensor and
+ * 				 anything it starts, and the signal mask the agent blocked for its
+ * 				 signalfd is cleared. An exec failure is sent back on a close-on-exec
+ * 				 pipe, so a missing program is an err reply and not a crash.
+ */
+static int spawn_sensor(AgentSensor *s) {
+    int out[2], err[2], status[2];
+    if (pipe2(out, O_CLOEXEC) != 0) return errno;
+    if (pipe2(err, O_CLOEXEC) != 0) {
+        int e = errno;
+        close(out[0]);
+        close(out[1]);
+        return e;
+    }
+    if (pipe2(status, O_CLOEXEC) != 0) {
+        int e = errno;
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        return e;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        setsid();
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        execv(s->argv[0], s->argv);
+        int e = errno;
+        ssize_t unused = write(status[1], &e, sizeof(e));
+        (void)unused;
+        _exit(127);
+    }
+
+    int e = pid < 0 ? errno : 0;
+    close(out[1]);
+    close(err[1]);
+    close(status[1]);
+    if (pid > 0) {
+        ssize_t n;
+        do {
+            n = read(status[0], &e, sizeof(e)); // EOF once exec has closed it.
+        } while (n < 0 && errno == EINTR);
+        if (n != (ssize_t)sizeof(e)) e = 0;
+        else waitpid(pid, NULL, 0);
+    }
+    close(status[0]);
+    if (e != 0) {
+        close(out[0]);
+        close(err[0]);
+        return e;
+    }
+
+    size_t idx = (size_t)(s - sensors);
+    close_watched(&s->out_fd); // Pipes of the last run, something it started may hold them.
+    close_watched(&s->err_fd);
+    agent_buffer_free(&s->out_text);
+    agent_buffer_free(&s->err_text);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+    s->out_fd = out[0];
+    s->err_fd = err[0];
+    watch_fd(s->out_fd, EPOLLIN, EV_TAG(idx, EV_KIND_OUT));
+    watch_fd(s->err_fd, EPOLLIN, EV_TAG(idx, EV_KIND_ERR));
+
+    s->pid = pid;
+    s->state = AGENT_RUNNING;
+    s->stopping = false;
+    s->started_ms = now_ms();
+    s->restart_at_ms = 0;
+    s->kill_at_ms = 0;
+    s->scrape_at_ms = s->started_ms + SCRAPE_MS; // Give it time to open its socket.
+    s->frames = s->bytes = 0;
+    s->dirty = true;
+    return 0;
+}
+
+/*
+ * Name:         sensor_exited
+ * Purpose:      Records a sensor's exit and decides whether it restarts.
+ * Arguments:    s: the sensor.
+ * 				 wait_status: from waitpid().
+ *
+ * Output:       A note to the controller.
+ * Modifies:     s.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The same policy as sensor_control: a stop is never a crash, a
+ * 				 clean exit does not restart, and the backoff doubles up to
+ * 				 RESTART_MAX_MS, from RESTART_MIN_MS again after a stable run.
+ */
+static void sensor_exited(AgentSensor *s, int wait_status) {
+    bool clean = WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0;
+    int64_t now = now_ms();
+
+    s->pid = 0;
+    s->kill_at_ms = 0;
+    close_watched(&s->scrape_fd);
+    if (WIFSIGNALED(wait_status)) {
+        snprintf(s->exit_text, sizeof(s->exit_text), "%d", -WTERMSIG(wait_status));
+        note(s, "killed by signal %d (%s)", WTERMSIG(wait_status), strsignal(WTERMSIG(wait_status)));
+    } else {
+        snprintf(s->exit_text, sizeof(s->exit_text), "%d", WEXITSTATUS(wait_status));
+        note(s, "exited with status %d", WEXITSTATUS(wait_status));
+    }
+
+    if (s->stopping) {
+        s->state = AGENT_STOPPED;
+    } else if (!clean && s->restart) {
+        if (now - s->started_ms >= RESTART_STABLE_MS) s->backoff_ms = RESTART_MIN_MS;
+        note(s, "restarting in %.1f s", s->backoff_ms / 1000.0);
+        s->state = AGENT_RESTARTING;
+        s->restart_at_ms = now + s->backoff_ms;
+        s->backoff_ms = s->backoff_ms * 2 < RESTART_MAX_MS ? s->backoff_ms * 2 : RESTART_MAX_MS;
+    } else {
+        s->state = clean ? AGENT_STOPPED : AGENT_FAILED;
+    }
+    s->stopping = false;
+    s->dirty = true;
+}
+
+/*
+ * Name:         reap_children
+ * Purpose:      Collects every exited sensor after a SIGCHLD.
+ */
+static void reap_children(void) {
+    int wait_status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wait_status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < sensor_count; i++) {
+            if (sensors[i].name && sensors[i].pid == pid) {
+                sensor_exited(&sensors[i], wait_status);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Name:         handle_output
+ * Purpose:      Reads a sensor's stdout or stderr and forwards each whole line.
+ * Arguments:    s: the sensor.
+ * 				 is_err: stderr rather than stdout.
+ *
+ * Output:       Log events to the controller.
+ * Modifies:     s.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A run of LOG_LINE_MAX bytes with no newline, a sensor writing raw
+ * 				 frames, is sent as a line of its own. At end of file the rest is
+ * 				 sent and the pipe closed.
+ */
+static void handle_output(AgentSensor *s, bool is_err) {
+    int *fd = is_err ? &s->err_fd : &s->out_fd;
+    AgentBuffer *text = is_err ? &s->err_text : &s->out_text;
+    const char *stream = is_err ? "err" : "out";
+    if (*fd < 0) return;
+
+    ssize_t n = agent_buffer_fill(text, *fd);
+    bool done = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+    char *line;
+    while ((line = agent_buffer_line(text)) != NULL) send_log(s, stream, line);
+    if (agent_buffer_pending(text) >= LOG_LINE_MAX || (done && agent_buffer_pending(text) > 0)) {
+        agent_buffer_append(text, "\n", 1);
+        while ((line = agent_buffer_line(text)) != NULL) send_log(s, stream, line);
+    }
+    if (done) {
+        close_watched(fd);
+        agent_buffer_free(text);
+    }
+}
+
+/*
+ * Name:         start_scrape
+ * Purpose:      Connects to a sensor's --metrics socket and sends the request.
+ * Arguments:    s: the sensor, running with a metrics path.
+ *
+ * Output:       None.
+ * Modifies:     s, the epoll set.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Non-blocking throughout, a sensor slow to answer holds up only
+ * 				 its own scrape, which is abandoned at the next SCRAPE_MS. A
+ * 				 socket that is not there yet is tried again then.
+ */
+static void start_scrape(AgentSensor *s) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(s->metrics_path) >= sizeof(addr.sun_path)) return;
+    strcpy(addr.sun_path, s->metrics_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != (ssize_t)(sizeof(request) - 1) ||
+        watch_fd(fd, EPOLLIN, EV_TAG(s - sensors, EV_KIND_SCRAPE)) != 0) {
+        close(fd);
+        return;
+    }
+    s->scrape_fd = fd;
+    agent_buffer_free(&s->scrape);
+}
+
+/*
+ * Name:         page_total
+ * Purpose:      Sums every sample of one metric on a metrics page.
+ * Returns:      The total, 0 when the metric is not on the page.
+ */
+static uint64_t page_total(const char *page, const char *metric) {
+    size_t len = strlen(metric);
+    uint64_t total = 0;
+    for (const char *line = page; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, metric, len) != 0 || (line[len] != '{' && line[len] != ' ')) continue;
+        const char *end = strchrnul(line, '\n');
+        const char *value = end;
+        while (value > line && value[-1] != ' ') value--;
+        total += strtoull(value, NULL, 10);
+    }
+    return total;
+}
+
+/*
+ * Name:         handle_scrape
+ * Purpose:      Reads the metrics page and takes the sensor's frame and byte counts from it.
+ */
+static void handle_scrape(AgentSensor *s) {
+    if (s->scrape_fd < 0) return;
+    ssize_t n = agent_buffer_fill(&s->scrape, s->scrape_fd);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n > 0 && agent_buffer_pending(&s->scrape) <= SCRAPE_MAX) return;
+
+    close_watched(&s->scrape_fd);
+    if (n == 0 && agent_buffer_append(&s->scrape, "", 1) == 0) {
+        const char *page = s->scrape.data + s->scrape.head;
+        uint64_t frames = page_total(page, "wx_frames_sent_total");
+        uint64_t bytes = page_total(page, "wx_bytes_written_total");
+        if (frames != s->frames || bytes != s->bytes) s->dirty = true;
+        s->frames = frames;
+        s->bytes = bytes;
+    }
+    agent_buffer_free(&s->scrape);
+}
+
+/*
+ * Name:         token_matches
+ * Purpose:      Compares a hello's token with --token-file's, in time that does
+ *               not depend on where they differ.
+ */
+static bool token_matches(const char *given) {
+    size_t want = strlen(token), have = strlen(given);
+    unsigned char diff = (unsigned char)(want != have);
+    for (size_t i = 0; i < want; i++) diff |= (unsigned char)(token[i] ^ (i < have ? given[i] : 0));
+    return diff == 0;
+}
+
+/*
+ * Name:         request_hello
+ * Purpose:      hello <version> [token], answered with the agent's version and host name.
+ * Arguments:    f: the fields.
+ * 				 count: number of fields.
+ *
+ * Output:       The reply.
+ * Modifies:     client.authenticated, sensors' dirty flags.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        With --token-file a hello without the token is answered and
+ * 				 the controller dropped, see handle_request().
+ */
+static void request_hello(char **f, int count) {
+    if (token[0] && !token_matches(count > 3 ? f[3] : "")) {
+        reply_error(f[0], "wrong token");
+        flush_client();
+        drop_client("wrong token");
+        return;
+    }
+    if (strtol(f[2], NULL, 10) != AGENT_PROTOCOL) {
+        reply_error(f[0], "protocol %s, this agent speaks %d", f[2], AGENT_PROTOCOL);
+        return;
+    }
+    client.authenticated = true;
+    char version[16];
+    snprintf(version, sizeof(version), "%d", AGENT_PROTOCOL);
+    send_fields(f[0], "ok", "wxagent", version, host_name, NULL);
+    for (size_t i = 0; i < sensor_count; i++) {
+        if (sensors[i].name) sensors[i].dirty = true; // The new controller hears about every sensor.
+    }
+}
+
+/*
+ * Name:         request_define
+ * Purpose:      define <name> <program> <0|1> [arg ...], adds a sensor or changes one.
+ * Arguments:    f: the fields.
+ * 				 count: number of fields.
+ *
+ * Output:       The reply.
+ * Modifies:     sensors, which may move.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A program without a '/' is ./bin/<program>/<program>, as in
+ * 				 sensor_control. A running sensor keeps its old arguments until
+ * 				 it is next started.
+ */
+static void request_define(char **f, int count) {
+    const char *name = f[2], *program = f[3], *restart = f[4];
+    if (!valid_name(name)) {
+        reply_error(f[0], "bad sensor name '%s'", name);
+        return;
+    }
+    if (strcmp(restart, "0") != 0 && strcmp(restart, "1") != 0) {
+        reply_error(f[0], "restart is 0 or 1, not '%s'", restart);
+        return;
+    }
+    char executable[PATH_MAX];
+    if (strchr(program, '/')) {
+        if (!valid_path(program)) {
+            reply_error(f[0], "program '%s' is outside the agent's root", program);
+            return;
+        }
+        snprintf(executable, sizeof(executable), "%s%s", program[0] == '.' ? "" : "./", program);
+    } else if (valid_name(program)) {
+        snprintf(executable, sizeof(executable), "./bin/%s/%s", program, program);
+    } else {
+        reply_error(f[0], "bad program name '%s'", program);
+        return;
+    }
+
+    int args = count - 5;
+    char **argv = calloc((size_t)args + 2, sizeof(char *));
+    if (!argv) {
+        reply_error(f[0], "out of memory");
+        return;
+    }
+    bool ok = (argv[0] = strdup(executable)) != NULL;
+    const char *metrics_path = NULL;
+    for (int i = 0; ok && i < args; i++) {
+        ok = (argv[i + 1] = strdup(f[5 + i])) != NULL;
+        if (!ok) break;
+        if (strncmp(argv[i + 1], "--metrics=", 10) == 0) metrics_path = argv[i + 1] + 10;
+        else if (i > 0 && strcmp(argv[i], "--metrics") == 0) metrics_path = argv[i + 1];
+    }
+
+    AgentSensor *s = ok ? find_sensor(name) : NULL;
+    if (ok && !s) {
+        for (size_t i = 0; i < sensor_count && !s; i++) {
+            if (!sensors[i].name) s = &sensors[i];
+        }
+        if (!s) {
+            AgentSensor *grown = realloc(sensors, (sensor_count + 1) * sizeof(*sensors));
+            if (grown) {
+                sensors = grown;
+                s = &sensors[sensor_count++];
+                memset(s, 0, sizeof(*s));
+                s->out_fd = s->err_fd = s->scrape_fd = -1;
+            }
+        }
+        if (s && !(s->name = strdup(name))) s = NULL;
+        if (s) {
+            s->state = AGENT_STOPPED;
+            s->backoff_ms = RESTART_MIN_MS;
+            snprintf(s->exit_text, sizeof(s->exit_text), "-");
+        }
+        ok = s != NULL;
+    }
+    if (!ok) {
+        for (char **a = argv; *a; a++) free(*a);
+        free(argv);
+        reply_error(f[0], "out of memory");
+        return;
+    }
+
+    for (char **a = s->argv; a && *a; a++) free(*a);
+    free(s->argv);
+    s->argv = argv;
+    s->metrics_path = metrics_path;
+    s->restart = restart[0] == '1';
+    s->dirty = true;
+    send_fields(f[0], "ok", NULL);
+}
+
+/*
+ * Name:         request_start
+ * Purpose:      start <name>, answered with the pid.
+ */
+static void request_start(char **f, int count) {
+    (void)count;
+    AgentSensor *s = find_sensor(f[2]);
+    if (!s) {
+        reply_error(f[0], "no sensor '%s'", f[2]);
+        return;
+    }
+    char pid[16];
+    if (s->pid == 0) {
+        s->backoff_ms = RESTART_MIN_MS; // A start by request begins a fresh backoff.
+        int e = spawn_sensor(s);
+        if (e != 0) {
+            reply_error(f[0], "%s: %s", s->argv[0], strerror(e));
+            return;
+        }
+        note(s, "started %s (PID: %d)", s->argv[0], (int)s->pid);
+    }
+    snprintf(pid, sizeof(pid), "%d", (int)s->pid);
+    send_fields(f[0], "ok", pid, NULL);
+}
+
+/*
+ * Name:         request_stop
+ * Purpose:      stop <name>, SIGTERM to the sensor's process group, SIGKILL
+ *               STOP_KILL_MS later if it is still there.
+ */
+static void request_stop(char **f, int count) {
+    (void)count;
+    AgentSensor *s = find_sensor(f[2]);
+    if (!s) {
+        reply_error(f[0], "no sensor '%s'", f[2]);
+        return;
+    }
+    if (s->restart_at_ms) {
+        s->restart_at_ms = 0;
+        s->state = AGENT_STOPPED;
+        s->dirty = true;
+    }
+    if (s->pid > 0 && !s->stopping) {
+        s->stopping = true;
+        kill(-s->pid, SIGTERM);
+        s->kill_at_ms = now_ms() + STOP_KILL_MS;
+    }
+    send_fields(f[0], "ok", NULL);
+}
+
+/*
+ * Name:         request_reload
+ * Purpose:      reload <name>, SIGHUP to the sensor itself, which reloads its data file.
+ */
+static void request_reload(char **f, int count) {
+    (void)count;
+    AgentSensor *s = find_sensor(f[2]);
+    if (!s || s->pid <= 0 || s->stopping) {
+        reply_error(f[0], "'%s' is not running", f[2]);
+        return;
+    }
+    if (kill(s->pid, SIGHUP) != 0) {
+        reply_error(f[0], "%s", strerror(errno));
+        return;
+    }
+    note(s, "sent SIGHUP, reloading the data file");
+    send_fields(f[0], "ok", NULL);
+}
+
+/*
+ * Name:         request_forget
+ * Purpose:      forget <name>, removes a stopped sensor.
+ */
+static void request_forget(char **f, int count) {
+    (void)count;
+    AgentSensor *s = find_sensor(f[2]);
+    if (!s) {
+        reply_error(f[0], "no sensor '%s'", f[2]);
+        return;
+    }
+    if (s->pid > 0) {
+        reply_error(f[0], "'%s' is running, stop it first", f[2]);
+        return;
+    }
+    free_sensor(s);
+    send_fields(f[0], "ok", NULL);
+}
+
+/*
+ * Name:         open_put_dir
+ * Purpose:      Opens the directory a put's path is in, creating it as mkdir -p,
+ *               without following a symbolic link at any step.
+ * Arguments:    path: a relative path that passed valid_path().
+ * 				 name: set to the path's last component.
+ *
+ * Output:       None.
+ * Modifies:     name.
+ * Returns:      The directory's descriptor, or -1 with errno set, ELOOP where a
+ * 				 component is a symbolic link.
+ * Assumptions:  The working directory is the root, see main().
+ *
+ * Bugs:         None known.
+ * Notes:        Each component is opened with O_NOFOLLOW relative to the one
+ * 				 before, so no link under the root can take the put outside it.
+ */
+static int open_put_dir(const char *path, char name[NAME_MAX + 1]) {
+    int dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (const char *p = path; dir >= 0;) {
+        const char *end = strchrnul(p, '/');
+        size_t len = (size_t)(end - p);
+        if (len > NAME_MAX) {
+            close(dir);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        if (*end == '\0') return dir;
+        p = end + 1;
+        if (len == 0 || (len == 1 && name[0] == '.')) continue;
+        if (mkdirat(dir, name, 0755) != 0 && errno != EEXIST) {
+            close(dir);
+            return -1;
+        }
+        int next = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && errno == ENOTDIR) errno = ELOOP; // O_DIRECTORY reports a link to a file so.
+        close(dir);
+        dir = next;
+    }
+    return -1;
+}
+
+/*
+ * Name:         put_refused
+ * Purpose:      Checks whether a path is under PUT_REFUSED_DIR, where the programs are.
+ */
+static bool put_refused(const char *path) {
+    for (;;) {
+        if (path[0] == '.' && path[1] == '/') path += 2;
+        else if (path[0] == '/') path++;
+        else break;
+    }
+    size_t len = strlen(PUT_REFUSED_DIR);
+    return strncmp(path, PUT_REFUSED_DIR, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+/*
+ * Name:         open_put_tmp
+ * Purpose:      Creates a put's temporary file in its directory, refusing a link.
+ * Returns:      The file's descriptor, or -1 with errno set.
+ */
+static int open_put_tmp(void) {
+    static unsigned sequence;
+    for (int tries = 0; tries < 100; tries++) {
+        snprintf(client.put_tmp, sizeof(client.put_tmp), ".%.*s.put%d.%u",
+                 NAME_MAX - 32, client.put_name, (int)getpid(), sequence++);
+        int fd = openat(client.put_dir_fd, client.put_tmp,
+                        O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd >= 0 || errno != EEXIST) return fd;
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+/*
+ * Name:         request_put
+ * Purpose:      put <path> <size>, the next size bytes on the connection are the file.
+ * Arguments:    f: the fields.
+ * 				 count: number of fields.
+ *
+ * Output:       None, the reply follows the last byte, see finish_put().
+ * Modifies:     client.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The bytes go to a temporary file next to the path, which is
+ * 				 renamed over it at the end, so a sensor replaying the file
+ * 				 reloads it whole, see replay_watch(). A put that cannot be
+ * 				 written still reads its bytes, the requests after it are intact.
+ * 				 A put into bin/ or through a symbolic link is refused, see
+ * 				 open_put_dir().
+ */
+static void request_put(char **f, int count) {
+    (void)count;
+    char *end = NULL;
+    unsigned long long size = strtoull(f[3], &end, 10);
+    if (end == f[3] || *end != '\0' || f[3][0] == '-') {
+        reply_error(f[0], "bad size '%s'", f[3]); // The bytes cannot be skipped, drop the link.
+        flush_client();
+        drop_client("bad put size");
+        return;
+    }
+
+    client.put_active = true;
+    client.put_left = client.put_size = size;
+    abandon_put();
+    client.put_error[0] = '\0';
+    snprintf(client.put_tag, sizeof(client.put_tag), "%s", f[0]);
+    snprintf(client.put_path, sizeof(client.put_path), "%s", f[2]);
+
+    if (!valid_path(f[2])) {
+        snprintf(client.put_error, sizeof(client.put_error), "path '%s' is outside the agent's root", f[2]);
+    } else if (put_refused(f[2])) {
+        snprintf(client.put_error, sizeof(client.put_error), "path '%s' is under %s/, which a put may not write",
+                 f[2], PUT_REFUSED_DIR);
+    } else if (size > PUT_MAX) {
+        snprintf(client.put_error, sizeof(client.put_error), "%llu bytes is over the %llu byte limit",
+                 size, (unsigned long long)PUT_MAX);
+    } else if ((client.put_dir_fd = open_put_dir(f[2], client.put_name)) < 0) {
+        snprintf(client.put_error, sizeof(client.put_error), "%s", errno == ELOOP ?
+                 "the path goes through a symbolic link" : strerror(errno));
+    } else if (client.put_name[0] == '\0' || strcmp(client.put_name, ".") == 0) {
+        snprintf(client.put_error, sizeof(client.put_error), "path '%s' names no file", f[2]);
+        abandon_put();
+    } else if ((client.put_fd = open_put_tmp()) < 0) {
+        snprintf(client.put_error, sizeof(client.put_error), "%s", strerror(errno));
+        abandon_put();
+    }
+}
+
+/*
+ * Name:         finish_put
+ * Purpose:      Renames a complete put into place and replies.
+ */
+static void finish_put(void) {
+    client.put_active = false;
+    if (client.put_fd >= 0) {
+        if (fchmod(client.put_fd, 0644) != 0 || fsync(client.put_fd) != 0) {
+            snprintf(client.put_error, sizeof(client.put_error), "%s", strerror(errno));
+        }
+        if (close(client.put_fd) != 0 && !client.put_error[0]) {
+            snprintf(client.put_error, sizeof(client.put_error), "%s", strerror(errno));
+        }
+        client.put_fd = -1;
+        if (!client.put_error[0] &&
+            renameat(client.put_dir_fd, client.put_tmp, client.put_dir_fd, client.put_name) != 0) {
+            snprintf(client.put_error, sizeof(client.put_error), "%s", strerror(errno));
+        }
+        if (client.put_error[0]) unlinkat(client.put_dir_fd, client.put_tmp, 0);
+        else fsync(client.put_dir_fd);
+    }
+    abandon_put();
+    if (client.put_error[0]) {
+        send_fields(client.put_tag, "err", client.put_error, NULL);
+        return;
+    }
+    char size[24];
+    snprintf(size, sizeof(size), "%llu", (unsigned long long)client.put_size);
+    safe_console_print("%s: wrote %s, %s bytes\n", program_name, client.put_path, size);
+    send_fields(client.put_tag, "ok", size, NULL);
+}
+
+/*
+ * Name:         take_put_bytes
+ * Purpose:      Writes the put's bytes held in the input buffer to its file.
+ */
+static void take_put_bytes(void) {
+    size_t n = agent_buffer_pending(&client.in);
+    if ((uint64_t)n > client.put_left) n = (size_t)client.put_left;
+    const char *p = client.in.data + client.in.head;
+    for (size_t done = 0; client.put_fd >= 0 && done < n;) {
+        ssize_t w = write(client.put_fd, p + done, n - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            snprintf(client.put_error, sizeof(client.put_error), "%s", w < 0 ? strerror(errno) : "short write");
+            abandon_put();
+            break;
+        }
+        done += (size_t)w;
+    }
+    agent_buffer_consume(&client.in, n);
+    client.put_left -= n;
+    if (client.put_left == 0) finish_put();
+}
+
+/*
+ * Name:         request_ping
+ * Purpose:      ping, an empty reply.
+ */
+static void request_ping(char **f, int count) {
+    (void)count;
+    send_fields(f[0], "ok", NULL);
+}
+
+static const AgentRequest requests[] = {
+    { "hello",  3, 4, request_hello },
+    { "define", 5, AGENT_FIELDS_MAX, request_define },
+    { "start",  3, 3, request_start },
+    { "stop",   3, 3, request_stop },
+    { "reload", 3, 3, request_reload },
+    { "forget", 3, 3, request_forget },
+    { "put",    4, 4, request_put },
+    { "ping",   2, 2, request_ping },
+};
+
+/*
+ * Name:         handle_request
+ * Purpose:      Splits one request line and runs its handler.
+ */
+static void handle_request(char *line) {
+    char *f[AGENT_FIELDS_MAX];
+    int count = agent_split(line, f, AGENT_FIELDS_MAX);
+    if (count == 0) return;
+    if (count < 0) {
+        send_fields("?", "err", errno == E2BIG ? "too many fields" : "bad escape", NULL);
+        return;
+    }
+    if (strlen(f[0]) > TAG_MAX_LEN || strcmp(f[0], "*") == 0) {
+        send_fields("?", "err", "bad tag", NULL);
+        return;
+    }
+    if (count < 2) {
+        reply_error(f[0], "no verb");
+        return;
+    }
+    if (!client.authenticated && strcmp(f[1], "hello") != 0) {
+        reply_error(f[0], "hello first, this agent needs a token");
+        flush_client();
+        drop_client("request before hello");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        const AgentRequest *r = &requests[i];
+        if (strcmp(f[1], r->verb) != 0) continue;
+        if (count < r->min_fields || count > r->max_fields) {
+            reply_error(f[0], "%s takes %d to %d fields, got %d", r->verb, r->min_fields - 2, r->max_fields - 2, count - 2);
+            if (strcmp(r->verb, "put") == 0) { // Its bytes cannot be told from the next request.
+                flush_client();
+                drop_client("malformed put");
+            }
+            return;
+        }
+        r->handler(f, count);
+        return;
+    }
+    reply_error(f[0], "unknown request '%s'", f[1]);
+}
+
+/*
+ * Name:         handle_client_input
+ * Purpose:      Reads everything the controller has sent and handles it in order.
+ * Arguments:    None.
+ *
+ * Output:       The replies, in one write where the socket takes them.
+ * Modifies:     client, sensors.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Requests are handled as they are parsed and their replies
+ * 				 queued, and the queue is written once at the end, so a burst of
+ * 				 pipelined requests is answered in one segment.
+ */
+static void handle_client_input(void) {
+    ssize_t n = agent_buffer_fill(&client.in, client.fd);
+    int read_errno = errno;
+    bool closed = n == 0 || (n < 0 && read_errno != EAGAIN && read_errno != EWOULDBLOCK);
+
+    while (client.fd >= 0) {
+        if (client.put_active) {
+            if (agent_buffer_pending(&client.in) == 0 && client.put_left > 0) break;
+            take_put_bytes();
+            continue;
+        }
+        char *line = agent_buffer_line(&client.in);
+        if (!line) {
+            if (agent_buffer_pending(&client.in) > AGENT_LINE_MAX) drop_client("line too long");
+            break;
+        }
+        handle_request(line);
+    }
+    flush_client();
+    if (closed) drop_client(n == 0 ? "end of stream" : strerror(read_errno));
+}
+
+/*
+ * Name:         drop_pending
+ * Purpose:      Closes the waiting controller, with a last reply when there is one.
+ */
+static void drop_pending(const char *tag, const char *why) {
+    if (pending_fd < 0) return;
+    if (tag) {
+        AgentBuffer out = { 0 };
+        const char *f[] = { tag, "err", why };
+        if (agent_buffer_fields(&out, f, 3) == 0) agent_buffer_flush(&out, pending_fd);
+        agent_buffer_free(&out);
+    }
+    safe_console_print("%s: waiting controller disconnected, %s\n", program_name, why);
+    close_watched(&pending_fd);
+    agent_buffer_free(&pending_in);
+}
+
+/*
+ * Name:         handle_pending_input
+ * Purpose:      Reads the waiting controller's hello, and swaps it in for the
+ *               current controller when the hello holds the token.
+ * Arguments:    None.
+ *
+ * Output:       A "bye" event to the controller replaced, or an error reply to
+ *               the waiting one.
+ * Modifies:     client, pending_fd, pending_in.
+ * Returns:      None.
+ * Assumptions:  token is set, a controller without one is swapped in at once,
+ *               see accept_client().
+ *
+ * Bugs:         None known.
+ * Notes:        The authenticated controller is not touched until the new one
+ *               has shown the token, so a peer without it cannot cut it off.
+ *               The hello and whatever follows it are handled as the new
+ *               controller's own input.
+ */
+static void handle_pending_input(void) {
+    ssize_t n = agent_buffer_fill(&pending_in, pending_fd);
+    int read_errno = errno;
+    bool closed = n == 0 || (n < 0 && read_errno != EAGAIN && read_errno != EWOULDBLOCK);
+
+    const char *start = pending_in.data + pending_in.head;
+    size_t held = agent_buffer_pending(&pending_in);
+    const char *nl = held ? memchr(start, '\n', held) : NULL;
+    if (!nl) {
+        if (closed) drop_pending(NULL, n == 0 ? "end of stream" : strerror(read_errno));
+        else if (held > AGENT_LINE_MAX) drop_pending(NULL, "line too long");
+        return;
+    }
+
+    char line[AGENT_LINE_MAX + 1];
+    size_t len = (size_t)(nl - start);
+    if (len > 0 && start[len - 1] == '\r') len--;
+    if (len > AGENT_LINE_MAX) {
+        drop_pending(NULL, "line too long");
+        return;
+    }
+    memcpy(line, start, len); // A copy, the line itself stays for handle_request().
+    line[len] = '\0';
+    char *f[AGENT_FIELDS_MAX];
+    int count = agent_split(line, f, AGENT_FIELDS_MAX);
+    const char *tag = count > 0 && strlen(f[0]) <= TAG_MAX_LEN ? f[0] : "?";
+    if (count < 4 || strcmp(f[1], "hello") != 0 || !token_matches(f[3])) {
+        drop_pending(tag, "another controller is connected, hello with the token to replace it");
+        return;
+    }
+
+    if (client.fd >= 0) {
+        send_fields("*", "bye", "replaced by a new controller", NULL);
+        flush_client();
+        drop_client("replaced by a new controller");
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_TAG(0, EV_KIND_CLIENT) };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pending_fd, &ev);
+    client.fd = pending_fd;
+    client.in = pending_in;
+    client.want_out = false;
+    client.authenticated = false; // Until the hello, handled again below.
+    pending_fd = -1;
+    pending_in = (AgentBuffer){ 0 };
+    safe_console_print("%s: controller connected, replacing the last one\n", program_name);
+    handle_client_input();
+}
+
+/*
+ * Name:         accept_client
+ * Purpose:      Takes a new controller connection, replacing any current one.
+ * Arguments:    None.
+ *
+ * Output:       A "bye" event to the controller replaced.
+ * Modifies:     client, or pending_fd.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        With --token-file, a connection made while an authenticated
+ *               controller is attached waits in pending_fd until its hello
+ *               holds the token, see handle_pending_input(). A later one
+ *               takes its place, so a peer holding it idle blocks no one.
+ */
+static void accept_client(void) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Batched already, Nagle only adds delay.
+    if (token[0] && client.fd >= 0 && client.authenticated) {
+        drop_pending(NULL, "replaced by a new connection");
+        if (watch_fd(fd, EPOLLIN, EV_TAG(0, EV_KIND_PENDING)) != 0) {
+            close(fd);
+            return;
+        }
+        pending_fd = fd;
+        safe_console_print("%s: controller waiting for its hello\n", program_name);
+        return;
+    }
+    if (client.fd >= 0) {
+        send_fields("*", "bye", "replaced by a new controller", NULL);
+        flush_client();
+        drop_client("replaced by a new controller");
+    }
+    client.fd = fd;
+    client.want_out = false;
+    client.authenticated = token[0] == '\0';
+    if (watch_fd(fd, EPOLLIN, EV_TAG(0, EV_KIND_CLIENT)) != 0) {
+        close(fd);
+        client.fd = -1;
+        return;
+    }
+    safe_console_print("%s: controller connected\n", program_name);
+}
+
+/*
+ * Name:         handle_tick
+ * Purpose:      Runs the deadlines and sends the batch of changed sensors.
+ * Arguments:    None.
+ *
+ * Output:       Sensor events, notes.
+ * Modifies:     sensors, client.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Every AGENT_BATCH_MS: restarts whose backoff has run, SIGKILL for
+ * 				 sensors that ignored a stop, metrics scrapes due, then one
+ * 				 event per changed sensor and a single write.
+ */
+static void handle_tick(void) {
+    uint64_t expirations;
+    ssize_t unused = read(tick_fd, &expirations, sizeof(expirations));
+    (void)unused;
+    int64_t now = now_ms();
+
+    for (size_t i = 0; i < sensor_count; i++) {
+        AgentSensor *s = &sensors[i];
+        if (!s->name) continue;
+
+        if (s->restart_at_ms && now >= s->restart_at_ms) {
+            s->restart_at_ms = 0;
+            int e = spawn_sensor(s);
+            if (e == 0) {
+                s->restarts++;
+                note(s, "restarted (PID: %d)", (int)s->pid);
+            } else {
+                note(s, "restart failed: %s", strerror(e));
+                s->restart_at_ms = now + s->backoff_ms;
+                s->backoff_ms = s->backoff_ms * 2 < RESTART_MAX_MS ? s->backoff_ms * 2 : RESTART_MAX_MS;
+            }
+        }
+        if (s->kill_at_ms && now >= s->kill_at_ms && s->pid > 0) {
+            s->kill_at_ms = 0;
+            note(s, "no exit %d ms after SIGTERM, sending SIGKILL", STOP_KILL_MS);
+            kill(-s->pid, SIGKILL);
+        }
+        if (s->pid > 0 && s->metrics_path && now >= s->scrape_at_ms) {
+            close_watched(&s->scrape_fd); // Abandon one that has not answered in SCRAPE_MS.
+            start_scrape(s);
+            s->scrape_at_ms = now + SCRAPE_MS;
+        }
+        if (s->dirty && client.fd >= 0) send_sensor(s);
+    }
+    flush_client();
+}
+
+/*
+ * Name:         open_listener
+ * Purpose:      Binds and listens on the --listen [host]:port.
+ * Returns:      The socket, or -1 after an error message.
+ */
+static int open_listener(const char *address) {
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon[1] == '\0' || (size_t)(colon - address) >= sizeof(host)) {
+        safe_console_error("%s: expected [host]:port, got '%s'\n", program_name, address);
+        return -1;
+    }
+    memcpy(host, address, (size_t)(colon - address));
+    host[colon - address] = '\0';
+    char *h = host;
+    size_t hlen = strlen(h);
+    if (hlen >= 2 && h[0] == '[' && h[hlen - 1] == ']') { // [::1]:7400
+        h[hlen - 1] = '\0';
+        h++;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    int err = getaddrinfo(*h ? h : NULL, colon + 1, &hints, &res);
+    if (err != 0) {
+        safe_console_error("%s: %s: %s\n", program_name, address, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, LISTEN_BACKLOG) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) safe_console_error("%s: cannot listen on %s: %s\n", program_name, address, strerror(errno));
+    return fd;
+}
+
+/*
+ * Name:         listener_is_loopback
+ * Purpose:      Checks whether the listening socket is bound to a loopback address.
+ */
+static bool listener_is_loopback(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0) return false;
+    if (addr.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        const struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return false;
+}
+
+/*
+ * Name:         load_token
+ * Purpose:      Reads the shared token, the first line of --token-file.
+ * Returns:      0, or -1 after an error message.
+ */
+static int load_token(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        safe_console_error("%s: %s: %s\n", program_name, path, strerror(errno));
+        return -1;
+    }
+    char line[TOKEN_MAX + 2];
+    bool got = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+    if (got) line[strcspn(line, "\r\n")] = '\0';
+    if (!got || line[0] == '\0' || strlen(line) > TOKEN_MAX || strpbrk(line, " \t")) {
+        safe_console_error("%s: %s: expected a token of 1 to %d characters, no spaces, on the first line\n",
+                           program_name, path, TOKEN_MAX);
+        return -1;
+    }
+    memcpy(token, line, strlen(line) + 1);
+    return 0;
+}
+
+/*
+ * Name:         stop_all
+ * Purpose:      Stops every sensor at shutdown, SIGKILL for any still there after STOP_KILL_MS.
+ */
+static void stop_all(void) {
+    bool any = false;
+    for (size_t i = 0; i < sensor_count; i++) {
+        if (sensors[i].name && sensors[i].pid > 0) {
+            kill(-sensors[i].pid, SIGTERM);
+            any = true;
+        }
+    }
+    int64_t deadline = now_ms() + STOP_KILL_MS;
+    while (any) {
+        any = false;
+        for (size_t i = 0; i < sensor_count; i++) {
+            AgentSensor *s = &sensors[i];
+            if (!s->name || s->pid <= 0) continue;
+            if (waitpid(s->pid, NULL, WNOHANG) == s->pid) {
+                s->pid = 0;
+                continue;
+            }
+            if (now_ms() >= deadline) {
+                kill(-s->pid, SIGKILL);
+                waitpid(s->pid, NULL, 0);
+                s->pid = 0;
+                continue;
+            }
+            any = true;
+        }
+        if (any) usleep(10000);
+    }
+}
+
+/*
+ * Name:         cleanup_and_exit
+ * Purpose:      Stops every sensor, releases every resource and exits.
+ * Arguments:    exit_code: passed to exit().
+ *
+ * Output:       None.
+ * Modifies:     Closes every fd and frees every sensor.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The sensors do not outlive the agent, one left running would
+ * 				 hold its serial port against the next agent's start.
+ */
+void cleanup_and_exit(int exit_code) {
+    stop_all();
+    drop_client("agent shutting down");
+    drop_pending(NULL, "agent shutting down");
+    for (size_t i = 0; i < sensor_count; i++) {
+        if (sensors[i].name) free_sensor(&sensors[i]);
+    }
+    free(sensors);
+    sensors = NULL;
+    sensor_count = 0;
+    if (listen_fd >= 0) close(listen_fd);
+    if (tick_fd >= 0) close(tick_fd);
+    if (signal_fd >= 0) close(signal_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    exit(exit_code);
+}
+
+/*
+ * Name:         print_usage
+ * Purpose:      Prints the command line syntax.
+ */
+static void print_usage(void) {
+    safe_console_error("Usage: %s [--listen [HOST]:PORT] [--root DIR] [--token-file PATH]\n", program_name);
+    safe_console_error("  --listen      address for sensor_control to connect to, default %s\n", DEFAULT_LISTEN);
+    safe_console_error("  --root        directory holding bin/ and the data files, default the working directory\n");
+    safe_console_error("  --token-file  file whose first line a controller must give in its hello\n");
+}
+
+/*
+ * Name:         Main
+ * Purpose:      Listens for sensor_control and runs the event loop until a
+ *               termination signal arrives.
+ * Arguments:    argv: see Usage above.
+ *
+ * Output:       Prints to stderr the appropriate error messages if encountered.
+ * Modifies:     None.
+ * Returns:      0 on a clean shutdown, 1 on a bad option or a failed start-up.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+int main(int argc, char *argv[]) {
+    program_name = argv[0];
+    const char *listen_address = DEFAULT_LISTEN;
+    const char *root = NULL;
+    const char *token_file = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_address = argv[++i];
+        } else if (strncmp(argv[i], "--listen=", 9) == 0) {
+            listen_address = argv[i] + 9;
+        } else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+            root = argv[++i];
+        } else if (strncmp(argv[i], "--root=", 7) == 0) {
+            root = argv[i] + 7;
+        } else if (strcmp(argv[i], "--token-file") == 0 && i + 1 < argc) {
+            token_file = argv[++i];
+        } else if (strncmp(argv[i], "--token-file=", 13) == 0) {
+            token_file = argv[i] + 13;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (token_file && load_token(token_file) != 0) return 1; // Before --root, a relative path is the caller's.
+    if (root && chdir(root) != 0) {
+        safe_console_error("%s: %s: %s\n", program_name, root, strerror(errno));
+        return 1;
+    }
+    gethostname(host_name, sizeof(host_name) - 1);
+
+    sigset_t block_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGQUIT);
+    sigaddset(&block_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block_set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &block_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || signal_fd < 0 || tick_fd < 0) {
+        safe_console_error("%s: %s\n", program_name, strerror(errno));
+        cleanup_and_exit(1);
+    }
+    struct itimerspec tick = {
+        .it_interval = { .tv_sec = 0, .tv_nsec = AGENT_BATCH_MS * 1000000L },
+        .it_value = { .tv_sec = 0, .tv_nsec = AGENT_BATCH_MS * 1000000L },
+    };
+    listen_fd = open_listener(listen_address);
+    if (listen_fd < 0) cleanup_and_exit(1);
+    if (timerfd_settime(tick_fd, 0, &tick, NULL) != 0 ||
+        watch_fd(signal_fd, EPOLLIN, EV_TAG(0, EV_KIND_SIGNAL)) != 0 ||
+        watch_fd(tick_fd, EPOLLIN, EV_TAG(0, EV_KIND_TICK)) != 0 ||
+        watch_fd(listen_fd, EPOLLIN, EV_TAG(0, EV_KIND_LISTEN)) != 0) {
+        safe_console_error("%s: %s\n", program_name, strerror(errno));
+        cleanup_and_exit(1);
+    }
+
+    safe_console_print("%s: %s listening on %s\n", program_name, host_name, listen_address);
+    if (!token[0] && !listener_is_loopback(listen_fd)) {
+        safe_console_print("%s: warning, no --token-file, anyone who can reach %s can run the programs under the root\n",
+                           program_name, listen_address);
+    }
+    safe_console_print("Press 'ctrl-c' to quit.\n");
+
+    bool running = true;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            safe_console_error("%s: epoll_wait: %s\n", program_name, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+            uint32_t kind = EV_KIND(tag);
+            size_t idx = EV_INDEX(tag);
+
+            if (kind == EV_KIND_SIGNAL) {
+                struct signalfd_siginfo si;
+                while (read(signal_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    if (si.ssi_signo == SIGCHLD) {
+                        reap_children();
+                    } else if (si.ssi_signo == SIGINT) {
+                        safe_console_print("\nReceived SIGINT (Ctrl+C), shutting down...\n");
+                        running = false;
+                    } else {
+                        safe_console_print("\nReceived signal %u, shutting down...\n", si.ssi_signo);
+                        running = false;
+                    }
+                }
+            } else if (kind == EV_KIND_TICK) {
+                handle_tick();
+            } else if (kind == EV_KIND_LISTEN) {
+                accept_client();
+            } else if (kind == EV_KIND_PENDING) {
+                if (pending_fd >= 0) handle_pending_input();
+            } else if (kind == EV_KIND_CLIENT) {
+                if (client.fd < 0) continue;
+                if (events[i].events & EPOLLOUT) flush_client();
+                if (client.fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) handle_client_input();
+            } else if (idx < sensor_count && sensors[idx].name) {
+                // The slot may have been forgotten by a request earlier in this batch.
+                if (kind == EV_KIND_OUT) handle_output(&sensors[idx], false);
+                else if (kind == EV_KIND_ERR) handle_output(&sensors[idx], true);
+                else if (kind == EV_KIND_SCRAPE) handle_scrape(&sensors[idx]);
+            }
+        }
+    }
+
+    safe_console_print("Program %s terminated.\n", program_name);
+    cleanup_and_exit(0);
+    return 0; // We won't get here, but it quiets verbose warnings on a no return value.
+}
@@ -0,0 +1,25 @@
+/*
+ * File:     wxb_btd300.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Biral BTD-300 records for wxb_convert.
+ *           Flash times are stored as epoch seconds, already converted from
+ *           the recorded UTC date and time by parse_to_epoch().
+ *
+ * Mods:
+ *
+ */
+
+#include "wxb_convert.h"
+#include "btd300_utils.h"
+
+static void btd300_convert_line(char *line, void *record) {
+    BTD300_parse_message(line, record);
+}
+
+const WxbConverter btd300_converter = {
+    .name = "btd300",
+    .record_size = sizeof(ParsedMessage),
+    .parse = btd300_convert_line,
+};
@@ -0,0 +1,25 @@
+/*
+ * File:     wxb_ceilometer.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Campbell SkyVUE8 ceilometer records for wxb_convert.
+ *           Sensor and message IDs are left zero, the emulator sets them per
+ *           message, and the backscatter profile is still generated at send time.
+ *
+ * Mods:
+ *
+ */
+
+#include "wxb_convert.h"
+#include "skyvue8_utils.h"
+
+static void ceilometer_convert_line(char *line, void *record) {
+    skyvue8_parse_message(line, record);
+}
+
+const WxbConverter ceilometer_converter = {
+    .name = "ceilometer",
+    .record_size = sizeof(ParsedMessage),
+    .parse = ceilometer_convert_line,
+};
@@ -0,0 +1,229 @@
+/*
+ * File:     wxb_convert.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Converts an emulator text data file into a .wxb binary replay cache.
+ *           Every line is parsed once, offline, with the same parse function the
+ *           emulator uses, and the resulting ParsedMessage records are written
+ *           back to back behind a WxbHeader (see replay_utils.h). Passing the
+ *           .wxb file to the emulator in place of the text file skips the text
+ *           parsing on every transmit.
+ *
+ *           A cache is tied to the build that made it: the header records the
+ *           record size, byte order and sizeof(time_t), and the emulator refuses
+ *           a cache that does not match. Regenerate caches on the target after
+ *           changing a sensor header.
+ *
+ *           With -z the records are written as a block-compressed .wxz cache
+ *           instead (see wxz_utils.h), a block at a time as lines are parsed,
+ *           so a month long file converts in the memory of one block.
+ *
+ * Usage:    wxb_convert [-z] <sensor> <input_file> [output_file]
+ *           sensor is one of ptb330, wind, btd300 or ceilometer. The output
+ *           defaults to the input path with its extension replaced by .wxb,
+ *           or .wxz with -z.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "wxb_convert.h"
+#include "replay_utils.h"
+#include "wxz_utils.h"
+
+static const WxbConverter *converters[] = {
+    &ptb330_converter,
+    &wind_converter,
+    &btd300_converter,
+    &ceilometer_converter,
+};
+#define CONVERTER_COUNT (sizeof(converters) / sizeof(converters[0]))
+
+/*
+ * Name:         find_converter
+ * Purpose:      Looks up a sensor by name.
+ * Arguments:    name: the sensor name from the command line.
+ *
+ * Returns:      The converter, or NULL if the sensor is unknown.
+ */
+static const WxbConverter *find_converter(const char *name) {
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        if (strcmp(converters[i]->name, name) == 0) return converters[i];
+    }
+    return NULL;
+}
+
+/*
+ * Name:         default_output_path
+ * Purpose:      Builds <input without extension>.wxb or .wxz.
+ * Arguments:    input: the input path.
+ * 				 ext: the extension, without the dot.
+ * 				 buf: receives the output path.
+ * 				 buf_len: size of buf.
+ *
+ * Output:       None.
+ * Modifies:     buf.
+ * Returns:      0 on success, -1 if the path does not fit.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Only an extension in the last path component is replaced.
+ */
+static int default_output_path(const char *input, const char *ext, char *buf, size_t buf_len) {
+    const char *slash = strrchr(input, '/');
+    const char *dot = strrchr(slash ? slash : input, '.');
+    size_t stem = dot && dot != input && dot[-1] != '/' ? (size_t)(dot - input) : strlen(input);
+    int n = snprintf(buf, buf_len, "%.*s.%s", (int)stem, input, ext);
+    return (n < 0 || (size_t)n >= buf_len) ? -1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-z] <sensor> <input_file> [output_file]\n", prog);
+    fprintf(stderr, "Sensors:");
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) fprintf(stderr, " %s", converters[i]->name);
+    fprintf(stderr, "\n");
+}
+
+/*
+ * Name:         convert_blocks
+ * Purpose:      Parses every line of src into a .wxz cache.
+ * Arguments:    conv: the sensor's converter.
+ * 				 src: the text data file, every line is read once.
+ * 				 output: the cache to write.
+ * 				 st: stat() of the text file.
+ *
+ * Output:       None.
+ * Modifies:     Creates output, advances the cursor of src.
+ * Returns:      0 on success, -1 with errno set.
+ * Assumptions:  src is mapped, so its line count is known.
+ *
+ * Bugs:         None known.
+ * Notes:        One record is parsed at a time and handed to the writer, which
+ * 				 holds the one block it is filling.
+ */
+static int convert_blocks(const WxbConverter *conv, ReplaySource *src, const char *output, const struct stat *st) {
+    WxzWriter w;
+    if (wxz_writer_open(&w, output, conv->name, conv->record_size, WXZ_BLOCK_RECORDS, st) != 0) return -1;
+
+    unsigned char record[REPLAY_LINE_MAX] __attribute__((aligned(16)));
+    char line[REPLAY_LINE_MAX];
+    size_t count = replay_line_count(src);
+    for (size_t i = 0; i < count; i++) {
+        replay_next_line(src, line, sizeof(line));
+        memset(record, 0, conv->record_size); // Padding stays zero as in a .wxb, whatever the parse leaves.
+        conv->parse(line, record);
+        if (wxz_writer_append(&w, record) != 0) {
+            int saved = errno;
+            wxz_writer_close(&w, false);
+            errno = saved;
+            return -1;
+        }
+    }
+    return wxz_writer_close(&w, true);
+}
+
+int main(int argc, char *argv[]) {
+    bool compress = argc > 1 && strcmp(argv[1], "-z") == 0;
+    if (compress) { // Shift -z off so the positional arguments stay where they were.
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 3 || argc > 4) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const WxbConverter *conv = find_converter(argv[1]);
+    if (!conv) {
+        fprintf(stderr, "%s: unknown sensor '%s'\n", argv[0], argv[1]);
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *input = argv[2];
+    char output[4096];
+    if (argc == 4) {
+        snprintf(output, sizeof(output), "%s", argv[3]);
+    } else if (default_output_path(input, compress ? "wxz" : "wxb", output, sizeof(output)) != 0) {
+        fprintf(stderr, "%s: output path too long\n", argv[0]);
+        return 1;
+    }
+
+    ReplaySource *src = NULL;
+    if (replay_open(&src, input) != 0) {
+        fprintf(stderr, "%s: Failed to open file %s: %s\n", argv[0], input, strerror(errno));
+        return 1;
+    }
+    if (replay_is_binary(src)) {
+        fprintf(stderr, "%s: %s is already a replay cache\n", argv[0], input);
+        replay_close(src);
+        return 1;
+    }
+    if (!replay_is_mapped(src)) { // A pipe has no end to convert up to.
+        fprintf(stderr, "%s: %s is not a regular file\n", argv[0], input);
+        replay_close(src);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(input, &st) != 0) {
+        fprintf(stderr, "%s: stat(%s): %s\n", argv[0], input, strerror(errno));
+        replay_close(src);
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    size_t count = replay_line_count(src);
+    int rc;
+    if (compress) {
+        rc = convert_blocks(conv, src, output, &st);
+        replay_close(src);
+    } else {
+        unsigned char *records = calloc(count ? count : 1, conv->record_size);
+        if (!records) {
+            fprintf(stderr, "%s: out of memory for %zu records\n", argv[0], count);
+            replay_close(src);
+            return 1;
+        }
+
+        char line[REPLAY_LINE_MAX];
+        for (size_t i = 0; i < count; i++) {
+            replay_next_line(src, line, sizeof(line)); // The index holds no empty lines.
+            conv->parse(line, records + i * conv->record_size);
+        }
+        replay_close(src);
+
+        rc = replay_write_records(output, conv->name, records, conv->record_size, count, &st);
+        free(records);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to write %s: %s\n", argv[0], output, strerror(errno));
+        return 1;
+    }
+
+    // Read the cache back the way an emulator will, so a bad write is caught here.
+    if (replay_open(&src, output) != 0 || replay_check_records(src, conv->name, conv->record_size) != 0) {
+        fprintf(stderr, "%s: %s failed verification: %s\n", argv[0], output, strerror(errno));
+        if (src) replay_close(src);
+        return 1;
+    }
+    replay_close(src);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    struct stat out_st;
+    long long out_size = stat(output, &out_st) == 0 ? (long long)out_st.st_size : -1;
+    printf("%s: %zu %s records of %zu bytes -> %s, %lld bytes (%.3f s)\n",
+           input, count, conv->name, conv->record_size, output, out_size, secs);
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * File:     wxb_convert.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Interface between the wxb_convert driver and the per-sensor parsers.
+ *           Each sensor is compiled as its own module, because the sensor headers
+ *           each define ParsedMessage and cannot share a translation unit.
+ *
+ * Mods:
+ *
+ */
+
+#ifndef WXB_CONVERT_H
+#define WXB_CONVERT_H
+
+#include <stddef.h>
+
+typedef struct {
+    const char *name;                        // Sensor name on the command line and in the header, e.g. "ptb330".
+    size_t record_size;                      // sizeof(ParsedMessage) of the sensor.
+    void (*parse)(char *line, void *record); // Parses one data file line into record, line may be modified.
+} WxbConverter;
+
+// Sensors wxb_convert can convert.
+extern const WxbConverter ptb330_converter;
+extern const WxbConverter wind_converter;
+extern const WxbConverter btd300_converter;
+extern const WxbConverter ceilometer_converter;
+
+#endif // WXB_CONVERT_H
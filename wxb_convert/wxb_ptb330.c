@@ -0,0 +1,27 @@
+/*
+ * File:     wxb_ptb330.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Vaisala PTB330 records for wxb_convert.
+ *           Altitude, serial number, address and units are left zero, the
+ *           emulator fills them in from its live configuration.
+ *
+ * Mods:
+ *
+ */
+
+#include "wxb_convert.h"
+#include "ptb330_utils.h"
+
+static const ptb330_sensor default_sensor; // All zero, see ptb330_apply_sensor().
+
+static void ptb330_convert_line(char *line, void *record) {
+    ptb330_parse_message(line, record, &default_sensor);
+}
+
+const WxbConverter ptb330_converter = {
+    .name = "ptb330",
+    .record_size = sizeof(ParsedMessage),
+    .parse = ptb330_convert_line,
+};
@@ -0,0 +1,25 @@
+/*
+ * File:     wxb_wind.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Gill WindObserver 75 records for wxb_convert.
+ *           The units character is left zero, the emulator fills it in
+ *           from its live configuration.
+ *
+ * Mods:
+ *
+ */
+
+#include "wxb_convert.h"
+#include "windobserver75_utils.h"
+
+static void wind_convert_line(char *line, void *record) {
+    WO75_parse_message(line, record, '\0');
+}
+
+const WxbConverter wind_converter = {
+    .name = "wind",
+    .record_size = sizeof(ParsedMessage),
+    .parse = wind_convert_line,
+};
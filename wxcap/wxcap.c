@@ -0,0 +1,483 @@
+/*
+ * File:     wxcap.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Reads the capture files an emulator writes with --capture PATH
+ *           (see capture_utils.h).
+ *
+ *           dump lists every record: time since the capture started, port,
+ *           direction, length and the bytes, with control characters escaped.
+ *
+ *           replay plays one port's recorded output back to a host at the
+ *           recorded timing, standing in for the emulator, so a timing bug in
+ *           a logger can be reproduced the same way every time. What the host
+ *           sends back is compared with what it sent during the capture, and
+ *           the first difference is reported. With --sync the replay waits for
+ *           the host's first byte and lines the recording up with it, for a
+ *           host that only speaks when polled.
+ *
+ * Usage:    wxcap dump <capture_file>
+ *           wxcap replay <capture_file> <serial_device> [baud_rate] [RS422|RS485] [--port N|NAME] [--sync]
+ *           The device may be anything open_serial_port() takes, e.g. pty:/tmp/logger.
+ *
+ * Mods:     14/10/2026 replay stops when the port hangs up, instead of polling
+ *           it until the next write is due.
+ *
+ */
+
+#define _GNU_SOURCE // ppoll()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture_utils.h"
+#include "serial_utils.h"
+
+#define DEFAULT_BAUD "9600"
+#define LINGER_NS 1000000000LL // How long replay keeps listening after its last write.
+
+typedef struct {
+    const unsigned char *data;          // The whole file, mapped.
+    size_t size;
+    const CaptureFileHeader *header;
+    char ports[CAPTURE_MAX_PORTS][CAPTURE_PORT_NAME_LEN];
+    unsigned port_count;                // Highest port id named, plus one.
+} Capture;
+
+/*
+ * Name:         usage
+ * Purpose:      Prints the command line.
+ * Arguments:    prog: argv[0].
+ *
+ * Returns:      None.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s dump <capture_file>\n", prog);
+    fprintf(stderr, "       %s replay <capture_file> <serial_device> [baud_rate] [RS422|RS485] [--port N|NAME] [--sync]\n", prog);
+}
+
+/*
+ * Name:         next_record
+ * Purpose:      Steps to the next record of a capture.
+ * Arguments:    cap: the capture.
+ *               at: offset of the record, advanced past it.
+ *               rec: receives the record header.
+ *               payload: receives a pointer to its bytes.
+ *
+ * Returns:      false at the end of the file or at a record cut short, the
+ *               end of a capture whose emulator was killed.
+ */
+static bool next_record(const Capture *cap, size_t *at, CaptureRecord *rec, const unsigned char **payload) {
+    if (cap->size - *at < sizeof(*rec)) return false;
+    memcpy(rec, cap->data + *at, sizeof(*rec));
+    if (cap->size - *at - sizeof(*rec) < rec->len) return false;
+    *payload = cap->data + *at + sizeof(*rec);
+    *at += sizeof(*rec) + rec->len;
+    return true;
+}
+
+/*
+ * Name:         open_capture
+ * Purpose:      Maps a capture file, checks its header and reads its port names.
+ * Arguments:    cap: filled in.
+ *               path: the capture file.
+ *
+ * Output:       An error message to stderr on failure.
+ * Modifies:     cap.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A capture written on a host of another byte order or layout is
+ *               refused, as a .wxb cache is.
+ */
+static int open_capture(Capture *cap, const char *path) {
+    memset(cap, 0, sizeof(*cap));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(CaptureFileHeader)) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    cap->data = map;
+    cap->size = (size_t)st.st_size;
+    cap->header = map;
+
+    const CaptureFileHeader *h = cap->header;
+    if (memcmp(h->magic, CAPTURE_MAGIC, sizeof(h->magic)) != 0 || h->version != CAPTURE_VERSION ||
+        h->byte_order != CAPTURE_BYTE_ORDER || h->header_size != sizeof(CaptureFileHeader) ||
+        h->record_size != sizeof(CaptureRecord)) {
+        fprintf(stderr, "%s is not a version %d capture file from a host like this one\n", path, CAPTURE_VERSION);
+        munmap(map, cap->size);
+        return -1;
+    }
+
+    size_t at = h->header_size;
+    CaptureRecord rec;
+    const unsigned char *payload;
+    while (next_record(cap, &at, &rec, &payload)) {
+        if (rec.dir != CAPTURE_PORT || rec.port >= CAPTURE_MAX_PORTS) continue;
+        size_t n = rec.len < CAPTURE_PORT_NAME_LEN - 1 ? rec.len : CAPTURE_PORT_NAME_LEN - 1;
+        memcpy(cap->ports[rec.port], payload, n);
+        cap->ports[rec.port][n] = '\0';
+        if (rec.port >= cap->port_count) cap->port_count = rec.port + 1u;
+    }
+    return 0;
+}
+
+/*
+ * Name:         port_name
+ * Purpose:      Names a port id for printing.
+ *
+ * Returns:      The name, or "?" for an unnamed port.
+ */
+static const char *port_name(const Capture *cap, uint8_t port) {
+    return port < cap->port_count && cap->ports[port][0] ? cap->ports[port] : "?";
+}
+
+/*
+ * Name:         print_escaped
+ * Purpose:      Prints bytes with CR, LF, tab and other control characters escaped.
+ *
+ * Returns:      None.
+ */
+static void print_escaped(const unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = buf[i];
+        if (c == '\r') fputs("\\r", stdout);
+        else if (c == '\n') fputs("\\n", stdout);
+        else if (c == '\t') fputs("\\t", stdout);
+        else if (c == '\\') fputs("\\\\", stdout);
+        else if (c < 0x20 || c >= 0x7f) printf("\\x%02X", c);
+        else putchar(c);
+    }
+}
+
+/*
+ * Name:         dump_capture
+ * Purpose:      Lists every record of a capture on stdout.
+ * Arguments:    cap: the capture.
+ *
+ * Output:       One line per record, then a summary line.
+ * Modifies:     None.
+ * Returns:      0.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Times are seconds since the capture started.
+ */
+static int dump_capture(const Capture *cap) {
+    time_t start = (time_t)(cap->header->start_unix_ns / 1000000000LL);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S UTC", gmtime(&start));
+    printf("# %.*s capture started %s\n", CAPTURE_PROGRAM_LEN, cap->header->program, when);
+
+    size_t at = cap->header->header_size, records = 0;
+    uint64_t bytes[2] = { 0, 0 };
+    CaptureRecord rec;
+    const unsigned char *payload;
+    while (next_record(cap, &at, &rec, &payload)) {
+        printf("%12.6f  %-24s ", rec.t_ns / 1e9, port_name(cap, rec.port));
+        switch (rec.dir) {
+        case CAPTURE_RX:
+        case CAPTURE_TX:
+            printf("%s %5u  ", rec.dir == CAPTURE_RX ? "RX" : "TX", rec.len);
+            print_escaped(payload, rec.len);
+            bytes[rec.dir] += rec.len;
+            break;
+        case CAPTURE_PORT:
+            printf("opened");
+            break;
+        case CAPTURE_GAP: {
+            uint64_t lost = 0;
+            memcpy(&lost, payload, rec.len < sizeof(lost) ? rec.len : sizeof(lost));
+            printf("GAP    %llu records lost", (unsigned long long)lost);
+            break;
+        }
+        default:
+            printf("?? %5u", rec.len);
+        }
+        putchar('\n');
+        records++;
+    }
+    printf("# %zu records, %llu bytes received, %llu bytes sent%s\n", records, (unsigned long long)bytes[CAPTURE_RX],
+           (unsigned long long)bytes[CAPTURE_TX], at < cap->size ? ", last record cut short" : "");
+    return 0;
+}
+
+/*
+ * Name:         mono_ns
+ * Purpose:      Reads CLOCK_MONOTONIC.
+ *
+ * Returns:      Nanoseconds.
+ */
+static int64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// What the host is expected to send during a replay and how far it has matched.
+typedef struct {
+    unsigned char *expect;              // The port's RX bytes from the capture, in order.
+    size_t expect_len;
+    size_t received;                    // Bytes the host has sent so far.
+    size_t matched;                     // Of those, the leading bytes equal to expect.
+    bool diverged;
+    int64_t diverged_ns;                // Replay time of the first difference.
+    bool hung_up;                       // The port reported a hang-up or error, or read end of file.
+    int64_t hung_up_ns;                 // Replay time it did.
+} HostCheck;
+
+/*
+ * Name:         read_host
+ * Purpose:      Reads what the host has sent and compares it with the capture.
+ * Arguments:    fd: the port.
+ *               check: the comparison so far.
+ *               t_ns: replay time, for the report.
+ *
+ * Returns:      Bytes read, 0 if none were waiting.
+ */
+static size_t read_host(int fd, HostCheck *check, int64_t t_ns) {
+    unsigned char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) return 0;
+    for (ssize_t i = 0; i < n; i++, check->received++) {
+        if (check->diverged) continue;
+        if (check->received < check->expect_len && buf[i] == check->expect[check->received]) {
+            check->matched++;
+        } else {
+            check->diverged = true;
+            check->diverged_ns = t_ns;
+        }
+    }
+    return (size_t)n;
+}
+
+/*
+ * Name:         wait_until
+ * Purpose:      Sleeps until a deadline, reading the host in the meantime.
+ * Arguments:    fd: the port.
+ *               check: see read_host().
+ *               deadline: CLOCK_MONOTONIC deadline in ns.
+ *               anchor: CLOCK_MONOTONIC time of replay time 0.
+ *
+ * Returns:      None.
+ * Notes:        POLLHUP, POLLERR or POLLNVAL without input, or a read of end
+ *               of file, is the end of the stream: check->hung_up is set and
+ *               the call returns at once, as ppoll() would report it again
+ *               without blocking.
+ */
+static void wait_until(int fd, HostCheck *check, int64_t deadline, int64_t anchor) {
+    while (!check->hung_up) {
+        int64_t now = mono_ns();
+        if (now >= deadline) return;
+        struct timespec left = { (time_t)((deadline - now) / 1000000000LL), (long)((deadline - now) % 1000000000LL) };
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (ppoll(&pfd, 1, &left, NULL) <= 0) continue;
+        if ((pfd.revents & POLLIN) && read_host(fd, check, mono_ns() - anchor) > 0) continue;
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            check->hung_up = true;
+            check->hung_up_ns = mono_ns() - anchor;
+        }
+    }
+}
+
+/*
+ * Name:         find_port
+ * Purpose:      Picks the port to replay, by id or name, or the first one with output.
+ * Arguments:    cap: the capture.
+ *               want: the --port value, NULL for the default.
+ *
+ * Returns:      The port id, or -1 if there is no such port.
+ */
+static int find_port(const Capture *cap, const char *want) {
+    if (want) {
+        char *end;
+        long id = strtol(want, &end, 10);
+        if (*end == '\0' && id >= 0 && id < (long)cap->port_count) return (int)id;
+        for (unsigned i = 0; i < cap->port_count; i++) {
+            if (strcmp(cap->ports[i], want) == 0) return (int)i;
+        }
+        return -1;
+    }
+    size_t at = cap->header->header_size;
+    CaptureRecord rec;
+    const unsigned char *payload;
+    while (next_record(cap, &at, &rec, &payload)) {
+        if (rec.dir == CAPTURE_TX) return rec.port;
+    }
+    return -1;
+}
+
+/*
+ * Name:         replay_capture
+ * Purpose:      Plays one port's recorded output to a host at the recorded timing.
+ * Arguments:    cap: the capture.
+ *               port: the port id to play.
+ *               fd: the port to play it on.
+ *               sync: wait for the host's first byte and align with the first recorded RX.
+ *
+ * Output:       Progress and the comparison with the host's recorded input to stderr.
+ * Modifies:     None.
+ * Returns:      0 if the host sent what it sent during the capture, 1 otherwise.
+ * Assumptions:  fd came from open_serial_port() without a transmit queue, so
+ *               every write goes out when it is made.
+ *
+ * Bugs:         None known.
+ * Notes:        Writes are timed from their own deadlines, not from the end of
+ *               the previous write, so a late write does not delay the rest.
+ *               The largest lateness is reported.
+ */
+static int replay_capture(const Capture *cap, int port, int fd, bool sync) {
+    HostCheck check = { 0 };
+    size_t at = cap->header->header_size, first_tx = 0, tx_records = 0;
+    int64_t base = -1, first_rx = -1;
+    CaptureRecord rec;
+    const unsigned char *payload;
+
+    // One pass for the host's expected input and the start of the recording.
+    while (next_record(cap, &at, &rec, &payload)) {
+        if (rec.port != port) continue;
+        if (rec.dir == CAPTURE_TX) {
+            if (base < 0) { base = (int64_t)rec.t_ns; first_tx = at - sizeof(rec) - rec.len; }
+            tx_records++;
+        } else if (rec.dir == CAPTURE_RX) {
+            if (first_rx < 0) first_rx = (int64_t)rec.t_ns;
+            check.expect_len += rec.len;
+        }
+    }
+    if (base < 0) {
+        fprintf(stderr, "Port %s sent nothing during the capture\n", port_name(cap, (uint8_t)port));
+        return 1;
+    }
+    check.expect = malloc(check.expect_len ? check.expect_len : 1);
+    if (!check.expect) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t fill = 0;
+    at = cap->header->header_size;
+    while (next_record(cap, &at, &rec, &payload)) {
+        if (rec.port == port && rec.dir == CAPTURE_RX) {
+            memcpy(check.expect + fill, payload, rec.len);
+            fill += rec.len;
+        }
+    }
+
+    int64_t anchor;
+    if (sync && first_rx >= 0) {
+        fprintf(stderr, "Waiting for the host's first byte\n");
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        while (poll(&pfd, 1, -1) <= 0 || !(pfd.revents & POLLIN)) {
+            struct timespec pause = { 0, 10000000L }; // Hung up, wait for the host to come back.
+            nanosleep(&pause, NULL);
+        }
+        anchor = mono_ns();
+        base = first_rx; // The host's first byte is replay time first_rx.
+        read_host(fd, &check, 0);
+        first_tx = cap->header->header_size;
+    } else {
+        anchor = mono_ns();
+    }
+
+    fprintf(stderr, "Replaying %zu writes of port %s\n", tx_records, port_name(cap, (uint8_t)port));
+    size_t sent = 0, sent_bytes = 0;
+    int64_t worst_late = 0, last = 0;
+    at = first_tx;
+    while (next_record(cap, &at, &rec, &payload)) {
+        if (rec.port != port || rec.dir != CAPTURE_TX) continue;
+        int64_t offset = (int64_t)rec.t_ns - base;
+        if (offset < 0) continue; // Written before the host's first byte, already history.
+        int64_t deadline = anchor + offset;
+        wait_until(fd, &check, deadline, anchor);
+        if (check.hung_up) break;
+        int64_t late = mono_ns() - deadline;
+        serial_write_buf(fd, payload, rec.len);
+        if (late > worst_late) worst_late = late;
+        last = deadline;
+        sent++;
+        sent_bytes += rec.len;
+    }
+    int64_t linger_end = (last > anchor ? last : anchor) + LINGER_NS;
+    while (!check.hung_up && mono_ns() < linger_end && check.received < check.expect_len) wait_until(fd, &check, mono_ns() + 10000000LL, anchor);
+
+    if (check.hung_up) fprintf(stderr, "The port hung up %.6f s in\n", check.hung_up_ns / 1e9);
+    fprintf(stderr, "Sent %zu writes, %zu bytes, at most %.1f us late\n", sent, sent_bytes, worst_late / 1e3);
+    fprintf(stderr, "The host sent %zu bytes, %zu during the capture", check.received, check.expect_len);
+    bool same = !check.diverged && check.received == check.expect_len;
+    if (check.diverged) {
+        fprintf(stderr, ", first difference at byte %zu, %.6f s in\n", check.matched, check.diverged_ns / 1e9);
+    } else {
+        fprintf(stderr, same ? ", the same bytes\n" : ", the same bytes as far as they went\n");
+    }
+    free(check.expect);
+    return same ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *want_port = NULL;
+    bool sync = false;
+    int out = 1;
+    for (int i = 1; i < argc; i++) { // Options may come anywhere, as for the emulators.
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) want_port = argv[++i];
+        else if (strncmp(argv[i], "--port=", 7) == 0) want_port = argv[i] + 7;
+        else if (strcmp(argv[i], "--sync") == 0) sync = true;
+        else argv[out++] = argv[i];
+    }
+    argc = out;
+
+    Capture cap;
+    if (strcmp(argv[1], "dump") == 0 && argc == 3) {
+        if (open_capture(&cap, argv[2]) != 0) return 1;
+        return dump_capture(&cap);
+    }
+    if (strcmp(argv[1], "replay") != 0 || argc < 4 || argc > 6) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (open_capture(&cap, argv[2]) != 0) return 1;
+    int port = find_port(&cap, want_port);
+    if (port < 0) {
+        fprintf(stderr, "%s: no port %s in %s\n", argv[0], want_port ? want_port : "with output", argv[2]);
+        return 1;
+    }
+
+    const char *device = argv[3];
+    const char *baud = argc >= 5 ? argv[4] : DEFAULT_BAUD;
+    SerialMode mode = argc >= 6 ? get_mode(argv[5]) : SERIAL_RS422;
+    int fd = open_serial_port(device, get_baud_rate(baud), mode);
+    if (fd < 0) return 1;
+
+    int ret = replay_capture(&cap, port, fd, sync);
+    close_serial_port(fd);
+    serial_utils_cleanup();
+    return ret;
+}
@@ -0,0 +1,87 @@
+/*
+ * File:     personality_hc2a.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Rotronic HC2A-S3 HygroClip2 personality for wxsensord.
+ *           A purely polled sensor: {F00RDD} (or {F00RDD with a checksum) is
+ *           answered with the next line of the data file, as rh_temp/tmp_rh_listen.c.
+ *           On a bus the two digits after F are the probe address, 00-99.
+ *
+ * Mods:     14/10/2026 Probe addresses for bus operation, {Fnn RDD reaches probe nn.
+ *           14/10/2026 A wxstate:// data file answers from the shared weather state.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "wxsensord.h"
+#include "console_utils.h"
+
+#define HC2A_MAX_ADDRESS 99
+
+extern const char *program_name;
+
+/*
+ * Name:         hc2a_line_address
+ * Purpose:      Reads the probe address from a {FnnRDD request.
+ * Arguments:    line: the received command.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The address nn, or WX_ADDR_NONE for any other line.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static int hc2a_line_address(const char *line) {
+    if (line[0] != '{' || line[1] != 'F' || !isdigit((unsigned char)line[2]) || !isdigit((unsigned char)line[3]) ||
+        strncmp(line + 4, "RDD", 3) != 0) {
+        return WX_ADDR_NONE;
+    }
+    return (line[2] - '0') * 10 + (line[3] - '0');
+}
+
+static int hc2a_create(WxPort *port) {
+    if (replay_is_binary(port->replay)) { // HC2A-S3 lines are sent verbatim, there is nothing to pre-parse.
+        safe_console_error("%s: %s: hc2a replays text data files only\n", program_name, port->data_file);
+        return -1;
+    }
+    replay_set_sensor(port->replay, "rh_temp"); // A wxstate:// source renders HC2 answers.
+    int addr = port->address >= 0 ? port->address : 0;
+    if (addr > HC2A_MAX_ADDRESS || wx_port_set_address(port, addr) != 0) {
+        safe_console_error("%s: %s: hc2a address must be a free 00-99\n", program_name, port->device);
+        return -1;
+    }
+    port->state = NULL; // The HC2A-S3 has no configurable state.
+    return 0;
+}
+
+static void hc2a_on_command(WxPort *port, char *line) {
+    if (hc2a_line_address(line) != port->address) {
+        safe_console_error("%s: %s: Unknown command\n", program_name, port->device);
+        return;
+    }
+
+    char resp[REPLAY_LINE_MAX];
+    size_t len = replay_next_line(port->replay, resp, sizeof(resp) - 2);
+    if (len == 0) {
+        safe_console_error("ERR: Empty file\r\n");
+        return;
+    }
+    resp[len++] = '\r';
+    resp[len++] = '\n';
+    wx_port_write(port, resp, len);
+}
+
+const WxPersonality hc2a_personality = {
+    .name = "hc2a",
+    .create = hc2a_create,
+    .on_command = hc2a_on_command,
+    .next_interval_ns = NULL,
+    .on_tick = NULL,
+    .destroy = NULL,
+    .line_address = hc2a_line_address,
+};
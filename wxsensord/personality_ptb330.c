@@ -0,0 +1,312 @@
+/*
+ * File:     personality_ptb330.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Vaisala PTB330 barometer personality for wxsensord.
+ *           Supports the commands a data logger uses in service:
+ *           R, SEND, INTV, SMODE, OPEN, CLOSE, ADDR, FORM, UNIT, ECHO, VERS and SNUM.
+ *           Configuration and diagnostic commands are acknowledged on the console
+ *           only; use the standalone ptb330 emulator to exercise those.
+ *
+ * Mods:     14/10/2026 Commands are matched by command_lookup().
+ *           14/10/2026 Bus addressing: SEND aa and OPEN aa reach one unit, and a
+ *                      polled unit ignores commands not addressed to it.
+ *           14/10/2026 Each unit formats with its own compiled FORM.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "wxsensord.h"
+#include "ptb330_utils.h"
+#include "console_utils.h"
+#include "command_utils.h"
+
+#define MAX_MSG_LENGTH 512
+#define NS_PER_SEC 1000000000ULL
+
+extern const char *program_name;
+
+/*
+ * Name:         ptb330_send_record
+ * Purpose:      Reads the next data file record and sends it formatted by the FORM string.
+ * Arguments:    port: the port to send on.
+ *
+ * Output:       One record on the port.
+ * Modifies:     Advances the port's replay cursor.
+ * Returns:      None.
+ * Assumptions:  port->state is a ptb330_sensor.
+ *
+ * Bugs:         None known.
+ * Notes:        Each port has its own compiled FORM in its ptb330_sensor, so a
+ *               FORM sent to one unit on a bus leaves the others as they were.
+ *               Records of a .wxb cache are copied out instead of parsed.
+ */
+static void ptb330_send_record(WxPort *port) {
+    ParsedMessage msg;
+    const void *record = replay_next_record(port->replay);
+    if (record) {
+        memcpy(&msg, record, sizeof(msg));
+        ptb330_apply_sensor(&msg, port->state);
+    } else {
+        char line[REPLAY_LINE_MAX];
+        if (replay_next_line(port->replay, line, sizeof(line)) == 0) return;
+        ptb330_parse_message(line, &msg, port->state);
+    }
+
+    const ptb330_sensor *sensor = port->state;
+    char out[MAX_MSG_LENGTH];
+    build_dynamic_output(sensor->form, &msg, out, sizeof(out));
+    wx_port_printf(port, "%s\r\n", out);
+}
+
+// Shared by every PTB330 port, the trie is built on the first command.
+static CommandDispatch ptb330_dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_SPACE | CMD_TERM_QUERY | CMD_TERM_EQUALS);
+
+/*
+ * Name:         ptb330_parse_cmd
+ * Purpose:      Translates a received string to command enum and extracts its parameters.
+ * Arguments:    buf: the string to translate to a command enum.
+ * 				 cmd: the ParsedCommand struct to store values in.
+ *
+ * Output:       None.
+ * Modifies:     cmd.
+ * Returns:      The matching command, or CMD_UNKNOWN.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Same matching rule as parse_command() in ptb330/ptb330.c.
+ */
+static CommandType ptb330_parse_cmd(const char *buf, ParsedCommand *cmd) {
+    memset(cmd, 0, sizeof(ParsedCommand));
+
+    const char *args;
+    const CommandMap *m = command_lookup(&ptb330_dispatch, buf, &args);
+    if (m == NULL) {
+        cmd->type = CMD_UNKNOWN;
+        return CMD_UNKNOWN;
+    }
+    cmd->type = (CommandType)m->type;
+    command_copy_params(args, cmd->raw_params, sizeof(cmd->raw_params));
+    return cmd->type;
+}
+
+/*
+ * Name:         ptb330_set_interval
+ * Purpose:      Handles INTV xxx [s|min|h|d].
+ * Arguments:    sensor: the sensor to update.
+ * 				 params: the text after INTV.
+ *
+ * Output:       None.
+ * Modifies:     sensor->intv_data.
+ * Returns:      true if a value was parsed.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        intv_data.interval holds seconds, as in the standalone emulator.
+ */
+static bool ptb330_set_interval(ptb330_sensor *sensor, const char *params) {
+    int val = 0;
+    char unit_str[MAX_INTV_STR] = {0};
+    int found = sscanf(params, "%d %15s", &val, unit_str);
+    if (found < 1) return false;
+
+    if (val < 0) val = 0;
+    if (val > 255) val = 255; // 0-255 per Vaisala spec.
+
+    long multiplier = 1;
+    const char *label = "s";
+    switch (found == 2 ? tolower((unsigned char)unit_str[0]) : 's') {
+        case 'm': multiplier = SECONDS_IN_MIN;  label = "min"; break;
+        case 'h': multiplier = SECONDS_IN_HOUR; label = "h";   break;
+        case 'd': multiplier = SECONDS_IN_DAY;  label = "d";   break;
+        default: break;
+    }
+    sensor->intv_data.interval = (long)val * multiplier;
+    sensor->intv_data.multiplier = multiplier;
+    strncpy(sensor->intv_data.interval_units, label, sizeof(sensor->intv_data.interval_units) - 1);
+    sensor->intv_data.interval_units[sizeof(sensor->intv_data.interval_units) - 1] = '\0';
+    return true;
+}
+
+/*
+ * Name:         ptb330_line_address
+ * Purpose:      Tells the bus which PTB330 a command line is for.
+ * Arguments:    line: the received command.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The address of SEND aa and OPEN aa, WX_ADDR_ALL for the other
+ * 				 commands, WX_ADDR_NONE for a line that is not a PTB330 command.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static int ptb330_line_address(const char *line) {
+    ParsedCommand cmd;
+    CommandType type = ptb330_parse_cmd(line, &cmd);
+    if (type == CMD_UNKNOWN) return WX_ADDR_NONE;
+
+    long addr;
+    if ((type == CMD_SEND || type == CMD_OPEN) && command_arg_long(cmd.raw_params, 0, 255, &addr) == 0) return (int)addr;
+    return WX_ADDR_ALL;
+}
+
+static int ptb330_create(WxPort *port) {
+    if (replay_check_records(port->replay, "ptb330", sizeof(ParsedMessage)) != 0) {
+        safe_console_error("%s: %s was not converted for ptb330\n", program_name, port->data_file);
+        return -1;
+    }
+    ptb330_sensor *sensor = NULL;
+    if (init_ptb330_sensor(&sensor) != 0) return -1;
+    if (port->address > 255 || wx_port_set_address(port, port->address >= 0 ? port->address : sensor->address) != 0) {
+        safe_console_error("%s: %s: ptb330 address %d is out of range or in use\n", program_name, port->device,
+                           port->address >= 0 ? port->address : sensor->address);
+        free_ptb330_sensor(sensor);
+        return -1;
+    }
+    sensor->address = (uint8_t)port->address;
+    if (port->bus) sensor->mode = SMODE_POLL; // As a PTB330 is set up for a multi-drop line.
+    port->state = sensor;
+    return 0;
+}
+
+static void ptb330_on_command(WxPort *port, char *line) {
+    ptb330_sensor *sensor = port->state;
+    ParsedCommand cmd;
+
+    if (port->bus && sensor->mode == SMODE_POLL && !port->addressed) return; // Only SEND aa and OPEN aa wake a polled unit.
+    if (sensor->echo_enabled) wx_port_printf(port, "%s\r\n", line);
+
+    switch (ptb330_parse_cmd(line, &cmd)) {
+        case CMD_R:
+            sensor->mode = SMODE_RUN;
+            break;
+        case CMD_SEND:
+            ptb330_send_record(port);
+            break;
+        case CMD_INTV:
+            if (ptb330_set_interval(sensor, cmd.raw_params)) {
+                wx_port_printf(port, "Output interval %d %s\r\n", sensor->intv_data.interval, sensor->intv_data.interval_units);
+            }
+            break;
+        case CMD_SMODE:
+            if (strncasecmp(cmd.raw_params, "STOP", 4) == 0) sensor->mode = SMODE_STOP;
+            else if (strncasecmp(cmd.raw_params, "POLL", 4) == 0) sensor->mode = SMODE_POLL;
+            else if (strncasecmp(cmd.raw_params, "RUN", 3) == 0) sensor->mode = SMODE_RUN;
+            else if (strncasecmp(cmd.raw_params, "SEND", 4) == 0) sensor->mode = SMODE_SEND;
+            break;
+        case CMD_ADDR: {
+            long addr;
+            if (cmd.raw_params[0] != '\0' && command_arg_long(cmd.raw_params, 0, 255, &addr) == 0 &&
+                wx_port_set_address(port, (int)addr) == 0) {
+                sensor->address = (uint8_t)addr;
+            }
+            wx_port_printf(port, "Address : 2 ?  %hhu\r\n", sensor->address);
+            break;
+        }
+        case CMD_OPEN: {
+            long addr;
+            if (cmd.raw_params[0] == '\0' || command_arg_long(cmd.raw_params, 0, 255, &addr) != 0) {
+                safe_console_error("%s: %s: Open command received without a valid address\n", program_name, port->device);
+            } else if (sensor->mode == SMODE_POLL && sensor->address == addr) {
+                sensor->mode = SMODE_STOP;
+                wx_port_printf(port, "PTB330: %hhu line opened for operator commands\r\n", sensor->address);
+            }
+            break;
+        }
+        case CMD_CLOSE:
+            if (sensor->mode == SMODE_STOP) {
+                sensor->mode = SMODE_POLL;
+                wx_port_printf(port, "line closed\r\n");
+            }
+            break;
+        case CMD_FORM:
+            if (cmd.raw_params[0] == '\0' || (cmd.raw_params[0] == '?' && cmd.raw_params[1] == '\0')) {
+                wx_port_printf(port, "Output format : %s\r\n", sensor->format_string);
+            } else if (cmd.raw_params[0] != '?') {
+                strncpy(sensor->format_string, cmd.raw_params, MAX_FORM_STR - 1);
+                sensor->format_string[MAX_FORM_STR - 1] = '\0';
+                parse_form_string(sensor->form, cmd.raw_params);
+            }
+            break;
+        case CMD_UNIT: {
+            char *sptr;
+            char *first = strtok_r(cmd.raw_params, " \t", &sptr);
+            char *second = strtok_r(NULL, " \t", &sptr);
+            const char *label = second ? second : first;
+            if (label && label[0] != '?') {
+                for (size_t j = 0; j < sizeof(unit_table) / sizeof(UnitConversion); j++) {
+                    if (strcasecmp(label, unit_table[j].label) == 0) {
+                        sensor->units = unit_table[j].unit;
+                        break;
+                    }
+                }
+            }
+            wx_port_printf(port, "Unit: %s\r\n", get_unit_str(sensor->units));
+            break;
+        }
+        case CMD_ECHO:
+            if (strncasecmp(cmd.raw_params, "ON", 2) == 0) sensor->echo_enabled = true;
+            else if (strncasecmp(cmd.raw_params, "OFF", 3) == 0) sensor->echo_enabled = false;
+            wx_port_printf(port, "Echo\t: %s\r\n", sensor->echo_enabled ? "ON" : "OFF");
+            break;
+        case CMD_VERS:
+            wx_port_printf(port, "PTB330 / %s\r\n", sensor->software_version);
+            break;
+        case CMD_SNUM:
+            wx_port_printf(port, "PTB330 Serial Numbers:\n\tSensor: %s\n\t%s %s\n\t%s %s\n\t%s %s\r\n",
+                           sensor->serial_number,
+                           "Module 1:", sensor->module_one.serial_number,
+                           "Module 2:", sensor->module_two.serial_number,
+                           "Module 3:", sensor->module_three.serial_number);
+            break;
+        case CMD_UNKNOWN:
+            safe_console_error("%s: %s: Unknown or Bad Command:\n", program_name, port->device);
+            break;
+        default:
+            safe_console_error("%s: %s: command not supported by wxsensord\n", program_name, port->device);
+            break;
+    }
+}
+
+/*
+ * Name:         ptb330_next_interval_ns
+ * Purpose:      Reports the RUN mode output interval to the host scheduler.
+ * Arguments:    port: the port being scheduled.
+ *
+ * Returns:      The interval in nanoseconds, 0 if the sensor is not in RUN mode.
+ * Notes:        INTV 0 means "as fast as possible" on the real sensor, it is held
+ *               to one second here, the fastest the data files are recorded at.
+ */
+static uint64_t ptb330_next_interval_ns(WxPort *port) {
+    ptb330_sensor *sensor = port->state;
+    if (sensor->mode != SMODE_RUN) return 0;
+    long secs = sensor->intv_data.interval > 0 ? sensor->intv_data.interval : 1;
+    return (uint64_t)secs * NS_PER_SEC;
+}
+
+static void ptb330_on_tick(WxPort *port) {
+    ptb330_sensor *sensor = port->state;
+    if (sensor->mode == SMODE_RUN) ptb330_send_record(port);
+}
+
+static void ptb330_destroy(WxPort *port) {
+    free_ptb330_sensor(port->state);
+    port->state = NULL;
+}
+
+const WxPersonality ptb330_personality = {
+    .name = "ptb330",
+    .create = ptb330_create,
+    .on_command = ptb330_on_command,
+    .next_interval_ns = ptb330_next_interval_ns,
+    .on_tick = ptb330_on_tick,
+    .destroy = ptb330_destroy,
+    .line_address = ptb330_line_address,
+};
@@ -0,0 +1,179 @@
+/*
+ * File:     personality_wind.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Gill WindObserver 75 personality for wxsensord.
+ *           Mirrors the command set of wind/windobserver75.c:
+ *            - ?      enable continuous output
+ *            - !      disable continuous output (polled)
+ *            - <A-Z>  poll for a single record
+ *            - &      report the unit identifier
+ *            - *      configuration mode (accepted, ignored)
+ *
+ * Mods:     14/10/2026 Commands are matched by command_lookup().
+ *           14/10/2026 Bus addressing: a unit answers polls for its own letter only,
+ *                      and starts polled when on a bus.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "wxsensord.h"
+#include "windobserver75_utils.h"
+#include "crc_utils.h"
+#include "console_utils.h"
+#include "command_utils.h"
+
+#define MAX_MSG_LENGTH 512
+
+extern const char *program_name;
+
+/*
+ * Name:         wind_send_record
+ * Purpose:      Reads the next data file record and sends it as a polar frame.
+ * Arguments:    port: the port to send on.
+ *
+ * Output:       One framed record on the port.
+ * Modifies:     Advances the port's replay cursor.
+ * Returns:      None.
+ * Assumptions:  port->state is a WO75_sensor.
+ *
+ * Bugs:         None known.
+ * Notes:        Records of a .wxb cache are copied out instead of parsed.
+ */
+static void wind_send_record(WxPort *port) {
+    WO75_sensor *sensor = port->state;
+    ParsedMessage msg;
+    const void *record = replay_next_record(port->replay);
+    if (record) {
+        memcpy(&msg, record, sizeof(msg));
+        msg.msg_units = sensor->units;
+    } else {
+        char line[REPLAY_LINE_MAX];
+        if (replay_next_line(port->replay, line, sizeof(line)) == 0) return;
+        WO75_parse_message(line, &msg, sensor->units);
+    }
+    if (port->bus) msg.msg_address = sensor->address; // The data file was recorded from one unit.
+
+    char frame[MAX_MSG_LENGTH];
+    int len = WO75_format_frame(&msg, frame, sizeof(frame));
+    if (len > 0) wx_port_write(port, frame, (size_t)len);
+}
+
+// Shared by every wind port, the trie is built on the first command.
+static CommandDispatch wind_dispatch = COMMAND_DISPATCH_INITIALIZER(cmd_table, CMD_TABLE_SIZE, CMD_TERM_ALNUM);
+
+/*
+ * Name:         wind_parse_command
+ * Purpose:      Translates a received string to command enum.
+ * Arguments:    buf: the string to translate to a command enum.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The matching command, or CMD_UNKNOWN.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Same matching rule as parse_command() in wind/windobserver75.c.
+ */
+static CommandType wind_parse_command(const char *buf) {
+    const CommandMap *m = command_lookup(&wind_dispatch, buf, NULL);
+    return m ? (CommandType)m->type : CMD_UNKNOWN;
+}
+
+static int wind_create(WxPort *port) {
+    if (replay_check_records(port->replay, "wind", sizeof(ParsedMessage)) != 0) {
+        safe_console_error("%s: %s was not converted for wind\n", program_name, port->data_file);
+        return -1;
+    }
+    WO75_sensor *sensor = NULL;
+    if (init_WO75_sensor(&sensor) != 0) return -1;
+    int addr = port->address >= 0 ? port->address : sensor->address;
+    if (addr < 'A' || addr > 'Z' || wx_port_set_address(port, addr) != 0) {
+        safe_console_error("%s: %s: wind unit ID must be a free letter A-Z\n", program_name, port->device);
+        free(sensor);
+        return -1;
+    }
+    sensor->address = (char)addr;
+    if (port->bus) sensor->mode = SMODE_M4; // Continuous output from several units would collide.
+    port->state = sensor;
+    return 0;
+}
+
+/*
+ * Name:         wind_line_address
+ * Purpose:      Tells the bus which WindObserver a command line is for.
+ * Arguments:    line: the received command.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      The unit ID of an A-Z poll, WX_ADDR_ALL for the other commands,
+ *               WX_ADDR_NONE for a line that is not a WindObserver command.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The poll entries of cmd_table[] are the upper case letters, so
+ *               the matched name is the ID.
+ */
+static int wind_line_address(const char *line) {
+    const CommandMap *m = command_lookup(&wind_dispatch, line, NULL);
+    if (m == NULL) return WX_ADDR_NONE;
+    return m->type == CMD_POLL ? (unsigned char)m->name[0] : WX_ADDR_ALL;
+}
+
+static void wind_on_command(WxPort *port, char *line) {
+    WO75_sensor *sensor = port->state;
+
+    switch (wind_parse_command(line)) {
+        case CMD_ENABLE:
+            if (sensor->mode == SMODE_M4) sensor->mode = SMODE_M2;
+            if (sensor->mode == SMODE_M3) sensor->mode = SMODE_M1;
+            if (sensor->mode == SMODE_M14) sensor->mode = SMODE_M15;
+            break;
+        case CMD_POLL:
+            wind_send_record(port);
+            break;
+        case CMD_DISABLE:
+            if (sensor->mode == SMODE_M2) sensor->mode = SMODE_M4;
+            if (sensor->mode == SMODE_M1) sensor->mode = SMODE_M3;
+            if (sensor->mode == SMODE_M15) sensor->mode = SMODE_M14;
+            break;
+        case CMD_UNIT_ID: {
+            char unit_id_msg[2] = { sensor->address, '\0' };
+            wx_port_printf(port, "\x02%s\x03%02X\r\n", unit_id_msg, checksumXOR(unit_id_msg));
+            break;
+        }
+        case CMD_CONFIG:
+            break;
+        default:
+            wx_port_printf(port, "Unrecognized command\r\n");
+            break;
+    }
+}
+
+static uint64_t wind_next_interval_ns(WxPort *port) {
+    WO75_sensor *sensor = port->state;
+    return WO75_is_ready_to_send(sensor) ? (uint64_t)sensor->output_rate : 0;
+}
+
+static void wind_on_tick(WxPort *port) {
+    if (WO75_is_ready_to_send(port->state)) wind_send_record(port);
+}
+
+static void wind_destroy(WxPort *port) {
+    free(port->state);
+    port->state = NULL;
+}
+
+const WxPersonality wind_personality = {
+    .name = "wind",
+    .create = wind_create,
+    .on_command = wind_on_command,
+    .next_interval_ns = wind_next_interval_ns,
+    .on_tick = wind_on_tick,
+    .destroy = wind_destroy,
+    .line_address = wind_line_address,
+};
@@ -0,0 +1,1059 @@
+/*
+ * File:     wxsensord.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Single process host for several emulated sensors at once.
+ *           Each emulator in this repository runs three threads per serial port
+ *           (signal, receiver polling with usleep(), sender on a condition
+ *           variable). On a Pi driving a full station that is thirty-odd threads
+ *           waking every CPU_WAIT_USEC to find nothing to read.
+ *
+ *           wxsensord runs every port from one thread and one epoll set:
+ *            - serial fds are non-blocking, and read in bulk only when readable,
+ *            - each port owns a timerfd (CLOCK_MONOTONIC) for its output interval,
+ *            - SIGINT/SIGTERM/SIGQUIT arrive through a signalfd,
+ *            - output that the driver will not accept yet is queued per port and
+ *              flushed on EPOLLOUT, so a slow port never stalls the others.
+ *
+ *           The sensor protocols themselves live in personality_*.c modules which
+ *           implement the WxPersonality interface in wxsensord.h.
+ *
+ *           Ports given the same serial device share it as one multi-drop bus.
+ *           A received line goes to the unit it addresses through a table per
+ *           personality, and each unit's reply can be held back by its own
+ *           one-shot timerfd for a bus wait counted in characters, as the
+ *           DSP8100 B command.
+ *
+ * Usage:    wxsensord [--metrics PATH] [--capture PATH] <personality>[@<address>[,<wait>]]:<file_path>:<serial_device>[:<baud_rate>[:<RS422|RS485>]] ...
+ *           e.g. wxsensord wind:wind_data.txt:/dev/ttyUSB0:9600:RS422 \
+ *                          ptb330:ptb330_data.txt:/dev/ttyUSB1:9600 \
+ *                          hc2a:rh_data.txt:/dev/ttyUSB2:19200:RS485
+ *           A bus of three barometers and a wind sensor on one adapter:
+ *                wxsensord ptb330@1,4:p1.txt:/dev/ttyUSB0:9600 ptb330@2,4:p2.txt:/dev/ttyUSB0 \
+ *                          ptb330@3,4:p3.txt:/dev/ttyUSB0 wind@B:wind_data.txt:/dev/ttyUSB0
+ *           The serial device may be a transport, see transport_utils.h:
+ *                wxsensord ptb330:p1.txt:tcp://:4001:9600 wind:wind_data.txt:pty:/tmp/ttyWIND
+ *
+ * Mods:     14/10/2026 Ports sharing a serial device form a multi-drop bus with
+ *                      address routing and a per-unit reply wait.
+ *           14/10/2026 --metrics PATH serves frame, line and command counts for
+ *                      every port together on a UNIX socket.
+ *           14/10/2026 A port's device may be tcp://, rfc2217:// or pty[:link].
+ *           14/10/2026 Every port's data file is reloaded when it is replaced
+ *                      or on SIGHUP, without a restart.
+ *           14/10/2026 --capture PATH records every byte on every port with
+ *                      timestamps, see wxcap.
+ *           14/10/2026 USDT probes on command parsing and handling, see
+ *                      trace_utils.h and trace/.
+ *           14/10/2026 WX_FAULTS injects faults into every port's output, without
+ *                      delay faults, which would hold up the whole loop.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include "wxsensord.h"
+#include "console_utils.h"
+#include "command_utils.h"
+#include "metrics_utils.h"
+#include "capture_utils.h"
+#include "fault_utils.h"
+#include "trace_utils.h"
+#include "transport_utils.h"
+
+#define BAUD_RATE "9600"
+#define BITS_PER_CHAR 10 // Start, 8 data and stop bit.
+#define MAX_BUS_WAIT_CHARS 65535
+#define MAX_EPOLL_EVENTS 16
+#define MAX_SPEC_LEN 512
+
+// epoll_event.data.u64 carries the port index in the upper half and the fd kind in the lower.
+#define EV_KIND_SERIAL 1u
+#define EV_KIND_TIMER  2u
+#define EV_KIND_SIGNAL 3u
+#define EV_KIND_REPLY  4u
+#define EV_TAG(idx, kind) (((uint64_t)(idx) << 32) | (kind))
+#define EV_INDEX(tag) ((size_t)((tag) >> 32))
+#define EV_KIND(tag) ((uint32_t)((tag) & 0xFFFFFFFFu))
+
+const char *program_name = "wxsensord";
+
+static const WxPersonality *personalities[] = {
+    &wind_personality,
+    &ptb330_personality,
+    &hc2a_personality,
+};
+
+#define PERSONALITY_COUNT (sizeof(personalities) / sizeof(personalities[0]))
+
+typedef struct {
+    const WxPersonality *personality;
+    WxPort *by_address[WX_BUS_ADDRESSES]; // Units of this personality by address, for O(1) routing.
+} WxBusKind;
+
+struct WxBus {
+    WxPort *owner;                    // First port on the device, holds its fd, line reader and queue.
+    WxBusKind kinds[PERSONALITY_COUNT];
+    size_t kind_count;
+    WxPort **members;                 // Every unit on the bus, owner first.
+    size_t member_count;
+    unsigned long lines;              // Command lines received.
+    unsigned long unclaimed;          // Lines no unit was addressed by.
+};
+
+static WxPort *ports = NULL;
+static size_t port_count = 0;
+static int epoll_fd = -1;
+static int signal_fd = -1;
+
+/*
+ * Name:         find_personality
+ * Purpose:      Looks up a personality by the name given on the command line.
+ * Arguments:    name: the personality name, e.g. "wind".
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      Pointer to the personality, or NULL if it is not compiled in.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static const WxPersonality *find_personality(const char *name) {
+    for (size_t i = 0; i < PERSONALITY_COUNT; i++) {
+        if (strcmp(personalities[i]->name, name) == 0) return personalities[i];
+    }
+    return NULL;
+}
+
+/*
+ * Name:         update_epoll_interest
+ * Purpose:      Adds or removes EPOLLOUT on a serial fd depending on whether output is queued.
+ * Arguments:    port: the port whose interest set should be updated.
+ *
+ * Output:       Error message to stderr if epoll_ctl() fails.
+ * Modifies:     port->tx_waiting.
+ * Returns:      None.
+ * Assumptions:  port->fd is registered in epoll_fd.
+ *
+ * Bugs:         None known.
+ * Notes:        EPOLLOUT is only armed while there is something to flush, otherwise
+ *               a writable tty would wake the loop continuously.
+ */
+static void update_epoll_interest(WxPort *port) {
+    bool want_out = port->tx_len > 0;
+    if (want_out == port->tx_waiting) return;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.u64 = EV_TAG(port - ports, EV_KIND_SERIAL);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, port->fd, &ev) != 0) {
+        safe_console_error("%s: epoll_ctl(%s): %s\n", program_name, port->device, strerror(errno));
+        return;
+    }
+    port->tx_waiting = want_out;
+}
+
+/*
+ * Name:         flush_port
+ * Purpose:      Writes as much of the queued output as the serial driver will take.
+ * Arguments:    port: the port to flush.
+ *
+ * Output:       Error message to stderr on a write error.
+ * Modifies:     port->tx_buf, port->tx_len.
+ * Returns:      None.
+ * Assumptions:  port->fd is non-blocking.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void flush_port(WxPort *port) {
+    size_t off = 0;
+    while (off < port->tx_len) {
+        ssize_t n = write(port->fd, port->tx_buf + off, port->tx_len - off);
+        if (n > 0) {
+            capture_bytes(port->fd, CAPTURE_TX, port->tx_buf + off, (size_t)n);
+            off += (size_t)n;
+            metrics_count(METRIC_BYTES_WRITTEN, (uint64_t)n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                safe_console_error("%s: write(%s): %s\n", program_name, port->device, strerror(errno));
+                off = port->tx_len; // Drop the queue rather than spin on a dead port.
+            }
+            break;
+        }
+    }
+    if (off > 0) {
+        memmove(port->tx_buf, port->tx_buf + off, port->tx_len - off);
+        port->tx_len -= off;
+    }
+    update_epoll_interest(port);
+}
+
+/*
+ * Name:         queue_output
+ * Purpose:      Queues bytes for transmission on a port and attempts to send them immediately.
+ * Arguments:    port: the port owning the serial fd.
+ *               buf: bytes to send.
+ *               len: number of bytes.
+ *
+ * Output:       Warning to stderr if the queue overflows.
+ * Modifies:     port->tx_buf, port->tx_len, port->tx_dropped.
+ * Returns:      None.
+ * Assumptions:  Called from the event loop thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        Unlike safe_serial_write() there is no tcdrain(): the call returns as
+ *               soon as the kernel has the bytes. Anything it will not accept stays
+ *               queued and is sent from the EPOLLOUT handler. WX_FAULTS faults
+ *               are applied here, except delays.
+ */
+static void queue_output(WxPort *port, const char *buf, size_t len) {
+    char faulted[FAULT_MAX_MESSAGE];
+    if (fault_active()) {
+        struct iovec iov = { (void *)buf, len };
+        ssize_t n = fault_apply(port->fd, &iov, 1, len, faulted, NULL);
+        if (n == 0) return; // Dropped.
+        if (n > 0) {
+            buf = faulted;
+            len = (size_t)n;
+        }
+    }
+    if (port->tx_len + len > sizeof(port->tx_buf)) {
+        flush_port(port); // Make room if the driver has drained since the last attempt.
+    }
+    if (port->tx_len + len > sizeof(port->tx_buf)) {
+        port->tx_dropped += len;
+        safe_console_error("%s: %s output queue full, dropped %zu bytes\n", program_name, port->device, len);
+        return;
+    }
+    memcpy(port->tx_buf + port->tx_len, buf, len);
+    port->tx_len += len;
+    metrics_count(METRIC_FRAMES_SENT, 1);
+    flush_port(port);
+}
+
+/*
+ * Name:         hold_reply
+ * Purpose:      Keeps a reply back until the port's bus wait has run.
+ * Arguments:    port: the replying port.
+ *               buf: bytes to send.
+ *               len: number of bytes.
+ *
+ * Output:       Warning to stderr if the reply does not fit.
+ * Modifies:     port->reply_buf, port->reply_len, port->tx_dropped, the reply timer.
+ * Returns:      None.
+ * Assumptions:  port->reply_fd is open.
+ *
+ * Bugs:         None known.
+ * Notes:        The wait is timed from the first byte of the reply, so a reply
+ *               written in pieces still goes out in one burst.
+ */
+static void hold_reply(WxPort *port, const char *buf, size_t len) {
+    if (port->reply_len + len > sizeof(port->reply_buf)) {
+        port->tx_dropped += len;
+        safe_console_error("%s: %s reply too long, dropped %zu bytes\n", program_name, port->device, len);
+        return;
+    }
+    if (port->reply_len == 0) {
+        struct itimerspec its = {0};
+        its.it_value.tv_sec = (time_t)(port->reply_wait_ns / 1000000000ULL);
+        its.it_value.tv_nsec = (long)(port->reply_wait_ns % 1000000000ULL);
+        if (timerfd_settime(port->reply_fd, 0, &its, NULL) != 0) {
+            safe_console_error("%s: timerfd_settime(%s): %s\n", program_name, port->device, strerror(errno));
+            queue_output(port->bus ? port->bus->owner : port, buf, len); // Late is better than lost.
+            return;
+        }
+    }
+    memcpy(port->reply_buf + port->reply_len, buf, len);
+    port->reply_len += len;
+}
+
+/*
+ * Name:         handle_reply_timer
+ * Purpose:      Sends a reply whose bus wait has run.
+ * Arguments:    port: the port whose reply timer fired.
+ *
+ * Output:       The held reply, on the bus's queue.
+ * Modifies:     port->reply_len.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void handle_reply_timer(WxPort *port) {
+    uint64_t expirations;
+    if (read(port->reply_fd, &expirations, sizeof(expirations)) != (ssize_t)sizeof(expirations)) return;
+    if (port->reply_len == 0) return;
+    queue_output(port->bus ? port->bus->owner : port, port->reply_buf, port->reply_len);
+    port->reply_len = 0;
+}
+
+/*
+ * Name:         wx_port_write
+ * Purpose:      Sends bytes from a port's personality.
+ * Arguments:    port: the sending port.
+ *               buf: bytes to send.
+ *               len: number of bytes.
+ *
+ * Output:       See queue_output().
+ * Modifies:     The queue of the port, or of its bus.
+ * Returns:      None.
+ * Assumptions:  Called from the event loop thread only.
+ *
+ * Bugs:         None known.
+ * Notes:        A reply to a command waits out the port's bus wait first. Periodic
+ *               output from on_tick() is never held back.
+ */
+void wx_port_write(WxPort *port, const char *buf, size_t len) {
+    if (port->replying && port->reply_fd >= 0) {
+        hold_reply(port, buf, len);
+        return;
+    }
+    queue_output(port->bus ? port->bus->owner : port, buf, len);
+}
+
+/*
+ * Name:         wx_port_printf
+ * Purpose:      printf() style wrapper around wx_port_write().
+ * Arguments:    port: the destination port.
+ *               fmt: format string, followed by its arguments.
+ *
+ * Output:       Error message to stderr if formatting fails.
+ * Modifies:     See wx_port_write().
+ * Returns:      None.
+ * Assumptions:  The formatted string fits in MAX_SPEC_LEN * 2 bytes, longer output is truncated.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+void wx_port_printf(WxPort *port, const char *fmt, ...) {
+    char buf[MAX_SPEC_LEN * 2];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        safe_console_error("%s: output formatting failed on %s\n", program_name, port->device);
+        return;
+    }
+    if ((size_t)len >= sizeof(buf)) len = sizeof(buf) - 1;
+    wx_port_write(port, buf, (size_t)len);
+}
+
+/*
+ * Name:         wx_port_reschedule
+ * Purpose:      Re-arms a port's timerfd if its personality now wants a different interval.
+ * Arguments:    port: the port to reschedule.
+ *
+ * Output:       Error message to stderr if timerfd_settime() fails.
+ * Modifies:     port->armed_interval_ns and the timer.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Called by the host after every command and by personalities that
+ *               change mode from a tick. The timer is periodic, so no interval drift
+ *               accumulates between resets; an unchanged interval is left alone so
+ *               a stream of commands does not keep pushing the next output back.
+ */
+void wx_port_reschedule(WxPort *port) {
+    uint64_t interval = port->personality->next_interval_ns ? port->personality->next_interval_ns(port) : 0;
+    if (interval == port->armed_interval_ns || port->timer_fd < 0) return;
+
+    struct itimerspec its = {0};
+    its.it_interval.tv_sec = (time_t)(interval / 1000000000ULL);
+    its.it_interval.tv_nsec = (long)(interval % 1000000000ULL);
+    its.it_value = its.it_interval; // A zero it_value disarms the timer.
+
+    if (timerfd_settime(port->timer_fd, 0, &its, NULL) != 0) {
+        safe_console_error("%s: timerfd_settime(%s): %s\n", program_name, port->device, strerror(errno));
+        return;
+    }
+    port->armed_interval_ns = interval;
+}
+
+/*
+ * Name:         wx_port_set_address
+ * Purpose:      Sets the address a port answers to, and moves it in its bus's table.
+ * Arguments:    port: the port.
+ *               address: 0 to WX_BUS_ADDRESSES - 1.
+ *
+ * Output:       None.
+ * Modifies:     port->address, the bus's address table.
+ * Returns:      0 on success, -1 with errno EINVAL if the address is out of range
+ *               or EADDRINUSE if another unit of the personality has it.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Personalities call this from create() with the sensor's own
+ *               default address when none was given, and when a command such as
+ *               PTB330 ADDR changes it. Off a bus only port->address changes.
+ */
+int wx_port_set_address(WxPort *port, int address) {
+    if (address < 0 || address >= WX_BUS_ADDRESSES) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (port->bus) {
+        WxBusKind *kind = NULL;
+        for (size_t k = 0; k < port->bus->kind_count; k++) {
+            if (port->bus->kinds[k].personality == port->personality) kind = &port->bus->kinds[k];
+        }
+        if (!kind) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (kind->by_address[address] && kind->by_address[address] != port) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if (port->address >= 0 && kind->by_address[port->address] == port) kind->by_address[port->address] = NULL;
+        kind->by_address[address] = port;
+    }
+    port->address = address;
+    return 0;
+}
+
+/*
+ * Name:         deliver_line
+ * Purpose:      Hands one command line to a port's personality.
+ * Arguments:    port: the port that should handle it.
+ *               line: the received command, CR/LF removed.
+ *               addressed: the line named the port's address.
+ *
+ * Output:       None.
+ * Modifies:     line, which the personality may change.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The personality may have changed mode, so the timer is re-checked afterwards.
+ */
+static void deliver_line(WxPort *port, char *line, bool addressed) {
+    port->addressed = addressed;
+    port->replying = true;
+    port->personality->on_command(port, line);
+    WX_TRACE2(command_handled, port->fd, -1); // A personality parses and handles in one call.
+    port->replying = false;
+    port->addressed = false;
+    wx_port_reschedule(port);
+}
+
+/*
+ * Name:         bus_dispatch
+ * Purpose:      Routes a line received on a bus to the units it is for.
+ * Arguments:    bus: the bus it arrived on.
+ *               line: the received command, CR/LF removed.
+ *
+ * Output:       None.
+ * Modifies:     bus->lines, bus->unclaimed.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Each personality on the bus reads the address from the line once,
+ *               and an addressed line is one table lookup whatever the number of
+ *               units. A line for an address nobody has goes unanswered, as on a
+ *               real bus. Each unit gets its own copy, personalities may modify it.
+ */
+static void bus_dispatch(WxBus *bus, const char *line) {
+    char copy[SERIAL_LINE_MAX];
+    bool claimed = false;
+    bus->lines++;
+
+    for (size_t k = 0; k < bus->kind_count; k++) {
+        WxBusKind *kind = &bus->kinds[k];
+        int addr = kind->personality->line_address ? kind->personality->line_address(line) : WX_ADDR_ALL;
+        if (addr == WX_ADDR_NONE) continue;
+
+        if (addr >= 0) {
+            WxPort *unit = addr < WX_BUS_ADDRESSES ? kind->by_address[addr] : NULL;
+            if (unit) {
+                snprintf(copy, sizeof(copy), "%s", line);
+                deliver_line(unit, copy, true);
+                claimed = true;
+            }
+            continue;
+        }
+        for (size_t m = 0; m < bus->member_count; m++) {
+            if (bus->members[m]->personality != kind->personality) continue;
+            snprintf(copy, sizeof(copy), "%s", line);
+            deliver_line(bus->members[m], copy, false);
+            claimed = true;
+        }
+    }
+    if (!claimed) bus->unclaimed++;
+}
+
+/*
+ * Name:         on_port_line
+ * Purpose:      Serial reader callback, passes a complete line to the port's personality.
+ * Arguments:    line: the received command, CR/LF removed.
+ *               ctx: the WxPort the line arrived on.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        On a bus the line is routed by bus_dispatch() instead.
+ */
+static void on_port_line(char *line, void *ctx) {
+    WxPort *port = ctx;
+    if (port->bus) {
+        bus_dispatch(port->bus, line);
+    } else {
+        deliver_line(port, line, false);
+    }
+}
+
+/*
+ * Name:         handle_serial_input
+ * Purpose:      Drains a readable serial fd through the port's line reader.
+ * Arguments:    port: the readable port.
+ *
+ * Output:       Error message to stderr on a read error.
+ * Modifies:     port->rx.
+ * Returns:      None.
+ * Assumptions:  port->fd is non-blocking.
+ *
+ * Bugs:         None known.
+ * Notes:        Each line is handed on by on_port_line().
+ */
+static void handle_serial_input(WxPort *port) {
+    if (serial_reader_drain(&port->rx) < 0) {
+        safe_console_error("%s: read(%s): %s\n", program_name, port->device, strerror(errno));
+    }
+}
+
+/*
+ * Name:         handle_timer
+ * Purpose:      Acknowledges a port's timerfd and runs one output tick.
+ * Arguments:    port: the port whose timer fired.
+ *
+ * Output:       None.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        If the loop fell behind, the expiry count is greater than one. Only
+ *               one record is sent, matching the standalone sender threads which
+ *               never burst to catch up.
+ */
+static void handle_timer(WxPort *port) {
+    uint64_t expirations;
+    if (read(port->timer_fd, &expirations, sizeof(expirations)) != (ssize_t)sizeof(expirations)) return;
+    if (port->personality->on_tick) port->personality->on_tick(port);
+}
+
+/*
+ * Name:         parse_unit
+ * Purpose:      Parses the @<address>[,<wait>] part of a port specification.
+ * Arguments:    unit: the text after '@', modified in place.
+ *               address: set to the address.
+ *               wait_chars: set to the bus wait, 0 if none was given.
+ *
+ * Output:       None.
+ * Modifies:     unit, *address, *wait_chars.
+ * Returns:      0 on success, -1 if either value is malformed or out of range.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The address is 0-255, or a single letter for sensors addressed
+ *               by one (WindObserver A-Z), stored as its character code. The wait
+ *               is in characters, as the DSP8100 B command.
+ */
+static int parse_unit(char *unit, int *address, long *wait_chars) {
+    char *wait = strchr(unit, ',');
+    *wait_chars = 0;
+    if (wait) {
+        *wait++ = '\0';
+        if (command_arg_long(wait, 0, MAX_BUS_WAIT_CHARS, wait_chars) != 0) return -1;
+    }
+
+    long value;
+    if (isalpha((unsigned char)unit[0]) && unit[1] == '\0') {
+        *address = toupper((unsigned char)unit[0]);
+    } else if (command_arg_long(unit, 0, WX_BUS_ADDRESSES - 1, &value) == 0) {
+        *address = (int)value;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Name:         bus_add
+ * Purpose:      Adds a port to a bus and to its personality's address table.
+ * Arguments:    bus: the bus.
+ *               port: the port joining it.
+ *
+ * Output:       Error message to stderr.
+ * Modifies:     bus.
+ * Returns:      0 on success, -1 if the address is taken or memory runs out.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Addresses are per personality, a wind B and a ptb330 66 can share a bus.
+ */
+static int bus_add(WxBus *bus, WxPort *port) {
+    WxBusKind *kind = NULL;
+    for (size_t k = 0; k < bus->kind_count; k++) {
+        if (bus->kinds[k].personality == port->personality) kind = &bus->kinds[k];
+    }
+    if (!kind) {
+        kind = &bus->kinds[bus->kind_count++];
+        kind->personality = port->personality;
+    }
+    if (port->address >= 0) {
+        if (kind->by_address[port->address]) {
+            safe_console_error("%s: %s address %d is used twice on %s\n", program_name,
+                               port->personality->name, port->address, port->device);
+            return -1;
+        }
+        kind->by_address[port->address] = port;
+    }
+
+    WxPort **members = realloc(bus->members, (bus->member_count + 1) * sizeof(WxPort *));
+    if (!members) {
+        safe_console_error("%s: out of memory\n", program_name);
+        return -1;
+    }
+    bus->members = members;
+    bus->members[bus->member_count++] = port;
+    port->bus = bus;
+    return 0;
+}
+
+/*
+ * Name:         join_bus
+ * Purpose:      Puts a port on the bus of the port that opened its serial device.
+ * Arguments:    owner: the port holding the device.
+ *               port: the port joining it.
+ *
+ * Output:       Error message to stderr.
+ * Modifies:     owner->bus, created on the first join, port.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        port keeps fd -1, everything it sends goes through the owner's queue.
+ */
+static int join_bus(WxPort *owner, WxPort *port) {
+    if (!owner->bus) {
+        WxBus *bus = calloc(1, sizeof(WxBus));
+        if (!bus) {
+            safe_console_error("%s: out of memory\n", program_name);
+            return -1;
+        }
+        bus->owner = owner;
+        if (bus_add(bus, owner) != 0) {
+            free(bus);
+            return -1;
+        }
+    }
+    port->baud = owner->baud;
+    return bus_add(owner->bus, port);
+}
+
+/*
+ * Name:         next_field
+ * Purpose:      Splits the next ':' separated field off a port specification.
+ * Arguments:    rest: the unparsed remainder, advanced past the field.
+ *               device: the field is a serial device, which may hold colons of its own.
+ *
+ * Output:       None.
+ * Modifies:     Terminates the field in place, *rest.
+ * Returns:      The field, or NULL once the specification is used up.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        tcp://[host]:port and rfc2217://[host]:port keep their port, and
+ *               pty:/path keeps its link, which must be a path to tell it from a
+ *               baud rate.
+ */
+static char *next_field(char **rest, bool device) {
+    char *field = *rest;
+    if (!field || *field == '\0') return NULL;
+
+    char *from = field;
+    if (device && transport_kind(field) != TRANSPORT_TTY) {
+        if (transport_kind(field) == TRANSPORT_PTY) {
+            if (strncmp(field, "pty:/", 5) == 0) from = field + 4;
+        } else {
+            from = strstr(field, "://") + 3;
+            if (*from == '[' && strchr(from, ']')) from = strchr(from, ']');
+            from = strchr(from, ':'); // Between host and port.
+            if (from) from++;
+        }
+    }
+
+    char *colon = from ? strchr(from, ':') : NULL;
+    if (colon) {
+        *colon = '\0';
+        *rest = colon + 1;
+    } else {
+        *rest = NULL;
+    }
+    return field;
+}
+
+/*
+ * Name:         setup_port
+ * Purpose:      Parses one port specification and opens its data file, serial device
+ *               and timers.
+ * Arguments:    port: the port to populate.
+ *               spec: personality[@address[,wait]]:file_path:serial_device[:baud_rate[:mode]], modified in place.
+ *
+ * Output:       Error messages to stderr.
+ * Modifies:     port.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  Ports before this one are set up.
+ *
+ * Bugs:         None known.
+ * Notes:        The strings in port point into spec, which must outlive the port.
+ *               A device already opened by an earlier port is joined as a bus,
+ *               with that port's baud rate and mode. Devices are matched by the
+ *               path as given.
+ */
+static int setup_port(WxPort *port, char *spec) {
+    char *rest = spec;
+    char *name = next_field(&rest, false);
+    char *file = next_field(&rest, false);
+    char *device = next_field(&rest, true);
+    char *baud_str = next_field(&rest, false);
+    char *mode_str = next_field(&rest, false);
+
+    port->fd = -1;
+    port->timer_fd = -1;
+    port->reply_fd = -1;
+    port->address = -1;
+
+    if (!name || !file || !device) {
+        safe_console_error("%s: port specification must be <personality>:<file_path>:<serial_device>\n", program_name);
+        return -1;
+    }
+    long wait_chars = 0;
+    char *unit = strchr(name, '@');
+    if (unit) {
+        *unit++ = '\0';
+        if (parse_unit(unit, &port->address, &wait_chars) != 0) {
+            safe_console_error("%s: bad unit '%s', expected @<address 0-255 or A-Z>[,<wait 0-%d chars>]\n",
+                               program_name, unit, MAX_BUS_WAIT_CHARS);
+            return -1;
+        }
+    }
+    port->personality = find_personality(name);
+    if (!port->personality) {
+        safe_console_error("%s: unknown personality '%s'\n", program_name, name);
+        return -1;
+    }
+    if (is_valid_tty(device) != 0) {
+        safe_console_error("%s: invalid serial device '%s'\n", program_name, device);
+        return -1;
+    }
+    port->device = device;
+    port->data_file = file;
+
+    if (replay_open(&port->replay, file) != 0) {
+        safe_console_error("%s: Failed to open file %s: %s\n", program_name, file, strerror(errno));
+        return -1;
+    }
+
+    WxPort *owner = NULL;
+    for (WxPort *p = ports; p < port; p++) {
+        if (p->fd >= 0 && strcmp(p->device, device) == 0) owner = p;
+    }
+
+    if (owner) {
+        if (join_bus(owner, port) != 0) return -1;
+    } else {
+        speed_t baud = get_baud_rate(baud_str ? baud_str : BAUD_RATE);
+        SerialMode mode = mode_str ? get_mode(mode_str) : SERIAL_RS485;
+        port->fd = open_serial_port(device, baud, mode);
+        if (port->fd < 0) return -1;
+        port->baud = strtoul(baud_str ? baud_str : BAUD_RATE, NULL, 10);
+
+        int flags = fcntl(port->fd, F_GETFL);
+        if (flags < 0 || fcntl(port->fd, F_SETFL, (flags & ~O_SYNC) | O_NONBLOCK) != 0) {
+            safe_console_error("%s: fcntl(%s): %s\n", program_name, device, strerror(errno));
+            return -1;
+        }
+
+        serial_reader_init(&port->rx, port->fd, on_port_line, port);
+    }
+
+    port->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (port->timer_fd < 0) {
+        safe_console_error("%s: timerfd_create: %s\n", program_name, strerror(errno));
+        return -1;
+    }
+    if (wait_chars > 0 && port->baud > 0) {
+        port->reply_wait_ns = (uint64_t)wait_chars * BITS_PER_CHAR * 1000000000ULL / port->baud;
+        port->reply_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (port->reply_fd < 0) {
+            safe_console_error("%s: timerfd_create: %s\n", program_name, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Name:         start_port
+ * Purpose:      Creates a port's personality and registers the port in the epoll set.
+ * Arguments:    port: a port setup_port() has opened.
+ *
+ * Output:       Error messages to stderr.
+ * Modifies:     port.
+ * Returns:      0 on success, -1 on failure.
+ * Assumptions:  epoll_fd is open, every port is set up, so create() sees the finished bus.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static int start_port(WxPort *port) {
+    const char *name = port->personality->name;
+    if (port->personality->create(port) != 0) {
+        safe_console_error("%s: failed to initialize %s on %s\n", program_name, name, port->device);
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    if (port->fd >= 0) { // Bus members share their owner's fd.
+        ev.data.u64 = EV_TAG(port - ports, EV_KIND_SERIAL);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, port->fd, &ev) != 0) {
+            safe_console_error("%s: epoll_ctl(%s): %s\n", program_name, port->device, strerror(errno));
+            return -1;
+        }
+    }
+    ev.data.u64 = EV_TAG(port - ports, EV_KIND_TIMER);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, port->timer_fd, &ev) != 0) {
+        safe_console_error("%s: epoll_ctl(timerfd): %s\n", program_name, strerror(errno));
+        return -1;
+    }
+    if (port->reply_fd >= 0) {
+        ev.data.u64 = EV_TAG(port - ports, EV_KIND_REPLY);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, port->reply_fd, &ev) != 0) {
+            safe_console_error("%s: epoll_ctl(timerfd): %s\n", program_name, strerror(errno));
+            return -1;
+        }
+    }
+
+    wx_port_reschedule(port);
+    if (port->bus) {
+        safe_console_print("%s: %s@%d on %s bus replaying %s\n", program_name, name, port->address,
+                           port->device, port->data_file);
+    } else {
+        safe_console_print("%s: %s on %s replaying %s\n", program_name, name, port->device, port->data_file);
+    }
+    return 0;
+}
+
+/*
+ * Name:         cleanup_and_exit
+ * Purpose:      Release every port and host resource and exit.
+ * Arguments:    exit_code: passed to exit().
+ *
+ * Output:       None.
+ * Modifies:     Closes every fd and frees every port.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        Queued output is flushed once, best effort, before the ports close.
+ */
+void cleanup_and_exit(int exit_code) {
+    for (size_t i = 0; ports && i < port_count; i++) {
+        WxPort *port = &ports[i];
+        if (port->fd >= 0 && port->tx_len > 0) flush_port(port);
+        if (port->state && port->personality && port->personality->destroy) port->personality->destroy(port);
+        if (port->timer_fd >= 0) close(port->timer_fd);
+        if (port->reply_fd >= 0) close(port->reply_fd);
+        if (port->fd >= 0) close(port->fd);
+        if (port->replay) replay_close(port->replay);
+    }
+    capture_stop(); // Every port is closed, writes out the last records.
+    metrics_stop();
+    for (size_t i = 0; ports && i < port_count; i++) {
+        WxBus *bus = ports[i].bus;
+        if (!bus || bus->owner != &ports[i]) continue;
+        safe_console_print("%s: %s bus, %zu units, %lu lines, %lu unclaimed\n", program_name,
+                           ports[i].device, bus->member_count, bus->lines, bus->unclaimed);
+        free(bus->members);
+        free(bus);
+    }
+    free(ports);
+    ports = NULL;
+    if (signal_fd >= 0) close(signal_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    serial_utils_cleanup();
+    exit(exit_code);
+}
+
+/*
+ * Name:         print_usage
+ * Purpose:      Prints the command line syntax and the compiled-in personalities.
+ * Arguments:    None.
+ *
+ * Output:       Usage text to stderr.
+ * Modifies:     None.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:
+ */
+static void print_usage(void) {
+    safe_console_error("Usage: %s [--metrics PATH] [--capture PATH] <personality>[@<address>[,<wait>]]:<file_path>:<serial_device>[:<baud_rate>[:<RS422|RS485>]] ...\n", program_name);
+    safe_console_error("Personalities:");
+    for (size_t i = 0; i < PERSONALITY_COUNT; i++) safe_console_error(" %s", personalities[i]->name);
+    safe_console_error("\n");
+}
+
+/*
+ * Name:         Main
+ * Purpose:      Opens every port given on the command line and runs the event loop
+ *               until a termination signal arrives.
+ * Arguments:    argv[1..]: one port specification each, see Usage above.
+ *
+ * Output:       Prints to stderr the appropriate error messages if encountered.
+ * Modifies:     None.
+ * Returns:      0 on a clean shutdown, 1 if any port fails to open.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        A port that fails to open aborts start-up, a half-populated station
+ *               is more confusing on the data logger than a daemon that will not start.
+ */
+int main(int argc, char *argv[]) {
+    program_name = argv[0];
+
+    MetricsOptions metrics_opts;
+    if (metrics_parse_options(&argc, argv, &metrics_opts) != 0) return 1; // Strips --metrics.
+    CaptureOptions capture_opts;
+    if (capture_parse_options(&argc, argv, &capture_opts) != 0) return 1; // Strips --capture.
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    sigset_t block_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &block_set, NULL);
+
+    if (metrics_start(&metrics_opts, program_name) != 0) return 1;
+    if (capture_start(&capture_opts, program_name) != 0) return 1;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        safe_console_error("%s: epoll_create1: %s\n", program_name, strerror(errno));
+        cleanup_and_exit(1);
+    }
+
+    signal_fd = signalfd(-1, &block_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        safe_console_error("%s: signalfd: %s\n", program_name, strerror(errno));
+        cleanup_and_exit(1);
+    }
+    struct epoll_event sev = {0};
+    sev.events = EPOLLIN;
+    sev.data.u64 = EV_TAG(0, EV_KIND_SIGNAL);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &sev) != 0) {
+        safe_console_error("%s: epoll_ctl(signalfd): %s\n", program_name, strerror(errno));
+        cleanup_and_exit(1);
+    }
+
+    ports = calloc((size_t)(argc - 1), sizeof(WxPort));
+    if (!ports) {
+        safe_console_error("%s: out of memory\n", program_name);
+        cleanup_and_exit(1);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        WxPort *port = &ports[port_count++];
+        if (setup_port(port, argv[i]) != 0) {
+            print_usage();
+            cleanup_and_exit(1);
+        }
+    }
+    for (size_t i = 0; i < port_count; i++) {
+        if (start_port(&ports[i]) != 0) cleanup_and_exit(1);
+        if (replay_watch(ports[i].replay) != 0) cleanup_and_exit(1);
+    }
+
+    safe_console_print("Press 'ctrl-c' to quit.\n");
+
+    bool running = true;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            safe_console_error("%s: epoll_wait: %s\n", program_name, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+            uint32_t kind = EV_KIND(tag);
+
+            if (kind == EV_KIND_SIGNAL) {
+                struct signalfd_siginfo si;
+                if (read(signal_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    if (si.ssi_signo == SIGINT) {
+                        safe_console_print("\nReceived SIGINT (Ctrl+C), shutting down...\n");
+                    } else {
+                        safe_console_print("\nReceived signal %u, shutting down...\n", si.ssi_signo);
+                    }
+                    running = false;
+                }
+                continue;
+            }
+
+            WxPort *port = &ports[EV_INDEX(tag)];
+            if (kind == EV_KIND_TIMER) {
+                handle_timer(port);
+            } else if (kind == EV_KIND_REPLY) {
+                handle_reply_timer(port);
+            } else if (kind == EV_KIND_SERIAL) {
+                if (events[i].events & EPOLLIN) handle_serial_input(port);
+                if (events[i].events & EPOLLOUT) flush_port(port);
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                    // A hung up device stays readable-at-EOF forever, stop watching it rather than spin.
+                    safe_console_error("%s: %s hung up, port disabled\n", program_name, port->device);
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, port->fd, NULL);
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, port->timer_fd, NULL);
+                }
+            }
+        }
+    }
+
+    safe_console_print("Program %s terminated.\n", program_name);
+    cleanup_and_exit(0);
+    return 0; // We won't get here, but it quiets verbose warnings on a no return value.
+}
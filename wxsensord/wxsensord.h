@@ -0,0 +1,104 @@
+/*
+ * File:     wxsensord.h
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Interface between the wxsensord host loop and the sensor personalities
+ *           it runs. Each personality is one sensor protocol (WindObserver 75,
+ *           PTB330, HC2A-S3 ...) compiled as its own module, because the sensor
+ *           headers each define CommandType, ParsedMessage and cmd_table[] and
+ *           cannot share a translation unit.
+ *
+ *           The host owns every file descriptor. A personality never blocks,
+ *           never sleeps and never creates a thread: it is handed complete
+ *           command lines and timer ticks, and writes its replies through
+ *           wx_port_write() / wx_port_printf().
+ *
+ *           Several ports may name the same serial device, each with its own
+ *           personality@address, to emulate a loaded RS-485 bus. They share one
+ *           fd, line reader and transmit queue (the first port's), and keep their
+ *           own state, data cursor, output timer and reply delay.
+ *
+ * Mods:     14/10/2026 Ports sharing a serial device form a multi-drop bus.
+ *
+ */
+
+#ifndef WXSENSORD_H
+#define WXSENSORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "replay_utils.h"
+#include "serial_utils.h"
+
+#define WX_TX_BUF_SIZE 8192  // Bytes of output a port will queue while the serial driver is full.
+#define WX_REPLY_BUF_SIZE 1024 // Bytes of one port's reply held back while its bus wait runs.
+#define WX_BUS_ADDRESSES 256 // Addresses 0-255 per personality on one bus.
+#define WX_ADDR_ALL  (-1)    // line_address(): a command every unit of the personality hears.
+#define WX_ADDR_NONE (-2)    // line_address(): not a command of this personality.
+
+typedef struct WxPersonality WxPersonality;
+typedef struct WxBus WxBus;
+
+typedef struct {
+    const WxPersonality *personality; // The sensor protocol running on this port.
+    void *state;                      // Personality private state, owned by create()/destroy().
+    const char *device;               // Serial device path, for console messages.
+    const char *data_file;            // Data file path, for console messages.
+    ReplaySource *replay;             // Data file this port replays.
+
+    int fd;                           // Non-blocking serial file descriptor.
+    int timer_fd;                     // timerfd driving periodic output, -1 if not created.
+    uint64_t armed_interval_ns;       // Interval currently programmed into timer_fd, 0 = disarmed.
+
+    SerialLineReader rx;              // Assembles command lines from fd.
+
+    char tx_buf[WX_TX_BUF_SIZE];      // Output the serial driver has not accepted yet.
+    size_t tx_len;
+    bool tx_waiting;                  // EPOLLOUT is armed for this port.
+    unsigned long tx_dropped;         // Bytes discarded because tx_buf was full.
+
+    WxBus *bus;                       // Bus shared with other ports on the device, NULL if the port has it alone.
+    int address;                      // From personality@address, -1 if none was given.
+    bool addressed;                   // The command being handled named this port's address.
+    bool replying;                    // Inside on_command(), output waits out reply_wait_ns.
+    unsigned long baud;               // Line rate in bits per second, for character timing.
+    uint64_t reply_wait_ns;           // Bus wait before a reply is sent, 0 replies at once.
+    int reply_fd;                     // One-shot timerfd releasing reply_buf, -1 with no bus wait.
+    char reply_buf[WX_REPLY_BUF_SIZE];
+    size_t reply_len;
+} WxPort;
+
+struct WxPersonality {
+    const char *name;                 // Name used on the command line, e.g. "wind".
+
+    /*
+     * create:           Allocates and initializes port->state. Returns 0 on success, -1 on failure.
+     * on_command:       Called by the serial reader once per complete CR/LF terminated line. line may be modified.
+     * next_interval_ns: Returns the current periodic output interval, 0 if the sensor is polled.
+     * on_tick:          Called when the interval expires, at most once per wake-up.
+     * destroy:          Frees port->state.
+     * line_address:     Returns the address a command line is for, WX_ADDR_ALL or WX_ADDR_NONE.
+     *                   Only used on a bus, NULL hands every line to every unit.
+     */
+    int (*create)(WxPort *port);
+    void (*on_command)(WxPort *port, char *line);
+    uint64_t (*next_interval_ns)(WxPort *port);
+    void (*on_tick)(WxPort *port);
+    void (*destroy)(WxPort *port);
+    int (*line_address)(const char *line);
+};
+
+// Host services available to personalities.
+void wx_port_write(WxPort *port, const char *buf, size_t len) __attribute__((nonnull(1, 2)));
+void wx_port_printf(WxPort *port, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void wx_port_reschedule(WxPort *port) __attribute__((nonnull(1)));
+int wx_port_set_address(WxPort *port, int address) __attribute__((nonnull(1)));
+
+// Personalities compiled into the daemon.
+extern const WxPersonality wind_personality;
+extern const WxPersonality ptb330_personality;
+extern const WxPersonality hc2a_personality;
+
+#endif // WXSENSORD_H
@@ -0,0 +1,484 @@
+/*
+ * File:     wxstate.c
+ * Author:   Bruce Dearing
+ * Date:     14/10/2026
+ * Version:  1.0
+ * Purpose:  Weather state producer for a whole emulated station. Generates
+ *           one coherent weather state every period and publishes it in the
+ *           shared memory segment /NAME (see wxstate_utils.h), where every
+ *           emulator started with the data file wxstate://NAME renders its
+ *           own protocol from it.
+ *
+ *           The weather is a seeded model: a diurnal cycle of temperature,
+ *           humidity, pressure tide, wind and daylight, slow random walks on
+ *           each, and passing showers. With --storm the thunderstorm engine of
+ *           the lightning emulators runs here too: its flashes are published
+ *           for btd300 and tss928, and its cells bring the rain, the outflow
+ *           wind, the cooling and the pressure jump under them, so the rain
+ *           gauge tips when the lightning is overhead.
+ *
+ * Usage:    wxstate [name] [--seed N] [--period MS] [--speed N] [--unlink] [--storm SEED [--storm-rate N] ...]
+ *           wxstate
+ *           wxstate station --storm 7 --speed 60
+ *           ptb330 wxstate://station /dev/ttyUSB0 9600 RS232
+ *
+ *           name is the segment, default WXSTATE_NAME_DEFAULT. --period is the
+ *           time between states, default DEFAULT_PERIOD_MS. --speed runs the
+ *           weather N times faster than real time. The segment is left in
+ *           place on exit, for a restarted producer to carry on in, unless
+ *           --unlink is given.
+ *
+ * Mods:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include "console_utils.h"
+#include "schedule_utils.h"
+#include "storm_utils.h"
+#include "wxstate_utils.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define DEFAULT_PERIOD_MS 1000
+#define MIN_PERIOD_MS 100
+#define MAX_PERIOD_MS 60000
+#define MAX_SPEED 10000.0
+#define TREND_STEP_S 600             // Pressure history spacing, the trend spans TREND_STEPS of them.
+#define TREND_STEPS 18               // Three hours.
+#define SHOWER_EVERY_S (6.0 * 3600.0) // Mean time between showers.
+
+// The evolving weather, everything the next state is drawn from.
+typedef struct {
+    StormRng rng;
+    double t_s;                      // Simulated seconds since start.
+    int64_t start_ms;                // UTC at t_s 0.
+    double mean_temp_c;              // Daily mean, from the seed.
+    double prevailing_deg;           // Mean wind direction, from the seed.
+
+    // Random walks, each relaxing back to zero.
+    double temp_walk, spread_walk, pressure_walk, dir_walk, speed_walk, gust_walk, cover;
+
+    double shower_len_s;             // Length of the shower in progress, 0 for none.
+    double shower_left_s;
+    double shower_peak_mmh;
+
+    double trend_hist[TREND_STEPS];  // Pressure every TREND_STEP_S, oldest at trend_next.
+    unsigned trend_count;
+    unsigned trend_next;
+    int64_t trend_slot;
+
+    bool storm_on;
+    StormEngine storm;
+    WxState state;                   // The state published last.
+} WeatherModel;
+
+// Options of the producer.
+typedef struct {
+    const char *name;
+    uint64_t seed;
+    unsigned period_ms;
+    double speed;
+    bool unlink_segment;
+} ProducerOptions;
+
+// Globals
+static const char *program_name = "wxstate";
+static volatile sig_atomic_t terminate = 0;
+static SendSchedule sched = SCHEDULE_INITIALIZER;
+static StormFlash step_flashes[STORM_MAX_STEP_FLASHES];
+
+/*
+ * Name:         gauss
+ * Purpose:      Returns a standard normal number, Box-Muller.
+ */
+static double gauss(StormRng *rng) {
+    double u = 1.0 - storm_rng_uniform(rng); // (0, 1], log() stays finite.
+    double v = storm_rng_uniform(rng);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/*
+ * Name:         walk
+ * Purpose:      Advances an Ornstein-Uhlenbeck random walk.
+ * Arguments:    rng: the model's generator.
+ * 				 x: the walk, relaxing to 0.
+ * 				 dt: step in seconds.
+ * 				 tau: relaxation time in seconds.
+ * 				 sigma: standard deviation the walk settles at.
+ *
+ * Returns:      None.
+ */
+static void walk(StormRng *rng, double *x, double dt, double tau, double sigma) {
+    double a = exp(-dt / tau);
+    *x = *x * a + sigma * sqrt(1.0 - a * a) * gauss(rng);
+}
+
+/*
+ * Name:         parse_options
+ * Purpose:      Takes the producer's options off the command line.
+ * Arguments:    argc: the argument count, reduced by the options taken.
+ * 				 argv: the arguments, the rest are kept in order.
+ * 				 opts: receives the options, defaults for any not given.
+ *
+ * Output:       Error message to stderr on a bad value.
+ * Modifies:     argc, argv, opts.
+ * Returns:      0 on success, -1 on a bad value.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        --seed, --period and --speed take their value as the next
+ * 				 argument or after '='. Mirrors storm_parse_options().
+ */
+static int parse_options(int *argc, char **argv, ProducerOptions *opts) {
+    static const char *names[] = { "--seed", "--period", "--speed" };
+    opts->name = WXSTATE_NAME_DEFAULT;
+    opts->seed = 1;
+    opts->period_ms = DEFAULT_PERIOD_MS;
+    opts->speed = 1.0;
+    opts->unlink_segment = false;
+
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--unlink") == 0) {
+            opts->unlink_segment = true;
+            continue;
+        }
+        int which = -1;
+        const char *value = NULL;
+        for (int k = 0; k < (int)(sizeof(names) / sizeof(names[0])); k++) {
+            size_t len = strlen(names[k]);
+            if (strncmp(argv[i], names[k], len) != 0) continue;
+            if (argv[i][len] == '=') {
+                value = argv[i] + len + 1;
+            } else if (argv[i][len] == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+            } else {
+                continue;
+            }
+            which = k;
+            break;
+        }
+        if (which < 0) {
+            argv[out++] = argv[i]; // Not ours, keep it in order.
+            continue;
+        }
+
+        char *end = NULL;
+        if (which == 0) {
+            opts->seed = strtoull(value, &end, 0);
+            if (end == value || *end != '\0' || value[0] == '-') {
+                fprintf(stderr, "Invalid --seed '%s': the seed is a whole number\n", value);
+                return -1;
+            }
+        } else if (which == 1) {
+            long ms = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || ms < MIN_PERIOD_MS || ms > MAX_PERIOD_MS) {
+                fprintf(stderr, "Invalid --period '%s': use %d to %d milliseconds\n", value, MIN_PERIOD_MS, MAX_PERIOD_MS);
+                return -1;
+            }
+            opts->period_ms = (unsigned)ms;
+        } else {
+            double v = strtod(value, &end);
+            if (end == value || *end != '\0' || !(v > 0.0 && v <= MAX_SPEED)) {
+                fprintf(stderr, "Invalid --speed '%s': use a factor above 0, up to %g\n", value, MAX_SPEED);
+                return -1;
+            }
+            opts->speed = v;
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    if (*argc >= 2) opts->name = argv[1];
+    return 0;
+}
+
+/*
+ * Name:         model_init
+ * Purpose:      Seeds the weather and the storm.
+ * Arguments:    m: the model.
+ * 				 opts: the producer's options.
+ * 				 storm_cfg: from storm_parse_options().
+ *
+ * Output:       None.
+ * Modifies:     m.
+ * Returns:      None.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The climate is drawn from --seed, the storm from --storm, so
+ * 				 the same storm can pass through different days.
+ */
+static void model_init(WeatherModel *m, const ProducerOptions *opts, const StormConfig *storm_cfg) {
+    memset(m, 0, sizeof(*m));
+    storm_rng_seed(&m->rng, opts->seed);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    m->start_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    m->mean_temp_c = 4.0 + 16.0 * storm_rng_uniform(&m->rng);
+    m->prevailing_deg = 360.0 * storm_rng_uniform(&m->rng);
+    m->cover = 0.4;
+    m->trend_slot = -1;
+    m->storm_on = storm_cfg->enabled;
+    if (m->storm_on) storm_init(&m->storm, storm_cfg);
+}
+
+/*
+ * Name:         storm_weather
+ * Purpose:      Steps the storm and publishes its flashes into the state.
+ * Arguments:    m: the model.
+ * 				 dt: step in seconds.
+ * 				 rain: receives the rain rate under the cells, mm/h.
+ *
+ * Returns:      How close the nearest active cell is, 1 overhead falling to 0
+ * 				 with distance and as the cell decays.
+ */
+static double storm_weather(WeatherModel *m, double dt, double *rain) {
+    *rain = 0.0;
+    if (!m->storm_on) return 0.0;
+
+    size_t n = storm_step(&m->storm, dt, step_flashes, STORM_MAX_STEP_FLASHES);
+    for (size_t i = 0; i < n; i++) m->state.flashes[m->state.flash_count++ % WXSTATE_FLASHES] = step_flashes[i];
+    m->state.storm_time_s = m->storm.time_s;
+
+    double near = 0.0;
+    for (unsigned i = 0; i < m->storm.cfg.cells; i++) {
+        const StormCell *c = &m->storm.cells[i];
+        double activity = c->age_s < c->life_s ? sin(M_PI * c->age_s / c->life_s) : 0.0;
+        double d = hypot(c->x_km, c->y_km);
+        double core = d / (2.0 * c->spread_km);
+        *rain += 40.0 * activity * exp(-core * core);
+        near = fmax(near, activity * exp(-d / 20.0));
+    }
+    return near;
+}
+
+/*
+ * Name:         shower_weather
+ * Purpose:      Starts, runs and ends the showers of an ordinary day.
+ * Arguments:    m: the model.
+ * 				 dt: step in seconds.
+ *
+ * Returns:      The shower's rain rate, mm/h.
+ */
+static double shower_weather(WeatherModel *m, double dt) {
+    if (m->shower_left_s <= 0.0) {
+        if (storm_rng_uniform(&m->rng) >= dt / SHOWER_EVERY_S) return 0.0;
+        double u = storm_rng_uniform(&m->rng);
+        m->shower_len_s = 1800.0 + 5400.0 * storm_rng_uniform(&m->rng);
+        m->shower_left_s = m->shower_len_s;
+        m->shower_peak_mmh = 0.5 + 8.0 * u * u; // Mostly light.
+    }
+    m->shower_left_s -= dt;
+    return m->shower_peak_mmh * sin(M_PI * (1.0 - fmax(m->shower_left_s, 0.0) / m->shower_len_s));
+}
+
+/*
+ * Name:         model_step
+ * Purpose:      Advances the weather and fills in the next state.
+ * Arguments:    m: the model.
+ * 				 dt: step in simulated seconds.
+ * 				 period_ms: spacing of the states, recorded in them.
+ *
+ * Output:       None.
+ * Modifies:     m, m->state.
+ * Returns:      None.
+ * Assumptions:  model_init() was called.
+ *
+ * Bugs:         None known.
+ * Notes:        Solar time is taken as UTC. Humidity is from the dew point by
+ * 				 the Magnus formula, cloud base from the dew point depression
+ * 				 (125 m per degree), visibility falls with humidity and rain.
+ */
+static void model_step(WeatherModel *m, double dt, unsigned period_ms) {
+    WxState *s = &m->state;
+    m->t_s += dt;
+    s->time_ms = m->start_ms + (int64_t)llround(m->t_s * 1000.0);
+    s->step++;
+    s->period_ms = period_ms;
+    double hour = fmod((double)s->time_ms / 3600000.0, 24.0);
+    double day = cos(2.0 * M_PI * (hour - 15.0) / 24.0); // 1 at the afternoon maximum.
+
+    walk(&m->rng, &m->temp_walk, dt, 6 * 3600.0, 1.5);
+    walk(&m->rng, &m->spread_walk, dt, 6 * 3600.0, 1.5);
+    walk(&m->rng, &m->pressure_walk, dt, 36 * 3600.0, 6.0);
+    walk(&m->rng, &m->dir_walk, dt, 2 * 3600.0, 35.0);
+    walk(&m->rng, &m->speed_walk, dt, 3 * 3600.0, 1.5);
+    walk(&m->rng, &m->gust_walk, dt, 30.0, 0.7);
+    walk(&m->rng, &m->cover, dt, 4 * 3600.0, 0.35);
+
+    double storm_rain;
+    double near = storm_weather(m, dt, &storm_rain);
+    double rain = storm_rain + shower_weather(m, dt);
+
+    s->temperature_c = m->mean_temp_c + 5.0 * day + m->temp_walk - 4.0 * near - 0.2 * fmin(rain, 10.0);
+    double spread = fmax(6.0 + 3.0 * day + m->spread_walk, 0.0) * exp(-rain / 8.0);
+    s->dew_point_c = s->temperature_c - spread;
+    double es = exp(17.625 * s->temperature_c / (243.04 + s->temperature_c));
+    double e = exp(17.625 * s->dew_point_c / (243.04 + s->dew_point_c));
+    s->humidity_pct = fmin(100.0 * e / es, 100.0);
+
+    s->pressure_hpa = 1013.25 + m->pressure_walk + 0.6 * cos(4.0 * M_PI * (hour - 10.0) / 24.0) + 2.0 * near;
+    int64_t slot = (int64_t)(m->t_s / TREND_STEP_S);
+    if (slot != m->trend_slot) { // One history entry per TREND_STEP_S.
+        m->trend_slot = slot;
+        m->trend_hist[m->trend_next] = s->pressure_hpa;
+        m->trend_next = (m->trend_next + 1) % TREND_STEPS;
+        if (m->trend_count < TREND_STEPS) m->trend_count++;
+    }
+    double oldest = m->trend_hist[m->trend_count < TREND_STEPS ? 0 : m->trend_next];
+    s->trend_hpa = s->pressure_hpa - oldest;
+
+    double dir = fmod(m->prevailing_deg + m->dir_walk, 360.0);
+    s->wind_dir_deg = dir < 0.0 ? dir + 360.0 : dir;
+    double diurnal_wind = 1.0 + 0.5 * cos(2.0 * M_PI * (hour - 14.0) / 24.0); // Mixing peaks in the afternoon.
+    s->wind_speed_ms = fmax(3.5 * diurnal_wind + m->speed_walk + m->gust_walk + 10.0 * near, 0.0);
+
+    double vis = 40000.0 * pow(fmax(1.0 - s->humidity_pct / 100.0, 0.0), 0.7);
+    if (rain > 0.0) vis = fmax(vis, 10000.0) / (1.0 + 0.6 * pow(rain, 0.7)); // The rain, not the damp air, limits it.
+    else if (s->humidity_pct >= 99.0) vis = fmin(vis, 300.0);
+    s->visibility_m = fmin(fmax(vis, 50.0), 50000.0);
+
+    s->precip_rate_mmh = rain < 0.05 ? 0.0 : rain;
+    s->precip_total_mm += s->precip_rate_mmh * dt / 3600.0;
+
+    double cover = fmin(fmax(m->cover + 0.4, 0.0) + (rain > 0.0 ? 0.4 : 0.0) + near, 1.0);
+    s->cloud_layers = cover < 0.25 ? 0 : cover < 0.6 ? 1 : cover < 0.85 ? 2 : 3;
+    if (s->visibility_m < 200.0) s->cloud_layers = 0; // Obscured, the ceilometer reports vertical visibility.
+    s->cloud_base_m[0] = fmax(125.0 * spread, 30.0);
+    s->cloud_base_m[1] = s->cloud_base_m[0] + 1200.0 + 800.0 * cover;
+    s->cloud_base_m[2] = s->cloud_base_m[1] + 2500.0;
+
+    double sun = sin(M_PI * (hour - 6.0) / 12.0);
+    s->luminance_cdm2 = sun > 0.0 ? 25000.0 * sun * (1.0 - 0.75 * cover) : 0.0;
+}
+
+/*
+ * Name:         signal_thread
+ * Purpose:      Captures any kill signals, sets 'terminate' and wakes the schedule.
+ * Arguments:    None
+ *
+ * Output:       None.
+ * Modifies:     Changes terminate to true.
+ * Returns:      None.
+ * Assumptions:  The signals are blocked in every thread.
+ *
+ * Bugs:         None known.
+ * Notes:        None.
+ */
+static void *signal_thread(void *arg) {
+    (void)arg;
+    int sig;
+    sigset_t wait_set;
+    sigemptyset(&wait_set);
+    sigaddset(&wait_set, SIGINT);
+    sigaddset(&wait_set, SIGTERM);
+    sigaddset(&wait_set, SIGQUIT); // Ctrl+backslash
+
+    sigwait(&wait_set, &sig);     // Blocks until a signal arrives
+
+    terminate = 1;
+    schedule_wake(&sched);
+    return NULL;
+}
+
+/*
+ * Name:         Main
+ * Purpose:      Creates the segment and publishes a state every period until a signal.
+ *               i.e. wxstate [name] [--seed N] [--period MS] [--speed N] [--unlink] [--storm SEED]
+ *
+ * Arguments:    name: the segment, default WXSTATE_NAME_DEFAULT.
+ *
+ * Output:       The segment and one line per state at startup, a summary at exit.
+ * Modifies:     /dev/shm/NAME.
+ * Returns:      0 on a clean exit, 1 on a setup failure.
+ * Assumptions:  None.
+ *
+ * Bugs:         None known.
+ * Notes:        The first state is published before the schedule starts, so a
+ *               reader that attaches once the segment exists always has one.
+ */
+int main(int argc, char *argv[]) {
+    ProducerOptions opts;
+    StormConfig storm_cfg;
+    if (storm_parse_options(&argc, argv, &storm_cfg) != 0) return 1; // Strips --storm*.
+    if (parse_options(&argc, argv, &opts) != 0) return 1;
+    if (argc > 2) {
+        safe_console_error("Usage: %s [name] [--seed N] [--period MS] [--speed N] [--unlink] [--storm SEED] [--storm-rate N] [--storm-cells N]\n", argv[0]);
+        return 1;
+    }
+    program_name = argv[0];
+
+    static WeatherModel model;
+    model_init(&model, &opts, &storm_cfg);
+
+    WxStatePublisher pub;
+    if (wxstate_create(&pub, opts.name) != 0) {
+        safe_console_error("%s: cannot create the state segment /%s: %s\n", program_name, opts.name, strerror(errno));
+        return 1;
+    }
+    if (schedule_init(&sched, SCHEDULE_CATCH_UP) != 0) {
+        safe_console_error("%s: cannot create the schedule: %s\n", program_name, strerror(errno));
+        wxstate_destroy(&pub, opts.unlink_segment);
+        return 1;
+    }
+
+    sigset_t block_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &block_set, NULL);
+
+    pthread_t sig_thread;
+    if (pthread_create(&sig_thread, NULL, signal_thread, NULL) != 0) {
+        safe_console_error("Failed to create signal thread: %s\n", strerror(errno));
+        schedule_destroy(&sched);
+        wxstate_destroy(&pub, opts.unlink_segment);
+        return 1;
+    }
+
+    double dt = opts.period_ms / 1000.0 * opts.speed;
+    model_step(&model, dt, opts.period_ms);
+    wxstate_publish(&pub, &model.state);
+
+    safe_console_print("%s: publishing wxstate://%s every %u ms, seed %llu%s\n", program_name, opts.name, opts.period_ms,
+                       (unsigned long long)opts.seed, storm_cfg.enabled ? ", with a storm" : "");
+    safe_console_print("Press 'ctrl-c' to quit.\n");
+
+    schedule_start(&sched, (uint64_t)opts.period_ms * SCHED_NS_PER_MS);
+    while (!terminate) {
+        ScheduleEvent event = schedule_wait(&sched);
+        if (terminate) break;
+        if (event == SCHEDULE_ERROR) {
+            safe_console_error("%s: schedule failed: %s\n", program_name, strerror(errno));
+            break;
+        }
+        if (event != SCHEDULE_TICK) continue;
+        model_step(&model, dt, opts.period_ms);
+        wxstate_publish(&pub, &model.state);
+    }
+    schedule_stop(&sched);
+
+    if (!terminate) pthread_kill(sig_thread, SIGTERM); // A schedule failure, let the signal thread go.
+    pthread_join(sig_thread, NULL);
+
+    const WxState *s = &model.state;
+    safe_console_print("%s: %llu states, %.1f mm of rain, %llu flashes\n", program_name, (unsigned long long)s->step,
+                       s->precip_total_mm, (unsigned long long)s->flash_count);
+    schedule_report(&sched, program_name);
+    schedule_destroy(&sched);
+    wxstate_destroy(&pub, opts.unlink_segment);
+    return 0;
+}